@@ -11,5 +11,5 @@ if [ "$(uname -m)" = "aarch64" ]; then
     ../bin/ubpf_plugin "$@" --interpret
 else
     # Cross-compiled - use QEMU
-    qemu-aarch64 -L /usr/aarch64-linux-gnu ../bin/ubpf_plugin "$@" --interpret
+    qemu-aarch64 -cpu max -L /usr/aarch64-linux-gnu ../bin/ubpf_plugin "$@" --interpret
 fi
@@ -0,0 +1,316 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Benchmark profile-guided code layout in the JIT.
+ *
+ * The benchmark generates a loop whose body performs a series of checks. Each
+ * check is followed inline by its (never executed) error path, so without a
+ * profile every check is a taken branch over a block of dead code. The program
+ * is JIT compiled twice, once as-is and once after a training run in the
+ * interpreter has recorded a branch profile, and both versions are timed.
+ *
+ * On Linux, the branch misses and L1 instruction cache misses of each version
+ * are counted with perf_event_open(2) when the kernel allows it.
+ *
+ * Usage: ubpf_bench_branch_layout [--iterations N] [--repetitions N] [--checks N] [--cold-size N]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+using ubpf_vm_ptr = std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)>;
+
+struct benchmark_options
+{
+    uint64_t iterations = 1000000;
+    int repetitions = 11;
+    int checks = 16;
+    int cold_size = 12;
+};
+
+/*
+ * r1 points to the number of loop iterations. Every check is always satisfied,
+ * so the blocks that return an error code are never executed.
+ */
+static std::vector<ebpf_inst>
+generate_program(const benchmark_options& options)
+{
+    std::vector<ebpf_inst> program;
+    program.push_back({EBPF_OP_LDXDW, 2, 1, 0, 0});
+    program.push_back({EBPF_OP_MOV64_IMM, 0, 0, 0, 0});
+    program.push_back({EBPF_OP_MOV64_IMM, 3, 0, 0, 0});
+
+    size_t loop_head = program.size();
+    program.push_back({EBPF_OP_JGE_REG, 3, 2, 0, 0}); // Patched below.
+
+    for (int check = 0; check < options.checks; check++) {
+        program.push_back({EBPF_OP_MOV64_REG, 4, 3, 0, 0});
+        program.push_back({EBPF_OP_XOR64_IMM, 4, 0, 0, 0x9e37 * (check + 1)});
+        program.push_back({EBPF_OP_AND64_IMM, 4, 0, 0, 0xffff});
+        program.push_back({EBPF_OP_JLE_IMM, 4, 0, static_cast<int16_t>(options.cold_size + 2), 0xffff});
+        program.push_back({EBPF_OP_MOV64_IMM, 0, 0, 0, -(check + 1)});
+        for (int filler = 0; filler < options.cold_size; filler++) {
+            program.push_back({EBPF_OP_ADD64_IMM, 5, 0, 0, filler + 1});
+        }
+        program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+        program.push_back({EBPF_OP_ADD64_REG, 0, 4, 0, 0});
+    }
+
+    program.push_back({EBPF_OP_ADD64_IMM, 3, 0, 0, 1});
+    program.push_back({EBPF_OP_JA, 0, 0, static_cast<int16_t>(loop_head - program.size() - 1), 0});
+    program[loop_head].offset = static_cast<int16_t>(program.size() - loop_head - 1);
+    program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    return program;
+}
+
+#if defined(__linux__)
+struct perf_counter
+{
+    int fd = -1;
+
+    perf_counter(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    ~perf_counter()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    void
+    start()
+    {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    // Returns -1 if the counter is not available.
+    int64_t
+    stop()
+    {
+        uint64_t value = 0;
+        if (fd < 0) {
+            return -1;
+        }
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+            return -1;
+        }
+        return static_cast<int64_t>(value);
+    }
+};
+#endif
+
+struct measurement
+{
+    double ns_per_iteration;
+    double branch_misses_per_iteration;
+    double icache_misses_per_iteration;
+};
+
+static double
+median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static measurement
+measure(ubpf_jit_fn fn, const benchmark_options& options)
+{
+    std::vector<double> times;
+    std::vector<double> branch_misses;
+    std::vector<double> icache_misses;
+    uint64_t iterations = options.iterations;
+
+#if defined(__linux__)
+    perf_counter branch_miss_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    perf_counter icache_miss_counter(
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+
+    // Warm up.
+    fn(&iterations, sizeof(iterations));
+
+    for (int repetition = 0; repetition < options.repetitions; repetition++) {
+#if defined(__linux__)
+        branch_miss_counter.start();
+        icache_miss_counter.start();
+#endif
+        auto start = std::chrono::steady_clock::now();
+        fn(&iterations, sizeof(iterations));
+        auto end = std::chrono::steady_clock::now();
+#if defined(__linux__)
+        int64_t branch_miss_count = branch_miss_counter.stop();
+        int64_t icache_miss_count = icache_miss_counter.stop();
+#else
+        int64_t branch_miss_count = -1;
+        int64_t icache_miss_count = -1;
+#endif
+
+        times.push_back(std::chrono::duration<double, std::nano>(end - start).count() / options.iterations);
+        branch_misses.push_back(
+            branch_miss_count < 0 ? -1.0 : static_cast<double>(branch_miss_count) / options.iterations);
+        icache_misses.push_back(
+            icache_miss_count < 0 ? -1.0 : static_cast<double>(icache_miss_count) / options.iterations);
+    }
+
+    return {median(times), median(branch_misses), median(icache_misses)};
+}
+
+static void
+print_counter(double value)
+{
+    if (value < 0) {
+        printf(" %14s", "n/a");
+    } else {
+        printf(" %14.4f", value);
+    }
+}
+
+static bool
+parse_options(int argc, char** argv, benchmark_options& options)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        long long value = strtoll(argv[++i], nullptr, 0);
+        if (value <= 0) {
+            return false;
+        }
+        if (arg == "--iterations") {
+            options.iterations = static_cast<uint64_t>(value);
+        } else if (arg == "--repetitions") {
+            options.repetitions = static_cast<int>(value);
+        } else if (arg == "--checks") {
+            options.checks = static_cast<int>(value);
+        } else if (arg == "--cold-size") {
+            options.cold_size = static_cast<int>(value);
+        } else {
+            return false;
+        }
+    }
+    return options.cold_size + 2 <= INT16_MAX;
+}
+
+int
+main(int argc, char** argv)
+{
+    benchmark_options options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(
+            stderr,
+            "Usage: %s [--iterations N] [--repetitions N] [--checks N] [--cold-size N]\n",
+            argv[0]);
+        return 1;
+    }
+
+    std::vector<ebpf_inst> program = generate_program(options);
+    uint32_t program_size = static_cast<uint32_t>(program.size() * sizeof(ebpf_inst));
+    char* errmsg = nullptr;
+
+    ubpf_vm_ptr plain_vm(ubpf_create(), ubpf_destroy);
+    ubpf_vm_ptr guided_vm(ubpf_create(), ubpf_destroy);
+    if (!plain_vm || !guided_vm) {
+        fprintf(stderr, "Failed to create VMs\n");
+        return 1;
+    }
+    ubpf_toggle_branch_profiling(guided_vm.get(), true);
+
+    if (ubpf_load(plain_vm.get(), program.data(), program_size, &errmsg) != 0 ||
+        ubpf_load(guided_vm.get(), program.data(), program_size, &errmsg) != 0) {
+        fprintf(stderr, "Failed to load program: %s\n", errmsg);
+        free(errmsg);
+        return 1;
+    }
+
+    // Train the profile with a short run in the interpreter.
+    uint64_t training_iterations = 64;
+    uint64_t interpreted_result;
+    if (ubpf_exec(guided_vm.get(), &training_iterations, sizeof(training_iterations), &interpreted_result) != 0) {
+        fprintf(stderr, "Failed to run the training program\n");
+        return 1;
+    }
+
+    struct
+    {
+        const char* name;
+        ubpf_vm* vm;
+    } variants[] = {{"program order", plain_vm.get()}, {"profile-guided", guided_vm.get()}};
+
+    printf(
+        "%d checks with %d-instruction error paths, %llu iterations, median of %d runs\n",
+        options.checks,
+        options.cold_size + 2,
+        static_cast<unsigned long long>(options.iterations),
+        options.repetitions);
+    printf("%-16s %10s %14s %14s %14s\n", "layout", "code bytes", "ns/iter", "br-miss/iter", "L1i-miss/iter");
+
+    uint64_t expected = 0;
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        std::vector<uint8_t> code(1 << 20);
+        size_t code_size = code.size();
+        if (ubpf_translate(variants[i].vm, code.data(), &code_size, &errmsg) != 0) {
+            fprintf(stderr, "Failed to translate program: %s\n", errmsg);
+            free(errmsg);
+            return 1;
+        }
+
+        ubpf_jit_fn fn = ubpf_compile(variants[i].vm, &errmsg);
+        if (fn == nullptr) {
+            fprintf(stderr, "Failed to compile program: %s\n", errmsg);
+            free(errmsg);
+            return 1;
+        }
+
+        uint64_t iterations = options.iterations;
+        uint64_t result = fn(&iterations, sizeof(iterations));
+        if (i == 0) {
+            expected = result;
+        } else if (result != expected) {
+            fprintf(stderr, "The %s layout computed a different result\n", variants[i].name);
+            return 1;
+        }
+
+        measurement m = measure(fn, options);
+        printf("%-16s %10zu %14.4f", variants[i].name, code_size, m.ns_per_iteration);
+        print_counter(m.branch_misses_per_iteration);
+        print_counter(m.icache_misses_per_iteration);
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Benchmark the JIT of the host architecture against the interpreter.
+ *
+ * A few small loops are each run in the interpreter and as JIT compiled code
+ * and the time per loop iteration and the speedup of the JIT are reported.
+ * When uBPF is built with the LLVM JIT (UBPF_ENABLE_LLVM_JIT), the loops are
+ * also compiled in LlvmJitMode and its speedup over the JIT is reported:
+ *
+ *   alu     - multiplications, shifts and XORs on registers
+ *   divmod  - unsigned division and modulo by a register
+ *   memory  - 64-bit loads from the context
+ *   helper  - a call to a registered helper in every iteration
+ *
+ * The first 8 bytes of the context hold the number of iterations. This is the
+ * benchmark to run when bringing up a new JIT backend, e.g. under qemu-user:
+ *
+ *   qemu-mips64el -cpu I6400 -L /usr/mipsisa64r6el-linux-gnuabi64 bin/ubpf_bench_jit_speedup
+ *
+ * (timings under qemu compare the emulated code, not the processor).
+ *
+ * Usage: ubpf_bench_jit_speedup [--iterations N] [--repetitions N]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+using ubpf_vm_ptr = std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)>;
+
+struct benchmark_options
+{
+    uint64_t iterations = 1000000;
+    int repetitions = 5;
+};
+
+// The context: the number of iterations and the words the memory kernel sums.
+struct benchmark_context
+{
+    uint64_t iterations;
+    uint64_t words[32];
+};
+
+static uint64_t
+mix_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return (p0 ^ (p1 << 1)) + 1;
+}
+
+/*
+ * r6 is the number of iterations and r7 the loop counter; body() emits the loop
+ * body, which accumulates into r0 and must keep r6 and r7.
+ */
+static std::vector<ebpf_inst>
+generate_loop(const std::function<void(std::vector<ebpf_inst>&)>& body)
+{
+    std::vector<ebpf_inst> program;
+    program.push_back({EBPF_OP_LDXDW, 6, 1, 0, 0});
+    program.push_back({EBPF_OP_MOV64_REG, 9, 1, 0, 0});
+    program.push_back({EBPF_OP_MOV64_IMM, 0, 0, 0, 1});
+    program.push_back({EBPF_OP_MOV64_IMM, 7, 0, 0, 0});
+
+    size_t loop_head = program.size();
+    program.push_back({EBPF_OP_JGE_REG, 7, 6, 0, 0}); // Patched below.
+    body(program);
+    program.push_back({EBPF_OP_ADD64_IMM, 7, 0, 0, 1});
+    program.push_back({EBPF_OP_JA, 0, 0, static_cast<int16_t>(loop_head - program.size() - 1), 0});
+    program[loop_head].offset = static_cast<int16_t>(program.size() - loop_head - 1);
+    program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    return program;
+}
+
+static void
+alu_body(std::vector<ebpf_inst>& program)
+{
+    program.push_back({EBPF_OP_ADD64_REG, 0, 7, 0, 0});
+    program.push_back({EBPF_OP_MUL64_IMM, 0, 0, 0, 0x3779b1e5});
+    program.push_back({EBPF_OP_MOV64_REG, 2, 0, 0, 0});
+    program.push_back({EBPF_OP_RSH64_IMM, 2, 0, 0, 29});
+    program.push_back({EBPF_OP_XOR64_REG, 0, 2, 0, 0});
+    program.push_back({EBPF_OP_MOV64_REG, 3, 0, 0, 0});
+    program.push_back({EBPF_OP_LSH64_IMM, 3, 0, 0, 7});
+    program.push_back({EBPF_OP_ADD64_REG, 0, 3, 0, 0});
+}
+
+static void
+divmod_body(std::vector<ebpf_inst>& program)
+{
+    program.push_back({EBPF_OP_MOV64_REG, 2, 7, 0, 0});
+    program.push_back({EBPF_OP_ADD64_IMM, 2, 0, 0, 3});
+    program.push_back({EBPF_OP_MOV64_REG, 3, 0, 0, 0});
+    program.push_back({EBPF_OP_LSH64_IMM, 3, 0, 0, 20});
+    program.push_back({EBPF_OP_DIV64_REG, 3, 2, 0, 0});
+    program.push_back({EBPF_OP_MOV64_REG, 4, 7, 0, 0});
+    program.push_back({EBPF_OP_MOD64_REG, 4, 2, 0, 0});
+    program.push_back({EBPF_OP_ADD64_REG, 0, 3, 0, 0});
+    program.push_back({EBPF_OP_ADD64_REG, 0, 4, 0, 0});
+}
+
+static void
+memory_body(std::vector<ebpf_inst>& program)
+{
+    program.push_back({EBPF_OP_MOV64_REG, 2, 7, 0, 0});
+    program.push_back({EBPF_OP_AND64_IMM, 2, 0, 0, 31});
+    program.push_back({EBPF_OP_LSH64_IMM, 2, 0, 0, 3});
+    program.push_back({EBPF_OP_ADD64_REG, 2, 9, 0, 0});
+    program.push_back({EBPF_OP_LDXDW, 3, 2, offsetof(benchmark_context, words), 0});
+    program.push_back({EBPF_OP_ADD64_REG, 0, 3, 0, 0});
+    program.push_back({EBPF_OP_LDXW, 4, 9, offsetof(benchmark_context, words) + 4, 0});
+    program.push_back({EBPF_OP_XOR64_REG, 0, 4, 0, 0});
+}
+
+static void
+helper_body(std::vector<ebpf_inst>& program)
+{
+    program.push_back({EBPF_OP_MOV64_REG, 1, 0, 0, 0});
+    program.push_back({EBPF_OP_MOV64_REG, 2, 7, 0, 0});
+    program.push_back({EBPF_OP_CALL, 0, 0, 0, 1});
+}
+
+static double
+median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+// Returns the median time per iteration in ns, or a negative value if a run failed.
+static double
+measure(const std::function<bool(benchmark_context&, uint64_t&)>& run, const benchmark_options& options, uint64_t& result)
+{
+    benchmark_context context{};
+    for (size_t i = 0; i < sizeof(context.words) / sizeof(context.words[0]); i++) {
+        context.words[i] = i * 0x0101010101010101ULL;
+    }
+
+    // Warm up.
+    context.iterations = std::min<uint64_t>(options.iterations, 1000);
+    if (!run(context, result)) {
+        return -1;
+    }
+
+    std::vector<double> times;
+    context.iterations = options.iterations;
+    for (int repetition = 0; repetition < options.repetitions; repetition++) {
+        auto start = std::chrono::steady_clock::now();
+        bool succeeded = run(context, result);
+        auto end = std::chrono::steady_clock::now();
+        if (!succeeded) {
+            return -1;
+        }
+        times.push_back(std::chrono::duration<double, std::nano>(end - start).count() / options.iterations);
+    }
+    return median(times);
+}
+
+static bool
+parse_options(int argc, char** argv, benchmark_options& options)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        long long value = strtoll(argv[++i], nullptr, 0);
+        if (value <= 0) {
+            return false;
+        }
+        if (arg == "--iterations") {
+            options.iterations = static_cast<uint64_t>(value);
+        } else if (arg == "--repetitions") {
+            options.repetitions = static_cast<int>(value);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    benchmark_options options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr, "Usage: %s [--iterations N] [--repetitions N]\n", argv[0]);
+        return 1;
+    }
+
+    struct
+    {
+        const char* name;
+        void (*body)(std::vector<ebpf_inst>&);
+    } kernels[] = {{"alu", alu_body}, {"divmod", divmod_body}, {"memory", memory_body}, {"helper", helper_body}};
+
+    printf("%llu iterations, median of %d runs\n", static_cast<unsigned long long>(options.iterations), options.repetitions);
+    printf(
+        "%-10s %16s %16s %10s %16s %10s\n",
+        "kernel",
+        "interp ns/iter",
+        "jit ns/iter",
+        "speedup",
+        "llvm ns/iter",
+        "llvm/jit");
+
+    for (const auto& kernel : kernels) {
+        std::vector<ebpf_inst> program = generate_loop(kernel.body);
+        char* errmsg = nullptr;
+
+        // The template JIT and the LLVM JIT each keep their code in their own VM.
+        ubpf_vm_ptr vm(ubpf_create(), ubpf_destroy);
+        ubpf_vm_ptr llvm_vm(ubpf_create(), ubpf_destroy);
+        if (!vm || !llvm_vm) {
+            fprintf(stderr, "Failed to create VM\n");
+            return 1;
+        }
+        for (ubpf_vm* v : {vm.get(), llvm_vm.get()}) {
+            if (ubpf_register(v, 1, "mix", mix_helper) != 0) {
+                fprintf(stderr, "Failed to register helper\n");
+                return 1;
+            }
+            if (ubpf_load(v, program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &errmsg) !=
+                0) {
+                fprintf(stderr, "Failed to load program: %s\n", errmsg);
+                free(errmsg);
+                return 1;
+            }
+        }
+
+        ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+        if (fn == nullptr) {
+            fprintf(stderr, "Failed to compile program: %s\n", errmsg);
+            free(errmsg);
+            return 1;
+        }
+
+        // The LLVM JIT is optional; without it, its columns are left empty.
+        ubpf_jit_ex_fn llvm_fn = ubpf_compile_ex(llvm_vm.get(), &errmsg, LlvmJitMode);
+        free(errmsg);
+        errmsg = nullptr;
+
+        uint64_t interpreted_result = 0;
+        double interpreted = measure(
+            [&](benchmark_context& context, uint64_t& result) {
+                return ubpf_exec(vm.get(), &context, sizeof(context), &result) == 0;
+            },
+            options,
+            interpreted_result);
+        uint64_t jitted_result = 0;
+        double jitted = measure(
+            [&](benchmark_context& context, uint64_t& result) {
+                result = fn(&context, sizeof(context));
+                return true;
+            },
+            options,
+            jitted_result);
+
+        std::vector<uint8_t> stack(UBPF_EBPF_STACK_SIZE);
+        uint64_t llvm_result = 0;
+        double llvm = -1;
+        if (llvm_fn != nullptr) {
+            llvm = measure(
+                [&](benchmark_context& context, uint64_t& result) {
+                    result = llvm_fn(&context, sizeof(context), stack.data(), stack.size());
+                    return true;
+                },
+                options,
+                llvm_result);
+        }
+
+        if (interpreted < 0) {
+            fprintf(stderr, "The %s kernel failed in the interpreter\n", kernel.name);
+            return 1;
+        }
+        if (jitted_result != interpreted_result) {
+            fprintf(stderr, "The %s kernel computed a different result in the JIT\n", kernel.name);
+            return 1;
+        }
+        if (llvm_fn != nullptr && llvm_result != interpreted_result) {
+            fprintf(stderr, "The %s kernel computed a different result in the LLVM JIT\n", kernel.name);
+            return 1;
+        }
+        printf("%-10s %16.3f %16.3f %9.2fx", kernel.name, interpreted, jitted, interpreted / jitted);
+        if (llvm_fn != nullptr) {
+            printf(" %16.3f %9.2fx\n", llvm, jitted / llvm);
+        } else {
+            printf(" %16s %10s\n", "-", "-");
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Benchmark how running one VM on several threads at once scales.
+ *
+ * All threads run the same short program on the same VM, in the interpreter and
+ * as JIT compiled code, and the total number of executions per second and the
+ * scaling over a single thread are reported for each thread count. Executing a
+ * program does not write to the VM, so with enough cores the throughput should
+ * grow with the number of threads; a write to the VM on every execution shows up
+ * here as the threads fighting over its cache lines.
+ *
+ * The first 8 bytes of the context hold the number of loop iterations that one
+ * execution runs; keep it small so that the cost of entering the VM dominates.
+ *
+ * Usage: ubpf_bench_shared_vm_scaling [--executions N] [--iterations N] [--threads N]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+using ubpf_vm_ptr = std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)>;
+
+struct benchmark_options
+{
+    uint64_t executions = 1000000; // Per thread.
+    uint64_t iterations = 8;       // Per execution.
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+// r6 is the number of iterations and r7 the loop counter; r0 accumulates.
+static std::vector<ebpf_inst>
+generate_program()
+{
+    std::vector<ebpf_inst> program;
+    program.push_back({EBPF_OP_LDXDW, 6, 1, 0, 0});
+    program.push_back({EBPF_OP_MOV64_IMM, 0, 0, 0, 1});
+    program.push_back({EBPF_OP_MOV64_IMM, 7, 0, 0, 0});
+
+    size_t loop_head = program.size();
+    program.push_back({EBPF_OP_JGE_REG, 7, 6, 0, 0}); // Patched below.
+    program.push_back({EBPF_OP_ADD64_REG, 0, 7, 0, 0});
+    program.push_back({EBPF_OP_MUL64_IMM, 0, 0, 0, 0x3779b1e5});
+    program.push_back({EBPF_OP_MOV64_REG, 2, 0, 0, 0});
+    program.push_back({EBPF_OP_RSH64_IMM, 2, 0, 0, 29});
+    program.push_back({EBPF_OP_XOR64_REG, 0, 2, 0, 0});
+    program.push_back({EBPF_OP_ADD64_IMM, 7, 0, 0, 1});
+    program.push_back({EBPF_OP_JA, 0, 0, static_cast<int16_t>(loop_head - program.size() - 1), 0});
+    program[loop_head].offset = static_cast<int16_t>(program.size() - loop_head - 1);
+    program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    return program;
+}
+
+/*
+ * Runs `run` options.executions times on each of `threads` threads, which are released
+ * together. Returns the total executions per second, or a negative value if an execution
+ * failed or computed a result other than `expected`.
+ */
+static double
+measure(
+    const std::function<bool(uint64_t*, uint64_t&)>& run,
+    unsigned threads,
+    const benchmark_options& options,
+    uint64_t expected)
+{
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            // Each thread has a context of its own; only the VM is shared.
+            uint64_t context = options.iterations;
+            uint64_t result = 0;
+            ready++;
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            for (uint64_t i = 0; i < options.executions; i++) {
+                if (!run(&context, result) || result != expected) {
+                    failed = true;
+                    return;
+                }
+            }
+        });
+    }
+
+    while (ready.load() != threads) {
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    if (failed) {
+        return -1;
+    }
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return static_cast<double>(options.executions) * threads / seconds;
+}
+
+static bool
+parse_options(int argc, char** argv, benchmark_options& options)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        long long value = strtoll(argv[++i], nullptr, 0);
+        if (value <= 0) {
+            return false;
+        }
+        if (arg == "--executions") {
+            options.executions = static_cast<uint64_t>(value);
+        } else if (arg == "--iterations") {
+            options.iterations = static_cast<uint64_t>(value);
+        } else if (arg == "--threads") {
+            options.threads = static_cast<unsigned>(value);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    benchmark_options options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr, "Usage: %s [--executions N] [--iterations N] [--threads N]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<ebpf_inst> program = generate_program();
+    char* errmsg = nullptr;
+    ubpf_vm_ptr vm(ubpf_create(), ubpf_destroy);
+    if (!vm) {
+        fprintf(stderr, "Failed to create VM\n");
+        return 1;
+    }
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &errmsg) != 0) {
+        fprintf(stderr, "Failed to load program: %s\n", errmsg);
+        free(errmsg);
+        return 1;
+    }
+
+    // The JIT is optional; without it, its columns are left empty.
+    ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+    free(errmsg);
+    errmsg = nullptr;
+
+    uint64_t expected = 0;
+    uint64_t context = options.iterations;
+    if (ubpf_exec(vm.get(), &context, sizeof(context), &expected) != 0) {
+        fprintf(stderr, "The program failed in the interpreter\n");
+        return 1;
+    }
+
+    auto interpret = [&](uint64_t* context, uint64_t& result) {
+        return ubpf_exec(vm.get(), context, sizeof(*context), &result) == 0;
+    };
+    auto jit = [&](uint64_t* context, uint64_t& result) {
+        result = fn(context, sizeof(*context));
+        return true;
+    };
+
+    printf(
+        "%llu executions of %llu iterations per thread\n",
+        static_cast<unsigned long long>(options.executions),
+        static_cast<unsigned long long>(options.iterations));
+    printf("%-8s %16s %10s %16s %10s\n", "threads", "interp exec/s", "scaling", "jit exec/s", "scaling");
+
+    double interpreted_single = 0;
+    double jitted_single = 0;
+    // 1, 2, 4, ... threads, and finally options.threads.
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < options.threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(options.threads);
+
+    for (unsigned threads : thread_counts) {
+        double interpreted = measure(interpret, threads, options, expected);
+        if (interpreted < 0) {
+            fprintf(stderr, "The program failed in the interpreter on %u threads\n", threads);
+            return 1;
+        }
+        if (threads == 1) {
+            interpreted_single = interpreted;
+        }
+        printf("%-8u %16.0f %9.2fx", threads, interpreted, interpreted / interpreted_single);
+
+        if (fn == nullptr) {
+            printf(" %16s %10s\n", "-", "-");
+            continue;
+        }
+        double jitted = measure(jit, threads, options, expected);
+        if (jitted < 0) {
+            fprintf(stderr, "The program computed a different result in the JIT on %u threads\n", threads);
+            return 1;
+        }
+        if (threads == 1) {
+            jitted_single = jitted;
+        }
+        printf(" %16.0f %9.2fx\n", jitted, jitted / jitted_single);
+    }
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+#
+# Copyright (c) 2026-present, IO Visor Project
+# All rights reserved.
+#
+# This source code is licensed in accordance with the terms specified in
+# the LICENSE file found in the root directory of this source tree.
+#
+
+# Little-endian MIPS64 Release 6 (n64 ABI), the only MIPS target of the JIT.
+set(CMAKE_SYSTEM_NAME Linux)
+set(CMAKE_SYSTEM_PROCESSOR mips64)
+set(CMAKE_SYSTEM_VERSION 1)
+set(CMAKE_C_COMPILER /usr/bin/mipsisa64r6el-linux-gnuabi64-gcc)
+set(CMAKE_CXX_COMPILER /usr/bin/mipsisa64r6el-linux-gnuabi64-g++)
+set(CMAKE_FIND_ROOT_PATH_MODE_PROGRAM NEVER)
+set(CMAKE_FIND_ROOT_PATH_MODE_LIBRARY ONLY)
+set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE ONLY)
\ No newline at end of file
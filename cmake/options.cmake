@@ -15,6 +15,8 @@ endif()
 option(UBPF_DISABLE_RETPOLINES "Disable retpoline security on indirect calls and jumps")
 option(UBPF_ENABLE_INSTALL "Set to true to enable the install targets")
 option(UBPF_ENABLE_TESTS "Set to true to enable tests")
+option(UBPF_ENABLE_BENCHMARKS "Set to true to build the benchmarks")
+option(UBPF_ENABLE_LLVM_JIT "Set to true to build the optimizing LLVM JIT tier (LlvmJitMode) if LLVM is found")
 option(UBPF_ENABLE_PACKAGE "Set to true to enable packaging")
 option(UBPF_SKIP_EXTERNAL "Set to true to skip external projects")
 option(UBPF_INSTALL_GIT_HOOKS "Set to true to install git hooks" ON)
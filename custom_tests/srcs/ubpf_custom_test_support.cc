@@ -99,6 +99,84 @@ bool ubpf_setup_custom_test(ubpf_vm_up &vm,
     return true;
 }
 
+ubpf_vm_up ubpf_load_custom_test_program(const std::vector<ebpf_inst> &program,
+                                         std::string &error,
+                                         std::optional<custom_test_fixup_cb> configure_f)
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (vm == nullptr)
+    {
+        error = "Failed to create VM";
+        return vm;
+    }
+
+    if (configure_f.has_value())
+    {
+        if (!(configure_f.value())(vm, error)) {
+            vm.reset();
+            return vm;
+        }
+    }
+
+    char *error_s{nullptr};
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error_s) != 0)
+    {
+        error = "Failed to load program: " + std::string{error_s ? error_s : "(none)"};
+        free(error_s);
+        vm.reset();
+    }
+    return vm;
+}
+
+static uint64_t
+backend_test_add(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    return p0 + 2 * p1 + 3 * p2 + 4 * p3 + 5 * p4;
+}
+
+static uint64_t
+backend_test_unwind(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return p0;
+}
+
+static uint64_t
+backend_test_dispatcher(
+    uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, unsigned int index, void *cookie)
+{
+    UNREFERENCED_PARAMETER(cookie);
+    return index == 1 ? backend_test_add(p0, p1, p2, p3, p4) + 1000 : backend_test_unwind(p0, p1, p2, p3, p4);
+}
+
+static bool
+backend_test_dispatcher_validate(unsigned int index, const ubpf_vm *vm)
+{
+    UNREFERENCED_PARAMETER(vm);
+    return index == 1 || index == 2;
+}
+
+custom_test_fixup_cb ubpf_backend_test_helpers(bool use_dispatcher)
+{
+    return [use_dispatcher](ubpf_vm_up &vm, std::string &error) {
+        UNREFERENCED_PARAMETER(error);
+        if (use_dispatcher)
+        {
+            ubpf_register_external_dispatcher(vm.get(), backend_test_dispatcher, backend_test_dispatcher_validate);
+        }
+        else
+        {
+            ubpf_register(vm.get(), 1, "add", backend_test_add);
+            ubpf_register(vm.get(), 2, "unwind", backend_test_unwind);
+        }
+        ubpf_set_unwind_function_index(vm.get(), 2);
+        return true;
+    };
+}
+
 bool get_program_string(int argc, char **argv, std::string &program_string, std::string &error)
 {
     std::vector<std::string> args(argv, argv + argc);
@@ -137,3 +215,14 @@ bool get_program_string(int argc, char **argv, std::string &program_string, std:
 
     return true;
 }
+
+bool ubpf_native_jit_available()
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__) || defined(_M_ARM64) || \
+    (defined(__riscv) && __riscv_xlen == 64) || \
+    (defined(__mips__) && defined(__mips64) && __mips_isa_rev >= 6 && defined(__MIPSEL__))
+    return true;
+#else
+    return false;
+#endif
+}
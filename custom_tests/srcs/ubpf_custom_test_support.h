@@ -56,6 +56,30 @@ bool ubpf_setup_custom_test(ubpf_vm_up &vm,
                        ubpf_jit_fn &jit_fn,
                        std::string &error);
 
+/**
+ * @brief Create a VM and load a program into it.
+ *
+ * @param[in] program The eBPF program to load.
+ * @param[out] error A string containing the error message (if any) generated while loading the program.
+ * @param[in] configure_f A function that will be invoked on the VM before the program is loaded, to register
+ * helpers or set options.
+ * @return The VM, or an empty pointer if it could not be created, configured or loaded.
+ */
+ubpf_vm_up ubpf_load_custom_test_program(const std::vector<ebpf_inst> &program,
+                                         std::string &error,
+                                         std::optional<custom_test_fixup_cb> configure_f = std::nullopt);
+
+/**
+ * @brief Get a configure function for ubpf_load_custom_test_program() that registers the helpers of the tests
+ * that compare a backend with the interpreter: helper 1 returns a weighted sum of its arguments and helper 2,
+ * the unwind function, returns its first argument.
+ *
+ * @param[in] use_dispatcher Whether an external dispatcher calls the helpers instead, adding 1000 to the
+ * result of helper 1.
+ * @return The configure function.
+ */
+custom_test_fixup_cb ubpf_backend_test_helpers(bool use_dispatcher);
+
 /**
  * @brief Get the program string object from the command line arguments or stdin.
  *
@@ -67,3 +91,11 @@ bool ubpf_setup_custom_test(ubpf_vm_up &vm,
  * @return false If there was a problem obtaining the program string.
  */
 bool get_program_string(int argc, char **argv, std::string &program_string, std::string &error);
+
+/**
+ * @brief Whether programs can be JIT compiled to native code on this architecture.
+ *
+ * @return true If ubpf_compile has a native backend for this architecture.
+ * @return false If programs can only be interpreted.
+ */
+bool ubpf_native_jit_available();
@@ -0,0 +1,258 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the portable C backend (ubpf_translate_c/ubpf_compile_c/ubpf_exec_c).
+ * This test verifies that:
+ * 1. Programs translated to C, compiled with the system compiler and loaded at
+ *    runtime return the same results as the interpreter, for ALU operations,
+ *    memory accesses, atomics, helpers (indexed and through the dispatcher),
+ *    the unwind helper and local calls
+ * 2. Failed bounds checks and local calls nested too deeply make the compiled
+ *    program fail, as they make the interpreter fail
+ * 3. ubpf_translate_c rejects function names that are not C identifiers
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+struct aot_c_test_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+};
+
+static bool
+run_test_case(const aot_c_test_case& test, bool use_dispatcher)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error, ubpf_backend_test_helpers(use_dispatcher));
+    if (!vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+
+    char* errmsg = nullptr;
+    if (ubpf_compile_c(vm.get(), &errmsg) == nullptr) {
+        std::cerr << test.name << ": failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        return false;
+    }
+
+    for (uint64_t input : {0ULL, 1ULL, 7ULL, 0x80000000ULL, 0xfedcba9876543210ULL}) {
+        uint64_t memory[4] = {input, ~input, input * 3, 0};
+        uint64_t expected = 0;
+        int expected_status = ubpf_exec(vm.get(), memory, sizeof(memory), &expected);
+        uint64_t expected_memory[4];
+        memcpy(expected_memory, memory, sizeof(memory));
+
+        uint64_t compiled_memory[4] = {input, ~input, input * 3, 0};
+        uint64_t result = 0;
+        int status = ubpf_exec_c(vm.get(), compiled_memory, sizeof(compiled_memory), &result);
+        if (status != expected_status || (status == 0 && result != expected) ||
+            memcmp(compiled_memory, expected_memory, sizeof(memory)) != 0) {
+            std::cerr << test.name << (use_dispatcher ? " (dispatcher)" : "") << ": input 0x" << std::hex << input
+                      << " returned 0x" << result << " (status " << std::dec << status << ") but 0x" << std::hex
+                      << expected << " (status " << std::dec << expected_status << ") in the interpreter"
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+#if defined(_WIN32)
+    std::cout << "PASSED: compiling C translations at runtime is not supported on Windows" << std::endl;
+    return 0;
+#else
+    std::vector<aot_c_test_case> tests = {
+        {
+            "alu",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                {EBPF_OP_MUL64_IMM, 0, 0, 0, -3},
+                {EBPF_OP_MOV64_REG, 3, 2, 0, 0},
+                {EBPF_OP_ARSH64_IMM, 3, 0, 0, 7},
+                {EBPF_OP_XOR64_REG, 0, 3, 0, 0},
+                {EBPF_OP_MOV_REG, 4, 2, 0, 0},
+                {EBPF_OP_ADD_IMM, 4, 0, 0, -5},
+                {EBPF_OP_LSH_IMM, 4, 0, 0, 3},
+                {EBPF_OP_ARSH_IMM, 4, 0, 0, 1},
+                {EBPF_OP_ADD64_REG, 0, 4, 0, 0},
+                {EBPF_OP_MOV64_REG, 5, 2, 0, 0},
+                {EBPF_OP_DIV64_IMM, 5, 0, 1, -3},
+                {EBPF_OP_ADD64_REG, 0, 5, 0, 0},
+                {EBPF_OP_MOV64_REG, 5, 2, 0, 0},
+                {EBPF_OP_MOD_REG, 5, 2, 1, 0},
+                {EBPF_OP_ADD64_REG, 0, 5, 0, 0},
+                {EBPF_OP_MOV64_IMM, 6, 0, 0, 0},
+                {EBPF_OP_DIV64_REG, 2, 6, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_BE, 2, 0, 0, 32},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_BSWAP, 2, 0, 0, 64},
+                {EBPF_OP_XOR64_REG, 0, 2, 0, 0},
+                {EBPF_OP_MOV64_REG, 7, 0, 16, 0},
+                {EBPF_OP_ADD64_REG, 0, 7, 0, 0},
+                {EBPF_OP_NEG, 0, 0, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "jumps",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+                {EBPF_OP_JSLT_IMM, 2, 0, 1, 0},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 1},
+                {EBPF_OP_JGT32_IMM, 2, 0, 1, 6},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 2},
+                {EBPF_OP_JSET_IMM, 2, 0, 1, 1},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 4},
+                {EBPF_OP_JSGE32_IMM, 2, 0, 1, -1},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 8},
+                {EBPF_OP_JA32, 0, 0, 0, 1},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 16},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "memory and atomics",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_STXDW, 10, 2, -8, 0},
+                {EBPF_OP_STW, 10, 0, -16, -2},
+                {EBPF_OP_LDXWSX, 3, 10, -16, 0},
+                {EBPF_OP_MOV64_IMM, 4, 0, 0, 5},
+                {EBPF_OP_ATOMIC_STORE, 10, 4, -8, EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH},
+                {EBPF_OP_ATOMIC32_STORE, 1, 3, 8, EBPF_ALU_OP_XOR},
+                {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                {EBPF_OP_ATOMIC_STORE, 1, 3, 16, EBPF_ATOMIC_OP_CMPXCHG},
+                {EBPF_OP_MOV64_IMM, 5, 0, 0, 9},
+                {EBPF_OP_ATOMIC32_STORE, 1, 5, 24, EBPF_ATOMIC_OP_XCHG},
+                {EBPF_OP_LDXDW, 6, 10, -8, 0},
+                {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 4, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+                {EBPF_OP_STXB, 1, 0, 31, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "helpers and unwind",
+            {
+                {EBPF_OP_LDXDW, 6, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+                {EBPF_OP_MOV64_IMM, 2, 0, 0, 2},
+                {EBPF_OP_MOV64_IMM, 3, 0, 0, 3},
+                {EBPF_OP_MOV64_IMM, 4, 0, 0, 4},
+                {EBPF_OP_MOV64_IMM, 5, 0, 0, 5},
+                {EBPF_OP_CALL, 0, 0, 0, 1},
+                {EBPF_OP_MOV64_REG, 7, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+                {EBPF_OP_AND64_IMM, 1, 0, 0, 1},
+                {EBPF_OP_CALL, 0, 0, 0, 2},
+                {EBPF_OP_MOV64_REG, 0, 7, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "local calls",
+            {
+                {EBPF_OP_LDXDW, 1, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+                {EBPF_OP_STXDW, 10, 6, -8, 0},
+                {EBPF_OP_CALL, 0, 1, 0, 4},
+                {EBPF_OP_LDXDW, 2, 10, -8, 0},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+                {EBPF_OP_STXDW, 10, 6, -8, 0},
+                {EBPF_OP_MUL64_IMM, 1, 0, 0, 3},
+                {EBPF_OP_CALL, 0, 1, 0, 3},
+                {EBPF_OP_LDXDW, 2, 10, -8, 0},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 7},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "out of bounds",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_AND64_IMM, 2, 0, 0, 0x3f},
+                {EBPF_OP_LSH64_IMM, 2, 0, 0, 3},
+                {EBPF_OP_ADD64_REG, 2, 1, 0, 0},
+                {EBPF_OP_LDXDW, 0, 2, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "unbounded recursion",
+            {
+                {EBPF_OP_CALL, 0, 1, 0, -1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+    };
+
+    bool success = true;
+    for (const auto& test : tests) {
+        for (bool use_dispatcher : {false, true}) {
+            if (!run_test_case(test, use_dispatcher)) {
+                success = false;
+            }
+        }
+    }
+
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(tests[0].program, error, ubpf_backend_test_helpers(false));
+    if (!vm) {
+        std::cerr << error << std::endl;
+    }
+    char* source = nullptr;
+    char* errmsg = nullptr;
+    if (!vm || ubpf_translate_c(vm.get(), "filter", &source, &errmsg) != 0 ||
+        std::string(source).find("filter(") == std::string::npos) {
+        std::cerr << "Failed to translate a program to C: " << (errmsg ? errmsg : "(none)") << std::endl;
+        success = false;
+    }
+    free(source);
+    free(errmsg);
+    source = nullptr;
+    errmsg = nullptr;
+    if (vm && ubpf_translate_c(vm.get(), "1filter", &source, &errmsg) == 0) {
+        std::cerr << "Translated a program to C with an invalid function name" << std::endl;
+        success = false;
+    }
+    free(source);
+    free(errmsg);
+
+    std::cout << (success ? "PASSED" : "FAILED") << std::endl;
+    return success ? 0 : 1;
+#endif
+}
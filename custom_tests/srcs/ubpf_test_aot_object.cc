@@ -0,0 +1,316 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test ahead-of-time compilation to object files (ubpf_translate_c_ex with
+ * UBPF_C_HELPERS_SYMBOLS and ubpf_compile_c_object), as done by ubpf-aot.
+ * This test verifies that:
+ * 1. Two programs translated into one translation unit compile into a relocatable
+ *    object that defines a function per program and leaves the helpers undefined
+ * 2. The object does not link without the helpers
+ * 3. Once the object is linked against the helpers, each function returns what the
+ *    interpreter returns, including when the unwind helper stops the program
+ * 4. Helpers without a name that is a C identifier cannot be linked by name
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#include <unistd.h>
+#endif
+
+#if defined(__ELF__)
+#include <elf.h>
+#endif
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+// The helpers as the interpreter sees them and, below, as the linked object sees them.
+static uint64_t
+scale_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p3;
+    (void)p4;
+    return p0 * p1 + p2;
+}
+
+static uint64_t
+unwind_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return p0;
+}
+
+static const char helper_source[] =
+    "#include <stdint.h>\n"
+    "uint64_t aot_object_scale(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, void* context)\n"
+    "{\n"
+    "    (void)p3;\n"
+    "    (void)p4;\n"
+    "    (void)context;\n"
+    "    return p0 * p1 + p2;\n"
+    "}\n"
+    "uint64_t aot_object_unwind(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, void* context)\n"
+    "{\n"
+    "    (void)p1;\n"
+    "    (void)p2;\n"
+    "    (void)p3;\n"
+    "    (void)p4;\n"
+    "    (void)context;\n"
+    "    return p0;\n"
+    "}\n";
+
+static bool
+register_helpers(ubpf_vm_up& vm, std::string& error)
+{
+    (void)error;
+    ubpf_register(vm.get(), 1, "aot_object_scale", scale_helper);
+    ubpf_register(vm.get(), 2, "aot_object_unwind", unwind_helper);
+    ubpf_set_unwind_function_index(vm.get(), 2);
+    return true;
+}
+
+#if defined(__ELF__)
+// Check that the object is relocatable, defines the programs and references the helpers.
+static bool
+check_object(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(Elf64_Ehdr) || memcmp(data.data(), ELFMAG, SELFMAG) != 0 ||
+        data[EI_CLASS] != ELFCLASS64) {
+        std::cerr << "The object is not a 64-bit ELF file" << std::endl;
+        return false;
+    }
+    Elf64_Ehdr header;
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.e_type != ET_REL) {
+        std::cerr << "The object is not relocatable" << std::endl;
+        return false;
+    }
+
+    bool defined_first = false;
+    bool defined_second = false;
+    bool references_scale = false;
+    for (unsigned int i = 0; i < header.e_shnum; i++) {
+        Elf64_Shdr section;
+        memcpy(&section, data.data() + header.e_shoff + i * header.e_shentsize, sizeof(section));
+        if (section.sh_type != SHT_SYMTAB) {
+            continue;
+        }
+        Elf64_Shdr strings;
+        memcpy(&strings, data.data() + header.e_shoff + section.sh_link * header.e_shentsize, sizeof(strings));
+        for (size_t offset = 0; offset + sizeof(Elf64_Sym) <= section.sh_size; offset += sizeof(Elf64_Sym)) {
+            Elf64_Sym symbol;
+            memcpy(&symbol, data.data() + section.sh_offset + offset, sizeof(symbol));
+            std::string name(data.data() + strings.sh_offset + symbol.st_name);
+            bool global = ELF64_ST_BIND(symbol.st_info) == STB_GLOBAL;
+            if (name == "aot_object_first" && global && symbol.st_shndx != SHN_UNDEF) {
+                defined_first = true;
+            } else if (name == "aot_object_second" && global && symbol.st_shndx != SHN_UNDEF) {
+                defined_second = true;
+            } else if (name == "aot_object_scale" && symbol.st_shndx == SHN_UNDEF) {
+                references_scale = true;
+            }
+        }
+    }
+    if (!defined_first || !defined_second || !references_scale) {
+        std::cerr << "The object does not define both programs or does not reference the helper" << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+#if defined(_WIN32)
+    std::cout << "PASSED: compiling C translations is not supported on Windows" << std::endl;
+    return 0;
+#else
+    std::vector<ebpf_inst> first = {
+        {EBPF_OP_LDXDW, 6, 1, 0, 0},
+        {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+        {EBPF_OP_MOV64_IMM, 2, 0, 0, 3},
+        {EBPF_OP_MOV64_IMM, 3, 0, 0, 11},
+        {EBPF_OP_CALL, 0, 0, 0, 1},
+        {EBPF_OP_STXDW, 10, 0, -8, 0},
+        {EBPF_OP_LDXDW, 0, 10, -8, 0},
+        {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::vector<ebpf_inst> second = {
+        {EBPF_OP_LDXDW, 6, 1, 0, 0},
+        {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+        {EBPF_OP_AND64_IMM, 1, 0, 0, 1},
+        {EBPF_OP_CALL, 0, 0, 0, 2},
+        {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+        {EBPF_OP_MOV64_REG, 2, 6, 0, 0},
+        {EBPF_OP_MOV64_IMM, 3, 0, 0, 0},
+        {EBPF_OP_CALL, 0, 0, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    std::string error;
+    ubpf_vm_up first_vm = ubpf_load_custom_test_program(first, error, register_helpers);
+    ubpf_vm_up second_vm = ubpf_load_custom_test_program(second, error, register_helpers);
+    if (!first_vm || !second_vm) {
+        std::cerr << error << std::endl;
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+
+    char* errmsg = nullptr;
+    char* first_source = nullptr;
+    char* second_source = nullptr;
+    if (ubpf_translate_c_ex(first_vm.get(), "aot_object_first", UBPF_C_HELPERS_SYMBOLS, &first_source, &errmsg) !=
+            0 ||
+        ubpf_translate_c_ex(second_vm.get(), "aot_object_second", UBPF_C_HELPERS_SYMBOLS, &second_source, &errmsg) !=
+            0) {
+        std::cerr << "Failed to translate: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        free(first_source);
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    std::string source = std::string(first_source) + "\n" + second_source;
+    free(first_source);
+    free(second_source);
+
+    const char* temporary = getenv("TMPDIR");
+    std::string directory = std::string(temporary && *temporary ? temporary : "/tmp") + "/ubpf-aot-test-XXXXXX";
+    if (mkdtemp(directory.data()) == nullptr) {
+        std::cerr << "Failed to create a temporary directory" << std::endl;
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    std::string object_path = directory + "/programs.o";
+    std::string helper_path = directory + "/helpers.c";
+    std::string library_path = directory + "/programs.so";
+
+    bool success = true;
+    void* library = nullptr;
+    if (ubpf_compile_c_object(source.c_str(), object_path.c_str(), &errmsg) != 0) {
+        std::cerr << "Failed to compile the object: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        success = false;
+    }
+#if defined(__ELF__)
+    if (success && !check_object(object_path)) {
+        success = false;
+    }
+#endif
+
+    const char* compiler = getenv("UBPF_CC");
+    if (compiler == nullptr || *compiler == '\0') {
+        compiler = getenv("CC");
+    }
+    if (compiler == nullptr || *compiler == '\0') {
+        compiler = "cc";
+    }
+#if defined(__ELF__)
+    // Without the helpers, their symbols are left undefined and the link fails.
+    if (success) {
+        std::string command = std::string(compiler) + " -fPIC -shared -Wl,-z,defs -o '" + library_path + "' '" +
+                              object_path + "' 2>/dev/null";
+        if (system(command.c_str()) == 0) {
+            std::cerr << "Linked the object without the helpers" << std::endl;
+            success = false;
+        }
+        unlink(library_path.c_str());
+    }
+#endif
+
+    // Link the object against the helpers, as the host would at build time.
+    if (success) {
+        std::ofstream(helper_path) << helper_source;
+        std::string command = std::string(compiler) + " -fPIC -shared -o '" + library_path + "' '" + object_path +
+                              "' '" + helper_path + "'";
+        if (system(command.c_str()) != 0 || (library = dlopen(library_path.c_str(), RTLD_NOW)) == nullptr) {
+            std::cerr << "Failed to link the object" << std::endl;
+            success = false;
+        }
+    }
+
+    if (success) {
+        struct
+        {
+            ubpf_vm* vm;
+            const char* name;
+        } programs[] = {{first_vm.get(), "aot_object_first"}, {second_vm.get(), "aot_object_second"}};
+        for (const auto& program : programs) {
+            auto fn = reinterpret_cast<ubpf_c_fn>(dlsym(library, program.name));
+            if (fn == nullptr) {
+                std::cerr << "Failed to find " << program.name << std::endl;
+                success = false;
+                continue;
+            }
+            for (uint64_t input : {0ULL, 1ULL, 6ULL, 0xfedcba9876543210ULL}) {
+                uint64_t memory[2] = {input, 0};
+                uint64_t expected = 0;
+                int expected_status = ubpf_exec(program.vm, memory, sizeof(memory), &expected);
+                uint64_t stack[UBPF_EBPF_STACK_SIZE / sizeof(uint64_t)];
+                uint64_t result = 0;
+                int status = fn(memory, sizeof(memory), reinterpret_cast<uint8_t*>(stack), sizeof(stack), nullptr, &result);
+                if (status != expected_status || result != expected) {
+                    std::cerr << program.name << ": input 0x" << std::hex << input << " returned 0x" << result
+                              << " but 0x" << expected << " in the interpreter" << std::endl;
+                    success = false;
+                }
+            }
+        }
+    }
+
+    if (library != nullptr) {
+        dlclose(library);
+    }
+    unlink(object_path.c_str());
+    unlink(helper_path.c_str());
+    unlink(library_path.c_str());
+    rmdir(directory.c_str());
+
+    // Helpers reached only through a dispatcher have no symbol to link against.
+    std::vector<ebpf_inst> call = {{EBPF_OP_CALL, 0, 0, 0, 5}, {EBPF_OP_EXIT, 0, 0, 0, 0}};
+    ubpf_vm_up vm = ubpf_load_custom_test_program(call, error, [](ubpf_vm_up& vm, std::string&) {
+        ubpf_register_external_dispatcher(
+            vm.get(),
+            [](uint64_t p0, uint64_t, uint64_t, uint64_t, uint64_t, unsigned int, void*) { return p0; },
+            [](unsigned int, const ubpf_vm*) { return true; });
+        return true;
+    });
+    char* translation = nullptr;
+    errmsg = nullptr;
+    if (!vm || ubpf_translate_c_ex(vm.get(), "unnamed", UBPF_C_HELPERS_SYMBOLS, &translation, &errmsg) == 0) {
+        std::cerr << "Translated a call to a helper without a name" << std::endl;
+        success = false;
+    }
+    free(translation);
+    free(errmsg);
+
+    std::cout << (success ? "PASSED" : "FAILED") << std::endl;
+    return success ? 0 : 1;
+#endif
+}
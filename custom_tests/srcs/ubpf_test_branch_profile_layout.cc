@@ -0,0 +1,272 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test interpreter branch profiling and profile-guided JIT code layout.
+ * This test verifies that:
+ * 1. The interpreter counts how often each conditional jump is taken and not taken
+ * 2. Profiles can be read and handed to another VM
+ * 3. A JIT'd program laid out with a profile computes the same results as the
+ *    interpreter on both the hot and the cold paths
+ * 4. The profile changes the generated code
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+struct layout_test_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+    // The pc of a conditional jump and the counts expected after training.
+    uint16_t branch_pc;
+    uint32_t expected_taken;
+    uint32_t expected_not_taken;
+    // Inputs that exercise the hot paths (used for training) ...
+    std::vector<uint64_t> training_inputs;
+    // ... and inputs that reach the blocks that the JIT moves out of line.
+    std::vector<uint64_t> cold_inputs;
+};
+
+static bool
+interpret(ubpf_vm* vm, uint64_t input, uint64_t& result)
+{
+    uint64_t memory = input;
+    return ubpf_exec(vm, &memory, sizeof(memory), &result) == 0;
+}
+
+static bool
+translate(ubpf_vm* vm, std::vector<uint8_t>& code)
+{
+    code.resize(65536);
+    size_t size = code.size();
+    char* errmsg = nullptr;
+    if (ubpf_translate(vm, code.data(), &size, &errmsg) != 0) {
+        std::cerr << "Failed to translate program: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        return false;
+    }
+    code.resize(size);
+    return true;
+}
+
+static bool
+run_test_case(const layout_test_case& test)
+{
+    std::string error;
+    ubpf_vm_up profiled_vm = ubpf_load_custom_test_program(test.program, error, [](ubpf_vm_up& vm, std::string&) {
+        ubpf_toggle_branch_profiling(vm.get(), true);
+        return true;
+    });
+    ubpf_vm_up plain_vm = ubpf_load_custom_test_program(test.program, error);
+    if (!profiled_vm || !plain_vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+
+    uint64_t result;
+    for (uint64_t input : test.training_inputs) {
+        if (!interpret(profiled_vm.get(), input, result)) {
+            std::cerr << test.name << ": interpreter failed during training" << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<ubpf_branch_profile_entry> profile(test.program.size());
+    if (ubpf_get_branch_profile(profiled_vm.get(), profile.data(), static_cast<uint32_t>(profile.size() - 1)) != -1) {
+        std::cerr << test.name << ": a profile was copied into a buffer that is too small" << std::endl;
+        return false;
+    }
+    if (ubpf_get_branch_profile(profiled_vm.get(), profile.data(), static_cast<uint32_t>(profile.size())) !=
+        static_cast<int>(profile.size())) {
+        std::cerr << test.name << ": could not get the branch profile" << std::endl;
+        return false;
+    }
+    if (ubpf_get_branch_profile(plain_vm.get(), profile.data(), static_cast<uint32_t>(profile.size())) != -1) {
+        std::cerr << test.name << ": a VM without profiling returned a profile" << std::endl;
+        return false;
+    }
+    if (profile[test.branch_pc].taken != test.expected_taken ||
+        profile[test.branch_pc].not_taken != test.expected_not_taken) {
+        std::cerr << test.name << ": branch at pc " << test.branch_pc << " was taken " << profile[test.branch_pc].taken
+                  << " and not taken " << profile[test.branch_pc].not_taken << " times; expected "
+                  << test.expected_taken << " and " << test.expected_not_taken << std::endl;
+        return false;
+    }
+
+    // Hand the profile to a second VM that runs the same program.
+    ubpf_vm_up guided_vm = ubpf_load_custom_test_program(test.program, error);
+    if (!guided_vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+    char* errmsg = nullptr;
+    if (ubpf_set_branch_profile(guided_vm.get(), profile.data(), static_cast<uint32_t>(profile.size() - 1), &errmsg) ==
+        0) {
+        std::cerr << test.name << ": a profile of the wrong size was accepted" << std::endl;
+        return false;
+    }
+    free(errmsg);
+    errmsg = nullptr;
+    if (ubpf_set_branch_profile(guided_vm.get(), profile.data(), static_cast<uint32_t>(profile.size()), &errmsg) != 0) {
+        std::cerr << test.name << ": could not set the branch profile: " << errmsg << std::endl;
+        free(errmsg);
+        return false;
+    }
+
+    if (!ubpf_native_jit_available()) {
+        return true;
+    }
+
+    std::vector<uint8_t> plain_code;
+    std::vector<uint8_t> guided_code;
+    if (!translate(plain_vm.get(), plain_code) || !translate(guided_vm.get(), guided_code)) {
+        return false;
+    }
+    if (plain_code == guided_code) {
+        std::cerr << test.name << ": the branch profile did not change the generated code" << std::endl;
+        return false;
+    }
+
+    for (ubpf_vm* vm : {profiled_vm.get(), guided_vm.get()}) {
+        ubpf_jit_fn jit_fn = ubpf_compile(vm, &errmsg);
+        if (jit_fn == nullptr) {
+            std::cerr << test.name << ": failed to compile: " << errmsg << std::endl;
+            free(errmsg);
+            return false;
+        }
+
+        std::vector<uint64_t> inputs = test.training_inputs;
+        inputs.insert(inputs.end(), test.cold_inputs.begin(), test.cold_inputs.end());
+        for (uint64_t input : inputs) {
+            uint64_t expected;
+            if (!interpret(plain_vm.get(), input, expected)) {
+                std::cerr << test.name << ": interpreter failed" << std::endl;
+                return false;
+            }
+            uint64_t memory = input;
+            uint64_t actual = jit_fn(&memory, sizeof(memory));
+            if (actual != expected) {
+                std::cerr << test.name << ": input " << input << " returned " << actual << " from the JIT'd code but "
+                          << expected << " from the interpreter" << std::endl;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    std::vector<layout_test_case> tests = {
+        {
+            // The target of the branch is cold: r0 = -1; exit moves to the end.
+            "cold target",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+                {EBPF_OP_JGT_IMM, 2, 0, 2, 100},
+                {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                {EBPF_OP_JA, 0, 0, 2, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, -1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            2,
+            0,
+            32,
+            std::vector<uint64_t>(32, 7),
+            {101, 1000},
+        },
+        {
+            // The fall-through of the branch is cold (and contains an LDDW): the
+            // branch is inverted and its target becomes the fall-through.
+            "cold fall-through",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_JNE_IMM, 2, 0, 3, 7},
+                {EBPF_OP_LDDW, 0, 0, 0, 0x1234},
+                {0, 0, 0, 0, 0x5678},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                {EBPF_OP_MUL64_IMM, 0, 0, 0, 3},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            1,
+            20,
+            0,
+            std::vector<uint64_t>(20, 9),
+            {7},
+        },
+        {
+            // A bounds check inside a loop whose failure path is cold.
+            "cold bounds check in loop",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_IMM, 3, 0, 0, 0},
+                {EBPF_OP_JGE_REG, 3, 2, 6, 0},
+                {EBPF_OP_JLT_IMM, 3, 0, 2, 4096},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, -1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+                {EBPF_OP_ADD64_IMM, 3, 0, 0, 1},
+                {EBPF_OP_JA, 0, 0, -7, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            4,
+            40,
+            0,
+            {10, 10, 10, 10},
+            {0, 1, 4096, 5000},
+        },
+        {
+            // The cold block sits between the main program and a local function.
+            "cold block before local function",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_JGT_IMM, 2, 0, 3, 100},
+                {EBPF_OP_MOV64_REG, 1, 2, 0, 0},
+                {EBPF_OP_CALL, 0, 1, 0, 3},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, -1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 1000},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            1,
+            0,
+            16,
+            std::vector<uint64_t>(16, 5),
+            {101},
+        },
+    };
+
+    for (const auto& test : tests) {
+        if (!run_test_case(test)) {
+            std::cerr << "FAILED: " << test.name << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: " << test.name << std::endl;
+    }
+
+    return 0;
+}
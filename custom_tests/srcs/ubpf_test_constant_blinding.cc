@@ -27,7 +27,9 @@ extern "C"
 // Check if constant blinding is supported on this platform
 static bool is_constant_blinding_supported()
 {
-#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__) || defined(_M_ARM64)
+#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__) || defined(_M_ARM64) || \
+    (defined(__riscv) && __riscv_xlen == 64) || \
+    (defined(__mips__) && defined(__mips64) && __mips_isa_rev >= 6 && defined(__MIPSEL__))
     return true;
 #else
     return false;
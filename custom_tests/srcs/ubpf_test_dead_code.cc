@@ -0,0 +1,221 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test that code that cannot be reached is left out of the compiled program.
+ * This test verifies that:
+ * 1. Programs with unreachable instructions, including an unreachable local
+ *    function and helper call, compute the same results in the JIT'd code as
+ *    in the interpreter
+ * 2. A program with an unreachable tail translates to as much native code as
+ *    the same program without it, and its unreachable helper calls are not
+ *    translated to C
+ * 3. Unreachable functions are still validated
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+struct dead_code_test_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+    uint64_t expected;
+};
+
+static uint64_t
+unreachable_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    return p0 + p1 + p2 + p3 + p4;
+}
+
+static bool
+register_helper(ubpf_vm_up& vm, std::string& error)
+{
+    (void)error;
+    return ubpf_register(vm.get(), 1, "unreachable_helper", unreachable_helper) == 0;
+}
+
+static size_t
+translated_size(const std::vector<ebpf_inst>& program)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, register_helper);
+    if (!vm) {
+        std::cerr << "Failed to load program: " << error << std::endl;
+        return 0;
+    }
+    std::vector<uint8_t> code(65536);
+    size_t size = code.size();
+    char* errmsg = nullptr;
+    if (ubpf_translate(vm.get(), code.data(), &size, &errmsg) != 0) {
+        std::cerr << "Failed to translate program: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        return 0;
+    }
+    return size;
+}
+
+static bool
+run_test_case(const dead_code_test_case& test)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error, register_helper);
+    if (!vm) {
+        std::cerr << test.name << ": failed to load: " << error << std::endl;
+        return false;
+    }
+
+    uint64_t memory = 7;
+    uint64_t result;
+    if (ubpf_exec(vm.get(), &memory, sizeof(memory), &result) != 0 || result != test.expected) {
+        std::cerr << test.name << ": the interpreter returned " << result << " instead of " << test.expected
+                  << std::endl;
+        return false;
+    }
+
+    if (!ubpf_native_jit_available()) {
+        return true;
+    }
+
+    char* errmsg = nullptr;
+    ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+    if (fn == nullptr) {
+        std::cerr << test.name << ": failed to compile: " << errmsg << std::endl;
+        free(errmsg);
+        return false;
+    }
+    memory = 7;
+    result = fn(&memory, sizeof(memory));
+    if (result != test.expected) {
+        std::cerr << test.name << ": the JIT'd code returned " << result << " instead of " << test.expected
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    // An unreachable tail that calls a local function, which calls a helper.
+    std::vector<ebpf_inst> with_dead_tail = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_MOV64_IMM, 6, 0, 0, 5},
+        {EBPF_OP_CALL, 0, 1, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+        {EBPF_OP_CALL, 0, 0, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::vector<ebpf_inst> without_dead_tail = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    std::vector<dead_code_test_case> tests = {
+        {"unreachable tail", with_dead_tail, 1},
+        {
+            "jump over unreachable code",
+            {
+                {EBPF_OP_LDXDW, 0, 1, 0, 0},
+                {EBPF_OP_JA, 0, 0, 3, 0},
+                {EBPF_OP_MOV64_IMM, 6, 0, 0, 1},
+                {EBPF_OP_LDDW, 0, 0, 0, 2},
+                {0, 0, 0, 0, 3},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            8,
+        },
+        {
+            // The local function is reachable; the code after its exit is not.
+            "unreachable code in a local function",
+            {
+                {EBPF_OP_LDXDW, 1, 1, 0, 0},
+                {EBPF_OP_CALL, 0, 1, 0, 1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+                {EBPF_OP_MUL64_IMM, 0, 0, 0, 3},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            21,
+        },
+    };
+
+    for (const auto& test : tests) {
+        if (!run_test_case(test)) {
+            std::cerr << "FAILED: " << test.name << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: " << test.name << std::endl;
+    }
+
+    if (ubpf_native_jit_available()) {
+        size_t with_size = translated_size(with_dead_tail);
+        size_t without_size = translated_size(without_dead_tail);
+        if (with_size == 0 || with_size != without_size) {
+            std::cerr << "FAILED: the program with an unreachable tail translated to " << with_size
+                      << " bytes and the one without it to " << without_size << " bytes" << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: native code size" << std::endl;
+    }
+
+    {
+        std::string error;
+        ubpf_vm_up vm = ubpf_load_custom_test_program(with_dead_tail, error, register_helper);
+        char* source = nullptr;
+        char* errmsg = nullptr;
+        if (!vm || ubpf_translate_c(vm.get(), "entry", &source, &errmsg) != 0) {
+            std::cerr << "FAILED: translating to C: " << (errmsg ? errmsg : error.c_str()) << std::endl;
+            free(errmsg);
+            return 1;
+        }
+        bool mentions_helper = strstr(source, "unreachable_helper") != nullptr;
+        free(source);
+        if (mentions_helper) {
+            std::cerr << "FAILED: the C translation calls the unreachable helper" << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: C translation" << std::endl;
+    }
+
+    // A jump out of a function that is never called is still rejected.
+    std::vector<ebpf_inst> invalid_dead_function = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_CALL, 0, 1, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_JA, 0, 0, -3, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::string error;
+    if (ubpf_load_custom_test_program(invalid_dead_function, error, register_helper) ||
+        error.find("jump out of bounds at PC 4") == std::string::npos) {
+        std::cerr << "FAILED: the invalid unreachable function was not rejected: " << error << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: validation of unreachable functions" << std::endl;
+
+    return 0;
+}
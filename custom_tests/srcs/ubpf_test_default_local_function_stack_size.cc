@@ -30,6 +30,8 @@ main(int argc, char** argv)
     }
 
     const size_t stack_size{8192};
+    // The main function's four bytes of stack take one 16-byte frame.
+    const size_t main_frame_size{16};
 
     uint8_t expected_result[8192] = {
         0,
@@ -41,10 +43,10 @@ main(int argc, char** argv)
     expected_result[stack_size - 1 - 3] = 0x4;
 
 
-    expected_result[stack_size - UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE - 1 - 0] = 0x11;
-    expected_result[stack_size - UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE - 1 - 1] = 0x12;
-    expected_result[stack_size - UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE - 1 - 2] = 0x13;
-    expected_result[stack_size - UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE - 1 - 3] = 0x14;
+    expected_result[stack_size - main_frame_size - 1 - 0] = 0x11;
+    expected_result[stack_size - main_frame_size - 1 - 1] = 0x12;
+    expected_result[stack_size - main_frame_size - 1 - 2] = 0x13;
+    expected_result[stack_size - main_frame_size - 1 - 3] = 0x14;
 
     bool success = true;
 
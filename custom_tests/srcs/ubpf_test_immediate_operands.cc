@@ -0,0 +1,276 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the JIT's handling of immediate operands.
+ * This test verifies that, for immediates that can be encoded in the instructions
+ * the JIT emits (e.g., arm64 bitmask, shifted and negated immediates) and for those
+ * that cannot, the JIT'd code computes the same results as the interpreter for:
+ * 1. 32- and 64-bit ALU operations with an immediate
+ * 2. Conditional jumps that compare with an immediate (including 0) or test bits
+ * 3. Conditional jumps over a single move (which may be compiled to a select)
+ * 4. Stores of immediates (including 0 and negative 64-bit values)
+ * 5. A single-bit test whose target is further away than a test-and-branch reaches
+ * Every program is also compiled with constant blinding.
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static const int32_t immediates[] = {
+    0,
+    1,
+    -1,
+    7,
+    -7,
+    0xfff,
+    -0xfff,
+    0x1000,
+    0x5000,
+    -0x5000,
+    0x12345,
+    -0x12345,
+    0xfff000,
+    0xffffff,
+    0x1000000,
+    0xff,
+    0xff00,
+    -256,
+    0x00ff00ff,
+    0x55555555,
+    0x7fffffff,
+    INT32_MIN,
+    0x40,
+    0x12345678,
+};
+
+static const uint64_t inputs[] = {
+    0,
+    1,
+    0x40,
+    0xfff,
+    0x5000,
+    0x12345678,
+    0xffffffff,
+    0x100000000ULL,
+    0x8000000000000000ULL,
+    0xfedcba9876543210ULL,
+    0xffffffffffffffffULL,
+};
+
+// Run the program on each input (in the first word of the memory) and compare the JIT'd code with the interpreter.
+static bool
+compare_with_interpreter(const std::string& name, const std::vector<ebpf_inst>& program)
+{
+    for (bool constant_blinding : {false, true}) {
+        std::string error;
+        ubpf_vm_up vm =
+            ubpf_load_custom_test_program(program, error, [constant_blinding](ubpf_vm_up& vm, std::string&) {
+                ubpf_toggle_constant_blinding(vm.get(), constant_blinding);
+                // Room for the long program in test_jump_immediates.
+                ubpf_set_jit_code_size(vm.get(), 1024 * 1024);
+                return true;
+            });
+        if (!vm) {
+            std::cerr << name << ": " << error << std::endl;
+            return false;
+        }
+        char* errmsg = nullptr;
+        ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+        if (fn == nullptr) {
+            std::cerr << name << ": failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+            free(errmsg);
+            return false;
+        }
+
+        for (uint64_t input : inputs) {
+            uint64_t interpreted_memory[2] = {input, 0};
+            uint64_t jitted_memory[2] = {input, 0};
+            uint64_t expected;
+            if (ubpf_exec(vm.get(), interpreted_memory, sizeof(interpreted_memory), &expected) != 0) {
+                std::cerr << name << ": interpreter failed" << std::endl;
+                return false;
+            }
+            uint64_t result = fn(jitted_memory, sizeof(jitted_memory));
+            if (result != expected || jitted_memory[1] != interpreted_memory[1]) {
+                std::cerr << name << (constant_blinding ? " (blinded)" : "") << ": input " << std::hex << input
+                          << " returned " << result << " and stored " << jitted_memory[1]
+                          << " from the JIT'd code but " << expected << " and " << interpreted_memory[1]
+                          << " from the interpreter" << std::dec << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+test_alu_immediates()
+{
+    const uint8_t opcodes[] = {
+        EBPF_OP_ADD_IMM,   EBPF_OP_SUB_IMM,   EBPF_OP_AND_IMM,   EBPF_OP_OR_IMM,    EBPF_OP_XOR_IMM,
+        EBPF_OP_MOV_IMM,   EBPF_OP_ADD64_IMM, EBPF_OP_SUB64_IMM, EBPF_OP_AND64_IMM, EBPF_OP_OR64_IMM,
+        EBPF_OP_XOR64_IMM, EBPF_OP_MOV64_IMM, EBPF_OP_MUL64_IMM,
+    };
+    for (uint8_t opcode : opcodes) {
+        for (int32_t imm : immediates) {
+            std::vector<ebpf_inst> program = {
+                {EBPF_OP_LDXDW, 0, 1, 0, 0},
+                {opcode, 0, 0, 0, imm},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            };
+            if (!compare_with_interpreter("ALU opcode " + std::to_string(opcode) + " imm " + std::to_string(imm),
+                                          program)) {
+                return false;
+            }
+        }
+    }
+
+    const uint8_t shifts[] = {
+        EBPF_OP_LSH_IMM, EBPF_OP_RSH_IMM, EBPF_OP_ARSH_IMM, EBPF_OP_LSH64_IMM, EBPF_OP_RSH64_IMM, EBPF_OP_ARSH64_IMM};
+    for (uint8_t opcode : shifts) {
+        int32_t size = (opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64 ? 64 : 32;
+        for (int32_t shift = 0; shift < size; shift++) {
+            std::vector<ebpf_inst> program = {
+                {EBPF_OP_LDXDW, 0, 1, 0, 0},
+                {opcode, 0, 0, 0, shift},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            };
+            if (!compare_with_interpreter("shift opcode " + std::to_string(opcode) + " by " + std::to_string(shift),
+                                          program)) {
+                return false;
+            }
+        }
+    }
+
+    // Constants that need several instructions or a single bitmask immediate.
+    for (uint64_t constant :
+         {0x00ff00ff00ff00ffULL, 0x5555555555555555ULL, 0xffff0000ffff0000ULL, 0x0000ffff00000000ULL,
+          0xffffffff00001234ULL, 0x123456789abcdef0ULL, 0x8000000000000000ULL}) {
+        std::vector<ebpf_inst> program = {
+            {EBPF_OP_LDDW, 0, 0, 0, static_cast<int32_t>(constant)},
+            {0, 0, 0, 0, static_cast<int32_t>(constant >> 32)},
+            {EBPF_OP_LDXDW, 2, 1, 0, 0},
+            {EBPF_OP_XOR64_REG, 0, 2, 0, 0},
+            {EBPF_OP_EXIT, 0, 0, 0, 0},
+        };
+        if (!compare_with_interpreter("LDDW " + std::to_string(constant), program)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+test_jump_immediates()
+{
+    const uint8_t opcodes[] = {
+        EBPF_OP_JEQ_IMM,    EBPF_OP_JNE_IMM,    EBPF_OP_JGT_IMM,    EBPF_OP_JGE_IMM,    EBPF_OP_JLT_IMM,
+        EBPF_OP_JLE_IMM,    EBPF_OP_JSGT_IMM,   EBPF_OP_JSGE_IMM,   EBPF_OP_JSLT_IMM,   EBPF_OP_JSLE_IMM,
+        EBPF_OP_JSET_IMM,   EBPF_OP_JEQ32_IMM,  EBPF_OP_JNE32_IMM,  EBPF_OP_JGT32_IMM,  EBPF_OP_JGE32_IMM,
+        EBPF_OP_JLT32_IMM,  EBPF_OP_JLE32_IMM,  EBPF_OP_JSGT32_IMM, EBPF_OP_JSGE32_IMM, EBPF_OP_JSLT32_IMM,
+        EBPF_OP_JSLE32_IMM, EBPF_OP_JSET32_IMM,
+    };
+    for (uint8_t opcode : opcodes) {
+        for (int32_t imm : immediates) {
+            // A jump around a block and a jump over a single (register and immediate) move.
+            std::vector<ebpf_inst> branch = {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+                {opcode, 2, 0, 2, imm},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 2},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 3},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            };
+            std::vector<ebpf_inst> select = {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                {EBPF_OP_MOV64_IMM, 3, 0, 0, 5},
+                {opcode, 2, 0, 1, imm},
+                {EBPF_OP_MOV64_REG, 0, 3, 0, 0},
+                {opcode, 2, 0, 1, imm},
+                {EBPF_OP_MOV64_IMM, 3, 0, 0, imm},
+                {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            };
+            std::string name = "jump opcode " + std::to_string(opcode) + " imm " + std::to_string(imm);
+            if (!compare_with_interpreter(name, branch) || !compare_with_interpreter(name + " (select)", select)) {
+                return false;
+            }
+        }
+    }
+
+    // A single-bit test whose target is further away than a TBZ/TBNZ on arm64 reaches (+/-32KB).
+    const int far_distance = 10000;
+    std::vector<ebpf_inst> far = {
+        {EBPF_OP_LDXDW, 2, 1, 0, 0},
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_JSET_IMM, 2, 0, far_distance, 0x40},
+    };
+    for (int i = 0; i < far_distance; i++) {
+        far.push_back({EBPF_OP_ADD64_IMM, 0, 0, 0, 1});
+    }
+    far.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    return compare_with_interpreter("far single-bit test", far);
+}
+
+static bool
+test_store_immediates()
+{
+    for (uint8_t opcode : {EBPF_OP_STB, EBPF_OP_STH, EBPF_OP_STW, EBPF_OP_STDW}) {
+        for (int32_t imm : immediates) {
+            std::vector<ebpf_inst> program = {
+                {EBPF_OP_LDXDW, 0, 1, 0, 0},
+                {EBPF_OP_STDW, 1, 0, 8, -1},
+                {opcode, 1, 0, 8, imm},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            };
+            if (!compare_with_interpreter("store opcode " + std::to_string(opcode) + " imm " + std::to_string(imm),
+                                          program)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (!ubpf_native_jit_available()) {
+        std::cout << "JIT not supported on this platform; skipping" << std::endl;
+        return 0;
+    }
+
+    struct
+    {
+        const char* name;
+        bool (*run)();
+    } tests[] = {
+        {"ALU immediates", test_alu_immediates},
+        {"jump immediates", test_jump_immediates},
+        {"store immediates", test_store_immediates},
+    };
+    for (const auto& test : tests) {
+        if (!test.run()) {
+            std::cerr << "FAILED: " << test.name << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: " << test.name << std::endl;
+    }
+    return 0;
+}
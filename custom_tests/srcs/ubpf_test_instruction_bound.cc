@@ -0,0 +1,234 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the instruction bound (ubpf_get_instruction_bound).
+ * This test verifies that:
+ * 1. Programs without loops, counted loops (nested or not) and local calls have a bound
+ *    that is the number of instructions they execute
+ * 2. Loops without a constant trip count and recursion have no bound
+ * 3. A program stops at an instruction limit below its bound and runs to the end at a
+ *    limit equal to it, in the interpreter and in the JIT'd code
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define JIT_CHECKS_SUPPORTED 1
+#else
+#define JIT_CHECKS_SUPPORTED 0
+#endif
+
+static const uint64_t unknown = UINT64_MAX;
+
+static void
+count_instruction(
+    void* context,
+    int program_counter,
+    const uint64_t registers[16],
+    const uint8_t* stack_start,
+    size_t stack_length,
+    uint64_t register_mask,
+    const uint8_t* stack_mask_start)
+{
+    (void)program_counter;
+    (void)registers;
+    (void)stack_start;
+    (void)stack_length;
+    (void)register_mask;
+    (void)stack_mask_start;
+    (*static_cast<uint64_t*>(context))++;
+}
+
+struct bound_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+    uint64_t bound;
+};
+
+// Run the program with the limit in the interpreter and in the JIT'd code; it must
+// return expected, or stop if expected is unknown.
+static bool
+run_with_limit(const bound_case& test, uint32_t instruction_limit, uint64_t expected)
+{
+    std::string error;
+    ubpf_vm_up vm =
+        ubpf_load_custom_test_program(test.program, error, [instruction_limit](ubpf_vm_up& vm, std::string&) {
+            ubpf_set_instruction_limit(vm.get(), instruction_limit, nullptr);
+            return true;
+        });
+    if (!vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+    uint64_t memory = 3;
+    uint64_t result = 0;
+    int status = ubpf_exec(vm.get(), &memory, sizeof(memory), &result);
+    if (expected == unknown ? status == 0 : status != 0 || result != expected) {
+        std::cerr << test.name << ": with a limit of " << instruction_limit << ", the interpreter "
+                  << (status == 0 ? "returned " + std::to_string(result) : std::string("stopped")) << std::endl;
+        return false;
+    }
+
+    if (ubpf_native_jit_available() && (expected != unknown || JIT_CHECKS_SUPPORTED)) {
+        char* errmsg = nullptr;
+        ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+        if (fn == nullptr) {
+            std::cerr << test.name << ": failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+            free(errmsg);
+            return false;
+        }
+        result = fn(&memory, sizeof(memory));
+        if (result != expected) {
+            std::cerr << test.name << ": with a limit of " << instruction_limit << ", the JIT'd code returned "
+                      << result << "; expected " << expected << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+check_case(const bound_case& test)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error);
+    if (!vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+    uint64_t bound = 0;
+    if (ubpf_get_instruction_bound(vm.get(), &bound) != 0) {
+        bound = unknown;
+    }
+    if (bound != test.bound) {
+        std::cerr << test.name << ": the bound is " << bound << "; expected " << test.bound << std::endl;
+        return false;
+    }
+
+    uint64_t executed = 0;
+    ubpf_register_debug_fn(vm.get(), &executed, count_instruction);
+    uint64_t memory = 3;
+    uint64_t expected = 0;
+    if (ubpf_exec(vm.get(), &memory, sizeof(memory), &expected) != 0) {
+        std::cerr << test.name << ": the program failed" << std::endl;
+        return false;
+    }
+    if (bound == unknown) {
+        return true;
+    }
+    if (executed != bound) {
+        std::cerr << test.name << ": executed " << executed << " instructions; expected " << bound << std::endl;
+        return false;
+    }
+    return run_with_limit(test, static_cast<uint32_t>(bound - 1), unknown) &&
+           run_with_limit(test, static_cast<uint32_t>(bound), expected);
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    const bound_case cases[] = {
+        {"branches",
+         {{EBPF_OP_LDDW, 0, 0, 0, 1},
+          {0, 0, 0, 0, 0},
+          {EBPF_OP_JEQ_IMM, 1, 0, 2, 0},
+          {EBPF_OP_MOV64_IMM, 0, 0, 0, 2},
+          {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         5},
+        {"loop counting up",
+         {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_JLT_IMM, 0, 0, -2, 100},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         202},
+        {"loop counting down",
+         {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_MOV64_IMM, 6, 0, 0, 10},
+          {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_SUB64_IMM, 6, 0, 0, 2},
+          {EBPF_OP_JNE_IMM, 6, 0, -3, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         18},
+        {"signed 32-bit loop",
+         {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_MOV_IMM, 6, 0, 0, -5},
+          {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_ADD_IMM, 6, 0, 0, 1},
+          {EBPF_OP_JSLT32_IMM, 6, 0, -3, 5},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         33},
+        {"nested loops",
+         {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_MOV64_IMM, 6, 0, 0, 0},
+          {EBPF_OP_MOV64_IMM, 7, 0, 0, 0},
+          {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_ADD64_IMM, 7, 0, 0, 1},
+          {EBPF_OP_JLT_IMM, 7, 0, -3, 3},
+          {EBPF_OP_ADD64_IMM, 6, 0, 0, 1},
+          {EBPF_OP_JLT_IMM, 6, 0, -6, 4},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         51},
+        {"local call",
+         {{EBPF_OP_MOV64_IMM, 1, 0, 0, 5},
+          {EBPF_OP_CALL, 0, 1, 0, 1},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+          {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         6},
+        {"loop bounded by memory",
+         {{EBPF_OP_LDXDW, 6, 1, 0, 0},
+          {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_JLT_REG, 0, 6, -2, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         unknown},
+        {"loop stepping past its limit",
+         {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_MOV64_IMM, 6, 0, 0, 10},
+          {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_SUB64_IMM, 6, 0, 0, 3},
+          {EBPF_OP_JSGT_IMM, 0, 0, 1, 10},
+          {EBPF_OP_JNE_IMM, 6, 0, -4, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         unknown},
+        {"recursion",
+         {{EBPF_OP_LDXDW, 1, 1, 0, 0},
+          {EBPF_OP_CALL, 0, 1, 0, 1},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+          {EBPF_OP_JEQ_IMM, 1, 0, 2, 0},
+          {EBPF_OP_SUB64_IMM, 1, 0, 0, 1},
+          {EBPF_OP_CALL, 0, 1, 0, -4},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         unknown},
+    };
+
+    bool success = true;
+    for (const auto& test : cases) {
+        if (!check_case(test)) {
+            success = false;
+        }
+    }
+
+    std::cout << (success ? "PASSED" : "FAILED") << std::endl;
+    return success ? 0 : 1;
+}
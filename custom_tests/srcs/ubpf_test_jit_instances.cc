@@ -0,0 +1,179 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test binding helpers to the JIT'd code of a program with ubpf_create_instance().
+ * This test verifies that:
+ * 1. Only a VM that has compiled its program has instances
+ * 2. Instances share the code of the VM and call their own helpers
+ * 3. An instance without a helper that the program calls has no function
+ * 4. An instance with an external dispatcher calls it instead of its helpers
+ * 5. Instances outlive the VM that compiled the program
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+using ubpf_instance_up = std::unique_ptr<ubpf_instance, decltype(&ubpf_destroy_instance)>;
+
+static uint64_t
+add_one(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return p0 + 1;
+}
+
+static uint64_t
+add_two(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return p0 + 2;
+}
+
+static uint64_t
+dispatch(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, unsigned int index, void* cookie)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    (void)cookie;
+    return p0 + 100 * index;
+}
+
+// r0 = helper(*(u64*)r1) * 2
+static const std::vector<ebpf_inst> program_code = {
+    {EBPF_OP_LDXDW, 1, 1, 0, 0},
+    {EBPF_OP_CALL, 0, 0, 0, 1},
+    {EBPF_OP_LSH64_IMM, 0, 0, 0, 1},
+    {EBPF_OP_EXIT, 0, 0, 0, 0},
+};
+
+static ubpf_instance_up
+create_instance(ubpf_vm* vm, external_function_t helper)
+{
+    char* errmsg = nullptr;
+    ubpf_instance_up instance(ubpf_create_instance(vm, &errmsg), ubpf_destroy_instance);
+    if (!instance) {
+        std::cerr << "creating an instance: " << (errmsg != nullptr ? errmsg : "") << std::endl;
+        free(errmsg);
+    } else if (helper != nullptr) {
+        ubpf_instance_register(instance.get(), 1, helper);
+    }
+    return instance;
+}
+
+static bool
+check_result(ubpf_instance* instance, const char* name, uint64_t expected)
+{
+    char* errmsg = nullptr;
+    ubpf_jit_fn fn = reinterpret_cast<ubpf_jit_fn>(ubpf_get_instance_function(instance, &errmsg));
+    if (fn == nullptr) {
+        std::cerr << name << ": no function: " << (errmsg != nullptr ? errmsg : "") << std::endl;
+        free(errmsg);
+        return false;
+    }
+    uint64_t memory = 10;
+    uint64_t result = fn(&memory, sizeof(memory));
+    if (result != expected) {
+        std::cerr << name << ": the JIT'd code returned " << result << " instead of " << expected << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    char* errmsg = nullptr;
+
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program_code, error, [](ubpf_vm_up& vm, std::string&) {
+        ubpf_register(vm.get(), 1, "helper", add_one);
+        return true;
+    });
+    if (!vm) {
+        std::cerr << "FAILED: " << error << std::endl;
+        return 1;
+    }
+    if (ubpf_create_instance(vm.get(), &errmsg) != nullptr) {
+        std::cerr << "FAILED: created an instance of a VM without JIT'd code" << std::endl;
+        return 1;
+    }
+    free(errmsg);
+    errmsg = nullptr;
+    std::cout << "PASSED: uncompiled VM" << std::endl;
+
+    if (!ubpf_native_jit_available()) {
+        std::cout << "SKIPPED: JIT not supported on this architecture" << std::endl;
+        return 0;
+    }
+
+    ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+    if (fn == nullptr) {
+        std::cerr << "FAILED: compiling the program: " << errmsg << std::endl;
+        free(errmsg);
+        return 1;
+    }
+
+    ubpf_instance_up first = create_instance(vm.get(), add_one);
+    ubpf_instance_up second = create_instance(vm.get(), add_two);
+    if (!first || !second || !check_result(first.get(), "first instance", 22) ||
+        !check_result(second.get(), "second instance", 24)) {
+        std::cerr << "FAILED: instances" << std::endl;
+        return 1;
+    }
+    uint64_t memory = 10;
+    if (fn(&memory, sizeof(memory)) != 22) {
+        std::cerr << "FAILED: the VM does not call its own helper" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: instances" << std::endl;
+
+    ubpf_instance_up missing_helper = create_instance(vm.get(), nullptr);
+    if (!missing_helper || ubpf_get_instance_function(missing_helper.get(), &errmsg) != nullptr ||
+        std::string(errmsg).find("call to nonexistent function 1 at PC 1") == std::string::npos) {
+        std::cerr << "FAILED: an instance without the helper has a function" << std::endl;
+        free(errmsg);
+        return 1;
+    }
+    free(errmsg);
+    std::cout << "PASSED: missing helper" << std::endl;
+
+    ubpf_instance_up dispatched = create_instance(vm.get(), add_one);
+    if (!dispatched || ubpf_instance_register_external_dispatcher(dispatched.get(), dispatch) != 0 ||
+        !check_result(dispatched.get(), "dispatched instance", 220)) {
+        std::cerr << "FAILED: external dispatcher" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: external dispatcher" << std::endl;
+
+    vm.reset();
+    if (!check_result(first.get(), "first instance", 22) || !check_result(second.get(), "second instance", 24)) {
+        std::cerr << "FAILED: the instances did not outlive the VM" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: release" << std::endl;
+
+    return 0;
+}
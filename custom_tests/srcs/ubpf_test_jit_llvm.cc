@@ -0,0 +1,327 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the optimizing LLVM JIT tier (LlvmJitMode).
+ * This test verifies that:
+ * 1. Programs compiled with LLVM return the same results as the interpreter, for
+ *    ALU operations, memory accesses, atomics, helpers (indexed and through the
+ *    dispatcher), the unwind helper and local calls
+ * 2. Failed bounds checks and local calls nested too deeply make the compiled
+ *    program fail, as they make the interpreter fail
+ * 3. Loops are stopped when the instruction limit is exceeded
+ * 4. Code compiled with LLVM cannot be translated into or copied to a buffer
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+struct llvm_jit_test_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+};
+
+static ubpf_jit_ex_fn
+compile(ubpf_vm* vm, const char* name)
+{
+    char* errmsg = nullptr;
+    ubpf_jit_ex_fn fn = ubpf_compile_ex(vm, &errmsg, LlvmJitMode);
+    if (fn == nullptr) {
+        std::cerr << name << ": failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+    }
+    return fn;
+}
+
+static bool
+run_test_case(const llvm_jit_test_case& test, bool use_dispatcher)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error, ubpf_backend_test_helpers(use_dispatcher));
+    if (!vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+
+    ubpf_jit_ex_fn fn = compile(vm.get(), test.name);
+    if (fn == nullptr) {
+        return false;
+    }
+
+    std::vector<uint8_t> stack(UBPF_EBPF_STACK_SIZE);
+    for (uint64_t input : {0ULL, 1ULL, 7ULL, 0x80000000ULL, 0xfedcba9876543210ULL}) {
+        uint64_t memory[4] = {input, ~input, input * 3, 0};
+        uint64_t expected = 0;
+        int expected_status = ubpf_exec(vm.get(), memory, sizeof(memory), &expected);
+        uint64_t expected_memory[4];
+        memcpy(expected_memory, memory, sizeof(memory));
+
+        // The JIT'd code reports failures by returning UINT64_MAX.
+        uint64_t compiled_memory[4] = {input, ~input, input * 3, 0};
+        uint64_t result = fn(compiled_memory, sizeof(compiled_memory), stack.data(), stack.size());
+        bool failed = expected_status != 0 ? result != UINT64_MAX : result != expected;
+        if (failed || (expected_status == 0 && memcmp(compiled_memory, expected_memory, sizeof(memory)) != 0)) {
+            std::cerr << test.name << (use_dispatcher ? " (dispatcher)" : "") << ": input 0x" << std::hex << input
+                      << " returned 0x" << result << " but 0x" << expected << " (status " << std::dec
+                      << expected_status << ") in the interpreter" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+test_instruction_limit()
+{
+    // A loop that counts r0 down from the first word of the memory.
+    std::vector<ebpf_inst> program = {
+        {EBPF_OP_LDXDW, 0, 1, 0, 0},
+        {EBPF_OP_JEQ_IMM, 0, 0, 2, 0},
+        {EBPF_OP_SUB64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_JA, 0, 0, -3, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, ubpf_backend_test_helpers(false));
+    if (!vm) {
+        std::cerr << "instruction limit: " << error << std::endl;
+        return false;
+    }
+    ubpf_set_instruction_limit(vm.get(), 1000, nullptr);
+
+    ubpf_jit_ex_fn fn = compile(vm.get(), "instruction limit");
+    if (fn == nullptr) {
+        return false;
+    }
+
+    std::vector<uint8_t> stack(UBPF_EBPF_STACK_SIZE);
+    uint64_t short_loop = 10;
+    uint64_t long_loop = 100000;
+    if (fn(&short_loop, sizeof(short_loop), stack.data(), stack.size()) != 0 ||
+        fn(&long_loop, sizeof(long_loop), stack.data(), stack.size()) != UINT64_MAX) {
+        std::cerr << "instruction limit: the loop was not stopped at the limit" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool
+test_no_copy()
+{
+    std::vector<ebpf_inst> program = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 42},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, ubpf_backend_test_helpers(false));
+    if (!vm) {
+        std::cerr << "copy: " << error << std::endl;
+        return false;
+    }
+    if (compile(vm.get(), "copy") == nullptr) {
+        return false;
+    }
+
+    uint8_t buffer[4096];
+    size_t size = sizeof(buffer);
+    char* errmsg = nullptr;
+    bool success = true;
+    if (ubpf_translate_ex(vm.get(), buffer, &size, &errmsg, LlvmJitMode) == 0) {
+        std::cerr << "Translated a program with LLVM into a buffer" << std::endl;
+        success = false;
+    }
+    free(errmsg);
+    errmsg = nullptr;
+    if (ubpf_copy_jit(vm.get(), buffer, sizeof(buffer), &errmsg) != nullptr) {
+        std::cerr << "Copied code JIT'd with LLVM" << std::endl;
+        success = false;
+    }
+    free(errmsg);
+    return success;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    // The LLVM JIT is optional (UBPF_ENABLE_LLVM_JIT).
+    {
+        std::vector<ebpf_inst> program = {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}};
+        std::string error;
+        ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, ubpf_backend_test_helpers(false));
+        char* errmsg = nullptr;
+        if (vm && ubpf_compile_ex(vm.get(), &errmsg, LlvmJitMode) == nullptr && errmsg != nullptr &&
+            strstr(errmsg, "built without the LLVM JIT") != nullptr) {
+            std::cout << "PASSED: uBPF was built without the LLVM JIT" << std::endl;
+            free(errmsg);
+            return 0;
+        }
+        free(errmsg);
+    }
+
+    std::vector<llvm_jit_test_case> tests = {
+        {
+            "alu",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                {EBPF_OP_MUL64_IMM, 0, 0, 0, -3},
+                {EBPF_OP_MOV64_REG, 3, 2, 0, 0},
+                {EBPF_OP_ARSH64_IMM, 3, 0, 0, 7},
+                {EBPF_OP_XOR64_REG, 0, 3, 0, 0},
+                {EBPF_OP_MOV_REG, 4, 2, 0, 0},
+                {EBPF_OP_ADD_IMM, 4, 0, 0, -5},
+                {EBPF_OP_LSH_IMM, 4, 0, 0, 3},
+                {EBPF_OP_ARSH_IMM, 4, 0, 0, 1},
+                {EBPF_OP_ADD64_REG, 0, 4, 0, 0},
+                {EBPF_OP_MOV64_REG, 5, 2, 0, 0},
+                {EBPF_OP_DIV64_IMM, 5, 0, 1, -3},
+                {EBPF_OP_ADD64_REG, 0, 5, 0, 0},
+                {EBPF_OP_MOV64_REG, 5, 2, 0, 0},
+                {EBPF_OP_MOD_REG, 5, 2, 1, 0},
+                {EBPF_OP_ADD64_REG, 0, 5, 0, 0},
+                {EBPF_OP_MOV64_IMM, 6, 0, 0, 0},
+                {EBPF_OP_DIV64_REG, 2, 6, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_BE, 2, 0, 0, 32},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_BSWAP, 2, 0, 0, 64},
+                {EBPF_OP_XOR64_REG, 0, 2, 0, 0},
+                {EBPF_OP_MOV64_REG, 7, 0, 16, 0},
+                {EBPF_OP_ADD64_REG, 0, 7, 0, 0},
+                {EBPF_OP_NEG, 0, 0, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "jumps",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+                {EBPF_OP_JSLT_IMM, 2, 0, 1, 0},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 1},
+                {EBPF_OP_JGT32_IMM, 2, 0, 1, 6},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 2},
+                {EBPF_OP_JSET_IMM, 2, 0, 1, 1},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 4},
+                {EBPF_OP_JSGE32_IMM, 2, 0, 1, -1},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 8},
+                {EBPF_OP_JA32, 0, 0, 0, 1},
+                {EBPF_OP_OR64_IMM, 0, 0, 0, 16},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "memory and atomics",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_STXDW, 10, 2, -8, 0},
+                {EBPF_OP_STW, 10, 0, -16, -2},
+                {EBPF_OP_LDXWSX, 3, 10, -16, 0},
+                {EBPF_OP_MOV64_IMM, 4, 0, 0, 5},
+                {EBPF_OP_ATOMIC_STORE, 10, 4, -8, EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH},
+                {EBPF_OP_ATOMIC32_STORE, 1, 3, 8, EBPF_ALU_OP_XOR},
+                {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                {EBPF_OP_ATOMIC_STORE, 1, 3, 16, EBPF_ATOMIC_OP_CMPXCHG},
+                {EBPF_OP_MOV64_IMM, 5, 0, 0, 9},
+                {EBPF_OP_ATOMIC32_STORE, 1, 5, 24, EBPF_ATOMIC_OP_XCHG},
+                {EBPF_OP_LDXDW, 6, 10, -8, 0},
+                {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 4, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+                {EBPF_OP_STXB, 1, 0, 31, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "helpers and unwind",
+            {
+                {EBPF_OP_LDXDW, 6, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+                {EBPF_OP_MOV64_IMM, 2, 0, 0, 2},
+                {EBPF_OP_MOV64_IMM, 3, 0, 0, 3},
+                {EBPF_OP_MOV64_IMM, 4, 0, 0, 4},
+                {EBPF_OP_MOV64_IMM, 5, 0, 0, 5},
+                {EBPF_OP_CALL, 0, 0, 0, 1},
+                {EBPF_OP_MOV64_REG, 7, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+                {EBPF_OP_AND64_IMM, 1, 0, 0, 1},
+                {EBPF_OP_CALL, 0, 0, 0, 2},
+                {EBPF_OP_MOV64_REG, 0, 7, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "local calls",
+            {
+                {EBPF_OP_LDXDW, 1, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+                {EBPF_OP_STXDW, 10, 6, -8, 0},
+                {EBPF_OP_CALL, 0, 1, 0, 4},
+                {EBPF_OP_LDXDW, 2, 10, -8, 0},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+                {EBPF_OP_STXDW, 10, 6, -8, 0},
+                {EBPF_OP_MUL64_IMM, 1, 0, 0, 3},
+                {EBPF_OP_CALL, 0, 1, 0, 3},
+                {EBPF_OP_LDXDW, 2, 10, -8, 0},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 7},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "out of bounds",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_AND64_IMM, 2, 0, 0, 0x3f},
+                {EBPF_OP_LSH64_IMM, 2, 0, 0, 3},
+                {EBPF_OP_ADD64_REG, 2, 1, 0, 0},
+                {EBPF_OP_LDXDW, 0, 2, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "unbounded recursion",
+            {
+                {EBPF_OP_CALL, 0, 1, 0, -1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+    };
+
+    bool success = true;
+    for (const auto& test : tests) {
+        for (bool use_dispatcher : {false, true}) {
+            if (!run_test_case(test, use_dispatcher)) {
+                success = false;
+            }
+        }
+    }
+    success = test_instruction_limit() && success;
+    success = test_no_copy() && success;
+
+    std::cout << (success ? "PASSED" : "FAILED") << std::endl;
+    return success ? 0 : 1;
+}
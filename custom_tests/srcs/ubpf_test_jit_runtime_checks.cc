@@ -0,0 +1,224 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the run-time checks in JIT'd code.
+ * This test verifies that programs that pass the interpreter's checks return the
+ * same result from the JIT'd code with bounds checks, an instruction limit and
+ * nested local calls, and, on arm64 (where the JIT'd code checks, too), that:
+ * 1. Out-of-bounds loads, stores and atomic operations stop the program (which
+ *    returns UINT64_MAX)
+ * 2. Accesses that are in neither the memory nor the stack are allowed if the
+ *    registered bounds check function allows them
+ * 3. Loops are stopped when the instruction limit is exceeded
+ * 4. Local calls are stopped when they nest deeper than UBPF_MAX_CALL_DEPTH
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define JIT_CHECKS_SUPPORTED 1
+#else
+#define JIT_CHECKS_SUPPORTED 0
+#endif
+
+// Memory outside the program's memory and stack that the bounds check function allows.
+static uint64_t extra_memory[4];
+
+static bool
+allow_extra_memory(void* user_context, uint64_t addr, uint64_t size)
+{
+    (void)user_context;
+    return addr >= reinterpret_cast<uint64_t>(extra_memory) &&
+           addr + size <= reinterpret_cast<uint64_t>(extra_memory + 4);
+}
+
+struct check_settings
+{
+    uint32_t instruction_limit;
+    bool bounds_check_function;
+};
+
+// Run the program in the interpreter and the JIT'd code. The results must be the same
+// if the interpreter succeeds; otherwise, the JIT'd code (if it checks) must stop the
+// program, too.
+static bool
+compare_with_interpreter(const std::string& name, const std::vector<ebpf_inst>& program, check_settings settings)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, [settings](ubpf_vm_up& vm, std::string&) {
+        ubpf_set_instruction_limit(vm.get(), settings.instruction_limit, nullptr);
+        if (settings.bounds_check_function) {
+            ubpf_register_data_bounds_check(vm.get(), nullptr, allow_extra_memory);
+        }
+        return true;
+    });
+    if (!vm) {
+        std::cerr << name << ": " << error << std::endl;
+        return false;
+    }
+    char* errmsg = nullptr;
+    ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+    if (fn == nullptr) {
+        std::cerr << name << ": failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        return false;
+    }
+
+    uint64_t interpreted_memory[4] = {1, 2, 3, reinterpret_cast<uint64_t>(extra_memory)};
+    uint64_t expected;
+    bool interpreter_succeeded =
+        ubpf_exec(vm.get(), interpreted_memory, sizeof(interpreted_memory), &expected) == 0;
+    if (!interpreter_succeeded && !JIT_CHECKS_SUPPORTED) {
+        // The JIT'd code would not stop the program.
+        return true;
+    }
+
+    uint64_t jitted_memory[4] = {1, 2, 3, reinterpret_cast<uint64_t>(extra_memory)};
+    uint64_t result = fn(jitted_memory, sizeof(jitted_memory));
+    if (!interpreter_succeeded) {
+        expected = UINT64_MAX;
+    }
+    if (result != expected) {
+        std::cerr << name << ": the JIT'd code returned " << std::hex << result << "; expected " << expected
+                  << std::dec << (interpreter_succeeded ? "" : " (the interpreter failed)") << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool
+test_bounds()
+{
+    struct
+    {
+        const char* name;
+        std::vector<ebpf_inst> program;
+    } programs[] = {
+        {"load in bounds", {{EBPF_OP_LDXDW, 0, 1, 16, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+        {"load past the end", {{EBPF_OP_LDXDW, 0, 1, 25, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+        {"byte load before the start", {{EBPF_OP_LDXB, 0, 1, -1, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+        {"store past the end",
+         {{EBPF_OP_STDW, 1, 0, 32, 7}, {EBPF_OP_MOV64_IMM, 0, 0, 0, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+        {"atomic add past the end",
+         {{EBPF_OP_MOV64_IMM, 2, 0, 0, 1},
+          {EBPF_OP_ATOMIC_STORE, 1, 2, 32, EBPF_ALU_OP_ADD},
+          {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+        {"stack access through a copy of r10",
+         {{EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+          {EBPF_OP_STDW, 10, 0, -8, 5},
+          {EBPF_OP_LDXDW, 0, 2, -8, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+        {"load above the stack",
+         {{EBPF_OP_MOV64_REG, 2, 10, 0, 0}, {EBPF_OP_LDXDW, 0, 2, 0, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+        {"load below the stack", {{EBPF_OP_LDXDW, 0, 10, -4104, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+        {"store and load outside the memory and the stack",
+         {{EBPF_OP_LDXDW, 2, 1, 24, 0},
+          {EBPF_OP_MOV64_IMM, 3, 0, 0, 42},
+          {EBPF_OP_STXDW, 2, 3, 8, 0},
+          {EBPF_OP_LDXDW, 0, 2, 8, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}}},
+    };
+    for (const auto& program : programs) {
+        for (bool bounds_check_function : {false, true}) {
+            if (!compare_with_interpreter(program.name, program.program, {0, bounds_check_function})) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+test_instruction_limit()
+{
+    // An unconditional and a conditional loop (which counts to 100 in 202 instructions).
+    std::vector<ebpf_inst> infinite_loop = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_JA, 0, 0, -2, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::vector<ebpf_inst> counted_loop = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_JLT_IMM, 0, 0, -2, 100},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    return compare_with_interpreter("infinite loop", infinite_loop, {1000, false}) &&
+           compare_with_interpreter("counted loop", counted_loop, {1000, false}) &&
+           compare_with_interpreter("counted loop over the limit", counted_loop, {100, false}) &&
+           compare_with_interpreter("counted loop at the limit", counted_loop, {202, false}) &&
+           compare_with_interpreter("counted loop one over the limit", counted_loop, {201, false}) &&
+           compare_with_interpreter("counted loop without a limit", counted_loop, {0, false});
+}
+
+static bool
+test_call_depth()
+{
+    // Every function calls the next one; the last one uses its stack.
+    for (int depth = UBPF_MAX_CALL_DEPTH - 1; depth <= UBPF_MAX_CALL_DEPTH + 1; depth++) {
+        std::vector<ebpf_inst> program = {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0}};
+        for (int i = 0; i < depth; i++) {
+            program.push_back({EBPF_OP_CALL, 0, 1, 0, 1});
+            program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+        }
+        program.push_back({EBPF_OP_STDW, 10, 0, -8, 1});
+        program.push_back({EBPF_OP_LDXDW, 0, 10, -8, 0});
+        program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+        if (!compare_with_interpreter("calls nested " + std::to_string(depth) + " deep", program, {0, false})) {
+            return false;
+        }
+    }
+
+    std::vector<ebpf_inst> recursion = {
+        {EBPF_OP_CALL, 0, 1, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_CALL, 0, 1, 0, -1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    return compare_with_interpreter("unbounded recursion", recursion, {0, false});
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (!ubpf_native_jit_available()) {
+        std::cout << "JIT not supported on this platform; skipping" << std::endl;
+        return 0;
+    }
+
+    struct
+    {
+        const char* name;
+        bool (*run)();
+    } tests[] = {
+        {"bounds checks", test_bounds},
+        {"instruction limit", test_instruction_limit},
+        {"call depth", test_call_depth},
+    };
+    for (const auto& test : tests) {
+        if (!test.run()) {
+            std::cerr << "FAILED: " << test.name << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: " << test.name << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test translating the local functions of a program on several threads with ubpf_set_jit_threads().
+ * This test verifies that:
+ * 1. A program of many local functions (with branches, stack accesses, helper calls
+ *    and LDDWs) translates to the same code on 1, 2, 4 and 16 threads
+ * 2. The program compiled on several threads returns the same result as the interpreter
+ * 3. A buffer that is too small for the code still fails the translation
+ * 4. 0 threads and more than UBPF_MAX_JIT_THREADS threads are rejected
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static const int function_count = 48;
+
+static uint64_t
+mix_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return (p0 ^ (p1 << 1)) + 1;
+}
+
+/*
+ * The main function passes the value in the context through every local function in
+ * turn. Function k mixes its argument with k, using a branch, the stack, an LDDW and,
+ * for every third function, helper 1.
+ */
+static std::vector<ebpf_inst>
+generate_program()
+{
+    std::vector<ebpf_inst> program;
+    program.push_back({EBPF_OP_LDXDW, 6, 1, 0, 0});
+    std::vector<size_t> calls;
+    for (int k = 0; k < function_count; k++) {
+        program.push_back({EBPF_OP_MOV64_REG, 1, 6, 0, 0});
+        calls.push_back(program.size());
+        program.push_back({EBPF_OP_CALL, 0, 1, 0, 0}); // Patched below.
+        program.push_back({EBPF_OP_MOV64_REG, 6, 0, 0, 0});
+    }
+    program.push_back({EBPF_OP_MOV64_REG, 0, 6, 0, 0});
+    program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+
+    for (int k = 0; k < function_count; k++) {
+        program[calls[k]].imm = static_cast<int32_t>(program.size() - calls[k] - 1);
+        program.push_back({EBPF_OP_MOV64_REG, 0, 1, 0, 0});
+        program.push_back({EBPF_OP_STXDW, 10, 1, -8, 0});
+        for (int j = 0; j < 8; j++) {
+            program.push_back({EBPF_OP_MUL64_IMM, 0, 0, 0, 0x3779b1e5 + k});
+            program.push_back({EBPF_OP_MOV64_REG, 2, 0, 0, 0});
+            program.push_back({EBPF_OP_RSH64_IMM, 2, 0, 0, 17 + j});
+            program.push_back({EBPF_OP_XOR64_REG, 0, 2, 0, 0});
+        }
+        program.push_back({EBPF_OP_LDDW, 3, 0, 0, k});
+        program.push_back({0, 0, 0, 0, 0x1234});
+        program.push_back({EBPF_OP_JGT_REG, 0, 3, 1, 0});
+        program.push_back({EBPF_OP_ADD64_REG, 0, 3, 0, 0});
+        program.push_back({EBPF_OP_LDXDW, 4, 10, -8, 0});
+        program.push_back({EBPF_OP_ADD64_REG, 0, 4, 0, 0});
+        if (k % 3 == 0) {
+            program.push_back({EBPF_OP_MOV64_REG, 1, 0, 0, 0});
+            program.push_back({EBPF_OP_MOV64_IMM, 2, 0, 0, k});
+            program.push_back({EBPF_OP_CALL, 0, 0, 0, 1});
+        }
+        program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    }
+    return program;
+}
+
+static bool
+register_mix(ubpf_vm_up& vm, std::string& error)
+{
+    (void)error;
+    return ubpf_register(vm.get(), 1, "mix", mix_helper) == 0;
+}
+
+static bool
+translate(ubpf_vm* vm, size_t buffer_size, std::vector<uint8_t>& code, std::string& error)
+{
+    code.assign(buffer_size, 0);
+    size_t size = code.size();
+    char* errmsg = nullptr;
+    if (ubpf_translate(vm, code.data(), &size, &errmsg) != 0) {
+        error = errmsg != nullptr ? errmsg : "unknown error";
+        free(errmsg);
+        return false;
+    }
+    code.resize(size);
+    return true;
+}
+
+int
+main()
+{
+    if (!ubpf_native_jit_available()) {
+        std::cout << "SKIPPED: JIT not supported on this architecture" << std::endl;
+        return 0;
+    }
+
+    std::vector<ebpf_inst> program = generate_program();
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, register_mix);
+    if (!vm) {
+        std::cerr << "FAILED: " << error << std::endl;
+        return 1;
+    }
+
+    if (ubpf_set_jit_threads(vm.get(), 0) == 0 || ubpf_set_jit_threads(vm.get(), UBPF_MAX_JIT_THREADS + 1) == 0) {
+        std::cerr << "FAILED: an invalid number of JIT threads was accepted" << std::endl;
+        return 1;
+    }
+
+    const size_t buffer_size = 1024 * 1024;
+    std::vector<uint8_t> serial_code;
+    if (ubpf_set_jit_threads(vm.get(), 1) != 0 || !translate(vm.get(), buffer_size, serial_code, error)) {
+        std::cerr << "FAILED: could not translate the program on one thread: " << error << std::endl;
+        return 1;
+    }
+
+    for (unsigned int threads : {2u, 4u, 16u}) {
+        std::vector<uint8_t> code;
+        if (ubpf_set_jit_threads(vm.get(), threads) != 0 || !translate(vm.get(), buffer_size, code, error)) {
+            std::cerr << "FAILED: could not translate the program on " << threads << " threads: " << error
+                      << std::endl;
+            return 1;
+        }
+        if (code != serial_code) {
+            std::cerr << "FAILED: the program translated on " << threads
+                      << " threads differs from its translation on one thread" << std::endl;
+            return 1;
+        }
+    }
+
+    // The code is larger than the buffer, but every function fits in it on its own.
+    std::vector<uint8_t> code;
+    if (translate(vm.get(), serial_code.size() - 1, code, error)) {
+        std::cerr << "FAILED: the program was translated into a buffer that is too small" << std::endl;
+        return 1;
+    }
+    if (error.find("Target buffer too small") == std::string::npos) {
+        std::cerr << "FAILED: unexpected error for a buffer that is too small: " << error << std::endl;
+        return 1;
+    }
+
+    uint64_t memory = 0x0123456789abcdefULL;
+    uint64_t expected = 0;
+    if (ubpf_exec(vm.get(), &memory, sizeof(memory), &expected) != 0) {
+        std::cerr << "FAILED: the program failed in the interpreter" << std::endl;
+        return 1;
+    }
+    char* errmsg = nullptr;
+    ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+    if (fn == nullptr) {
+        std::cerr << "FAILED: could not compile the program: " << (errmsg != nullptr ? errmsg : "") << std::endl;
+        free(errmsg);
+        return 1;
+    }
+    uint64_t result = fn(&memory, sizeof(memory));
+    if (result != expected) {
+        std::cerr << "FAILED: the program returned " << result << " in the JIT instead of " << expected << std::endl;
+        return 1;
+    }
+
+    std::cout << "PASSED: " << function_count << " local functions translated on several threads match the "
+              << "translation on one thread" << std::endl;
+    return 0;
+}
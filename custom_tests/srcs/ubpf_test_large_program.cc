@@ -0,0 +1,133 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the JIT with a program whose code is larger than a short branch reaches.
+ * This test verifies that a program with ~32K bounds-checked loads (several MB of
+ * arm64 code) compiles and computes the same results as the interpreter when:
+ * 1. Conditional and single-bit-test jumps skip all of the loads
+ * 2. A loop jumps back over all of them
+ * 3. Helpers are called at either end of the code
+ * 4. The run-time checks jump to the out-of-line code at the start of it
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static const int loads = 32000;
+static const int iterations = 3;
+
+static uint64_t
+combine(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e)
+{
+    (void)c;
+    (void)d;
+    (void)e;
+    return a * 3 + b;
+}
+
+static std::vector<ebpf_inst>
+large_program()
+{
+    std::vector<ebpf_inst> program = {
+        {EBPF_OP_LDXDW, 6, 1, 0, 0},
+        {EBPF_OP_MOV64_REG, 8, 1, 0, 0},
+        {EBPF_OP_MOV64_IMM, 7, 0, 0, 0},
+        {EBPF_OP_MOV64_IMM, 9, 0, 0, 0},
+    };
+    // loop:
+    int16_t loop = static_cast<int16_t>(program.size());
+    program.push_back({EBPF_OP_MOV64_REG, 1, 6, 0, 0});
+    program.push_back({EBPF_OP_MOV64_IMM, 2, 0, 0, 5});
+    program.push_back({EBPF_OP_CALL, 0, 0, 0, 0});
+    program.push_back({EBPF_OP_ADD64_REG, 9, 0, 0, 0});
+    program.push_back({EBPF_OP_MOV64_IMM, 0, 0, 0, 0});
+    program.push_back({EBPF_OP_JEQ_IMM, 6, 0, loads + 1, 0});
+    program.push_back({EBPF_OP_JSET_IMM, 6, 0, loads, 2});
+    for (int i = 0; i < loads; i++) {
+        program.push_back({EBPF_OP_LDXDW, 0, 8, static_cast<int16_t>(8 * (i % 3 + 1)), 0});
+    }
+    program.push_back({EBPF_OP_ADD64_REG, 9, 0, 0, 0});
+    program.push_back({EBPF_OP_ADD64_IMM, 7, 0, 0, 1});
+    program.push_back(
+        {EBPF_OP_JLT_IMM, 7, 0, static_cast<int16_t>(loop - static_cast<int>(program.size()) - 1), iterations});
+    program.push_back({EBPF_OP_MOV64_REG, 1, 9, 0, 0});
+    program.push_back({EBPF_OP_MOV64_IMM, 2, 0, 0, 1});
+    program.push_back({EBPF_OP_CALL, 0, 0, 0, 0});
+    program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    return program;
+}
+
+static bool
+compare_with_interpreter(const std::vector<ebpf_inst>& program, uint32_t instruction_limit)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, [instruction_limit](ubpf_vm_up& vm, std::string&) {
+        ubpf_set_jit_code_size(vm.get(), 16 * 1024 * 1024);
+        ubpf_set_instruction_limit(vm.get(), instruction_limit, nullptr);
+        ubpf_register(vm.get(), 0, "combine", as_external_function_t(reinterpret_cast<void*>(combine)));
+        return true;
+    });
+    if (!vm) {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    char* errmsg = nullptr;
+    ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+    if (fn == nullptr) {
+        std::cerr << "Failed to compile program: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        return false;
+    }
+
+    // The low two bits of the first word decide whether the loads are skipped.
+    for (uint64_t input : {0, 1, 2, 3}) {
+        uint64_t memory[4] = {input, 10, 20, 30};
+        uint64_t expected;
+        if (ubpf_exec(vm.get(), memory, sizeof(memory), &expected) != 0) {
+            std::cerr << "Interpreter failed on input " << input << std::endl;
+            return false;
+        }
+        uint64_t result = fn(memory, sizeof(memory));
+        if (result != expected) {
+            std::cerr << "Input " << input << " returned " << result << " from the JIT'd code but " << expected
+                      << " from the interpreter" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if (!ubpf_native_jit_available()) {
+        std::cout << "JIT not supported on this platform; skipping" << std::endl;
+        return 0;
+    }
+
+    std::vector<ebpf_inst> program = large_program();
+    for (uint32_t instruction_limit : {0U, 1000000U}) {
+        if (!compare_with_interpreter(program, instruction_limit)) {
+            std::cerr << "FAILED: large program" << (instruction_limit ? " with an instruction limit" : "")
+                      << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: large program" << (instruction_limit ? " with an instruction limit" : "") << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,220 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the JIT'd atomic operations with and without ARMv8.1 LSE instructions.
+ * This test verifies that:
+ * 1. LSE atomics are enabled by default exactly when the processor supports them
+ *    (ubpf_toggle_lse_atomics reports the previous setting)
+ * 2. Every 32- and 64-bit atomic operation, with and without fetch, computes the
+ *    same result and leaves the same value in memory as the interpreter
+ * 3. Atomic adds and a compare-and-exchange loop do not lose updates when several
+ *    threads run them on the same counters
+ * Both the LSE and the LDXR/STXR code paths are tested on arm64 processors with LSE;
+ * on other processors (and architectures), the only available path is tested.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+// The memory the programs that test a single operation run on.
+struct atomic_context
+{
+    uint64_t operand;
+    uint64_t expected;
+    uint64_t target;
+};
+
+static const int contention_threads = 4;
+static const int contention_iterations = 20000;
+
+// Loads programs with LSE atomics on or off.
+static custom_test_fixup_cb
+toggle_lse_atomics(bool lse)
+{
+    return [lse](ubpf_vm_up& vm, std::string&) {
+        ubpf_toggle_lse_atomics(vm.get(), lse);
+        return true;
+    };
+}
+
+static ubpf_jit_fn
+compile(ubpf_vm* vm)
+{
+    char* errmsg = nullptr;
+    ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+    if (fn == nullptr) {
+        std::cerr << "Failed to compile program: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+    }
+    return fn;
+}
+
+static bool
+test_single_operations(bool lse)
+{
+    const uint64_t initial_target = 0x0123456789abcdefULL;
+    const uint64_t operand = 0xf0f0f0f00f0f0f0fULL;
+
+    for (uint8_t opcode : {EBPF_OP_ATOMIC_STORE, EBPF_OP_ATOMIC32_STORE}) {
+        for (int32_t imm :
+             {EBPF_ALU_OP_ADD,
+              EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH,
+              EBPF_ALU_OP_OR,
+              EBPF_ALU_OP_OR | EBPF_ATOMIC_OP_FETCH,
+              EBPF_ALU_OP_AND,
+              EBPF_ALU_OP_AND | EBPF_ATOMIC_OP_FETCH,
+              EBPF_ALU_OP_XOR,
+              EBPF_ALU_OP_XOR | EBPF_ATOMIC_OP_FETCH,
+              EBPF_ATOMIC_OP_XCHG,
+              EBPF_ATOMIC_OP_CMPXCHG}) {
+            // r0 = expected; atomic op on target with operand; return r0 * 31 + r2.
+            std::vector<ebpf_inst> program = {
+                {EBPF_OP_LDXDW, 2, 1, offsetof(atomic_context, operand), 0},
+                {EBPF_OP_LDXDW, 0, 1, offsetof(atomic_context, expected), 0},
+                {opcode, 1, 2, offsetof(atomic_context, target), imm},
+                {EBPF_OP_MUL64_IMM, 0, 0, 0, 31},
+                {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            };
+            std::string error;
+            ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, toggle_lse_atomics(lse));
+            if (!vm) {
+                std::cerr << error << std::endl;
+                return false;
+            }
+            ubpf_jit_fn fn = compile(vm.get());
+            if (fn == nullptr) {
+                return false;
+            }
+
+            // For CMPXCHG, both a matching and a mismatching expected value.
+            for (uint64_t expected : {initial_target, initial_target ^ 1}) {
+                atomic_context interpreted = {operand, expected, initial_target};
+                atomic_context jitted = interpreted;
+                uint64_t expected_result;
+                if (ubpf_exec(vm.get(), &interpreted, sizeof(interpreted), &expected_result) != 0) {
+                    std::cerr << "Interpreter failed" << std::endl;
+                    return false;
+                }
+                uint64_t result = fn(&jitted, sizeof(jitted));
+                if (result != expected_result || jitted.target != interpreted.target) {
+                    std::cerr << "Atomic operation " << std::hex << static_cast<int>(opcode) << "/" << imm
+                              << (lse ? " with" : " without") << " LSE returned " << result << " and left "
+                              << jitted.target << "; the interpreter returned " << expected_result << " and left "
+                              << interpreted.target << std::dec << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+test_contention(bool lse)
+{
+    // Every iteration adds 1 to the first counter (64-bit, no fetch) and to the
+    // second one (32-bit, fetch), and increments the third with a CMPXCHG loop.
+    std::vector<ebpf_inst> program = {
+        {EBPF_OP_MOV64_IMM, 3, 0, 0, 0},
+        // loop:
+        {EBPF_OP_MOV64_IMM, 2, 0, 0, 1},
+        {EBPF_OP_ATOMIC_STORE, 1, 2, 0, EBPF_ALU_OP_ADD},
+        {EBPF_OP_MOV64_IMM, 4, 0, 0, 1},
+        {EBPF_OP_ATOMIC32_STORE, 1, 4, 8, EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH},
+        // retry:
+        {EBPF_OP_LDXDW, 6, 1, 16, 0},
+        {EBPF_OP_MOV64_REG, 0, 6, 0, 0},
+        {EBPF_OP_MOV64_REG, 5, 6, 0, 0},
+        {EBPF_OP_ADD64_IMM, 5, 0, 0, 1},
+        {EBPF_OP_ATOMIC_STORE, 1, 5, 16, EBPF_ATOMIC_OP_CMPXCHG},
+        {EBPF_OP_JNE_REG, 0, 6, -6, 0},
+        {EBPF_OP_ADD64_IMM, 3, 0, 0, 1},
+        {EBPF_OP_JLT_IMM, 3, 0, -12, contention_iterations},
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, toggle_lse_atomics(lse));
+    if (!vm) {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    ubpf_jit_fn fn = compile(vm.get());
+    if (fn == nullptr) {
+        return false;
+    }
+
+    uint64_t counters[3] = {0, 0, 0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < contention_threads; i++) {
+        threads.emplace_back([&]() { fn(counters, sizeof(counters)); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    uint64_t expected = static_cast<uint64_t>(contention_threads) * contention_iterations;
+    if (counters[0] != expected || counters[1] != expected || counters[2] != expected) {
+        std::cerr << "Lost updates" << (lse ? " with" : " without") << " LSE: counters are " << counters[0] << ", "
+                  << counters[1] << " and " << counters[2] << "; expected " << expected << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (!vm) {
+        return 1;
+    }
+    bool lse_supported = ubpf_toggle_lse_atomics(vm.get(), false);
+    if (ubpf_toggle_lse_atomics(vm.get(), lse_supported)) {
+        std::cerr << "FAILED: ubpf_toggle_lse_atomics did not return the previous setting" << std::endl;
+        return 1;
+    }
+#if !defined(__aarch64__) && !defined(_M_ARM64)
+    if (lse_supported) {
+        std::cerr << "FAILED: LSE atomics are enabled on a processor that is not arm64" << std::endl;
+        return 1;
+    }
+#endif
+    std::cout << "LSE atomics are " << (lse_supported ? "" : "not ") << "supported" << std::endl;
+
+    if (!ubpf_native_jit_available()) {
+        return 0;
+    }
+
+    std::vector<bool> settings = {false};
+    if (lse_supported) {
+        settings.push_back(true);
+    }
+    for (bool lse : settings) {
+        if (!test_single_operations(lse) || !test_contention(lse)) {
+            std::cerr << "FAILED: atomics" << (lse ? " with" : " without") << " LSE" << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: atomics" << (lse ? " with" : " without") << " LSE" << std::endl;
+    }
+
+    return 0;
+}
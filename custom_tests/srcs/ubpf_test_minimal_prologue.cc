@@ -0,0 +1,238 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test that the JIT only saves the callee-saved registers a program uses.
+ * This test verifies that:
+ * 1. Programs that use different subsets of r6 to r10 (directly, through
+ *    helper calls or through local calls) compute the same results in the
+ *    JIT'd code as in the interpreter, in both JIT modes
+ * 2. A program that keeps a value in a volatile register gets a shorter
+ *    prologue and epilogue than the same program using a callee-saved one
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+struct prologue_test_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+};
+
+static uint64_t
+scramble(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    return p0 * 3 + p1 * 5 + p2 * 7 + p3 * 11 + p4 * 13;
+}
+
+static bool
+register_scramble(ubpf_vm_up& vm, std::string& error)
+{
+    (void)error;
+    return ubpf_register(vm.get(), 1, "scramble", scramble) == 0;
+}
+
+static size_t
+translated_size(const std::vector<ebpf_inst>& program)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, register_scramble);
+    if (!vm) {
+        std::cerr << error << std::endl;
+        return 0;
+    }
+    std::vector<uint8_t> code(65536);
+    size_t size = code.size();
+    char* errmsg = nullptr;
+    if (ubpf_translate(vm.get(), code.data(), &size, &errmsg) != 0) {
+        std::cerr << "Failed to translate program: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        return 0;
+    }
+    return size;
+}
+
+static bool
+run_test_case(const prologue_test_case& test)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error, register_scramble);
+    if (!vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+
+    if (!ubpf_native_jit_available()) {
+        return true;
+    }
+
+    char* errmsg = nullptr;
+    ubpf_jit_fn basic_fn = ubpf_compile(vm.get(), &errmsg);
+    if (basic_fn == nullptr) {
+        std::cerr << test.name << ": failed to compile: " << errmsg << std::endl;
+        free(errmsg);
+        return false;
+    }
+    ubpf_vm_up extended_vm = ubpf_load_custom_test_program(test.program, error, register_scramble);
+    if (!extended_vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+    ubpf_jit_ex_fn extended_fn = ubpf_compile_ex(extended_vm.get(), &errmsg, ExtendedJitMode);
+    if (extended_fn == nullptr) {
+        std::cerr << test.name << ": failed to compile in extended mode: " << errmsg << std::endl;
+        free(errmsg);
+        return false;
+    }
+
+    for (uint64_t input : {0ULL, 1ULL, 7ULL, 0x123456789ULL}) {
+        uint64_t memory = input;
+        uint64_t expected;
+        if (ubpf_exec(vm.get(), &memory, sizeof(memory), &expected) != 0) {
+            std::cerr << test.name << ": interpreter failed" << std::endl;
+            return false;
+        }
+
+        memory = input;
+        uint64_t basic = basic_fn(&memory, sizeof(memory));
+
+        std::vector<uint8_t> stack(UBPF_EBPF_STACK_SIZE);
+        memory = input;
+        uint64_t extended = extended_fn(&memory, sizeof(memory), stack.data(), stack.size());
+
+        if (basic != expected || extended != expected) {
+            std::cerr << test.name << ": input " << input << " returned " << basic << " (basic) and " << extended
+                      << " (extended) from the JIT'd code but " << expected << " from the interpreter" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    std::vector<prologue_test_case> tests = {
+        {
+            "volatile registers only",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 42},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "one callee-saved register",
+            {
+                {EBPF_OP_LDXDW, 7, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 7, 0, 0},
+                {EBPF_OP_MUL64_IMM, 0, 0, 0, 3},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "stack without callee-saved registers",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_STXDW, 10, 2, -8, 0},
+                {EBPF_OP_LDXDW, 0, 10, -8, 0},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            "all callee-saved registers",
+            {
+                {EBPF_OP_LDXDW, 6, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 7, 6, 0, 0},
+                {EBPF_OP_ADD64_IMM, 7, 0, 0, 1},
+                {EBPF_OP_MOV64_REG, 8, 7, 0, 0},
+                {EBPF_OP_ADD64_IMM, 8, 0, 0, 2},
+                {EBPF_OP_MOV64_REG, 9, 8, 0, 0},
+                {EBPF_OP_ADD64_IMM, 9, 0, 0, 3},
+                {EBPF_OP_STXDW, 10, 9, -16, 0},
+                {EBPF_OP_LDXDW, 0, 10, -16, 0},
+                {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 7, 0, 0},
+                {EBPF_OP_ADD64_REG, 0, 8, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            // The helper clobbers the volatile registers; r6 has to survive the call.
+            "helper call",
+            {
+                {EBPF_OP_LDXDW, 6, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+                {EBPF_OP_MOV64_IMM, 2, 0, 0, 2},
+                {EBPF_OP_MOV64_IMM, 3, 0, 0, 3},
+                {EBPF_OP_MOV64_IMM, 4, 0, 0, 4},
+                {EBPF_OP_MOV64_IMM, 5, 0, 0, 5},
+                {EBPF_OP_CALL, 0, 0, 0, 1},
+                {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+        {
+            // The local call adjusts r10 even though the program never names it.
+            "local call",
+            {
+                {EBPF_OP_LDXDW, 1, 1, 0, 0},
+                {EBPF_OP_CALL, 0, 1, 0, 2},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 5},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+                {EBPF_OP_LSH64_IMM, 0, 0, 0, 1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+        },
+    };
+
+    for (const auto& test : tests) {
+        if (!run_test_case(test)) {
+            std::cerr << "FAILED: " << test.name << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: " << test.name << std::endl;
+    }
+
+    if (ubpf_native_jit_available()) {
+        // The same program, once with r2 and once with r6 holding the value.
+        std::vector<ebpf_inst> volatile_program = {
+            {EBPF_OP_MOV64_IMM, 2, 0, 0, 1},
+            {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+            {EBPF_OP_EXIT, 0, 0, 0, 0},
+        };
+        std::vector<ebpf_inst> callee_saved_program = {
+            {EBPF_OP_MOV64_IMM, 6, 0, 0, 1},
+            {EBPF_OP_MOV64_REG, 0, 6, 0, 0},
+            {EBPF_OP_EXIT, 0, 0, 0, 0},
+        };
+        size_t volatile_size = translated_size(volatile_program);
+        size_t callee_saved_size = translated_size(callee_saved_program);
+        if (volatile_size == 0 || volatile_size >= callee_saved_size) {
+            std::cerr << "FAILED: the program that only uses volatile registers translated to " << volatile_size
+                      << " bytes and the one that uses r6 to " << callee_saved_size << " bytes" << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: prologue size" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,230 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test compiling many VMs on several threads at once.
+ * This test verifies that:
+ * 1. Translating a VM's program while other threads translate other VMs, each
+ *    with its own register mapping, produces the same machine code as
+ *    translating it on its own
+ * 2. Programs compiled at the same time compute the same results as the
+ *    interpreter
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+
+    // Testing only: change the mapping between native and eBPF registers that a VM is compiled with.
+    void
+    ubpf_set_register_offset(struct ubpf_vm* vm, int x);
+}
+
+#include "ubpf_custom_test_support.h"
+
+static const int thread_count = 4;
+static const int repetitions = 25;
+static const size_t buffer_size = 65536;
+
+static uint64_t
+mix_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return (p0 ^ (p1 << 1)) + 1;
+}
+
+// A loop of ALU operations over *(u64*)r1 iterations.
+static const std::vector<ebpf_inst> alu_program = {
+    {EBPF_OP_LDXDW, 6, 1, 0, 0},
+    {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+    {EBPF_OP_MOV64_IMM, 7, 0, 0, 0},
+    {EBPF_OP_JGE_REG, 7, 6, 7, 0},
+    {EBPF_OP_ADD64_REG, 0, 7, 0, 0},
+    {EBPF_OP_MUL64_IMM, 0, 0, 0, 0x3779b1e5},
+    {EBPF_OP_MOV64_REG, 2, 0, 0, 0},
+    {EBPF_OP_RSH64_IMM, 2, 0, 0, 29},
+    {EBPF_OP_XOR64_REG, 0, 2, 0, 0},
+    {EBPF_OP_ADD64_IMM, 7, 0, 0, 1},
+    {EBPF_OP_JA, 0, 0, -8, 0},
+    {EBPF_OP_EXIT, 0, 0, 0, 0},
+};
+
+// Divides and spills to the stack.
+static const std::vector<ebpf_inst> stack_program = {
+    {EBPF_OP_LDXDW, 2, 1, 0, 0},
+    {EBPF_OP_ADD64_IMM, 2, 0, 0, 7},
+    {EBPF_OP_STXDW, 10, 2, -8, 0},
+    {EBPF_OP_MOV64_IMM, 3, 0, 0, 1000003},
+    {EBPF_OP_DIV64_REG, 3, 2, 0, 0},
+    {EBPF_OP_STXDW, 10, 3, -16, 0},
+    {EBPF_OP_LDXDW, 4, 10, -8, 0},
+    {EBPF_OP_MOD64_IMM, 4, 0, 0, 5},
+    {EBPF_OP_LDXDW, 0, 10, -16, 0},
+    {EBPF_OP_LSH64_IMM, 0, 0, 0, 4},
+    {EBPF_OP_OR64_REG, 0, 4, 0, 0},
+    {EBPF_OP_EXIT, 0, 0, 0, 0},
+};
+
+// Calls helper 1 and a local function that keeps r6 to r9.
+static const std::vector<ebpf_inst> call_program = {
+    {EBPF_OP_LDXDW, 6, 1, 0, 0},
+    {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+    {EBPF_OP_MOV64_IMM, 2, 0, 0, 3},
+    {EBPF_OP_CALL, 0, 0, 0, 1},
+    {EBPF_OP_MOV64_REG, 1, 0, 0, 0},
+    {EBPF_OP_CALL, 0, 1, 0, 2},
+    {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+    {EBPF_OP_EXIT, 0, 0, 0, 0},
+    {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+    {EBPF_OP_MUL64_IMM, 6, 0, 0, 3},
+    {EBPF_OP_MOV64_REG, 0, 6, 0, 0},
+    {EBPF_OP_EXIT, 0, 0, 0, 0},
+};
+
+struct compile_job
+{
+    ubpf_vm_up vm{nullptr, ubpf_destroy};
+    std::string name;
+    std::vector<uint8_t> expected_code;
+    uint64_t expected_result = 0;
+};
+
+static bool
+translate(ubpf_vm* vm, std::vector<uint8_t>& code, std::string& error)
+{
+    code.assign(buffer_size, 0);
+    size_t size = code.size();
+    char* errmsg = nullptr;
+    if (ubpf_translate(vm, code.data(), &size, &errmsg) != 0) {
+        error = errmsg != nullptr ? errmsg : "unknown error";
+        free(errmsg);
+        return false;
+    }
+    code.resize(size);
+    return true;
+}
+
+int
+main()
+{
+    if (!ubpf_native_jit_available()) {
+        std::cout << "SKIPPED: JIT not supported on this architecture" << std::endl;
+        return 0;
+    }
+
+    const std::vector<std::pair<const char*, const std::vector<ebpf_inst>*>> programs = {
+        {"alu", &alu_program}, {"stack", &stack_program}, {"call", &call_program}};
+    const int register_offsets[] = {0, 1, 5, 999};
+    uint64_t memory = 37;
+
+    // Load every program with every register offset and translate each one on its own.
+    std::vector<compile_job> jobs;
+    for (const auto& [name, code] : programs) {
+        for (int register_offset : register_offsets) {
+            // Like the "no register offset" tests, calls need the default register mapping.
+            if (code == &call_program && register_offset != 0) {
+                continue;
+            }
+            compile_job job;
+            job.name = std::string(name) + " with register offset " + std::to_string(register_offset);
+            std::string error;
+            job.vm = ubpf_load_custom_test_program(*code, error, [register_offset](ubpf_vm_up& vm, std::string&) {
+                ubpf_set_register_offset(vm.get(), register_offset);
+                ubpf_register(vm.get(), 1, "mix", mix_helper);
+                return true;
+            });
+            if (!job.vm) {
+                std::cerr << "FAILED: " << job.name << ": " << error << std::endl;
+                return 1;
+            }
+            if (!translate(job.vm.get(), job.expected_code, error)) {
+                std::cerr << "FAILED: could not translate " << job.name << ": " << error << std::endl;
+                return 1;
+            }
+            if (ubpf_exec(job.vm.get(), &memory, sizeof(memory), &job.expected_result) != 0) {
+                std::cerr << "FAILED: could not interpret " << job.name << std::endl;
+                return 1;
+            }
+            jobs.push_back(std::move(job));
+        }
+    }
+
+    // Translate them again, all at the same time, and then compile them, all at the same time.
+    std::atomic<bool> go{false};
+    std::atomic<int> failures{0};
+    std::vector<std::string> errors(thread_count);
+    std::vector<ubpf_jit_fn> compiled(jobs.size());
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.emplace_back([&, t]() {
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            std::vector<uint8_t> code;
+            for (int repetition = 0; repetition < repetitions; repetition++) {
+                for (size_t i = t; i < jobs.size(); i += thread_count) {
+                    std::string error;
+                    if (!translate(jobs[i].vm.get(), code, error)) {
+                        errors[t] = "could not translate " + jobs[i].name + ": " + error;
+                        failures++;
+                        return;
+                    }
+                    if (code != jobs[i].expected_code) {
+                        errors[t] = jobs[i].name + " translated differently on " + std::to_string(thread_count) +
+                                    " threads";
+                        failures++;
+                        return;
+                    }
+                }
+            }
+            for (size_t i = t; i < jobs.size(); i += thread_count) {
+                char* errmsg = nullptr;
+                compiled[i] = ubpf_compile(jobs[i].vm.get(), &errmsg);
+                if (compiled[i] == nullptr) {
+                    errors[t] = "could not compile " + jobs[i].name + ": " + (errmsg != nullptr ? errmsg : "");
+                    free(errmsg);
+                    failures++;
+                    return;
+                }
+            }
+        });
+    }
+    go = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (failures != 0) {
+        for (const auto& error : errors) {
+            if (!error.empty()) {
+                std::cerr << "FAILED: " << error << std::endl;
+            }
+        }
+        return 1;
+    }
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        uint64_t result = compiled[i](&memory, sizeof(memory));
+        if (result != jobs[i].expected_result) {
+            std::cerr << "FAILED: " << jobs[i].name << " returned " << result << " in the JIT instead of "
+                      << jobs[i].expected_result << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "PASSED: " << jobs.size() << " programs compiled on " << thread_count
+              << " threads match their serial compilation" << std::endl;
+    return 0;
+}
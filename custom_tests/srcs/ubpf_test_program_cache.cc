@@ -0,0 +1,220 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the process-wide program cache.
+ * This test verifies that:
+ * 1. A second VM that loads the same program with the cache enabled shares the
+ *    cached program and its JIT'd code, and each VM still calls its own helpers, in
+ *    the interpreter and in the JIT'd code; a VM with other JIT options compiles
+ *    code of its own
+ * 2. A VM that lacks a helper the cached program calls fails to load it with the
+ *    same error as without the cache
+ * 3. Loads with different options or bytecode, and VMs without the cache, do not
+ *    share the program
+ * 4. The program stays usable until the last VM that shares it unloads it
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static uint64_t
+tenant_a(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return p0 + 100;
+}
+
+static uint64_t
+tenant_b(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return p0 + 200;
+}
+
+// r0 = helper(*(u64*)r1) * 2
+static const std::vector<ebpf_inst> program = {
+    {EBPF_OP_LDXDW, 1, 1, 0, 0},
+    {EBPF_OP_CALL, 0, 0, 0, 1},
+    {EBPF_OP_LSH64_IMM, 0, 0, 0, 1},
+    {EBPF_OP_EXIT, 0, 0, 0, 0},
+};
+
+// Configures a VM with the helper (if any), the program cache and, if not 0, a minimum context size.
+static custom_test_fixup_cb
+configure(external_function_t helper, bool cache, size_t context_size = 0)
+{
+    return [=](ubpf_vm_up& vm, std::string&) {
+        if (helper != nullptr) {
+            ubpf_register(vm.get(), 1, "helper", helper);
+        }
+        if (context_size != 0) {
+            ubpf_set_minimum_context_size(vm.get(), context_size);
+        }
+        ubpf_toggle_program_cache(vm.get(), cache);
+        return true;
+    };
+}
+
+static bool
+check_result(ubpf_vm* vm, const char* name, uint64_t expected)
+{
+    uint64_t memory = 1;
+    uint64_t result = 0;
+    if (ubpf_exec(vm, &memory, sizeof(memory), &result) != 0 || result != expected) {
+        std::cerr << name << ": the interpreter returned " << result << " instead of " << expected << std::endl;
+        return false;
+    }
+    if (ubpf_native_jit_available()) {
+        char* errmsg = nullptr;
+        ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+        if (fn == nullptr) {
+            std::cerr << name << ": failed to compile: " << errmsg << std::endl;
+            free(errmsg);
+            return false;
+        }
+        memory = 1;
+        result = fn(&memory, sizeof(memory));
+        if (result != expected) {
+            std::cerr << name << ": the JIT'd code returned " << result << " instead of " << expected << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+check_jit_hits(const char* step, uint64_t jit_hits)
+{
+    ubpf_program_cache_stats stats;
+    ubpf_get_program_cache_stats(&stats);
+    // Without a native JIT, nothing is compiled.
+    if (!ubpf_native_jit_available()) {
+        jit_hits = 0;
+    }
+    if (stats.jit_hits != jit_hits) {
+        std::cerr << step << ": " << stats.jit_hits << " compilations shared JIT'd code instead of " << jit_hits
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool
+check_stats(const char* step, uint32_t programs, uint64_t hits, uint64_t misses)
+{
+    ubpf_program_cache_stats stats;
+    ubpf_get_program_cache_stats(&stats);
+    if (stats.programs != programs || stats.hits != hits || stats.misses != misses) {
+        std::cerr << step << ": the cache holds " << stats.programs << " programs after " << stats.hits
+                  << " hits and " << stats.misses << " misses instead of " << programs << ", " << hits << " and "
+                  << misses << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    std::string error;
+
+    ubpf_vm_up first = ubpf_load_custom_test_program(program, error, configure(tenant_a, true));
+    ubpf_vm_up second = ubpf_load_custom_test_program(program, error, configure(tenant_b, true));
+    if (!first || !second) {
+        std::cerr << "FAILED: loading the program: " << error << std::endl;
+        return 1;
+    }
+    if (!check_stats("shared load", 1, 1, 1) || !check_result(first.get(), "first VM", 202) ||
+        !check_result(second.get(), "second VM", 402) || !check_jit_hits("shared load", 1)) {
+        std::cerr << "FAILED: shared program" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: shared program" << std::endl;
+
+    // Constant blinding changes the code, so this VM compiles its own.
+    ubpf_vm_up blinded = ubpf_load_custom_test_program(program, error, configure(tenant_b, true));
+    if (!blinded) {
+        std::cerr << "FAILED: loading the program: " << error << std::endl;
+        return 1;
+    }
+    ubpf_toggle_constant_blinding(blinded.get(), true);
+    if (!check_stats("blinded load", 1, 2, 1) || !check_result(blinded.get(), "blinded VM", 402) ||
+        !check_jit_hits("blinded load", 1)) {
+        std::cerr << "FAILED: other JIT options" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: other JIT options" << std::endl;
+
+    std::string uncached_error;
+    if (ubpf_load_custom_test_program(program, error, configure(nullptr, true)) ||
+        ubpf_load_custom_test_program(program, uncached_error, configure(nullptr, false)) ||
+        error != uncached_error || error.find("call to nonexistent function 1 at PC 1") == std::string::npos) {
+        std::cerr << "FAILED: a VM without the helper loaded the program or failed with \"" << error
+                  << "\" instead of \"" << uncached_error << "\"" << std::endl;
+        return 1;
+    }
+    if (!check_stats("missing helper", 1, 3, 1)) {
+        std::cerr << "FAILED: missing helper" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: missing helper" << std::endl;
+
+    std::vector<ebpf_inst> other_program = program;
+    other_program[2].imm = 2;
+    ubpf_vm_up other_options =
+        ubpf_load_custom_test_program(program, error, configure(tenant_a, true, sizeof(uint64_t)));
+    ubpf_vm_up other_code = ubpf_load_custom_test_program(other_program, error, configure(tenant_a, true));
+    ubpf_vm_up uncached = ubpf_load_custom_test_program(program, error, configure(tenant_a, false));
+    if (!other_options || !other_code || !uncached || !check_stats("other loads", 3, 3, 3) ||
+        !check_result(other_options.get(), "other options", 202) ||
+        !check_result(other_code.get(), "other bytecode", 404) || !check_result(uncached.get(), "uncached", 202)) {
+        std::cerr << "FAILED: unshared programs" << std::endl;
+        return 1;
+    }
+    ubpf_range_report report;
+    if (ubpf_get_range_report(other_options.get(), &report) != 0 || ubpf_get_range_report(first.get(), &report) == 0) {
+        std::cerr << "FAILED: the range verifier results were shared between different context sizes" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: unshared programs" << std::endl;
+
+    first.reset();
+    // The second VM still runs the code that the first VM compiled.
+    if (!check_stats("first unloaded", 3, 3, 3) || !check_result(second.get(), "second VM", 402) ||
+        !check_jit_hits("first unloaded", 1)) {
+        std::cerr << "FAILED: unloading a VM that shares the program" << std::endl;
+        return 1;
+    }
+    second.reset();
+    blinded.reset();
+    other_options.reset();
+    other_code.reset();
+    if (!check_stats("all unloaded", 0, 3, 3)) {
+        std::cerr << "FAILED: unloading the last VMs" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: release" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,185 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test running one program in several VMs with ubpf_get_program() and ubpf_load_program().
+ * This test verifies that:
+ * 1. Instances of a program call their own helpers, in the interpreter and in the
+ *    JIT'd code, and get the options and analysis results the program was loaded with
+ * 2. Each instance keeps its own instruction limit
+ * 3. An instance without a helper that the program calls, and a VM that already has
+ *    code, fail to load the program
+ * 4. The program outlives the VM that loaded it and the release of its handle for as
+ *    long as instances run it
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static uint64_t
+add_one(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return p0 + 1;
+}
+
+static uint64_t
+add_two(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return p0 + 2;
+}
+
+// r0 = helper(*(u64*)r1) * 2
+static const std::vector<ebpf_inst> program_code = {
+    {EBPF_OP_LDXDW, 1, 1, 0, 0},
+    {EBPF_OP_CALL, 0, 0, 0, 1},
+    {EBPF_OP_LSH64_IMM, 0, 0, 0, 1},
+    {EBPF_OP_EXIT, 0, 0, 0, 0},
+};
+
+static ubpf_vm_up
+create_instance(external_function_t helper)
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (vm && helper != nullptr) {
+        ubpf_register(vm.get(), 1, "helper", helper);
+    }
+    return vm;
+}
+
+static bool
+check_result(ubpf_vm* vm, const char* name, uint64_t expected)
+{
+    uint64_t memory = 10;
+    uint64_t result = 0;
+    if (ubpf_exec(vm, &memory, sizeof(memory), &result) != 0 || result != expected) {
+        std::cerr << name << ": the interpreter returned " << result << " instead of " << expected << std::endl;
+        return false;
+    }
+    if (ubpf_native_jit_available()) {
+        char* errmsg = nullptr;
+        ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+        if (fn == nullptr) {
+            std::cerr << name << ": failed to compile: " << errmsg << std::endl;
+            free(errmsg);
+            return false;
+        }
+        memory = 10;
+        result = fn(&memory, sizeof(memory));
+        if (result != expected) {
+            std::cerr << name << ": the JIT'd code returned " << result << " instead of " << expected << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    char* errmsg = nullptr;
+
+    ubpf_vm_up empty = create_instance(add_one);
+    if (ubpf_get_program(empty.get(), &errmsg) != nullptr) {
+        std::cerr << "FAILED: got a program from a VM without code" << std::endl;
+        return 1;
+    }
+    free(errmsg);
+
+    ubpf_program* program = nullptr;
+    {
+        std::string error;
+        ubpf_vm_up prototype = ubpf_load_custom_test_program(program_code, error, [](ubpf_vm_up& vm, std::string&) {
+            ubpf_register(vm.get(), 1, "helper", add_one);
+            ubpf_set_minimum_context_size(vm.get(), sizeof(uint64_t));
+            return true;
+        });
+        if (!prototype) {
+            std::cerr << "FAILED: " << error << std::endl;
+            return 1;
+        }
+        program = ubpf_get_program(prototype.get(), &errmsg);
+        if (program == nullptr) {
+            std::cerr << "FAILED: getting the program: " << errmsg << std::endl;
+            free(errmsg);
+            return 1;
+        }
+    }
+
+    ubpf_vm_up first = create_instance(add_one);
+    ubpf_vm_up second = create_instance(add_two);
+    for (ubpf_vm* vm : {first.get(), second.get()}) {
+        if (ubpf_load_program(vm, program, &errmsg) != 0) {
+            std::cerr << "FAILED: loading an instance: " << errmsg << std::endl;
+            free(errmsg);
+            return 1;
+        }
+    }
+    ubpf_range_report report;
+    uint64_t bound;
+    if (!check_result(first.get(), "first instance", 22) || !check_result(second.get(), "second instance", 24) ||
+        ubpf_get_range_report(second.get(), &report) != 0 || report.accesses != 1 || report.proven != 1 ||
+        ubpf_get_instruction_bound(second.get(), &bound) != 0 || bound != 4) {
+        std::cerr << "FAILED: instances" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: instances" << std::endl;
+
+    ubpf_vm_up limited = create_instance(add_one);
+    ubpf_set_instruction_limit(limited.get(), 2, nullptr);
+    uint64_t memory = 10;
+    uint64_t result;
+    if (ubpf_load_program(limited.get(), program, &errmsg) != 0 ||
+        ubpf_exec(limited.get(), &memory, sizeof(memory), &result) == 0 || !check_result(first.get(), "first", 22)) {
+        std::cerr << "FAILED: the instruction limit of one instance" << std::endl;
+        free(errmsg);
+        return 1;
+    }
+    std::cout << "PASSED: instruction limit" << std::endl;
+
+    ubpf_vm_up missing_helper = create_instance(nullptr);
+    if (ubpf_load_program(missing_helper.get(), program, &errmsg) == 0 ||
+        std::string(errmsg).find("call to nonexistent function 1 at PC 1") == std::string::npos) {
+        std::cerr << "FAILED: an instance without the helper loaded the program" << std::endl;
+        free(errmsg);
+        return 1;
+    }
+    free(errmsg);
+    if (ubpf_load_program(first.get(), program, &errmsg) == 0) {
+        std::cerr << "FAILED: a VM with code loaded the program" << std::endl;
+        return 1;
+    }
+    free(errmsg);
+    std::cout << "PASSED: invalid instances" << std::endl;
+
+    ubpf_release_program(program);
+    first.reset();
+    if (!check_result(second.get(), "second instance", 24)) {
+        std::cerr << "FAILED: the program did not outlive its handle" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: release" << std::endl;
+
+    return 0;
+}
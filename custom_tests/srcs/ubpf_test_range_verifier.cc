@@ -0,0 +1,302 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the range verifier (ubpf_set_minimum_context_size).
+ * This test verifies that:
+ * 1. Accesses to the context within the declared size, to the stack, through a spilled
+ *    and filled context pointer, through an index bounded by a branch or by a loop
+ *    condition and to a helper's region after a NULL check are proven in bounds, and
+ *    that accesses the verifier cannot bound are not
+ * 2. Programs return the same results as without the verifier, in the interpreter and
+ *    in the JIT'd code
+ * 3. A program is not run with less memory or stack than it was verified for
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define JIT_CHECKS_SUPPORTED 1
+#else
+#define JIT_CHECKS_SUPPORTED 0
+#endif
+
+static const size_t context_size = 32;
+
+// The region that the region helper returns (or not, if its argument is 0).
+static uint64_t region[2] = {0x1111, 0x2222};
+
+static uint64_t
+region_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return p0 ? reinterpret_cast<uint64_t>(region) : 0;
+}
+
+static uint64_t
+nop_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p0;
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return 0;
+}
+
+// Without the verifier, accesses to the region are allowed by the bounds check function.
+static bool
+allow_region(void* user_context, uint64_t addr, uint64_t size)
+{
+    (void)user_context;
+    return addr >= reinterpret_cast<uint64_t>(region) && addr + size <= reinterpret_cast<uint64_t>(region + 2);
+}
+
+// Registers the helpers and the bounds check and, to verify the program, its context size.
+static custom_test_fixup_cb
+register_region(bool verify)
+{
+    return [verify](ubpf_vm_up& vm, std::string& error) {
+        ubpf_safe_helper_descriptor descriptor = {
+            1, "region", region_helper, UBPF_SAFE_HELPER_RESULT_POINTER, 100, sizeof(region)};
+        if (ubpf_register_safe_helper(vm.get(), &descriptor) != 0 ||
+            ubpf_register(vm.get(), 2, "nop", nop_helper) != 0 ||
+            ubpf_register_data_bounds_check(vm.get(), nullptr, allow_region) != 0 ||
+            (verify && ubpf_set_minimum_context_size(vm.get(), context_size) != 0)) {
+            error = "failed to configure the VM";
+            return false;
+        }
+        return true;
+    };
+}
+
+struct range_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+    uint32_t accesses;
+    uint32_t proven;
+};
+
+static bool
+check_case(const range_case& test)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error, register_region(true));
+    ubpf_vm_up reference_vm = ubpf_load_custom_test_program(test.program, error, register_region(false));
+    if (!vm || !reference_vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+
+    ubpf_range_report report;
+    if (ubpf_get_range_report(vm.get(), &report) != 0) {
+        std::cerr << test.name << ": no range report" << std::endl;
+        return false;
+    }
+    if (report.accesses != test.accesses || report.proven != test.proven) {
+        std::cerr << test.name << ": " << report.proven << " of " << report.accesses
+                  << " accesses proven in bounds; expected " << test.proven << " of " << test.accesses << std::endl;
+        return false;
+    }
+
+    uint8_t memory[context_size + 8];
+    for (size_t i = 0; i < sizeof(memory); i++) {
+        memory[i] = static_cast<uint8_t>(i);
+    }
+    uint64_t expected = 0;
+    uint64_t result = 0;
+    if (ubpf_exec(reference_vm.get(), memory, sizeof(memory), &expected) != 0) {
+        std::cerr << test.name << ": the program failed without the verifier" << std::endl;
+        return false;
+    }
+    if (ubpf_exec(vm.get(), memory, sizeof(memory), &result) != 0 || result != expected) {
+        std::cerr << test.name << ": the interpreter returned " << std::hex << result << "; expected " << expected
+                  << std::dec << std::endl;
+        return false;
+    }
+
+    if (ubpf_native_jit_available()) {
+        char* errmsg = nullptr;
+        ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+        if (fn == nullptr) {
+            std::cerr << test.name << ": failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+            free(errmsg);
+            return false;
+        }
+        result = fn(memory, sizeof(memory));
+        if (result != expected) {
+            std::cerr << test.name << ": the JIT'd code returned " << std::hex << result << "; expected " << expected
+                      << std::dec << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+test_proven_accesses()
+{
+    const range_case cases[] = {
+        {"context load in bounds", {{EBPF_OP_LDXDW, 0, 1, 24, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}, 1, 1},
+        {"context load past the declared size", {{EBPF_OP_LDXDW, 0, 1, 32, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}, 1, 0},
+        {"stack store and load",
+         {{EBPF_OP_STDW, 10, 0, -8, 7}, {EBPF_OP_LDXDW, 0, 10, -8, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         2,
+         2},
+        {"spilled and filled context pointer",
+         {{EBPF_OP_STXDW, 10, 1, -8, 0},
+          {EBPF_OP_MOV64_IMM, 1, 0, 0, 0},
+          {EBPF_OP_LDXDW, 2, 10, -8, 0},
+          {EBPF_OP_LDXB, 0, 2, 4, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         3,
+         3},
+        {"spilled pointer given to a helper",
+         {{EBPF_OP_STXDW, 10, 1, -8, 0},
+          {EBPF_OP_MOV64_REG, 1, 10, 0, 0},
+          {EBPF_OP_ADD64_IMM, 1, 0, 0, -8},
+          {EBPF_OP_CALL, 0, 0, 0, 2},
+          {EBPF_OP_LDXDW, 2, 10, -8, 0},
+          {EBPF_OP_LDXB, 0, 2, 4, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         3,
+         2},
+        {"index bounded by a branch",
+         {{EBPF_OP_LDXB, 2, 1, 0, 0},
+          {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_JGT_IMM, 2, 0, 2, 7},
+          {EBPF_OP_ADD64_REG, 1, 2, 0, 0},
+          {EBPF_OP_LDXB, 0, 1, 24, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         2,
+         2},
+        {"unbounded index",
+         {{EBPF_OP_LDXB, 2, 1, 0, 0},
+          {EBPF_OP_ADD64_REG, 1, 2, 0, 0},
+          {EBPF_OP_LDXB, 0, 1, 24, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         2,
+         1},
+        {"index bounded by a loop condition",
+         {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_MOV64_IMM, 2, 0, 0, 0},
+          {EBPF_OP_MOV64_REG, 3, 1, 0, 0},
+          {EBPF_OP_ADD64_REG, 3, 2, 0, 0},
+          {EBPF_OP_LDXB, 4, 3, 0, 0},
+          {EBPF_OP_ADD64_REG, 0, 4, 0, 0},
+          {EBPF_OP_ADD64_IMM, 2, 0, 0, 1},
+          {EBPF_OP_JLT_IMM, 2, 0, -6, 32},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         1,
+         1},
+        {"region after a NULL check",
+         {{EBPF_OP_MOV64_IMM, 1, 0, 0, 1},
+          {EBPF_OP_CALL, 0, 0, 0, 1},
+          {EBPF_OP_JEQ_IMM, 0, 0, 2, 0},
+          {EBPF_OP_LDXDW, 0, 0, 8, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_MOV64_IMM, 0, 0, 0, 7},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         1,
+         1},
+        {"region without a NULL check",
+         {{EBPF_OP_MOV64_IMM, 1, 0, 0, 1},
+          {EBPF_OP_CALL, 0, 0, 0, 1},
+          {EBPF_OP_LDXDW, 0, 0, 8, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         1,
+         0},
+    };
+
+    bool success = true;
+    for (const auto& test : cases) {
+        success &= check_case(test);
+    }
+    return success;
+}
+
+static bool
+test_context_size_contract()
+{
+    std::vector<ebpf_inst> program = {
+        {EBPF_OP_STDW, 10, 0, -8, 7}, {EBPF_OP_LDXDW, 0, 1, 24, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}};
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, register_region(true));
+    ubpf_vm_up unverified_vm = ubpf_load_custom_test_program(program, error, register_region(false));
+    if (!vm || !unverified_vm) {
+        std::cerr << "contract: " << error << std::endl;
+        return false;
+    }
+    if (ubpf_set_minimum_context_size(vm.get(), context_size) != -1) {
+        std::cerr << "contract: the context size was changed after the program was loaded" << std::endl;
+        return false;
+    }
+    ubpf_range_report report;
+    if (ubpf_get_range_report(unverified_vm.get(), &report) != -1) {
+        std::cerr << "contract: a range report without the verifier" << std::endl;
+        return false;
+    }
+
+    uint8_t memory[context_size] = {};
+    uint8_t stack[UBPF_EBPF_STACK_SIZE];
+    uint64_t result = 0;
+    if (ubpf_exec(vm.get(), memory, sizeof(memory), &result) != 0) {
+        std::cerr << "contract: the program failed with the declared memory" << std::endl;
+        return false;
+    }
+    if (ubpf_exec(vm.get(), memory, sizeof(memory) - 1, &result) != -1 ||
+        ubpf_exec(vm.get(), nullptr, 0, &result) != -1 ||
+        ubpf_exec_ex(vm.get(), memory, sizeof(memory), &result, stack, ubpf_get_stack_requirement(vm.get()) - 1) != -1) {
+        std::cerr << "contract: the program ran with less memory or stack than it was verified for" << std::endl;
+        return false;
+    }
+
+    if (JIT_CHECKS_SUPPORTED) {
+        char* errmsg = nullptr;
+        ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+        if (fn == nullptr) {
+            std::cerr << "contract: failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+            free(errmsg);
+            return false;
+        }
+        if (fn(memory, sizeof(memory) - 1) != UINT64_MAX || fn(nullptr, 0) != UINT64_MAX) {
+            std::cerr << "contract: the JIT'd code ran with less memory than it was verified for" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    bool success = true;
+    success &= test_proven_accesses();
+    success &= test_context_size_contract();
+
+    if (success) {
+        std::cout << "PASSED" << std::endl;
+        return 0;
+    }
+    std::cout << "FAILED" << std::endl;
+    return 1;
+}
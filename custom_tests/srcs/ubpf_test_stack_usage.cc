@@ -0,0 +1,215 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the computed stack usage of local functions (ubpf_get_stack_requirement).
+ * This test verifies that:
+ * 1. The frames of functions that access the stack through r10, through a copy of it
+ *    and through a pointer given to a helper are sized to cover those accesses
+ * 2. The stack requirement is the deepest chain of frames, including recursion up to
+ *    UBPF_MAX_CALL_DEPTH frames, and is enough to run the program
+ * 3. Programs whose frames cannot be sized, or are sized by a registered calculator,
+ *    need UBPF_EBPF_STACK_SIZE bytes of stack
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static uint64_t
+nop_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p0;
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return 0;
+}
+
+static int
+calculate_stack_usage(const struct ubpf_vm* vm, uint16_t pc, void* cookie)
+{
+    (void)vm;
+    (void)pc;
+    (void)cookie;
+    return 64;
+}
+
+struct stack_usage_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+    size_t stack_requirement;
+    bool use_calculator;
+};
+
+static bool
+check_case(const stack_usage_case& test)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error, [&test](ubpf_vm_up& vm, std::string& error) {
+        if (ubpf_register(vm.get(), 1, "nop", nop_helper) != 0 ||
+            (test.use_calculator &&
+             ubpf_register_stack_usage_calculator(vm.get(), calculate_stack_usage, nullptr) != 0)) {
+            error = "failed to create the VM";
+            return false;
+        }
+        return true;
+    });
+    if (!vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+
+    size_t stack_requirement = ubpf_get_stack_requirement(vm.get());
+    if (stack_requirement != test.stack_requirement) {
+        std::cerr << test.name << ": the stack requirement is " << stack_requirement << "; expected "
+                  << test.stack_requirement << std::endl;
+        return false;
+    }
+
+    uint64_t memory = 0;
+    uint64_t expected = 0;
+    if (ubpf_exec(vm.get(), &memory, sizeof(memory), &expected) != 0) {
+        std::cerr << test.name << ": the program failed" << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> stack(stack_requirement);
+    uint64_t result = 0;
+    memory = 0;
+    if (ubpf_exec_ex(vm.get(), &memory, sizeof(memory), &result, stack.data(), stack.size()) != 0 ||
+        result != expected) {
+        std::cerr << test.name << ": the program failed with a stack of " << stack.size() << " bytes" << std::endl;
+        return false;
+    }
+    // Every byte of the deepest chain of frames is used.
+    memory = 0;
+    if (stack_requirement != UBPF_EBPF_STACK_SIZE &&
+        ubpf_exec_ex(vm.get(), &memory, sizeof(memory), &result, stack.data() + 1, stack.size() - 1) != -1) {
+        std::cerr << test.name << ": the program ran with a stack that is one byte too small" << std::endl;
+        return false;
+    }
+
+    if (ubpf_native_jit_available()) {
+        char* errmsg = nullptr;
+        ubpf_jit_ex_fn fn = ubpf_compile_ex(vm.get(), &errmsg, ExtendedJitMode);
+        if (fn == nullptr) {
+            std::cerr << test.name << ": failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+            free(errmsg);
+            return false;
+        }
+        memory = 0;
+        result = fn(&memory, sizeof(memory), stack.data(), stack.size());
+        if (result != expected) {
+            std::cerr << test.name << ": the JIT'd code returned " << result << "; expected " << expected
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    const stack_usage_case cases[] = {
+        {"nested calls",
+         {{EBPF_OP_STDW, 10, 0, -16, 1},
+          {EBPF_OP_CALL, 0, 1, 0, 3},
+          {EBPF_OP_LDXDW, 1, 10, -16, 0},
+          {EBPF_OP_ADD64_REG, 0, 1, 0, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          // A 48-byte frame that is used through a copy of r10.
+          {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+          {EBPF_OP_ADD64_IMM, 2, 0, 0, -40},
+          {EBPF_OP_STDW, 2, 0, -8, 2},
+          {EBPF_OP_MOV64_IMM, 2, 0, 0, 0},
+          {EBPF_OP_CALL, 0, 1, 0, 2},
+          {EBPF_OP_LDXDW, 0, 10, -48, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_STW, 10, 0, -32, 3},
+          {EBPF_OP_LDXW, 0, 10, -32, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         16 + 48 + 32,
+         false},
+        {"deepest of two calls",
+         {{EBPF_OP_LDXDW, 1, 1, 0, 0},
+          {EBPF_OP_JEQ_IMM, 1, 0, 2, 0},
+          {EBPF_OP_CALL, 0, 1, 0, 3},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_CALL, 0, 1, 0, 4},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_STB, 10, 0, -16, 1},
+          {EBPF_OP_LDXB, 0, 10, -16, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_STB, 10, 0, -80, 2},
+          {EBPF_OP_LDXB, 0, 10, -80, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         80,
+         false},
+        {"recursion",
+         {{EBPF_OP_MOV64_IMM, 1, 0, 0, UBPF_MAX_CALL_DEPTH - 2},
+          {EBPF_OP_CALL, 0, 1, 0, 1},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          // Recurses until r1 reaches 0, with as many frames as the call depth allows.
+          {EBPF_OP_STXDW, 10, 1, -32, 0},
+          {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+          {EBPF_OP_JEQ_IMM, 1, 0, 2, 0},
+          {EBPF_OP_SUB64_IMM, 1, 0, 0, 1},
+          {EBPF_OP_CALL, 0, 1, 0, -5},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         32 * (UBPF_MAX_CALL_DEPTH - 1),
+         false},
+        {"pointer given to a helper",
+         {{EBPF_OP_MOV64_REG, 1, 10, 0, 0},
+          {EBPF_OP_ADD64_IMM, 1, 0, 0, -24},
+          {EBPF_OP_CALL, 0, 0, 0, 1},
+          {EBPF_OP_STB, 10, 0, -32, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         32,
+         false},
+        {"stored stack pointer",
+         {{EBPF_OP_STXDW, 10, 10, -8, 0}, {EBPF_OP_MOV64_IMM, 0, 0, 0, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         UBPF_EBPF_STACK_SIZE,
+         false},
+        {"stack pointer across a jump",
+         {{EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+          {EBPF_OP_LDXDW, 1, 1, 0, 0},
+          {EBPF_OP_JEQ_IMM, 1, 0, 1, 0},
+          {EBPF_OP_ADD64_IMM, 2, 0, 0, -8},
+          {EBPF_OP_STDW, 2, 0, -8, 0},
+          {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         UBPF_EBPF_STACK_SIZE,
+         false},
+        {"stack usage calculator",
+         {{EBPF_OP_STDW, 10, 0, -8, 1}, {EBPF_OP_LDXDW, 0, 10, -8, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         UBPF_EBPF_STACK_SIZE,
+         true},
+    };
+
+    bool success = true;
+    for (const auto& test : cases) {
+        if (!check_case(test)) {
+            success = false;
+        }
+    }
+
+    std::cout << (success ? "PASSED" : "FAILED") << std::endl;
+    return success ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+// Copyright (c) uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the stackless fast path for programs that never use r10.
+ * This test verifies that:
+ * 1. ubpf_get_stack_requirement reports 0 for programs (including their local
+ *    functions) that never use r10 and the size of their frames for those that do
+ * 2. Stackless programs run correctly in the interpreter (with and without
+ *    undefined behavior checks), in ubpf_exec_ex without a stack and in JIT'd
+ *    code in both JIT modes
+ * 3. The JIT'd code of a stackless program does not reserve stack space
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+struct stackless_test_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+    size_t expected_stack_requirement;
+};
+
+static bool
+run_test_case(const stackless_test_case& test)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error);
+    ubpf_vm_up checked_vm = ubpf_load_custom_test_program(test.program, error, [](ubpf_vm_up& vm, std::string&) {
+        ubpf_toggle_undefined_behavior_check(vm.get(), true);
+        return true;
+    });
+    ubpf_vm_up extended_vm = ubpf_load_custom_test_program(test.program, error);
+    if (!vm || !checked_vm || !extended_vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+
+    size_t stack_requirement = ubpf_get_stack_requirement(vm.get());
+    if (stack_requirement != test.expected_stack_requirement) {
+        std::cerr << test.name << ": stack requirement is " << stack_requirement << " but expected "
+                  << test.expected_stack_requirement << std::endl;
+        return false;
+    }
+
+    ubpf_jit_fn basic_fn = nullptr;
+    ubpf_jit_ex_fn extended_fn = nullptr;
+    if (ubpf_native_jit_available()) {
+        char* errmsg = nullptr;
+        basic_fn = ubpf_compile(vm.get(), &errmsg);
+        if (basic_fn == nullptr) {
+            std::cerr << test.name << ": failed to compile: " << errmsg << std::endl;
+            free(errmsg);
+            return false;
+        }
+        extended_fn = ubpf_compile_ex(extended_vm.get(), &errmsg, ExtendedJitMode);
+        if (extended_fn == nullptr) {
+            std::cerr << test.name << ": failed to compile in extended mode: " << errmsg << std::endl;
+            free(errmsg);
+            return false;
+        }
+    }
+
+    for (uint64_t input : {0ULL, 3ULL, 10ULL, 0xfedcba9876ULL}) {
+        uint64_t memory = input;
+        uint64_t expected;
+        if (ubpf_exec(vm.get(), &memory, sizeof(memory), &expected) != 0) {
+            std::cerr << test.name << ": interpreter failed" << std::endl;
+            return false;
+        }
+
+        uint64_t checked;
+        memory = input;
+        if (ubpf_exec(checked_vm.get(), &memory, sizeof(memory), &checked) != 0 || checked != expected) {
+            std::cerr << test.name << ": interpreter with undefined behavior checks failed" << std::endl;
+            return false;
+        }
+
+        // A program that needs no stack does not need to be given one.
+        std::vector<uint8_t> stack(stack_requirement);
+        uint8_t* stack_start = stack_requirement ? stack.data() : nullptr;
+        uint64_t result;
+        memory = input;
+        if (ubpf_exec_ex(vm.get(), &memory, sizeof(memory), &result, stack_start, stack.size()) != 0 ||
+            result != expected) {
+            std::cerr << test.name << ": ubpf_exec_ex failed" << std::endl;
+            return false;
+        }
+
+        if (!ubpf_native_jit_available()) {
+            continue;
+        }
+        memory = input;
+        uint64_t basic = basic_fn(&memory, sizeof(memory));
+        memory = input;
+        uint64_t extended = extended_fn(&memory, sizeof(memory), stack_start, stack.size());
+        if (basic != expected || extended != expected) {
+            std::cerr << test.name << ": input " << input << " returned " << basic << " (basic) and " << extended
+                      << " (extended) from the JIT'd code but " << expected << " from the interpreter" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    std::vector<stackless_test_case> tests = {
+        {
+            "classifier without stack",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+                {EBPF_OP_JGT_IMM, 2, 0, 1, 5},
+                {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            0,
+        },
+        {
+            "spill and fill",
+            {
+                {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                {EBPF_OP_STXDW, 10, 2, -8, 0},
+                {EBPF_OP_LDXDW, 0, 10, -8, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            16,
+        },
+        {
+            "local functions without stack",
+            {
+                {EBPF_OP_LDXDW, 1, 1, 0, 0},
+                {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+                {EBPF_OP_CALL, 0, 1, 0, 2},
+                {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+                {EBPF_OP_MUL64_IMM, 6, 0, 0, 3},
+                {EBPF_OP_MOV64_REG, 1, 6, 0, 0},
+                {EBPF_OP_CALL, 0, 1, 0, 2},
+                {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 7},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            0,
+        },
+        {
+            // Only the local function touches the stack.
+            "stack in local function",
+            {
+                {EBPF_OP_LDXDW, 1, 1, 0, 0},
+                {EBPF_OP_CALL, 0, 1, 0, 1},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+                {EBPF_OP_STXDW, 10, 1, -16, 0},
+                {EBPF_OP_LDXDW, 0, 10, -16, 0},
+                {EBPF_OP_ADD64_IMM, 0, 0, 0, 2},
+                {EBPF_OP_EXIT, 0, 0, 0, 0},
+            },
+            16,
+        },
+    };
+
+    for (const auto& test : tests) {
+        if (!run_test_case(test)) {
+            std::cerr << "FAILED: " << test.name << std::endl;
+            return 1;
+        }
+        std::cout << "PASSED: " << test.name << std::endl;
+    }
+
+    // The requirement is reset when the program is unloaded.
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(tests[1].program, error);
+    if (!vm) {
+        std::cerr << "FAILED: " << error << std::endl;
+        return 1;
+    }
+    ubpf_unload_code(vm.get());
+    if (ubpf_get_stack_requirement(vm.get()) != 0) {
+        std::cerr << "FAILED: the stack requirement was not reset by ubpf_unload_code" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED: unload" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the load-time analysis of the undefined behavior checks.
+ * This test verifies that:
+ * 1. Programs whose checks are proven run without errors
+ * 2. Uninitialized registers and stack bytes are reported at the same instruction and with
+ *    the same errors as when the interpreter tracks the state at every instruction
+ * 3. Both hold in the legacy and the safe execution profiles
+ */
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static std::string errors;
+
+static int
+capture_error(FILE* stream, const char* format, ...)
+{
+    (void)stream;
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    errors += buffer;
+    return length;
+}
+
+static void
+count_instructions(
+    void* context,
+    int pc,
+    const uint64_t registers[16],
+    const uint8_t* stack_start,
+    size_t stack_length,
+    uint64_t register_mask,
+    const uint8_t* stack_mask)
+{
+    (void)pc;
+    (void)registers;
+    (void)stack_start;
+    (void)stack_length;
+    (void)register_mask;
+    (void)stack_mask;
+    (*static_cast<int*>(context))++;
+}
+
+struct uninitialized_reads_case
+{
+    const char* name;
+    std::vector<ebpf_inst> program;
+    uint64_t memory;
+    bool fails;
+};
+
+struct run_result
+{
+    int return_value;
+    uint64_t result;
+    std::string errors;
+};
+
+static bool
+run(const uninitialized_reads_case& test, ubpf_execution_profile profile, bool track_every_instruction, run_result& out)
+{
+    int instructions = 0;
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(test.program, error, [&](ubpf_vm_up& vm, std::string& error) {
+        if (ubpf_set_execution_profile(vm.get(), profile) != 0) {
+            error = "failed to set the execution profile";
+            return false;
+        }
+        ubpf_set_error_print(vm.get(), capture_error);
+        ubpf_toggle_undefined_behavior_check(vm.get(), true);
+        if (track_every_instruction && ubpf_register_debug_fn(vm.get(), &instructions, count_instructions) != 0) {
+            error = "failed to register the debug function";
+            return false;
+        }
+        return true;
+    });
+    if (!vm) {
+        std::cerr << test.name << ": " << error << std::endl;
+        return false;
+    }
+
+    uint64_t memory = test.memory;
+    errors.clear();
+    out.result = 0;
+    out.return_value = ubpf_exec(vm.get(), &memory, sizeof(memory), &out.result);
+    out.errors = errors;
+    return true;
+}
+
+static bool
+check_case(const uninitialized_reads_case& test, ubpf_execution_profile profile)
+{
+    const char* profile_name = profile == UBPF_EXECUTION_PROFILE_SAFE ? " (safe)" : "";
+    run_result proven{};
+    run_result tracked{};
+    if (!run(test, profile, false, proven) || !run(test, profile, true, tracked)) {
+        return false;
+    }
+    if ((proven.return_value != 0) != test.fails) {
+        std::cerr << test.name << profile_name << ": the program " << (test.fails ? "ran" : "failed") << std::endl;
+        return false;
+    }
+    if (proven.return_value != tracked.return_value || proven.result != tracked.result ||
+        proven.errors != tracked.errors) {
+        std::cerr << test.name << profile_name << ": reported \"" << proven.errors << "\"; tracking every instruction reported \""
+                  << tracked.errors << "\"" << std::endl;
+        return false;
+    }
+    if (test.fails && proven.errors.find("Invalid register state") == std::string::npos) {
+        std::cerr << test.name << profile_name << ": no undefined behavior was reported" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    // Stores r1 at r10 - 8 only if the memory is nonzero, then returns the slot.
+    const std::vector<ebpf_inst> written_on_one_path = {
+        {EBPF_OP_LDXDW, 2, 1, 0, 0},
+        {EBPF_OP_JEQ_IMM, 2, 0, 1, 0},
+        {EBPF_OP_STXDW, 10, 2, -8, 0},
+        {EBPF_OP_LDXDW, 0, 10, -8, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+    const uninitialized_reads_case cases[] = {
+        {"initialized stack and registers",
+         {{EBPF_OP_LDXDW, 2, 1, 0, 0},
+          {EBPF_OP_MOV64_REG, 3, 10, 0, 0},
+          {EBPF_OP_STXDW, 3, 2, -16, 0},
+          {EBPF_OP_STW, 10, 0, -4, 7},
+          {EBPF_OP_JEQ_IMM, 2, 0, 2, 0},
+          {EBPF_OP_LDXDW, 0, 10, -16, 0},
+          {EBPF_OP_JA, 0, 0, 1, 0},
+          {EBPF_OP_LDXW, 0, 10, -4, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         3,
+         false},
+        {"initialized across a local call",
+         {{EBPF_OP_STDW, 10, 0, -8, 5},
+          {EBPF_OP_MOV64_IMM, 6, 0, 0, 2},
+          {EBPF_OP_CALL, 0, 1, 0, 4},
+          {EBPF_OP_LDXDW, 1, 10, -8, 0},
+          {EBPF_OP_ADD64_REG, 0, 1, 0, 0},
+          {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_STW, 10, 0, -4, 1},
+          {EBPF_OP_LDXW, 0, 10, -4, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         0,
+         false},
+        {"branch on an uninitialized register",
+         {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_JEQ_IMM, 3, 0, 1, 0},
+          {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         0,
+         true},
+        {"return of unwritten stack",
+         {{EBPF_OP_STW, 10, 0, -8, 1}, {EBPF_OP_LDXDW, 0, 10, -8, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         0,
+         true},
+        {"local function without a return value",
+         {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+          {EBPF_OP_CALL, 0, 1, 0, 1},
+          {EBPF_OP_EXIT, 0, 0, 0, 0},
+          {EBPF_OP_LDXDW, 0, 10, -8, 0},
+          {EBPF_OP_EXIT, 0, 0, 0, 0}},
+         0,
+         true},
+        {"stack written on the taken path", written_on_one_path, 1, false},
+        {"stack not written on the taken path", written_on_one_path, 0, true},
+    };
+
+    bool success = true;
+    for (const auto& test : cases) {
+        for (auto profile : {UBPF_EXECUTION_PROFILE_LEGACY, UBPF_EXECUTION_PROFILE_SAFE}) {
+            if (!check_case(test, profile)) {
+                success = false;
+            }
+        }
+    }
+
+    std::cout << (success ? "PASSED" : "FAILED") << std::endl;
+    return success ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// This program reads BPF instructions from stdin, JITs them and then repeatedly
+// swaps the helper they call while several threads execute the program.
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static uint64_t
+first_helper(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e)
+{
+    UNREFERENCED_PARAMETER(a);
+    UNREFERENCED_PARAMETER(b);
+    UNREFERENCED_PARAMETER(c);
+    UNREFERENCED_PARAMETER(d);
+    UNREFERENCED_PARAMETER(e);
+    return 46;
+}
+
+static uint64_t
+second_helper(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e)
+{
+    UNREFERENCED_PARAMETER(a);
+    UNREFERENCED_PARAMETER(b);
+    UNREFERENCED_PARAMETER(c);
+    UNREFERENCED_PARAMETER(d);
+    UNREFERENCED_PARAMETER(e);
+    return 47;
+}
+
+int
+main(int argc, char** argv)
+{
+    std::string program_string{};
+    std::string error{};
+    ubpf_jit_fn jit_fn;
+
+    if (!get_program_string(argc, argv, program_string, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)> vm(ubpf_create(), ubpf_destroy);
+    if (!ubpf_setup_custom_test(
+            vm,
+            program_string,
+            [](ubpf_vm_up& vm, std::string& error) {
+                if (ubpf_register(vm.get(), 1, "unnamed", first_helper) != 0) {
+                    error = "Failed to register helper function";
+                    return false;
+                }
+                return true;
+            },
+            jit_fn,
+            error)) {
+        std::cerr << "Problem setting up custom test: " << error << std::endl;
+        return 1;
+    }
+
+    std::atomic<bool> done{false};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> runners;
+    for (int i = 0; i < 4; i++) {
+        runners.emplace_back([&]() {
+            uint64_t memory{0x123456789};
+            while (!done.load()) {
+                uint64_t result = jit_fn(&memory, sizeof(memory));
+                if (result != 46 && result != 47) {
+                    failed.store(true);
+                }
+            }
+        });
+    }
+
+    for (int i = 0; i < 10000; i++) {
+        external_function_t fn = (i % 2) ? first_helper : second_helper;
+        if (ubpf_register(vm.get(), 1, "unnamed", fn) != 0) {
+            std::cerr << "Failed to register helper function" << std::endl;
+            failed.store(true);
+            break;
+        }
+    }
+
+    done.store(true);
+    for (auto& runner : runners) {
+        runner.join();
+    }
+
+    uint64_t memory{0x123456789};
+    if (ubpf_register(vm.get(), 1, "unnamed", second_helper) != 0 ||
+        jit_fn(&memory, sizeof(memory)) != 47) {
+        std::cerr << "Final helper update was not observed" << std::endl;
+        failed.store(true);
+    }
+
+    return failed.load() ? 1 : 0;
+}
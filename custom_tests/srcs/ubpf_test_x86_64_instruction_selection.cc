@@ -0,0 +1,342 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Test the instruction selection of the x86-64 JIT over pairs of instructions.
+ * This test verifies that:
+ * 1. Loads folded into ALU operations and comparisons, and additions emitted as
+ *    LEA, return the same results as the interpreter, for base and temporary
+ *    registers that need special encodings, with and without constant blinding
+ * 2. Loads are not folded when the loaded register is read later
+ * 3. A pair is fused (its code is smaller than when the second instruction is a
+ *    jump target)
+ * 4. With constant blinding, the immediates of fused pairs are not in the code
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+// An immediate that is easy to find in the JIT'd code.
+static const int32_t marker = 0x5a17c0de;
+
+// Loads programs with constant blinding on or off.
+static custom_test_fixup_cb
+toggle_constant_blinding(bool blinding)
+{
+    return [blinding](ubpf_vm_up& vm, std::string&) {
+        ubpf_toggle_constant_blinding(vm.get(), blinding);
+        return true;
+    };
+}
+
+// Run the program in the interpreter and JIT'd, on memory that makes its comparisons go either way.
+static bool
+check_program(const std::string& name, const std::vector<ebpf_inst>& program)
+{
+    for (bool blinding : {false, true}) {
+        std::string error;
+        ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, toggle_constant_blinding(blinding));
+        if (!vm) {
+            std::cerr << name << ": " << error << std::endl;
+            return false;
+        }
+        char* errmsg = nullptr;
+        ubpf_jit_fn fn = ubpf_compile(vm.get(), &errmsg);
+        if (fn == nullptr) {
+            std::cerr << name << ": failed to compile: " << (errmsg ? errmsg : "(none)") << std::endl;
+            free(errmsg);
+            return false;
+        }
+
+        for (uint64_t value : {0ULL, 1ULL, 0x5a17c0deULL, 0xffffffffa5e83f22ULL, 0x8000000000000000ULL}) {
+            uint64_t memory[4] = {value, value + 1, value - 1, ~value};
+            uint64_t jit_memory[4];
+            memcpy(jit_memory, memory, sizeof(memory));
+
+            uint64_t expected = 0;
+            if (ubpf_exec(vm.get(), memory, sizeof(memory), &expected) != 0) {
+                std::cerr << name << ": the interpreter failed" << std::endl;
+                return false;
+            }
+            uint64_t result = fn(jit_memory, sizeof(jit_memory));
+            if (result != expected || memcmp(memory, jit_memory, sizeof(memory)) != 0) {
+                std::cerr << name << (blinding ? " (blinded)" : "") << ": value 0x" << std::hex << value
+                          << " returned 0x" << result << " but 0x" << expected << " in the interpreter" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static size_t
+code_size(const std::vector<ebpf_inst>& program, bool blinding, std::vector<uint8_t>* code = nullptr)
+{
+    std::string error;
+    ubpf_vm_up vm = ubpf_load_custom_test_program(program, error, toggle_constant_blinding(blinding));
+    if (!vm) {
+        std::cerr << error << std::endl;
+        return 0;
+    }
+    std::vector<uint8_t> buffer(65536);
+    size_t size = buffer.size();
+    char* errmsg = nullptr;
+    if (ubpf_translate(vm.get(), buffer.data(), &size, &errmsg) != 0) {
+        std::cerr << "Failed to translate program: " << (errmsg ? errmsg : "(none)") << std::endl;
+        free(errmsg);
+        return 0;
+    }
+    if (code) {
+        code->assign(buffer.begin(), buffer.begin() + size);
+    }
+    return size;
+}
+
+static bool
+test_load_folding()
+{
+    // r7 and r8 are mapped to R12 and R13 (System V), which need a SIB byte and a
+    // displacement as a base.
+    const uint8_t alu_ops[] = {
+        EBPF_ALU_OP_ADD, EBPF_ALU_OP_SUB, EBPF_ALU_OP_OR, EBPF_ALU_OP_AND, EBPF_ALU_OP_XOR, EBPF_ALU_OP_MOV};
+    bool success = true;
+    for (uint8_t op : alu_ops) {
+        for (bool is_64bit : {false, true}) {
+            for (uint8_t base : {1, 7, 8, 10}) {
+                for (uint8_t temp : {2, 8}) {
+                    uint8_t load = is_64bit ? EBPF_OP_LDXDW : EBPF_OP_LDXW;
+                    int16_t offset = base == 10 ? -16 : 8;
+                    std::vector<ebpf_inst> program = {
+                        {EBPF_OP_MOV64_REG, 7, 1, 0, 0},
+                        {EBPF_OP_MOV64_REG, 8, 1, 0, 0},
+                        {EBPF_OP_LDXDW, 3, 1, 0, 0},
+                        {EBPF_OP_STXDW, 10, 3, -16, 0},
+                        {EBPF_OP_LDDW, 0, 0, 0, 0x12345678},
+                        {0, 0, 0, 0, static_cast<int32_t>(0x9abcdef0)},
+                        {load, temp, base, offset, 0},
+                        {static_cast<uint8_t>((is_64bit ? EBPF_CLS_ALU64 : EBPF_CLS_ALU) | EBPF_SRC_REG | op),
+                         0,
+                         temp,
+                         0,
+                         0},
+                        {EBPF_OP_EXIT, 0, 0, 0, 0},
+                    };
+                    std::string name = "load and ALU 0x" + std::to_string(op) + (is_64bit ? " 64" : " 32") +
+                                       " base r" + std::to_string(base) + " temp r" + std::to_string(temp);
+                    success = check_program(name, program) && success;
+                }
+            }
+        }
+    }
+
+    // The loaded register is read after the ALU operation, so it must still be written.
+    std::vector<ebpf_inst> live = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 3},
+        {EBPF_OP_LDXDW, 2, 1, 8, 0},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_JA, 0, 0, 0, 0},
+        {EBPF_OP_MUL64_REG, 0, 2, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    return check_program("live load", live) && success;
+}
+
+static bool
+test_compare_folding()
+{
+    const uint8_t modes[] = {
+        EBPF_MODE_JEQ,
+        EBPF_MODE_JNE,
+        EBPF_MODE_JGT,
+        EBPF_MODE_JGE,
+        EBPF_MODE_JLT,
+        EBPF_MODE_JLE,
+        EBPF_MODE_JSGT,
+        EBPF_MODE_JSGE,
+        EBPF_MODE_JSLT,
+        EBPF_MODE_JSLE,
+        EBPF_MODE_JSET};
+    bool success = true;
+    for (uint8_t mode : modes) {
+        for (bool is_64bit : {false, true}) {
+            for (bool with_register : {false, true}) {
+                for (uint8_t base : {1, 8}) {
+                    uint8_t load = is_64bit ? EBPF_OP_LDXDW : EBPF_OP_LDXW;
+                    uint8_t jump = static_cast<uint8_t>(
+                        (is_64bit ? EBPF_CLS_JMP : EBPF_CLS_JMP32) | (with_register ? EBPF_SRC_REG : 0) | mode);
+                    std::vector<ebpf_inst> program = {
+                        {EBPF_OP_MOV64_REG, 8, 1, 0, 0},
+                        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+                        {EBPF_OP_MOV64_IMM, 3, 0, 0, marker},
+                        {load, 2, base, 0, 0},
+                        {jump, 2, static_cast<uint8_t>(with_register ? 3 : 0), 1, with_register ? 0 : marker},
+                        {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+                        {load, 4, base, 8, 0},
+                        {jump, 4, static_cast<uint8_t>(with_register ? 3 : 0), 1, with_register ? 0 : -marker},
+                        {EBPF_OP_OR64_IMM, 0, 0, 0, 2},
+                        {EBPF_OP_EXIT, 0, 0, 0, 0},
+                    };
+                    std::string name = "load and jump 0x" + std::to_string(mode) + (is_64bit ? " 64" : " 32") +
+                                       (with_register ? " reg" : " imm") + " base r" + std::to_string(base);
+                    success = check_program(name, program) && success;
+                }
+            }
+        }
+    }
+    return success;
+}
+
+static bool
+test_lea()
+{
+    bool success = true;
+    success = check_program(
+                  "mov and add immediate",
+                  {
+                      {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                      {EBPF_OP_MOV64_REG, 0, 2, 0, 0},
+                      {EBPF_OP_ADD64_IMM, 0, 0, 0, -marker},
+                      {EBPF_OP_MOV64_REG, 8, 0, 0, 0},
+                      {EBPF_OP_ADD64_IMM, 8, 0, 0, 127},
+                      {EBPF_OP_ADD64_REG, 0, 8, 0, 0},
+                      {EBPF_OP_EXIT, 0, 0, 0, 0},
+                  }) &&
+              success;
+    success = check_program(
+                  "stack address",
+                  {
+                      {EBPF_OP_LDXDW, 3, 1, 0, 0},
+                      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+                      {EBPF_OP_ADD64_IMM, 2, 0, 0, -8},
+                      {EBPF_OP_STXDW, 2, 3, 0, 0},
+                      {EBPF_OP_LDXDW, 0, 10, -8, 0},
+                      {EBPF_OP_EXIT, 0, 0, 0, 0},
+                  }) &&
+              success;
+    success = check_program(
+                  "mov and add register",
+                  {
+                      {EBPF_OP_LDXDW, 2, 1, 0, 0},
+                      {EBPF_OP_LDXDW, 3, 1, 8, 0},
+                      {EBPF_OP_MOV64_REG, 7, 2, 0, 0},
+                      {EBPF_OP_ADD64_REG, 7, 3, 0, 0},
+                      {EBPF_OP_MOV64_REG, 8, 3, 0, 0},
+                      {EBPF_OP_ADD64_REG, 8, 8, 0, 0},
+                      {EBPF_OP_MOV64_REG, 0, 7, 0, 0},
+                      {EBPF_OP_XOR64_REG, 0, 8, 0, 0},
+                      {EBPF_OP_EXIT, 0, 0, 0, 0},
+                  }) &&
+              success;
+    for (int32_t shift = 1; shift <= 3; shift++) {
+        for (uint8_t base : {0, 8}) {
+            success = check_program(
+                          "scaled index " + std::to_string(shift) + " base r" + std::to_string(base),
+                          {
+                              {EBPF_OP_LDXDW, base, 1, 0, 0},
+                              {EBPF_OP_LDXDW, 7, 1, 8, 0},
+                              {EBPF_OP_LSH64_IMM, 7, 0, 0, shift},
+                              {EBPF_OP_ADD64_REG, base, 7, 0, 0},
+                              {EBPF_OP_MOV64_IMM, 7, 0, 0, 0},
+                              {EBPF_OP_MOV64_REG, 0, base, 0, 0},
+                              {EBPF_OP_EXIT, 0, 0, 0, 0},
+                          }) &&
+                      success;
+        }
+    }
+    return success;
+}
+
+static bool
+test_fusion_and_blinding()
+{
+    // The same additions (and jumps), once as pairs and once with every ADD a jump
+    // target. An LEA takes 3 bytes less than a MOV and an ADD.
+    const int count = 32;
+    std::vector<ebpf_inst> fused;
+    std::vector<ebpf_inst> split;
+    for (int i = 0; i < count; i++) {
+        fused.push_back({EBPF_OP_MOV64_REG, 0, 1, 0, 0});
+        fused.push_back({EBPF_OP_ADD64_IMM, 0, 0, 0, marker});
+        fused.push_back({EBPF_OP_JA, 0, 0, 0, 0});
+        split.push_back({EBPF_OP_MOV64_REG, 0, 1, 0, 0});
+        split.push_back({EBPF_OP_JA, 0, 0, 0, 0});
+        split.push_back({EBPF_OP_ADD64_IMM, 0, 0, 0, marker});
+    }
+    fused.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    split.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    size_t fused_size = code_size(fused, false);
+    size_t split_size = code_size(split, false);
+    if (fused_size == 0 || split_size < fused_size + count * 3) {
+        std::cerr << "Moves and additions were not emitted as LEA (" << fused_size << " vs " << split_size
+                  << " bytes)" << std::endl;
+        return false;
+    }
+
+    std::vector<ebpf_inst> compare = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_LDXDW, 2, 1, 0, 0},
+        {EBPF_OP_JNE_IMM, 2, 0, 1, marker},
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_LDXW, 2, 1, 0, 0},
+        {EBPF_OP_JSET32_IMM, 2, 0, 1, marker},
+        {EBPF_OP_OR64_IMM, 0, 0, 0, 2},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    uint8_t marker_bytes[sizeof(marker)];
+    memcpy(marker_bytes, &marker, sizeof(marker));
+    for (const auto* program : {&fused, &compare}) {
+        std::vector<uint8_t> code;
+        if (code_size(*program, true, &code) == 0) {
+            return false;
+        }
+        for (size_t i = 0; i + sizeof(marker_bytes) <= code.size(); i++) {
+            if (memcmp(&code[i], marker_bytes, sizeof(marker_bytes)) == 0) {
+                std::cerr << "A blinded immediate of a fused pair is in the JIT'd code" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    bool success = test_load_folding();
+    success = test_compare_folding() && success;
+    success = test_lea() && success;
+    success = test_fusion_and_blinding() && success;
+
+    std::cout << (success ? "PASSED" : "FAILED") << std::endl;
+    return success ? 0 : 1;
+}
+
+#else
+
+int
+main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    std::cout << "PASSED: the x86-64 JIT is not built for this platform" << std::endl;
+    return 0;
+}
+
+#endif
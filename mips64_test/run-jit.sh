@@ -0,0 +1,15 @@
+#!/bin/bash
+# Copyright (c) 2026 uBPF contributors
+# SPDX-License-Identifier: Apache-2.0
+
+# Wrapper script for running ubpf_plugin with JIT mode
+# Automatically detects if QEMU is needed (cross-compilation) or can run natively
+
+# Check if we're running on native MIPS64 or need QEMU
+if [ "$(uname -m)" = "mips64" ]; then
+    # Native MIPS64 - run directly
+    ../bin/ubpf_plugin "$@" --jit
+else
+    # Cross-compiled - use QEMU
+    qemu-mips64el -cpu I6400 -L /usr/mipsisa64r6el-linux-gnuabi64 ../bin/ubpf_plugin "$@" --jit
+fi
@@ -0,0 +1,15 @@
+#!/bin/bash
+# Copyright (c) 2026 uBPF contributors
+# SPDX-License-Identifier: Apache-2.0
+
+# Wrapper script for running ubpf_plugin with JIT mode
+# Automatically detects if QEMU is needed (cross-compilation) or can run natively
+
+# Check if we're running on native RISC-V 64 or need QEMU
+if [ "$(uname -m)" = "riscv64" ]; then
+    # Native RISC-V 64 - run directly
+    ../bin/ubpf_plugin "$@" --jit
+else
+    # Cross-compiled - use QEMU
+    qemu-riscv64 -L /usr/riscv64-linux-gnu ../bin/ubpf_plugin "$@" --jit
+fi
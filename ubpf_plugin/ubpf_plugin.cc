@@ -6,6 +6,7 @@
 // value of %r0 at the end of execution.
 // The program is intended to be used with the bpf conformance test suite.
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <vector>
@@ -103,6 +104,8 @@ bytes_to_ebpf_inst(std::vector<uint8_t> bytes)
 int main(int argc, char **argv)
 {
     bool jit = false; // JIT == true, interpreter == false
+    bool aot_c = false; // Translate to C and compile with the system compiler.
+    bool llvm_jit = false; // Compile with the LLVM JIT (LlvmJitMode).
     enum ubpf_execution_profile execution_profile = UBPF_EXECUTION_PROFILE_LEGACY;
     std::vector<std::string> args(argv, argv + argc);
     std::string program_string;
@@ -141,6 +144,18 @@ int main(int argc, char **argv)
             jit = false;
             args.erase(args.begin());
         }
+        else if (args[0] == "--aot-c")
+        {
+            jit = false;
+            aot_c = true;
+            args.erase(args.begin());
+        }
+        else if (args[0] == "--llvm-jit")
+        {
+            jit = false;
+            llvm_jit = true;
+            args.erase(args.begin());
+        }
         else if (args[0] == "--profile")
         {
             if (args.size() < 2) {
@@ -210,6 +225,21 @@ int main(int argc, char **argv)
         ubpf_toggle_constant_blinding(vm.get(), true);
     }
 
+    // Check environment variable for falling back from LSE to LDXR/STXR atomics on arm64
+    const char* disable_lse_env = std::getenv("UBPF_DISABLE_LSE_ATOMICS");
+    if (disable_lse_env != nullptr && std::string(disable_lse_env) == "1")
+    {
+        ubpf_toggle_lse_atomics(vm.get(), false);
+    }
+
+    // Check environment variable for an instruction limit (which the arm64 JIT enforces, too)
+    const char* instruction_limit_env = std::getenv("UBPF_INSTRUCTION_LIMIT");
+    if (instruction_limit_env != nullptr)
+    {
+        ubpf_set_instruction_limit(
+            vm.get(), static_cast<uint32_t>(std::strtoul(instruction_limit_env, nullptr, 10)), nullptr);
+    }
+
     if (ubpf_set_unwind_function_index(vm.get(), 5) != 0)
     {
         std::cerr << "Failed to set unwind function index" << std::endl;
@@ -313,6 +343,107 @@ int main(int argc, char **argv)
             return 1;
         }
     }
+    else if (llvm_jit)
+    {
+        // Compile the program with the LLVM JIT ...
+        ubpf_jit_ex_fn fn = ubpf_compile_ex(vm.get(), &error, LlvmJitMode);
+        if (fn == nullptr)
+        {
+            std::cerr << "Failed to compile program: " << error << std::endl;
+            free(error);
+            return 1;
+        }
+
+        std::vector<uint8_t> usable_program_memory{memory};
+        uint8_t *usable_program_memory_pointer{nullptr};
+        if (usable_program_memory.size() != 0) {
+            usable_program_memory_pointer = usable_program_memory.data();
+        }
+
+        // ... execute it with the external dispatcher ...
+        std::vector<uint8_t> stack(UBPF_EBPF_STACK_SIZE);
+        external_dispatcher_result =
+            fn(usable_program_memory_pointer, usable_program_memory.size(), stack.data(), stack.size());
+
+        // ... and with indexed helpers; the compiled code looks them up at every call ...
+        ubpf_register_external_dispatcher(vm.get(), nullptr, test_helpers_validater);
+        for (auto& [key, value] : helper_functions) {
+            if (ubpf_register(vm.get(), key, "unnamed", value) != 0) {
+                std::cerr << "Failed to register helper function" << std::endl;
+                return 1;
+            }
+        }
+
+        usable_program_memory = memory;
+        usable_program_memory_pointer = nullptr;
+        if (usable_program_memory.size() != 0) {
+            usable_program_memory_pointer = usable_program_memory.data();
+        }
+        std::fill(stack.begin(), stack.end(), 0);
+        uint64_t index_helper_result =
+            fn(usable_program_memory_pointer, usable_program_memory.size(), stack.data(), stack.size());
+
+        // ... and make sure the results are the same.
+        if (external_dispatcher_result != index_helper_result) {
+            std::cerr << "Execution of the LLVM JIT'd code with external and indexed helpers gave different results: 0x"
+                      << std::hex << external_dispatcher_result
+                      << " vs 0x" << std::hex << index_helper_result << "." << std::endl;
+            return 1;
+        }
+    }
+    else if (aot_c)
+    {
+        // Translate the program to C and compile it ...
+        if (ubpf_compile_c(vm.get(), &error) == nullptr)
+        {
+            std::cerr << "Failed to compile program: " << error << std::endl;
+            free(error);
+            return 1;
+        }
+
+        std::vector<uint8_t> usable_program_memory{memory};
+        uint8_t *usable_program_memory_pointer{nullptr};
+        if (usable_program_memory.size() != 0) {
+            usable_program_memory_pointer = usable_program_memory.data();
+        }
+
+        // ... execute it with the external dispatcher ...
+        if (ubpf_exec_c(vm.get(), usable_program_memory_pointer, usable_program_memory.size(), &external_dispatcher_result) != 0)
+        {
+            std::cerr << "Failed to execute program" << std::endl;
+            return 1;
+        }
+
+        // ... and with indexed helpers; the compiled code looks them up at every call ...
+        ubpf_register_external_dispatcher(vm.get(), nullptr, test_helpers_validater);
+        for (auto& [key, value] : helper_functions) {
+            if (ubpf_register(vm.get(), key, "unnamed", value) != 0) {
+                std::cerr << "Failed to register helper function" << std::endl;
+                return 1;
+            }
+        }
+
+        usable_program_memory = memory;
+        usable_program_memory_pointer = nullptr;
+        if (usable_program_memory.size() != 0) {
+            usable_program_memory_pointer = usable_program_memory.data();
+        }
+
+        uint64_t index_helper_result;
+        if (ubpf_exec_c(vm.get(), usable_program_memory_pointer, usable_program_memory.size(), &index_helper_result) != 0)
+        {
+            std::cerr << "Failed to execute program" << std::endl;
+            return 1;
+        }
+
+        // ... and make sure the results are the same.
+        if (external_dispatcher_result != index_helper_result) {
+            std::cerr << "Execution of the compiled C code with external and indexed helpers gave different results: 0x"
+                      << std::hex << external_dispatcher_result
+                      << " vs 0x" << std::hex << index_helper_result << "." << std::endl;
+            return 1;
+        }
+    }
     else
     {
         if (execution_profile == UBPF_EXECUTION_PROFILE_SAFE) {
@@ -0,0 +1,361 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * ubpf-aot: compile eBPF programs ahead of time into a relocatable object file.
+ *
+ * Every program is loaded (and so validated) like it would be at runtime, translated
+ * to C with helpers linked by name (see ubpf_translate_c_ex) and all of them are
+ * compiled into one object file that exports a function per program. Helper calls
+ * become relocations against the host's symbols, so the object is linked into the
+ * host like any other and no code is generated at runtime.
+ */
+
+#include <ubpf_config.h>
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ubpf.h"
+
+#if defined(UBPF_HAS_ELF_H)
+#if defined(UBPF_HAS_ELF_H_COMPAT)
+#include <libelf.h>
+#else
+#include <elf.h>
+#endif
+#endif
+
+#define MAX_HELPERS 64
+
+struct helper
+{
+    unsigned int index;
+    const char* name;
+};
+
+static void
+usage(const char* name)
+{
+    fprintf(
+        stderr,
+        "usage: %s [-h] [-o|--output PATH] [-S|--source] [-H|--helper INDEX:NAME]... [-u|--unwind INDEX]\n"
+        "       [-s|--main-function NAME] [-B|--no-bounds-check] PROGRAM[:FUNCTION]...\n",
+        name);
+    fprintf(stderr, "\nCompiles each eBPF PROGRAM (raw instructions or an ELF file) into a function named\n");
+    fprintf(stderr, "FUNCTION (by default the name of the file) and writes them to one object file.\n");
+    fprintf(stderr, "The functions have the signature of ubpf_c_fn. The object is compiled with $UBPF_CC, $CC or cc.\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -o, --output PATH: Write the object (or the source with -S) to PATH\n");
+    fprintf(stderr, "  -S, --source: Write the generated C source instead of compiling it (to stdout without -o)\n");
+    fprintf(stderr, "  -H, --helper INDEX:NAME: Link calls to helper INDEX against the external function NAME\n");
+    fprintf(stderr, "                           (a program that calls a helper without one is rejected)\n");
+    fprintf(stderr, "  -u, --unwind INDEX: Stop the program when helper INDEX returns 0\n");
+    fprintf(stderr, "  -s, --main-function NAME: Consider the symbol NAME to be the entry point of ELF programs\n");
+    fprintf(stderr, "  -B, --no-bounds-check: Do not check memory accesses at runtime\n");
+}
+
+/*
+ * Registered for every helper given with -H, only so that the programs that call it
+ * validate. The translation calls the helper by its name instead, so this is never part
+ * of the object: a call to a helper without -H fails to load here, and a helper that the
+ * host does not define is an undefined symbol when the object is linked.
+ */
+static uint64_t
+validation_only_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    (void)p0;
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    return 0;
+}
+
+static void*
+readfile(const char* path, size_t maxlen, size_t* len)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    char* data = calloc(maxlen, 1);
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        fclose(file);
+        return NULL;
+    }
+    size_t offset = 0;
+    size_t rv;
+    while ((rv = fread(data + offset, 1, maxlen - offset, file)) > 0) {
+        offset += rv;
+    }
+
+    if (ferror(file)) {
+        fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+        fclose(file);
+        free(data);
+        return NULL;
+    }
+
+    if (!feof(file)) {
+        fprintf(stderr, "Failed to read %s because it is too large (max %u bytes)\n", path, (unsigned)maxlen);
+        fclose(file);
+        free(data);
+        return NULL;
+    }
+
+    fclose(file);
+    *len = offset;
+    return data;
+}
+
+// The function name for PROGRAM without :FUNCTION: the file name without directory and
+// extension, with everything that cannot be in a C identifier replaced by '_'.
+static char*
+default_function_name(const char* path)
+{
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t length = strcspn(base, ".");
+
+    char* name = malloc(length + 2);
+    if (name == NULL) {
+        return NULL;
+    }
+    char* out = name;
+    if (length == 0 || isdigit((unsigned char)base[0])) {
+        *out++ = '_';
+    }
+    for (size_t i = 0; i < length; i++) {
+        *out++ = isalnum((unsigned char)base[i]) ? base[i] : '_';
+    }
+    *out = '\0';
+    return name;
+}
+
+static bool
+parse_helper(const char* value, struct helper* helper)
+{
+    char* end;
+    errno = 0;
+    unsigned long index = strtoul(value, &end, 0);
+    if (errno != 0 || end == value || *end != ':' || end[1] == '\0' || index >= UBPF_MAX_EXT_FUNCS) {
+        return false;
+    }
+    helper->index = (unsigned int)index;
+    helper->name = end + 1;
+    return true;
+}
+
+// Load one program and append its translation to *source.
+static bool
+translate_program(
+    const char* path,
+    const char* function_name,
+    const struct helper* helpers,
+    int helper_count,
+    int unwind_index,
+    bool bounds_check,
+    const char* main_function_name,
+    char** source)
+{
+    size_t code_len;
+    void* code = readfile(path, 1024 * 1024, &code_len);
+    if (code == NULL) {
+        return false;
+    }
+
+    struct ubpf_vm* vm = ubpf_create();
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to create VM\n");
+        free(code);
+        return false;
+    }
+
+    bool succeeded = false;
+    char* errmsg = NULL;
+    char* translation = NULL;
+    for (int i = 0; i < helper_count; i++) {
+        if (ubpf_register(vm, helpers[i].index, helpers[i].name, validation_only_helper) != 0) {
+            fprintf(stderr, "Failed to register helper %u (%s)\n", helpers[i].index, helpers[i].name);
+            goto done;
+        }
+    }
+    if (unwind_index >= 0 && ubpf_set_unwind_function_index(vm, unwind_index) != 0) {
+        fprintf(stderr, "Failed to set the unwind helper to %d\n", unwind_index);
+        goto done;
+    }
+    ubpf_toggle_bounds_check(vm, bounds_check);
+
+    int rv;
+#if defined(UBPF_HAS_ELF_H)
+    if (code_len >= SELFMAG && !memcmp(code, ELFMAG, SELFMAG)) {
+        rv = ubpf_load_elf_ex(vm, code, code_len, main_function_name, &errmsg);
+    } else {
+#endif
+        (void)main_function_name;
+        rv = ubpf_load(vm, code, (uint32_t)code_len, &errmsg);
+#if defined(UBPF_HAS_ELF_H)
+    }
+#endif
+    if (rv < 0) {
+        fprintf(stderr, "Failed to load %s: %s\n", path, errmsg);
+        goto done;
+    }
+
+    if (ubpf_translate_c_ex(vm, function_name, UBPF_C_HELPERS_SYMBOLS, &translation, &errmsg) < 0) {
+        fprintf(stderr, "Failed to translate %s: %s\n", path, errmsg);
+        goto done;
+    }
+
+    size_t length = *source ? strlen(*source) : 0;
+    char* combined = realloc(*source, length + strlen(translation) + 2);
+    if (combined == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+    if (length > 0) {
+        combined[length++] = '\n';
+    }
+    strcpy(combined + length, translation);
+    *source = combined;
+    succeeded = true;
+
+done:
+    free(translation);
+    free(errmsg);
+    ubpf_destroy(vm);
+    free(code);
+    return succeeded;
+}
+
+int
+main(int argc, char** argv)
+{
+    struct option longopts[] = {
+        {.name = "help", .val = 'h'},
+        {.name = "output", .val = 'o', .has_arg = 1},
+        {.name = "source", .val = 'S'},
+        {.name = "helper", .val = 'H', .has_arg = 1},
+        {.name = "unwind", .val = 'u', .has_arg = 1},
+        {.name = "main-function", .val = 's', .has_arg = 1},
+        {.name = "no-bounds-check", .val = 'B'},
+        {0}};
+
+    const char* output = NULL;
+    const char* main_function_name = NULL;
+    struct helper helpers[MAX_HELPERS];
+    int helper_count = 0;
+    int unwind_index = -1;
+    bool write_source = false;
+    bool bounds_check = true;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ho:SH:u:s:B", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'o':
+            output = optarg;
+            break;
+        case 'S':
+            write_source = true;
+            break;
+        case 'H':
+            if (helper_count == MAX_HELPERS || !parse_helper(optarg, &helpers[helper_count])) {
+                fprintf(stderr, "Invalid helper %s\n", optarg);
+                return 1;
+            }
+            helper_count++;
+            break;
+        case 'u':
+            unwind_index = atoi(optarg);
+            break;
+        case 's':
+            main_function_name = optarg;
+            break;
+        case 'B':
+            bounds_check = false;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind == argc || (output == NULL && !write_source)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char* source = NULL;
+    for (int i = optind; i < argc; i++) {
+        // PROGRAM[:FUNCTION]; a colon followed by a path separator is part of the path.
+        char* path = strdup(argv[i]);
+        char* separator = path ? strrchr(path, ':') : NULL;
+        char* function_name;
+        if (separator != NULL && strchr(separator, '/') == NULL && strchr(separator, '\\') == NULL) {
+            *separator = '\0';
+            function_name = strdup(separator + 1);
+        } else {
+            function_name = path ? default_function_name(path) : NULL;
+        }
+        bool translated = path != NULL && function_name != NULL &&
+                          translate_program(
+                              path,
+                              function_name,
+                              helpers,
+                              helper_count,
+                              unwind_index,
+                              bounds_check,
+                              main_function_name,
+                              &source);
+        if (path == NULL || function_name == NULL) {
+            fprintf(stderr, "Out of memory\n");
+        }
+        free(function_name);
+        free(path);
+        if (!translated) {
+            free(source);
+            return 1;
+        }
+    }
+
+    if (write_source) {
+        FILE* file = output ? fopen(output, "w") : stdout;
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+            free(source);
+            return 1;
+        }
+        bool written = fputs(source, file) >= 0;
+        if ((output && fclose(file) != 0) || !written) {
+            fprintf(stderr, "Failed to write %s\n", output ? output : "the source");
+            free(source);
+            return 1;
+        }
+        free(source);
+        return 0;
+    }
+
+    char* errmsg = NULL;
+    if (ubpf_compile_c_object(source, output, &errmsg) < 0) {
+        fprintf(stderr, "Failed to compile %s: %s\n", output, errmsg);
+        free(errmsg);
+        free(source);
+        return 1;
+    }
+    free(source);
+    return 0;
+}
@@ -72,6 +72,13 @@ extern "C"
 #define UBPF_MAX_EXT_FUNCS 64
 #endif
 
+/**
+ * @brief Maximum number of threads that the JIT can translate a program on (see \ref ubpf_set_jit_threads).
+ */
+#if !defined(UBPF_MAX_JIT_THREADS)
+#define UBPF_MAX_JIT_THREADS 64
+#endif
+
 #define UBPF_EBPF_NONVOLATILE_SIZE (sizeof(uint64_t) * 5)
 
 
@@ -80,6 +87,16 @@ extern "C"
      */
     struct ubpf_vm;
 
+    /**
+     * @brief Opaque type for a validated program that several VMs can run.
+     */
+    struct ubpf_program;
+
+    /**
+     * @brief Opaque type for an instance of a compiled program, with helpers of its own.
+     */
+    struct ubpf_instance;
+
     /**
      * @brief Opaque type for a uBPF JIT compiled function.
      *
@@ -113,11 +130,18 @@ extern "C"
      * The function generated by the JITer executing in basic mode automatically
      * allocates a stack for the program's execution.
      * See ubpf_jit_fn for more information.
+     *
+     * LlvmJitMode has the calling convention of ExtendedJitMode, but the program is
+     * lowered to LLVM IR, optimized at O2 and compiled with LLVM's ORC JIT instead of
+     * the template JIT. Compilation is much slower and the code is usually faster. It is
+     * only available if uBPF was built with UBPF_ENABLE_LLVM_JIT, and only through
+     * ubpf_compile_ex: the code cannot be translated into or copied to a buffer.
      */
     enum JitMode
     {
         ExtendedJitMode,
-        BasicJitMode
+        BasicJitMode,
+        LlvmJitMode
     };
 
     /**
@@ -138,6 +162,8 @@ extern "C"
 
     /**
      * @brief Enable / disable bounds_check. Bounds check is enabled by default, but it may be too restrictive.
+     * On arm64, the JIT'd code checks bounds, too (and returns UINT64_MAX from an access that fails the check);
+     * the setting at the time the program is compiled applies.
      *
      * @param[in] vm The VM to enable / disable bounds check on.
      * @param[in] enable Enable bounds check if true, disable if false.
@@ -169,6 +195,22 @@ extern "C"
     bool
     ubpf_toggle_constant_blinding(struct ubpf_vm* vm, bool enable);
 
+    /**
+     * @brief Enable / disable the ARMv8.1 LSE atomic instructions in the arm64 JIT compiler.
+     * With LSE, eBPF atomic operations are compiled to single LDADD, LDSET, LDCLR, LDEOR,
+     * SWP and CAS instructions, which scale much better under contention than the
+     * LDXR/STXR retry loops that are used otherwise. By default, LSE is enabled if (and
+     * only if) the processor supports it. Enabling it on a processor without LSE makes
+     * JIT'd atomic operations fault. It takes effect at the next compilation and has no
+     * effect on other architectures.
+     *
+     * @param[in] vm The VM to enable / disable LSE atomics on.
+     * @param[in] enable Enable LSE atomics if true, disable if false.
+     * @retval true LSE atomics were previously enabled.
+     */
+    bool
+    ubpf_toggle_lse_atomics(struct ubpf_vm* vm, bool enable);
+
     /**
      * @brief Execution profile for a VM instance.
      *
@@ -382,8 +424,11 @@ extern "C"
      * The callback's job is to calculate the amount of stack space used by the local function that
      * starts at the given PC.
      *
-     * If the callback returns 0 or there is no callback registered, the eBPF interpreter/JITer
-     * assume that the local function uses the maximum stack available according to the spec (512K).
+     * If there is no callback registered, the size of each function's frame is computed
+     * from the accesses that it makes relative to r10 when the program is loaded. A function
+     * whose accesses cannot be followed (for example, because a pointer into its frame is
+     * stored to memory or passed to a local function) is assumed to use
+     * UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE bytes.
      *
      * @param[in] vm The VM to register the callback with.
      * @param[in] dispatcher The callback that will be invoked to determine the amount of stack
@@ -433,6 +478,55 @@ extern "C"
     void
     ubpf_unload_code(struct ubpf_vm* vm);
 
+    /**
+     * @brief Get the program loaded into a VM, so that other VMs can run it.
+     *
+     * A program holds what does not change once code is loaded: the read-only
+     * bytecode and what validation and the load-time analyses computed about it. It
+     * stays valid until it is released with ubpf_release_program(), even if the VM is
+     * destroyed.
+     *
+     * @param[in] vm The VM that the code was loaded into.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @return A reference to the program, or NULL if no code is loaded.
+     */
+    struct ubpf_program*
+    ubpf_get_program(struct ubpf_vm* vm, char** errmsg);
+
+    /**
+     * @brief Release a reference to a program returned by ubpf_get_program().
+     *
+     * The program is freed once it is released and all the VMs that run it have
+     * unloaded it.
+     *
+     * @param[in] program The program, or NULL.
+     */
+    void
+    ubpf_release_program(struct ubpf_program* program);
+
+    /**
+     * @brief Make a VM an instance of a program that another VM loaded.
+     *
+     * This takes the place of ubpf_load() and must likewise be done after registering
+     * all functions. Instead of validating and analyzing the code again, the VM shares
+     * the program and only checks that it has the helpers that the program calls. The
+     * VM takes the options that the program was loaded with (the execution profile,
+     * bounds and undefined behavior checks, read-only bytecode, the minimum context size
+     * and the pointer secret); its helpers, external dispatcher, regions and instruction
+     * limit are its own. If it is compiled with the same JIT options as another VM that
+     * runs the program, it shares that VM's JIT'd code (see ubpf_toggle_program_cache()).
+     *
+     * @param[in] vm The VM to load the program into.
+     * @param[in] program The program, from ubpf_get_program().
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Code is already loaded, a helper that the program calls is missing or, if
+     * the program was loaded after ubpf_set_minimum_context_size(), the VM's safe
+     * helpers differ from those of the VM that loaded it.
+     */
+    int
+    ubpf_load_program(struct ubpf_vm* vm, struct ubpf_program* program, char** errmsg);
+
 #if defined(UBPF_HAS_ELF_H)
     /**
      * @brief Load code from an ELF file.
@@ -583,6 +677,9 @@ extern "C"
      * Note: Caller must know the mode in which the JITer was executed and may
      * need to cast the result to the appropriate type (e.g., ubpf_jit_ex_fn).
      *
+     * The copy starts with a short stub that passes the VM's helper table to the
+     * code, so it may only run while the VM exists.
+     *
      * @param[in] vm The VM of the already JIT'd program.
      * @param[out] errmsg The error message, if any. This should be freed by the caller.
      * @return A pointer to the compiled program (the same as buffer), or
@@ -601,6 +698,10 @@ extern "C"
      * Safe-profile VMs are rejected because the first revision of the safe
      * execution profile is interpreter-only.
      *
+     * The machine code expects the address of the VM's helper table in a register
+     * that only the VM's entry stub sets; run it with \ref ubpf_compile or
+     * \ref ubpf_copy_jit.
+     *
      * @param[in] vm The VM to translate the program in.
      * @param[out] buffer The buffer to store the translated code in.
      * @param[in] size The size of the buffer.
@@ -621,6 +722,10 @@ extern "C"
      * Safe-profile VMs are rejected because the first revision of the safe
      * execution profile is interpreter-only.
      *
+     * The machine code expects the address of the VM's helper table in a register
+     * that only the VM's entry stub sets; run it with \ref ubpf_compile or
+     * \ref ubpf_copy_jit.
+     *
      * @param[in] vm The VM to translate the program in.
      * @param[out] buffer The buffer to store the translated code in.
      * @param[in] size The size of the buffer.
@@ -764,10 +869,35 @@ extern "C"
     int
     ubpf_set_jit_code_size(struct ubpf_vm* vm, size_t code_size);
 
+    /**
+     * @brief Set the number of threads that the JIT translates a program on.
+     * The local functions of a program are then translated at the same time, and the
+     * generated code is the same as when the program is translated on one thread, which
+     * is the default. Only the x86-64 JIT uses more than one thread, and not when a
+     * branch profile moves code out of its function (see \ref ubpf_set_branch_profile).
+     *
+     * @param[in] vm The VM to set the number of threads for.
+     * @param[in] threads The number of threads, including the one that compiles; between 1
+     *  and \ref UBPF_MAX_JIT_THREADS.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_set_jit_threads(struct ubpf_vm* vm, unsigned int threads);
+
     /**
      * @brief Set the instruction limit for the VM. This is the maximum number
      * of instructions that a program may execute during a call to ubpf_exec.
-     * It has no effect on JIT'd programs.
+     * On arm64 and in LlvmJitMode, JIT'd programs are stopped (and return UINT64_MAX)
+     * before the basic block in which they would exceed it; it has no effect
+     * on programs JIT'd for other architectures or compiled before it was set.
+     * JIT'd code is charged for a whole basic block before the block runs, but the
+     * interpreter stops at the instruction that exceeds the limit. A program that
+     * runs out partway through a block therefore stops earlier in JIT'd code: the
+     * interpreter has already run the helper calls and stores that come before that
+     * instruction in the block, and JIT'd code has not.
+     * A program whose instruction bound (see ubpf_get_instruction_bound) is within
+     * the limit cannot exceed it and is run without counting instructions.
      *
      * @param[in] vm The VM to set the instruction limit for.
      * @param[in] limit The maximum number of instructions that a program may execute or 0 for no limit.
@@ -778,11 +908,37 @@ extern "C"
     int
     ubpf_set_instruction_limit(struct ubpf_vm* vm, uint32_t limit, uint32_t* previous_limit);
 
+    /**
+     * @brief Get an upper bound on the number of instructions that the loaded program
+     * executes, counted as for ubpf_set_instruction_limit (including those of the local
+     * functions it calls).
+     *
+     * The bound is computed when the program is loaded. It is known for programs
+     * without loops and for loops with a constant trip count: a loop that is only
+     * entered at its first instruction and that jumps back to it from its last one
+     * if a register that is set to an immediate before the loop, and changed only by
+     * adding or subtracting an immediate once per iteration, compares with an
+     * immediate. It is not known for other loops or for recursive local calls.
+     *
+     * @param[in] vm The VM instance.
+     * @param[out] bound The maximum number of instructions the program executes.
+     * @retval 0 Success.
+     * @retval -1 No program is loaded or its bound is not known.
+     */
+    int
+    ubpf_get_instruction_bound(const struct ubpf_vm* vm, uint64_t* bound);
+
     /**
      * @brief Enable or disable undefined behavior checks. Undefined behavior includes
      * reading from uninitialized memory or using uninitialized registers. Default is disabled to
      * preserve performance and compatibility with existing eBPF programs.
      *
+     * If the checks are enabled when the program is loaded, a dataflow analysis proves which of
+     * them pass, and the interpreter only tracks the initialized registers and stack bytes up to
+     * the instructions whose checks it could not prove. The errors that are reported are the
+     * same. The state is tracked at every instruction when a debug function is registered or the
+     * checks are enabled after the program is loaded.
+     *
      * @param[in] vm VM to enable or disable undefined behavior checks on.
      * @param[in] enable Enable undefined behavior checks if true, disable if false.
      * @retval true Undefined behavior checks were previously enabled.
@@ -809,6 +965,434 @@ extern "C"
     bool
     ubpf_toggle_readonly_bytecode(struct ubpf_vm* vm, bool enable);
 
+    /**
+     * @brief The number of times that a conditional jump was taken and not taken.
+     */
+    struct ubpf_branch_profile_entry
+    {
+        uint32_t taken;     ///< Number of times control transferred to the jump's target.
+        uint32_t not_taken; ///< Number of times control fell through the jump.
+    };
+
+    /**
+     * @brief Enable or disable branch profiling in the interpreter.
+     *
+     * When enabled, ubpf_load() allocates a profile with one entry per instruction and
+     * every execution in the interpreter counts how often each conditional jump is taken
+     * and not taken. Entries for other instructions stay zero. The counters are not
+     * updated atomically, so concurrent executions may lose counts.
+     *
+     * A program that is JIT compiled while the VM holds a profile is laid out using it:
+     * the hot successor of a biased branch becomes the fall-through path and blocks that
+     * the profile shows are never entered (error returns, bounds failures) are moved to
+     * the end of the JIT'd code.
+     *
+     * @param[in] vm The VM instance.
+     * @param[in] enable True to enable branch profiling, false to disable.
+     * @retval true Branch profiling was previously enabled.
+     * @retval false Branch profiling was previously disabled.
+     *
+     * @note Must be called before ubpf_load(). Has no effect on already loaded code.
+     * @note Only the interpreter for the legacy execution profile records branches.
+     */
+    bool
+    ubpf_toggle_branch_profiling(struct ubpf_vm* vm, bool enable);
+
+    /**
+     * @brief Enable or disable sharing the programs that the VM loads through the
+     * process-wide program cache.
+     *
+     * When enabled, ubpf_load() looks the program up in the cache by its bytecode and
+     * by the options that validation and the load-time analyses depend on (the
+     * execution profile, bounds and undefined behavior checks, read-only bytecode, the
+     * minimum context size, the pointer secret and safe helper metadata). If another VM
+     * already loaded it, the VM shares that VM's read-only bytecode and analysis
+     * results instead of validating and analyzing the program again; only its helper
+     * calls are checked against the VM's own helpers. Otherwise the program is loaded
+     * as usual and added to the cache. A shared program is freed when the last VM that
+     * loaded it unloads it.
+     *
+     * Helpers, the external dispatcher and the other bindings stay with each VM. JIT'd
+     * code is shared too: a VM that compiles a shared program with the same JIT mode and
+     * JIT options (constant blinding, LSE atomics, instruction limit and unwind helper)
+     * as another VM runs the code that the other VM compiled, through an entry stub of its
+     * own that passes it the VM's bindings. Code compiled for a branch profile is not
+     * shared. Programs are not shared when a stack usage calculator is registered.
+     *
+     * @param[in] vm The VM instance.
+     * @param[in] enable True to share programs through the cache, false to disable.
+     * @retval true The program cache was previously enabled.
+     * @retval false The program cache was previously disabled.
+     *
+     * @note Must be called before ubpf_load(). Has no effect on already loaded code.
+     */
+    bool
+    ubpf_toggle_program_cache(struct ubpf_vm* vm, bool enable);
+
+    /**
+     * @brief Statistics of the process-wide program cache.
+     */
+    struct ubpf_program_cache_stats
+    {
+        uint32_t programs; ///< Programs that the cache holds.
+        uint64_t hits;     ///< Loads that shared a cached program.
+        uint64_t misses;   ///< Loads with the cache enabled that did not find the program.
+        uint64_t jit_hits; ///< Compilations that shared code that another VM compiled for the program.
+    };
+
+    /**
+     * @brief Get the statistics of the process-wide program cache.
+     *
+     * @param[out] stats The number of cached programs, of cache hits and misses and of
+     * compilations that shared JIT'd code.
+     */
+    void
+    ubpf_get_program_cache_stats(struct ubpf_program_cache_stats* stats);
+
+    /**
+     * @brief Create an instance of the program that a VM compiled.
+     *
+     * An instance holds nothing but what is its own: its helpers, external dispatcher,
+     * bounds check and error hooks, and an entry point that passes them to the JIT'd
+     * code. It points at the VM's program and JIT'd code, which it shares with the VM and
+     * with every other instance of the program, and stays valid after the VM is destroyed.
+     * Creating one neither validates nor compiles anything. The memory and stack that the
+     * program runs with are those passed to each call of the instance's function.
+     *
+     * An instance starts without helpers; register the ones that the program calls
+     * before calling ubpf_get_instance_function().
+     *
+     * @param[in] vm A VM that compiled its program with a native JIT (ubpf_compile() or
+     * ubpf_compile_ex() in BasicJitMode or ExtendedJitMode).
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @return The instance, or NULL if the VM has not compiled its program or memory runs out.
+     */
+    struct ubpf_instance*
+    ubpf_create_instance(struct ubpf_vm* vm, char** errmsg);
+
+    /**
+     * @brief Destroy an instance. The program and its JIT'd code are freed once no VM or
+     * instance runs them.
+     *
+     * @param[in] instance The instance, or NULL.
+     */
+    void
+    ubpf_destroy_instance(struct ubpf_instance* instance);
+
+    /**
+     * @brief Register a helper with an instance, like ubpf_register() does with a VM.
+     *
+     * @param[in] instance The instance.
+     * @param[in] idx The index of the helper.
+     * @param[in] fn The helper.
+     * @retval 0 Success.
+     * @retval -1 The index is out of range.
+     */
+    int
+    ubpf_instance_register(struct ubpf_instance* instance, unsigned int idx, external_function_t fn);
+
+    /**
+     * @brief Register an external dispatcher with an instance, like
+     * ubpf_register_external_dispatcher() does with a VM. The helper calls of the program
+     * were validated when it was loaded, so the dispatcher has no validation function.
+     *
+     * @param[in] instance The instance.
+     * @param[in] dispatcher The callback that will dispatch every helper call, or NULL to
+     * call the registered helpers.
+     * @retval 0 Success.
+     */
+    int
+    ubpf_instance_register_external_dispatcher(
+        struct ubpf_instance* instance, external_function_dispatcher_t dispatcher);
+
+    /**
+     * @brief Set the function that reports the errors of an instance, like
+     * ubpf_set_error_print() does for a VM.
+     *
+     * @param[in] instance The instance.
+     * @param[in] error_printf The function, or NULL for fprintf.
+     */
+    void
+    ubpf_instance_set_error_print(
+        struct ubpf_instance* instance, int (*error_printf)(FILE* stream, const char* format, ...));
+
+    /**
+     * @brief Set the bounds check function of an instance, like
+     * ubpf_register_data_bounds_check() does for a VM.
+     *
+     * @param[in] instance The instance.
+     * @param[in] user_context The context to pass to the function.
+     * @param[in] bounds_check The function.
+     * @retval 0 Success.
+     * @retval -1 A bounds check function is already registered.
+     */
+    int
+    ubpf_instance_register_data_bounds_check(
+        struct ubpf_instance* instance, void* user_context, ubpf_bounds_check bounds_check);
+
+    /**
+     * @brief Get the function that runs the program with the bindings of an instance.
+     *
+     * The function has the signature of the mode that the VM compiled the program in: a
+     * ubpf_jit_fn for BasicJitMode and a ubpf_jit_ex_fn for ExtendedJitMode. Several
+     * threads may call it at the same time.
+     *
+     * @param[in] instance The instance.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @return The function, or NULL if the instance has no external dispatcher and lacks a
+     * helper that the program calls.
+     */
+    ubpf_jit_ex_fn
+    ubpf_get_instance_function(struct ubpf_instance* instance, char** errmsg);
+
+    /**
+     * @brief Copy the branch profile of the loaded program.
+     *
+     * @param[in] vm The VM instance.
+     * @param[out] profile Buffer that receives one entry per instruction.
+     * @param[in] count The number of entries that fit in profile.
+     * @return The number of entries copied or -1 if the VM has no profile or
+     *         profile is too small to hold it.
+     */
+    int
+    ubpf_get_branch_profile(const struct ubpf_vm* vm, struct ubpf_branch_profile_entry* profile, uint32_t count);
+
+    /**
+     * @brief Give the VM a branch profile to guide JIT code layout.
+     *
+     * Replaces the profile of the loaded program, e.g., with one that was recorded by
+     * another VM running the same program. It takes effect at the next call to
+     * ubpf_compile() or ubpf_compile_ex().
+     *
+     * @param[in] vm The VM instance.
+     * @param[in] profile One entry per instruction of the loaded program.
+     * @param[in] count The number of entries in profile.
+     * @param[out] errmsg Error message if the profile could not be set. Must be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_set_branch_profile(
+        struct ubpf_vm* vm, const struct ubpf_branch_profile_entry* profile, uint32_t count, char** errmsg);
+
+    /**
+     * @brief Get the number of bytes of eBPF stack that the loaded program needs.
+     *
+     * When a program is loaded, the VM detects whether it (or any of its local
+     * functions) ever uses r10. A program that does not can neither spill to nor
+     * read from the stack, so it is run without one: ubpf_exec() does not set up
+     * a stack and code JIT'd in BasicJitMode does not reserve host stack space for
+     * it. Such a program may be given a NULL stack of length 0 in ubpf_exec_ex()
+     * and in code JIT'd in ExtendedJitMode.
+     *
+     * Otherwise, if the size of every function's frame was computed (see
+     * ubpf_register_stack_usage_calculator), the requirement is the most stack that
+     * any chain of at most UBPF_MAX_CALL_DEPTH frames of local calls uses, so that
+     * an external stack of that size is enough.
+     *
+     * @param[in] vm The VM instance.
+     * @return 0 if no program is loaded or the program never uses the stack, the
+     *  largest stack depth of the program's call graph if it is known and smaller than
+     *  UBPF_EBPF_STACK_SIZE, and UBPF_EBPF_STACK_SIZE otherwise.
+     */
+    size_t
+    ubpf_get_stack_requirement(const struct ubpf_vm* vm);
+
+    /**
+     * @brief Declare the smallest memory (context) that programs loaded into the VM
+     * will be run with, and so enable the range verifier.
+     *
+     * When a program is loaded, the range verifier tracks which registers hold
+     * pointers into the context, into the stack or into a region returned by a
+     * safe helper, and the ranges of their offsets and of scalars. The accesses of
+     * the main function that it proves in bounds are run without a bounds check by
+     * the interpreter and by the JITs that check accesses. In exchange, while bounds
+     * checks are enabled, running the program with less than size bytes of memory
+     * (or a NULL one), or with a stack smaller than ubpf_get_stack_requirement(),
+     * fails.
+     *
+     * @param[in] vm The VM instance.
+     * @param[in] size The minimum size of the memory, in bytes.
+     * @retval 0 Success.
+     * @retval -1 Code is already loaded.
+     */
+    int
+    ubpf_set_minimum_context_size(struct ubpf_vm* vm, size_t size);
+
+    /**
+     * @brief What the range verifier proved about the loaded program.
+     */
+    struct ubpf_range_report
+    {
+        uint32_t accesses; ///< Loads, stores and atomic operations in the program.
+        uint32_t proven;   ///< Those whose bounds check is left out.
+    };
+
+    /**
+     * @brief Get what the range verifier proved about the loaded program.
+     *
+     * @param[in] vm The VM instance.
+     * @param[out] report The number of memory accesses and of proven ones.
+     * @retval 0 Success.
+     * @retval -1 No program was loaded after ubpf_set_minimum_context_size().
+     */
+    int
+    ubpf_get_range_report(const struct ubpf_vm* vm, struct ubpf_range_report* report);
+
+    /**
+     * @brief What a program translated to C by \ref ubpf_translate_c needs from its host.
+     *
+     * The generated function calls helpers by index: through the dispatcher if it is
+     * set and through helpers[index] otherwise. Helpers get the context as a sixth
+     * argument, just as in the interpreter and the JITs.
+     */
+    struct ubpf_c_environment
+    {
+        external_function_dispatcher_t dispatcher; ///< Called for every helper call if not NULL.
+        const external_function_t* helpers;        ///< UBPF_MAX_EXT_FUNCS helpers, indexed by call immediate.
+        ubpf_bounds_check bounds_check;            ///< Consulted for accesses outside the context and stack.
+        void* bounds_check_context;                ///< Passed to bounds_check.
+    };
+
+    /**
+     * @brief A program translated to C and compiled.
+     *
+     * @param[in] mem The context, passed in r1.
+     * @param[in] mem_len The size of the context, passed in r2.
+     * @param[in] stack The eBPF stack. May be NULL (and stack_len 0) if the program
+     *  does not use the stack, see \ref ubpf_get_stack_requirement.
+     * @param[in] stack_len The size of the stack.
+     * @param[in] env The helpers and the bounds check function.
+     * @param[out] bpf_return_value The value of r0 when the program exits.
+     * @retval 0 Success.
+     * @retval -1 A memory access failed the bounds check or local calls nested too deeply.
+     */
+    typedef int (*ubpf_c_fn)(
+        void* mem,
+        size_t mem_len,
+        uint8_t* stack,
+        size_t stack_len,
+        const struct ubpf_c_environment* env,
+        uint64_t* bpf_return_value);
+
+    /**
+     * @brief Translate the loaded program into a self-contained C function.
+     *
+     * This is a portable alternative to the JIT for targets that do not have one:
+     * the generated source only needs a C99 compiler and can be compiled into the
+     * host at build time or at runtime with \ref ubpf_compile_c. The function is
+     * named function_name and has the signature of \ref ubpf_c_fn.
+     *
+     * Bounds checks are emitted only if they are enabled in the VM (see
+     * \ref ubpf_toggle_bounds_check). The unwind helper index and the values of
+     * LDDW instructions (including relocated map addresses) are fixed at
+     * translation. The instruction limit is not enforced. Safe-profile VMs are
+     * rejected because the safe execution profile is interpreter-only.
+     *
+     * @param[in] vm The VM with the program to translate.
+     * @param[in] function_name The name of the generated function; a C identifier.
+     * @param[out] source The generated C source. This should be freed by the caller.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_translate_c(struct ubpf_vm* vm, const char* function_name, char** source, char** errmsg);
+
+    /**
+     * @brief Translate the loaded program to C, compile it and load the result.
+     *
+     * The source is compiled into a shared object with $UBPF_CC, $CC or cc (in that
+     * order) and then loaded with dlopen. The shared object stays loaded until the
+     * code is unloaded from the VM or the VM is destroyed. Not supported on Windows.
+     *
+     * @param[in] vm The VM with the program to compile.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @return The compiled program, or NULL on failure.
+     */
+    ubpf_c_fn
+    ubpf_compile_c(struct ubpf_vm* vm, char** errmsg);
+
+    /**
+     * @brief How a program translated to C reaches its helpers.
+     */
+    enum ubpf_c_helper_linkage
+    {
+        /// Through the dispatcher or helper table of the \ref ubpf_c_environment (the default).
+        UBPF_C_HELPERS_ENVIRONMENT,
+        /// By direct calls to external functions named as the helpers were registered, e.g.
+        /// uint64_t name(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, void* context).
+        /// Compiling the translation leaves a relocation against each of these symbols,
+        /// which is resolved when the object is linked into the host.
+        UBPF_C_HELPERS_SYMBOLS,
+    };
+
+    /**
+     * @brief Translate the loaded program into a self-contained C function, choosing how
+     * helpers are called.
+     *
+     * With UBPF_C_HELPERS_SYMBOLS every helper the program calls must have been
+     * registered under a name that is a C identifier, and the environment passed to
+     * the function is only consulted for the bounds check function; it may be NULL.
+     * Several translations (with different function names) can be concatenated into
+     * one translation unit.
+     *
+     * @param[in] vm The VM with the program to translate.
+     * @param[in] function_name The name of the generated function; a C identifier.
+     * @param[in] linkage How helpers are called.
+     * @param[out] source The generated C source. This should be freed by the caller.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_translate_c_ex(
+        struct ubpf_vm* vm,
+        const char* function_name,
+        enum ubpf_c_helper_linkage linkage,
+        char** source,
+        char** errmsg);
+
+    /**
+     * @brief Compile C source (such as the output of \ref ubpf_translate_c_ex) into a
+     * relocatable object file that can be linked into the host at build time.
+     *
+     * The compiler is chosen as for \ref ubpf_compile_c. The object contains no
+     * writable code and needs no runtime code generation. Not supported on Windows.
+     *
+     * @param[in] source The C source.
+     * @param[in] object_path Where to write the object file.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_compile_c_object(const char* source, const char* object_path, char** errmsg);
+
+    /**
+     * @brief Fill in the environment for a program translated to C from the helpers,
+     * the external dispatcher and the bounds check function registered with the VM.
+     *
+     * @param[in] vm The VM to take the environment from.
+     * @param[out] env The environment.
+     */
+    void
+    ubpf_get_c_environment(const struct ubpf_vm* vm, struct ubpf_c_environment* env);
+
+    /**
+     * @brief Run the program compiled by \ref ubpf_compile_c with the environment of the VM
+     * and, if the program uses one, a stack of UBPF_EBPF_STACK_SIZE bytes.
+     *
+     * @param[in] vm The VM with the compiled program.
+     * @param[in] mem The context.
+     * @param[in] mem_len The size of the context.
+     * @param[out] bpf_return_value The value of r0 when the program exits.
+     * @retval 0 Success.
+     * @retval -1 The program has not been compiled or it failed at runtime.
+     */
+    int
+    ubpf_exec_c(const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value);
+
     /**
      * @brief A function to invoke before each instruction.
      *
@@ -43,7 +43,7 @@
 #endif
 
 void
-ubpf_set_register_offset(int x);
+ubpf_set_register_offset(struct ubpf_vm* vm, int x);
 static void*
 readfile(const char* path, size_t maxlen, size_t* len);
 static int
@@ -56,7 +56,7 @@ register_safe_scalar_helper(struct ubpf_vm* vm, unsigned int index, const char*
 static void
 usage(const char* name)
 {
-    fprintf(stderr, "usage: %s [-h] [-j|--jit] [-m|--mem PATH] [-p|--profile PROFILE] BINARY\n", name);
+    fprintf(stderr, "usage: %s [-h] [-j|--jit] [-l|--llvm-jit] [-c|--aot-c] [-m|--mem PATH] [-p|--profile PROFILE] BINARY\n", name);
     fprintf(stderr, "\nExecutes the eBPF code in BINARY and prints the result to stdout.\n");
     fprintf(
         stderr, "If --mem is given then the specified file will be read and a pointer\nto its data passed in r1.\n");
@@ -73,6 +73,8 @@ usage(const char* name)
         stderr,
         "      See docs/VerifiedPrograms.md for more information.\n");
     fprintf(stderr, "If --jit is given then the JIT compiler will be used.\n");
+    fprintf(stderr, "If --llvm-jit is given then the LLVM JIT compiler will be used.\n");
+    fprintf(stderr, "If --aot-c is given then the program will be translated to C and compiled with $CC.\n");
     fprintf(stderr, "\nOther options:\n");
     fprintf(stderr, "  -r, --register-offset NUM: Change the mapping from eBPF to x86 registers\n");
     fprintf(
@@ -83,6 +85,10 @@ usage(const char* name)
         stderr, "  -R, --reload: reload the code, without unloading it first (for testing only, this should fail)\n");
     fprintf(stderr, "  -s, --main-function NAME: Consider the symbol NAME to be the eBPF program's entry point\n");
     fprintf(stderr, "  -p, --profile PROFILE: Select execution profile (legacy or safe)\n");
+    fprintf(
+        stderr,
+        "  -V, --verifier-report: Declare the size of --mem as the minimum context size and report the\n"
+        "      memory accesses that the range verifier proves in bounds\n");
 }
 
 typedef struct _map_entry
@@ -223,26 +229,33 @@ main(int argc, char** argv)
         },
         {.name = "mem", .val = 'm', .has_arg = 1},
         {.name = "jit", .val = 'j'},
+        {.name = "llvm-jit", .val = 'l'},
+        {.name = "aot-c", .val = 'c'},
         {.name = "data", .val = 'd'},
         {.name = "register-offset", .val = 'r', .has_arg = 1},
         {.name = "unload", .val = 'U'}, /* for unit test only */
         {.name = "reload", .val = 'R'}, /* for unit test only */
         {.name = "main-function", .val = 's', .has_arg = 1},
         {.name = "profile", .val = 'p', .has_arg = 1},
+        {.name = "verifier-report", .val = 'V'},
         {0}};
 
     const char* mem_filename = NULL;
     const char* main_function_name = NULL;
     enum ubpf_execution_profile execution_profile = UBPF_EXECUTION_PROFILE_LEGACY;
     bool jit = false;
+    bool llvm_jit = false;
+    bool aot_c = false;
     bool unload = false;
     bool reload = false;
     bool data_relocation = false; // treat R_BPF_64_64 as relocations to maps by default.
+    bool verifier_report = false;
+    int register_offset = 0;
 
     uint64_t secret = (uint64_t)rand() << 32 | (uint64_t)rand();
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "hm:jdr:URs:p:", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hm:jlcdr:URs:p:V", longopts, NULL)) != -1) {
         switch (opt) {
         case 'm':
             mem_filename = optarg;
@@ -259,11 +272,17 @@ main(int argc, char** argv)
         case 'j':
             jit = true;
             break;
+        case 'l':
+            llvm_jit = true;
+            break;
+        case 'c':
+            aot_c = true;
+            break;
         case 'd':
             data_relocation = true;
             break;
         case 'r':
-            ubpf_set_register_offset(atoi(optarg));
+            register_offset = atoi(optarg);
             break;
         case 'h':
             usage(argv[0]);
@@ -274,6 +293,9 @@ main(int argc, char** argv)
         case 'R':
             reload = true;
             break;
+        case 'V':
+            verifier_report = true;
+            break;
         default:
             usage(argv[0]);
             return 1;
@@ -311,6 +333,7 @@ main(int argc, char** argv)
         fprintf(stderr, "Failed to create VM\n");
         return 1;
     }
+    ubpf_set_register_offset(vm, register_offset);
 
     // Enable constant blinding if environment variable is set
     const char* enable_blinding_env = getenv("UBPF_ENABLE_CONSTANT_BLINDING");
@@ -348,6 +371,9 @@ main(int argc, char** argv)
     }
 
     ubpf_register_stack_usage_calculator(vm, stack_usage_calculator, NULL);
+    if (verifier_report) {
+        ubpf_set_minimum_context_size(vm, mem_len);
+    }
     /*
      * The ELF magic corresponds to an RSH instruction with an offset,
      * which is invalid.
@@ -387,6 +413,16 @@ load:
         return 1;
     }
 
+    struct ubpf_range_report report;
+    if (verifier_report && ubpf_get_range_report(vm, &report) == 0) {
+        fprintf(
+            stderr,
+            "bounds checks: %u of %u memory accesses proven in bounds (%.1f%%)\n",
+            report.proven,
+            report.accesses,
+            report.accesses ? 100.0 * report.proven / report.accesses : 0.0);
+    }
+
     uint64_t ret;
 
     if (jit) {
@@ -398,6 +434,25 @@ load:
             return 1;
         }
         ret = fn(mem, mem_len);
+    } else if (llvm_jit) {
+        ubpf_jit_ex_fn fn = ubpf_compile_ex(vm, &errmsg, LlvmJitMode);
+        if (fn == NULL) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            free(errmsg);
+            free(mem);
+            return 1;
+        }
+        uint64_t stack[UBPF_EBPF_STACK_SIZE / sizeof(uint64_t)];
+        ret = fn(mem, mem_len, (uint8_t*)stack, sizeof(stack));
+    } else if (aot_c) {
+        if (ubpf_compile_c(vm, &errmsg) == NULL) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            free(errmsg);
+            free(mem);
+            return 1;
+        }
+        if (ubpf_exec_c(vm, mem, mem_len, &ret) < 0)
+            ret = UINT64_MAX;
     } else {
         if (ubpf_exec(vm, mem, mem_len, &ret) < 0)
             ret = UINT64_MAX;
@@ -503,6 +558,39 @@ trash_registers(void)
         "mov w14, #0xfe;"
         "mov w15, #0xff;" ::
             : "w0", "w1", "w2", "w3", "w4", "w5", "w6", "w7", "w8", "w9", "w10", "w11", "w12", "w13", "w14", "w15");
+#elif defined(__riscv)
+    asm("li a0, 0xf0;"
+        "li a1, 0xf1;"
+        "li a2, 0xf2;"
+        "li a3, 0xf3;"
+        "li a4, 0xf4;"
+        "li a5, 0xf5;"
+        "li a6, 0xf6;"
+        "li a7, 0xf7;"
+        "li t0, 0xf8;"
+        "li t1, 0xf9;"
+        "li t2, 0xfa;"
+        "li t3, 0xfb;"
+        "li t4, 0xfc;"
+        "li t5, 0xfd;"
+        "li t6, 0xfe;" ::
+            : "a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7", "t0", "t1", "t2", "t3", "t4", "t5", "t6");
+#elif defined(__mips__)
+    asm("li $4, 0xf0;"
+        "li $5, 0xf1;"
+        "li $6, 0xf2;"
+        "li $7, 0xf3;"
+        "li $8, 0xf4;"
+        "li $9, 0xf5;"
+        "li $10, 0xf6;"
+        "li $11, 0xf7;"
+        "li $12, 0xf8;"
+        "li $13, 0xf9;"
+        "li $14, 0xfa;"
+        "li $15, 0xfb;"
+        "li $24, 0xfc;"
+        "li $25, 0xfd;" ::
+            : "$4", "$5", "$6", "$7", "$8", "$9", "$10", "$11", "$12", "$13", "$14", "$15", "$24", "$25");
 #else
     fprintf(stderr, "trash_registers not implemented for this architecture.\n");
     exit(1);
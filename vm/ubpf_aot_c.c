@@ -0,0 +1,1120 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Portable ahead-of-time backend: translates a loaded (and so validated) program into
+ * a single self-contained C function. The C compiler of the host then does the work of
+ * a JIT backend -- register allocation, instruction selection and scheduling -- for any
+ * processor it targets, including those that uBPF has no native JIT for.
+ *
+ * The generated function keeps the eBPF registers in local variables and turns every
+ * jump target into a label. Local calls push r6-r9, the caller's stack usage and the
+ * return pc onto a small frame array and EXIT pops them again, exactly as the
+ * interpreter does. Helpers are called by index through the environment that is passed
+ * in, so the translation does not depend on the addresses of the host's helpers, or
+ * (for objects that are linked into the host, see the ubpf-aot tool) directly by the
+ * names they were registered under.
+ *
+ * The generated code only includes <stdbool.h>, <stddef.h>, <stdint.h> and <string.h>
+ * (and <stdatomic.h> for compilers without the GCC __atomic builtins). It can be built
+ * into the host at build time or compiled at runtime with ubpf_compile_c().
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "ubpf_int.h"
+
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+// The name of the function that ubpf_compile_c() generates and looks up.
+#define UBPF_C_ENTRY_NAME "ubpf_c_entry"
+
+// Everything the generated function needs besides itself. Guarded so that several
+// translations can be compiled into one translation unit, also next to ubpf.h.
+static const char ubpf_c_preamble[] =
+    "#include <stdbool.h>\n"
+    "#include <stddef.h>\n"
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "#ifndef UBPF_C_RUNTIME\n"
+    "#define UBPF_C_RUNTIME\n"
+    "\n"
+    "#ifndef UBPF_H\n"
+    "struct ubpf_c_environment\n"
+    "{\n"
+    "    uint64_t (*dispatcher)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, unsigned int, void*);\n"
+    "    uint64_t (*const* helpers)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);\n"
+    "    bool (*bounds_check)(void*, uint64_t, uint64_t);\n"
+    "    void* bounds_check_context;\n"
+    "};\n"
+    "#endif\n"
+    "\n"
+    "// Helpers receive the context as a sixth argument, as in the interpreter and the JITs.\n"
+    "typedef uint64_t (*ubpf_c_helper_fn)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, void*);\n"
+    "#define UBPF_C_HELPER(env, index) ((ubpf_c_helper_fn)(void (*)(void))(env)->helpers[index])\n"
+    "\n"
+    "#define UBPF_C_LOAD_STORE(type, name)                                                   \\\n"
+    "    static inline type ubpf_c_load##name(uint64_t address)                              \\\n"
+    "    {                                                                                   \\\n"
+    "        type value;                                                                     \\\n"
+    "        memcpy(&value, (const void*)(uintptr_t)address, sizeof(value));                 \\\n"
+    "        return value;                                                                   \\\n"
+    "    }                                                                                   \\\n"
+    "    static inline void ubpf_c_store##name(uint64_t address, type value)                 \\\n"
+    "    {                                                                                   \\\n"
+    "        memcpy((void*)(uintptr_t)address, &value, sizeof(value));                       \\\n"
+    "    }\n"
+    "UBPF_C_LOAD_STORE(uint8_t, 8)\n"
+    "UBPF_C_LOAD_STORE(uint16_t, 16)\n"
+    "UBPF_C_LOAD_STORE(uint32_t, 32)\n"
+    "UBPF_C_LOAD_STORE(uint64_t, 64)\n"
+    "\n"
+    "// Division by zero and INT_MIN / -1 behave as they do in the interpreter.\n"
+    "#define UBPF_C_DIVISION(type, stype, min, bits)                                         \\\n"
+    "    static inline type ubpf_c_udiv##bits(type a, type b) { return b ? a / b : 0; }      \\\n"
+    "    static inline type ubpf_c_umod##bits(type a, type b) { return b ? a % b : a; }      \\\n"
+    "    static inline type ubpf_c_sdiv##bits(type a, type b)                                \\\n"
+    "    {                                                                                   \\\n"
+    "        if (b == 0)                                                                     \\\n"
+    "            return 0;                                                                   \\\n"
+    "        if ((stype)a == min && (stype)b == -1)                                          \\\n"
+    "            return a;                                                                   \\\n"
+    "        return (type)((stype)a / (stype)b);                                             \\\n"
+    "    }                                                                                   \\\n"
+    "    static inline type ubpf_c_smod##bits(type a, type b)                                \\\n"
+    "    {                                                                                   \\\n"
+    "        if (b == 0)                                                                     \\\n"
+    "            return a;                                                                   \\\n"
+    "        if ((stype)a == min && (stype)b == -1)                                          \\\n"
+    "            return 0;                                                                   \\\n"
+    "        return (type)((stype)a % (stype)b);                                             \\\n"
+    "    }\n"
+    "UBPF_C_DIVISION(uint32_t, int32_t, INT32_MIN, 32)\n"
+    "UBPF_C_DIVISION(uint64_t, int64_t, INT64_MIN, 64)\n"
+    "\n"
+    "static inline uint16_t ubpf_c_bswap16(uint16_t x) { return (uint16_t)((x >> 8) | (x << 8)); }\n"
+    "static inline uint32_t ubpf_c_bswap32(uint32_t x)\n"
+    "{\n"
+    "    return ((x & 0xff000000u) >> 24) | ((x & 0x00ff0000u) >> 8) | ((x & 0x0000ff00u) << 8) | ((x & 0x000000ffu) << 24);\n"
+    "}\n"
+    "static inline uint64_t ubpf_c_bswap64(uint64_t x)\n"
+    "{\n"
+    "    return ((uint64_t)ubpf_c_bswap32((uint32_t)x) << 32) | ubpf_c_bswap32((uint32_t)(x >> 32));\n"
+    "}\n"
+    "#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__\n"
+    "#define UBPF_C_LE(bits, x) ubpf_c_bswap##bits((uint##bits##_t)(x))\n"
+    "#define UBPF_C_BE(bits, x) ((uint##bits##_t)(x))\n"
+    "#else\n"
+    "#define UBPF_C_LE(bits, x) ((uint##bits##_t)(x))\n"
+    "#define UBPF_C_BE(bits, x) ubpf_c_bswap##bits((uint##bits##_t)(x))\n"
+    "#endif\n"
+    "\n"
+    "#if defined(__GNUC__) || defined(__clang__)\n"
+    "#define UBPF_C_ATOMIC(type, address) ((type*)(uintptr_t)(address))\n"
+    "#define UBPF_C_FETCH_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)\n"
+    "#define UBPF_C_FETCH_OR(p, v) __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)\n"
+    "#define UBPF_C_FETCH_AND(p, v) __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)\n"
+    "#define UBPF_C_FETCH_XOR(p, v) __atomic_fetch_xor((p), (v), __ATOMIC_SEQ_CST)\n"
+    "#define UBPF_C_EXCHANGE(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)\n"
+    "#define UBPF_C_COMPARE_EXCHANGE(p, e, d) \\\n"
+    "    __atomic_compare_exchange_n((p), (e), (d), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)\n"
+    "#else\n"
+    "#include <stdatomic.h>\n"
+    "#define UBPF_C_ATOMIC(type, address) ((_Atomic type*)(uintptr_t)(address))\n"
+    "#define UBPF_C_FETCH_ADD(p, v) atomic_fetch_add((p), (v))\n"
+    "#define UBPF_C_FETCH_OR(p, v) atomic_fetch_or((p), (v))\n"
+    "#define UBPF_C_FETCH_AND(p, v) atomic_fetch_and((p), (v))\n"
+    "#define UBPF_C_FETCH_XOR(p, v) atomic_fetch_xor((p), (v))\n"
+    "#define UBPF_C_EXCHANGE(p, v) atomic_exchange((p), (v))\n"
+    "#define UBPF_C_COMPARE_EXCHANGE(p, e, d) atomic_compare_exchange_strong((p), (e), (d))\n"
+    "#endif\n"
+    "\n"
+    "// The same policy as the interpreter: the context, the stack or whatever the host's\n"
+    "// bounds check function accepts.\n"
+    "static inline bool\n"
+    "ubpf_c_access_ok(\n"
+    "    const struct ubpf_c_environment* env,\n"
+    "    const void* mem,\n"
+    "    size_t mem_len,\n"
+    "    const void* stack,\n"
+    "    size_t stack_len,\n"
+    "    uint64_t address,\n"
+    "    uint64_t size)\n"
+    "{\n"
+    "    uint64_t start = (uint64_t)(uintptr_t)mem;\n"
+    "    if (mem != NULL && address >= start && address - start <= mem_len && size <= mem_len - (address - start))\n"
+    "        return true;\n"
+    "    start = (uint64_t)(uintptr_t)stack;\n"
+    "    if (stack != NULL && address >= start && address - start <= stack_len && size <= stack_len - (address - start))\n"
+    "        return true;\n"
+    "    return env != NULL && env->bounds_check != NULL && size <= UINT64_MAX - address &&\n"
+    "           env->bounds_check(env->bounds_check_context, address, size);\n"
+    "}\n"
+    "\n"
+    "#endif // UBPF_C_RUNTIME\n";
+
+struct c_source
+{
+    char* data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+};
+
+static void
+emit(struct c_source* source, const char* format, ...)
+{
+    if (source->failed) {
+        return;
+    }
+
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int needed = vsnprintf(
+            source->data ? source->data + source->length : NULL, source->capacity - source->length, format, args);
+        va_end(args);
+        if (needed < 0) {
+            source->failed = true;
+            return;
+        }
+        if ((size_t)needed < source->capacity - source->length) {
+            source->length += needed;
+            return;
+        }
+
+        size_t capacity = source->capacity * 2 + needed + 1;
+        char* data = realloc(source->data, capacity);
+        if (data == NULL) {
+            source->failed = true;
+            return;
+        }
+        source->data = data;
+        source->capacity = capacity;
+    }
+}
+
+struct c_translation
+{
+    struct ubpf_vm* vm;
+    enum ubpf_c_helper_linkage linkage;
+    struct c_source body;
+    bool* is_target;
+    bool* used_helpers;
+    uint16_t used_registers;
+    bool has_local_calls;
+    bool needs_fail;
+};
+
+static const char*
+reg(struct c_translation* state, int r)
+{
+    static const char* names[] = {"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10"};
+    state->used_registers |= 1 << r;
+    return names[r];
+}
+
+// An immediate sign extended to 64 bits, written as an unsigned 64-bit literal.
+static void
+format_imm64(char* buffer, size_t size, int32_t imm)
+{
+    if (imm >= 0) {
+        snprintf(buffer, size, "UINT64_C(%d)", imm);
+    } else {
+        snprintf(buffer, size, "UINT64_C(0x%" PRIx64 ")", (uint64_t)(int64_t)imm);
+    }
+}
+
+static void
+format_imm32(char* buffer, size_t size, int32_t imm)
+{
+    if (imm >= 0) {
+        snprintf(buffer, size, "UINT32_C(%d)", imm);
+    } else {
+        snprintf(buffer, size, "UINT32_C(0x%" PRIx32 ")", (uint32_t)imm);
+    }
+}
+
+static void
+format_signed(char* buffer, size_t size, int32_t imm)
+{
+    if (imm == INT32_MIN) {
+        snprintf(buffer, size, "(-2147483647 - 1)");
+    } else {
+        snprintf(buffer, size, "%d", imm);
+    }
+}
+
+static void
+format_address(struct c_translation* state, char* buffer, size_t size, int base, int16_t offset)
+{
+    if (offset == 0) {
+        snprintf(buffer, size, "%s", reg(state, base));
+    } else if (offset > 0) {
+        snprintf(buffer, size, "%s + %d", reg(state, base), offset);
+    } else {
+        snprintf(buffer, size, "%s - %d", reg(state, base), -offset);
+    }
+}
+
+static void
+emit_access_check(struct c_translation* state, const char* address, int size, uint32_t pc)
+{
+    if (!state->vm->bounds_check_enabled || ubpf_access_is_proven(state->vm, pc)) {
+        return;
+    }
+    emit(
+        &state->body,
+        "    if (!ubpf_c_access_ok(env, mem, mem_len, stack, stack_len, %s, %d))\n"
+        "        goto fail;\n",
+        address,
+        size);
+    state->needs_fail = true;
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B:
+        return 1;
+    case EBPF_SIZE_H:
+        return 2;
+    case EBPF_SIZE_W:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+static bool
+translate_alu(struct c_translation* state, struct ebpf_inst inst, char** errmsg)
+{
+    bool is64 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    bool use_reg = (inst.opcode & EBPF_SRC_REG) != 0;
+    uint8_t op = inst.opcode & EBPF_ALU_OP_MASK;
+    const char* dst = reg(state, inst.dst);
+    char src[64];
+    int shift_mask = is64 ? 63 : 31;
+
+    // The second operand, already cast to the width of the operation.
+    if (use_reg && op != EBPF_ALU_OP_END && op != EBPF_ALU_OP_NEG) {
+        snprintf(src, sizeof(src), is64 ? "%s" : "(uint32_t)%s", reg(state, inst.src));
+    } else if (is64) {
+        format_imm64(src, sizeof(src), inst.imm);
+    } else {
+        format_imm32(src, sizeof(src), inst.imm);
+    }
+
+    // The shift amount is masked at translation time for immediates.
+    char shift[64];
+    if (use_reg) {
+        snprintf(shift, sizeof(shift), "(%s & %d)", reg(state, inst.src), shift_mask);
+    } else {
+        snprintf(shift, sizeof(shift), "%d", inst.imm & shift_mask);
+    }
+
+    const char* bits = is64 ? "64" : "32";
+    const char* cast = is64 ? "" : "(uint32_t)";
+    const char* symbol = NULL;
+    switch (op) {
+    case EBPF_ALU_OP_ADD:
+        symbol = "+";
+        break;
+    case EBPF_ALU_OP_SUB:
+        symbol = "-";
+        break;
+    case EBPF_ALU_OP_MUL:
+        symbol = "*";
+        break;
+    case EBPF_ALU_OP_OR:
+        symbol = "|";
+        break;
+    case EBPF_ALU_OP_AND:
+        symbol = "&";
+        break;
+    case EBPF_ALU_OP_XOR:
+        symbol = "^";
+        break;
+    case EBPF_ALU_OP_DIV:
+    case EBPF_ALU_OP_MOD:
+        emit(
+            &state->body,
+            "    %s = ubpf_c_%s%s%s(%s%s, %s);\n",
+            dst,
+            inst.offset == 1 ? "s" : "u",
+            op == EBPF_ALU_OP_DIV ? "div" : "mod",
+            bits,
+            cast,
+            dst,
+            src);
+        return true;
+    case EBPF_ALU_OP_LSH:
+        emit(&state->body, "    %s = %s(%s%s << %s);\n", dst, cast, cast, dst, shift);
+        return true;
+    case EBPF_ALU_OP_RSH:
+        emit(&state->body, "    %s = %s%s >> %s;\n", dst, cast, dst, shift);
+        return true;
+    case EBPF_ALU_OP_ARSH:
+        if (is64) {
+            emit(&state->body, "    %s = (uint64_t)((int64_t)%s >> %s);\n", dst, dst, shift);
+        } else {
+            emit(&state->body, "    %s = (uint32_t)((int32_t)(uint32_t)%s >> %s);\n", dst, dst, shift);
+        }
+        return true;
+    case EBPF_ALU_OP_NEG:
+        emit(&state->body, "    %s = %s(0 - %s%s);\n", dst, cast, cast, dst);
+        return true;
+    case EBPF_ALU_OP_MOV:
+        if (use_reg && inst.offset != 0) {
+            // MOVSX: sign extend the low 8, 16 or 32 bits of the source.
+            emit(
+                &state->body,
+                "    %s = (uint%s_t)(int%s_t)(int%d_t)%s;\n",
+                dst,
+                bits,
+                bits,
+                inst.offset,
+                reg(state, inst.src));
+        } else {
+            emit(&state->body, "    %s = %s;\n", dst, src);
+        }
+        return true;
+    case EBPF_ALU_OP_END:
+        if (is64) {
+            emit(&state->body, "    %s = ubpf_c_bswap%d((uint%d_t)%s);\n", dst, inst.imm, inst.imm, dst);
+        } else {
+            emit(
+                &state->body,
+                "    %s = UBPF_C_%s(%d, %s);\n",
+                dst,
+                (inst.opcode & EBPF_SRC_REG) ? "BE" : "LE",
+                inst.imm,
+                dst);
+        }
+        return true;
+    default:
+        *errmsg = ubpf_error("unsupported ALU opcode 0x%02x", inst.opcode);
+        return false;
+    }
+
+    if (is64) {
+        emit(&state->body, "    %s %s= %s;\n", dst, symbol, src);
+    } else {
+        emit(&state->body, "    %s = (uint32_t)((uint32_t)%s %s %s);\n", dst, dst, symbol, src);
+    }
+    return true;
+}
+
+static bool
+translate_conditional_jump(struct c_translation* state, struct ebpf_inst inst, uint32_t target, char** errmsg)
+{
+    bool is32 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32;
+    bool use_reg = (inst.opcode & EBPF_SRC_REG) != 0;
+    uint8_t mode = inst.opcode & EBPF_JMP_OP_MASK;
+    bool is_signed =
+        mode == EBPF_MODE_JSGT || mode == EBPF_MODE_JSGE || mode == EBPF_MODE_JSLT || mode == EBPF_MODE_JSLE;
+
+    char lhs[64];
+    char rhs[64];
+    if (is_signed) {
+        snprintf(lhs, sizeof(lhs), is32 ? "(int32_t)(uint32_t)%s" : "(int64_t)%s", reg(state, inst.dst));
+        if (use_reg) {
+            snprintf(rhs, sizeof(rhs), is32 ? "(int32_t)(uint32_t)%s" : "(int64_t)%s", reg(state, inst.src));
+        } else {
+            format_signed(rhs, sizeof(rhs), inst.imm);
+        }
+    } else {
+        snprintf(lhs, sizeof(lhs), is32 ? "(uint32_t)%s" : "%s", reg(state, inst.dst));
+        if (use_reg) {
+            snprintf(rhs, sizeof(rhs), is32 ? "(uint32_t)%s" : "%s", reg(state, inst.src));
+        } else if (is32) {
+            format_imm32(rhs, sizeof(rhs), inst.imm);
+        } else {
+            format_imm64(rhs, sizeof(rhs), inst.imm);
+        }
+    }
+
+    const char* symbol = NULL;
+    switch (mode) {
+    case EBPF_MODE_JEQ:
+        symbol = "==";
+        break;
+    case EBPF_MODE_JNE:
+        symbol = "!=";
+        break;
+    case EBPF_MODE_JGT:
+    case EBPF_MODE_JSGT:
+        symbol = ">";
+        break;
+    case EBPF_MODE_JGE:
+    case EBPF_MODE_JSGE:
+        symbol = ">=";
+        break;
+    case EBPF_MODE_JLT:
+    case EBPF_MODE_JSLT:
+        symbol = "<";
+        break;
+    case EBPF_MODE_JLE:
+    case EBPF_MODE_JSLE:
+        symbol = "<=";
+        break;
+    case EBPF_MODE_JSET:
+        emit(&state->body, "    if ((%s & %s) != 0)\n        goto L%u;\n", lhs, rhs, target);
+        return true;
+    default:
+        *errmsg = ubpf_error("unsupported jump opcode 0x%02x", inst.opcode);
+        return false;
+    }
+    emit(&state->body, "    if (%s %s %s)\n        goto L%u;\n", lhs, symbol, rhs, target);
+    return true;
+}
+
+static bool
+translate_atomic(struct c_translation* state, struct ebpf_inst inst, const char* address, char** errmsg)
+{
+    bool is64 = inst.opcode == EBPF_OP_ATOMIC_STORE;
+    const char* type = is64 ? "uint64_t" : "uint32_t";
+    const char* src = reg(state, inst.src);
+    char value[32];
+    snprintf(value, sizeof(value), is64 ? "%s" : "(uint32_t)%s", src);
+
+    const char* operation = NULL;
+    switch (inst.imm & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+        operation = "FETCH_ADD";
+        break;
+    case EBPF_ALU_OP_OR:
+        operation = "FETCH_OR";
+        break;
+    case EBPF_ALU_OP_AND:
+        operation = "FETCH_AND";
+        break;
+    case EBPF_ALU_OP_XOR:
+        operation = "FETCH_XOR";
+        break;
+    case (EBPF_ATOMIC_OP_XCHG & ~EBPF_ATOMIC_OP_FETCH):
+        operation = "EXCHANGE";
+        break;
+    case (EBPF_ATOMIC_OP_CMPXCHG & ~EBPF_ATOMIC_OP_FETCH):
+        // The value that was found in memory is always returned in r0.
+        emit(
+            &state->body,
+            "    {\n"
+            "        %s expected = (%s)%s;\n"
+            "        UBPF_C_COMPARE_EXCHANGE(UBPF_C_ATOMIC(%s, %s), &expected, %s);\n"
+            "        %s = expected;\n"
+            "    }\n",
+            type,
+            type,
+            reg(state, 0),
+            type,
+            address,
+            value,
+            reg(state, 0));
+        return true;
+    default:
+        *errmsg = ubpf_error("unsupported atomic operation 0x%x", inst.imm);
+        return false;
+    }
+
+    if (inst.imm & EBPF_ATOMIC_OP_FETCH) {
+        emit(&state->body, "    %s = UBPF_C_%s(UBPF_C_ATOMIC(%s, %s), %s);\n", src, operation, type, address, value);
+    } else {
+        emit(&state->body, "    (void)UBPF_C_%s(UBPF_C_ATOMIC(%s, %s), %s);\n", operation, type, address, value);
+    }
+    return true;
+}
+
+static bool
+is_identifier(const char* name)
+{
+    if (name == NULL || !(*name == '_' || (*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z'))) {
+        return false;
+    }
+    for (const char* c = name; *c; c++) {
+        if (!(*c == '_' || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+translate_instruction(
+    struct c_translation* state, uint32_t pc, struct ebpf_inst inst, uint32_t function_start, char** errmsg)
+{
+    struct ubpf_vm* vm = state->vm;
+    uint8_t class = inst.opcode & EBPF_CLS_MASK;
+    char address[64];
+    char value[64];
+
+    switch (class) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        return translate_alu(state, inst, errmsg);
+
+    case EBPF_CLS_LD: {
+        struct ebpf_inst next = ubpf_fetch_instruction(vm, pc + 1);
+        uint64_t value64 = (uint32_t)inst.imm | ((uint64_t)(uint32_t)next.imm << 32);
+        emit(&state->body, "    %s = UINT64_C(0x%" PRIx64 ");\n", reg(state, inst.dst), value64);
+        return true;
+    }
+
+    case EBPF_CLS_LDX: {
+        int size = access_size(inst.opcode);
+        format_address(state, address, sizeof(address), inst.src, inst.offset);
+        emit_access_check(state, address, size, pc);
+        if ((inst.opcode & 0xe0) == EBPF_MODE_MEMSX) {
+            emit(
+                &state->body,
+                "    %s = (uint64_t)(int64_t)(int%d_t)ubpf_c_load%d(%s);\n",
+                reg(state, inst.dst),
+                size * 8,
+                size * 8,
+                address);
+        } else {
+            emit(&state->body, "    %s = ubpf_c_load%d(%s);\n", reg(state, inst.dst), size * 8, address);
+        }
+        return true;
+    }
+
+    case EBPF_CLS_ST:
+    case EBPF_CLS_STX: {
+        int size = access_size(inst.opcode);
+        format_address(state, address, sizeof(address), inst.dst, inst.offset);
+        emit_access_check(state, address, size, pc);
+        if ((inst.opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+            return translate_atomic(state, inst, address, errmsg);
+        }
+        if (class == EBPF_CLS_STX) {
+            snprintf(value, sizeof(value), "(uint%d_t)%s", size * 8, reg(state, inst.src));
+        } else if (size == 8) {
+            format_imm64(value, sizeof(value), inst.imm);
+        } else {
+            snprintf(value, sizeof(value), "(uint%d_t)0x%" PRIx32, size * 8, (uint32_t)inst.imm);
+        }
+        emit(&state->body, "    ubpf_c_store%d(%s, %s);\n", size * 8, address, value);
+        return true;
+    }
+
+    case EBPF_CLS_JMP:
+    case EBPF_CLS_JMP32:
+        break;
+
+    default:
+        *errmsg = ubpf_error("unsupported opcode 0x%02x at PC %u", inst.opcode, pc);
+        return false;
+    }
+
+    switch (inst.opcode) {
+    case EBPF_OP_JA:
+        emit(&state->body, "    goto L%u;\n", pc + 1 + inst.offset);
+        return true;
+    case EBPF_OP_JA32:
+        emit(&state->body, "    goto L%u;\n", pc + 1 + inst.imm);
+        return true;
+    case EBPF_OP_EXIT:
+        if (state->has_local_calls) {
+            reg(state, 0);
+            emit(&state->body, "    goto exit_function;\n");
+        } else {
+            emit(&state->body, "    *bpf_return_value = %s;\n    return 0;\n", reg(state, 0));
+        }
+        return true;
+    case EBPF_OP_CALL:
+        if (inst.src == 0 && state->linkage == UBPF_C_HELPERS_SYMBOLS) {
+            const char* symbol = (uint32_t)inst.imm < MAX_EXT_FUNCS ? vm->ext_func_names[inst.imm] : NULL;
+            if (!is_identifier(symbol)) {
+                *errmsg = ubpf_error("helper %d called at PC %u has no name that can be linked against", inst.imm, pc);
+                return false;
+            }
+            state->used_helpers[inst.imm] = true;
+            emit(
+                &state->body,
+                "    %s = %s(%s, %s, %s, %s, %s, mem);\n",
+                reg(state, 0),
+                symbol,
+                reg(state, 1),
+                reg(state, 2),
+                reg(state, 3),
+                reg(state, 4),
+                reg(state, 5));
+        } else if (inst.src == 0) {
+            emit(
+                &state->body,
+                "    %s = env->dispatcher != NULL ? env->dispatcher(%s, %s, %s, %s, %s, %d, mem)\n"
+                "                               : UBPF_C_HELPER(env, %d)(%s, %s, %s, %s, %s, mem);\n",
+                reg(state, 0),
+                reg(state, 1),
+                reg(state, 2),
+                reg(state, 3),
+                reg(state, 4),
+                reg(state, 5),
+                inst.imm,
+                inst.imm,
+                reg(state, 1),
+                reg(state, 2),
+                reg(state, 3),
+                reg(state, 4),
+                reg(state, 5));
+        }
+        if (inst.src == 0) {
+            if (inst.imm == vm->unwind_stack_extension_index) {
+                emit(&state->body, "    if (r0 == 0) {\n        *bpf_return_value = r0;\n        return 0;\n    }\n");
+            }
+            return true;
+        }
+        if (inst.src == 1) {
+            // The caller's stack usage is known here; the callee's frame lies below it.
+            emit(
+                &state->body,
+                "    if (depth >= %d)\n"
+                "        goto fail;\n"
+                "    frames[depth].saved[0] = %s;\n"
+                "    frames[depth].saved[1] = %s;\n"
+                "    frames[depth].saved[2] = %s;\n"
+                "    frames[depth].saved[3] = %s;\n"
+                "    frames[depth].stack_usage = %d;\n"
+                "    frames[depth].return_pc = %u;\n"
+                "    depth++;\n"
+                "    %s -= %d;\n"
+                "    goto L%u;\n",
+                UBPF_MAX_CALL_DEPTH,
+                reg(state, 6),
+                reg(state, 7),
+                reg(state, 8),
+                reg(state, 9),
+                ubpf_stack_usage_for_local_func(vm, (uint16_t)function_start),
+                pc + 1,
+                reg(state, 10),
+                ubpf_stack_usage_for_local_func(vm, (uint16_t)function_start),
+                pc + 1 + inst.imm);
+            state->needs_fail = true;
+            return true;
+        }
+        *errmsg = ubpf_error("unsupported call type %d at PC %u", inst.src, pc);
+        return false;
+    default:
+        return translate_conditional_jump(state, inst, pc + 1 + inst.offset, errmsg);
+    }
+}
+
+// Find every instruction that control can reach other than by falling through.
+static void
+find_targets(struct c_translation* state)
+{
+    struct ubpf_vm* vm = state->vm;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        uint8_t class = inst.opcode & EBPF_CLS_MASK;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+            continue;
+        }
+        if (!ubpf_instruction_is_reachable(vm, pc) || (class != EBPF_CLS_JMP && class != EBPF_CLS_JMP32)) {
+            continue;
+        }
+        if (inst.opcode == EBPF_OP_EXIT) {
+            continue;
+        }
+        if (inst.opcode == EBPF_OP_CALL) {
+            if (inst.src == 1) {
+                state->has_local_calls = true;
+                state->is_target[pc + 1 + inst.imm] = true;
+                state->is_target[pc + 1] = true;
+            }
+            continue;
+        }
+        state->is_target[pc + 1 + (inst.opcode == EBPF_OP_JA32 ? inst.imm : inst.offset)] = true;
+    }
+}
+
+int
+ubpf_translate_c(struct ubpf_vm* vm, const char* function_name, char** source, char** errmsg)
+{
+    return ubpf_translate_c_ex(vm, function_name, UBPF_C_HELPERS_ENVIRONMENT, source, errmsg);
+}
+
+int
+ubpf_translate_c_ex(
+    struct ubpf_vm* vm,
+    const char* function_name,
+    enum ubpf_c_helper_linkage linkage,
+    char** source,
+    char** errmsg)
+{
+    *errmsg = NULL;
+    *source = NULL;
+
+    if (vm->execution_profile == UBPF_EXECUTION_PROFILE_SAFE) {
+        *errmsg = ubpf_error("safe execution profile is interpreter-only");
+        return -1;
+    }
+    if (!vm->insts) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+        return -1;
+    }
+    if (!is_identifier(function_name)) {
+        *errmsg = ubpf_error("invalid C function name");
+        return -1;
+    }
+
+    struct c_translation state = {.vm = vm, .linkage = linkage};
+    state.is_target = calloc(vm->num_insts + 1, sizeof(*state.is_target));
+    state.used_helpers = calloc(MAX_EXT_FUNCS, sizeof(*state.used_helpers));
+    if (state.is_target == NULL || state.used_helpers == NULL) {
+        free(state.is_target);
+        free(state.used_helpers);
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+    find_targets(&state);
+
+    if (vm->bounds_check_enabled && vm->proven_accesses != NULL) {
+        // The accesses that the range verifier proved in bounds are not checked.
+        emit(
+            &state.body,
+            "    if ((mem == NULL && %zu != 0) || mem_len < %zu || stack_len < %zu)\n"
+            "        goto fail;\n",
+            vm->minimum_context_size,
+            vm->minimum_context_size,
+            vm->stack_requirement);
+        state.needs_fail = true;
+    }
+
+    // Code that cannot be reached is not translated, so that its helpers need not be defined.
+    uint32_t function_start = 0;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (!ubpf_instruction_is_reachable(vm, pc)) {
+            pc += inst.opcode == EBPF_OP_LDDW;
+            continue;
+        }
+        if (pc == 0 || vm->int_funcs[pc]) {
+            function_start = pc;
+            emit(&state.body, "    // Function at PC %u\n", pc);
+        }
+        if (state.is_target[pc]) {
+            emit(&state.body, "L%u:\n", pc);
+        }
+        if (!translate_instruction(&state, pc, inst, function_start, errmsg)) {
+            free(state.body.data);
+            free(state.is_target);
+            free(state.used_helpers);
+            return -1;
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+
+    if (state.has_local_calls) {
+        // EXIT from a local function restores the caller's registers and stack pointer
+        // and continues after its call instruction.
+        emit(
+            &state.body,
+            "exit_function:\n"
+            "    if (depth == 0) {\n"
+            "        *bpf_return_value = r0;\n"
+            "        return 0;\n"
+            "    }\n"
+            "    depth--;\n"
+            "    r6 = frames[depth].saved[0];\n"
+            "    r7 = frames[depth].saved[1];\n"
+            "    r8 = frames[depth].saved[2];\n"
+            "    r9 = frames[depth].saved[3];\n"
+            "    r10 += frames[depth].stack_usage;\n"
+            "    switch (frames[depth].return_pc) {\n");
+        for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+            struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+            if (inst.opcode == EBPF_OP_CALL && inst.src == 1 && ubpf_instruction_is_reachable(vm, pc)) {
+                emit(&state.body, "    case %u:\n        goto L%u;\n", pc + 1, pc + 1);
+            }
+        }
+        emit(&state.body, "    }\n");
+        state.needs_fail = true;
+    }
+    if (state.needs_fail) {
+        emit(&state.body, "fail:\n");
+    }
+    emit(&state.body, "    return -1;\n");
+
+    struct c_source output = {0};
+    emit(&output, "// Generated by uBPF from %u eBPF instructions.\n", vm->num_insts);
+    emit(&output, "%s\n", ubpf_c_preamble);
+    // Repeated declarations are fine when several translations share a translation unit.
+    bool declared_helpers = false;
+    for (unsigned int i = 0; i < MAX_EXT_FUNCS; i++) {
+        if (state.used_helpers[i]) {
+            emit(
+                &output,
+                "extern uint64_t %s(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, void*);\n",
+                vm->ext_func_names[i]);
+            declared_helpers = true;
+        }
+    }
+    if (declared_helpers) {
+        emit(&output, "\n");
+    }
+    emit(
+        &output,
+        "int\n"
+        "%s(\n"
+        "    void* mem,\n"
+        "    size_t mem_len,\n"
+        "    uint8_t* stack,\n"
+        "    size_t stack_len,\n"
+        "    const struct ubpf_c_environment* env,\n"
+        "    uint64_t* bpf_return_value)\n"
+        "{\n",
+        function_name);
+    for (int r = 0; r <= BPF_REG_10; r++) {
+        if (!(state.used_registers & (1 << r))) {
+            continue;
+        }
+        if (r == 1) {
+            emit(&output, "    uint64_t r1 = (uint64_t)(uintptr_t)mem;\n");
+        } else if (r == 2) {
+            emit(&output, "    uint64_t r2 = (uint64_t)mem_len;\n");
+        } else if (r == 10) {
+            emit(&output, "    uint64_t r10 = (uint64_t)((uintptr_t)stack + stack_len);\n");
+        } else {
+            emit(&output, "    uint64_t r%d = 0;\n", r);
+        }
+    }
+    // A register may be written and never read again.
+    for (int r = 0; r <= BPF_REG_10; r++) {
+        if (state.used_registers & (1 << r)) {
+            emit(&output, "    (void)r%d;\n", r);
+        }
+    }
+    if (state.has_local_calls) {
+        emit(
+            &output,
+            "    struct\n"
+            "    {\n"
+            "        uint64_t saved[4];\n"
+            "        uint64_t stack_usage;\n"
+            "        uint32_t return_pc;\n"
+            "    } frames[%d];\n"
+            "    unsigned int depth = 0;\n",
+            UBPF_MAX_CALL_DEPTH);
+    }
+    emit(&output, "    (void)mem;\n    (void)mem_len;\n    (void)stack;\n    (void)stack_len;\n    (void)env;\n\n");
+    emit(&output, "%s}\n", state.body.data ? state.body.data : "");
+
+    bool failed = state.body.failed || output.failed;
+    free(state.body.data);
+    free(state.is_target);
+    free(state.used_helpers);
+    if (failed) {
+        free(output.data);
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+
+    *source = output.data;
+    return 0;
+}
+
+void
+ubpf_get_c_environment(const struct ubpf_vm* vm, struct ubpf_c_environment* env)
+{
+    env->dispatcher = vm->jit_data->dispatcher;
+    env->helpers = (const external_function_t*)vm->ext_funcs;
+    env->bounds_check = vm->jit_data->bounds_check_function;
+    env->bounds_check_context = vm->jit_data->bounds_check_user_data;
+}
+
+#if defined(_WIN32)
+
+ubpf_c_fn
+ubpf_compile_c(struct ubpf_vm* vm, char** errmsg)
+{
+    (void)vm;
+    *errmsg = ubpf_error("compiling C translations at runtime is not supported on this platform");
+    return NULL;
+}
+
+void
+ubpf_release_c_module(struct ubpf_vm* vm)
+{
+    (void)vm;
+}
+
+int
+ubpf_compile_c_object(const char* source, const char* object_path, char** errmsg)
+{
+    (void)source;
+    (void)object_path;
+    *errmsg = ubpf_error("compiling C translations is not supported on this platform");
+    return -1;
+}
+
+#else
+
+// Create a private directory for the compiler's input (and output) files.
+static bool
+make_temporary_directory(char* directory, size_t size, char** errmsg)
+{
+    const char* temporary = getenv("TMPDIR");
+    if (temporary == NULL || *temporary == '\0') {
+        temporary = "/tmp";
+    }
+    snprintf(directory, size, "%s/ubpf-c-XXXXXX", temporary);
+    if (strchr(directory, '\'') != NULL || mkdtemp(directory) == NULL) {
+        *errmsg = ubpf_error("cannot create a temporary directory in %s", temporary);
+        return false;
+    }
+    return true;
+}
+
+// Write source to directory/program.c and compile it with flags into output_path.
+static bool
+run_c_compiler(const char* directory, const char* source, const char* flags, const char* output_path, char** errmsg)
+{
+    const char* compiler = getenv("UBPF_CC");
+    if (compiler == NULL || *compiler == '\0') {
+        compiler = getenv("CC");
+    }
+    if (compiler == NULL || *compiler == '\0') {
+        compiler = "cc";
+    }
+    if (strchr(output_path, '\'') != NULL) {
+        *errmsg = ubpf_error("invalid output path %s", output_path);
+        return false;
+    }
+
+    char source_path[PATH_MAX + 16];
+    snprintf(source_path, sizeof(source_path), "%s/program.c", directory);
+    FILE* file = fopen(source_path, "w");
+    if (file == NULL) {
+        *errmsg = ubpf_error("cannot write %s", source_path);
+        return false;
+    }
+    bool written = fputs(source, file) >= 0;
+    if (fclose(file) != 0 || !written) {
+        *errmsg = ubpf_error("cannot write %s", source_path);
+        unlink(source_path);
+        return false;
+    }
+
+    // The compiler is run through the shell so that UBPF_CC and CC may carry flags.
+    size_t command_size = strlen(compiler) + strlen(flags) + strlen(source_path) + strlen(output_path) + 64;
+    char* command = malloc(command_size);
+    if (command == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        unlink(source_path);
+        return false;
+    }
+    snprintf(command, command_size, "%s -O2 %s -o '%s' '%s'", compiler, flags, output_path, source_path);
+    int status = system(command);
+    free(command);
+    unlink(source_path);
+    if (status != 0) {
+        *errmsg = ubpf_error("C compiler failed (%s, status %d)", compiler, status);
+        return false;
+    }
+    return true;
+}
+
+ubpf_c_fn
+ubpf_compile_c(struct ubpf_vm* vm, char** errmsg)
+{
+    *errmsg = NULL;
+    if (vm->c_compiled) {
+        return vm->c_compiled;
+    }
+
+    char* source = NULL;
+    if (ubpf_translate_c(vm, UBPF_C_ENTRY_NAME, &source, errmsg) < 0) {
+        return NULL;
+    }
+
+    char directory[PATH_MAX];
+    if (!make_temporary_directory(directory, sizeof(directory), errmsg)) {
+        free(source);
+        return NULL;
+    }
+    char module_path[PATH_MAX + 16];
+    snprintf(module_path, sizeof(module_path), "%s/program.so", directory);
+
+    ubpf_c_fn fn = NULL;
+    if (run_c_compiler(directory, source, "-fPIC -shared", module_path, errmsg)) {
+        void* module = dlopen(module_path, RTLD_NOW | RTLD_LOCAL);
+        if (module == NULL) {
+            *errmsg = ubpf_error("cannot load the compiled program: %s", dlerror());
+        } else {
+            fn = (ubpf_c_fn)dlsym(module, UBPF_C_ENTRY_NAME);
+            if (fn == NULL) {
+                *errmsg = ubpf_error("cannot find %s in the compiled program", UBPF_C_ENTRY_NAME);
+                dlclose(module);
+            } else {
+                vm->c_module = module;
+                vm->c_compiled = fn;
+            }
+        }
+    }
+
+    // A loaded module stays mapped after its file is removed.
+    unlink(module_path);
+    rmdir(directory);
+    free(source);
+    return fn;
+}
+
+int
+ubpf_compile_c_object(const char* source, const char* object_path, char** errmsg)
+{
+    *errmsg = NULL;
+    char directory[PATH_MAX];
+    if (!make_temporary_directory(directory, sizeof(directory), errmsg)) {
+        return -1;
+    }
+    // Position independent so that the object can go into PIEs and shared libraries.
+    bool compiled = run_c_compiler(directory, source, "-fPIC -c", object_path, errmsg);
+    rmdir(directory);
+    return compiled ? 0 : -1;
+}
+
+void
+ubpf_release_c_module(struct ubpf_vm* vm)
+{
+    if (vm->c_module) {
+        dlclose(vm->c_module);
+    }
+    vm->c_module = NULL;
+    vm->c_compiled = NULL;
+}
+
+#endif
+
+int
+ubpf_exec_c(const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value)
+{
+    if (vm->c_compiled == NULL) {
+        return -1;
+    }
+
+    struct ubpf_c_environment env;
+    ubpf_get_c_environment(vm, &env);
+    if (vm->stack_requirement == 0) {
+        return vm->c_compiled(mem, mem_len, NULL, 0, &env, bpf_return_value);
+    }
+
+    uint64_t stack[UBPF_EBPF_STACK_SIZE / sizeof(uint64_t)];
+    return vm->c_compiled(mem, mem_len, (uint8_t*)stack, sizeof(stack), &env, bpf_return_value);
+}
@@ -0,0 +1,242 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Control flow graph: the basic blocks of a program, the blocks that each can pass
+ * control to, the function (the main program or a local function) that contains each and
+ * whether it can be reached from the entry. It is built once, in time linear in the size
+ * of the program, when the program is validated, and the JITs leave out the blocks that
+ * cannot be reached.
+ *
+ * A block starts at the entry, at a local function, at a jump target and after a jump or
+ * an exit, and ends before the next one. Local calls do not end blocks: a block that is
+ * reached reaches the functions that it calls, and the instruction after a call is
+ * assumed to be reached.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "ubpf_int.h"
+
+static bool
+is_jump(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32 || ubpf_instruction_is_conditional_jump(inst);
+}
+
+static uint32_t
+jump_target(uint32_t pc, struct ebpf_inst inst)
+{
+    return pc + 1 + (inst.opcode == EBPF_OP_JA32 ? inst.imm : inst.offset);
+}
+
+static bool
+is_local_call(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_CALL && inst.src == 1;
+}
+
+/*
+ * Check that the functions are self-contained: that their jumps stay within the function,
+ * which ends with an EXIT or an unconditional jump. A program without local calls is a
+ * single function and is not checked.
+ */
+static bool
+check_functions(
+    const struct ebpf_inst* insts, uint32_t num_insts, const struct ubpf_cfg* cfg, const bool* is_called, char** errmsg)
+{
+    if (cfg->num_functions == 1 && !is_called[0]) {
+        return true;
+    }
+    for (uint32_t function = 0; function < cfg->num_functions; function++) {
+        uint32_t start = cfg->function_start[function];
+        uint32_t end = function + 1 < cfg->num_functions ? cfg->function_start[function + 1] : num_insts;
+        for (uint32_t pc = start; pc < end; pc++) {
+            struct ebpf_inst inst = insts[pc];
+            uint8_t inst_class = inst.opcode & EBPF_CLS_MASK;
+            if ((inst_class != EBPF_CLS_JMP && inst_class != EBPF_CLS_JMP32) || inst.opcode == EBPF_OP_CALL ||
+                inst.opcode == EBPF_OP_EXIT) {
+                continue;
+            }
+            int64_t target = (int64_t)pc + 1 + (inst.opcode == EBPF_OP_JA32 ? inst.imm : inst.offset);
+            if (target < start || target > end - 1) {
+                *errmsg = ubpf_error("jump out of bounds at PC %d", pc);
+                return false;
+            }
+        }
+        bool ends_with_exit = insts[end - 1].opcode == EBPF_OP_EXIT;
+        bool ends_with_jump =
+            end >= start + 2 && (insts[end - 2].opcode == EBPF_OP_JA || insts[end - 2].opcode == EBPF_OP_JA32);
+        if (!(ends_with_exit || ends_with_jump)) {
+            *errmsg = ubpf_error("sub-program does not end with EXIT or unconditional jump at PC %d", end - 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The last instruction of the block [start, end), which may be an LDDW.
+static uint32_t
+last_instruction(const struct ebpf_inst* insts, uint32_t start, uint32_t end)
+{
+    uint32_t last = start;
+    for (uint32_t pc = start; pc < end; pc += insts[pc].opcode == EBPF_OP_LDDW ? 2 : 1) {
+        last = pc;
+    }
+    return last;
+}
+
+static void
+add_successor(struct ubpf_basic_block* block, uint32_t successor)
+{
+    if (block->num_successors == 0 || block->successors[0] != successor) {
+        block->successors[block->num_successors++] = successor;
+    }
+}
+
+static bool
+mark_reachable_blocks(const struct ebpf_inst* insts, struct ubpf_cfg* cfg)
+{
+    uint32_t* worklist = calloc(cfg->num_blocks, sizeof(uint32_t));
+    if (worklist == NULL) {
+        return false;
+    }
+    uint32_t worklist_size = 0;
+    cfg->blocks[0].reachable = true;
+    worklist[worklist_size++] = 0;
+    while (worklist_size > 0) {
+        const struct ubpf_basic_block* block = &cfg->blocks[worklist[--worklist_size]];
+        for (uint32_t i = 0; i < block->num_successors; i++) {
+            uint32_t successor = block->successors[i];
+            if (!cfg->blocks[successor].reachable) {
+                cfg->blocks[successor].reachable = true;
+                worklist[worklist_size++] = successor;
+            }
+        }
+        for (uint32_t pc = block->start; pc < block->end; pc++) {
+            if (is_local_call(insts[pc])) {
+                uint32_t callee = cfg->block_of[pc + 1 + insts[pc].imm];
+                if (!cfg->blocks[callee].reachable) {
+                    cfg->blocks[callee].reachable = true;
+                    worklist[worklist_size++] = callee;
+                }
+            }
+        }
+    }
+    free(worklist);
+
+    cfg->num_unreachable_insts = 0;
+    for (uint32_t b = 0; b < cfg->num_blocks; b++) {
+        if (!cfg->blocks[b].reachable) {
+            cfg->num_unreachable_insts += cfg->blocks[b].end - cfg->blocks[b].start;
+        }
+    }
+    return true;
+}
+
+struct ubpf_cfg*
+ubpf_create_cfg(const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+{
+    struct ubpf_cfg* cfg = calloc(1, sizeof(*cfg));
+    bool* is_leader = calloc(num_insts, sizeof(bool));
+    bool* is_called = calloc(num_insts, sizeof(bool));
+    bool succeeded = false;
+    if (cfg == NULL || (num_insts != 0 && (is_leader == NULL || is_called == NULL))) {
+        goto done;
+    }
+    if (num_insts == 0) {
+        succeeded = true;
+        goto done;
+    }
+
+    is_leader[0] = true;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        struct ebpf_inst inst = insts[pc];
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        } else if (is_local_call(inst)) {
+            is_leader[pc + 1 + inst.imm] = true;
+            is_called[pc + 1 + inst.imm] = true;
+        } else if (is_jump(inst) || inst.opcode == EBPF_OP_EXIT) {
+            if (is_jump(inst)) {
+                is_leader[jump_target(pc, inst)] = true;
+            }
+            if (pc + 1 < num_insts) {
+                is_leader[pc + 1] = true;
+            }
+        }
+    }
+
+    cfg->num_functions = 1;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        cfg->num_blocks += is_leader[pc];
+        cfg->num_functions += pc != 0 && is_called[pc];
+    }
+    cfg->blocks = calloc(cfg->num_blocks, sizeof(cfg->blocks[0]));
+    cfg->block_of = calloc(num_insts, sizeof(cfg->block_of[0]));
+    cfg->function_start = calloc(cfg->num_functions, sizeof(cfg->function_start[0]));
+    if (cfg->blocks == NULL || cfg->block_of == NULL || cfg->function_start == NULL) {
+        goto done;
+    }
+
+    uint32_t block = 0;
+    uint32_t function = 0;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        if (pc != 0 && is_called[pc]) {
+            cfg->function_start[++function] = pc;
+        }
+        if (is_leader[pc]) {
+            if (pc != 0) {
+                cfg->blocks[block++].end = pc;
+            }
+            cfg->blocks[block].start = pc;
+            cfg->blocks[block].function = function;
+        }
+        cfg->block_of[pc] = block;
+    }
+    cfg->blocks[block].end = num_insts;
+
+    for (uint32_t b = 0; b < cfg->num_blocks; b++) {
+        struct ubpf_basic_block* current = &cfg->blocks[b];
+        uint32_t last = last_instruction(insts, current->start, current->end);
+        struct ebpf_inst inst = insts[last];
+        if (is_jump(inst)) {
+            add_successor(current, cfg->block_of[jump_target(last, inst)]);
+        }
+        if (inst.opcode != EBPF_OP_EXIT && inst.opcode != EBPF_OP_JA && inst.opcode != EBPF_OP_JA32 &&
+            current->end < num_insts) {
+            add_successor(current, b + 1);
+        }
+    }
+
+    if (!check_functions(insts, num_insts, cfg, is_called, errmsg)) {
+        free(is_leader);
+        free(is_called);
+        ubpf_destroy_cfg(cfg);
+        return NULL;
+    }
+    succeeded = mark_reachable_blocks(insts, cfg);
+
+done:
+    free(is_leader);
+    free(is_called);
+    if (!succeeded) {
+        *errmsg = ubpf_error("out of memory");
+        ubpf_destroy_cfg(cfg);
+        return NULL;
+    }
+    return cfg;
+}
+
+void
+ubpf_destroy_cfg(struct ubpf_cfg* cfg)
+{
+    if (cfg == NULL) {
+        return;
+    }
+    free(cfg->blocks);
+    free(cfg->block_of);
+    free(cfg->function_start);
+    free(cfg);
+}
@@ -0,0 +1,446 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Instruction bound: an upper bound on the number of instructions that a program
+ * executes, counted as for ubpf_set_instruction_limit (an LDDW is one instruction), so
+ * that a program that cannot exceed the limit is run without counting.
+ *
+ * The bound of a function is the longest path through it, where a local call adds the
+ * bound of the function it calls. A loop is bounded if it has a constant trip count:
+ *   - its instructions are a range [header, latch] that is only entered by falling
+ *     into the header,
+ *   - its only back edge is a conditional jump at the latch that compares a register
+ *     with an immediate and
+ *   - that register is set to an immediate in the straight-line code before the
+ *     header and, in the loop, only changed by adding (or subtracting) an immediate
+ *     once per iteration.
+ * Such a loop counts as its longest path times the number of times its body runs, and
+ * loops may nest. Any other loop, and recursion, leaves the program unbounded.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "ubpf_int.h"
+
+#define BOUND_UNKNOWN UINT64_MAX
+
+enum function_state
+{
+    FUNCTION_UNVISITED,
+    FUNCTION_IN_PROGRESS,
+    FUNCTION_DONE,
+};
+
+struct bound_analysis
+{
+    const struct ubpf_vm* vm;
+    uint32_t* jumps_to;      // The number of jumps to each instruction.
+    bool* is_second_slot;    // The second half of an LDDW.
+    bool* is_loop_header;    // The header of a loop that has been bounded.
+    bool* is_in_loop;        // An instruction after the header of a loop that has been bounded.
+    uint64_t* cost;          // The longest path from each instruction out of the enclosing region.
+    uint8_t* function_state; // Indexed by the first instruction of each function.
+    uint64_t* function_bound;
+};
+
+static uint64_t
+bound_add(uint64_t a, uint64_t b)
+{
+    return a > BOUND_UNKNOWN - b ? BOUND_UNKNOWN : a + b;
+}
+
+static uint64_t
+bound_multiply(uint64_t a, uint64_t b)
+{
+    return b != 0 && a > BOUND_UNKNOWN / b ? BOUND_UNKNOWN : a * b;
+}
+
+static uint64_t
+bound_max(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+static bool
+is_jump(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32 || ubpf_instruction_is_conditional_jump(inst);
+}
+
+static uint32_t
+jump_target(uint32_t pc, struct ebpf_inst inst)
+{
+    return pc + 1 + (inst.opcode == EBPF_OP_JA32 ? inst.imm : inst.offset);
+}
+
+static uint32_t
+instruction_size(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_LDDW ? 2 : 1;
+}
+
+static uint32_t
+function_end(const struct ubpf_vm* vm, uint32_t start)
+{
+    uint32_t end = start + 1;
+    while (end < vm->num_insts && !vm->int_funcs[end]) {
+        end++;
+    }
+    return end;
+}
+
+// Whether the instruction may change the register.
+static bool
+writes_register(struct ebpf_inst inst, int reg)
+{
+    uint8_t class = inst.opcode & EBPF_CLS_MASK;
+    switch (class) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+    case EBPF_CLS_LD:
+    case EBPF_CLS_LDX:
+        return inst.dst == reg;
+    case EBPF_CLS_STX:
+        if ((inst.opcode & 0xe0) != EBPF_MODE_ATOMIC) {
+            return false;
+        }
+        if (inst.imm == EBPF_ATOMIC_OP_CMPXCHG) {
+            return reg == BPF_REG_0;
+        }
+        return (inst.imm & EBPF_ATOMIC_OP_FETCH) && inst.src == reg;
+    case EBPF_CLS_JMP:
+        // Calls clobber the argument registers and return in r0.
+        return (inst.opcode & EBPF_JMP_OP_MASK) == EBPF_MODE_CALL && reg <= BPF_REG_5;
+    default:
+        return false;
+    }
+}
+
+/*
+ * The number of times the body of the loop [header, latch] runs if its latch compares a
+ * register that starts at a constant and changes by a constant step on every iteration,
+ * or BOUND_UNKNOWN.
+ */
+static uint64_t
+trip_count(const struct bound_analysis* analysis, uint32_t function_start, uint32_t header, uint32_t latch)
+{
+    const struct ubpf_vm* vm = analysis->vm;
+    struct ebpf_inst check = ubpf_fetch_instruction(vm, latch);
+    bool is32 = (check.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32;
+    uint8_t relation = check.opcode & EBPF_JMP_OP_MASK;
+    if (check.opcode & EBPF_SRC_REG) {
+        return BOUND_UNKNOWN;
+    }
+
+    // The one instruction in the loop that changes the register.
+    int64_t update_pc = -1;
+    for (uint32_t pc = header; pc < latch; pc++) {
+        if (!analysis->is_second_slot[pc] && writes_register(ubpf_fetch_instruction(vm, pc), check.dst)) {
+            if (update_pc >= 0) {
+                return BOUND_UNKNOWN;
+            }
+            update_pc = pc;
+        }
+    }
+    if (update_pc < 0 || analysis->is_in_loop[update_pc] || (update_pc != header && analysis->is_loop_header[update_pc])) {
+        return BOUND_UNKNOWN;
+    }
+    struct ebpf_inst update = ubpf_fetch_instruction(vm, (uint32_t)update_pc);
+    int64_t step;
+    if (update.opcode == EBPF_OP_ADD64_IMM || (is32 && update.opcode == EBPF_OP_ADD_IMM)) {
+        step = update.imm;
+    } else if (update.opcode == EBPF_OP_SUB64_IMM || (is32 && update.opcode == EBPF_OP_SUB_IMM)) {
+        step = -(int64_t)update.imm;
+    } else {
+        return BOUND_UNKNOWN;
+    }
+    // It runs on every iteration: nothing before it in the loop jumps past it.
+    for (uint32_t pc = header; pc < (uint32_t)update_pc; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (!analysis->is_second_slot[pc] && is_jump(inst)) {
+            uint32_t target = jump_target(pc, inst);
+            if (target > (uint32_t)update_pc && target <= latch) {
+                return BOUND_UNKNOWN;
+            }
+        }
+    }
+
+    // The initial value is set in the straight-line code that falls into the loop.
+    if (header == function_start || analysis->jumps_to[header] != 1) {
+        return BOUND_UNKNOWN;
+    }
+    uint64_t initial;
+    uint32_t pc = header;
+    for (;;) {
+        pc -= pc >= 2 && analysis->is_second_slot[pc - 1] ? 2 : 1;
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (writes_register(inst, check.dst)) {
+            if (inst.opcode == EBPF_OP_MOV64_IMM) {
+                initial = (uint64_t)(int64_t)inst.imm;
+            } else if (inst.opcode == EBPF_OP_MOV_IMM) {
+                initial = (uint32_t)inst.imm;
+            } else {
+                return BOUND_UNKNOWN;
+            }
+            break;
+        }
+        if (inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32 || inst.opcode == EBPF_OP_EXIT ||
+            pc == function_start || analysis->jumps_to[pc] != 0) {
+            return BOUND_UNKNOWN;
+        }
+    }
+
+    /*
+     * Compare as unsigned values of the width of the jump: flipping the sign bit turns a
+     * signed order into an unsigned one without changing the steps between values.
+     * The register takes the values first, first + distance, ... (or first - distance,
+     * ...) at the latch; the body runs again while the comparison holds.
+     */
+    uint64_t mask = is32 ? UINT32_MAX : UINT64_MAX;
+    bool is_signed = relation == EBPF_MODE_JSGT || relation == EBPF_MODE_JSGE || relation == EBPF_MODE_JSLT ||
+                     relation == EBPF_MODE_JSLE;
+    uint64_t sign = is_signed ? (mask >> 1) + 1 : 0;
+    uint64_t increment = (uint64_t)step & mask;
+    if (increment == 0) {
+        return BOUND_UNKNOWN;
+    }
+    bool descending = increment > mask >> 1;
+    uint64_t distance = descending ? (~increment + 1) & mask : increment;
+    uint64_t first = ((initial + increment) & mask) ^ sign;
+    uint64_t limit = ((uint64_t)(int64_t)check.imm & mask) ^ sign;
+
+    uint64_t low, high;
+    switch (relation) {
+    case EBPF_MODE_JEQ:
+        return first == limit ? 2 : 1;
+    case EBPF_MODE_JNE:
+        // The body runs until the register reaches the limit, which it must not skip.
+        if (!descending && limit >= first && (limit - first) % distance == 0) {
+            return bound_add((limit - first) / distance, 1);
+        }
+        if (descending && limit <= first && (first - limit) % distance == 0) {
+            return bound_add((first - limit) / distance, 1);
+        }
+        return BOUND_UNKNOWN;
+    case EBPF_MODE_JLT:
+    case EBPF_MODE_JSLT:
+        if (limit == 0) {
+            return 1;
+        }
+        low = 0;
+        high = limit - 1;
+        break;
+    case EBPF_MODE_JLE:
+    case EBPF_MODE_JSLE:
+        low = 0;
+        high = limit;
+        break;
+    case EBPF_MODE_JGT:
+    case EBPF_MODE_JSGT:
+        if (limit == mask) {
+            return 1;
+        }
+        low = limit + 1;
+        high = mask;
+        break;
+    case EBPF_MODE_JGE:
+    case EBPF_MODE_JSGE:
+        low = limit;
+        high = mask;
+        break;
+    default:
+        return BOUND_UNKNOWN;
+    }
+    if (first < low || first > high) {
+        return 1;
+    }
+    // The number of further values in [low, high]; the next one must leave it without wrapping.
+    uint64_t steps;
+    if (!descending) {
+        steps = (high - first) / distance;
+        if (mask - (first + steps * distance) < distance) {
+            return BOUND_UNKNOWN;
+        }
+    } else {
+        steps = (first - low) / distance;
+        if (first - steps * distance < distance) {
+            return BOUND_UNKNOWN;
+        }
+    }
+    return bound_add(steps, 2);
+}
+
+static uint64_t
+function_bound(struct bound_analysis* analysis, uint32_t start);
+
+/*
+ * The cost of continuing at target after the instruction at from, in the region
+ * [start, end] (a function or the body of a loop whose header is start and whose
+ * latch is end). Leaving the body of a loop costs nothing more within it.
+ */
+static uint64_t
+successor_cost(
+    const struct bound_analysis* analysis, uint32_t start, uint32_t end, bool is_loop, uint32_t from, uint32_t target)
+{
+    if (target < start || target > end) {
+        return is_loop ? 0 : BOUND_UNKNOWN;
+    }
+    if (is_loop && target == start) {
+        // Only the latch jumps back to the header.
+        return from == end ? 0 : BOUND_UNKNOWN;
+    }
+    if (target <= from || analysis->is_in_loop[target]) {
+        return BOUND_UNKNOWN;
+    }
+    return analysis->cost[target];
+}
+
+/*
+ * Compute the longest path from every instruction in the region [start, end] (see
+ * successor_cost) out of it, summarizing the loops it contains, and return that from
+ * start.
+ */
+static uint64_t
+region_cost(struct bound_analysis* analysis, uint32_t function_start, uint32_t start, uint32_t end, bool is_loop)
+{
+    const struct ubpf_vm* vm = analysis->vm;
+    for (int64_t pc = end; pc >= start; pc--) {
+        if (analysis->is_second_slot[pc]) {
+            continue;
+        }
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, (uint32_t)pc);
+        uint32_t target = is_jump(inst) ? jump_target((uint32_t)pc, inst) : 0;
+
+        if (is_jump(inst) && target <= pc && !(is_loop && pc == end && target == start)) {
+            // The latch of a loop in the region.
+            uint32_t header = target;
+            uint32_t latch = (uint32_t)pc;
+            if (header < start || (is_loop && header == start) || !ubpf_instruction_is_conditional_jump(inst)) {
+                return BOUND_UNKNOWN;
+            }
+            uint64_t body = region_cost(analysis, function_start, header, latch, true);
+            uint64_t trips = body == BOUND_UNKNOWN ? BOUND_UNKNOWN : trip_count(analysis, function_start, header, latch);
+            if (trips == BOUND_UNKNOWN) {
+                return BOUND_UNKNOWN;
+            }
+            // The most expensive way out of the loop.
+            uint64_t after = 0;
+            for (uint32_t inner = header; inner <= latch; inner++) {
+                struct ebpf_inst exit = ubpf_fetch_instruction(vm, inner);
+                if (analysis->is_second_slot[inner] || exit.opcode == EBPF_OP_EXIT) {
+                    continue;
+                }
+                uint32_t successors[2] = {inner + instruction_size(exit), inner + instruction_size(exit)};
+                if (is_jump(exit)) {
+                    successors[0] = jump_target(inner, exit);
+                    if (exit.opcode == EBPF_OP_JA || exit.opcode == EBPF_OP_JA32) {
+                        successors[1] = successors[0];
+                    }
+                }
+                for (int i = 0; i < 2; i++) {
+                    if (successors[i] < header || successors[i] > latch) {
+                        after = bound_max(after, successor_cost(analysis, start, end, is_loop, latch, successors[i]));
+                    }
+                }
+            }
+            analysis->cost[header] = bound_add(bound_multiply(trips, body), after);
+            if (analysis->cost[header] == BOUND_UNKNOWN) {
+                return BOUND_UNKNOWN;
+            }
+            analysis->is_loop_header[header] = true;
+            for (uint32_t inner = header + 1; inner <= latch; inner++) {
+                analysis->is_in_loop[inner] = true;
+            }
+            pc = header;
+            continue;
+        }
+
+        uint64_t cost = 1;
+        uint64_t next = 0;
+        uint32_t fallthrough = (uint32_t)pc + instruction_size(inst);
+        if (inst.opcode == EBPF_OP_EXIT) {
+            next = 0;
+        } else if (inst.opcode == EBPF_OP_CALL) {
+            if (inst.src == 1) {
+                cost = bound_add(cost, function_bound(analysis, (uint32_t)pc + 1 + inst.imm));
+            }
+            next = successor_cost(analysis, start, end, is_loop, (uint32_t)pc, fallthrough);
+        } else if (inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32) {
+            next = successor_cost(analysis, start, end, is_loop, (uint32_t)pc, target);
+        } else if (is_jump(inst)) {
+            next = bound_max(
+                successor_cost(analysis, start, end, is_loop, (uint32_t)pc, fallthrough),
+                successor_cost(analysis, start, end, is_loop, (uint32_t)pc, target));
+        } else {
+            next = successor_cost(analysis, start, end, is_loop, (uint32_t)pc, fallthrough);
+        }
+        analysis->cost[pc] = bound_add(cost, next);
+        if (analysis->cost[pc] == BOUND_UNKNOWN) {
+            return BOUND_UNKNOWN;
+        }
+    }
+    return analysis->cost[start];
+}
+
+static uint64_t
+function_bound(struct bound_analysis* analysis, uint32_t start)
+{
+    if (start >= analysis->vm->num_insts) {
+        return BOUND_UNKNOWN;
+    }
+    switch (analysis->function_state[start]) {
+    case FUNCTION_IN_PROGRESS:
+        // Recursion.
+        return BOUND_UNKNOWN;
+    case FUNCTION_DONE:
+        return analysis->function_bound[start];
+    default:
+        break;
+    }
+    analysis->function_state[start] = FUNCTION_IN_PROGRESS;
+    uint64_t bound = region_cost(analysis, start, start, function_end(analysis->vm, start) - 1, false);
+    analysis->function_state[start] = FUNCTION_DONE;
+    analysis->function_bound[start] = bound;
+    return bound;
+}
+
+void
+ubpf_compute_instruction_bound(struct ubpf_vm* vm)
+{
+    vm->instruction_bound = BOUND_UNKNOWN;
+
+    uint32_t num_insts = vm->num_insts;
+    struct bound_analysis analysis = {
+        .vm = vm,
+        .jumps_to = calloc(num_insts, sizeof(uint32_t)),
+        .is_second_slot = calloc(num_insts, sizeof(bool)),
+        .is_loop_header = calloc(num_insts, sizeof(bool)),
+        .is_in_loop = calloc(num_insts, sizeof(bool)),
+        .cost = calloc(num_insts, sizeof(uint64_t)),
+        .function_state = calloc(num_insts, sizeof(uint8_t)),
+        .function_bound = calloc(num_insts, sizeof(uint64_t)),
+    };
+    if (analysis.jumps_to != NULL && analysis.is_second_slot != NULL && analysis.is_loop_header != NULL &&
+        analysis.is_in_loop != NULL && analysis.cost != NULL && analysis.function_state != NULL &&
+        analysis.function_bound != NULL) {
+        for (uint32_t pc = 0; pc < num_insts; pc++) {
+            struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+            if (inst.opcode == EBPF_OP_LDDW && pc + 1 < num_insts) {
+                analysis.is_second_slot[++pc] = true;
+            } else if (is_jump(inst) && jump_target(pc, inst) < num_insts) {
+                analysis.jumps_to[jump_target(pc, inst)]++;
+            }
+        }
+        vm->instruction_bound = function_bound(&analysis, 0);
+    }
+
+    free(analysis.jumps_to);
+    free(analysis.is_second_slot);
+    free(analysis.is_loop_header);
+    free(analysis.is_in_loop);
+    free(analysis.cost);
+    free(analysis.function_state);
+    free(analysis.function_bound);
+}
@@ -41,8 +41,6 @@ typedef enum
 
 struct ubpf_jit_result
 {
-    uint32_t external_dispatcher_offset;
-    uint32_t external_helper_offset;
     upbf_jit_result_t compile_result;
     enum JitMode jit_mode;
     char* errmsg;
@@ -53,6 +51,7 @@ typedef enum
     UBPF_STACK_USAGE_UNKNOWN = 0,
     UBPF_STACK_USAGE_CUSTOM,
     UBPF_STACK_USAGE_DEFAULT,
+    UBPF_STACK_USAGE_COMPUTED, // From the function's accesses; see ubpf_compute_stack_requirement.
 } ubpf_stack_usage_calculation_status_t;
 
 struct ubpf_stack_usage
@@ -61,6 +60,27 @@ struct ubpf_stack_usage
     uint16_t stack_usage;
 };
 
+struct ubpf_basic_block
+{
+    uint32_t start;         // The first instruction.
+    uint32_t end;           // One past the last instruction.
+    uint32_t function;      // The index of the function that contains the block.
+    uint32_t successors[2]; // The blocks that control passes to, other than through local calls.
+    uint8_t num_successors;
+    bool reachable; // Whether the block can be reached from the entry.
+};
+
+// The control flow graph of a loaded program; see ubpf_create_cfg.
+struct ubpf_cfg
+{
+    uint32_t num_blocks;
+    struct ubpf_basic_block* blocks; // In program order.
+    uint32_t* block_of;              // Per instruction: the block that contains it.
+    uint32_t num_functions;
+    uint32_t* function_start; // Per function, in program order; the main program is function 0.
+    uint32_t num_unreachable_insts;
+};
+
 // Use public definition for consistency
 #define MAX_EXT_FUNCS UBPF_MAX_EXT_FUNCS
 #define UBPF_MAX_SAFE_REGIONS 64
@@ -83,59 +103,126 @@ struct ubpf_safe_helper_metadata
     uint64_t region_size;
 };
 
+/*
+ * Data that JIT'd code reads at run time. It lives in its own page, away from the
+ * code, so that the code is never written after it is compiled: registering a helper
+ * or the external dispatcher is a single atomic store into this page. The code does
+ * not hold its address either; the VM's entry stub (see jit_entry in struct ubpf_vm)
+ * passes it to the code as a hidden argument.
+ */
+struct ubpf_jit_data
+{
+    const void* code; // The JIT'd code that the entry stub jumps to. Must come first.
+    external_function_dispatcher_t dispatcher;
+    extended_external_helper_t helpers[MAX_EXT_FUNCS];
+    // Read by the functions that JIT'd code calls when a run-time check fails.
+    ubpf_bounds_check bounds_check_function;
+    void* bounds_check_user_data;
+    int (*error_printf)(FILE* stream, const char* format, ...);
+};
+
+// The options besides the program that the native JITs translate it with.
+struct ubpf_jit_options
+{
+    enum JitMode jit_mode;
+    bool constant_blinding_enabled;
+    bool lse_atomics_enabled;
+    int register_offset;
+    int instruction_limit;
+    int unwind_stack_extension_index;
+};
+
+/*
+ * Machine code that a native JIT compiled, which is never written once it is compiled.
+ * It reaches everything that belongs to a VM through the struct ubpf_jit_data that the
+ * VM's entry stub passes to it, so the VMs that run the same shared program with the
+ * same options run one image (see ubpf_find_jit_code). It is reference counted by those
+ * VMs and unmapped when the last one releases it.
+ */
+struct ubpf_jit_code
+{
+    struct ubpf_jit_code* next;   // In the list of the program that shares it.
+    struct ubpf_program* program; // The program that shares it, if any; holds a reference to it.
+    uint32_t references;
+    struct ubpf_jit_options options;
+    void* code; // The mapping that holds the code.
+    size_t size;
+};
+
+/*
+ * The largest entry stub that jit_entry (see struct ubpf_vm) writes. The entry stub
+ * loads the address of a struct ubpf_jit_data into the register in which JIT'd code
+ * expects it and either jumps to jit_data->code or falls through into the code that
+ * follows the stub.
+ */
+#define UBPF_JIT_ENTRY_MAX_SIZE 64
+
+/*
+ * The fields that every execution reads come first, so that threads running the same
+ * VM share a few read-only cache lines. ubpf_create places the VM at the start of its
+ * own pages, which keeps those lines from being shared with anything that is written.
+ * Executing a program must never write to the VM.
+ */
 struct ubpf_vm
 {
     struct ebpf_inst* insts;
     uint16_t num_insts;
+    bool bounds_check_enabled;
+    bool undefined_behavior_check_enabled;
+    bool context_size_declared; // See ubpf_set_minimum_context_size.
+    bool shadow_tracking_needed; // Whether any instruction of shadow_tracked is.
+    enum ubpf_execution_profile execution_profile;
+    size_t minimum_context_size;
+    size_t stack_requirement; // Bytes of eBPF stack the program needs; 0 if it never uses r10.
+    int instruction_limit;
+    uint64_t instruction_bound; // See ubpf_compute_instruction_bound.
+    extended_external_helper_t* ext_funcs; // Points at jit_data->helpers.
+    bool* int_funcs;
+    struct ubpf_stack_usage* local_func_stack_usage;
+    bool* proven_accesses; // Per instruction: an access proven in bounds (see ubpf_verify_ranges).
+    bool* shadow_tracked;  // Per instruction: track the shadow state (see ubpf_analyze_uninitialized_reads).
+    struct ubpf_branch_profile_entry* branch_profile; // One entry per instruction; NULL unless profiling.
+    void* debug_function_context; ///< Context pointer that is passed to the debug function.
+    ubpf_debug_fn debug_function; ///< Debug function that is called before each instruction.
+    ubpf_data_relocation data_relocation_function;
+    void* data_relocation_user_data;
+    uint64_t pointer_secret;
+    ubpf_jit_ex_fn jitted; // The entry stub, once the program is compiled.
+    struct ubpf_jit_data* jit_data; // Also holds the dispatcher, bounds check and error hooks.
+
+    // Everything below is only used while loading, compiling or configuring the VM.
     size_t insts_alloc_size;           // Actual allocation size (page-aligned) for mmap'd bytecode
     bool readonly_bytecode_enabled;     // Whether bytecode is stored in read-only memory
-    ubpf_jit_ex_fn jitted;
-    size_t jitted_size;
+    size_t jitted_size; // What ubpf_copy_jit copies: an entry stub and the code.
+    struct ubpf_jit_code* jit_code; // The code that the entry stub jumps to, possibly shared.
     size_t jitter_buffer_size;
+    unsigned int jit_threads; // See ubpf_set_jit_threads.
     struct ubpf_jit_result jitted_result;
+    ubpf_c_fn c_compiled; // The program translated to C, see ubpf_compile_c.
+    void* c_module;       // The shared object that c_compiled lives in.
+    void* llvm_jit;       // The LLVM JIT (LLVMOrcLLJITRef) that owns jitted in LlvmJitMode.
 
-    extended_external_helper_t* ext_funcs;
-    bool* int_funcs;
+    struct ubpf_cfg* cfg;
     const char** ext_func_names;
 
-    struct ubpf_stack_usage* local_func_stack_usage;
     void* stack_usage_calculator_cookie;
     stack_usage_calculator_t stack_usage_calculator;
 
-    external_function_dispatcher_t dispatcher;
     external_function_validate_t dispatcher_validate;
 
-    bool bounds_check_enabled;
-    bool undefined_behavior_check_enabled;
     bool constant_blinding_enabled;
-    enum ubpf_execution_profile execution_profile;
-    bool execution_started;
-    int (*error_printf)(FILE* stream, const char* format, ...);
+    bool lse_atomics_enabled; // Emit ARMv8.1 LSE atomics in the arm64 JIT (see ubpf_toggle_lse_atomics).
+    int register_offset;      // Permutes the x86-64 JIT's register mapping (see ubpf_set_register_offset).
     struct ubpf_jit_result (*jit_translate)(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode);
-    bool (*jit_update_dispatcher)(
-        struct ubpf_vm* vm,
-        external_function_dispatcher_t new_dispatcher,
-        uint8_t* buffer,
-        size_t size,
-        uint32_t offset);
-    bool (*jit_update_helper)(
-        struct ubpf_vm* vm,
-        extended_external_helper_t new_helper,
-        unsigned int idx,
-        uint8_t* buffer,
-        size_t size,
-        uint32_t offset);
+    size_t (*jit_entry)(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through);
     int unwind_stack_extension_index;
-    uint64_t pointer_secret;
-    ubpf_data_relocation data_relocation_function;
-    void* data_relocation_user_data;
-    ubpf_bounds_check bounds_check_function;
-    void* bounds_check_user_data;
     struct ubpf_safe_region_internal safe_regions[UBPF_MAX_SAFE_REGIONS];
     struct ubpf_safe_helper_metadata safe_helpers[MAX_EXT_FUNCS];
-    int instruction_limit;
-    void* debug_function_context; ///< Context pointer that is passed to the debug function.
-    ubpf_debug_fn debug_function; ///< Debug function that is called before each instruction.
+    uint32_t memory_accesses;
+    uint32_t proven_memory_accesses;
+    bool branch_profiling_enabled;
+    bool program_cache_enabled;
+    struct ubpf_program* program; // The shared program that insts belongs to, if any.
 #ifdef DEBUG
     uint64_t* regs;
 #endif
@@ -161,50 +248,359 @@ ubpf_is_valid_instruction(const struct ebpf_inst insts, char ** errmsg);
 
 /* The various JIT targets.  */
 
+/*
+ * Each JIT target also has an entry stub writer (see jit_entry in struct ubpf_vm): it
+ * writes at most UBPF_JIT_ENTRY_MAX_SIZE bytes of code to buffer that pass jit_data to
+ * JIT'd code and jump to jit_data->code or, if fall_through, run into the code that
+ * follows the stub. It returns the size of the stub.
+ */
+
 // arm64
 struct ubpf_jit_result
 ubpf_translate_arm64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode);
+
+size_t
+ubpf_jit_entry_arm64(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through);
+
+/**
+ * @brief Check if the processor we are running on implements the ARMv8.1 LSE atomic instructions.
+ *
+ * @return false on other architectures.
+ */
 bool
-ubpf_jit_update_dispatcher_arm64(
-    struct ubpf_vm* vm, external_function_dispatcher_t new_dispatcher, uint8_t* buffer, size_t size, uint32_t offset);
-bool
-ubpf_jit_update_helper_arm64(
-    struct ubpf_vm* vm,
-    extended_external_helper_t new_helper,
-    unsigned int idx,
-    uint8_t* buffer,
-    size_t size,
-    uint32_t offset);
+ubpf_arm64_lse_atomics_supported(void);
+
+// mips64
+struct ubpf_jit_result
+ubpf_translate_mips64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode);
+
+size_t
+ubpf_jit_entry_mips64(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through);
+
+// riscv64
+struct ubpf_jit_result
+ubpf_translate_riscv64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode);
+
+size_t
+ubpf_jit_entry_riscv64(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through);
 
 // x86_64
 struct ubpf_jit_result
 ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode);
-bool
-ubpf_jit_update_dispatcher_x86_64(
-    struct ubpf_vm* vm, external_function_dispatcher_t new_dispatcher, uint8_t* buffer, size_t size, uint32_t offset);
-bool
-ubpf_jit_update_helper_x86_64(
-    struct ubpf_vm* vm,
-    extended_external_helper_t new_helper,
-    unsigned int idx,
-    uint8_t* buffer,
-    size_t size,
-    uint32_t offset);
+
+size_t
+ubpf_jit_entry_x86_64(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through);
+
+/**
+ * @brief For testing, change the mapping between x86 and eBPF registers that the VM is compiled with.
+ *
+ * An offset below the number of eBPF registers rotates the mapping, any other value seeds a shuffle.
+ * The mapping is kept per VM, so VMs with different offsets can be compiled at the same time.
+ */
+void
+ubpf_set_register_offset(struct ubpf_vm* vm, int x);
+
+// LLVM (LlvmJitMode)
+ubpf_jit_ex_fn
+ubpf_compile_llvm(struct ubpf_vm* vm, char** errmsg);
+
+/**
+ * @brief Dispose of the LLVM JIT that holds the code compiled in LlvmJitMode, if any.
+ *
+ * @param[in] vm The VM whose JIT'd code is released.
+ */
+void
+ubpf_release_llvm_jit(struct ubpf_vm* vm);
+
+/**
+ * @brief Unload the shared object that ubpf_compile_c() loaded, if any.
+ *
+ * @param[in] vm The VM to release the compiled C program of.
+ */
+void
+ubpf_release_c_module(struct ubpf_vm* vm);
 
 // uhm, hello?
 struct ubpf_jit_result
 ubpf_translate_null(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode);
+
+size_t
+ubpf_jit_entry_null(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through);
+
+/**
+ * @brief Map a struct ubpf_jit_data for a VM or an instance, preceded by a page with its
+ * entry stub, which JIT'd code is always called through. The entry stub is the function
+ * that runs the code, once jit_data->code is set.
+ *
+ * @param[in] jit_entry The function that writes the entry stub (see jit_entry in struct ubpf_vm).
+ * @return The struct ubpf_jit_data, or NULL if the memory could not be mapped.
+ */
+struct ubpf_jit_data*
+ubpf_create_jit_data(size_t (*jit_entry)(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through));
+
+/**
+ * @brief Unmap a struct ubpf_jit_data and its entry stub.
+ *
+ * @param[in] jit_data The struct ubpf_jit_data, or NULL.
+ */
+void
+ubpf_destroy_jit_data(struct ubpf_jit_data* jit_data);
+
+/**
+ * @brief The size of a page of memory, which mappings that get their own protection
+ * are rounded up to.
+ */
+size_t
+ubpf_page_size(void);
+
+/**
+ * @brief Unmap the JIT'd code held by the VM.
+ *
+ * @param[in] vm The VM whose JIT'd code is released.
+ */
+void
+ubpf_release_jitted(struct ubpf_vm* vm);
+
+/**
+ * @brief Why JIT'd code that enforces the VM's limits stopped a program.
+ */
+enum ubpf_jit_stop_reason
+{
+    UBPF_JIT_STOP_INSTRUCTION_LIMIT, ///< The program ran out of fuel (see ubpf_set_instruction_limit).
+    UBPF_JIT_STOP_CALL_DEPTH,        ///< The program nested more than UBPF_MAX_CALL_DEPTH local calls.
+    UBPF_JIT_STOP_CONTEXT_SIZE,      ///< The program was given less memory or stack than it was verified for.
+};
+
+/**
+ * @brief Check a memory access that the inline bounds check of JIT'd code did not allow,
+ * i.e., one that is neither in the program's memory nor in its stack. JIT'd code calls
+ * this function; it asks the VM's bounds check function (if any) and reports the error
+ * if the access is not allowed.
+ *
+ * @param[in] jit_data The struct ubpf_jit_data that the JIT'd code was entered with.
+ * @param[in] addr The address of the access.
+ * @param[in] size The size of the access.
+ * @param[in] pc The eBPF instruction that made the access.
+ * @return true if the access is allowed.
+ */
+bool
+ubpf_jit_check_access(const struct ubpf_jit_data* jit_data, uint64_t addr, uint64_t size, uint32_t pc);
+
+/**
+ * @brief Report that JIT'd code stopped a program. JIT'd code calls this function before
+ * it returns UINT64_MAX.
+ *
+ * @param[in] jit_data The struct ubpf_jit_data that the JIT'd code was entered with.
+ * @param[in] reason Why it was stopped.
+ * @param[in] minimum_context_size The memory that the program was verified for (see
+ * UBPF_JIT_STOP_CONTEXT_SIZE).
+ * @param[in] stack_requirement The stack that the program needs.
+ */
+void
+ubpf_jit_report_stop(
+    const struct ubpf_jit_data* jit_data,
+    enum ubpf_jit_stop_reason reason,
+    size_t minimum_context_size,
+    size_t stack_requirement);
+
+/**
+ * @brief Build the control flow graph of a program whose instructions are valid, and
+ * check that its local functions are self-contained.
+ *
+ * @param[in] insts The instructions of the program.
+ * @param[in] num_insts The number of instructions.
+ * @param[out] errmsg The error message if a local function is not self-contained or
+ * there is not enough memory.
+ * @return The control flow graph, to be freed with ubpf_destroy_cfg, or NULL on error.
+ */
+struct ubpf_cfg*
+ubpf_create_cfg(const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+
+void
+ubpf_destroy_cfg(struct ubpf_cfg* cfg);
+
+/**
+ * @brief Whether control can reach the instruction at pc. Code that cannot is not JIT'd.
+ */
+static inline bool
+ubpf_instruction_is_reachable(const struct ubpf_vm* vm, uint32_t pc)
+{
+    return vm->cfg == NULL || vm->cfg->blocks[vm->cfg->block_of[pc]].reachable;
+}
+
+/**
+ * @brief Run the range verifier on the loaded program: record in vm->proven_accesses the
+ * memory accesses that stay in bounds whenever the program is run with at least
+ * vm->minimum_context_size bytes of memory and, if it uses one, a stack of
+ * UBPF_EBPF_STACK_SIZE bytes. Their run-time bounds checks can be left out.
+ *
+ * @param[in] vm The VM whose program is verified.
+ * @param[out] errmsg The error message if the verifier ran out of memory.
+ * @return false if the verifier ran out of memory.
+ */
+bool
+ubpf_verify_ranges(struct ubpf_vm* vm, char** errmsg);
+
+/**
+ * @brief Check that a program whose bounds checks rely on the range verifier is given
+ * the memory and the stack that it was verified for, and report the error if not.
+ *
+ * @param[in] vm The VM whose program is about to run.
+ * @param[in] mem The memory the program is run with.
+ * @param[in] mem_len The size of the memory.
+ * @param[in] stack_len The size of the stack.
+ * @return true if the program may run.
+ */
 bool
-ubpf_jit_update_dispatcher_null(
-    struct ubpf_vm* vm, external_function_dispatcher_t new_dispatcher, uint8_t* buffer, size_t size, uint32_t offset);
+ubpf_check_context_size(const struct ubpf_vm* vm, const void* mem, size_t mem_len, size_t stack_len);
+
+/**
+ * @brief Check that helper idx can be called: that the external dispatcher accepts it or,
+ * without one, that a helper is registered at idx.
+ *
+ * @param[in] vm The VM whose helpers are checked.
+ * @param[in] idx The index of the helper.
+ * @return true if a call to the helper is valid.
+ */
+bool
+ubpf_helper_is_registered(const struct ubpf_vm* vm, unsigned int idx);
+
+/**
+ * @brief Load a program from the process-wide program cache: if the cache holds the same
+ * program, loaded with the same options, point vm at it and check its helper calls
+ * against the helpers of vm.
+ *
+ * @param[in] vm The VM to load the program into.
+ * @param[in] insts The program.
+ * @param[in] num_insts The number of instructions in the program.
+ * @param[out] errmsg The error message if a helper that the program calls is missing.
+ * @retval 1 The program was loaded from the cache.
+ * @retval 0 The cache does not hold the program.
+ * @retval -1 The program calls a helper that vm does not have.
+ */
+int
+ubpf_load_cached_program(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+
+/**
+ * @brief Add the program that was just loaded into vm to the program cache, which takes
+ * over its bytecode and analysis results. Nothing is cached if memory runs out or the
+ * cache already holds the program.
+ *
+ * @param[in] vm The VM that loaded the program.
+ * @param[in] insts The program, as passed to ubpf_load.
+ */
+void
+ubpf_cache_loaded_program(struct ubpf_vm* vm, const struct ebpf_inst* insts);
+
+/**
+ * @brief Make vm an instance of a program: take the options that the program was loaded
+ * with, point vm at the program and check its helper calls against the helpers of vm.
+ *
+ * @param[in] vm The VM, which has no code loaded.
+ * @param[in] program The program, which vm takes a reference to.
+ * @param[out] errmsg The error message if vm cannot run the program.
+ * @retval 0 Success.
+ * @retval -1 vm lacks a helper that the program calls or has other safe helpers.
+ */
+int
+ubpf_share_program(struct ubpf_vm* vm, struct ubpf_program* program, char** errmsg);
+
+/**
+ * @brief Drop the reference of vm to the shared program it runs, if any, and free the
+ * program if it was the last one.
+ *
+ * @param[in] vm The VM whose program is unloaded.
+ */
+void
+ubpf_unload_program(struct ubpf_vm* vm);
+
+/**
+ * @brief Find the code that another VM compiled for the shared program that vm runs,
+ * with the options of vm, and take a reference to it.
+ *
+ * @param[in] vm The VM to compile.
+ * @param[in] jit_mode The mode to compile vm in.
+ * @return The code, or NULL if there is none to share: vm does not run a shared
+ * program, it profiles branches or no VM compiled the program with these options yet.
+ */
+struct ubpf_jit_code*
+ubpf_find_jit_code(struct ubpf_vm* vm, enum JitMode jit_mode);
+
+/**
+ * @brief Take over code that was just compiled for vm, which holds the only reference to
+ * it, and share it through the program that vm runs, if any, unless another VM already
+ * shares code for it with the same options.
+ *
+ * @param[in] vm The VM that the code was compiled for.
+ * @param[in] jit_mode The mode that the code was compiled in.
+ * @param[in] code The read-only, executable mapping that holds the code.
+ * @param[in] size The size of the code.
+ * @return The code, or NULL if memory runs out; then the mapping is not taken over.
+ */
+struct ubpf_jit_code*
+ubpf_create_jit_code(struct ubpf_vm* vm, enum JitMode jit_mode, void* code, size_t size);
+
+/**
+ * @brief Drop a reference to JIT'd code and unmap the code if it was the last one.
+ *
+ * @param[in] jit_code The code.
+ */
+void
+ubpf_release_jit_code(struct ubpf_jit_code* jit_code);
+
+/**
+ * @brief Compute vm->instruction_bound, an upper bound on the number of instructions the
+ * loaded program executes (as counted for ubpf_set_instruction_limit), or UINT64_MAX if
+ * it is not known.
+ *
+ * @param[in] vm The VM whose program is analyzed.
+ */
+void
+ubpf_compute_instruction_bound(struct ubpf_vm* vm);
+
+/**
+ * @brief Size the frames of the loaded program's functions from their accesses relative
+ * to r10, unless a stack usage calculator is registered, and compute the stack that the
+ * program needs: the most that any chain of local calls uses, or UBPF_EBPF_STACK_SIZE if
+ * a frame could not be sized (or a calculator sized it).
+ *
+ * @param[in] vm The VM whose program is analyzed.
+ * @return The number of bytes of stack that the program needs.
+ */
+size_t
+ubpf_compute_stack_requirement(struct ubpf_vm* vm);
+
+/**
+ * @brief Prove the undefined behavior checks of the loaded program: record in
+ * vm->shadow_tracked the instructions at which the interpreter has to track which
+ * registers and stack bytes are initialized, the ones from which an instruction whose
+ * check the analysis cannot prove to pass can be reached.
+ *
+ * @param[in] vm The VM whose program is analyzed.
+ * @param[out] errmsg The error message if the analysis ran out of memory.
+ * @return false if the analysis ran out of memory.
+ */
 bool
-ubpf_jit_update_helper_null(
-    struct ubpf_vm* vm,
-    extended_external_helper_t new_helper,
-    unsigned int idx,
-    uint8_t* buffer,
-    size_t size,
-    uint32_t offset);
+ubpf_analyze_uninitialized_reads(struct ubpf_vm* vm, char** errmsg);
+
+/**
+ * @brief Whether the program has to count the instructions it executes: it has an
+ * instruction limit that it may exceed.
+ */
+static inline bool
+ubpf_counts_instructions(const struct ubpf_vm* vm)
+{
+    return vm->instruction_limit != 0 && vm->instruction_bound > (uint32_t)vm->instruction_limit;
+}
+
+/**
+ * @brief Whether JIT'd code may leave out the run-time bounds check of the access at pc.
+ */
+static inline bool
+ubpf_access_is_proven(const struct ubpf_vm* vm, uint32_t pc)
+{
+    return vm->proven_accesses != NULL && vm->proven_accesses[pc];
+}
 
 char*
 ubpf_error(const char* fmt, ...);
@@ -274,6 +670,21 @@ ubpf_instruction_has_fallthrough(const struct ebpf_inst inst)
     return inst.opcode != EBPF_OP_EXIT;
 }
 
+/**
+ * @brief Determine whether an eBPF instruction is a conditional jump
+ *
+ * @return True if the inst transfers control to its target only when its
+ *         condition holds; false, otherwise.
+ */
+static inline bool
+ubpf_instruction_is_conditional_jump(const struct ebpf_inst inst)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+    uint8_t op = inst.opcode & EBPF_JMP_OP_MASK;
+    return (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && op != EBPF_MODE_JA && op != EBPF_MODE_CALL &&
+           op != EBPF_MODE_EXIT;
+}
+
 // If either GNU C or Clang
 #if defined(__GNUC__) || defined(__clang__)
 #define UBPF_ATOMIC_ADD_FETCH(ptr, val) __sync_fetch_and_add(ptr, val)
@@ -288,6 +699,7 @@ ubpf_instruction_has_fallthrough(const struct ebpf_inst inst)
 #define UBPF_ATOMIC_XOR_FETCH32(ptr, val) __sync_fetch_and_xor(ptr, val)
 #define UBPF_ATOMIC_EXCHANGE32(ptr, val) __sync_lock_test_and_set(ptr, val);
 #define UBPF_ATOMIC_COMPARE_EXCHANGE32(ptr, oldval, newval) __sync_val_compare_and_swap(ptr, oldval, newval)
+#define UBPF_ATOMIC_STORE64(ptr, val) __atomic_store_n((volatile uint64_t*)ptr, (uint64_t)val, __ATOMIC_RELEASE)
 // If Microsoft Visual C++
 #elif defined(_MSC_VER)
 #include <intrin.h>
@@ -305,6 +717,7 @@ ubpf_instruction_has_fallthrough(const struct ebpf_inst inst)
 #define UBPF_ATOMIC_EXCHANGE32(ptr, val) _InterlockedExchange((volatile long*)ptr, val)
 #define UBPF_ATOMIC_COMPARE_EXCHANGE32(ptr, oldval, newval) \
     _InterlockedCompareExchange((volatile long*)ptr, newval, oldval)
+#define UBPF_ATOMIC_STORE64(ptr, val) _InterlockedExchange64((volatile int64_t*)ptr, (int64_t)val)
 #endif
 
 #endif
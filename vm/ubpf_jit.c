@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <inttypes.h>
 #include "ubpf_int.h"
 
 int
@@ -37,6 +38,10 @@ ubpf_translate_ex(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errm
         *errmsg = ubpf_error("safe execution profile is interpreter-only");
         return -1;
     }
+    if (jit_mode == LlvmJitMode) {
+        *errmsg = ubpf_error("code JIT'd with LLVM cannot be translated into a buffer");
+        return -1;
+    }
 
     struct ubpf_jit_result jit_result = vm->jit_translate(vm, buffer, size, jit_mode);
     vm->jitted_result = jit_result;
@@ -57,7 +62,6 @@ ubpf_translate_null(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitM
 {
     struct ubpf_jit_result compile_result;
     compile_result.compile_result = UBPF_JIT_COMPILE_FAILURE;
-    compile_result.external_dispatcher_offset = 0;
 
     /* NULL JIT target - just returns an error. */
     UNUSED_PARAMETER(vm);
@@ -68,40 +72,20 @@ ubpf_translate_null(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitM
     return compile_result;
 }
 
-bool
-ubpf_jit_update_dispatcher_null(
-    struct ubpf_vm* vm, external_function_dispatcher_t new_dispatcher, uint8_t* buffer, size_t size, uint32_t offset)
-{
-    UNUSED_PARAMETER(vm);
-    UNUSED_PARAMETER(new_dispatcher);
-    UNUSED_PARAMETER(buffer);
-    UNUSED_PARAMETER(size);
-    UNUSED_PARAMETER(offset);
-    return false;
-}
-
-bool
-ubpf_jit_update_helper_null(
-    struct ubpf_vm* vm,
-    extended_external_helper_t new_helper,
-    unsigned int idx,
-    uint8_t* buffer,
-    size_t size,
-    uint32_t offset)
+int
+ubpf_set_jit_code_size(struct ubpf_vm* vm, size_t code_size)
 {
-    UNUSED_PARAMETER(vm);
-    UNUSED_PARAMETER(new_helper);
-    UNUSED_PARAMETER(idx);
-    UNUSED_PARAMETER(buffer);
-    UNUSED_PARAMETER(size);
-    UNUSED_PARAMETER(offset);
-    return false;
+    vm->jitter_buffer_size = code_size;
+    return 0;
 }
 
 int
-ubpf_set_jit_code_size(struct ubpf_vm* vm, size_t code_size)
+ubpf_set_jit_threads(struct ubpf_vm* vm, unsigned int threads)
 {
-    vm->jitter_buffer_size = code_size;
+    if (threads == 0 || threads > UBPF_MAX_JIT_THREADS) {
+        return -1;
+    }
+    vm->jit_threads = threads;
     return 0;
 }
 
@@ -111,6 +95,73 @@ ubpf_compile(struct ubpf_vm* vm, char** errmsg)
     return (ubpf_jit_fn)ubpf_compile_ex(vm, errmsg, BasicJitMode);
 }
 
+size_t
+ubpf_jit_entry_null(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through)
+{
+    /* NULL JIT target - there is no code to enter. */
+    UNUSED_PARAMETER(buffer);
+    UNUSED_PARAMETER(jit_data);
+    UNUSED_PARAMETER(fall_through);
+    return 0;
+}
+
+/* The size of the mapping that holds the struct ubpf_jit_data, after the entry stub's page. */
+static size_t
+jit_data_mapping_size(void)
+{
+    size_t page_size = ubpf_page_size();
+    return (sizeof(struct ubpf_jit_data) + page_size - 1) & ~(page_size - 1);
+}
+
+struct ubpf_jit_data*
+ubpf_create_jit_data(size_t (*jit_entry)(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through))
+{
+    size_t page_size = ubpf_page_size();
+    uint8_t* mapping =
+        mmap(0, page_size + jit_data_mapping_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    struct ubpf_jit_data* jit_data = (struct ubpf_jit_data*)(mapping + page_size);
+    jit_data->error_printf = fprintf;
+
+    // The entry stub never changes: it reaches the code through jit_data->code.
+    size_t entry_size = jit_entry(mapping, jit_data, false);
+#if defined(__riscv) || defined(__mips__)
+    __builtin___clear_cache((char*)mapping, (char*)mapping + entry_size);
+#else
+    UNUSED_PARAMETER(entry_size);
+#endif
+    if (mprotect(mapping, page_size, PROT_READ | PROT_EXEC) < 0) {
+        munmap(mapping, page_size + jit_data_mapping_size());
+        return NULL;
+    }
+    return jit_data;
+}
+
+void
+ubpf_destroy_jit_data(struct ubpf_jit_data* jit_data)
+{
+    if (jit_data) {
+        size_t page_size = ubpf_page_size();
+        munmap((uint8_t*)jit_data - page_size, page_size + jit_data_mapping_size());
+    }
+}
+
+void
+ubpf_release_jitted(struct ubpf_vm* vm)
+{
+    if (vm->llvm_jit) {
+        ubpf_release_llvm_jit(vm);
+    } else if (vm->jit_code) {
+        UBPF_ATOMIC_STORE64(&vm->jit_data->code, 0);
+        ubpf_release_jit_code(vm->jit_code);
+        vm->jit_code = NULL;
+    }
+    vm->jitted = NULL;
+    vm->jitted_size = 0;
+}
+
 ubpf_jit_ex_fn
 ubpf_compile_ex(struct ubpf_vm* vm, char** errmsg, enum JitMode mode)
 {
@@ -128,11 +179,7 @@ ubpf_compile_ex(struct ubpf_vm* vm, char** errmsg, enum JitMode mode)
         return vm->jitted;
     }
 
-    if (vm->jitted) {
-        munmap(vm->jitted, vm->jitted_size);
-        vm->jitted = NULL;
-        vm->jitted_size = 0;
-    }
+    ubpf_release_jitted(vm);
 
     *errmsg = NULL;
 
@@ -141,6 +188,23 @@ ubpf_compile_ex(struct ubpf_vm* vm, char** errmsg, enum JitMode mode)
         return NULL;
     }
 
+    if (mode == LlvmJitMode) {
+        vm->jitted = ubpf_compile_llvm(vm, errmsg);
+        vm->jitted_result.compile_result = vm->jitted ? UBPF_JIT_COMPILE_SUCCESS : UBPF_JIT_COMPILE_FAILURE;
+        vm->jitted_result.jit_mode = mode;
+        vm->jitted_result.errmsg = NULL;
+        return vm->jitted;
+    }
+
+    // Another VM that runs the same program may have compiled it with the same options.
+    vm->jit_code = ubpf_find_jit_code(vm, mode);
+    if (vm->jit_code) {
+        vm->jitted_result.compile_result = UBPF_JIT_COMPILE_SUCCESS;
+        vm->jitted_result.jit_mode = mode;
+        vm->jitted_result.errmsg = NULL;
+        goto enter;
+    }
+
     jitted_size = vm->jitter_buffer_size;
     buffer = calloc(jitted_size, 1);
     if (buffer == NULL) {
@@ -155,27 +219,85 @@ ubpf_compile_ex(struct ubpf_vm* vm, char** errmsg, enum JitMode mode)
     jitted = mmap(0, jitted_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (jitted == MAP_FAILED) {
         *errmsg = ubpf_error("internal uBPF error: mmap failed: %s\n", strerror(errno));
+        jitted = NULL;
         goto out;
     }
 
     memcpy(jitted, buffer, jitted_size);
+#if defined(__riscv) || defined(__mips__)
+    // RISC-V and MIPS do not keep the instruction cache coherent with the stores that wrote
+    // the code.
+    __builtin___clear_cache((char*)jitted, (char*)jitted + jitted_size);
+#endif
 
     if (mprotect(jitted, jitted_size, PROT_READ | PROT_EXEC) < 0) {
         *errmsg = ubpf_error("internal uBPF error: mprotect failed: %s\n", strerror(errno));
         goto out;
     }
 
-    vm->jitted = jitted;
-    vm->jitted_size = jitted_size;
+    vm->jit_code = ubpf_create_jit_code(vm, mode, jitted, jitted_size);
+    if (vm->jit_code == NULL) {
+        *errmsg = ubpf_error("internal uBPF error: out of memory\n");
+        goto out;
+    }
+
+enter:
+    // The code is entered through the VM's entry stub, which passes it the VM's
+    // struct ubpf_jit_data.
+    UBPF_ATOMIC_STORE64(&vm->jit_data->code, (uintptr_t)vm->jit_code->code);
+    vm->jitted = (ubpf_jit_ex_fn)((uint8_t*)vm->jit_data - ubpf_page_size());
+    uint8_t entry[UBPF_JIT_ENTRY_MAX_SIZE];
+    vm->jitted_size = vm->jit_entry(entry, vm->jit_data, true) + vm->jit_code->size;
 
 out:
     free(buffer);
-    if (jitted && vm->jitted == NULL) {
+    if (jitted && vm->jit_code == NULL) {
         munmap(jitted, jitted_size);
     }
     return vm->jitted;
 }
 
+bool
+ubpf_jit_check_access(const struct ubpf_jit_data* jit_data, uint64_t addr, uint64_t size, uint32_t pc)
+{
+    if (jit_data->bounds_check_function != NULL &&
+        jit_data->bounds_check_function(jit_data->bounds_check_user_data, addr, size)) {
+        return true;
+    }
+    jit_data->error_printf(
+        stderr,
+        "uBPF error: out of bounds memory access at PC %u, addr %p, size %" PRIu64 "\n",
+        pc,
+        (void*)(uintptr_t)addr,
+        size);
+    return false;
+}
+
+void
+ubpf_jit_report_stop(
+    const struct ubpf_jit_data* jit_data,
+    enum ubpf_jit_stop_reason reason,
+    size_t minimum_context_size,
+    size_t stack_requirement)
+{
+    switch (reason) {
+    case UBPF_JIT_STOP_INSTRUCTION_LIMIT:
+        jit_data->error_printf(stderr, "Error: Instruction limit exceeded.\n");
+        break;
+    case UBPF_JIT_STOP_CALL_DEPTH:
+        jit_data->error_printf(
+            stderr, "uBPF error: number of nested functions calls exceeds max (%u)\n", (unsigned)UBPF_MAX_CALL_DEPTH);
+        break;
+    case UBPF_JIT_STOP_CONTEXT_SIZE:
+        jit_data->error_printf(
+            stderr,
+            "uBPF error: the program needs at least %zu bytes of memory and %zu bytes of stack\n",
+            minimum_context_size,
+            stack_requirement);
+        break;
+    }
+}
+
 ubpf_jit_fn
 ubpf_copy_jit(struct ubpf_vm* vm, void* buffer, size_t size, char** errmsg)
 {
@@ -186,6 +308,12 @@ ubpf_copy_jit(struct ubpf_vm* vm, void* buffer, size_t size, char** errmsg)
         return (ubpf_jit_fn)NULL;
     }
 
+    // The code is scattered over memory that LLVM manages.
+    if (vm->llvm_jit) {
+        *errmsg = ubpf_error("Cannot copy code JIT'd with LLVM");
+        return (ubpf_jit_fn)NULL;
+    }
+
     // If the given buffer is not big enough to contain the JIT'd code,
     // we cannot copy.
     if (vm->jitted_size > size) {
@@ -193,8 +321,10 @@ ubpf_copy_jit(struct ubpf_vm* vm, void* buffer, size_t size, char** errmsg)
         return (ubpf_jit_fn)NULL;
     }
 
-    // All good. Do the copy!
-    memcpy(buffer, vm->jitted, vm->jitted_size);
+    // All good. Do the copy! The copy starts with an entry stub of its own that
+    // passes the VM's struct ubpf_jit_data to the code that follows it.
+    size_t entry_size = vm->jit_entry(buffer, vm->jit_data, true);
+    memcpy((uint8_t*)buffer + entry_size, vm->jit_code->code, vm->jit_code->size);
     *errmsg = NULL;
     return (ubpf_jit_fn)buffer;
 }
@@ -25,6 +25,8 @@
 #include <stdint.h>
 #define _GNU_SOURCE
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -32,6 +34,18 @@
 #include "ubpf_int.h"
 #include "ubpf_jit_support.h"
 
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#elif defined(__aarch64__) && defined(__APPLE__)
+#include <sys/sysctl.h>
+#elif defined(_M_ARM64)
+#include <windows.h>
+#endif
+
+#if !defined(HWCAP_ATOMICS)
+#define HWCAP_ATOMICS (1 << 8)
+#endif
+
 #if !defined(_countof)
 #define _countof(array) (sizeof(array) / sizeof(array[0]))
 #endif
@@ -77,17 +91,29 @@ enum Registers
 };
 
 // Callee saved registers - this must be a multiple of two because of how we save the stack later on.
-static enum Registers callee_saved_registers[] = {R19, R20, R21, R22, R23, R24, R25, R26};
+static const enum Registers callee_saved_registers[] = {R19, R20, R21, R22, R23, R24, R25, R26, R27, R28};
 // Caller saved registers (and parameter registers)
 // static enum Registers caller_saved_registers[] = {R0, R1, R2, R3, R4};
 // Temp register for immediate generation
-static enum Registers temp_register = R24;
+static const enum Registers temp_register = R24;
 // Temp register for division results
-static enum Registers temp_div_register = R25;
+static const enum Registers temp_div_register = R25;
 // Temp register for load/store offsets
-static enum Registers offset_register = R26;
+static const enum Registers offset_register = R26;
 // Special register for external dispatcher context.
-static enum Registers VOLATILE_CTXT = R26;
+static const enum Registers VOLATILE_CTXT = R26;
+// The memory the program was started with and its length, for bounds checks.
+static const enum Registers mem_register = R27;
+static const enum Registers mem_len_register = R28;
+// Scratch registers for the run-time checks. They never hold a value from one eBPF
+// instruction to the next: R16 holds the address being checked (or the fuel left), R17
+// what is compared with it, R12 and R13 the bounds of the stack and R15 the link register
+// while the out-of-line bounds check is called.
+static const enum Registers check_address_register = R16;
+static const enum Registers check_temp_register = R17;
+static const enum Registers stack_start_register = R12;
+static const enum Registers stack_len_register = R13;
+static const enum Registers saved_link_register = R15;
 
 // Number of eBPF registers
 #define REGISTER_MAP_SIZE 11
@@ -100,11 +126,13 @@ static enum Registers VOLATILE_CTXT = R26;
 //              r24         Temp - used for generating 32-bit immediates
 //              r25         Temp - used for modulous calculations
 //              r26         Temp - used for large load/store offsets
+//              r27 - r28   The memory and its length, if bounds are checked
+//              r12 - r17   Scratch - used by bounds, instruction limit and call depth checks
 //
 // Note that the AArch64 ABI uses r0 both for function parameters and result.  We use r5 to hold
 // the result during the function and do an extra final move at the end of the function to copy the
 // result to the correct place.
-static enum Registers register_map[REGISTER_MAP_SIZE] = {
+static const enum Registers register_map[REGISTER_MAP_SIZE] = {
     R5, // result
     R0,
     R1,
@@ -252,6 +280,16 @@ enum LoadStoreExclusiveOpcode
     LSE_LDXRX = 0xc85f7c00U,  // 1100_1000_0101_1111_0111_1100_0000_0000
 };
 
+enum AtomicMemoryOpcode
+{
+    // sz     V A R  Rs o3 opc
+    AMO_LDADD = 0x38200000U, // 0011_1000_0010_0000_0000_0000_0000_0000
+    AMO_LDCLR = 0x38201000U, // 0011_1000_0010_0000_0001_0000_0000_0000
+    AMO_LDEOR = 0x38202000U, // 0011_1000_0010_0000_0010_0000_0000_0000
+    AMO_LDSET = 0x38203000U, // 0011_1000_0010_0000_0011_0000_0000_0000
+    AMO_SWP = 0x38208000U,   // 0011_1000_0010_0000_1000_0000_0000_0000
+};
+
 /* [ArmARM-A H.a]: C4.1.66: Load/store register (unscaled immediate).  */
 static void
 emit_loadstore_immediate(
@@ -272,21 +310,49 @@ emit_loadstore_exclusive(
     emit_instruction(state, op | (rs << 16) | (rn << 5) | rt);
 }
 
+/* [ArmARM-A H.a]: C4.1.68: Atomic memory operations (ARMv8.1 LSE).
+ * Rt receives the old value (RZ to discard it). With acquire_release, the AL
+ * variant (e.g., LDADDAL) is emitted.
+ */
 static void
-emit_loadstore_literal(
-    struct jit_state* state, enum LoadStoreOpcode op, enum Registers rt, struct PatchableTarget target)
+emit_atomic_memory_operation(
+    struct jit_state* state,
+    bool sixty_four,
+    enum AtomicMemoryOpcode op,
+    bool acquire_release,
+    enum Registers rs,
+    enum Registers rt,
+    enum Registers rn)
 {
-    note_load(state, target);
-    const uint32_t reg_op_base = 0x08000000U;
-    emit_instruction(state, op | reg_op_base | rt);
+    uint32_t size = sixty_four ? 0xc0000000U : 0x80000000U;
+    uint32_t ordering = acquire_release ? 0x00c00000U : 0;
+    emit_instruction(state, size | op | ordering | (rs << 16) | (rn << 5) | rt);
 }
 
+/* [ArmARM-A H.a]: C6.2.41: CASAL (ARMv8.1 LSE). Compares the value at [rn] with rs,
+ * stores rt if they are equal and always loads the old value into rs.
+ */
 static void
-emit_adr(struct jit_state* state, struct PatchableTarget target, enum Registers rd)
+emit_compare_and_swap(
+    struct jit_state* state, bool sixty_four, enum Registers rs, enum Registers rt, enum Registers rn)
 {
-    note_lea(state, target);
-    uint32_t instr = 0x10000000 | rd;
-    emit_instruction(state, instr);
+    const uint32_t casal_op_base = 0x08e0fc00U;
+    uint32_t size = sixty_four ? 0xc0000000U : 0x80000000U;
+    emit_instruction(state, size | casal_op_base | (rs << 16) | (rn << 5) | rt);
+}
+
+/* [ArmARM-A H.a]: C4.1.66: Load/store register (unsigned immediate).  */
+static void
+emit_loadstore_unsigned_immediate(
+    struct jit_state* state, enum LoadStoreOpcode op, enum Registers rt, enum Registers rn, uint32_t imm)
+{
+    const uint32_t imm_op_base = 0x39000000U;
+    // The immediate is scaled by the size of the access (encoded in bits 30-31).
+    uint32_t scale = op >> 30;
+    assert((imm & ((1U << scale) - 1)) == 0);
+    imm >>= scale;
+    assert(imm < 0x1000);
+    emit_instruction(state, imm_op_base | op | (imm << 10) | (rn << 5) | rt);
 }
 
 enum LoadStorePairOpcode
@@ -341,6 +407,94 @@ emit_logical_register(
     emit_instruction(state, sz(sixty_four) | op | (1 << 27) | (1 << 25) | (rm << 16) | (rn << 5) | rd);
 }
 
+/*
+ * Find the N:immr:imms encoding of imm as a logical (bitmask) immediate.
+ * Such an immediate is a 2-, 4-, 8-, 16-, 32- or 64-bit element, holding a
+ * single rotated run of ones, that is replicated across the register. 0 and
+ * all ones cannot be encoded. Returns false if imm is not a bitmask immediate.
+ */
+static bool
+encode_logical_immediate(bool sixty_four, uint64_t imm, uint32_t* encoding)
+{
+    uint64_t register_mask = sixty_four ? UINT64_MAX : UINT32_MAX;
+    imm &= register_mask;
+    if (imm == 0 || imm == register_mask) {
+        return false;
+    }
+
+    /* Find the smallest element that imm is a replication of. */
+    unsigned size = sixty_four ? 64 : 32;
+    while (size > 2) {
+        uint64_t half_mask = (UINT64_C(1) << (size / 2)) - 1;
+        if ((imm & half_mask) != ((imm >> (size / 2)) & half_mask)) {
+            break;
+        }
+        size /= 2;
+    }
+    uint64_t element_mask = size == 64 ? UINT64_MAX : (UINT64_C(1) << size) - 1;
+    uint64_t element = imm & element_mask;
+
+    /* Find the rotation that turns the element into a run of ones starting at bit 0. */
+    for (unsigned rotation = 0; rotation < size; rotation++) {
+        uint64_t rotated = element;
+        if (rotation != 0) {
+            rotated = ((element >> rotation) | (element << (size - rotation))) & element_mask;
+        }
+        if ((rotated & (rotated + 1)) != 0) {
+            continue;
+        }
+        unsigned ones = 0;
+        while (rotated & (UINT64_C(1) << ones)) {
+            ones++;
+        }
+        uint32_t n = size == 64 ? 1 : 0;
+        uint32_t immr = (size - rotation) % size;
+        uint32_t imms = ((~(size - 1) << 1) & 0x3f) | (ones - 1);
+        *encoding = (n << 12) | (immr << 6) | imms;
+        return true;
+    }
+    return false;
+}
+
+/* [ArmARM-A H.a]: C4.1.64: Logical (immediate).
+ * Only the opcodes without the N bit (AND, ORR, EOR and ANDS) have an immediate form.
+ * The encoding comes from encode_logical_immediate.
+ */
+static void
+emit_logical_immediate(
+    struct jit_state* state,
+    bool sixty_four,
+    enum LogicalOpcode op,
+    enum Registers rd,
+    enum Registers rn,
+    uint32_t encoding)
+{
+    assert(op == LOG_AND || op == LOG_ORR || op == LOG_EOR || op == LOG_ANDS);
+    emit_instruction(state, sz(sixty_four) | op | 0x12000000U | (encoding << 10) | (rn << 5) | rd);
+}
+
+enum BitfieldOpcode
+{
+    //         opc
+    BF_SBFM = 0x13000000U, // 0001_0011_0000_0000_0000_0000_0000_0000
+    BF_UBFM = 0x53000000U, // 0101_0011_0000_0000_0000_0000_0000_0000
+};
+
+/* [ArmARM-A H.a]: C4.1.64: Bitfield.  */
+static void
+emit_bitfield(
+    struct jit_state* state,
+    bool sixty_four,
+    enum BitfieldOpcode op,
+    enum Registers rd,
+    enum Registers rn,
+    uint32_t immr,
+    uint32_t imms)
+{
+    uint32_t n = sixty_four ? (UINT32_C(1) << 22) : 0;
+    emit_instruction(state, sz(sixty_four) | op | n | (immr << 16) | (imms << 10) | (rn << 5) | rd);
+}
+
 enum UnconditionalBranchOpcode
 {
     //         opc-|op2--|op3----|        op4|
@@ -363,20 +517,35 @@ enum UnconditionalBranchImmediateOpcode
     UBR_BL = 0x94000000U, // 1001_0100_0000_0000_0000_0000_0000_0000
 };
 
+/* Note a jump (or a call of special code) at the current offset, to be patched by resolve_jumps. */
+static void
+note_jump(struct jit_state* state, struct PatchableTarget target)
+{
+    if (state->num_jumps == UBPF_JIT_MAX_JUMPS) {
+        state->jit_status = TooManyJumps;
+        return;
+    }
+    emit_patchable_relative(state->jumps, state->offset, target, state->num_jumps++);
+}
+
+/* Whether the next jump noted is to be emitted in its long form (see far_jumps in struct jit_state). */
+static bool
+next_jump_is_far(const struct jit_state* state)
+{
+    return state->far_jumps != NULL && state->num_jumps < UBPF_JIT_MAX_JUMPS && state->far_jumps[state->num_jumps];
+}
+
 /* [ArmARM-A H.a]: C4.1.65: Unconditional branch (immediate).  */
 static uint32_t
 emit_unconditionalbranch_immediate(
     struct jit_state* state, enum UnconditionalBranchImmediateOpcode op, struct PatchableTarget target)
 {
     uint32_t source_offset = state->offset;
-    struct patchable_relative* table = state->jumps;
-    int* num_jumps = &state->num_jumps;
     if (op == UBR_BL && !target.is_special) {
-        table = state->local_calls;
-        num_jumps = &state->num_local_calls;
+        emit_patchable_relative(state->local_calls, state->offset, target, state->num_local_calls++);
+    } else {
+        note_jump(state, target);
     }
-
-    emit_patchable_relative(table, state->offset, target, (*num_jumps)++);
     emit_instruction(state, op);
 
     return source_offset;
@@ -409,12 +578,24 @@ enum ConditionalBranchImmediateOpcode
     BR_Bcond = 0x54000000U
 };
 
-/* [ArmARM-A H.a]: C4.1.65: Conditional branch (immediate).  */
+/* The offset field of a short branch (B.cond, CBZ/CBNZ or TBZ/TBNZ) that skips the
+ * unconditional branch after it: the long form of a jump whose target is out of reach.
+ */
+#define SKIP_NEXT_INSTRUCTION (2 << 5)
+
+/* [ArmARM-A H.a]: C4.1.65: Conditional branch (immediate).
+ * Note: The target has to be within +/-1MB; a jump that is not is emitted in its long form.
+ */
 static uint32_t
 emit_conditionalbranch_immediate(struct jit_state* state, enum Condition cond, struct PatchableTarget target)
 {
+    assert(cond < COND_AL);
+    if (next_jump_is_far(state)) {
+        emit_instruction(state, BR_Bcond | SKIP_NEXT_INSTRUCTION | (cond ^ 1));
+        return emit_unconditionalbranch_immediate(state, UBR_B, target);
+    }
     uint32_t source_offset = state->offset;
-    emit_patchable_relative(state->jumps, state->offset, target, state->num_jumps++);
+    note_jump(state, target);
     emit_instruction(state, BR_Bcond | (0 << 5) | cond);
     return source_offset;
 }
@@ -426,6 +607,68 @@ enum CompareBranchOpcode
     CBR_CBNZ = 0x35000000U, // 0011_0101_0000_0000_0000_0000_0000_0000
 };
 
+/* [ArmARM-A H.a]: C4.1.65: Compare and branch (immediate).
+ * Note: The target has to be within +/-1MB; a jump that is not is emitted in its long form.
+ */
+static uint32_t
+emit_compareandbranch_immediate(
+    struct jit_state* state, bool sixty_four, enum CompareBranchOpcode op, enum Registers rt, struct PatchableTarget target)
+{
+    if (next_jump_is_far(state)) {
+        enum CompareBranchOpcode inverse = op == CBR_CBZ ? CBR_CBNZ : CBR_CBZ;
+        emit_instruction(state, sz(sixty_four) | inverse | SKIP_NEXT_INSTRUCTION | rt);
+        return emit_unconditionalbranch_immediate(state, UBR_B, target);
+    }
+    uint32_t source_offset = state->offset;
+    note_jump(state, target);
+    emit_instruction(state, sz(sixty_four) | op | rt);
+    return source_offset;
+}
+
+enum TestBranchOpcode
+{
+    //          o
+    TBR_TBZ = 0x36000000U,  // 0011_0110_0000_0000_0000_0000_0000_0000
+    TBR_TBNZ = 0x37000000U, // 0011_0111_0000_0000_0000_0000_0000_0000
+};
+
+/* [ArmARM-A H.a]: C4.1.65: Test and branch (immediate).
+ * Note: The target has to be within +/-32KB; a jump that is not is emitted in its long form.
+ */
+static uint32_t
+emit_testandbranch_immediate(
+    struct jit_state* state, enum TestBranchOpcode op, enum Registers rt, uint32_t bit, struct PatchableTarget target)
+{
+    uint32_t test = ((bit >> 5) << 31) | ((bit & 0x1f) << 19) | rt;
+    if (next_jump_is_far(state)) {
+        enum TestBranchOpcode inverse = op == TBR_TBZ ? TBR_TBNZ : TBR_TBZ;
+        emit_instruction(state, test | inverse | SKIP_NEXT_INSTRUCTION);
+        return emit_unconditionalbranch_immediate(state, UBR_B, target);
+    }
+    uint32_t source_offset = state->offset;
+    note_jump(state, target);
+    emit_instruction(state, test | op);
+    return source_offset;
+}
+
+/* [ArmARM-A H.a]: C4.1.67: Conditional select.  */
+static void
+emit_conditionalselect(
+    struct jit_state* state, bool sixty_four, enum Condition cond, enum Registers rd, enum Registers rn, enum Registers rm)
+{
+    emit_instruction(state, sz(sixty_four) | 0x1a800000U | (rm << 16) | (cond << 12) | (rn << 5) | rd);
+}
+
+/* [ArmARM-A H.a]: C4.1.67: Conditional compare (register).
+ * CMP rn, rm if cond holds; otherwise, set the flags to nzcv.
+ */
+static void
+emit_conditionalcompare_register(
+    struct jit_state* state, bool sixty_four, enum Registers rn, enum Registers rm, uint32_t nzcv, enum Condition cond)
+{
+    emit_instruction(state, sz(sixty_four) | 0x7a400000U | (rm << 16) | (cond << 12) | (rn << 5) | nzcv);
+}
+
 enum DP1Opcode
 {
     //   S          op2--|op-----|
@@ -466,6 +709,31 @@ emit_dataprocessing_twosource(
     emit_instruction(state, sz(sixty_four) | op | (rm << 16) | (rn << 5) | rd);
 }
 
+/* Shift rn by a constant amount. LSL, LSR and ASR (immediate) are aliases of UBFM and SBFM.
+ * Like the register forms, the amount is taken modulo the register size.
+ */
+static void
+emit_shift_immediate(
+    struct jit_state* state, bool sixty_four, enum DP2Opcode op, enum Registers rd, enum Registers rn, uint32_t shift)
+{
+    uint32_t size = sixty_four ? 64 : 32;
+    shift &= size - 1;
+    switch (op) {
+    case DP2_LSLV:
+        emit_bitfield(state, sixty_four, BF_UBFM, rd, rn, (size - shift) & (size - 1), size - 1 - shift);
+        break;
+    case DP2_LSRV:
+        emit_bitfield(state, sixty_four, BF_UBFM, rd, rn, shift, size - 1);
+        break;
+    case DP2_ASRV:
+        emit_bitfield(state, sixty_four, BF_SBFM, rd, rn, shift, size - 1);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
 enum DP3Opcode
 {
     //  54       31|       0
@@ -503,19 +771,30 @@ emit_movewide_immediate(struct jit_state* state, bool sixty_four, enum Registers
      * See whether the 0x0000 or 0xffff pattern is more common in the immediate.  This ensures we
      * produce the fewest number of immediates.
      */
-    unsigned count0000 = sixty_four ? 0 : 2;
+    unsigned blocks = sixty_four ? 4 : 2;
+    unsigned count0000 = 0;
     unsigned countffff = 0;
-    for (unsigned i = 0; i < (sixty_four ? 64 : 32); i += 16) {
-        uint64_t block = (imm >> i) & 0xffff;
+    for (unsigned i = 0; i < blocks; ++i) {
+        uint64_t block = (imm >> (i * 16)) & 0xffff;
         if (block == 0xffff) {
             ++countffff;
         } else if (block == 0) {
             ++count0000;
         }
     }
+    bool invert = (count0000 < countffff);
+
+    /* When that takes more than one instruction, a bitmask immediate (e.g., 0x00ff00ff00ff00ff)
+     * may still be loaded with a single ORR from the zero register.
+     */
+    unsigned needed = blocks - (invert ? countffff : count0000);
+    uint32_t encoding;
+    if (needed > 1 && encode_logical_immediate(sixty_four, imm, &encoding)) {
+        emit_logical_immediate(state, sixty_four, LOG_ORR, rd, RZ, encoding);
+        return;
+    }
 
     /* Iterate over 16-bit elements of imm, outputting an appropriate move instruction.  */
-    bool invert = (count0000 < countffff);
     enum MoveWideOpcode op = invert ? MW_MOVN : MW_MOVZ;
     uint64_t skip_pattern = invert ? 0xffff : 0;
     for (unsigned i = 0; i < (sixty_four ? 4 : 2); ++i) {
@@ -573,42 +852,241 @@ emit_movewide_immediate_blinded(struct jit_state* state, bool sixty_four, enum R
         } \
     } while (0)
 
+/*
+ * Whether the JIT'd code checks the bounds of memory accesses (see emit_bounds_check)
+ * or counts the instructions it executes (see emit_instruction_limit_charge).
+ */
+static bool
+has_runtime_checks(const struct ubpf_vm* vm)
+{
+    return vm->bounds_check_enabled || ubpf_counts_instructions(vm);
+}
+
+/*
+ * The prologue keeps the address of the VM's struct ubpf_jit_data, which the entry
+ * stub (see ubpf_jit_entry_arm64) passes in R9, at this offset from the frame pointer
+ * (R29), below the callee-saved registers. With run-time checks, the fuel left and the
+ * start and the length of the stack follow it.
+ */
+#define FRAME_JIT_DATA_OFFSET 0
+#define RUNTIME_CHECK_FUEL_OFFSET 8
+#define RUNTIME_CHECK_STACK_BOUNDS_OFFSET 16
+#define RUNTIME_CHECK_AREA_SIZE 32
+
+// The register in which the entry stub passes the address of the struct ubpf_jit_data.
+static const enum Registers jit_data_register = R9;
+
+/* The size of the area below the callee-saved registers. */
+static uint32_t
+frame_area_size(const struct ubpf_vm* vm)
+{
+    return has_runtime_checks(vm) ? RUNTIME_CHECK_AREA_SIZE : 8;
+}
+
+/*
+ * Select the callee-saved registers that the prologue has to save and the
+ * epilogue has to restore: the temporaries, which every program may use, the
+ * registers that hold the memory bounds if bounds are checked and those that
+ * are mapped to an eBPF register the program uses (see compute_used_registers).
+ * Returns the number written to saved_registers.
+ */
+static unsigned
+select_saved_registers(const struct ubpf_vm* vm, uint16_t used_registers, enum Registers* saved_registers)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < _countof(callee_saved_registers); i++) {
+        enum Registers reg = callee_saved_registers[i];
+        bool used = reg == temp_register || reg == temp_div_register || reg == offset_register ||
+                    (vm->bounds_check_enabled && (reg == mem_register || reg == mem_len_register));
+        for (int r = 0; r < _BPF_REG_MAX && !used; r++) {
+            used = (used_registers & (1 << r)) && map_register(r) == reg;
+        }
+        if (used) {
+            saved_registers[count++] = reg;
+        }
+    }
+    return count;
+}
+
+/* Store (or load) the given registers in pairs from SP + offset upwards. An odd
+ * register out gets a slot of its own.
+ */
+static void
+emit_saved_registers(
+    struct jit_state* state, const enum Registers* registers, unsigned count, uint32_t offset, bool store)
+{
+    unsigned i;
+    for (i = 0; i + 1 < count; i += 2) {
+        emit_loadstorepair_immediate(
+            state, store ? LSP_STPX : LSP_LDPX, registers[i], registers[i + 1], SP, offset + i * 8);
+    }
+    if (i < count) {
+        emit_loadstore_immediate(state, store ? LS_STRX : LS_LDRX, registers[i], SP, offset + i * 8);
+    }
+}
+
+/* Emit the out-of-line code of the run-time checks (before the entry point).
+ *
+ * At bounds_check_loc, the check of an access that is neither in the memory nor in the
+ * stack (see emit_bounds_check). It is called with the address in R16, (pc << 8) | size
+ * in R17 and the link register of the caller in R15 and asks ubpf_jit_check_access,
+ * preserving the argument and result registers. It returns if the access is allowed.
+ *
+ * At instruction_limit_loc, call_depth_loc and context_size_loc, the code that reports
+ * why the program is stopped.
+ *
+ * A program that is stopped returns UINT64_MAX (the interpreter fails with -1).
+ */
+static void
+emit_runtime_check_stubs(struct jit_state* state, struct ubpf_vm* vm)
+{
+    DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit);
+    DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(default_tgt, 0);
+    uint32_t byte_mask = 0;
+    encode_logical_immediate(true, 0xff, &byte_mask);
+
+    uint32_t access_denied_jump_source = 0;
+    if (vm->bounds_check_enabled) {
+        state->bounds_check_loc = state->offset;
+        emit_addsub_immediate(state, true, AS_SUB, SP, SP, 64);
+        emit_loadstorepair_immediate(state, LSP_STPX, R0, R1, SP, 0);
+        emit_loadstorepair_immediate(state, LSP_STPX, R2, R3, SP, 16);
+        emit_loadstorepair_immediate(state, LSP_STPX, R4, R5, SP, 32);
+        emit_loadstorepair_immediate(state, LSP_STPX, saved_link_register, R30, SP, 48);
+
+        emit_loadstore_immediate(state, LS_LDRX, R0, R29, FRAME_JIT_DATA_OFFSET);
+        emit_logical_register(state, true, LOG_ORR, R1, RZ, check_address_register);
+        emit_logical_immediate(state, true, LOG_AND, R2, check_temp_register, byte_mask);
+        emit_shift_immediate(state, true, DP2_LSRV, R3, check_temp_register, 8);
+        emit_movewide_immediate(state, true, R8, (uint64_t)(uintptr_t)ubpf_jit_check_access);
+        emit_unconditionalbranch_register(state, BR_BLR, R8);
+        // Only the low byte of a returned bool is defined.
+        emit_logical_immediate(state, true, LOG_AND, check_address_register, R0, byte_mask);
+
+        emit_loadstorepair_immediate(state, LSP_LDPX, saved_link_register, R30, SP, 48);
+        emit_loadstorepair_immediate(state, LSP_LDPX, R4, R5, SP, 32);
+        emit_loadstorepair_immediate(state, LSP_LDPX, R2, R3, SP, 16);
+        emit_loadstorepair_immediate(state, LSP_LDPX, R0, R1, SP, 0);
+        emit_addsub_immediate(state, true, AS_ADD, SP, SP, 64);
+        access_denied_jump_source =
+            emit_compareandbranch_immediate(state, false, CBR_CBZ, check_address_register, default_tgt);
+        emit_unconditionalbranch_register(state, BR_RET, R30);
+    }
+
+    state->instruction_limit_loc = state->offset;
+    emit_movewide_immediate(state, false, R1, UBPF_JIT_STOP_INSTRUCTION_LIMIT);
+    uint32_t report_jump_source = emit_unconditionalbranch_immediate(state, UBR_B, default_tgt);
+
+    state->call_depth_loc = state->offset;
+    emit_movewide_immediate(state, false, R1, UBPF_JIT_STOP_CALL_DEPTH);
+    uint32_t call_depth_jump_source = emit_unconditionalbranch_immediate(state, UBR_B, default_tgt);
+
+    state->context_size_loc = state->offset;
+    emit_movewide_immediate(state, false, R1, UBPF_JIT_STOP_CONTEXT_SIZE);
+
+    emit_jump_target(state, report_jump_source);
+    emit_jump_target(state, call_depth_jump_source);
+    emit_loadstore_immediate(state, LS_LDRX, R0, R29, FRAME_JIT_DATA_OFFSET);
+    emit_movewide_immediate(state, true, R2, vm->minimum_context_size);
+    emit_movewide_immediate(state, true, R3, vm->stack_requirement);
+    emit_movewide_immediate(state, true, R8, (uint64_t)(uintptr_t)ubpf_jit_report_stop);
+    emit_unconditionalbranch_register(state, BR_BLR, R8);
+
+    // ubpf_jit_check_access has already reported an access it does not allow.
+    if (vm->bounds_check_enabled) {
+        emit_jump_target(state, access_denied_jump_source);
+    }
+    emit_movewide_immediate(state, true, map_register(0), UINT64_MAX);
+    emit_unconditionalbranch_immediate(state, UBR_B, exit_tgt);
+}
+
+/*
+ * Stop the program if it is given less memory (or stack) than the range verifier assumed
+ * when it proved the accesses that emit_bounds_check leaves unchecked (see
+ * ubpf_check_context_size). The memory and its length are in mem_register and
+ * mem_len_register and, in ExtendedJitMode, the length of the stack is in R3.
+ */
+static void
+emit_context_size_check(struct jit_state* state, struct ubpf_vm* vm)
+{
+    DECLARE_PATCHABLE_SPECIAL_TARGET(context_size_tgt, ContextSize);
+    if (vm->minimum_context_size != 0) {
+        emit_compareandbranch_immediate(state, true, CBR_CBZ, mem_register, context_size_tgt);
+        emit_movewide_immediate(state, true, check_temp_register, vm->minimum_context_size);
+        emit_addsub_register(state, true, AS_SUBS, RZ, mem_len_register, check_temp_register);
+        emit_conditionalbranch_immediate(state, COND_LO, context_size_tgt);
+    }
+    if (state->jit_mode == ExtendedJitMode && vm->stack_requirement != 0) {
+        emit_movewide_immediate(state, true, check_temp_register, vm->stack_requirement);
+        emit_addsub_register(state, true, AS_SUBS, RZ, R3, check_temp_register);
+        emit_conditionalbranch_immediate(state, COND_LO, context_size_tgt);
+    }
+}
+
 /* Generate the function prologue.
  *
  * We set the stack to look like:
- *   ubpf_stack_size bytes of UBPF stack
+ *   ubpf_stack_size bytes of UBPF stack (none if the program never uses r10)
  *   SP on entry
  *   SP on entry
- *   Callee saved registers
+ *   Callee saved registers (only those the program uses, see select_saved_registers)
+ *   Stack bounds and fuel (only with run-time checks, see has_runtime_checks)
+ *   Address of the struct ubpf_jit_data
  *   Frame <- SP.
  * Precondition: The runtime stack pointer is 16-byte aligned.
  * Postcondition:  The runtime stack pointer is 16-byte aligned.
  */
 static void
-emit_jit_prologue(struct jit_state* state, size_t ubpf_stack_size)
+emit_jit_prologue(struct jit_state* state, struct ubpf_vm* vm, uint16_t used_registers)
 {
+    size_t ubpf_stack_size = vm->stack_requirement;
+    enum Registers saved_registers[_countof(callee_saved_registers)];
+    unsigned num_saved_registers = select_saved_registers(vm, used_registers, saved_registers);
+    uint32_t area_size = frame_area_size(vm);
+
     emit_addsub_immediate(state, true, AS_SUB, SP, SP, 16);
     emit_loadstorepair_immediate(state, LSP_STPX, R29, R30, SP, 0);
 
-    state->stack_size = _countof(callee_saved_registers) * 8;
+    state->stack_size = align_to(area_size + num_saved_registers * 8, 16);
     emit_addsub_immediate(state, true, AS_SUB, SP, SP, state->stack_size);
     /* Save callee saved registers */
-    unsigned i;
-    for (i = 0; i < _countof(callee_saved_registers); i += 2) {
-        emit_loadstorepair_immediate(
-            state, LSP_STPX, callee_saved_registers[i], callee_saved_registers[i + 1], SP, (i) * 8);
-    }
+    emit_saved_registers(state, saved_registers, num_saved_registers, area_size, true);
     emit_addsub_immediate(state, true, AS_ADD, R29, SP, 0);
+    emit_loadstore_immediate(state, LS_STRX, jit_data_register, R29, FRAME_JIT_DATA_OFFSET);
 
     if (state->jit_mode == BasicJitMode) {
         /* Setup UBPF frame pointer. */
-        emit_addsub_immediate(state, true, AS_ADD, map_register(10), SP, 0);
-        emit_addsub_immediate(state, true, AS_SUB, SP, SP, ubpf_stack_size);
-    } else {
+        if (used_registers & (1 << BPF_REG_10)) {
+            emit_addsub_immediate(state, true, AS_ADD, map_register(10), SP, 0);
+        }
+        if (ubpf_stack_size) {
+            emit_addsub_immediate(state, true, AS_SUB, SP, SP, ubpf_stack_size);
+        }
+    } else if (used_registers & (1 << BPF_REG_10)) {
         emit_addsub_immediate(state, true, AS_ADD, map_register(10), R2, 0);
         emit_addsub_register(state, true, AS_ADD, map_register(10), map_register(10), R3);
     }
 
+    if (vm->bounds_check_enabled) {
+        emit_logical_register(state, true, LOG_ORR, mem_register, RZ, R0);
+        emit_logical_register(state, true, LOG_ORR, mem_len_register, RZ, R1);
+        if (state->jit_mode == BasicJitMode) {
+            emit_addsub_immediate(state, true, AS_ADD, stack_start_register, SP, 0);
+            emit_movewide_immediate(state, true, stack_len_register, ubpf_stack_size);
+            emit_loadstorepair_immediate(
+                state, LSP_STPX, stack_start_register, stack_len_register, R29, RUNTIME_CHECK_STACK_BOUNDS_OFFSET);
+        } else {
+            emit_loadstorepair_immediate(state, LSP_STPX, R2, R3, R29, RUNTIME_CHECK_STACK_BOUNDS_OFFSET);
+        }
+    }
+    if (ubpf_counts_instructions(vm)) {
+        emit_movewide_immediate(state, true, check_address_register, (uint32_t)vm->instruction_limit);
+        emit_loadstore_immediate(state, LS_STRX, check_address_register, R29, RUNTIME_CHECK_FUEL_OFFSET);
+    }
+    if (vm->bounds_check_enabled && vm->proven_accesses != NULL) {
+        emit_context_size_check(state, vm);
+    }
+
     /* Copy R0 to the volatile context for safe keeping. */
     emit_logical_register(state, true, LOG_ORR, VOLATILE_CTXT, RZ, R0);
 
@@ -616,12 +1094,18 @@ emit_jit_prologue(struct jit_state* state, size_t ubpf_stack_size)
     DECLARE_PATCHABLE_SPECIAL_TARGET(enter_tgt, Enter);
     emit_unconditionalbranch_immediate(state, UBR_BL, enter_tgt);
     emit_unconditionalbranch_immediate(state, UBR_B, exit_tgt);
+    if (has_runtime_checks(vm)) {
+        emit_runtime_check_stubs(state, vm);
+    }
     state->entry_loc = state->offset;
 }
 
 static void
-emit_jit_epilogue(struct jit_state* state)
+emit_jit_epilogue(struct jit_state* state, struct ubpf_vm* vm, uint16_t used_registers)
 {
+    enum Registers saved_registers[_countof(callee_saved_registers)];
+    unsigned num_saved_registers = select_saved_registers(vm, used_registers, saved_registers);
+
     state->exit_loc = state->offset;
 
     /* Move register 0 into R0 */
@@ -633,11 +1117,7 @@ emit_jit_epilogue(struct jit_state* state)
     emit_addsub_immediate(state, true, AS_ADD, SP, R29, 0);
 
     /* Restore callee-saved registers).  */
-    size_t i;
-    for (i = 0; i < _countof(callee_saved_registers); i += 2) {
-        emit_loadstorepair_immediate(
-            state, LSP_LDPX, callee_saved_registers[i], callee_saved_registers[i + 1], SP, (i) * 8);
-    }
+    emit_saved_registers(state, saved_registers, num_saved_registers, frame_area_size(vm), false);
     emit_addsub_immediate(state, true, AS_ADD, SP, SP, state->stack_size);
 
     emit_loadstorepair_immediate(state, LSP_LDPX, R29, R30, SP, 0);
@@ -662,9 +1142,11 @@ emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm
     emit_loadstore_immediate(state, LS_STRX, R30, SP, 0);
 
     // Determine whether to call it through a dispatcher or by index and then load up the address
-    // of that function.
-    DECLARE_PATCHABLE_SPECIAL_TARGET(external_dispatcher_pt, ExternalDispatcher);
-    emit_loadstore_literal(state, LS_LDRL, temp_register, external_dispatcher_pt);
+    // of that function. Both live in the VM's struct ubpf_jit_data, whose address the prologue
+    // keeps in the frame.
+    emit_loadstore_immediate(state, LS_LDRX, R6, R29, FRAME_JIT_DATA_OFFSET);
+    emit_loadstore_unsigned_immediate(
+        state, LS_LDRX, temp_register, R6, offsetof(struct ubpf_jit_data, dispatcher));
 
     // Check whether temp_register is empty.
     emit_addsub_immediate(state, true, AS_SUBS, temp_register, temp_register, 0);
@@ -674,15 +1156,13 @@ emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm
     uint32_t external_dispatcher_jump_source = emit_conditionalbranch_immediate(state, COND_NE, default_tgt);
 
     // We are not ready to roll. In other words, we are going to load the helper function address by index.
-    EMIT_MOVEWIDE_IMMEDIATE(vm, state, true, R5, idx);
-    emit_movewide_immediate(state, true, R6, 3);
-    emit_dataprocessing_twosource(state, true, DP2_LSLV, R5, R5, R6);
-
-    emit_movewide_immediate(state, true, temp_register, 0);
-    DECLARE_PATCHABLE_SPECIAL_TARGET(load_helper_tgt, LoadHelperTable);
-    emit_adr(state, load_helper_tgt, temp_register);
-    emit_addsub_register(state, true, AS_ADD, temp_register, temp_register, R5);
-    emit_loadstore_immediate(state, LS_LDRX, temp_register, temp_register, 0);
+    // Validation guarantees that idx names a registered helper when there is no external dispatcher.
+    emit_loadstore_unsigned_immediate(
+        state,
+        LS_LDRX,
+        temp_register,
+        R6,
+        offsetof(struct ubpf_jit_data, helpers) + (idx % MAX_EXT_FUNCS) * sizeof(extended_external_helper_t));
 
     // Add the implicit 6th parameter (the context)
     emit_logical_register(state, true, LOG_ORR, R5, RZ, VOLATILE_CTXT);
@@ -721,9 +1201,23 @@ emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm
     emit_addsub_immediate(state, true, AS_ADD, SP, SP, stack_movement);
 }
 
+/* Call the local function at target_pc. With bounds checks, stop the program instead if
+ * the call would nest deeper than UBPF_MAX_CALL_DEPTH (like the interpreter): every call
+ * takes 64 bytes of the native stack (the registers it saves and the callee's prolog).
+ */
 static void
-emit_local_call(struct jit_state* state, uint32_t target_pc)
-{
+emit_local_call(struct jit_state* state, struct ubpf_vm* vm, uint32_t target_pc)
+{
+    if (vm->bounds_check_enabled) {
+        DECLARE_PATCHABLE_SPECIAL_TARGET(call_depth_tgt, CallDepth);
+        uint64_t stack_size = state->jit_mode == BasicJitMode ? vm->stack_requirement : 0;
+        emit_addsub_immediate(state, true, AS_ADD, check_address_register, SP, 0);
+        emit_addsub_register(state, true, AS_SUB, check_address_register, R29, check_address_register);
+        emit_movewide_immediate(state, true, check_temp_register, stack_size + 16 + 64 * UBPF_MAX_CALL_DEPTH);
+        emit_addsub_register(state, true, AS_SUBS, RZ, check_address_register, check_temp_register);
+        emit_conditionalbranch_immediate(state, COND_HS, call_depth_tgt);
+    }
+
     emit_loadstore_immediate(state, LS_LDRX, temp_register, SP, 0);
     emit_addsub_register(state, true, AS_SUB, map_register(10), map_register(10), temp_register);
 
@@ -748,29 +1242,34 @@ emit_local_call(struct jit_state* state, uint32_t target_pc)
     emit_addsub_register(state, true, AS_ADD, map_register(10), map_register(10), temp_register);
 }
 
-/* Helper for emitting atomic operations using LDXR/STXR loop */
+bool
+ubpf_arm64_lse_atomics_supported(void)
+{
+#if defined(__aarch64__) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_ATOMICS) != 0;
+#elif defined(__aarch64__) && defined(__APPLE__)
+    int lse = 0;
+    size_t size = sizeof(lse);
+    return sysctlbyname("hw.optional.arm.FEAT_LSE", &lse, &size, NULL, 0) == 0 && lse;
+#elif defined(_M_ARM64)
+    return IsProcessorFeaturePresent(PF_ARM_V81_ATOMIC_INSTRUCTIONS_AVAILABLE);
+#else
+    return false;
+#endif
+}
+
+/* Compute the target address of an atomic operation (addr_reg + offset) into addr_temp.
+ * offset_temp is clobbered if the offset does not fit in an immediate.
+ */
 static void
-emit_atomic_operation(
+emit_atomic_address(
     struct jit_state* state,
     struct ubpf_vm* vm,
-    bool is_64bit,
-    enum Registers value_reg,
     enum Registers addr_reg,
-    enum Registers result_reg,
-    enum Registers temp_reg,
-    enum Registers status_reg,
     int16_t offset,
-    uint8_t alu_op,
-    bool is_cmpxchg,
-    bool is_xchg,
-    bool fetch)
+    enum Registers addr_temp,
+    enum Registers offset_temp)
 {
-    // Save the target address (addr_reg + offset) into a temporary register.
-    // Ensure that the base address register used for LDXR/STXR never aliases
-    // the status register used by STXR.
-    enum Registers addr_temp =
-        (status_reg == temp_div_register) ? offset_register : temp_div_register;
-    
     if (offset != 0) {
         // Use int32_t to avoid undefined behavior when negating INT16_MIN
         int32_t abs_offset = offset;
@@ -784,9 +1283,6 @@ emit_atomic_operation(
         if (abs_offset < 256) {
             emit_addsub_immediate(state, true, op, addr_temp, addr_reg, (int16_t)abs_offset);
         } else {
-            // Choose a scratch register for the offset that is distinct from addr_temp.
-            enum Registers offset_temp =
-                (addr_temp == offset_register) ? temp_div_register : offset_register;
             EMIT_MOVEWIDE_IMMEDIATE(vm, state, true, offset_temp, offset);
             emit_addsub_register(state, true, AS_ADD, addr_temp, addr_reg, offset_temp);
         }
@@ -795,6 +1291,101 @@ emit_atomic_operation(
         // is guaranteed not to alias status_reg.
         emit_logical_register(state, true, LOG_ORR, addr_temp, RZ, addr_reg);
     }
+}
+
+/* Helper for emitting atomic operations with single ARMv8.1 LSE instructions.
+ * Like the Linux arm64 BPF JIT, the fetching variants (and XCHG and CMPXCHG) are
+ * fully ordered (the AL forms) and the others are not ordered.
+ */
+static void
+emit_lse_atomic_operation(
+    struct jit_state* state,
+    struct ubpf_vm* vm,
+    bool is_64bit,
+    enum Registers value_reg,
+    enum Registers addr_reg,
+    enum Registers result_reg,
+    int16_t offset,
+    uint8_t alu_op,
+    bool is_cmpxchg,
+    bool is_xchg,
+    bool fetch)
+{
+    // No status register is needed, so the address can be used as is or go to
+    // R25; VOLATILE_CTXT (R26) is left alone.
+    enum Registers addr_temp = addr_reg;
+    if (offset != 0) {
+        addr_temp = temp_div_register;
+        emit_atomic_address(state, vm, addr_reg, offset, addr_temp, temp_register);
+    }
+
+    if (is_cmpxchg) {
+        // CASAL compares with and loads the old value into the register of r0,
+        // which is exactly what BPF_CMPXCHG does.
+        emit_compare_and_swap(state, is_64bit, map_register(0), value_reg, addr_temp);
+        return;
+    }
+    if (is_xchg) {
+        emit_atomic_memory_operation(state, is_64bit, AMO_SWP, true, value_reg, result_reg, addr_temp);
+        return;
+    }
+
+    enum AtomicMemoryOpcode op = AMO_LDADD;
+    switch (alu_op) {
+    case EBPF_ALU_OP_ADD:
+        op = AMO_LDADD;
+        break;
+    case EBPF_ALU_OP_OR:
+        op = AMO_LDSET;
+        break;
+    case EBPF_ALU_OP_AND:
+        // LDCLR clears the bits that are set in Rs, so it needs the complement.
+        emit_logical_register(state, is_64bit, LOG_ORN, temp_register, RZ, value_reg);
+        value_reg = temp_register;
+        op = AMO_LDCLR;
+        break;
+    case EBPF_ALU_OP_XOR:
+        op = AMO_LDEOR;
+        break;
+    default:
+        // Should not happen
+        break;
+    }
+    emit_atomic_memory_operation(state, is_64bit, op, fetch, value_reg, fetch ? result_reg : RZ, addr_temp);
+}
+
+/* Helper for emitting atomic operations using LDXR/STXR loop (or, if enabled, LSE) */
+static void
+emit_atomic_operation(
+    struct jit_state* state,
+    struct ubpf_vm* vm,
+    bool is_64bit,
+    enum Registers value_reg,
+    enum Registers addr_reg,
+    enum Registers result_reg,
+    enum Registers temp_reg,
+    enum Registers status_reg,
+    int16_t offset,
+    uint8_t alu_op,
+    bool is_cmpxchg,
+    bool is_xchg,
+    bool fetch)
+{
+    if (vm->lse_atomics_enabled) {
+        emit_lse_atomic_operation(
+            state, vm, is_64bit, value_reg, addr_reg, result_reg, offset, alu_op, is_cmpxchg, is_xchg, fetch);
+        return;
+    }
+
+    // Save the target address (addr_reg + offset) into a temporary register.
+    // Ensure that the base address register used for LDXR/STXR never aliases
+    // the status register used by STXR.
+    enum Registers addr_temp =
+        (status_reg == temp_div_register) ? offset_register : temp_div_register;
+    // Choose a scratch register for the offset that is distinct from addr_temp.
+    enum Registers offset_temp =
+        (addr_temp == offset_register) ? temp_div_register : offset_register;
+    emit_atomic_address(state, vm, addr_reg, offset, addr_temp, offset_temp);
 
     // Mark retry label location
     uint32_t retry_loc = state->offset;
@@ -908,36 +1499,6 @@ emit_atomic_operation(
     }
 }
 
-static uint32_t
-emit_dispatched_external_helper_address(struct jit_state* state, uint64_t dispatcher_addr)
-{
-    // We will assume that the buffer of memory holding the JIT'd code is 4-byte aligned.
-    // And, because ARM is 32-bit instructions, we know that each instruction is 4-byte aligned.
-    // And, finally, we need to make sure that the place we are putting the dispatch address
-    // is also 4-byte aligned. As a result, we can be sure that the delta between whoever
-    // is doing the PC-relative load and this address is a multiple of 4 bytes (which is how
-    // the PC-relative load instruction encodes its offset).
-    uint8_t byte = 0;
-    int adjustment = (4 - (state->offset % 4)) % 4;
-    for (int i = 0; i < adjustment; i++) {
-        emit_bytes(state, &byte, 1);
-    }
-    uint32_t helper_address = state->offset;
-    emit_bytes(state, &dispatcher_addr, sizeof(uint64_t));
-    return helper_address;
-}
-
-static uint32_t
-emit_helper_table(struct jit_state* state, struct ubpf_vm* vm)
-{
-
-    uint32_t helper_table_address_target = state->offset;
-    for (int i = 0; i < MAX_EXT_FUNCS; i++) {
-        emit_bytes(state, &vm->ext_funcs[i], sizeof(uint64_t));
-    }
-    return helper_table_address_target;
-}
-
 static bool
 is_imm_op(struct ebpf_inst const* inst)
 {
@@ -962,14 +1523,43 @@ is_alu64_op(struct ebpf_inst const* inst)
     return class == EBPF_CLS_ALU64 || class == EBPF_CLS_JMP;
 }
 
+/* The magnitude of a (sign-extended) 32-bit immediate. */
+static uint32_t
+imm_magnitude(int32_t imm)
+{
+    return imm < 0 ? (uint32_t)(-(int64_t)imm) : (uint32_t)imm;
+}
+
+/* Whether imm can be added or subtracted with at most two ADD/SUB (immediate)
+ * instructions (one for the low 12 bits and one for the next 12).
+ */
+static bool
+is_addsub_immediate(int32_t imm)
+{
+    return imm_magnitude(imm) < 0x1000000;
+}
+
+/* Whether a register can be compared with imm by a single CMP or CMN (immediate). */
+static bool
+is_compare_immediate(int32_t imm)
+{
+    uint32_t magnitude = imm_magnitude(imm);
+    return magnitude < 0x1000 || (magnitude < 0x1000000 && !(magnitude & 0xfff));
+}
+
+/* Whether the immediate of an instruction can be encoded in the instruction(s) emitted for it
+ * (see translate) instead of having to be moved into a temporary register first.
+ */
 static bool
 is_simple_imm(struct ebpf_inst const* inst)
 {
+    uint32_t encoding;
     switch (inst->opcode) {
     case EBPF_OP_ADD_IMM:
     case EBPF_OP_ADD64_IMM:
     case EBPF_OP_SUB_IMM:
     case EBPF_OP_SUB64_IMM:
+        return is_addsub_immediate(inst->imm);
     case EBPF_OP_JEQ_IMM:
     case EBPF_OP_JGT_IMM:
     case EBPF_OP_JGE_IMM:
@@ -990,7 +1580,7 @@ is_simple_imm(struct ebpf_inst const* inst)
     case EBPF_OP_JLE32_IMM:
     case EBPF_OP_JSLT32_IMM:
     case EBPF_OP_JSLE32_IMM:
-        return inst->imm >= 0 && inst->imm < 0x1000;
+        return is_compare_immediate(inst->imm);
     case EBPF_OP_MOV_IMM:
     case EBPF_OP_MOV64_IMM:
         return true;
@@ -1000,17 +1590,16 @@ is_simple_imm(struct ebpf_inst const* inst)
     case EBPF_OP_OR64_IMM:
     case EBPF_OP_XOR_IMM:
     case EBPF_OP_XOR64_IMM:
-        return false;
+    case EBPF_OP_JSET_IMM:
+    case EBPF_OP_JSET32_IMM:
+        return encode_logical_immediate(is_alu64_op(inst), (uint64_t)(int64_t)inst->imm, &encoding);
     case EBPF_OP_ARSH_IMM:
     case EBPF_OP_ARSH64_IMM:
     case EBPF_OP_LSH_IMM:
     case EBPF_OP_LSH64_IMM:
     case EBPF_OP_RSH_IMM:
     case EBPF_OP_RSH64_IMM:
-        return false;
-    case EBPF_OP_JSET_IMM:
-    case EBPF_OP_JSET32_IMM:
-        return false;
+        return true;
     case EBPF_OP_DIV_IMM:
     case EBPF_OP_DIV64_IMM:
     case EBPF_OP_MOD_IMM:
@@ -1022,13 +1611,243 @@ is_simple_imm(struct ebpf_inst const* inst)
     case EBPF_OP_STH:
     case EBPF_OP_STW:
     case EBPF_OP_STDW:
-        return false;
+        // Zero is stored from the zero register.
+        return inst->imm == 0;
     default:
         assert(false);
         return false;
     }
 }
 
+/* Add (or subtract) a sign-extended immediate accepted by is_addsub_immediate. */
+static void
+emit_addsub_signed_immediate(
+    struct jit_state* state, bool sixty_four, enum AddSubOpcode op, enum Registers rd, enum Registers rn, int32_t imm)
+{
+    assert(op == AS_ADD || op == AS_SUB);
+    if (imm < 0) {
+        op = (op == AS_ADD) ? AS_SUB : AS_ADD;
+    }
+    uint32_t magnitude = imm_magnitude(imm);
+    uint32_t high = magnitude & 0xfff000;
+    uint32_t low = magnitude & 0xfff;
+    if (high) {
+        emit_addsub_immediate(state, sixty_four, op, rd, rn, high);
+        rn = rd;
+    }
+    // An add of 0 still has to clear the upper half of the destination of a 32-bit operation.
+    if (low || !high) {
+        emit_addsub_immediate(state, sixty_four, op, rd, rn, low);
+    }
+}
+
+/* Compare a register with a sign-extended immediate accepted by is_compare_immediate:
+ * CMP rn, #imm or, for a negative immediate, CMN rn, #-imm (which sets the same flags).
+ */
+static void
+emit_compare_immediate(struct jit_state* state, bool sixty_four, enum Registers rn, int32_t imm)
+{
+    emit_addsub_immediate(state, sixty_four, imm < 0 ? AS_ADDS : AS_SUBS, RZ, rn, imm_magnitude(imm));
+}
+
+/* The number of bytes a load or store accesses. */
+static uint32_t
+access_size(uint8_t opcode)
+{
+    switch (opcode & EBPF_SIZE_DW) {
+    case EBPF_SIZE_B:
+        return 1;
+    case EBPF_SIZE_H:
+        return 2;
+    case EBPF_SIZE_W:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+/*
+ * Check that the access of size bytes at base_bpf_register + offset by the instruction at
+ * pc is in the memory or in the stack (like the interpreter's bounds_check) and, if it
+ * is in neither, call the out-of-line check (see emit_runtime_check_stubs), which asks
+ * the registered bounds check function and stops the program if that fails, too.
+ *
+ * An access relative to r10 that stays in the stack frame of the main function needs no
+ * check: r10 only changes across local calls. Neither does one that the range verifier
+ * proved in bounds (see ubpf_verify_ranges).
+ */
+static void
+emit_bounds_check(
+    struct jit_state* state,
+    struct ubpf_vm* vm,
+    uint32_t pc,
+    uint32_t first_local_function,
+    int base_bpf_register,
+    int16_t offset,
+    uint32_t size)
+{
+    if (!vm->bounds_check_enabled || ubpf_access_is_proven(vm, pc)) {
+        return;
+    }
+    bool stack_relative = base_bpf_register == BPF_REG_10;
+    int32_t stack_size = (int32_t)vm->stack_requirement;
+    if (stack_relative && state->jit_mode == BasicJitMode && pc < first_local_function && offset >= -stack_size &&
+        offset + (int32_t)size <= 0) {
+        return;
+    }
+
+    DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(default_tgt, 0);
+    emit_addsub_signed_immediate(
+        state, true, AS_ADD, check_address_register, map_register(base_bpf_register), offset);
+
+    // The access is in [start, start + length) if address - start < length and
+    // address - start + size <= length (in which case, the addition cannot overflow).
+    // Accesses relative to r10 most likely are in the stack, so check that first.
+    uint32_t in_bounds_jump_sources[2];
+    for (int region = 0; region < 2; region++) {
+        enum Registers start = mem_register;
+        enum Registers length = mem_len_register;
+        if ((region == 0) == stack_relative) {
+            emit_loadstorepair_immediate(
+                state, LSP_LDPX, stack_start_register, stack_len_register, R29, RUNTIME_CHECK_STACK_BOUNDS_OFFSET);
+            start = stack_start_register;
+            length = stack_len_register;
+        }
+        emit_addsub_register(state, true, AS_SUB, check_temp_register, check_address_register, start);
+        emit_addsub_register(state, true, AS_SUBS, RZ, check_temp_register, length);
+        emit_addsub_immediate(state, true, AS_ADD, check_temp_register, check_temp_register, size);
+        // If address - start >= length, set C (and clear Z) so that LS does not hold.
+        emit_conditionalcompare_register(state, true, check_temp_register, length, 2, COND_LO);
+        in_bounds_jump_sources[region] = emit_conditionalbranch_immediate(state, COND_LS, default_tgt);
+    }
+
+    DECLARE_PATCHABLE_SPECIAL_TARGET(bounds_check_tgt, BoundsCheck);
+    emit_logical_register(state, true, LOG_ORR, saved_link_register, RZ, R30);
+    emit_movewide_immediate(state, true, check_temp_register, ((uint64_t)pc << 8) | size);
+    emit_unconditionalbranch_immediate(state, UBR_BL, bounds_check_tgt);
+    emit_logical_register(state, true, LOG_ORR, R30, RZ, saved_link_register);
+
+    emit_jump_target(state, in_bounds_jump_sources[0]);
+    emit_jump_target(state, in_bounds_jump_sources[1]);
+}
+
+/*
+ * Whether the instruction ends a basic block, i.e., whether the next instruction can be
+ * reached other than by falling through it.
+ */
+static bool
+ends_basic_block(struct ebpf_inst inst)
+{
+    return !ubpf_instruction_has_fallthrough(inst) || inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32 ||
+           ubpf_instruction_is_conditional_jump(inst);
+}
+
+/*
+ * Whether the instruction at pc starts a basic block: the first instruction of a
+ * function, a jump target or an instruction after one that ends a basic block.
+ */
+static bool
+starts_basic_block(const struct ubpf_vm* vm, const struct jit_state* state, uint32_t pc)
+{
+    return pc == 0 || vm->int_funcs[pc] || (state->layout_flags[pc] & LayoutJumpTarget) ||
+           ends_basic_block(ubpf_fetch_instruction(vm, pc - 1));
+}
+
+/*
+ * The number of instructions in the basic block that starts at pc, as the interpreter
+ * counts them (an LDDW is one instruction).
+ */
+static uint32_t
+basic_block_size(const struct ubpf_vm* vm, const struct jit_state* state, uint32_t pc)
+{
+    uint32_t size = 0;
+    while (pc < vm->num_insts) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        size++;
+        pc += inst.opcode == EBPF_OP_LDDW ? 2 : 1;
+        if (ends_basic_block(inst) || (pc < vm->num_insts && starts_basic_block(vm, state, pc))) {
+            break;
+        }
+    }
+    return size;
+}
+
+/*
+ * Take count instructions from the fuel left and stop the program if it runs out. The
+ * fuel is charged when a basic block is entered with all of its instructions, so the
+ * program stops before the block in which the interpreter would stop, after the same
+ * number of instructions.
+ */
+static void
+emit_instruction_limit_charge(struct jit_state* state, uint32_t count)
+{
+    DECLARE_PATCHABLE_SPECIAL_TARGET(instruction_limit_tgt, InstructionLimit);
+    emit_loadstore_immediate(state, LS_LDRX, check_address_register, R29, RUNTIME_CHECK_FUEL_OFFSET);
+    if (count < 0x1000) {
+        emit_addsub_immediate(state, true, AS_SUBS, check_address_register, check_address_register, count);
+    } else {
+        emit_movewide_immediate(state, true, check_temp_register, count);
+        emit_addsub_register(state, true, AS_SUBS, check_address_register, check_address_register, check_temp_register);
+    }
+    emit_loadstore_immediate(state, LS_STRX, check_address_register, R29, RUNTIME_CHECK_FUEL_OFFSET);
+    emit_conditionalbranch_immediate(state, COND_MI, instruction_limit_tgt);
+}
+
+/*
+ * Whether the conditional jump at layout position n only skips a 64-bit move that
+ * nothing else jumps to, i.e., whether it can be emitted as a CSEL that performs the
+ * move unless the condition holds. If so, the move is returned in select_inst. When
+ * instructions are counted, the move is a basic block of its own that is charged for (see
+ * emit_instruction_limit_charge), so it is not folded.
+ */
+static bool
+is_conditional_select(
+    const struct ubpf_vm* vm, const struct jit_state* state, uint32_t n, struct ebpf_inst inst, struct ebpf_inst* select_inst)
+{
+    uint32_t i = state->layout[n];
+    if (ubpf_counts_instructions(vm) || !ubpf_instruction_is_conditional_jump(inst) || inst.offset != 1 ||
+        (state->layout_flags[i] & (LayoutInvertBranch | LayoutJumpToTarget)) ||
+        n + 1 >= state->layout_size || state->layout[n + 1] != i + 1 || vm->int_funcs[i + 1] ||
+        (state->layout_flags[i + 1] & LayoutJumpTarget)) {
+        return false;
+    }
+    *select_inst = ubpf_fetch_instruction(vm, i + 1);
+    return select_inst->opcode == EBPF_OP_MOV64_IMM ||
+           (select_inst->opcode == EBPF_OP_MOV64_REG && select_inst->offset == 0);
+}
+
+/*
+ * Emit the end of a conditional jump whose condition is in the flags: a B.cond or, when
+ * the jump only skips a move (see is_conditional_select), a CSEL that does the move
+ * unless the condition holds.
+ */
+static void
+emit_conditional_jump(
+    struct jit_state* state,
+    struct ubpf_vm* vm,
+    enum Condition cond,
+    struct PatchableTarget target,
+    const struct ebpf_inst* select_inst)
+{
+    if (!select_inst) {
+        emit_conditionalbranch_immediate(state, cond, target);
+        return;
+    }
+
+    enum Registers rd = map_register(select_inst->dst);
+    enum Registers rm = map_register(select_inst->src);
+    if (select_inst->opcode == EBPF_OP_MOV64_IMM) {
+        if (select_inst->imm == 0 && !vm->constant_blinding_enabled) {
+            rm = RZ;
+        } else {
+            // temp_register may hold the operand of the comparison; it is no longer needed.
+            rm = temp_div_register;
+            EMIT_MOVEWIDE_IMMEDIATE(vm, state, true, rm, (int64_t)select_inst->imm);
+        }
+    }
+    emit_conditionalselect(state, true, cond, rd, rd, rm);
+}
+
 static uint8_t
 to_reg_op(uint8_t opcode)
 {
@@ -1224,15 +2043,29 @@ static int
 translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 {
     int i;
+    uint16_t used_registers = compute_used_registers(vm);
+
+    // The main function ends where the first local function starts.
+    uint32_t first_local_function = vm->num_insts;
+    for (uint32_t pc = 1; pc < vm->num_insts; pc++) {
+        if (vm->int_funcs[pc]) {
+            first_local_function = pc;
+            break;
+        }
+    }
 
-    emit_jit_prologue(state, UBPF_EBPF_STACK_SIZE);
+    emit_jit_prologue(state, vm, used_registers);
 
-    for (i = 0; i < vm->num_insts; i++) {
+    compute_jit_layout(vm, state);
+
+    for (uint32_t n = 0; n < state->layout_size; n++) {
 
         if (state->jit_status != NoError) {
             break;
         }
 
+        i = state->layout[n];
+
         // All checks for errors during the encoding of _this_ instruction
         // occur at the end of the loop.
         struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
@@ -1275,6 +2108,12 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 
         state->pc_locs[i] = state->offset;
 
+        // When instructions are counted (the program's instruction bound exceeds the limit),
+        // every basic block takes its instructions from the fuel when it is entered.
+        if (ubpf_counts_instructions(vm) && starts_basic_block(vm, state, i)) {
+            emit_instruction_limit_charge(state, basic_block_size(vm, state, i));
+        }
+
         enum Registers dst = map_register(inst.dst);
         enum Registers src = map_register(inst.src);
         uint8_t opcode = inst.opcode;
@@ -1290,8 +2129,25 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 
         DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(tgt, target_pc);
 
+        // When the fall-through of a conditional jump was moved out of line (see
+        // compute_jit_layout), jump there on the opposite condition instead. Arm
+        // condition codes come in pairs that differ only in their low bit.
+        int cond_invert = 0;
+        if (state->layout_flags[i] & LayoutInvertBranch) {
+            cond_invert = 1;
+            tgt.target.regular.ebpf_target_pc = i + 1;
+        }
+
         int sixty_four = is_alu64_op(&inst);
 
+        // A conditional jump that only skips a move is emitted as a CSEL (and the
+        // move is skipped below).
+        struct ebpf_inst select_inst;
+        const struct ebpf_inst* select = NULL;
+        if (is_conditional_select(vm, state, n, inst, &select_inst)) {
+            select = &select_inst;
+        }
+
         // If this is an operation with an immediate operand (and that immediate
         // operand is _not_ simple), then we convert the operation to the equivalent
         // register version after moving the immediate into a temporary register.
@@ -1299,13 +2155,18 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         // all attacker-controlled immediates are blinded.
         // Exception: MOV_IMM/MOV64_IMM are handled directly in their switch case to avoid
         // an extra ORR instruction when blinding is enabled.
-        if (is_imm_op(&inst) &&
-            opcode != EBPF_OP_MOV_IMM &&
-            opcode != EBPF_OP_MOV64_IMM &&
-            (!is_simple_imm(&inst) || vm->constant_blinding_enabled)) {
-            EMIT_MOVEWIDE_IMMEDIATE(vm, state, sixty_four, temp_register, (int64_t)inst.imm);
-            src = temp_register;
-            opcode = to_reg_op(opcode);
+        if (is_imm_op(&inst) && opcode != EBPF_OP_MOV_IMM && opcode != EBPF_OP_MOV64_IMM) {
+            if (!is_simple_imm(&inst) || vm->constant_blinding_enabled) {
+                // The immediate of a 64-bit store is sign-extended to 64 bits, too.
+                bool sixty_four_imm = sixty_four || opcode == EBPF_OP_STDW;
+                EMIT_MOVEWIDE_IMMEDIATE(vm, state, sixty_four_imm, temp_register, (int64_t)inst.imm);
+                src = temp_register;
+                opcode = to_reg_op(opcode);
+            } else if ((opcode & EBPF_CLS_MASK) == EBPF_CLS_ST) {
+                // The only simple immediate to store is 0: store the zero register instead.
+                src = RZ;
+                opcode = to_reg_op(opcode);
+            }
         }
 
         switch (opcode) {
@@ -1313,7 +2174,7 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_ADD64_IMM:
         case EBPF_OP_SUB_IMM:
         case EBPF_OP_SUB64_IMM:
-            emit_addsub_immediate(state, sixty_four, to_addsub_opcode(opcode), dst, dst, inst.imm);
+            emit_addsub_signed_immediate(state, sixty_four, to_addsub_opcode(opcode), dst, dst, inst.imm);
             break;
         case EBPF_OP_ADD_REG:
         case EBPF_OP_ADD64_REG:
@@ -1321,13 +2182,20 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_SUB64_REG:
             emit_addsub_register(state, sixty_four, to_addsub_opcode(opcode), dst, dst, src);
             break;
+        case EBPF_OP_LSH_IMM:
+        case EBPF_OP_RSH_IMM:
+        case EBPF_OP_ARSH_IMM:
+        case EBPF_OP_LSH64_IMM:
+        case EBPF_OP_RSH64_IMM:
+        case EBPF_OP_ARSH64_IMM:
+            emit_shift_immediate(state, sixty_four, to_dp2_opcode(opcode), dst, dst, (uint32_t)inst.imm);
+            break;
         case EBPF_OP_LSH_REG:
         case EBPF_OP_RSH_REG:
         case EBPF_OP_ARSH_REG:
         case EBPF_OP_LSH64_REG:
         case EBPF_OP_RSH64_REG:
         case EBPF_OP_ARSH64_REG:
-            /* TODO: CHECK imm is small enough.  */
             emit_dataprocessing_twosource(state, sixty_four, to_dp2_opcode(opcode), dst, dst, src);
             break;
         case EBPF_OP_MUL_REG:
@@ -1340,6 +2208,17 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_MOD64_REG:
             divmod(state, opcode, dst, dst, src, inst.offset);
             break;
+        case EBPF_OP_OR_IMM:
+        case EBPF_OP_AND_IMM:
+        case EBPF_OP_XOR_IMM:
+        case EBPF_OP_OR64_IMM:
+        case EBPF_OP_AND64_IMM:
+        case EBPF_OP_XOR64_IMM: {
+            uint32_t encoding = 0;
+            encode_logical_immediate(sixty_four, (uint64_t)(int64_t)inst.imm, &encoding);
+            emit_logical_immediate(state, sixty_four, to_logical_opcode(opcode), dst, dst, encoding);
+            break;
+        }
         case EBPF_OP_OR_REG:
         case EBPF_OP_AND_REG:
         case EBPF_OP_XOR_REG:
@@ -1442,10 +2321,18 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_JSGT32_IMM:
         case EBPF_OP_JSGE32_IMM:
         case EBPF_OP_JSLT32_IMM:
-        case EBPF_OP_JSLE32_IMM:
-            emit_addsub_immediate(state, sixty_four, AS_SUBS, RZ, dst, inst.imm);
-            emit_conditionalbranch_immediate(state, to_condition(opcode), tgt);
+        case EBPF_OP_JSLE32_IMM: {
+            // A comparison for (in)equality with 0 needs no flags.
+            uint8_t mode = opcode & EBPF_JMP_OP_MASK;
+            if (inst.imm == 0 && !select && (mode == EBPF_MODE_JEQ || mode == EBPF_MODE_JNE)) {
+                enum CompareBranchOpcode op = ((mode == EBPF_MODE_JEQ) ^ cond_invert) ? CBR_CBZ : CBR_CBNZ;
+                emit_compareandbranch_immediate(state, sixty_four, op, dst, tgt);
+                break;
+            }
+            emit_compare_immediate(state, sixty_four, dst, inst.imm);
+            emit_conditional_jump(state, vm, to_condition(opcode) ^ cond_invert, tgt, select);
             break;
+        }
         case EBPF_OP_JEQ_REG:
         case EBPF_OP_JGT_REG:
         case EBPF_OP_JGE_REG:
@@ -1467,12 +2354,30 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_JSLT32_REG:
         case EBPF_OP_JSLE32_REG:
             emit_addsub_register(state, sixty_four, AS_SUBS, RZ, dst, src);
-            emit_conditionalbranch_immediate(state, to_condition(opcode), tgt);
+            emit_conditional_jump(state, vm, to_condition(opcode) ^ cond_invert, tgt, select);
             break;
+        case EBPF_OP_JSET_IMM:
+        case EBPF_OP_JSET32_IMM: {
+            uint64_t mask = sixty_four ? (uint64_t)(int64_t)inst.imm : (uint32_t)inst.imm;
+            // Testing a single bit needs no flags.
+            if (!select && (mask & (mask - 1)) == 0) {
+                uint32_t bit = 0;
+                while (!(mask & (UINT64_C(1) << bit))) {
+                    bit++;
+                }
+                emit_testandbranch_immediate(state, cond_invert ? TBR_TBZ : TBR_TBNZ, dst, bit, tgt);
+                break;
+            }
+            uint32_t encoding = 0;
+            encode_logical_immediate(sixty_four, mask, &encoding);
+            emit_logical_immediate(state, sixty_four, LOG_ANDS, RZ, dst, encoding);
+            emit_conditional_jump(state, vm, to_condition(opcode) ^ cond_invert, tgt, select);
+            break;
+        }
         case EBPF_OP_JSET_REG:
         case EBPF_OP_JSET32_REG:
             emit_logical_register(state, sixty_four, LOG_ANDS, RZ, dst, src);
-            emit_conditionalbranch_immediate(state, to_condition(opcode), tgt);
+            emit_conditional_jump(state, vm, to_condition(opcode) ^ cond_invert, tgt, select);
             break;
         case EBPF_OP_CALL: {
             DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit);
@@ -1484,7 +2389,7 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
                 }
             } else if (inst.src == 1) {
                 uint32_t call_target = i + inst.imm + 1;
-                emit_local_call(state, call_target);
+                emit_local_call(state, vm, call_target);
             } else {
                 emit_unconditionalbranch_immediate(state, UBR_B, exit_tgt);
             }
@@ -1511,6 +2416,14 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_LDXWSX:
         case EBPF_OP_LDXHSX:
         case EBPF_OP_LDXBSX:
+            emit_bounds_check(
+                state,
+                vm,
+                i,
+                first_local_function,
+                (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_LDX ? inst.src : inst.dst,
+                inst.offset,
+                access_size(inst.opcode));
             if (inst.offset >= -256 && inst.offset < 256) {
                 emit_loadstore_immediate(state, to_loadstore_opcode(opcode), dst, src, inst.offset);
             } else {
@@ -1537,6 +2450,7 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
             break;
 
         case EBPF_OP_ATOMIC_STORE: {
+            emit_bounds_check(state, vm, i, first_local_function, inst.dst, inst.offset, 8);
             bool fetch = inst.imm & EBPF_ATOMIC_OP_FETCH;
             // Use R24 as temp for loaded value, offset_register (R26) for address calc
             // Use temp_div_register (R25) as status register for STXR (not mapped to any BPF register)
@@ -1573,6 +2487,7 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         } break;
 
         case EBPF_OP_ATOMIC32_STORE: {
+            emit_bounds_check(state, vm, i, first_local_function, inst.dst, inst.offset, 4);
             bool fetch = inst.imm & EBPF_ATOMIC_OP_FETCH;
             // Use R24 as temp for loaded value, offset_register (R26) for address calc
             // Use temp_div_register (R25) as status register for STXR (not mapped to any BPF register)
@@ -1625,26 +2540,23 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_STH:
         case EBPF_OP_STB:
         case EBPF_OP_STDW:
-        case EBPF_OP_JSET_IMM:
-        case EBPF_OP_JSET32_IMM:
-        case EBPF_OP_OR_IMM:
-        case EBPF_OP_AND_IMM:
-        case EBPF_OP_XOR_IMM:
-        case EBPF_OP_OR64_IMM:
-        case EBPF_OP_AND64_IMM:
-        case EBPF_OP_XOR64_IMM:
-        case EBPF_OP_LSH_IMM:
-        case EBPF_OP_RSH_IMM:
-        case EBPF_OP_ARSH_IMM:
-        case EBPF_OP_LSH64_IMM:
-        case EBPF_OP_RSH64_IMM:
-        case EBPF_OP_ARSH64_IMM:
             *errmsg = ubpf_error("Unexpected instruction at PC %d: opcode %02x, immediate %08x", i, opcode, inst.imm);
             state->jit_status = UnexpectedInstruction;
         default:
             *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, opcode);
             state->jit_status = UnknownInstruction;
         }
+
+        if (select) {
+            // The move was folded into the CSEL.
+            state->pc_locs[i + 1] = state->offset;
+            n++;
+        }
+
+        if (state->layout_flags[i] & LayoutJumpToTarget) {
+            DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(hot_tgt, target_pc);
+            emit_unconditionalbranch_immediate(state, UBR_B, hot_tgt);
+        }
     }
 
     if (state->jit_status != NoError) {
@@ -1686,10 +2598,7 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         return -1;
     }
 
-    emit_jit_epilogue(state);
-
-    state->dispatcher_loc = emit_dispatched_external_helper_address(state, (uint64_t)vm->dispatcher);
-    state->helper_table_loc = emit_helper_table(state, vm);
+    emit_jit_epilogue(state, vm, used_registers);
 
     return 0;
 }
@@ -1712,7 +2621,11 @@ divmod(struct jit_state* state, uint8_t opcode, int rd, int rn, int rm, int16_t
     }
 }
 
-static void
+/*
+ * Patch the offset of the branch at offset. Returns false if the target is out of
+ * the range of the branch.
+ */
+static bool
 resolve_branch_immediate(struct jit_state* state, uint32_t offset, int32_t imm)
 {
     assert((imm & 3) == 0);
@@ -1721,54 +2634,65 @@ resolve_branch_immediate(struct jit_state* state, uint32_t offset, int32_t imm)
     memcpy(&instr, state->buf + offset, sizeof(uint32_t));
     if ((instr & 0xfe000000U) == 0x54000000U       /* Conditional branch immediate.  */
         || (instr & 0x7e000000U) == 0x34000000U) { /* Compare and branch immediate.  */
-        assert((imm >> 19) == INT64_C(-1) || (imm >> 19) == 0);
+        if ((imm >> 18) != -1 && (imm >> 18) != 0) {
+            return false;
+        }
         instr |= (imm & 0x7ffff) << 5;
+    } else if ((instr & 0x7e000000U) == 0x36000000U) {
+        /* Test and branch immediate.  */
+        if ((imm >> 13) != -1 && (imm >> 13) != 0) {
+            return false;
+        }
+        instr |= (imm & 0x3fff) << 5;
     } else if ((instr & 0x7c000000U) == 0x14000000U) {
         /* Unconditional branch immediate.  */
-        assert((imm >> 26) == INT64_C(-1) || (imm >> 26) == 0);
+        if ((imm >> 25) != -1 && (imm >> 25) != 0) {
+            return false;
+        }
         instr |= (imm & 0x03ffffffU) << 0;
     } else {
         assert(false);
         instr = BAD_OPCODE;
     }
     memcpy(state->buf + offset, &instr, sizeof(uint32_t));
+    return true;
 }
 
-static void
-resolve_load_literal(struct jit_state* state, uint32_t instr_offset, int32_t target_offset)
-{
-    uint32_t instr;
-    target_offset = (0x7FFFF & target_offset) << 5;
-    memcpy(&instr, state->buf + instr_offset, sizeof(uint32_t));
-    instr |= target_offset;
-    memcpy(state->buf + instr_offset, &instr, sizeof(uint32_t));
-}
-
-static void
-resolve_adr(struct jit_state* state, uint32_t instr_offset, int32_t immediate)
+/* Whether instr is a branch with a short reach: B.cond, CBZ/CBNZ or TBZ/TBNZ. */
+static bool
+is_short_branch(uint32_t instr)
 {
-    uint32_t instr;
-    uint32_t immhi = (immediate & 0x00ffffff) << 5;
-    memcpy(&instr, state->buf + instr_offset, sizeof(uint32_t));
-    instr |= immhi;
-    memcpy(state->buf + instr_offset, &instr, sizeof(uint32_t));
+    return (instr & 0xfe000000U) == 0x54000000U || (instr & 0x7e000000U) == 0x34000000U ||
+           (instr & 0x7e000000U) == 0x36000000U;
 }
 
+/*
+ * Patch the jumps. A short branch that does not reach its target is marked to be emitted
+ * in its long form (see far_jumps in struct jit_state) when the program is translated
+ * again, which *retry asks for.
+ */
 static bool
-resolve_jumps(struct jit_state* state)
+resolve_jumps(struct jit_state* state, bool* retry)
 {
+    bool resolved = true;
     for (unsigned i = 0; i < state->num_jumps; ++i) {
         struct patchable_relative jump = state->jumps[i];
 
         int32_t target_loc;
 
         if (jump.target.is_special) {
-            // Jumps to special targets Exit and Enter are the only
-            // valid options.
             if (jump.target.target.special == Exit) {
                 target_loc = state->exit_loc;
             } else if (jump.target.target.special == Enter) {
                 target_loc = state->entry_loc;
+            } else if (jump.target.target.special == BoundsCheck) {
+                target_loc = state->bounds_check_loc;
+            } else if (jump.target.target.special == InstructionLimit) {
+                target_loc = state->instruction_limit_loc;
+            } else if (jump.target.target.special == CallDepth) {
+                target_loc = state->call_depth_loc;
+            } else if (jump.target.target.special == ContextSize) {
+                target_loc = state->context_size_loc;
             } else {
                 target_loc = -1;
                 return false;
@@ -1784,53 +2708,18 @@ resolve_jumps(struct jit_state* state)
         }
 
         int32_t rel = target_loc - jump.offset_loc;
-        resolve_branch_immediate(state, jump.offset_loc, rel);
-    }
-    return true;
-}
-
-static bool
-resolve_loads(struct jit_state* state)
-{
-    for (unsigned i = 0; i < state->num_loads; ++i) {
-        struct patchable_relative jump = state->loads[i];
-
-        int32_t target_loc = 0;
-        // Right now it is only possible to load from the external dispatcher.
-        if (jump.target.is_special && jump.target.target.special == ExternalDispatcher) {
-            target_loc = state->dispatcher_loc;
-        } else {
-            return false;
-        }
-
-        int32_t rel = target_loc - jump.offset_loc;
-        assert(rel % 4 == 0);
-        rel >>= 2;
-        resolve_load_literal(state, jump.offset_loc, rel);
-    }
-    return true;
-}
-
-static bool
-resolve_leas(struct jit_state* state)
-{
-    for (unsigned i = 0; i < state->num_leas; ++i) {
-        struct patchable_relative jump = state->leas[i];
-
-        int32_t target_loc = 0;
-        // Right now it is only possible to have leas to the helper table.
-        if (jump.target.is_special && jump.target.target.special == LoadHelperTable) {
-            target_loc = state->helper_table_loc;
-        } else {
-            return false;
+        if (!resolve_branch_immediate(state, jump.offset_loc, rel)) {
+            uint32_t instr;
+            memcpy(&instr, state->buf + jump.offset_loc, sizeof(uint32_t));
+            if (!is_short_branch(instr)) {
+                return false;
+            }
+            state->far_jumps[i] = true;
+            *retry = true;
+            resolved = false;
         }
-
-        int32_t rel = target_loc - jump.offset_loc;
-        assert(rel % 4 == 0);
-        rel >>= 2;
-        resolve_adr(state, jump.offset_loc, rel);
     }
-    return true;
+    return resolved;
 }
 
 static bool
@@ -1846,71 +2735,71 @@ resolve_local_calls(struct jit_state* state)
 
         int32_t rel = target_loc - local_call.offset_loc;
         rel -= state->bpf_function_prolog_size;
-        resolve_branch_immediate(state, local_call.offset_loc, rel);
+        if (!resolve_branch_immediate(state, local_call.offset_loc, rel)) {
+            return false;
+        }
     }
     return true;
 }
 
-bool
-ubpf_jit_update_dispatcher_arm64(
-    struct ubpf_vm* vm, external_function_dispatcher_t new_dispatcher, uint8_t* buffer, size_t size, uint32_t offset)
-{
-    UNUSED_PARAMETER(vm);
-    uint64_t jit_upper_bound = (uint64_t)buffer + size;
-    void* dispatcher_address = (void*)((uint64_t)buffer + offset);
-    if ((uint64_t)dispatcher_address + sizeof(void*) < jit_upper_bound) {
-        memcpy(dispatcher_address, &new_dispatcher, sizeof(void*));
-        return true;
-    }
-
-    return false;
-}
-
-bool
-ubpf_jit_update_helper_arm64(
-    struct ubpf_vm* vm,
-    extended_external_helper_t new_helper,
-    unsigned int idx,
-    uint8_t* buffer,
-    size_t size,
-    uint32_t offset)
-{
-    UNUSED_PARAMETER(vm);
-    uint64_t jit_upper_bound = (uint64_t)buffer + size;
-
-    void* dispatcher_address = (void*)((uint64_t)buffer + offset + (8 * idx));
-    if ((uint64_t)dispatcher_address + sizeof(void*) < jit_upper_bound) {
-        memcpy(dispatcher_address, &new_helper, sizeof(void*));
-        return true;
-    }
-    return false;
-}
-
 struct ubpf_jit_result
 ubpf_translate_arm64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode)
 {
     struct jit_state state;
     struct ubpf_jit_result compile_result;
+    uint8_t* far_jumps = calloc(UBPF_JIT_MAX_JUMPS, sizeof(far_jumps[0]));
 
+retry:
     if (initialize_jit_state_result(&state, &compile_result, buffer, *size, jit_mode, &compile_result.errmsg) < 0) {
         goto out;
     }
+    if (far_jumps == NULL) {
+        compile_result.errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
+        goto out;
+    }
+    state.far_jumps = far_jumps;
 
     if (translate(vm, &state, &compile_result.errmsg) < 0) {
         goto out;
     }
 
-    if (!resolve_jumps(&state) || !resolve_loads(&state) || !resolve_leas(&state) || !resolve_local_calls(&state)) {
+    // Should a jump not reach its target, translate the program again with it (and
+    // every other one that does not) in its long form. As these only ever get added,
+    // this ends.
+    bool retry = false;
+    bool jumps_resolved = resolve_jumps(&state, &retry);
+    if (!jumps_resolved || !resolve_local_calls(&state)) {
+        if (retry) {
+            release_jit_state_result(&state, &compile_result);
+            goto retry;
+        }
         compile_result.errmsg = ubpf_error("Could not patch the relative addresses in the JIT'd code.");
         goto out;
     }
 
     compile_result.compile_result = UBPF_JIT_COMPILE_SUCCESS;
     *size = state.offset;
-    compile_result.external_dispatcher_offset = state.dispatcher_loc;
-    compile_result.external_helper_offset = state.helper_table_loc;
 
 out:
     release_jit_state_result(&state, &compile_result);
+    free(far_jumps);
     return compile_result;
 }
+
+size_t
+ubpf_jit_entry_arm64(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through)
+{
+    struct jit_state state;
+    memset(&state, 0, sizeof(state));
+    state.buf = buffer;
+    state.size = UBPF_JIT_ENTRY_MAX_SIZE;
+
+    // The prologue keeps jit_data_register in the frame (see emit_jit_prologue).
+    emit_movewide_immediate(&state, true, jit_data_register, (uint64_t)(uintptr_t)jit_data);
+    if (!fall_through) {
+        emit_loadstore_unsigned_immediate(
+            &state, LS_LDRX, R16, jit_data_register, offsetof(struct ubpf_jit_data, code));
+        emit_unconditionalbranch_register(&state, BR_BR, R16);
+    }
+    return state.offset;
+}
@@ -0,0 +1,996 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Optimizing JIT tier: lowers a loaded (and so validated) program into LLVM IR, optimizes
+ * it with the O2 pipeline and compiles it with ORC (LLJIT). It trades compile time for the
+ * throughput of long-running programs and is selected with LlvmJitMode.
+ *
+ * The code has the calling convention of ubpf_jit_ex_fn and behaves like the template
+ * JITs: helpers are called through the VM's struct ubpf_jit_data (the external dispatcher
+ * if one is set, the helper table otherwise), memory accesses that are neither in the
+ * context nor in the stack are checked with ubpf_jit_check_access, and the program is
+ * stopped with UINT64_MAX when an access is not allowed, it nests too many local calls or
+ * it runs out of fuel (charged per basic block).
+ *
+ * The translation follows the C backend (ubpf_aot_c.c): registers are locals (which
+ * SROA turns into SSA values), every basic block gets a label and local calls push r6-r9,
+ * the caller's stack usage and the return pc onto a small frame array.
+ *
+ * Only built when uBPF is configured with UBPF_ENABLE_LLVM_JIT and LLVM (13 or later)
+ * is found.
+ */
+
+#include <ubpf_config.h>
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+#if defined(UBPF_HAS_LLVM_JIT)
+
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+
+#define UBPF_LLVM_ENTRY_NAME "ubpf_llvm_entry"
+
+struct llvm_translation
+{
+    struct ubpf_vm* vm;
+    LLVMContextRef context;
+    LLVMModuleRef module;
+    LLVMBuilderRef builder;
+    LLVMValueRef function;
+
+    LLVMTypeRef i8;
+    LLVMTypeRef i32;
+    LLVMTypeRef i64;
+
+    // The parameters of the function, as integers.
+    LLVMValueRef mem;
+    LLVMValueRef mem_len;
+    LLVMValueRef stack;
+    LLVMValueRef stack_len;
+
+    LLVMValueRef registers[11];
+    LLVMValueRef fuel;
+    LLVMValueRef depth;
+    LLVMValueRef saved;        // [UBPF_MAX_CALL_DEPTH x [4 x i64]]
+    LLVMValueRef stack_usage;  // [UBPF_MAX_CALL_DEPTH x i64]
+    LLVMValueRef return_pc;    // [UBPF_MAX_CALL_DEPTH x i32]
+
+    bool* is_leader;             // The instruction starts a basic block.
+    LLVMBasicBlockRef* blocks;   // The basic block of each leader.
+    LLVMBasicBlockRef fail;      // Returns UINT64_MAX.
+    LLVMBasicBlockRef exit_function;
+    bool has_local_calls;
+};
+
+static LLVMValueRef
+const_i64(struct llvm_translation* t, uint64_t value)
+{
+    return LLVMConstInt(t->i64, value, false);
+}
+
+static LLVMValueRef
+const_i32(struct llvm_translation* t, uint32_t value)
+{
+    return LLVMConstInt(t->i32, value, false);
+}
+
+static LLVMValueRef
+load_register(struct llvm_translation* t, int r)
+{
+    return LLVMBuildLoad2(t->builder, t->i64, t->registers[r], "");
+}
+
+static void
+store_register(struct llvm_translation* t, int r, LLVMValueRef value)
+{
+    LLVMTypeRef type = LLVMTypeOf(value);
+    if (type != t->i64) {
+        value = LLVMBuildZExt(t->builder, value, t->i64, "");
+    }
+    LLVMBuildStore(t->builder, value, t->registers[r]);
+}
+
+// A host function (or data) address as a pointer of the given type.
+static LLVMValueRef
+host_pointer(struct llvm_translation* t, const void* address, LLVMTypeRef type)
+{
+    return LLVMConstIntToPtr(const_i64(t, (uint64_t)(uintptr_t)address), LLVMPointerType(type, 0));
+}
+
+static LLVMValueRef
+call_intrinsic(struct llvm_translation* t, const char* name, LLVMTypeRef type, LLVMValueRef* args, unsigned count)
+{
+    unsigned id = LLVMLookupIntrinsicID(name, strlen(name));
+    LLVMValueRef declaration = LLVMGetIntrinsicDeclaration(t->module, id, &type, 1);
+    LLVMTypeRef function_type = LLVMIntrinsicGetType(t->context, id, &type, 1);
+    return LLVMBuildCall2(t->builder, function_type, declaration, args, count, "");
+}
+
+// Start a new basic block, falling through from the current one if it is still open.
+static void
+enter_block(struct llvm_translation* t, LLVMBasicBlockRef block)
+{
+    LLVMBasicBlockRef current = LLVMGetInsertBlock(t->builder);
+    if (LLVMGetBasicBlockTerminator(current) == NULL) {
+        LLVMBuildBr(t->builder, block);
+    }
+    LLVMPositionBuilderAtEnd(t->builder, block);
+}
+
+// Report why the program is stopped and return UINT64_MAX.
+static void
+emit_stop(struct llvm_translation* t, enum ubpf_jit_stop_reason reason)
+{
+    LLVMTypeRef params[] = {LLVMPointerType(t->i8, 0), t->i32, t->i64, t->i64};
+    LLVMTypeRef type = LLVMFunctionType(LLVMVoidTypeInContext(t->context), params, 4, false);
+    LLVMValueRef args[] = {
+        host_pointer(t, t->vm->jit_data, t->i8),
+        const_i32(t, reason),
+        const_i64(t, t->vm->minimum_context_size),
+        const_i64(t, t->vm->stack_requirement)};
+    LLVMBuildCall2(t->builder, type, host_pointer(t, (const void*)ubpf_jit_report_stop, type), args, 4, "");
+    LLVMBuildBr(t->builder, t->fail);
+}
+
+// address is in [start, start + length) with room for size bytes, without overflowing.
+static LLVMValueRef
+emit_in_region(struct llvm_translation* t, LLVMValueRef address, uint64_t size, LLVMValueRef start, LLVMValueRef length)
+{
+    LLVMBuilderRef b = t->builder;
+    LLVMValueRef offset = LLVMBuildSub(b, address, start, "");
+    LLVMValueRef above = LLVMBuildICmp(b, LLVMIntUGE, address, start, "");
+    LLVMValueRef within = LLVMBuildICmp(b, LLVMIntULE, offset, length, "");
+    LLVMValueRef room = LLVMBuildICmp(b, LLVMIntULE, const_i64(t, size), LLVMBuildSub(b, length, offset, ""), "");
+    return LLVMBuildAnd(b, LLVMBuildAnd(b, above, within, ""), room, "");
+}
+
+static void
+emit_access_check(struct llvm_translation* t, LLVMValueRef address, uint64_t size, uint32_t pc)
+{
+    if (!t->vm->bounds_check_enabled || ubpf_access_is_proven(t->vm, pc)) {
+        return;
+    }
+    LLVMBuilderRef b = t->builder;
+    LLVMValueRef allowed = LLVMBuildOr(
+        b,
+        emit_in_region(t, address, size, t->mem, t->mem_len),
+        emit_in_region(t, address, size, t->stack, t->stack_len),
+        "");
+    LLVMBasicBlockRef slow = LLVMAppendBasicBlockInContext(t->context, t->function, "check_access");
+    LLVMBasicBlockRef next = LLVMAppendBasicBlockInContext(t->context, t->function, "");
+    LLVMBuildCondBr(b, allowed, next, slow);
+
+    LLVMPositionBuilderAtEnd(b, slow);
+    LLVMTypeRef params[] = {LLVMPointerType(t->i8, 0), t->i64, t->i64, t->i32};
+    LLVMTypeRef type = LLVMFunctionType(LLVMInt1TypeInContext(t->context), params, 4, false);
+    LLVMValueRef args[] = {host_pointer(t, t->vm->jit_data, t->i8), address, const_i64(t, size), const_i32(t, pc)};
+    LLVMValueRef checked =
+        LLVMBuildCall2(b, type, host_pointer(t, (const void*)ubpf_jit_check_access, type), args, 4, "");
+    LLVMBuildCondBr(b, checked, next, t->fail);
+
+    LLVMPositionBuilderAtEnd(b, next);
+}
+
+// Stop the program if it is given less memory (or stack) than the range verifier
+// assumed for the accesses that emit_access_check leaves unchecked.
+static void
+emit_context_size_check(struct llvm_translation* t)
+{
+    LLVMBuilderRef b = t->builder;
+    const struct ubpf_vm* vm = t->vm;
+    LLVMValueRef enough = LLVMBuildAnd(
+        b,
+        LLVMBuildICmp(b, LLVMIntUGE, t->mem_len, const_i64(t, vm->minimum_context_size), ""),
+        LLVMBuildICmp(b, LLVMIntUGE, t->stack_len, const_i64(t, vm->stack_requirement), ""),
+        "");
+    if (vm->minimum_context_size != 0) {
+        enough = LLVMBuildAnd(b, enough, LLVMBuildICmp(b, LLVMIntNE, t->mem, const_i64(t, 0), ""), "");
+    }
+    LLVMBasicBlockRef too_small = LLVMAppendBasicBlockInContext(t->context, t->function, "context_size");
+    LLVMBasicBlockRef next = LLVMAppendBasicBlockInContext(t->context, t->function, "");
+    LLVMBuildCondBr(b, enough, next, too_small);
+
+    LLVMPositionBuilderAtEnd(b, too_small);
+    emit_stop(t, UBPF_JIT_STOP_CONTEXT_SIZE);
+    LLVMPositionBuilderAtEnd(b, next);
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B:
+        return 1;
+    case EBPF_SIZE_H:
+        return 2;
+    case EBPF_SIZE_W:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+// Division by zero and INT_MIN / -1 behave as they do in the interpreter.
+static LLVMValueRef
+emit_division(struct llvm_translation* t, LLVMValueRef dividend, LLVMValueRef divisor, bool is_signed, bool is_modulo)
+{
+    LLVMBuilderRef b = t->builder;
+    LLVMTypeRef type = LLVMTypeOf(dividend);
+    LLVMValueRef zero = LLVMBuildICmp(b, LLVMIntEQ, divisor, LLVMConstInt(type, 0, false), "");
+    LLVMValueRef unsafe = zero;
+    if (is_signed) {
+        unsigned bits = LLVMGetIntTypeWidth(type);
+        LLVMValueRef min = LLVMConstInt(type, 1ULL << (bits - 1), false);
+        LLVMValueRef overflow = LLVMBuildAnd(
+            b,
+            LLVMBuildICmp(b, LLVMIntEQ, dividend, min, ""),
+            LLVMBuildICmp(b, LLVMIntEQ, divisor, LLVMConstAllOnes(type), ""),
+            "");
+        unsafe = LLVMBuildOr(b, zero, overflow, "");
+    }
+    // Dividing by 1 instead gives the interpreter's result for INT_MIN / -1 (and % -1).
+    LLVMValueRef safe_divisor = LLVMBuildSelect(b, unsafe, LLVMConstInt(type, 1, false), divisor, "");
+    LLVMValueRef result;
+    if (is_modulo) {
+        result = is_signed ? LLVMBuildSRem(b, dividend, safe_divisor, "") : LLVMBuildURem(b, dividend, safe_divisor, "");
+        return LLVMBuildSelect(b, zero, dividend, result, "");
+    }
+    result = is_signed ? LLVMBuildSDiv(b, dividend, safe_divisor, "") : LLVMBuildUDiv(b, dividend, safe_divisor, "");
+    return LLVMBuildSelect(b, zero, LLVMConstInt(type, 0, false), result, "");
+}
+
+static bool
+translate_alu(struct llvm_translation* t, struct ebpf_inst inst, char** errmsg)
+{
+    LLVMBuilderRef b = t->builder;
+    bool is64 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    bool use_reg = (inst.opcode & EBPF_SRC_REG) != 0;
+    uint8_t op = inst.opcode & EBPF_ALU_OP_MASK;
+    LLVMTypeRef type = is64 ? t->i64 : t->i32;
+
+    if (op == EBPF_ALU_OP_END) {
+        LLVMTypeRef swapped_type = LLVMIntTypeInContext(t->context, inst.imm);
+        LLVMValueRef value = load_register(t, inst.dst);
+        if (inst.imm != 64) {
+            value = LLVMBuildTrunc(b, value, swapped_type, "");
+        }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        bool swap = is64 || !use_reg;
+#else
+        bool swap = is64 || use_reg;
+#endif
+        if (swap && inst.imm != 8) {
+            value = call_intrinsic(t, "llvm.bswap", swapped_type, &value, 1);
+        }
+        store_register(t, inst.dst, value);
+        return true;
+    }
+
+    LLVMValueRef dst = load_register(t, inst.dst);
+    LLVMValueRef src;
+    if (use_reg) {
+        src = load_register(t, inst.src);
+    } else {
+        src = LLVMConstInt(t->i64, (uint64_t)(int64_t)inst.imm, false);
+    }
+    if (!is64) {
+        dst = LLVMBuildTrunc(b, dst, type, "");
+        src = LLVMBuildTrunc(b, src, type, "");
+    }
+
+    LLVMValueRef shift = LLVMBuildAnd(b, src, LLVMConstInt(type, is64 ? 63 : 31, false), "");
+    LLVMValueRef result;
+    switch (op) {
+    case EBPF_ALU_OP_ADD:
+        result = LLVMBuildAdd(b, dst, src, "");
+        break;
+    case EBPF_ALU_OP_SUB:
+        result = LLVMBuildSub(b, dst, src, "");
+        break;
+    case EBPF_ALU_OP_MUL:
+        result = LLVMBuildMul(b, dst, src, "");
+        break;
+    case EBPF_ALU_OP_OR:
+        result = LLVMBuildOr(b, dst, src, "");
+        break;
+    case EBPF_ALU_OP_AND:
+        result = LLVMBuildAnd(b, dst, src, "");
+        break;
+    case EBPF_ALU_OP_XOR:
+        result = LLVMBuildXor(b, dst, src, "");
+        break;
+    case EBPF_ALU_OP_DIV:
+    case EBPF_ALU_OP_MOD:
+        result = emit_division(t, dst, src, inst.offset == 1, op == EBPF_ALU_OP_MOD);
+        break;
+    case EBPF_ALU_OP_LSH:
+        result = LLVMBuildShl(b, dst, shift, "");
+        break;
+    case EBPF_ALU_OP_RSH:
+        result = LLVMBuildLShr(b, dst, shift, "");
+        break;
+    case EBPF_ALU_OP_ARSH:
+        result = LLVMBuildAShr(b, dst, shift, "");
+        break;
+    case EBPF_ALU_OP_NEG:
+        result = LLVMBuildNeg(b, dst, "");
+        break;
+    case EBPF_ALU_OP_MOV:
+        if (use_reg && inst.offset != 0) {
+            // MOVSX: sign extend the low 8, 16 or 32 bits of the source.
+            LLVMValueRef narrow = LLVMBuildTrunc(b, src, LLVMIntTypeInContext(t->context, inst.offset), "");
+            result = LLVMBuildSExt(b, narrow, type, "");
+        } else {
+            result = src;
+        }
+        break;
+    default:
+        *errmsg = ubpf_error("unsupported ALU opcode 0x%02x", inst.opcode);
+        return false;
+    }
+    store_register(t, inst.dst, result);
+    return true;
+}
+
+static bool
+translate_conditional_jump(struct llvm_translation* t, struct ebpf_inst inst, uint32_t pc, char** errmsg)
+{
+    LLVMBuilderRef b = t->builder;
+    bool is32 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32;
+    bool use_reg = (inst.opcode & EBPF_SRC_REG) != 0;
+    LLVMValueRef lhs = load_register(t, inst.dst);
+    LLVMValueRef rhs = use_reg ? load_register(t, inst.src) : const_i64(t, (uint64_t)(int64_t)inst.imm);
+    if (is32) {
+        lhs = LLVMBuildTrunc(b, lhs, t->i32, "");
+        rhs = LLVMBuildTrunc(b, rhs, t->i32, "");
+    }
+
+    LLVMValueRef condition;
+    switch (inst.opcode & EBPF_JMP_OP_MASK) {
+    case EBPF_MODE_JEQ:
+        condition = LLVMBuildICmp(b, LLVMIntEQ, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JNE:
+        condition = LLVMBuildICmp(b, LLVMIntNE, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JGT:
+        condition = LLVMBuildICmp(b, LLVMIntUGT, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JGE:
+        condition = LLVMBuildICmp(b, LLVMIntUGE, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JLT:
+        condition = LLVMBuildICmp(b, LLVMIntULT, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JLE:
+        condition = LLVMBuildICmp(b, LLVMIntULE, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JSGT:
+        condition = LLVMBuildICmp(b, LLVMIntSGT, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JSGE:
+        condition = LLVMBuildICmp(b, LLVMIntSGE, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JSLT:
+        condition = LLVMBuildICmp(b, LLVMIntSLT, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JSLE:
+        condition = LLVMBuildICmp(b, LLVMIntSLE, lhs, rhs, "");
+        break;
+    case EBPF_MODE_JSET:
+        condition =
+            LLVMBuildICmp(b, LLVMIntNE, LLVMBuildAnd(b, lhs, rhs, ""), LLVMConstInt(LLVMTypeOf(lhs), 0, false), "");
+        break;
+    default:
+        *errmsg = ubpf_error("unsupported jump opcode 0x%02x at PC %u", inst.opcode, pc);
+        return false;
+    }
+    LLVMBuildCondBr(b, condition, t->blocks[pc + 1 + inst.offset], t->blocks[pc + 1]);
+    return true;
+}
+
+static bool
+translate_atomic(struct llvm_translation* t, struct ebpf_inst inst, LLVMValueRef address, char** errmsg)
+{
+    LLVMBuilderRef b = t->builder;
+    bool is64 = inst.opcode == EBPF_OP_ATOMIC_STORE;
+    LLVMTypeRef type = is64 ? t->i64 : t->i32;
+    LLVMValueRef pointer = LLVMBuildIntToPtr(b, address, LLVMPointerType(type, 0), "");
+    LLVMValueRef value = load_register(t, inst.src);
+    if (!is64) {
+        value = LLVMBuildTrunc(b, value, type, "");
+    }
+
+    LLVMAtomicRMWBinOp operation;
+    switch (inst.imm & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+        operation = LLVMAtomicRMWBinOpAdd;
+        break;
+    case EBPF_ALU_OP_OR:
+        operation = LLVMAtomicRMWBinOpOr;
+        break;
+    case EBPF_ALU_OP_AND:
+        operation = LLVMAtomicRMWBinOpAnd;
+        break;
+    case EBPF_ALU_OP_XOR:
+        operation = LLVMAtomicRMWBinOpXor;
+        break;
+    case (EBPF_ATOMIC_OP_XCHG & ~EBPF_ATOMIC_OP_FETCH):
+        operation = LLVMAtomicRMWBinOpXchg;
+        break;
+    case (EBPF_ATOMIC_OP_CMPXCHG & ~EBPF_ATOMIC_OP_FETCH): {
+        // The value that was found in memory is always returned in r0.
+        LLVMValueRef expected = load_register(t, 0);
+        if (!is64) {
+            expected = LLVMBuildTrunc(b, expected, type, "");
+        }
+        LLVMValueRef exchange = LLVMBuildAtomicCmpXchg(
+            b,
+            pointer,
+            expected,
+            value,
+            LLVMAtomicOrderingSequentiallyConsistent,
+            LLVMAtomicOrderingSequentiallyConsistent,
+            false);
+        store_register(t, 0, LLVMBuildExtractValue(b, exchange, 0, ""));
+        return true;
+    }
+    default:
+        *errmsg = ubpf_error("unsupported atomic operation 0x%x", inst.imm);
+        return false;
+    }
+
+    LLVMValueRef old = LLVMBuildAtomicRMW(b, operation, pointer, value, LLVMAtomicOrderingSequentiallyConsistent, false);
+    if (inst.imm & EBPF_ATOMIC_OP_FETCH) {
+        store_register(t, inst.src, old);
+    }
+    return true;
+}
+
+// Call helper idx through the VM's struct ubpf_jit_data, which may change at any time.
+static void
+translate_helper_call(struct llvm_translation* t, struct ebpf_inst inst)
+{
+    LLVMBuilderRef b = t->builder;
+    struct ubpf_jit_data* data = t->vm->jit_data;
+    LLVMValueRef args[7];
+    for (int r = 1; r <= 5; r++) {
+        args[r - 1] = load_register(t, r);
+    }
+    LLVMValueRef context = LLVMBuildIntToPtr(b, t->mem, LLVMPointerType(t->i8, 0), "");
+
+    LLVMValueRef dispatcher = LLVMBuildLoad2(b, t->i64, host_pointer(t, &data->dispatcher, t->i64), "");
+    LLVMSetOrdering(dispatcher, LLVMAtomicOrderingMonotonic);
+    LLVMSetAlignment(dispatcher, sizeof(uint64_t));
+    LLVMBasicBlockRef external = LLVMAppendBasicBlockInContext(t->context, t->function, "dispatcher");
+    LLVMBasicBlockRef helper = LLVMAppendBasicBlockInContext(t->context, t->function, "helper");
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(t->context, t->function, "");
+    LLVMBuildCondBr(b, LLVMBuildICmp(b, LLVMIntNE, dispatcher, const_i64(t, 0), ""), external, helper);
+
+    LLVMPositionBuilderAtEnd(b, external);
+    LLVMTypeRef dispatcher_params[] = {
+        t->i64, t->i64, t->i64, t->i64, t->i64, t->i32, LLVMPointerType(t->i8, 0)};
+    LLVMTypeRef dispatcher_type = LLVMFunctionType(t->i64, dispatcher_params, 7, false);
+    args[5] = const_i32(t, (uint32_t)inst.imm);
+    args[6] = context;
+    LLVMValueRef dispatched = LLVMBuildCall2(
+        b,
+        dispatcher_type,
+        LLVMBuildIntToPtr(b, dispatcher, LLVMPointerType(dispatcher_type, 0), ""),
+        args,
+        7,
+        "");
+    LLVMBuildBr(b, done);
+
+    LLVMPositionBuilderAtEnd(b, helper);
+    LLVMTypeRef helper_params[] = {t->i64, t->i64, t->i64, t->i64, t->i64, LLVMPointerType(t->i8, 0)};
+    LLVMTypeRef helper_type = LLVMFunctionType(t->i64, helper_params, 6, false);
+    LLVMValueRef function =
+        LLVMBuildLoad2(b, t->i64, host_pointer(t, &data->helpers[inst.imm % MAX_EXT_FUNCS], t->i64), "");
+    LLVMSetOrdering(function, LLVMAtomicOrderingMonotonic);
+    LLVMSetAlignment(function, sizeof(uint64_t));
+    args[5] = context;
+    LLVMValueRef called = LLVMBuildCall2(
+        b, helper_type, LLVMBuildIntToPtr(b, function, LLVMPointerType(helper_type, 0), ""), args, 6, "");
+    LLVMBuildBr(b, done);
+
+    LLVMPositionBuilderAtEnd(b, done);
+    LLVMValueRef result = LLVMBuildPhi(b, t->i64, "");
+    LLVMValueRef values[] = {dispatched, called};
+    LLVMBasicBlockRef blocks[] = {external, helper};
+    LLVMAddIncoming(result, values, blocks, 2);
+    store_register(t, 0, result);
+
+    if (inst.imm == t->vm->unwind_stack_extension_index) {
+        LLVMBasicBlockRef unwind = LLVMAppendBasicBlockInContext(t->context, t->function, "unwind");
+        LLVMBasicBlockRef next = LLVMAppendBasicBlockInContext(t->context, t->function, "");
+        LLVMBuildCondBr(b, LLVMBuildICmp(b, LLVMIntEQ, result, const_i64(t, 0), ""), unwind, next);
+        LLVMPositionBuilderAtEnd(b, unwind);
+        LLVMBuildRet(b, const_i64(t, 0));
+        LLVMPositionBuilderAtEnd(b, next);
+    }
+}
+
+// Pointer to element index of the frame array (of element_type) at base.
+static LLVMValueRef
+frame_element(struct llvm_translation* t, LLVMValueRef base, LLVMTypeRef array_type, LLVMValueRef depth, int index)
+{
+    LLVMValueRef indices[3] = {const_i32(t, 0), depth, const_i32(t, index)};
+    return LLVMBuildGEP2(t->builder, array_type, base, indices, index < 0 ? 2 : 3, "");
+}
+
+static void
+translate_local_call(struct llvm_translation* t, struct ebpf_inst inst, uint32_t pc, uint32_t function_start)
+{
+    LLVMBuilderRef b = t->builder;
+    LLVMTypeRef saved_type = LLVMArrayType(LLVMArrayType(t->i64, 4), UBPF_MAX_CALL_DEPTH);
+    LLVMTypeRef usage_type = LLVMArrayType(t->i64, UBPF_MAX_CALL_DEPTH);
+    LLVMTypeRef return_type = LLVMArrayType(t->i32, UBPF_MAX_CALL_DEPTH);
+
+    LLVMValueRef depth = LLVMBuildLoad2(b, t->i32, t->depth, "");
+    LLVMBasicBlockRef too_deep = LLVMAppendBasicBlockInContext(t->context, t->function, "call_depth");
+    LLVMBasicBlockRef call = LLVMAppendBasicBlockInContext(t->context, t->function, "");
+    LLVMBuildCondBr(b, LLVMBuildICmp(b, LLVMIntUGE, depth, const_i32(t, UBPF_MAX_CALL_DEPTH), ""), too_deep, call);
+    LLVMPositionBuilderAtEnd(b, too_deep);
+    emit_stop(t, UBPF_JIT_STOP_CALL_DEPTH);
+
+    // The caller's stack usage is known here; the callee's frame lies below it.
+    LLVMPositionBuilderAtEnd(b, call);
+    uint16_t usage = ubpf_stack_usage_for_local_func(t->vm, (uint16_t)function_start);
+    for (int i = 0; i < 4; i++) {
+        LLVMBuildStore(b, load_register(t, 6 + i), frame_element(t, t->saved, saved_type, depth, i));
+    }
+    LLVMBuildStore(b, const_i64(t, usage), frame_element(t, t->stack_usage, usage_type, depth, -1));
+    LLVMBuildStore(b, const_i32(t, pc + 1), frame_element(t, t->return_pc, return_type, depth, -1));
+    LLVMBuildStore(b, LLVMBuildAdd(b, depth, const_i32(t, 1), ""), t->depth);
+    store_register(t, 10, LLVMBuildSub(b, load_register(t, 10), const_i64(t, usage), ""));
+    LLVMBuildBr(b, t->blocks[pc + 1 + inst.imm]);
+}
+
+static bool
+translate_instruction(
+    struct llvm_translation* t, uint32_t pc, struct ebpf_inst inst, uint32_t function_start, char** errmsg)
+{
+    LLVMBuilderRef b = t->builder;
+    uint8_t class = inst.opcode & EBPF_CLS_MASK;
+
+    switch (class) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        return translate_alu(t, inst, errmsg);
+
+    case EBPF_CLS_LD: {
+        struct ebpf_inst next = ubpf_fetch_instruction(t->vm, pc + 1);
+        store_register(t, inst.dst, const_i64(t, (uint32_t)inst.imm | ((uint64_t)(uint32_t)next.imm << 32)));
+        return true;
+    }
+
+    case EBPF_CLS_LDX:
+    case EBPF_CLS_ST:
+    case EBPF_CLS_STX: {
+        int size = access_size(inst.opcode);
+        LLVMTypeRef type = LLVMIntTypeInContext(t->context, size * 8);
+        int base = class == EBPF_CLS_LDX ? inst.src : inst.dst;
+        LLVMValueRef address =
+            LLVMBuildAdd(b, load_register(t, base), const_i64(t, (uint64_t)(int64_t)inst.offset), "");
+        emit_access_check(t, address, size, pc);
+        if (class != EBPF_CLS_LDX && (inst.opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+            return translate_atomic(t, inst, address, errmsg);
+        }
+        LLVMValueRef pointer = LLVMBuildIntToPtr(b, address, LLVMPointerType(type, 0), "");
+        if (class == EBPF_CLS_LDX) {
+            LLVMValueRef value = LLVMBuildLoad2(b, type, pointer, "");
+            LLVMSetAlignment(value, 1);
+            if ((inst.opcode & 0xe0) == EBPF_MODE_MEMSX) {
+                value = LLVMBuildSExt(b, value, t->i64, "");
+            }
+            store_register(t, inst.dst, value);
+        } else {
+            LLVMValueRef value =
+                class == EBPF_CLS_STX ? load_register(t, inst.src) : const_i64(t, (uint64_t)(int64_t)inst.imm);
+            if (size != 8) {
+                value = LLVMBuildTrunc(b, value, type, "");
+            }
+            LLVMSetAlignment(LLVMBuildStore(b, value, pointer), 1);
+        }
+        return true;
+    }
+
+    case EBPF_CLS_JMP:
+    case EBPF_CLS_JMP32:
+        break;
+
+    default:
+        *errmsg = ubpf_error("unsupported opcode 0x%02x at PC %u", inst.opcode, pc);
+        return false;
+    }
+
+    switch (inst.opcode) {
+    case EBPF_OP_JA:
+        LLVMBuildBr(b, t->blocks[pc + 1 + inst.offset]);
+        return true;
+    case EBPF_OP_JA32:
+        LLVMBuildBr(b, t->blocks[pc + 1 + inst.imm]);
+        return true;
+    case EBPF_OP_EXIT:
+        if (t->has_local_calls) {
+            LLVMBuildBr(b, t->exit_function);
+        } else {
+            LLVMBuildRet(b, load_register(t, 0));
+        }
+        return true;
+    case EBPF_OP_CALL:
+        if (inst.src == 0) {
+            translate_helper_call(t, inst);
+            return true;
+        }
+        if (inst.src == 1) {
+            translate_local_call(t, inst, pc, function_start);
+            return true;
+        }
+        *errmsg = ubpf_error("unsupported call type %d at PC %u", inst.src, pc);
+        return false;
+    default:
+        return translate_conditional_jump(t, inst, pc, errmsg);
+    }
+}
+
+// Mark the first instruction of every basic block.
+static void
+find_leaders(struct llvm_translation* t)
+{
+    struct ubpf_vm* vm = t->vm;
+    t->is_leader[0] = true;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        uint8_t class = inst.opcode & EBPF_CLS_MASK;
+        if (vm->int_funcs[pc]) {
+            t->is_leader[pc] = true;
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+            continue;
+        }
+        if (class != EBPF_CLS_JMP && class != EBPF_CLS_JMP32) {
+            continue;
+        }
+        if (inst.opcode == EBPF_OP_CALL) {
+            if (inst.src == 1) {
+                t->has_local_calls = true;
+                t->is_leader[pc + 1 + inst.imm] = true;
+                t->is_leader[pc + 1] = true;
+            }
+            continue;
+        }
+        t->is_leader[pc + 1] = true;
+        if (inst.opcode != EBPF_OP_EXIT) {
+            t->is_leader[pc + 1 + (inst.opcode == EBPF_OP_JA32 ? inst.imm : inst.offset)] = true;
+        }
+    }
+}
+
+// The number of instructions the interpreter executes in the basic block starting at pc.
+static uint32_t
+basic_block_size(struct llvm_translation* t, uint32_t pc)
+{
+    uint32_t size = 0;
+    do {
+        struct ebpf_inst inst = ubpf_fetch_instruction(t->vm, pc);
+        size++;
+        pc += inst.opcode == EBPF_OP_LDDW ? 2 : 1;
+    } while (pc < t->vm->num_insts && !t->is_leader[pc]);
+    return size;
+}
+
+static void
+emit_instruction_limit_charge(struct llvm_translation* t, uint32_t count)
+{
+    LLVMBuilderRef b = t->builder;
+    LLVMValueRef fuel = LLVMBuildSub(b, LLVMBuildLoad2(b, t->i64, t->fuel, ""), const_i64(t, count), "");
+    LLVMBuildStore(b, fuel, t->fuel);
+    LLVMBasicBlockRef out_of_fuel = LLVMAppendBasicBlockInContext(t->context, t->function, "instruction_limit");
+    LLVMBasicBlockRef next = LLVMAppendBasicBlockInContext(t->context, t->function, "");
+    LLVMBuildCondBr(b, LLVMBuildICmp(b, LLVMIntSLT, fuel, const_i64(t, 0), ""), out_of_fuel, next);
+    LLVMPositionBuilderAtEnd(b, out_of_fuel);
+    emit_stop(t, UBPF_JIT_STOP_INSTRUCTION_LIMIT);
+    LLVMPositionBuilderAtEnd(b, next);
+}
+
+// EXIT from a local function restores the caller's registers and stack pointer and
+// continues after its call instruction.
+static void
+emit_exit_function(struct llvm_translation* t)
+{
+    LLVMBuilderRef b = t->builder;
+    LLVMTypeRef saved_type = LLVMArrayType(LLVMArrayType(t->i64, 4), UBPF_MAX_CALL_DEPTH);
+    LLVMTypeRef usage_type = LLVMArrayType(t->i64, UBPF_MAX_CALL_DEPTH);
+    LLVMTypeRef return_type = LLVMArrayType(t->i32, UBPF_MAX_CALL_DEPTH);
+
+    LLVMPositionBuilderAtEnd(b, t->exit_function);
+    LLVMValueRef depth = LLVMBuildLoad2(b, t->i32, t->depth, "");
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(t->context, t->function, "done");
+    LLVMBasicBlockRef restore = LLVMAppendBasicBlockInContext(t->context, t->function, "return");
+    LLVMBuildCondBr(b, LLVMBuildICmp(b, LLVMIntEQ, depth, const_i32(t, 0), ""), done, restore);
+    LLVMPositionBuilderAtEnd(b, done);
+    LLVMBuildRet(b, load_register(t, 0));
+
+    LLVMPositionBuilderAtEnd(b, restore);
+    depth = LLVMBuildSub(b, depth, const_i32(t, 1), "");
+    LLVMBuildStore(b, depth, t->depth);
+    for (int i = 0; i < 4; i++) {
+        store_register(
+            t, 6 + i, LLVMBuildLoad2(b, t->i64, frame_element(t, t->saved, saved_type, depth, i), ""));
+    }
+    LLVMValueRef usage = LLVMBuildLoad2(b, t->i64, frame_element(t, t->stack_usage, usage_type, depth, -1), "");
+    store_register(t, 10, LLVMBuildAdd(b, load_register(t, 10), usage, ""));
+    LLVMValueRef return_pc = LLVMBuildLoad2(b, t->i32, frame_element(t, t->return_pc, return_type, depth, -1), "");
+
+    unsigned cases = 0;
+    for (uint32_t pc = 0; pc < t->vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(t->vm, pc);
+        cases += inst.opcode == EBPF_OP_CALL && inst.src == 1;
+    }
+    LLVMValueRef dispatch = LLVMBuildSwitch(b, return_pc, t->fail, cases);
+    for (uint32_t pc = 0; pc < t->vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(t->vm, pc);
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+            LLVMAddCase(dispatch, const_i32(t, pc + 1), t->blocks[pc + 1]);
+        }
+    }
+}
+
+static bool
+build_function(struct llvm_translation* t, char** errmsg)
+{
+    struct ubpf_vm* vm = t->vm;
+    LLVMBuilderRef b = t->builder;
+
+    // uint64_t (void* mem, size_t mem_len, uint8_t* stack, size_t stack_len), as ubpf_jit_ex_fn.
+    LLVMTypeRef i8_pointer = LLVMPointerType(t->i8, 0);
+    LLVMTypeRef params[] = {i8_pointer, t->i64, i8_pointer, t->i64};
+    LLVMTypeRef type = LLVMFunctionType(t->i64, params, 4, false);
+    t->function = LLVMAddFunction(t->module, UBPF_LLVM_ENTRY_NAME, type);
+
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(t->context, t->function, "entry");
+    LLVMPositionBuilderAtEnd(b, entry);
+    t->mem = LLVMBuildPtrToInt(b, LLVMGetParam(t->function, 0), t->i64, "mem");
+    t->mem_len = LLVMGetParam(t->function, 1);
+    t->stack = LLVMBuildPtrToInt(b, LLVMGetParam(t->function, 2), t->i64, "stack");
+    t->stack_len = LLVMGetParam(t->function, 3);
+
+    for (int r = 0; r <= BPF_REG_10; r++) {
+        char name[8];
+        snprintf(name, sizeof(name), "r%d", r);
+        t->registers[r] = LLVMBuildAlloca(b, t->i64, name);
+    }
+    for (int r = 0; r <= BPF_REG_10; r++) {
+        LLVMValueRef value = const_i64(t, 0);
+        if (r == 1) {
+            value = t->mem;
+        } else if (r == 2) {
+            value = t->mem_len;
+        } else if (r == 10) {
+            value = LLVMBuildAdd(b, t->stack, t->stack_len, "");
+        }
+        store_register(t, r, value);
+    }
+    if (ubpf_counts_instructions(vm)) {
+        t->fuel = LLVMBuildAlloca(b, t->i64, "fuel");
+        LLVMBuildStore(b, const_i64(t, (uint32_t)vm->instruction_limit), t->fuel);
+    }
+    if (t->has_local_calls) {
+        t->depth = LLVMBuildAlloca(b, t->i32, "depth");
+        t->saved = LLVMBuildAlloca(b, LLVMArrayType(LLVMArrayType(t->i64, 4), UBPF_MAX_CALL_DEPTH), "saved");
+        t->stack_usage = LLVMBuildAlloca(b, LLVMArrayType(t->i64, UBPF_MAX_CALL_DEPTH), "stack_usage");
+        t->return_pc = LLVMBuildAlloca(b, LLVMArrayType(t->i32, UBPF_MAX_CALL_DEPTH), "return_pc");
+        LLVMBuildStore(b, const_i32(t, 0), t->depth);
+        t->exit_function = LLVMAppendBasicBlockInContext(t->context, t->function, "exit_function");
+    }
+    t->fail = LLVMAppendBasicBlockInContext(t->context, t->function, "fail");
+    if (vm->bounds_check_enabled && vm->proven_accesses != NULL) {
+        emit_context_size_check(t);
+    }
+
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        if (t->is_leader[pc]) {
+            char name[16];
+            snprintf(name, sizeof(name), "L%u", pc);
+            t->blocks[pc] = LLVMAppendBasicBlockInContext(t->context, t->function, name);
+        }
+    }
+
+    uint32_t function_start = 0;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (vm->int_funcs[pc]) {
+            function_start = pc;
+        }
+        if (t->is_leader[pc]) {
+            enter_block(t, t->blocks[pc]);
+            if (ubpf_counts_instructions(vm)) {
+                emit_instruction_limit_charge(t, basic_block_size(t, pc));
+            }
+        }
+        if (!translate_instruction(t, pc, inst, function_start, errmsg)) {
+            return false;
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+    // A program that runs past its last instruction fails, as in the interpreter.
+    if (LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(b)) == NULL) {
+        LLVMBuildBr(b, t->fail);
+    }
+
+    if (t->has_local_calls) {
+        emit_exit_function(t);
+    }
+    LLVMPositionBuilderAtEnd(b, t->fail);
+    LLVMBuildRet(b, const_i64(t, UINT64_MAX));
+
+    char* message = NULL;
+    if (LLVMVerifyFunction(t->function, LLVMReturnStatusAction)) {
+        LLVMVerifyModule(t->module, LLVMReturnStatusAction, &message);
+        *errmsg = ubpf_error("internal uBPF error: invalid LLVM IR: %s", message ? message : "");
+        LLVMDisposeMessage(message);
+        return false;
+    }
+    return true;
+}
+
+static char*
+take_llvm_error(LLVMErrorRef error, const char* what)
+{
+    char* message = LLVMGetErrorMessage(error);
+    char* result = ubpf_error("%s: %s", what, message);
+    LLVMDisposeErrorMessage(message);
+    return result;
+}
+
+// Run the O2 pipeline for the host processor.
+static bool
+optimize_module(LLVMModuleRef module, char** errmsg)
+{
+    char* triple = LLVMGetDefaultTargetTriple();
+    char* error = NULL;
+    LLVMTargetRef target;
+    if (LLVMGetTargetFromTriple(triple, &target, &error)) {
+        *errmsg = ubpf_error("cannot find the LLVM target for %s: %s", triple, error);
+        LLVMDisposeMessage(error);
+        LLVMDisposeMessage(triple);
+        return false;
+    }
+    char* cpu = LLVMGetHostCPUName();
+    char* features = LLVMGetHostCPUFeatures();
+    LLVMTargetMachineRef machine = LLVMCreateTargetMachine(
+        target, triple, cpu, features, LLVMCodeGenLevelDefault, LLVMRelocDefault, LLVMCodeModelJITDefault);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(features);
+
+    LLVMSetTarget(module, triple);
+    LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(machine);
+    LLVMSetModuleDataLayout(module, layout);
+    LLVMDisposeTargetData(layout);
+    LLVMDisposeMessage(triple);
+
+    LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+    LLVMErrorRef result = LLVMRunPasses(module, "default<O2>", machine, options);
+    LLVMDisposePassBuilderOptions(options);
+    LLVMDisposeTargetMachine(machine);
+    if (result) {
+        *errmsg = take_llvm_error(result, "cannot optimize the program");
+        return false;
+    }
+    return true;
+}
+
+ubpf_jit_ex_fn
+ubpf_compile_llvm(struct ubpf_vm* vm, char** errmsg)
+{
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    struct llvm_translation t = {.vm = vm};
+    ubpf_jit_ex_fn fn = NULL;
+    LLVMOrcThreadSafeContextRef thread_safe_context = LLVMOrcCreateNewThreadSafeContext();
+    t.context = LLVMOrcThreadSafeContextGetContext(thread_safe_context);
+    t.module = LLVMModuleCreateWithNameInContext("ubpf", t.context);
+    t.builder = LLVMCreateBuilderInContext(t.context);
+    t.i8 = LLVMInt8TypeInContext(t.context);
+    t.i32 = LLVMInt32TypeInContext(t.context);
+    t.i64 = LLVMInt64TypeInContext(t.context);
+    t.is_leader = calloc(vm->num_insts + 1, sizeof(*t.is_leader));
+    t.blocks = calloc(vm->num_insts + 1, sizeof(*t.blocks));
+    LLVMOrcLLJITRef jit = NULL;
+
+    if (t.is_leader == NULL || t.blocks == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+    find_leaders(&t);
+    if (!build_function(&t, errmsg) || !optimize_module(t.module, errmsg)) {
+        goto out;
+    }
+
+    LLVMErrorRef error = LLVMOrcCreateLLJIT(&jit, LLVMOrcCreateLLJITBuilder());
+    if (error) {
+        *errmsg = take_llvm_error(error, "cannot create the LLVM JIT");
+        jit = NULL;
+        goto out;
+    }
+    // The JIT takes the module.
+    LLVMOrcThreadSafeModuleRef thread_safe_module = LLVMOrcCreateNewThreadSafeModule(t.module, thread_safe_context);
+    t.module = NULL;
+    error = LLVMOrcLLJITAddLLVMIRModule(jit, LLVMOrcLLJITGetMainJITDylib(jit), thread_safe_module);
+    if (error) {
+        LLVMOrcDisposeThreadSafeModule(thread_safe_module);
+        *errmsg = take_llvm_error(error, "cannot add the program to the LLVM JIT");
+        goto out;
+    }
+    LLVMOrcExecutorAddress address = 0;
+    error = LLVMOrcLLJITLookup(jit, &address, UBPF_LLVM_ENTRY_NAME);
+    if (error) {
+        *errmsg = take_llvm_error(error, "cannot compile the program with LLVM");
+        goto out;
+    }
+
+    fn = (ubpf_jit_ex_fn)(uintptr_t)address;
+    vm->llvm_jit = jit;
+    jit = NULL;
+
+out:
+    if (jit != NULL) {
+        LLVMOrcDisposeLLJIT(jit);
+    }
+    LLVMDisposeBuilder(t.builder);
+    if (t.module != NULL) {
+        LLVMDisposeModule(t.module);
+    }
+    LLVMOrcDisposeThreadSafeContext(thread_safe_context);
+    free(t.is_leader);
+    free(t.blocks);
+    return fn;
+}
+
+void
+ubpf_release_llvm_jit(struct ubpf_vm* vm)
+{
+    if (vm->llvm_jit) {
+        LLVMOrcDisposeLLJIT(vm->llvm_jit);
+        vm->llvm_jit = NULL;
+    }
+}
+
+#else
+
+ubpf_jit_ex_fn
+ubpf_compile_llvm(struct ubpf_vm* vm, char** errmsg)
+{
+    (void)vm;
+    *errmsg = ubpf_error("uBPF was built without the LLVM JIT (see UBPF_ENABLE_LLVM_JIT)");
+    return NULL;
+}
+
+void
+ubpf_release_llvm_jit(struct ubpf_vm* vm)
+{
+    (void)vm;
+}
+
+#endif
@@ -0,0 +1,1910 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * MIPS64 Release 6 (little-endian, n64 ABI) JIT backend. It follows the arm64 JIT
+ * (ubpf_jit_arm64.c) and the riscv64 JIT (ubpf_jit_riscv64.c) closely: the same code
+ * layout, invariants and handling of helpers, local calls and jumps.
+ *
+ * References:
+ * [MIPS64-ISA]: MIPS64 Architecture for Programmers Volume II: The MIPS64 Instruction Set
+ *               Reference Manual, Revision 6.06
+ * [MIPS-N64]: MIPSpro N32 and N64 ABI Handbook (the n64 calling convention)
+ *
+ * The register mapping, the LL/SC atomics and the JMP32 canonicalization are those of
+ * docs/specs/jit-mips.md. Where the code departs from that draft, and why:
+ * - Temps: T0-T3 ($12-$15 in the n64 ABI, the draft's $t4-$t7) plus T8 for copied
+ *   comparison operands and far jumps and T9 for helper addresses, which PIC helpers
+ *   expect to find their own address in.
+ * - S5 holds the address of the VM's struct ubpf_jit_data, which the entry stub passes
+ *   in T8 (ubpf_jit_entry_mips64), instead of a helper table base that the prologue
+ *   finds with a BALC. The code holds no data and no absolute addresses (§4.1, §9).
+ * - ALU32 results are zero-extended with DEXT (one instruction) rather than with a
+ *   DSLL32/DSRL32 pair (§3.2).
+ * - Division and modulo by zero and INT_MIN / -1 are handled with SELNEZ/SELEQZ, not
+ *   with branches; the draft's BNEC src, $zero encodes BNEZALC, not a branch (§3.3).
+ * - BE16/BE32/BE64 use DSBH (and DSHD) followed by a mask or a shift instead of WSBH
+ *   and ROTR (§3.5).
+ * - Immediates are built with LUI/ORI and then DAHI/DATI (at most 4 instructions), not
+ *   LUI/ORI/DSLL (up to 6), also when blinded (§3.9, §5.1, §8.1).
+ * - An out-of-range conditional branch is inverted around a jump as in the draft, but a
+ *   jump that a BC does not reach either becomes an AUIPC and a JIC (§3.10).
+ * - The LL/SC loops use T1 for the loaded value and T8 for the stored one (§3.11).
+ * - RA is pushed on the native stack around each helper call and each local call;
+ *   there are no helper_ra_save or per-depth ra_slot_offset slots. R6-R9 and the
+ *   stack usage of the caller are saved on the native stack too (§3.12, §7).
+ * - Helper calls use JIALC through T9 (§3.12).
+ * - A NOP is emitted where an instruction would otherwise land in the forbidden slot
+ *   of a compact branch, which the draft does not account for (see avoid_forbidden_slot).
+ * - The instruction cache is synchronized with __builtin___clear_cache in ubpf_jit.c
+ *   rather than a hand-written SYNCI loop (§5.2).
+ */
+
+#include <stdint.h>
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "ubpf_int.h"
+#include "ubpf_jit_support.h"
+
+#if !defined(_countof)
+#define _countof(array) (sizeof(array) / sizeof(array[0]))
+#endif
+
+// All MIPS64 integer registers by their n64 ABI names.
+enum Registers
+{
+    ZERO,
+    AT,
+    V0,
+    V1,
+    A0,
+    A1,
+    A2,
+    A3,
+    A4,
+    A5,
+    A6,
+    A7,
+    T0,
+    T1,
+    T2,
+    T3,
+    S0,
+    S1,
+    S2,
+    S3,
+    S4,
+    S5,
+    S6,
+    S7,
+    T8,
+    T9,
+    K0,
+    K1,
+    GP,
+    SP,
+    FP,
+    RA,
+};
+
+// Callee saved registers that the JIT'd code may use (FP is saved with the return address).
+static const enum Registers callee_saved_registers[] = {S0, S1, S2, S3, S4, S5, S6};
+// Temp register for immediate generation
+static const enum Registers temp_register = T0;
+// Temp register for division and comparison operands
+static const enum Registers temp_div_register = T1;
+// Temp register for load/store offsets, comparison operands and atomic addresses
+static const enum Registers offset_register = T2;
+// Temp register that constant blinding uses to recover a blinded immediate.
+static const enum Registers blinding_register = T3;
+// Temp register for a copied comparison operand and the address of a jump that does not
+// reach its target.
+static const enum Registers scratch_register = T8;
+// The address of a helper. Position-independent code expects its own address in T9.
+static const enum Registers call_register = T9;
+// Special register for the address of the VM's struct ubpf_jit_data (passed in T8 at entry).
+static const enum Registers JIT_DATA = S5;
+// Special register for external dispatcher context.
+static const enum Registers VOLATILE_CTXT = S6;
+
+// Number of eBPF registers
+#define REGISTER_MAP_SIZE 11
+
+// Register assignments:
+//   BPF        MIPS64      Usage
+//   r0         v0          Return value from calls
+//   r1 - r5    a0 - a4     Function parameters, caller-saved
+//   r6 - r10   s0 - s4     Callee-saved registers
+//              s5          The address of the VM's struct ubpf_jit_data
+//              s6          The context of the external dispatcher
+//              t0 - t3     Temps - used for immediates, divisions, offsets and blinding
+//              t8, t9      Temps - used for comparison operands, jumps and helper addresses
+//
+// Unlike on arm64 and riscv64, the result register of the n64 ABI (v0) is not an
+// argument register, so r0 lives there and needs no moves around calls.
+static const enum Registers register_map[REGISTER_MAP_SIZE] = {
+    V0, // result
+    A0,
+    A1,
+    A2,
+    A3,
+    A4, // parameters
+    S0,
+    S1,
+    S2,
+    S3,
+    S4, // callee-saved
+};
+
+/* Return the MIPS64 register for the given eBPF register */
+static enum Registers
+map_register(int r)
+{
+    assert(r < REGISTER_MAP_SIZE);
+    return register_map[r % REGISTER_MAP_SIZE];
+}
+
+static uint32_t inline align_to(uint32_t amount, uint64_t boundary)
+{
+    return (amount + (boundary - 1)) & ~(boundary - 1);
+}
+
+/* Whether value fits in a signed 16-bit immediate (DADDIU, loads and stores). */
+static bool
+is_simm16(int64_t value)
+{
+    return value >= -32768 && value < 32768;
+}
+
+/* Whether value fits in an unsigned 16-bit immediate (ANDI, ORI, XORI). */
+static bool
+is_uimm16(int64_t value)
+{
+    return value >= 0 && value <= 0xffff;
+}
+
+/* Whether a word offset fits in a signed field of the given number of bits. */
+static bool
+fits_offset(int64_t offset, unsigned bits)
+{
+    return offset >= -(INT64_C(1) << (bits - 1)) && offset < (INT64_C(1) << (bits - 1));
+}
+
+static void
+emit_bytes(struct jit_state* state, void* data, uint32_t len)
+{
+    if (!(len <= state->size && state->offset <= state->size - len)) {
+        state->jit_status = NotEnoughSpace;
+        return;
+    }
+
+    memcpy(state->buf + state->offset, data, len);
+    state->offset += len;
+}
+
+static void
+emit_instruction(struct jit_state* state, uint32_t instr)
+{
+    emit_bytes(state, &instr, 4);
+}
+
+/* [MIPS64-ISA]: Table A.2: The major opcodes (bits 31..26), with the Release 6 ones. */
+enum MajorOpcode
+{
+    OPC_SPECIAL = 0x00,
+    OPC_REGIMM = 0x01,
+    OPC_POP06 = 0x06, // BGEUC
+    OPC_POP07 = 0x07, // BLTUC
+    OPC_POP10 = 0x08, // BEQC
+    OPC_ANDI = 0x0c,
+    OPC_ORI = 0x0d,
+    OPC_XORI = 0x0e,
+    OPC_LUI = 0x0f,
+    OPC_POP26 = 0x16, // BGEC
+    OPC_POP27 = 0x17, // BLTC
+    OPC_POP30 = 0x18, // BNEC
+    OPC_DADDIU = 0x19,
+    OPC_SPECIAL3 = 0x1f,
+    OPC_LB = 0x20,
+    OPC_LH = 0x21,
+    OPC_LW = 0x23,
+    OPC_LBU = 0x24,
+    OPC_LHU = 0x25,
+    OPC_LWU = 0x27,
+    OPC_SB = 0x28,
+    OPC_SH = 0x29,
+    OPC_SW = 0x2b,
+    OPC_BC = 0x32,
+    OPC_POP66 = 0x36, // BEQZC, JIC
+    OPC_LD = 0x37,
+    OPC_BALC = 0x3a,
+    OPC_PCREL = 0x3b, // AUIPC
+    OPC_POP76 = 0x3e, // BNEZC, JIALC
+    OPC_SD = 0x3f,
+};
+
+/* The function field of the SPECIAL register-register operations. The multiplications and
+ * divisions of Release 6 also set the shift amount field (to 2, or to 3 for the remainders),
+ * which is in the high bits here.
+ */
+enum ALUOpcode
+{
+    ALU_SLL = 0x00,
+    ALU_SRL = 0x02,
+    ALU_SRA = 0x03,
+    ALU_SLLV = 0x04,
+    ALU_SRLV = 0x06,
+    ALU_SRAV = 0x07,
+    ALU_SYNC = 0x0f,
+    ALU_DSLLV = 0x14,
+    ALU_DSRLV = 0x16,
+    ALU_DSRAV = 0x17,
+    ALU_DIV = 0x09a,
+    ALU_MOD = 0x0da,
+    ALU_DIVU = 0x09b,
+    ALU_MODU = 0x0db,
+    ALU_DMUL = 0x09c,
+    ALU_DDIV = 0x09e,
+    ALU_DMOD = 0x0de,
+    ALU_DDIVU = 0x09f,
+    ALU_DMODU = 0x0df,
+    ALU_AND = 0x24,
+    ALU_OR = 0x25,
+    ALU_XOR = 0x26,
+    ALU_DADDU = 0x2d,
+    ALU_DSUBU = 0x2f,
+    ALU_SELEQZ = 0x35,
+    ALU_SELNEZ = 0x37,
+    ALU_DSLL = 0x38,
+    ALU_DSRL = 0x3a,
+    ALU_DSRA = 0x3b,
+    ALU_DSLL32 = 0x3c,
+    ALU_DSRL32 = 0x3e,
+    ALU_DSRA32 = 0x3f,
+};
+
+/* rd = rs op rt ([MIPS64-ISA]: the SPECIAL format). */
+static void
+emit_alu_register(struct jit_state* state, enum ALUOpcode op, enum Registers rd, enum Registers rs, enum Registers rt)
+{
+    emit_instruction(
+        state, (OPC_SPECIAL << 26) | (rs << 21) | (rt << 16) | (rd << 11) | ((op >> 6) << 6) | (op & 0x3f));
+}
+
+/* An I-type instruction: the major opcode, two registers and a 16-bit immediate. */
+static void
+emit_itype(struct jit_state* state, enum MajorOpcode opcode, enum Registers rt, enum Registers rs, uint32_t imm16)
+{
+    emit_instruction(state, ((uint32_t)opcode << 26) | (rs << 21) | (rt << 16) | (imm16 & 0xffff));
+}
+
+/* ANDI, ORI and XORI zero-extend their immediate; DADDIU sign-extends it. */
+static void
+emit_alu_immediate(struct jit_state* state, enum MajorOpcode opcode, enum Registers rt, enum Registers rs, int32_t imm)
+{
+    assert(opcode == OPC_DADDIU ? is_simm16(imm) : is_uimm16(imm));
+    emit_itype(state, opcode, rt, rs, (uint32_t)imm);
+}
+
+enum ShiftOpcode
+{
+    SHIFT_SLL,
+    SHIFT_SRL,
+    SHIFT_SRA,
+};
+
+/*
+ * DSLL, DSRL and DSRA (DSLL32, ... for amounts of 32 or more) or, if sixty_four is false,
+ * SLL, SRL and SRA, which shift the low 32 bits and sign-extend. SRL and SRA need a
+ * sign-extended operand.
+ */
+static void
+emit_shift_immediate(
+    struct jit_state* state, bool sixty_four, enum ShiftOpcode op, enum Registers rd, enum Registers rt, uint32_t shift)
+{
+    enum ALUOpcode alu_op;
+    if (!sixty_four) {
+        alu_op = op == SHIFT_SLL ? ALU_SLL : op == SHIFT_SRL ? ALU_SRL : ALU_SRA;
+        shift &= 31;
+    } else if ((shift & 63) < 32) {
+        alu_op = op == SHIFT_SLL ? ALU_DSLL : op == SHIFT_SRL ? ALU_DSRL : ALU_DSRA;
+    } else {
+        alu_op = op == SHIFT_SLL ? ALU_DSLL32 : op == SHIFT_SRL ? ALU_DSRL32 : ALU_DSRA32;
+    }
+    emit_instruction(state, (OPC_SPECIAL << 26) | (rt << 16) | (rd << 11) | ((shift & 31) << 6) | alu_op);
+}
+
+/* rd = rs (OR rd, rs, zero). */
+static void
+emit_mov(struct jit_state* state, enum Registers rd, enum Registers rs)
+{
+    emit_alu_register(state, ALU_OR, rd, rs, ZERO);
+}
+
+/* [MIPS64-ISA]: DEXT: rt = the size bits of rs from bit pos, zero-extended (size <= 32). */
+static void
+emit_extract(struct jit_state* state, enum Registers rt, enum Registers rs, uint32_t pos, uint32_t size)
+{
+    assert(size >= 1 && size <= 32 && pos + size <= 64);
+    emit_instruction(state, (OPC_SPECIAL3 << 26) | (rs << 21) | (rt << 16) | ((size - 1) << 11) | (pos << 6) | 0x03);
+}
+
+/* rd = the low 32 bits of rs, zero-extended. */
+static void
+emit_zero_extend32(struct jit_state* state, enum Registers rd, enum Registers rs)
+{
+    emit_extract(state, rd, rs, 0, 32);
+}
+
+/* rd = the low 32 bits of rs, sign-extended (SLL rd, rs, 0). */
+static void
+emit_sign_extend32(struct jit_state* state, enum Registers rd, enum Registers rs)
+{
+    emit_shift_immediate(state, false, SHIFT_SLL, rd, rs, 0);
+}
+
+/* The sa field of the BSHFL (function 0x20) and DBSHFL (function 0x24) instructions. */
+enum ShuffleOpcode
+{
+    BSHFL_SEB = 0x420,
+    BSHFL_SEH = 0x620,
+    DBSHFL_DSBH = 0x0a4,
+    DBSHFL_DSHD = 0x164,
+};
+
+/* SEB, SEH, DSBH and DSHD: rd = op(rt). */
+static void
+emit_shuffle(struct jit_state* state, enum ShuffleOpcode op, enum Registers rd, enum Registers rt)
+{
+    emit_instruction(state, (OPC_SPECIAL3 << 26) | (rt << 16) | (rd << 11) | op);
+}
+
+/* The rt field of the REGIMM instructions that add to the upper bits of a register. */
+enum UpperImmediateOpcode
+{
+    REGIMM_DAHI = 0x06,
+    REGIMM_DATI = 0x1e,
+};
+
+/*
+ * Load a 64-bit immediate into rd. A sign-extended 32-bit value takes a DADDIU or ORI, or
+ * a LUI and an ORI; the Release 6 DAHI and DATI then add bits 47..32 and 63..48 (each
+ * sign-extended), so no value takes more than four instructions.
+ */
+static void
+emit_load_immediate(struct jit_state* state, enum Registers rd, int64_t imm)
+{
+    int32_t lo32 = (int32_t)imm;
+    if (is_simm16(lo32)) {
+        emit_alu_immediate(state, OPC_DADDIU, rd, ZERO, lo32);
+    } else if (is_uimm16(lo32)) {
+        emit_alu_immediate(state, OPC_ORI, rd, ZERO, lo32);
+    } else {
+        emit_itype(state, OPC_LUI, rd, ZERO, (uint32_t)lo32 >> 16);
+        if (lo32 & 0xffff) {
+            emit_alu_immediate(state, OPC_ORI, rd, rd, lo32 & 0xffff);
+        }
+    }
+
+    uint64_t rest = (uint64_t)imm - (uint64_t)(int64_t)lo32;
+    int16_t bits32 = (int16_t)(rest >> 32);
+    rest -= (uint64_t)(int64_t)bits32 << 32;
+    int16_t bits48 = (int16_t)(rest >> 48);
+    if (bits32) {
+        emit_itype(state, OPC_REGIMM, (enum Registers)REGIMM_DAHI, rd, (uint16_t)bits32);
+    }
+    if (bits48) {
+        emit_itype(state, OPC_REGIMM, (enum Registers)REGIMM_DATI, rd, (uint16_t)bits48);
+    }
+}
+
+/* Load an immediate with constant blinding: the immediate XORed with a random value and
+ * the random value are loaded and XORed to recover the original constant, preventing JIT
+ * spray attacks.
+ */
+static void
+emit_load_immediate_blinded(struct jit_state* state, enum Registers rd, int64_t imm)
+{
+    assert(rd != blinding_register);
+    uint64_t random = ubpf_generate_blinding_constant();
+    emit_load_immediate(state, rd, (int64_t)((uint64_t)imm ^ random));
+    emit_load_immediate(state, blinding_register, (int64_t)random);
+    emit_alu_register(state, ALU_XOR, rd, rd, blinding_register);
+}
+
+#define EMIT_LOAD_IMMEDIATE(vm, state, rd, imm) \
+    do { \
+        if ((vm)->constant_blinding_enabled) { \
+            emit_load_immediate_blinded(state, rd, imm); \
+        } else { \
+            emit_load_immediate(state, rd, imm); \
+        } \
+    } while (0)
+
+/* rd = rs + imm. scratch is clobbered if imm does not fit in a DADDIU. */
+static void
+emit_add_immediate(struct jit_state* state, enum Registers rd, enum Registers rs, int64_t imm, enum Registers scratch)
+{
+    if (is_simm16(imm)) {
+        emit_alu_immediate(state, OPC_DADDIU, rd, rs, (int32_t)imm);
+    } else {
+        emit_load_immediate(state, scratch, imm);
+        emit_alu_register(state, ALU_DADDU, rd, rs, scratch);
+    }
+}
+
+/* Loads and stores with a signed 16-bit offset, which every eBPF offset fits in. */
+static void
+emit_load(struct jit_state* state, enum MajorOpcode op, enum Registers rt, enum Registers base, int32_t offset)
+{
+    assert(is_simm16(offset));
+    emit_itype(state, op, rt, base, (uint32_t)offset);
+}
+
+static void
+emit_store(struct jit_state* state, enum MajorOpcode op, enum Registers rt, enum Registers base, int32_t offset)
+{
+    assert(is_simm16(offset));
+    emit_itype(state, op, rt, base, (uint32_t)offset);
+}
+
+/* The function field of the Release 6 load linked and store conditional (SPECIAL3). */
+enum AtomicOpcode
+{
+    ATOMIC_SC = 0x26,
+    ATOMIC_SCD = 0x27,
+    ATOMIC_LL = 0x36,
+    ATOMIC_LLD = 0x37,
+};
+
+/* LL/LLD rt, 0(base) or SC/SCD rt, 0(base). SC sets rt to 1 if it stored and 0 if not. */
+static void
+emit_atomic(struct jit_state* state, enum AtomicOpcode op, enum Registers rt, enum Registers base)
+{
+    emit_instruction(state, (OPC_SPECIAL3 << 26) | (base << 21) | (rt << 16) | op);
+}
+
+/* A full memory barrier (SYNC 0). */
+static void
+emit_sync(struct jit_state* state)
+{
+    emit_instruction(state, ALU_SYNC);
+}
+
+/*
+ * The conditions of the compact branches. Conditions come in pairs that differ only in
+ * their low bit (like the Arm condition codes). A comparison with the zero register is
+ * only encodable for EQ and NE (BEQZC and BNEZC, which reach further); all others compare
+ * two different registers that are not zero.
+ */
+enum BranchCondition
+{
+    BR_EQ = 0,
+    BR_NE = 1,
+    BR_LT = 2,
+    BR_GE = 3,
+    BR_LTU = 4,
+    BR_GEU = 5,
+};
+
+/*
+ * [MIPS64-ISA]: 4.1.3.2: "Forbidden slot". The instruction after a compact conditional
+ * branch must not be a branch or a jump. Whether instr is such a branch.
+ */
+static bool
+is_compact_conditional_branch(uint32_t instr)
+{
+    uint32_t rs = (instr >> 21) & 0x1f;
+    uint32_t rt = (instr >> 16) & 0x1f;
+    switch (instr >> 26) {
+    case OPC_POP06:
+    case OPC_POP07:
+    case OPC_POP26:
+    case OPC_POP27:
+        // With rt == 0, these are the branches with a delay slot that the JIT never emits.
+        return rt != 0;
+    case OPC_POP10:
+    case OPC_POP30:
+        return true;
+    case OPC_POP66:
+    case OPC_POP76:
+        // With rs == 0, these are JIC and JIALC.
+        return rs != 0;
+    default:
+        return false;
+    }
+}
+
+/* Emit a NOP if the instruction that was emitted last has a forbidden slot, so that a
+ * branch or jump can follow.
+ */
+static void
+avoid_forbidden_slot(struct jit_state* state)
+{
+    uint32_t previous;
+    if (state->offset < 4 || state->offset > state->size) {
+        return;
+    }
+    memcpy(&previous, state->buf + state->offset - 4, sizeof(previous));
+    if (is_compact_conditional_branch(previous)) {
+        emit_instruction(state, 0);
+    }
+}
+
+/* The encoding of a compact branch on cond, without its offset. */
+static uint32_t
+encode_branch(enum BranchCondition cond, enum Registers rs, enum Registers rt)
+{
+    if ((cond == BR_EQ || cond == BR_NE) && (rs == ZERO || rt == ZERO)) {
+        // BEQZC and BNEZC (a 21-bit offset).
+        enum Registers reg = rs == ZERO ? rt : rs;
+        assert(reg != ZERO);
+        return ((uint32_t)(cond == BR_EQ ? OPC_POP66 : OPC_POP76) << 26) | (reg << 21);
+    }
+    assert(rs != ZERO && rt != ZERO && rs != rt);
+    enum MajorOpcode opcode = OPC_POP10;
+    switch (cond) {
+    case BR_EQ:
+    case BR_NE:
+        // BEQC and BNEC are encoded with the lower register first.
+        if (rs > rt) {
+            enum Registers swap = rs;
+            rs = rt;
+            rt = swap;
+        }
+        opcode = cond == BR_EQ ? OPC_POP10 : OPC_POP30;
+        break;
+    case BR_LT:
+        opcode = OPC_POP27;
+        break;
+    case BR_GE:
+        opcode = OPC_POP26;
+        break;
+    case BR_LTU:
+        opcode = OPC_POP07;
+        break;
+    case BR_GEU:
+        opcode = OPC_POP06;
+        break;
+    }
+    return ((uint32_t)opcode << 26) | (rs << 21) | (rt << 16);
+}
+
+/*
+ * A compact conditional branch with an offset (in instructions, relative to the next
+ * instruction) known when it is emitted.
+ */
+static void
+emit_branch_offset(struct jit_state* state, enum BranchCondition cond, enum Registers rs, enum Registers rt, int32_t offset)
+{
+    uint32_t instr = encode_branch(cond, rs, rt);
+    uint32_t opcode = instr >> 26;
+    unsigned bits = (opcode == OPC_POP66 || opcode == OPC_POP76) ? 21 : 16;
+    assert(fits_offset(offset, bits));
+    avoid_forbidden_slot(state);
+    emit_instruction(state, instr | ((uint32_t)offset & ((1U << bits) - 1)));
+}
+
+/* [MIPS64-ISA]: AUIPC: rs = PC + (imm16 << 16). */
+static void
+emit_auipc(struct jit_state* state, enum Registers rs)
+{
+    emit_instruction(state, ((uint32_t)OPC_PCREL << 26) | (rs << 21) | (0x1e << 16));
+}
+
+/* Note a jump (or a call of special code) at the current offset, to be patched by resolve_jumps. */
+static void
+note_jump(struct jit_state* state, struct PatchableTarget target)
+{
+    if (state->num_jumps == UBPF_JIT_MAX_JUMPS) {
+        state->jit_status = TooManyJumps;
+        return;
+    }
+    emit_patchable_relative(state->jumps, state->offset, target, state->num_jumps++);
+}
+
+/* Whether the jump that is emitted next did not reach its target the last time. */
+static bool
+next_jump_is_far(const struct jit_state* state)
+{
+    return state->far_jumps != NULL && state->num_jumps < UBPF_JIT_MAX_JUMPS && state->far_jumps[state->num_jumps];
+}
+
+/*
+ * Jump to the target (BC, which reaches ±128 MB) or, if link is set, call it (BALC). A
+ * jump that did not reach its target before is emitted as an AUIPC and a JIC (or JIALC)
+ * instead, which reach ±2 GB. Returns the location of the jump, to be used with
+ * emit_jump_target.
+ */
+static uint32_t
+emit_jump(struct jit_state* state, bool link, struct PatchableTarget target)
+{
+    if (next_jump_is_far(state)) {
+        uint32_t source_offset = state->offset;
+        note_jump(state, target);
+        emit_auipc(state, scratch_register);
+        emit_itype(state, link ? OPC_POP76 : OPC_POP66, scratch_register, ZERO, 0);
+        return source_offset;
+    }
+    avoid_forbidden_slot(state);
+    uint32_t source_offset = state->offset;
+    note_jump(state, target);
+    emit_instruction(state, (uint32_t)(link ? OPC_BALC : OPC_BC) << 26);
+    return source_offset;
+}
+
+/*
+ * Jump to the target if the condition holds for rs and rt. A register-register compact
+ * branch only reaches ±128 KB (±4 MB for BEQZC and BNEZC), so one that did not reach its
+ * target before is emitted as a branch on the opposite condition over a jump (see
+ * emit_jump).
+ */
+static uint32_t
+emit_branch(
+    struct jit_state* state, enum BranchCondition cond, enum Registers rs, enum Registers rt, struct PatchableTarget target)
+{
+    if (next_jump_is_far(state)) {
+        emit_branch_offset(state, cond ^ 1, rs, rt, 2);
+        return emit_jump(state, false, target);
+    }
+    avoid_forbidden_slot(state);
+    uint32_t source_offset = state->offset;
+    note_jump(state, target);
+    emit_instruction(state, encode_branch(cond, rs, rt));
+    return source_offset;
+}
+
+/* Jump to the address in rt plus offset (JIC) or, if link is set, call it (JIALC). */
+static void
+emit_jump_register(struct jit_state* state, bool link, enum Registers rt)
+{
+    avoid_forbidden_slot(state);
+    emit_itype(state, link ? OPC_POP76 : OPC_POP66, rt, ZERO, 0);
+}
+
+/* Return to the address in RA (JIC ra, 0). */
+static void
+emit_return(struct jit_state* state)
+{
+    emit_jump_register(state, false, RA);
+}
+
+/*
+ * Select the callee-saved registers that the prologue has to save and the epilogue
+ * has to restore: the ones that hold the JIT data and the context of the external
+ * dispatcher and those that are mapped to an eBPF register the program uses (see
+ * compute_used_registers). Returns the number written to saved_registers.
+ */
+static unsigned
+select_saved_registers(uint16_t used_registers, enum Registers* saved_registers)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < _countof(callee_saved_registers); i++) {
+        enum Registers reg = callee_saved_registers[i];
+        bool used = reg == JIT_DATA || reg == VOLATILE_CTXT;
+        for (int r = 0; r < _BPF_REG_MAX && !used; r++) {
+            used = (used_registers & (1 << r)) && map_register(r) == reg;
+        }
+        if (used) {
+            saved_registers[count++] = reg;
+        }
+    }
+    return count;
+}
+
+/* Subtract (or add) the given number of bytes from (to) SP. */
+static void
+emit_adjust_stack(struct jit_state* state, int64_t bytes)
+{
+    emit_add_immediate(state, SP, SP, bytes, temp_register);
+}
+
+/* Generate the function prologue.
+ *
+ * We set the stack to look like:
+ *   ubpf_stack_size bytes of UBPF stack (none if the program never uses r10)
+ *   Return address
+ *   Frame pointer (FP) on entry
+ *   Callee saved registers (only those the program uses, see select_saved_registers)
+ *   Frame (FP) <- SP.
+ * Precondition: The runtime stack pointer is 16-byte aligned.
+ * Postcondition:  The runtime stack pointer is 16-byte aligned.
+ */
+static void
+emit_jit_prologue(struct jit_state* state, struct ubpf_vm* vm, uint16_t used_registers)
+{
+    size_t ubpf_stack_size = vm->stack_requirement;
+    enum Registers saved_registers[_countof(callee_saved_registers)];
+    unsigned num_saved_registers = select_saved_registers(used_registers, saved_registers);
+
+    emit_adjust_stack(state, -16);
+    emit_store(state, OPC_SD, RA, SP, 8);
+    emit_store(state, OPC_SD, FP, SP, 0);
+
+    state->stack_size = align_to(num_saved_registers * 8, 16);
+    emit_adjust_stack(state, -(int64_t)state->stack_size);
+    /* Save callee saved registers */
+    for (unsigned i = 0; i < num_saved_registers; i++) {
+        emit_store(state, OPC_SD, saved_registers[i], SP, i * 8);
+    }
+    emit_mov(state, FP, SP);
+
+    if (state->jit_mode == BasicJitMode) {
+        /* Setup UBPF frame pointer. */
+        if (used_registers & (1 << BPF_REG_10)) {
+            emit_mov(state, map_register(10), SP);
+        }
+        if (ubpf_stack_size) {
+            emit_adjust_stack(state, -(int64_t)ubpf_stack_size);
+        }
+    } else if (used_registers & (1 << BPF_REG_10)) {
+        emit_alu_register(state, ALU_DADDU, map_register(10), A2, A3);
+    }
+
+    /* Copy A0 to the volatile context for safe keeping. */
+    emit_mov(state, VOLATILE_CTXT, A0);
+
+    /* The helpers and the external dispatcher are looked up there at every call. The
+     * entry stub passes its address in T8 (see ubpf_jit_entry_mips64). */
+    emit_mov(state, JIT_DATA, scratch_register);
+
+    DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit);
+    DECLARE_PATCHABLE_SPECIAL_TARGET(enter_tgt, Enter);
+    emit_jump(state, true, enter_tgt);
+    emit_jump(state, false, exit_tgt);
+    state->entry_loc = state->offset;
+}
+
+static void
+emit_jit_epilogue(struct jit_state* state, uint16_t used_registers)
+{
+    enum Registers saved_registers[_countof(callee_saved_registers)];
+    unsigned num_saved_registers = select_saved_registers(used_registers, saved_registers);
+
+    state->exit_loc = state->offset;
+
+    /* Register 0 already is in V0. We could be anywhere in the stack if we excepted. Get
+     * our head right. */
+    emit_mov(state, SP, FP);
+
+    /* Restore callee-saved registers.  */
+    for (unsigned i = 0; i < num_saved_registers; i++) {
+        emit_load(state, OPC_LD, saved_registers[i], SP, i * 8);
+    }
+    emit_adjust_stack(state, state->stack_size);
+
+    emit_load(state, OPC_LD, RA, SP, 8);
+    emit_load(state, OPC_LD, FP, SP, 0);
+    emit_adjust_stack(state, 16);
+
+    emit_return(state);
+}
+
+static void
+emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm, unsigned int idx)
+{
+    /*
+     * There are two paths through the function:
+     * 1. There is an external dispatcher registered. If so, we prioritize that.
+     * 2. We fall back to the regular registered helper.
+     * See translate and emit_dispatched_external_helper_call in ubpf_jit_x86_64.c for additional
+     * details.
+     */
+
+    emit_adjust_stack(state, -16);
+    emit_store(state, OPC_SD, RA, SP, 0);
+
+    // Determine whether to call it through a dispatcher or by index and then load up the address
+    // of that function. Both live in the VM's struct ubpf_jit_data, whose address is in JIT_DATA.
+    emit_load(state, OPC_LD, call_register, JIT_DATA, offsetof(struct ubpf_jit_data, dispatcher));
+
+    // Jump to the call if we are ready to roll (because we are using an external dispatcher).
+    DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(default_tgt, 0);
+    uint32_t external_dispatcher_jump_source = emit_branch(state, BR_NE, call_register, ZERO, default_tgt);
+
+    // We are not ready to roll. In other words, we are going to load the helper function address by index.
+    // Validation guarantees that idx names a registered helper when there is no external dispatcher.
+    emit_load(
+        state,
+        OPC_LD,
+        call_register,
+        JIT_DATA,
+        offsetof(struct ubpf_jit_data, helpers) + (idx % MAX_EXT_FUNCS) * sizeof(extended_external_helper_t));
+
+    // Add the implicit 6th parameter (the context)
+    emit_mov(state, A5, VOLATILE_CTXT);
+
+    // And now we, too, are ready to roll. So, let's jump around the code that sets up the additional
+    // parameters for the external dispatcher. We will end up at the call site where both paths
+    // will rendezvous.
+    uint32_t no_dispatcher_jump_source = emit_jump(state, false, default_tgt);
+
+    // Mark the landing spot for the jump around the code that sets up a call to a helper function
+    // when no external dispatcher is present.
+    emit_jump_target(state, external_dispatcher_jump_source);
+
+    // ... set up the final two arguments for the external dispatcher: the index of the helper to be
+    // invoked and the context.
+    EMIT_LOAD_IMMEDIATE(vm, state, A5, idx);
+    emit_mov(state, A6, VOLATILE_CTXT);
+
+    // Mark the landing spot for the jump around the external-dispatcher-argument-setup code.
+    emit_jump_target(state, no_dispatcher_jump_source);
+
+    // Both paths meet here -- all that's left is to call! The result lands in V0, which is
+    // eBPF r0.
+    emit_jump_register(state, true, call_register);
+
+    emit_load(state, OPC_LD, RA, SP, 0);
+    emit_adjust_stack(state, 16);
+}
+
+/* Call the local function at target_pc (with a BALC, see resolve_local_calls). */
+static void
+emit_local_call(struct jit_state* state, uint32_t target_pc)
+{
+    emit_load(state, OPC_LD, temp_register, SP, 0);
+    emit_alu_register(state, ALU_DSUBU, map_register(10), map_register(10), temp_register);
+
+    uint32_t stack_movement = align_to(48, 16);
+    emit_adjust_stack(state, -(int64_t)stack_movement);
+
+    emit_store(state, OPC_SD, RA, SP, 0);
+    emit_store(state, OPC_SD, temp_register, SP, 8);
+    for (int r = 6; r <= 9; r++) {
+        emit_store(state, OPC_SD, map_register(r), SP, 16 + (r - 6) * 8);
+    }
+
+    if (state->num_local_calls == UBPF_MAX_INSTS) {
+        state->jit_status = TooManyLocalCalls;
+        return;
+    }
+    DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(tgt, target_pc);
+    emit_patchable_relative(state->local_calls, state->offset, tgt, state->num_local_calls++);
+    emit_instruction(state, (uint32_t)OPC_BALC << 26);
+
+    emit_load(state, OPC_LD, RA, SP, 0);
+    emit_load(state, OPC_LD, temp_register, SP, 8);
+    for (int r = 6; r <= 9; r++) {
+        emit_load(state, OPC_LD, map_register(r), SP, 16 + (r - 6) * 8);
+    }
+
+    emit_adjust_stack(state, stack_movement);
+
+    emit_alu_register(state, ALU_DADDU, map_register(10), map_register(10), temp_register);
+}
+
+/*
+ * Emit an atomic operation on the word or doubleword at addr_reg + offset with an LL/SC
+ * (LLD/SCD) loop. The ones that fetch (and XCHG and CMPXCHG) are fully ordered by a SYNC
+ * on either side, like the AL forms that the arm64 JIT emits; the others are not ordered.
+ * A fetched word is zero-extended.
+ */
+static void
+emit_atomic_operation(
+    struct jit_state* state, bool sixty_four, enum Registers value_reg, enum Registers addr_reg, int16_t offset, int32_t imm)
+{
+    bool fetch = imm & EBPF_ATOMIC_OP_FETCH;
+    enum AtomicOpcode load_linked = sixty_four ? ATOMIC_LLD : ATOMIC_LL;
+    enum AtomicOpcode store_conditional = sixty_four ? ATOMIC_SCD : ATOMIC_SC;
+    // LL and SC only have a 9-bit offset.
+    enum Registers addr_temp = addr_reg;
+    if (offset != 0) {
+        addr_temp = offset_register;
+        emit_alu_immediate(state, OPC_DADDIU, addr_temp, addr_reg, offset);
+    }
+
+    if ((imm & EBPF_ALU_OP_MASK) == (EBPF_ATOMIC_OP_CMPXCHG & ~EBPF_ATOMIC_OP_FETCH)) {
+        // Load the old value and, if it is what r0 holds, store the new one; r0 gets the old
+        // value. LL sign-extends, so r0 is, too, to compare them.
+        enum Registers expected_reg = map_register(0);
+        if (!sixty_four) {
+            emit_sign_extend32(state, blinding_register, expected_reg);
+            expected_reg = blinding_register;
+        }
+        emit_sync(state);
+        emit_atomic(state, load_linked, temp_div_register, addr_temp);
+        emit_branch_offset(state, BR_NE, temp_div_register, expected_reg, 3);
+        emit_mov(state, scratch_register, value_reg);
+        emit_atomic(state, store_conditional, scratch_register, addr_temp);
+        emit_branch_offset(state, BR_EQ, scratch_register, ZERO, -5);
+        emit_sync(state);
+        if (sixty_four) {
+            emit_mov(state, map_register(0), temp_div_register);
+        } else {
+            emit_zero_extend32(state, map_register(0), temp_div_register);
+        }
+        return;
+    }
+
+    enum ALUOpcode op = ALU_DADDU;
+    switch (imm & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+        op = ALU_DADDU;
+        break;
+    case EBPF_ALU_OP_OR:
+        op = ALU_OR;
+        break;
+    case EBPF_ALU_OP_AND:
+        op = ALU_AND;
+        break;
+    case EBPF_ALU_OP_XOR:
+        op = ALU_XOR;
+        break;
+    case (EBPF_ATOMIC_OP_XCHG & ~EBPF_ATOMIC_OP_FETCH):
+        // OR with zero: the new value is the operand.
+        op = ALU_OR;
+        fetch = true;
+        break;
+    default:
+        // Should not happen
+        break;
+    }
+    bool exchange = (imm & EBPF_ALU_OP_MASK) == (EBPF_ATOMIC_OP_XCHG & ~EBPF_ATOMIC_OP_FETCH);
+
+    // SC stores the low 32 bits, so the operation can be done in 64 bits.
+    if (fetch) {
+        emit_sync(state);
+    }
+    emit_atomic(state, load_linked, temp_div_register, addr_temp);
+    emit_alu_register(state, op, scratch_register, exchange ? ZERO : temp_div_register, value_reg);
+    emit_atomic(state, store_conditional, scratch_register, addr_temp);
+    emit_branch_offset(state, BR_EQ, scratch_register, ZERO, -4);
+    if (fetch) {
+        emit_sync(state);
+        if (sixty_four) {
+            emit_mov(state, value_reg, temp_div_register);
+        } else {
+            emit_zero_extend32(state, value_reg, temp_div_register);
+        }
+    }
+}
+
+static bool
+is_imm_op(struct ebpf_inst const* inst)
+{
+    int class = inst->opcode & EBPF_CLS_MASK;
+    bool is_imm = (inst->opcode & EBPF_SRC_REG) == EBPF_SRC_IMM;
+    bool is_endian = (inst->opcode & EBPF_ALU_OP_MASK) == 0xd0;
+    bool is_neg = (inst->opcode & EBPF_ALU_OP_MASK) == 0x80;
+    bool is_call = inst->opcode == EBPF_OP_CALL;
+    bool is_exit = inst->opcode == EBPF_OP_EXIT;
+    bool is_ja = inst->opcode == EBPF_OP_JA || inst->opcode == EBPF_OP_JA32;
+    bool is_alu = (class == EBPF_CLS_ALU || class == EBPF_CLS_ALU64) && !is_endian && !is_neg;
+    bool is_jmp = (class == EBPF_CLS_JMP && !is_ja && !is_call && !is_exit);
+    bool is_jmp32 = (class == EBPF_CLS_JMP32 && inst->opcode != EBPF_OP_JA32);
+    bool is_store = class == EBPF_CLS_ST;
+    return (is_imm && (is_alu || is_jmp || is_jmp32)) || is_store;
+}
+
+static bool
+is_alu64_op(struct ebpf_inst const* inst)
+{
+    int class = inst->opcode & EBPF_CLS_MASK;
+    return class == EBPF_CLS_ALU64 || class == EBPF_CLS_JMP;
+}
+
+/* Whether the immediate of an instruction can be encoded in the instruction(s) emitted for it
+ * (see translate) instead of having to be moved into a temporary register first.
+ */
+static bool
+is_simple_imm(struct ebpf_inst const* inst)
+{
+    switch (inst->opcode) {
+    case EBPF_OP_ADD_IMM:
+    case EBPF_OP_ADD64_IMM:
+        return is_simm16(inst->imm);
+    case EBPF_OP_SUB_IMM:
+    case EBPF_OP_SUB64_IMM:
+        // Subtracting is adding the negated immediate.
+        return is_simm16(-(int64_t)inst->imm);
+    case EBPF_OP_AND_IMM:
+    case EBPF_OP_AND64_IMM:
+    case EBPF_OP_OR_IMM:
+    case EBPF_OP_OR64_IMM:
+    case EBPF_OP_XOR_IMM:
+    case EBPF_OP_XOR64_IMM:
+    case EBPF_OP_JSET_IMM:
+    case EBPF_OP_JSET32_IMM:
+        // ANDI, ORI and XORI zero-extend their immediate, eBPF sign-extends it.
+        return is_uimm16(inst->imm);
+    case EBPF_OP_JEQ_IMM:
+    case EBPF_OP_JGT_IMM:
+    case EBPF_OP_JGE_IMM:
+    case EBPF_OP_JNE_IMM:
+    case EBPF_OP_JSGT_IMM:
+    case EBPF_OP_JSGE_IMM:
+    case EBPF_OP_JLT_IMM:
+    case EBPF_OP_JLE_IMM:
+    case EBPF_OP_JSLT_IMM:
+    case EBPF_OP_JSLE_IMM:
+    case EBPF_OP_JEQ32_IMM:
+    case EBPF_OP_JGT32_IMM:
+    case EBPF_OP_JGE32_IMM:
+    case EBPF_OP_JNE32_IMM:
+    case EBPF_OP_JSGT32_IMM:
+    case EBPF_OP_JSGE32_IMM:
+    case EBPF_OP_JLT32_IMM:
+    case EBPF_OP_JLE32_IMM:
+    case EBPF_OP_JSLT32_IMM:
+    case EBPF_OP_JSLE32_IMM:
+        // Branches compare two registers; 0 is in the zero register.
+        return inst->imm == 0;
+    case EBPF_OP_MOV_IMM:
+    case EBPF_OP_MOV64_IMM:
+        return true;
+    case EBPF_OP_ARSH_IMM:
+    case EBPF_OP_ARSH64_IMM:
+    case EBPF_OP_LSH_IMM:
+    case EBPF_OP_LSH64_IMM:
+    case EBPF_OP_RSH_IMM:
+    case EBPF_OP_RSH64_IMM:
+        return true;
+    case EBPF_OP_DIV_IMM:
+    case EBPF_OP_DIV64_IMM:
+    case EBPF_OP_MOD_IMM:
+    case EBPF_OP_MOD64_IMM:
+    case EBPF_OP_MUL_IMM:
+    case EBPF_OP_MUL64_IMM:
+        return false;
+    case EBPF_OP_STB:
+    case EBPF_OP_STH:
+    case EBPF_OP_STW:
+    case EBPF_OP_STDW:
+        // Zero is stored from the zero register.
+        return inst->imm == 0;
+    default:
+        assert(false);
+        return false;
+    }
+}
+
+static uint8_t
+to_reg_op(uint8_t opcode)
+{
+    int class = opcode & EBPF_CLS_MASK;
+    if (class == EBPF_CLS_ALU64 || class == EBPF_CLS_ALU || class == EBPF_CLS_JMP || class == EBPF_CLS_JMP32) {
+        return opcode | EBPF_SRC_REG;
+    } else if (class == EBPF_CLS_ST) {
+        return (opcode & ~EBPF_CLS_MASK) | EBPF_CLS_STX;
+    }
+    assert(false);
+    return 0;
+}
+
+static enum ALUOpcode
+to_alu_opcode(int opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+        return ALU_DADDU;
+    case EBPF_ALU_OP_SUB:
+        return ALU_DSUBU;
+    case EBPF_ALU_OP_MUL:
+        return ALU_DMUL;
+    case EBPF_ALU_OP_OR:
+        return ALU_OR;
+    case EBPF_ALU_OP_AND:
+        return ALU_AND;
+    case EBPF_ALU_OP_XOR:
+        return ALU_XOR;
+    default:
+        assert(false);
+        return ALU_DADDU;
+    }
+}
+
+static enum MajorOpcode
+to_alu_immediate_opcode(int opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+    case EBPF_ALU_OP_SUB:
+        return OPC_DADDIU;
+    case EBPF_ALU_OP_OR:
+        return OPC_ORI;
+    case EBPF_ALU_OP_AND:
+        return OPC_ANDI;
+    case EBPF_ALU_OP_XOR:
+        return OPC_XORI;
+    default:
+        assert(false);
+        return OPC_DADDIU;
+    }
+}
+
+static enum ShiftOpcode
+to_shift_opcode(int opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_LSH:
+        return SHIFT_SLL;
+    case EBPF_ALU_OP_RSH:
+        return SHIFT_SRL;
+    default:
+        return SHIFT_SRA;
+    }
+}
+
+/* The variable shifts: DSLLV, ... or SLLV, ..., which shift by the low 6 (5) bits of rs. */
+static enum ALUOpcode
+to_shift_variable_opcode(int opcode, bool sixty_four)
+{
+    switch (to_shift_opcode(opcode)) {
+    case SHIFT_SLL:
+        return sixty_four ? ALU_DSLLV : ALU_SLLV;
+    case SHIFT_SRL:
+        return sixty_four ? ALU_DSRLV : ALU_SRLV;
+    default:
+        return sixty_four ? ALU_DSRAV : ALU_SRAV;
+    }
+}
+
+static enum MajorOpcode
+to_load_opcode(int opcode)
+{
+    switch (opcode) {
+    case EBPF_OP_LDXW:
+        return OPC_LWU;
+    case EBPF_OP_LDXH:
+        return OPC_LHU;
+    case EBPF_OP_LDXB:
+        return OPC_LBU;
+    case EBPF_OP_LDXDW:
+        return OPC_LD;
+    case EBPF_OP_LDXWSX:
+        return OPC_LW;
+    case EBPF_OP_LDXHSX:
+        return OPC_LH;
+    case EBPF_OP_LDXBSX:
+        return OPC_LB;
+    default:
+        assert(false);
+        return OPC_LD;
+    }
+}
+
+static enum MajorOpcode
+to_store_opcode(int opcode)
+{
+    switch (opcode & EBPF_SIZE_DW) {
+    case EBPF_SIZE_B:
+        return OPC_SB;
+    case EBPF_SIZE_H:
+        return OPC_SH;
+    case EBPF_SIZE_W:
+        return OPC_SW;
+    default:
+        return OPC_SD;
+    }
+}
+
+/*
+ * The branch for a conditional jump that compares dst with src. MIPS only has "less
+ * than" and "greater or equal" branches, so for the others, the operands are swapped.
+ */
+static enum BranchCondition
+to_branch_condition(int opcode, bool* swap_operands)
+{
+    *swap_operands = false;
+    switch (opcode & EBPF_JMP_OP_MASK) {
+    case EBPF_MODE_JEQ:
+        return BR_EQ;
+    case EBPF_MODE_JNE:
+    case EBPF_MODE_JSET:
+        return BR_NE;
+    case EBPF_MODE_JGT:
+        *swap_operands = true;
+        return BR_LTU;
+    case EBPF_MODE_JGE:
+        return BR_GEU;
+    case EBPF_MODE_JLT:
+        return BR_LTU;
+    case EBPF_MODE_JLE:
+        *swap_operands = true;
+        return BR_GEU;
+    case EBPF_MODE_JSGT:
+        *swap_operands = true;
+        return BR_LT;
+    case EBPF_MODE_JSGE:
+        return BR_GE;
+    case EBPF_MODE_JSLT:
+        return BR_LT;
+    case EBPF_MODE_JSLE:
+        *swap_operands = true;
+        return BR_GE;
+    default:
+        assert(false);
+        return BR_EQ;
+    }
+}
+
+/*
+ * Divide (or take the remainder of) rn by rm into rd. The results of the Release 6
+ * divisions are unpredictable (but do not trap) for a zero divisor and the overflowing
+ * signed division, so those are selected with SELNEZ and SELEQZ instead: a zero divisor
+ * gives 0 (the remainder: the dividend) and a divisor of -1 gives the negated dividend
+ * (the remainder: 0), which also covers INT_MIN / -1. The 32-bit divisions need
+ * sign-extended operands.
+ */
+static void
+divmod(
+    struct jit_state* state,
+    uint8_t opcode,
+    enum Registers rd,
+    enum Registers rn,
+    enum Registers rm,
+    int16_t offset,
+    bool divisor_may_be_zero,
+    bool divisor_may_be_minus_one)
+{
+    bool mod = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK);
+    bool sixty_four = (opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    bool is_signed = (offset == 1);
+    enum Registers result = temp_div_register;
+
+    if (!sixty_four) {
+        emit_sign_extend32(state, offset_register, rn);
+        emit_sign_extend32(state, blinding_register, rm);
+        rn = offset_register;
+        rm = blinding_register;
+    }
+
+    enum ALUOpcode op;
+    if (sixty_four) {
+        op = mod ? (is_signed ? ALU_DMOD : ALU_DMODU) : (is_signed ? ALU_DDIV : ALU_DDIVU);
+    } else {
+        op = mod ? (is_signed ? ALU_MOD : ALU_MODU) : (is_signed ? ALU_DIV : ALU_DIVU);
+    }
+    emit_alu_register(state, op, result, rn, rm);
+
+    if (divisor_may_be_zero) {
+        emit_alu_register(state, ALU_SELNEZ, result, result, rm);
+        if (mod) {
+            emit_alu_register(state, ALU_SELEQZ, call_register, rn, rm);
+            emit_alu_register(state, ALU_OR, result, result, call_register);
+        }
+    }
+    if (is_signed && divisor_may_be_minus_one) {
+        // scratch_register is 0 if the divisor is -1.
+        emit_alu_immediate(state, OPC_DADDIU, scratch_register, rm, 1);
+        emit_alu_register(state, ALU_SELNEZ, result, result, scratch_register);
+        if (!mod) {
+            emit_alu_register(state, ALU_DSUBU, call_register, ZERO, rn);
+            emit_alu_register(state, ALU_SELEQZ, call_register, call_register, scratch_register);
+            emit_alu_register(state, ALU_OR, result, result, call_register);
+        }
+    }
+
+    if (sixty_four) {
+        emit_mov(state, rd, result);
+    } else {
+        emit_zero_extend32(state, rd, result);
+    }
+}
+
+/*
+ * The layout of the JIT'd code follows a certain pattern. There are
+ * several invariants in the JIT'd code as well. Those are documented
+ * in the translate function of the x86_64 JIT. Like on Arm, the stack usage
+ * of a function is pushed twice to keep the stack 16-byte aligned.
+ */
+static int
+translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
+{
+    int i;
+    uint16_t used_registers = compute_used_registers(vm);
+
+    emit_jit_prologue(state, vm, used_registers);
+
+    compute_jit_layout(vm, state);
+
+    for (uint32_t n = 0; n < state->layout_size; n++) {
+
+        if (state->jit_status != NoError) {
+            break;
+        }
+
+        i = state->layout[n];
+
+        // All checks for errors during the encoding of _this_ instruction
+        // occur at the end of the loop.
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
+
+        // If
+        // a) the previous instruction in the eBPF program could fallthrough
+        //    to this instruction and
+        // b) the current instruction starts a local function,
+        // then there has to be a means to "jump around" the code that
+        // manipulates the stack when the program executes in the fallthrough
+        // path.
+        uint32_t fallthrough_jump_source = 0;
+        bool fallthrough_jump_present = false;
+        if (i != 0 && vm->int_funcs[i]) {
+            struct ebpf_inst prev_inst = ubpf_fetch_instruction(vm, i - 1);
+            if (ubpf_instruction_has_fallthrough(prev_inst)) {
+                DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(default_tgt, 0)
+                fallthrough_jump_source = emit_jump(state, false, default_tgt);
+                fallthrough_jump_present = true;
+            }
+        }
+
+        if (i == 0 || vm->int_funcs[i]) {
+            // The stack usage is always loaded with a LUI and an ORI so that every function
+            // has a prolog of the same size.
+            size_t prolog_start = state->offset;
+            uint32_t stack_usage = (uint32_t)ubpf_stack_usage_for_local_func(vm, i);
+            emit_itype(state, OPC_LUI, temp_register, ZERO, stack_usage >> 16);
+            emit_alu_immediate(state, OPC_ORI, temp_register, temp_register, stack_usage & 0xffff);
+            emit_adjust_stack(state, -16);
+            emit_store(state, OPC_SD, temp_register, SP, 0);
+            emit_store(state, OPC_SD, temp_register, SP, 8);
+            // Record the size of the prolog so that we can calculate offset when doing a local call.
+            if (state->bpf_function_prolog_size == 0) {
+                state->bpf_function_prolog_size = state->offset - prolog_start;
+            } else {
+                assert(state->bpf_function_prolog_size == state->offset - prolog_start);
+            }
+        }
+
+        if (fallthrough_jump_present) {
+            DECLARE_PATCHABLE_REGULAR_JIT_TARGET(fallthrough_tgt, state->offset)
+            modify_patchable_relatives_target(state->jumps, state->num_jumps, fallthrough_jump_source, fallthrough_tgt);
+        }
+
+        state->pc_locs[i] = state->offset;
+
+        enum Registers dst = map_register(inst.dst);
+        enum Registers src = map_register(inst.src);
+        uint8_t opcode = inst.opcode;
+
+        // Use int64_t to avoid signed overflow with large immediates
+        int64_t target_pc_64;
+        if (inst.opcode == EBPF_OP_JA32) {
+            target_pc_64 = (int64_t)i + (int64_t)inst.imm + 1;
+        } else {
+            target_pc_64 = (int64_t)i + (int64_t)inst.offset + 1;
+        }
+        uint32_t target_pc = (uint32_t)target_pc_64;
+
+        DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(tgt, target_pc);
+
+        // When the fall-through of a conditional jump was moved out of line (see
+        // compute_jit_layout), jump there on the opposite condition instead.
+        int cond_invert = 0;
+        if (state->layout_flags[i] & LayoutInvertBranch) {
+            cond_invert = 1;
+            tgt.target.regular.ebpf_target_pc = i + 1;
+        }
+
+        int sixty_four = is_alu64_op(&inst);
+
+        // If this is an operation with an immediate operand (and that immediate
+        // operand is _not_ simple), then we convert the operation to the equivalent
+        // register version after moving the immediate into a temporary register.
+        // When constant blinding is enabled, we also convert simple immediates to ensure
+        // all attacker-controlled immediates are blinded.
+        // Exception: MOV_IMM/MOV64_IMM are handled directly in their switch case.
+        bool divisor_may_be_zero = true;
+        bool divisor_may_be_minus_one = true;
+        if (is_imm_op(&inst) && opcode != EBPF_OP_MOV_IMM && opcode != EBPF_OP_MOV64_IMM) {
+            if (!is_simple_imm(&inst) || (vm->constant_blinding_enabled && inst.imm != 0)) {
+                EMIT_LOAD_IMMEDIATE(vm, state, temp_register, (int64_t)inst.imm);
+                src = temp_register;
+                opcode = to_reg_op(opcode);
+                divisor_may_be_zero = inst.imm == 0;
+                divisor_may_be_minus_one = inst.imm == -1;
+            } else if (
+                (opcode & EBPF_CLS_MASK) == EBPF_CLS_ST ||
+                (((opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP || (opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32) &&
+                 (opcode & EBPF_JMP_OP_MASK) != EBPF_MODE_JSET)) {
+                // The simple immediate to store or to compare with is 0: it is in the zero register.
+                src = ZERO;
+                opcode = to_reg_op(opcode);
+            }
+        }
+
+        switch (opcode) {
+        case EBPF_OP_ADD_IMM:
+        case EBPF_OP_ADD64_IMM:
+        case EBPF_OP_SUB_IMM:
+        case EBPF_OP_SUB64_IMM:
+        case EBPF_OP_OR_IMM:
+        case EBPF_OP_AND_IMM:
+        case EBPF_OP_XOR_IMM:
+        case EBPF_OP_OR64_IMM:
+        case EBPF_OP_AND64_IMM:
+        case EBPF_OP_XOR64_IMM: {
+            int32_t imm = (opcode & EBPF_ALU_OP_MASK) == EBPF_ALU_OP_SUB ? -inst.imm : inst.imm;
+            emit_alu_immediate(state, to_alu_immediate_opcode(opcode), dst, dst, imm);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        }
+        case EBPF_OP_ADD_REG:
+        case EBPF_OP_ADD64_REG:
+        case EBPF_OP_SUB_REG:
+        case EBPF_OP_SUB64_REG:
+        case EBPF_OP_MUL_REG:
+        case EBPF_OP_MUL64_REG:
+        case EBPF_OP_OR_REG:
+        case EBPF_OP_AND_REG:
+        case EBPF_OP_XOR_REG:
+        case EBPF_OP_OR64_REG:
+        case EBPF_OP_AND64_REG:
+        case EBPF_OP_XOR64_REG:
+            // The low 32 bits of these do not depend on the high bits of the operands, and
+            // the doubleword forms have no restrictions on them (unlike ADDU and MUL).
+            emit_alu_register(state, to_alu_opcode(opcode), dst, dst, src);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_LSH_IMM:
+        case EBPF_OP_LSH64_IMM:
+        case EBPF_OP_ARSH64_IMM:
+        case EBPF_OP_RSH64_IMM:
+            emit_shift_immediate(state, sixty_four, to_shift_opcode(opcode), dst, dst, (uint32_t)inst.imm);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_RSH_IMM:
+            // The bits above the low 32 bits that are shifted in are zero.
+            emit_extract(state, dst, dst, inst.imm & 31, 32 - (inst.imm & 31));
+            break;
+        case EBPF_OP_ARSH_IMM:
+            emit_sign_extend32(state, dst, dst);
+            emit_shift_immediate(state, false, SHIFT_SRA, dst, dst, (uint32_t)inst.imm);
+            emit_zero_extend32(state, dst, dst);
+            break;
+        case EBPF_OP_LSH_REG:
+        case EBPF_OP_RSH_REG:
+        case EBPF_OP_ARSH_REG:
+        case EBPF_OP_LSH64_REG:
+        case EBPF_OP_RSH64_REG:
+        case EBPF_OP_ARSH64_REG:
+            // SRLV and SRAV need a sign-extended operand, SLLV does not.
+            if (!sixty_four && opcode != EBPF_OP_LSH_REG) {
+                emit_sign_extend32(state, dst, dst);
+            }
+            emit_alu_register(state, to_shift_variable_opcode(opcode, sixty_four), dst, src, dst);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_DIV_REG:
+        case EBPF_OP_MOD_REG:
+        case EBPF_OP_DIV64_REG:
+        case EBPF_OP_MOD64_REG:
+            divmod(state, opcode, dst, dst, src, inst.offset, divisor_may_be_zero, divisor_may_be_minus_one);
+            break;
+        case EBPF_OP_NEG:
+        case EBPF_OP_NEG64:
+            emit_alu_register(state, ALU_DSUBU, dst, ZERO, dst);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_MOV_IMM:
+            EMIT_LOAD_IMMEDIATE(vm, state, dst, (int64_t)(uint32_t)inst.imm);
+            break;
+        case EBPF_OP_MOV64_IMM:
+            EMIT_LOAD_IMMEDIATE(vm, state, dst, (int64_t)inst.imm);
+            break;
+        case EBPF_OP_MOV_REG:
+        case EBPF_OP_MOV64_REG:
+            // MOVSX: sign-extend based on offset value (RFC 9669)
+            if (inst.offset == 8 || inst.offset == 16) {
+                emit_shuffle(state, inst.offset == 8 ? BSHFL_SEB : BSHFL_SEH, dst, src);
+                if (!sixty_four) {
+                    emit_zero_extend32(state, dst, dst);
+                }
+            } else if (inst.offset == 32 && sixty_four) {
+                emit_sign_extend32(state, dst, src);
+            } else if (sixty_four) {
+                emit_mov(state, dst, src);
+            } else {
+                emit_zero_extend32(state, dst, src);
+            }
+            break;
+        case EBPF_OP_LE:
+            /* MIPS64el is little-endian: only truncate. */
+            if (inst.imm == 16) {
+                emit_alu_immediate(state, OPC_ANDI, dst, dst, 0xffff);
+            } else if (inst.imm == 32) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_BE:
+        case EBPF_OP_BSWAP:
+            // DSBH swaps the bytes in each halfword and DSHD the halfwords in the doubleword.
+            emit_shuffle(state, DBSHFL_DSBH, dst, dst);
+            if (inst.imm == 16) {
+                emit_alu_immediate(state, OPC_ANDI, dst, dst, 0xffff);
+            } else {
+                emit_shuffle(state, DBSHFL_DSHD, dst, dst);
+                if (inst.imm == 32) {
+                    emit_shift_immediate(state, true, SHIFT_SRL, dst, dst, 32);
+                }
+            }
+            break;
+
+        case EBPF_OP_JA:
+        case EBPF_OP_JA32:
+            emit_jump(state, false, tgt);
+            break;
+        case EBPF_OP_JEQ_REG:
+        case EBPF_OP_JGT_REG:
+        case EBPF_OP_JGE_REG:
+        case EBPF_OP_JLT_REG:
+        case EBPF_OP_JLE_REG:
+        case EBPF_OP_JNE_REG:
+        case EBPF_OP_JSGT_REG:
+        case EBPF_OP_JSGE_REG:
+        case EBPF_OP_JSLT_REG:
+        case EBPF_OP_JSLE_REG:
+        case EBPF_OP_JEQ32_REG:
+        case EBPF_OP_JGT32_REG:
+        case EBPF_OP_JGE32_REG:
+        case EBPF_OP_JLT32_REG:
+        case EBPF_OP_JLE32_REG:
+        case EBPF_OP_JNE32_REG:
+        case EBPF_OP_JSGT32_REG:
+        case EBPF_OP_JSGE32_REG:
+        case EBPF_OP_JSLT32_REG:
+        case EBPF_OP_JSLE32_REG: {
+            // A 32-bit comparison compares the low halves, sign-extended. That keeps their
+            // order as unsigned values, too.
+            if (!sixty_four) {
+                emit_sign_extend32(state, temp_div_register, dst);
+                dst = temp_div_register;
+                if (src != ZERO) {
+                    emit_sign_extend32(state, offset_register, src);
+                    src = offset_register;
+                }
+            }
+            bool swap_operands;
+            enum BranchCondition cond = to_branch_condition(opcode, &swap_operands) ^ cond_invert;
+            enum Registers rs = swap_operands ? src : dst;
+            enum Registers rt = swap_operands ? dst : src;
+            // Only BEQZC and BNEZC take the zero register, and no branch compares a register
+            // with itself: copy such an operand.
+            if (cond != BR_EQ && cond != BR_NE && (rs == ZERO || rt == ZERO)) {
+                if (rs == ZERO) {
+                    rs = scratch_register;
+                } else {
+                    rt = scratch_register;
+                }
+                emit_mov(state, scratch_register, ZERO);
+            } else if (rs == rt) {
+                emit_mov(state, scratch_register, rt);
+                rt = scratch_register;
+            }
+            emit_branch(state, cond, rs, rt, tgt);
+            break;
+        }
+        case EBPF_OP_JSET_IMM:
+        case EBPF_OP_JSET32_IMM:
+        case EBPF_OP_JSET_REG:
+        case EBPF_OP_JSET32_REG:
+            if (opcode == EBPF_OP_JSET_IMM || opcode == EBPF_OP_JSET32_IMM) {
+                emit_alu_immediate(state, OPC_ANDI, temp_div_register, dst, inst.imm);
+            } else {
+                emit_alu_register(state, ALU_AND, temp_div_register, dst, src);
+            }
+            if (!sixty_four) {
+                emit_sign_extend32(state, temp_div_register, temp_div_register);
+            }
+            emit_branch(state, BR_NE ^ cond_invert, temp_div_register, ZERO, tgt);
+            break;
+        case EBPF_OP_CALL: {
+            DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit);
+            if (inst.src == 0) {
+                emit_dispatched_external_helper_call(state, vm, inst.imm);
+                if (inst.imm == vm->unwind_stack_extension_index) {
+                    emit_branch(state, BR_EQ, map_register(0), ZERO, exit_tgt);
+                }
+            } else if (inst.src == 1) {
+                uint32_t call_target = i + inst.imm + 1;
+                emit_local_call(state, call_target);
+            } else {
+                emit_jump(state, false, exit_tgt);
+            }
+            break;
+        }
+        case EBPF_OP_EXIT:
+            emit_adjust_stack(state, 16);
+            emit_return(state);
+            break;
+
+        case EBPF_OP_STXW:
+        case EBPF_OP_STXH:
+        case EBPF_OP_STXB:
+        case EBPF_OP_STXDW:
+            emit_store(state, to_store_opcode(opcode), src, dst, inst.offset);
+            break;
+        case EBPF_OP_LDXW:
+        case EBPF_OP_LDXH:
+        case EBPF_OP_LDXB:
+        case EBPF_OP_LDXDW:
+        case EBPF_OP_LDXWSX:
+        case EBPF_OP_LDXHSX:
+        case EBPF_OP_LDXBSX:
+            emit_load(state, to_load_opcode(opcode), dst, src, inst.offset);
+            break;
+
+        case EBPF_OP_ATOMIC_STORE:
+        case EBPF_OP_ATOMIC32_STORE:
+            switch (inst.imm & EBPF_ALU_OP_MASK) {
+            case EBPF_ALU_OP_ADD:
+            case EBPF_ALU_OP_OR:
+            case EBPF_ALU_OP_AND:
+            case EBPF_ALU_OP_XOR:
+            case (EBPF_ATOMIC_OP_XCHG & ~EBPF_ATOMIC_OP_FETCH):
+            case (EBPF_ATOMIC_OP_CMPXCHG & ~EBPF_ATOMIC_OP_FETCH):
+                emit_atomic_operation(state, opcode == EBPF_OP_ATOMIC_STORE, src, dst, inst.offset, inst.imm);
+                break;
+            default:
+                *errmsg = ubpf_error("Unknown atomic operation at PC %d: imm %02x", i, inst.imm);
+                state->jit_status = UnknownInstruction;
+                break;
+            }
+            break;
+
+        case EBPF_OP_LDDW: {
+            struct ebpf_inst inst2 = ubpf_fetch_instruction(vm, ++i);
+            uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
+            EMIT_LOAD_IMMEDIATE(vm, state, dst, (int64_t)imm);
+            break;
+        }
+
+        case EBPF_OP_MUL_IMM:
+        case EBPF_OP_MUL64_IMM:
+        case EBPF_OP_DIV_IMM:
+        case EBPF_OP_MOD_IMM:
+        case EBPF_OP_DIV64_IMM:
+        case EBPF_OP_MOD64_IMM:
+        case EBPF_OP_STW:
+        case EBPF_OP_STH:
+        case EBPF_OP_STB:
+        case EBPF_OP_STDW:
+            *errmsg = ubpf_error("Unexpected instruction at PC %d: opcode %02x, immediate %08x", i, opcode, inst.imm);
+            state->jit_status = UnexpectedInstruction;
+            break;
+        default:
+            *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, opcode);
+            state->jit_status = UnknownInstruction;
+        }
+
+        if (state->layout_flags[i] & LayoutJumpToTarget) {
+            DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(hot_tgt, target_pc);
+            emit_jump(state, false, hot_tgt);
+        }
+    }
+
+    if (state->jit_status != NoError) {
+        switch (state->jit_status) {
+        case TooManyJumps: {
+            *errmsg = ubpf_error("Too many jump instructions.");
+            break;
+        }
+        case TooManyLoads: {
+            *errmsg = ubpf_error("Too many load instructions.");
+            break;
+        }
+        case TooManyLeas: {
+            *errmsg = ubpf_error("Too many LEA calculations.");
+            break;
+        }
+        case TooManyLocalCalls: {
+            *errmsg = ubpf_error("Too many local calls.");
+            break;
+        }
+        case UnexpectedInstruction: {
+            // errmsg set at time the error was detected because the message requires
+            // information about the unexpected instruction.
+            break;
+        }
+        case UnknownInstruction: {
+            // errmsg set at time the error was detected because the message requires
+            // information about the unknown instruction.
+            break;
+        }
+        case NotEnoughSpace: {
+            *errmsg = ubpf_error("Target buffer too small");
+            break;
+        }
+        case NoError: {
+            assert(false);
+        }
+        }
+        return -1;
+    }
+
+    emit_jit_epilogue(state, used_registers);
+
+    return 0;
+}
+
+/* Patch an AUIPC and the JIC or JIALC after it to reach offset (relative to the AUIPC). */
+static void
+resolve_pc_relative_pair(struct jit_state* state, uint32_t offset_loc, int32_t offset)
+{
+    uint32_t instrs[2];
+    memcpy(instrs, state->buf + offset_loc, sizeof(instrs));
+    // The low half is sign-extended by the second instruction.
+    instrs[0] |= (uint32_t)(((int64_t)offset + 0x8000) >> 16) & 0xffff;
+    instrs[1] |= (uint32_t)offset & 0xffff;
+    memcpy(state->buf + offset_loc, instrs, sizeof(instrs));
+}
+
+/*
+ * Patch the compact branch (or the BC or BALC) at offset_loc, whose offset counts the
+ * instructions after the next one. Returns false if the target is out of its range.
+ */
+static bool
+resolve_branch(struct jit_state* state, uint32_t offset_loc, int32_t offset)
+{
+    assert((offset & 3) == 0);
+    uint32_t instr;
+    memcpy(&instr, state->buf + offset_loc, sizeof(uint32_t));
+    int32_t instructions = (offset - 4) / 4;
+    unsigned bits = 16;
+    switch (instr >> 26) {
+    case OPC_BC:
+    case OPC_BALC:
+        bits = 26;
+        break;
+    case OPC_POP66:
+    case OPC_POP76:
+        bits = 21;
+        break;
+    default:
+        assert(is_compact_conditional_branch(instr));
+        break;
+    }
+    if (!fits_offset(instructions, bits)) {
+        return false;
+    }
+    instr |= (uint32_t)instructions & ((1U << bits) - 1);
+    memcpy(state->buf + offset_loc, &instr, sizeof(uint32_t));
+    return true;
+}
+
+/* Patch the jump at offset_loc. Returns false if the target is out of its range. */
+static bool
+resolve_jump(struct jit_state* state, uint32_t offset_loc, int32_t offset)
+{
+    uint32_t instr;
+    memcpy(&instr, state->buf + offset_loc, sizeof(uint32_t));
+    if ((instr >> 26) == OPC_PCREL) {
+        resolve_pc_relative_pair(state, offset_loc, offset);
+        return true;
+    }
+    return resolve_branch(state, offset_loc, offset);
+}
+
+/*
+ * Patch the jumps. One that does not reach its target is marked to be emitted in its long
+ * form (see far_jumps in struct jit_state) when the program is translated again, which
+ * *retry asks for.
+ */
+static bool
+resolve_jumps(struct jit_state* state, bool* retry)
+{
+    bool resolved = true;
+    for (int i = 0; i < state->num_jumps; ++i) {
+        struct patchable_relative jump = state->jumps[i];
+
+        int32_t target_loc;
+
+        if (jump.target.is_special) {
+            if (jump.target.target.special == Exit) {
+                target_loc = state->exit_loc;
+            } else if (jump.target.target.special == Enter) {
+                target_loc = state->entry_loc;
+            } else {
+                return false;
+            }
+        } else {
+            // The jit target, if specified, takes precedence.
+            if (jump.target.target.regular.jit_target_pc != 0) {
+                target_loc = jump.target.target.regular.jit_target_pc;
+            } else {
+                target_loc = state->pc_locs[jump.target.target.regular.ebpf_target_pc];
+            }
+        }
+
+        if (!resolve_jump(state, jump.offset_loc, target_loc - (int32_t)jump.offset_loc)) {
+            state->far_jumps[i] = true;
+            *retry = true;
+            resolved = false;
+        }
+    }
+    return resolved;
+}
+
+static bool
+resolve_local_calls(struct jit_state* state)
+{
+    for (int i = 0; i < state->num_local_calls; ++i) {
+        struct patchable_relative local_call = state->local_calls[i];
+
+        // A local call must be eBPF PC-relative and it cannot be special.
+        assert(!local_call.target.is_special);
+        int32_t target_loc = state->pc_locs[local_call.target.target.regular.ebpf_target_pc];
+
+        int32_t rel = target_loc - local_call.offset_loc;
+        rel -= state->bpf_function_prolog_size;
+        // A BALC reaches ±128 MB, more than the code of any program takes.
+        if (!resolve_branch(state, local_call.offset_loc, rel)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct ubpf_jit_result
+ubpf_translate_mips64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode)
+{
+    struct jit_state state;
+    struct ubpf_jit_result compile_result;
+    uint8_t* far_jumps = calloc(UBPF_JIT_MAX_JUMPS, sizeof(far_jumps[0]));
+
+retry:
+    if (initialize_jit_state_result(&state, &compile_result, buffer, *size, jit_mode, &compile_result.errmsg) < 0) {
+        goto out;
+    }
+    if (far_jumps == NULL) {
+        compile_result.errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
+        goto out;
+    }
+    state.far_jumps = far_jumps;
+
+    if (translate(vm, &state, &compile_result.errmsg) < 0) {
+        goto out;
+    }
+
+    // Should a jump not reach its target, translate the program again with it (and every
+    // other one that does not) in its long form. As these only ever get added, this ends.
+    bool retry = false;
+    if (!resolve_jumps(&state, &retry) || !resolve_local_calls(&state)) {
+        if (retry) {
+            release_jit_state_result(&state, &compile_result);
+            goto retry;
+        }
+        compile_result.errmsg = ubpf_error("Could not patch the relative addresses in the JIT'd code.");
+        goto out;
+    }
+
+    compile_result.compile_result = UBPF_JIT_COMPILE_SUCCESS;
+    *size = state.offset;
+
+out:
+    release_jit_state_result(&state, &compile_result);
+    free(far_jumps);
+    return compile_result;
+}
+
+size_t
+ubpf_jit_entry_mips64(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through)
+{
+    struct jit_state state;
+    memset(&state, 0, sizeof(state));
+    state.buf = buffer;
+    state.size = UBPF_JIT_ENTRY_MAX_SIZE;
+
+    // The prologue keeps T8 in JIT_DATA (see emit_jit_prologue).
+    emit_load_immediate(&state, scratch_register, (int64_t)(uintptr_t)jit_data);
+    if (!fall_through) {
+        emit_load(&state, OPC_LD, call_register, scratch_register, offsetof(struct ubpf_jit_data, code));
+        emit_jump_register(&state, false, call_register);
+    }
+    return state.offset;
+}
@@ -0,0 +1,1737 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * RISC-V 64 (RV64GC) JIT backend. It follows the arm64 JIT (ubpf_jit_arm64.c) closely:
+ * the same code layout, invariants and handling of helpers, local calls and jumps.
+ *
+ * References:
+ * [RISCV-UNPRIV]: The RISC-V Instruction Set Manual, Volume I: Unprivileged ISA
+ *                 (https://github.com/riscv/riscv-isa-manual)
+ * [RISCV-ABI]: RISC-V ABIs Specification, LP64 calling convention
+ *              (https://github.com/riscv-non-isa/riscv-elf-psabi-doc)
+ */
+
+#include <stdint.h>
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "ubpf_int.h"
+#include "ubpf_jit_support.h"
+
+#if !defined(_countof)
+#define _countof(array) (sizeof(array) / sizeof(array[0]))
+#endif
+
+// All RV64 integer registers by their ABI names.
+enum Registers
+{
+    ZERO,
+    RA,
+    SP,
+    GP,
+    TP,
+    T0,
+    T1,
+    T2,
+    S0,
+    S1,
+    A0,
+    A1,
+    A2,
+    A3,
+    A4,
+    A5,
+    A6,
+    A7,
+    S2,
+    S3,
+    S4,
+    S5,
+    S6,
+    S7,
+    S8,
+    S9,
+    S10,
+    S11,
+    T3,
+    T4,
+    T5,
+    T6,
+};
+
+// Callee saved registers that the JIT'd code may use (S0 is the frame pointer and is
+// saved with the return address).
+static const enum Registers callee_saved_registers[] = {S1, S2, S3, S4, S5, S6, S7};
+// Temp register for immediate generation
+static const enum Registers temp_register = T0;
+// Temp register for division and comparison operands
+static const enum Registers temp_div_register = T1;
+// Temp register for load/store offsets and comparison operands
+static const enum Registers offset_register = T2;
+// Temp register that constant blinding uses to recover a blinded immediate.
+static const enum Registers blinding_register = T3;
+// Temp register that holds the address of a jump that does not reach its target.
+static const enum Registers far_jump_register = T6;
+// Special register for external dispatcher context.
+static const enum Registers VOLATILE_CTXT = S6;
+// Special register for the address of the VM's struct ubpf_jit_data (passed in T5 at entry).
+static const enum Registers JIT_DATA = S7;
+
+// Number of eBPF registers
+#define REGISTER_MAP_SIZE 11
+
+// Register assignments:
+//   BPF        RV64        Usage
+//   r0         a5          Return value from calls (see note)
+//   r1 - r5    a0 - a4     Function parameters, caller-saved
+//   r6 - r10   s1 - s5     Callee-saved registers
+//              s6          The context of the external dispatcher
+//              s7          The address of the VM's struct ubpf_jit_data
+//              t0 - t3     Temps - used for immediates, divisions, offsets and blinding
+//              t6          Temp - used for jumps that need an absolute target
+//
+// Note that the RISC-V ABI uses a0 both for function parameters and result. We use a5 to
+// hold the result during the function and do an extra final move at the end of the
+// function to copy the result to the correct place (like the arm64 JIT).
+static const enum Registers register_map[REGISTER_MAP_SIZE] = {
+    A5, // result
+    A0,
+    A1,
+    A2,
+    A3,
+    A4, // parameters
+    S1,
+    S2,
+    S3,
+    S4,
+    S5, // callee-saved
+};
+
+/* Return the RV64 register for the given eBPF register */
+static enum Registers
+map_register(int r)
+{
+    assert(r < REGISTER_MAP_SIZE);
+    return register_map[r % REGISTER_MAP_SIZE];
+}
+
+static uint32_t inline align_to(uint32_t amount, uint64_t boundary)
+{
+    return (amount + (boundary - 1)) & ~(boundary - 1);
+}
+
+/* Sign-extend the low bits of value. */
+static int64_t
+sign_extend(uint64_t value, unsigned bits)
+{
+    uint64_t sign = UINT64_C(1) << (bits - 1);
+    value &= (sign << 1) - 1;
+    return (int64_t)((value ^ sign) - sign);
+}
+
+/* Whether value fits in the signed 12-bit immediate of an I-type or S-type instruction. */
+static bool
+is_imm12(int64_t value)
+{
+    return value >= -2048 && value < 2048;
+}
+
+static void
+emit_bytes(struct jit_state* state, void* data, uint32_t len)
+{
+    if (!(len <= state->size && state->offset <= state->size - len)) {
+        state->jit_status = NotEnoughSpace;
+        return;
+    }
+
+    memcpy(state->buf + state->offset, data, len);
+    state->offset += len;
+}
+
+static void
+emit_instruction(struct jit_state* state, uint32_t instr)
+{
+    emit_bytes(state, &instr, 4);
+}
+
+/* [RISCV-UNPRIV]: 2.2: Base instruction formats (major opcodes). */
+enum MajorOpcode
+{
+    OPC_LOAD = 0x03,
+    OPC_OP_IMM = 0x13,
+    OPC_AUIPC = 0x17,
+    OPC_OP_IMM_32 = 0x1b,
+    OPC_STORE = 0x23,
+    OPC_AMO = 0x2f,
+    OPC_OP = 0x33,
+    OPC_LUI = 0x37,
+    OPC_OP_32 = 0x3b,
+    OPC_BRANCH = 0x63,
+    OPC_JALR = 0x67,
+    OPC_JAL = 0x6f,
+};
+
+/* The funct3 (and, in the high bits, funct7) of the register-register operations. */
+enum ALUOpcode
+{
+    ALU_ADD = 0x000,
+    ALU_SUB = 0x200,
+    ALU_SLL = 0x001,
+    ALU_SLTU = 0x003,
+    ALU_XOR = 0x004,
+    ALU_SRL = 0x005,
+    ALU_SRA = 0x205,
+    ALU_OR = 0x006,
+    ALU_AND = 0x007,
+    // [RISCV-UNPRIV]: 13: "M" Extension for Integer Multiplication and Division.
+    ALU_MUL = 0x008,
+    ALU_DIV = 0x00c,
+    ALU_DIVU = 0x00d,
+    ALU_REM = 0x00e,
+    ALU_REMU = 0x00f,
+};
+
+/* [RISCV-UNPRIV]: 2.4: Integer computational instructions (R-type). */
+static void
+emit_alu_register(
+    struct jit_state* state, bool sixty_four, enum ALUOpcode op, enum Registers rd, enum Registers rs1, enum Registers rs2)
+{
+    uint32_t funct3 = op & 0x7;
+    uint32_t funct7 = (op & 0x200) ? 0x20 : ((op & 0x8) ? 0x01 : 0x00);
+    emit_instruction(
+        state,
+        (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | (sixty_four ? OPC_OP : OPC_OP_32));
+}
+
+/* I-type instruction with a signed 12-bit immediate. */
+static void
+emit_itype(struct jit_state* state, enum MajorOpcode opcode, uint32_t funct3, enum Registers rd, enum Registers rs1, int32_t imm)
+{
+    assert(is_imm12(imm));
+    emit_instruction(state, ((uint32_t)(imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode);
+}
+
+/* The funct3 of the register-immediate operations. */
+enum ALUImmediateOpcode
+{
+    ALUI_ADDI = 0,
+    ALUI_SLLI = 1,
+    ALUI_SLTIU = 3,
+    ALUI_XORI = 4,
+    ALUI_SRLI = 5,
+    ALUI_ORI = 6,
+    ALUI_ANDI = 7,
+};
+
+/* [RISCV-UNPRIV]: 2.4.1: Integer register-immediate instructions. ADDIW is the 32-bit ADDI. */
+static void
+emit_alu_immediate(
+    struct jit_state* state, bool sixty_four, enum ALUImmediateOpcode op, enum Registers rd, enum Registers rs1, int32_t imm)
+{
+    emit_itype(state, sixty_four ? OPC_OP_IMM : OPC_OP_IMM_32, op, rd, rs1, imm);
+}
+
+enum ShiftOpcode
+{
+    SHIFT_SLL,
+    SHIFT_SRL,
+    SHIFT_SRA,
+};
+
+/* SLLI, SRLI and SRAI (or their 32-bit W forms, which shift the low 32 bits and sign-extend). */
+static void
+emit_shift_immediate(
+    struct jit_state* state, bool sixty_four, enum ShiftOpcode op, enum Registers rd, enum Registers rs1, uint32_t shift)
+{
+    uint32_t imm = shift & (sixty_four ? 63 : 31);
+    if (op == SHIFT_SRA) {
+        imm |= 0x400;
+    }
+    emit_instruction(
+        state,
+        (imm << 20) | (rs1 << 15) | ((op == SHIFT_SLL ? ALUI_SLLI : ALUI_SRLI) << 12) | (rd << 7) |
+            (sixty_four ? OPC_OP_IMM : OPC_OP_IMM_32));
+}
+
+/* rd = rs (ADDI rd, rs, 0). */
+static void
+emit_mov(struct jit_state* state, enum Registers rd, enum Registers rs)
+{
+    emit_alu_immediate(state, true, ALUI_ADDI, rd, rs, 0);
+}
+
+/* rd = the low 32 bits of rs, zero-extended (RV64GC has no single instruction for this). */
+static void
+emit_zero_extend32(struct jit_state* state, enum Registers rd, enum Registers rs)
+{
+    emit_shift_immediate(state, true, SHIFT_SLL, rd, rs, 32);
+    emit_shift_immediate(state, true, SHIFT_SRL, rd, rd, 32);
+}
+
+/* rd = the low 32 bits of rs, sign-extended (ADDIW rd, rs, 0). */
+static void
+emit_sign_extend32(struct jit_state* state, enum Registers rd, enum Registers rs)
+{
+    emit_alu_immediate(state, false, ALUI_ADDI, rd, rs, 0);
+}
+
+/* [RISCV-UNPRIV]: 2.4.1: LUI and AUIPC (U-type). */
+static void
+emit_upper_immediate(struct jit_state* state, enum MajorOpcode opcode, enum Registers rd, uint32_t imm20)
+{
+    emit_instruction(state, ((imm20 & 0xfffff) << 12) | (rd << 7) | opcode);
+}
+
+/*
+ * Load a 64-bit immediate into rd with the shortest of the usual sequences: LUI and ADDIW
+ * for a sign-extended 32-bit value and, for others, the upper bits followed by a shift
+ * and an ADDI of the low 12 bits.
+ */
+static void
+emit_load_immediate(struct jit_state* state, enum Registers rd, int64_t imm)
+{
+    if (imm == (int32_t)imm) {
+        int64_t lo12 = sign_extend((uint64_t)imm, 12);
+        uint32_t hi20 = (uint32_t)(((uint64_t)imm + 0x800) >> 12) & 0xfffff;
+        if (hi20 == 0) {
+            emit_alu_immediate(state, true, ALUI_ADDI, rd, ZERO, (int32_t)lo12);
+            return;
+        }
+        emit_upper_immediate(state, OPC_LUI, rd, hi20);
+        if (lo12) {
+            emit_alu_immediate(state, false, ALUI_ADDI, rd, rd, (int32_t)lo12);
+        }
+        return;
+    }
+
+    int64_t lo12 = sign_extend((uint64_t)imm, 12);
+    uint64_t hi52 = ((uint64_t)imm + 0x800) >> 12;
+    unsigned shift = 12;
+    while (!(hi52 & 1)) {
+        hi52 >>= 1;
+        shift++;
+    }
+    emit_load_immediate(state, rd, sign_extend(hi52, 64 - shift));
+    emit_shift_immediate(state, true, SHIFT_SLL, rd, rd, shift);
+    if (lo12) {
+        emit_alu_immediate(state, true, ALUI_ADDI, rd, rd, (int32_t)lo12);
+    }
+}
+
+/* Load an immediate with constant blinding: the immediate XORed with a random value and
+ * the random value are loaded and XORed to recover the original constant, preventing JIT
+ * spray attacks.
+ */
+static void
+emit_load_immediate_blinded(struct jit_state* state, enum Registers rd, int64_t imm)
+{
+    assert(rd != blinding_register);
+    uint64_t random = ubpf_generate_blinding_constant();
+    emit_load_immediate(state, rd, (int64_t)((uint64_t)imm ^ random));
+    emit_load_immediate(state, blinding_register, (int64_t)random);
+    emit_alu_register(state, true, ALU_XOR, rd, rd, blinding_register);
+}
+
+#define EMIT_LOAD_IMMEDIATE(vm, state, rd, imm) \
+    do { \
+        if ((vm)->constant_blinding_enabled) { \
+            emit_load_immediate_blinded(state, rd, imm); \
+        } else { \
+            emit_load_immediate(state, rd, imm); \
+        } \
+    } while (0)
+
+/* rd = rs + imm. scratch is clobbered if imm does not fit in an ADDI. */
+static void
+emit_add_immediate(struct jit_state* state, enum Registers rd, enum Registers rs, int64_t imm, enum Registers scratch)
+{
+    if (is_imm12(imm)) {
+        emit_alu_immediate(state, true, ALUI_ADDI, rd, rs, (int32_t)imm);
+    } else {
+        emit_load_immediate(state, scratch, imm);
+        emit_alu_register(state, true, ALU_ADD, rd, rs, scratch);
+    }
+}
+
+/* The funct3 of the loads ([RISCV-UNPRIV]: 2.6 and 5.3). */
+enum LoadOpcode
+{
+    LD_LB = 0,
+    LD_LH = 1,
+    LD_LW = 2,
+    LD_LD = 3,
+    LD_LBU = 4,
+    LD_LHU = 5,
+    LD_LWU = 6,
+};
+
+/* The funct3 of the stores. */
+enum StoreOpcode
+{
+    ST_SB = 0,
+    ST_SH = 1,
+    ST_SW = 2,
+    ST_SD = 3,
+};
+
+static void
+emit_load(struct jit_state* state, enum LoadOpcode op, enum Registers rd, enum Registers base, int32_t offset)
+{
+    emit_itype(state, OPC_LOAD, op, rd, base, offset);
+}
+
+/* [RISCV-UNPRIV]: 2.6: Load and store instructions (S-type). */
+static void
+emit_store(struct jit_state* state, enum StoreOpcode op, enum Registers rs, enum Registers base, int32_t offset)
+{
+    assert(is_imm12(offset));
+    uint32_t imm = (uint32_t)offset & 0xfff;
+    emit_instruction(
+        state, ((imm >> 5) << 25) | (rs << 20) | (base << 15) | (op << 12) | ((imm & 0x1f) << 7) | OPC_STORE);
+}
+
+/* [RISCV-UNPRIV]: 8: "A" Extension for Atomic Instructions (funct5). */
+enum AtomicOpcode
+{
+    AMO_ADD = 0x00,
+    AMO_SWAP = 0x01,
+    AMO_LR = 0x02,
+    AMO_SC = 0x03,
+    AMO_XOR = 0x04,
+    AMO_OR = 0x08,
+    AMO_AND = 0x0c,
+};
+
+/* An AMO (or LR/SC) on the word or doubleword at (addr). ordered sets both aq and rl. */
+static void
+emit_atomic(
+    struct jit_state* state,
+    bool sixty_four,
+    enum AtomicOpcode op,
+    bool ordered,
+    enum Registers rd,
+    enum Registers addr,
+    enum Registers rs2)
+{
+    emit_instruction(
+        state,
+        ((uint32_t)op << 27) | ((ordered ? 3U : 0U) << 25) | (rs2 << 20) | (addr << 15) | ((sixty_four ? 3U : 2U) << 12) |
+            (rd << 7) | OPC_AMO);
+}
+
+/* The funct3 of the conditional branches. Conditions come in pairs that differ only in
+ * their low bit (like the Arm condition codes).
+ */
+enum BranchCondition
+{
+    BR_BEQ = 0,
+    BR_BNE = 1,
+    BR_BLT = 4,
+    BR_BGE = 5,
+    BR_BLTU = 6,
+    BR_BGEU = 7,
+};
+
+/* The immediate fields of a B-type instruction for a (byte) offset. */
+static uint32_t
+encode_branch_offset(int32_t offset)
+{
+    uint32_t imm = (uint32_t)offset;
+    return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (((imm >> 1) & 0xf) << 8) |
+           (((imm >> 11) & 1) << 7);
+}
+
+/* The immediate fields of a J-type instruction for a (byte) offset. */
+static uint32_t
+encode_jump_offset(int32_t offset)
+{
+    uint32_t imm = (uint32_t)offset;
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20) |
+           (((imm >> 12) & 0xff) << 12);
+}
+
+/* [RISCV-UNPRIV]: 2.5.2: Conditional branches, with an offset known when it is emitted. */
+static void
+emit_branch_offset(
+    struct jit_state* state, enum BranchCondition cond, enum Registers rs1, enum Registers rs2, int32_t offset)
+{
+    emit_instruction(state, encode_branch_offset(offset) | (rs2 << 20) | (rs1 << 15) | (cond << 12) | OPC_BRANCH);
+}
+
+/* Note a jump (or a call of special code) at the current offset, to be patched by resolve_jumps. */
+static void
+note_jump(struct jit_state* state, struct PatchableTarget target)
+{
+    if (state->num_jumps == UBPF_JIT_MAX_JUMPS) {
+        state->jit_status = TooManyJumps;
+        return;
+    }
+    emit_patchable_relative(state->jumps, state->offset, target, state->num_jumps++);
+}
+
+/* Whether the jump that is emitted next did not reach its target the last time. */
+static bool
+next_jump_is_far(const struct jit_state* state)
+{
+    return state->far_jumps != NULL && state->num_jumps < UBPF_JIT_MAX_JUMPS && state->far_jumps[state->num_jumps];
+}
+
+/*
+ * [RISCV-UNPRIV]: 2.5.1: Unconditional jumps. Jump to the target (JAL, which reaches
+ * ±1 MB) and, if rd is RA, put the return address there. A jump that did not reach its
+ * target before is emitted as an AUIPC and a JALR instead, which reach ±2 GB. Returns the
+ * location of the jump, to be used with emit_jump_target.
+ */
+static uint32_t
+emit_jump(struct jit_state* state, enum Registers rd, struct PatchableTarget target)
+{
+    assert(rd == ZERO || rd == RA);
+    uint32_t source_offset = state->offset;
+    if (next_jump_is_far(state)) {
+        enum Registers base = rd == RA ? RA : far_jump_register;
+        note_jump(state, target);
+        emit_upper_immediate(state, OPC_AUIPC, base, 0);
+        emit_itype(state, OPC_JALR, 0, rd, base, 0);
+        return source_offset;
+    }
+    note_jump(state, target);
+    emit_instruction(state, (rd << 7) | OPC_JAL);
+    return source_offset;
+}
+
+/*
+ * Jump to the target if the condition holds for rs1 and rs2. A conditional branch only
+ * reaches ±4 KB, so one that did not reach its target before is emitted as a branch on
+ * the opposite condition over a jump (see emit_jump).
+ */
+static uint32_t
+emit_branch(
+    struct jit_state* state, enum BranchCondition cond, enum Registers rs1, enum Registers rs2, struct PatchableTarget target)
+{
+    if (next_jump_is_far(state)) {
+        emit_branch_offset(state, cond ^ 1, rs1, rs2, 12);
+        return emit_jump(state, ZERO, target);
+    }
+    uint32_t source_offset = state->offset;
+    note_jump(state, target);
+    emit_branch_offset(state, cond, rs1, rs2, 0);
+    return source_offset;
+}
+
+/* Return to the address in RA (JALR zero, 0(ra)). */
+static void
+emit_return(struct jit_state* state)
+{
+    emit_itype(state, OPC_JALR, 0, ZERO, RA, 0);
+}
+
+/*
+ * Select the callee-saved registers that the prologue has to save and the epilogue
+ * has to restore: the ones that hold the context of the external dispatcher and the
+ * address of the struct ubpf_jit_data and those that are mapped to an eBPF register
+ * the program uses (see compute_used_registers).
+ * Returns the number written to saved_registers.
+ */
+static unsigned
+select_saved_registers(uint16_t used_registers, enum Registers* saved_registers)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < _countof(callee_saved_registers); i++) {
+        enum Registers reg = callee_saved_registers[i];
+        bool used = reg == VOLATILE_CTXT || reg == JIT_DATA;
+        for (int r = 0; r < _BPF_REG_MAX && !used; r++) {
+            used = (used_registers & (1 << r)) && map_register(r) == reg;
+        }
+        if (used) {
+            saved_registers[count++] = reg;
+        }
+    }
+    return count;
+}
+
+/* Subtract (or add) the given number of bytes from (to) SP. */
+static void
+emit_adjust_stack(struct jit_state* state, int64_t bytes)
+{
+    emit_add_immediate(state, SP, SP, bytes, temp_register);
+}
+
+/* Generate the function prologue.
+ *
+ * We set the stack to look like:
+ *   ubpf_stack_size bytes of UBPF stack (none if the program never uses r10)
+ *   Return address
+ *   Frame pointer (S0) on entry
+ *   Callee saved registers (only those the program uses, see select_saved_registers)
+ *   Frame (S0) <- SP.
+ * Precondition: The runtime stack pointer is 16-byte aligned.
+ * Postcondition:  The runtime stack pointer is 16-byte aligned.
+ */
+static void
+emit_jit_prologue(struct jit_state* state, struct ubpf_vm* vm, uint16_t used_registers)
+{
+    size_t ubpf_stack_size = vm->stack_requirement;
+    enum Registers saved_registers[_countof(callee_saved_registers)];
+    unsigned num_saved_registers = select_saved_registers(used_registers, saved_registers);
+
+    emit_adjust_stack(state, -16);
+    emit_store(state, ST_SD, RA, SP, 8);
+    emit_store(state, ST_SD, S0, SP, 0);
+
+    state->stack_size = align_to(num_saved_registers * 8, 16);
+    emit_adjust_stack(state, -(int64_t)state->stack_size);
+    /* Save callee saved registers */
+    for (unsigned i = 0; i < num_saved_registers; i++) {
+        emit_store(state, ST_SD, saved_registers[i], SP, i * 8);
+    }
+    emit_mov(state, S0, SP);
+
+    if (state->jit_mode == BasicJitMode) {
+        /* Setup UBPF frame pointer. */
+        if (used_registers & (1 << BPF_REG_10)) {
+            emit_mov(state, map_register(10), SP);
+        }
+        if (ubpf_stack_size) {
+            emit_adjust_stack(state, -(int64_t)ubpf_stack_size);
+        }
+    } else if (used_registers & (1 << BPF_REG_10)) {
+        emit_alu_register(state, true, ALU_ADD, map_register(10), A2, A3);
+    }
+
+    /* Copy A0 to the volatile context for safe keeping. */
+    emit_mov(state, VOLATILE_CTXT, A0);
+    /* And the hidden argument from the entry stub (see ubpf_jit_entry_riscv64). */
+    emit_mov(state, JIT_DATA, T5);
+
+    DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit);
+    DECLARE_PATCHABLE_SPECIAL_TARGET(enter_tgt, Enter);
+    emit_jump(state, RA, enter_tgt);
+    emit_jump(state, ZERO, exit_tgt);
+    state->entry_loc = state->offset;
+}
+
+static void
+emit_jit_epilogue(struct jit_state* state, uint16_t used_registers)
+{
+    enum Registers saved_registers[_countof(callee_saved_registers)];
+    unsigned num_saved_registers = select_saved_registers(used_registers, saved_registers);
+
+    state->exit_loc = state->offset;
+
+    /* Move register 0 into A0 */
+    emit_mov(state, A0, map_register(0));
+
+    /* We could be anywhere in the stack if we excepted. Get our head right. */
+    emit_mov(state, SP, S0);
+
+    /* Restore callee-saved registers.  */
+    for (unsigned i = 0; i < num_saved_registers; i++) {
+        emit_load(state, LD_LD, saved_registers[i], SP, i * 8);
+    }
+    emit_adjust_stack(state, state->stack_size);
+
+    emit_load(state, LD_LD, RA, SP, 8);
+    emit_load(state, LD_LD, S0, SP, 0);
+    emit_adjust_stack(state, 16);
+
+    emit_return(state);
+}
+
+static void
+emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm, unsigned int idx)
+{
+    /*
+     * There are two paths through the function:
+     * 1. There is an external dispatcher registered. If so, we prioritize that.
+     * 2. We fall back to the regular registered helper.
+     * See translate and emit_dispatched_external_helper_call in ubpf_jit_x86_64.c for additional
+     * details.
+     */
+
+    emit_adjust_stack(state, -16);
+    emit_store(state, ST_SD, RA, SP, 0);
+
+    // Determine whether to call it through a dispatcher or by index and then load up the address
+    // of that function. Both live in the VM's struct ubpf_jit_data, whose address is in JIT_DATA.
+    emit_load(state, LD_LD, temp_div_register, JIT_DATA, offsetof(struct ubpf_jit_data, dispatcher));
+
+    // Jump to the call if we are ready to roll (because we are using an external dispatcher).
+    DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(default_tgt, 0);
+    uint32_t external_dispatcher_jump_source = emit_branch(state, BR_BNE, temp_div_register, ZERO, default_tgt);
+
+    // We are not ready to roll. In other words, we are going to load the helper function address by index.
+    // Validation guarantees that idx names a registered helper when there is no external dispatcher.
+    emit_load(
+        state,
+        LD_LD,
+        temp_div_register,
+        JIT_DATA,
+        offsetof(struct ubpf_jit_data, helpers) + (idx % MAX_EXT_FUNCS) * sizeof(extended_external_helper_t));
+
+    // Add the implicit 6th parameter (the context)
+    emit_mov(state, A5, VOLATILE_CTXT);
+
+    // And now we, too, are ready to roll. So, let's jump around the code that sets up the additional
+    // parameters for the external dispatcher. We will end up at the call site where both paths
+    // will rendezvous.
+    uint32_t no_dispatcher_jump_source = emit_jump(state, ZERO, default_tgt);
+
+    // Mark the landing spot for the jump around the code that sets up a call to a helper function
+    // when no external dispatcher is present.
+    emit_jump_target(state, external_dispatcher_jump_source);
+
+    // ... set up the final two arguments for the external dispatcher: the index of the helper to be
+    // invoked and the context.
+    EMIT_LOAD_IMMEDIATE(vm, state, A5, idx);
+    emit_mov(state, A6, VOLATILE_CTXT);
+
+    // Mark the landing spot for the jump around the external-dispatcher-argument-setup code.
+    emit_jump_target(state, no_dispatcher_jump_source);
+
+    // Both paths meet here -- all that's left is to call!
+    emit_itype(state, OPC_JALR, 0, RA, temp_div_register, 0);
+
+    /* On exit need to move result from A0 to whichever register we've mapped EBPF r0 to.  */
+    emit_mov(state, map_register(0), A0);
+
+    emit_load(state, LD_LD, RA, SP, 0);
+    emit_adjust_stack(state, 16);
+}
+
+/* Call the local function at target_pc (with an AUIPC and a JALR, see resolve_local_calls). */
+static void
+emit_local_call(struct jit_state* state, uint32_t target_pc)
+{
+    emit_load(state, LD_LD, temp_register, SP, 0);
+    emit_alu_register(state, true, ALU_SUB, map_register(10), map_register(10), temp_register);
+
+    uint32_t stack_movement = align_to(48, 16);
+    emit_adjust_stack(state, -(int64_t)stack_movement);
+
+    emit_store(state, ST_SD, RA, SP, 0);
+    emit_store(state, ST_SD, temp_register, SP, 8);
+    for (int r = 6; r <= 9; r++) {
+        emit_store(state, ST_SD, map_register(r), SP, 16 + (r - 6) * 8);
+    }
+
+    if (state->num_local_calls == UBPF_MAX_INSTS) {
+        state->jit_status = TooManyLocalCalls;
+        return;
+    }
+    DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(tgt, target_pc);
+    emit_patchable_relative(state->local_calls, state->offset, tgt, state->num_local_calls++);
+    emit_upper_immediate(state, OPC_AUIPC, RA, 0);
+    emit_itype(state, OPC_JALR, 0, RA, RA, 0);
+
+    emit_load(state, LD_LD, RA, SP, 0);
+    emit_load(state, LD_LD, temp_register, SP, 8);
+    for (int r = 6; r <= 9; r++) {
+        emit_load(state, LD_LD, map_register(r), SP, 16 + (r - 6) * 8);
+    }
+
+    emit_adjust_stack(state, stack_movement);
+
+    emit_alu_register(state, true, ALU_ADD, map_register(10), map_register(10), temp_register);
+}
+
+/*
+ * Emit an atomic operation on the word or doubleword at addr_reg + offset. The AMOs that
+ * fetch (and XCHG and CMPXCHG) are fully ordered (aq and rl set), like the AL forms that
+ * the arm64 JIT emits; the others are not ordered. A fetched word is zero-extended.
+ */
+static void
+emit_atomic_operation(
+    struct jit_state* state,
+    struct ubpf_vm* vm,
+    bool sixty_four,
+    enum Registers value_reg,
+    enum Registers addr_reg,
+    int16_t offset,
+    int32_t imm)
+{
+    bool fetch = imm & EBPF_ATOMIC_OP_FETCH;
+    enum Registers addr_temp = temp_div_register;
+    if (offset == 0) {
+        addr_temp = addr_reg;
+    } else if (is_imm12(offset)) {
+        emit_alu_immediate(state, true, ALUI_ADDI, addr_temp, addr_reg, offset);
+    } else {
+        EMIT_LOAD_IMMEDIATE(vm, state, offset_register, offset);
+        emit_alu_register(state, true, ALU_ADD, addr_temp, addr_reg, offset_register);
+    }
+
+    if ((imm & EBPF_ALU_OP_MASK) == (EBPF_ATOMIC_OP_CMPXCHG & ~EBPF_ATOMIC_OP_FETCH)) {
+        // LR/SC loop: load the old value and, if it is what r0 holds, store the new one;
+        // r0 gets the old value. LR.W sign-extends, so r0 is, too, to compare them.
+        enum Registers expected_reg = map_register(0);
+        if (!sixty_four) {
+            emit_sign_extend32(state, blinding_register, expected_reg);
+            expected_reg = blinding_register;
+        }
+        emit_atomic(state, sixty_four, AMO_LR, true, temp_register, addr_temp, ZERO);
+        emit_branch_offset(state, BR_BNE, temp_register, expected_reg, 12);
+        emit_atomic(state, sixty_four, AMO_SC, true, offset_register, addr_temp, value_reg);
+        emit_branch_offset(state, BR_BNE, offset_register, ZERO, -12);
+        if (sixty_four) {
+            emit_mov(state, map_register(0), temp_register);
+        } else {
+            emit_zero_extend32(state, map_register(0), temp_register);
+        }
+        return;
+    }
+
+    enum AtomicOpcode op = AMO_ADD;
+    switch (imm & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+        op = AMO_ADD;
+        break;
+    case EBPF_ALU_OP_OR:
+        op = AMO_OR;
+        break;
+    case EBPF_ALU_OP_AND:
+        op = AMO_AND;
+        break;
+    case EBPF_ALU_OP_XOR:
+        op = AMO_XOR;
+        break;
+    case (EBPF_ATOMIC_OP_XCHG & ~EBPF_ATOMIC_OP_FETCH):
+        op = AMO_SWAP;
+        fetch = true;
+        break;
+    default:
+        // Should not happen
+        break;
+    }
+    emit_atomic(state, sixty_four, op, fetch, fetch ? value_reg : ZERO, addr_temp, value_reg);
+    if (fetch && !sixty_four) {
+        emit_zero_extend32(state, value_reg, value_reg);
+    }
+}
+
+/*
+ * Swap the bytes of the low bits of rd (16, 32 or 64) into its low bits, zero-extended.
+ * RV64GC has no byte reverse instruction (that needs Zbb), so the bytes are moved one by
+ * one.
+ */
+static void
+emit_byte_swap(struct jit_state* state, enum Registers rd, uint32_t bits)
+{
+    unsigned bytes = bits / 8;
+    for (unsigned k = 0; k < bytes; k++) {
+        enum Registers byte = k == 0 ? temp_register : temp_div_register;
+        if (k == 0) {
+            emit_alu_immediate(state, true, ALUI_ANDI, byte, rd, 0xff);
+        } else {
+            emit_shift_immediate(state, true, SHIFT_SRL, byte, rd, 8 * k);
+            if (k != 7) {
+                emit_alu_immediate(state, true, ALUI_ANDI, byte, byte, 0xff);
+            }
+        }
+        if (k != bytes - 1) {
+            emit_shift_immediate(state, true, SHIFT_SLL, byte, byte, 8 * (bytes - 1 - k));
+        }
+        if (k != 0) {
+            emit_alu_register(state, true, ALU_OR, temp_register, temp_register, byte);
+        }
+    }
+    emit_mov(state, rd, temp_register);
+}
+
+static bool
+is_imm_op(struct ebpf_inst const* inst)
+{
+    int class = inst->opcode & EBPF_CLS_MASK;
+    bool is_imm = (inst->opcode & EBPF_SRC_REG) == EBPF_SRC_IMM;
+    bool is_endian = (inst->opcode & EBPF_ALU_OP_MASK) == 0xd0;
+    bool is_neg = (inst->opcode & EBPF_ALU_OP_MASK) == 0x80;
+    bool is_call = inst->opcode == EBPF_OP_CALL;
+    bool is_exit = inst->opcode == EBPF_OP_EXIT;
+    bool is_ja = inst->opcode == EBPF_OP_JA || inst->opcode == EBPF_OP_JA32;
+    bool is_alu = (class == EBPF_CLS_ALU || class == EBPF_CLS_ALU64) && !is_endian && !is_neg;
+    bool is_jmp = (class == EBPF_CLS_JMP && !is_ja && !is_call && !is_exit);
+    bool is_jmp32 = (class == EBPF_CLS_JMP32 && inst->opcode != EBPF_OP_JA32);
+    bool is_store = class == EBPF_CLS_ST;
+    return (is_imm && (is_alu || is_jmp || is_jmp32)) || is_store;
+}
+
+static bool
+is_alu64_op(struct ebpf_inst const* inst)
+{
+    int class = inst->opcode & EBPF_CLS_MASK;
+    return class == EBPF_CLS_ALU64 || class == EBPF_CLS_JMP;
+}
+
+/* Whether the immediate of an instruction can be encoded in the instruction(s) emitted for it
+ * (see translate) instead of having to be moved into a temporary register first.
+ */
+static bool
+is_simple_imm(struct ebpf_inst const* inst)
+{
+    switch (inst->opcode) {
+    case EBPF_OP_ADD_IMM:
+    case EBPF_OP_ADD64_IMM:
+    case EBPF_OP_AND_IMM:
+    case EBPF_OP_AND64_IMM:
+    case EBPF_OP_OR_IMM:
+    case EBPF_OP_OR64_IMM:
+    case EBPF_OP_XOR_IMM:
+    case EBPF_OP_XOR64_IMM:
+    case EBPF_OP_JSET_IMM:
+    case EBPF_OP_JSET32_IMM:
+        return is_imm12(inst->imm);
+    case EBPF_OP_SUB_IMM:
+    case EBPF_OP_SUB64_IMM:
+        // Subtracting is adding the negated immediate.
+        return is_imm12(-(int64_t)inst->imm);
+    case EBPF_OP_JEQ_IMM:
+    case EBPF_OP_JGT_IMM:
+    case EBPF_OP_JGE_IMM:
+    case EBPF_OP_JNE_IMM:
+    case EBPF_OP_JSGT_IMM:
+    case EBPF_OP_JSGE_IMM:
+    case EBPF_OP_JLT_IMM:
+    case EBPF_OP_JLE_IMM:
+    case EBPF_OP_JSLT_IMM:
+    case EBPF_OP_JSLE_IMM:
+    case EBPF_OP_JEQ32_IMM:
+    case EBPF_OP_JGT32_IMM:
+    case EBPF_OP_JGE32_IMM:
+    case EBPF_OP_JNE32_IMM:
+    case EBPF_OP_JSGT32_IMM:
+    case EBPF_OP_JSGE32_IMM:
+    case EBPF_OP_JLT32_IMM:
+    case EBPF_OP_JLE32_IMM:
+    case EBPF_OP_JSLT32_IMM:
+    case EBPF_OP_JSLE32_IMM:
+        // Branches compare two registers; 0 is in the zero register.
+        return inst->imm == 0;
+    case EBPF_OP_MOV_IMM:
+    case EBPF_OP_MOV64_IMM:
+        return true;
+    case EBPF_OP_ARSH_IMM:
+    case EBPF_OP_ARSH64_IMM:
+    case EBPF_OP_LSH_IMM:
+    case EBPF_OP_LSH64_IMM:
+    case EBPF_OP_RSH_IMM:
+    case EBPF_OP_RSH64_IMM:
+        return true;
+    case EBPF_OP_DIV_IMM:
+    case EBPF_OP_DIV64_IMM:
+    case EBPF_OP_MOD_IMM:
+    case EBPF_OP_MOD64_IMM:
+    case EBPF_OP_MUL_IMM:
+    case EBPF_OP_MUL64_IMM:
+        return false;
+    case EBPF_OP_STB:
+    case EBPF_OP_STH:
+    case EBPF_OP_STW:
+    case EBPF_OP_STDW:
+        // Zero is stored from the zero register.
+        return inst->imm == 0;
+    default:
+        assert(false);
+        return false;
+    }
+}
+
+static uint8_t
+to_reg_op(uint8_t opcode)
+{
+    int class = opcode & EBPF_CLS_MASK;
+    if (class == EBPF_CLS_ALU64 || class == EBPF_CLS_ALU || class == EBPF_CLS_JMP || class == EBPF_CLS_JMP32) {
+        return opcode | EBPF_SRC_REG;
+    } else if (class == EBPF_CLS_ST) {
+        return (opcode & ~EBPF_CLS_MASK) | EBPF_CLS_STX;
+    }
+    assert(false);
+    return 0;
+}
+
+static enum ALUOpcode
+to_alu_opcode(int opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+        return ALU_ADD;
+    case EBPF_ALU_OP_SUB:
+        return ALU_SUB;
+    case EBPF_ALU_OP_MUL:
+        return ALU_MUL;
+    case EBPF_ALU_OP_OR:
+        return ALU_OR;
+    case EBPF_ALU_OP_AND:
+        return ALU_AND;
+    case EBPF_ALU_OP_XOR:
+        return ALU_XOR;
+    case EBPF_ALU_OP_LSH:
+        return ALU_SLL;
+    case EBPF_ALU_OP_RSH:
+        return ALU_SRL;
+    case EBPF_ALU_OP_ARSH:
+        return ALU_SRA;
+    default:
+        assert(false);
+        return ALU_ADD;
+    }
+}
+
+static enum ALUImmediateOpcode
+to_alu_immediate_opcode(int opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+    case EBPF_ALU_OP_SUB:
+        return ALUI_ADDI;
+    case EBPF_ALU_OP_OR:
+        return ALUI_ORI;
+    case EBPF_ALU_OP_AND:
+        return ALUI_ANDI;
+    case EBPF_ALU_OP_XOR:
+        return ALUI_XORI;
+    default:
+        assert(false);
+        return ALUI_ADDI;
+    }
+}
+
+static enum ShiftOpcode
+to_shift_opcode(int opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_LSH:
+        return SHIFT_SLL;
+    case EBPF_ALU_OP_RSH:
+        return SHIFT_SRL;
+    default:
+        return SHIFT_SRA;
+    }
+}
+
+static enum LoadOpcode
+to_load_opcode(int opcode)
+{
+    switch (opcode) {
+    case EBPF_OP_LDXW:
+        return LD_LWU;
+    case EBPF_OP_LDXH:
+        return LD_LHU;
+    case EBPF_OP_LDXB:
+        return LD_LBU;
+    case EBPF_OP_LDXDW:
+        return LD_LD;
+    case EBPF_OP_LDXWSX:
+        return LD_LW;
+    case EBPF_OP_LDXHSX:
+        return LD_LH;
+    case EBPF_OP_LDXBSX:
+        return LD_LB;
+    default:
+        assert(false);
+        return LD_LD;
+    }
+}
+
+static enum StoreOpcode
+to_store_opcode(int opcode)
+{
+    switch (opcode & EBPF_SIZE_DW) {
+    case EBPF_SIZE_B:
+        return ST_SB;
+    case EBPF_SIZE_H:
+        return ST_SH;
+    case EBPF_SIZE_W:
+        return ST_SW;
+    default:
+        return ST_SD;
+    }
+}
+
+/*
+ * The branch for a conditional jump that compares dst with src. RISC-V only has "less
+ * than" and "greater or equal" branches, so for the others, the operands are swapped.
+ */
+static enum BranchCondition
+to_branch_condition(int opcode, bool* swap_operands)
+{
+    *swap_operands = false;
+    switch (opcode & EBPF_JMP_OP_MASK) {
+    case EBPF_MODE_JEQ:
+        return BR_BEQ;
+    case EBPF_MODE_JNE:
+    case EBPF_MODE_JSET:
+        return BR_BNE;
+    case EBPF_MODE_JGT:
+        *swap_operands = true;
+        return BR_BLTU;
+    case EBPF_MODE_JGE:
+        return BR_BGEU;
+    case EBPF_MODE_JLT:
+        return BR_BLTU;
+    case EBPF_MODE_JLE:
+        *swap_operands = true;
+        return BR_BGEU;
+    case EBPF_MODE_JSGT:
+        *swap_operands = true;
+        return BR_BLT;
+    case EBPF_MODE_JSGE:
+        return BR_BGE;
+    case EBPF_MODE_JSLT:
+        return BR_BLT;
+    case EBPF_MODE_JSLE:
+        *swap_operands = true;
+        return BR_BGE;
+    default:
+        assert(false);
+        return BR_BEQ;
+    }
+}
+
+/* Whether a (32-bit) conditional jump compares its operands as signed values. */
+static bool
+is_signed_condition(int opcode)
+{
+    switch (opcode & EBPF_JMP_OP_MASK) {
+    case EBPF_MODE_JSGT:
+    case EBPF_MODE_JSGE:
+    case EBPF_MODE_JSLT:
+    case EBPF_MODE_JSLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Divide (or take the remainder of) rn by rm into rd. RISC-V division by zero returns
+ * all ones (and the remainder the dividend), but eBPF wants 0 for the quotient, so it is
+ * masked unless the divisor is known not to be zero. The overflowing signed division
+ * returns what eBPF wants.
+ */
+static void
+divmod(struct jit_state* state, uint8_t opcode, enum Registers rd, enum Registers rn, enum Registers rm, int16_t offset, bool divisor_may_be_zero)
+{
+    bool mod = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK);
+    bool sixty_four = (opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    bool is_signed = (offset == 1);
+
+    if (mod) {
+        emit_alu_register(state, sixty_four, is_signed ? ALU_REM : ALU_REMU, rd, rn, rm);
+    } else if (!divisor_may_be_zero) {
+        emit_alu_register(state, sixty_four, is_signed ? ALU_DIV : ALU_DIVU, rd, rn, rm);
+    } else {
+        // temp_div_register = (divisor != 0) ? ~0 : 0
+        if (sixty_four) {
+            emit_alu_register(state, true, ALU_SLTU, temp_div_register, ZERO, rm);
+        } else {
+            emit_shift_immediate(state, true, SHIFT_SLL, temp_div_register, rm, 32);
+            emit_alu_register(state, true, ALU_SLTU, temp_div_register, ZERO, temp_div_register);
+        }
+        emit_alu_register(state, true, ALU_SUB, temp_div_register, ZERO, temp_div_register);
+        emit_alu_register(state, sixty_four, is_signed ? ALU_DIV : ALU_DIVU, rd, rn, rm);
+        emit_alu_register(state, true, ALU_AND, rd, rd, temp_div_register);
+    }
+    if (!sixty_four) {
+        emit_zero_extend32(state, rd, rd);
+    }
+}
+
+/*
+ * The layout of the JIT'd code follows a certain pattern. There are
+ * several invariants in the JIT'd code as well. Those are documented
+ * in the translate function of the x86_64 JIT. Like on Arm, the stack usage
+ * of a function is pushed twice to keep the stack 16-byte aligned.
+ */
+static int
+translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
+{
+    int i;
+    uint16_t used_registers = compute_used_registers(vm);
+
+    emit_jit_prologue(state, vm, used_registers);
+
+    compute_jit_layout(vm, state);
+
+    for (uint32_t n = 0; n < state->layout_size; n++) {
+
+        if (state->jit_status != NoError) {
+            break;
+        }
+
+        i = state->layout[n];
+
+        // All checks for errors during the encoding of _this_ instruction
+        // occur at the end of the loop.
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
+
+        // If
+        // a) the previous instruction in the eBPF program could fallthrough
+        //    to this instruction and
+        // b) the current instruction starts a local function,
+        // then there has to be a means to "jump around" the code that
+        // manipulates the stack when the program executes in the fallthrough
+        // path.
+        uint32_t fallthrough_jump_source = 0;
+        bool fallthrough_jump_present = false;
+        if (i != 0 && vm->int_funcs[i]) {
+            struct ebpf_inst prev_inst = ubpf_fetch_instruction(vm, i - 1);
+            if (ubpf_instruction_has_fallthrough(prev_inst)) {
+                DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(default_tgt, 0)
+                fallthrough_jump_source = emit_jump(state, ZERO, default_tgt);
+                fallthrough_jump_present = true;
+            }
+        }
+
+        if (i == 0 || vm->int_funcs[i]) {
+            // The stack usage is always loaded with a LUI and an ADDIW so that every function
+            // has a prolog of the same size.
+            size_t prolog_start = state->offset;
+            int64_t stack_usage = ubpf_stack_usage_for_local_func(vm, i);
+            emit_upper_immediate(state, OPC_LUI, temp_register, (uint32_t)((stack_usage + 0x800) >> 12));
+            emit_alu_immediate(state, false, ALUI_ADDI, temp_register, temp_register, (int32_t)sign_extend(stack_usage, 12));
+            emit_adjust_stack(state, -16);
+            emit_store(state, ST_SD, temp_register, SP, 0);
+            emit_store(state, ST_SD, temp_register, SP, 8);
+            // Record the size of the prolog so that we can calculate offset when doing a local call.
+            if (state->bpf_function_prolog_size == 0) {
+                state->bpf_function_prolog_size = state->offset - prolog_start;
+            } else {
+                assert(state->bpf_function_prolog_size == state->offset - prolog_start);
+            }
+        }
+
+        if (fallthrough_jump_present) {
+            DECLARE_PATCHABLE_REGULAR_JIT_TARGET(fallthrough_tgt, state->offset)
+            modify_patchable_relatives_target(state->jumps, state->num_jumps, fallthrough_jump_source, fallthrough_tgt);
+        }
+
+        state->pc_locs[i] = state->offset;
+
+        enum Registers dst = map_register(inst.dst);
+        enum Registers src = map_register(inst.src);
+        uint8_t opcode = inst.opcode;
+
+        // Use int64_t to avoid signed overflow with large immediates
+        int64_t target_pc_64;
+        if (inst.opcode == EBPF_OP_JA32) {
+            target_pc_64 = (int64_t)i + (int64_t)inst.imm + 1;
+        } else {
+            target_pc_64 = (int64_t)i + (int64_t)inst.offset + 1;
+        }
+        uint32_t target_pc = (uint32_t)target_pc_64;
+
+        DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(tgt, target_pc);
+
+        // When the fall-through of a conditional jump was moved out of line (see
+        // compute_jit_layout), jump there on the opposite condition instead.
+        int cond_invert = 0;
+        if (state->layout_flags[i] & LayoutInvertBranch) {
+            cond_invert = 1;
+            tgt.target.regular.ebpf_target_pc = i + 1;
+        }
+
+        int sixty_four = is_alu64_op(&inst);
+
+        // If this is an operation with an immediate operand (and that immediate
+        // operand is _not_ simple), then we convert the operation to the equivalent
+        // register version after moving the immediate into a temporary register.
+        // When constant blinding is enabled, we also convert simple immediates to ensure
+        // all attacker-controlled immediates are blinded.
+        // Exception: MOV_IMM/MOV64_IMM are handled directly in their switch case.
+        bool divisor_may_be_zero = true;
+        if (is_imm_op(&inst) && opcode != EBPF_OP_MOV_IMM && opcode != EBPF_OP_MOV64_IMM) {
+            if (!is_simple_imm(&inst) || (vm->constant_blinding_enabled && inst.imm != 0)) {
+                EMIT_LOAD_IMMEDIATE(vm, state, temp_register, (int64_t)inst.imm);
+                src = temp_register;
+                opcode = to_reg_op(opcode);
+                divisor_may_be_zero = inst.imm == 0;
+            } else if (
+                (opcode & EBPF_CLS_MASK) == EBPF_CLS_ST ||
+                (((opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP || (opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32) &&
+                 (opcode & EBPF_JMP_OP_MASK) != EBPF_MODE_JSET)) {
+                // The simple immediate to store or to compare with is 0: it is in the zero register.
+                src = ZERO;
+                opcode = to_reg_op(opcode);
+            }
+        }
+
+        switch (opcode) {
+        case EBPF_OP_ADD_IMM:
+        case EBPF_OP_ADD64_IMM:
+        case EBPF_OP_SUB_IMM:
+        case EBPF_OP_SUB64_IMM:
+        case EBPF_OP_OR_IMM:
+        case EBPF_OP_AND_IMM:
+        case EBPF_OP_XOR_IMM:
+        case EBPF_OP_OR64_IMM:
+        case EBPF_OP_AND64_IMM:
+        case EBPF_OP_XOR64_IMM: {
+            int32_t imm = (opcode & EBPF_ALU_OP_MASK) == EBPF_ALU_OP_SUB ? -inst.imm : inst.imm;
+            emit_alu_immediate(state, true, to_alu_immediate_opcode(opcode), dst, dst, imm);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        }
+        case EBPF_OP_ADD_REG:
+        case EBPF_OP_ADD64_REG:
+        case EBPF_OP_SUB_REG:
+        case EBPF_OP_SUB64_REG:
+        case EBPF_OP_MUL_REG:
+        case EBPF_OP_MUL64_REG:
+        case EBPF_OP_OR_REG:
+        case EBPF_OP_AND_REG:
+        case EBPF_OP_XOR_REG:
+        case EBPF_OP_OR64_REG:
+        case EBPF_OP_AND64_REG:
+        case EBPF_OP_XOR64_REG:
+            // The low 32 bits of these do not depend on the high bits of the operands.
+            emit_alu_register(state, true, to_alu_opcode(opcode), dst, dst, src);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_LSH_IMM:
+        case EBPF_OP_RSH_IMM:
+        case EBPF_OP_ARSH_IMM:
+        case EBPF_OP_LSH64_IMM:
+        case EBPF_OP_RSH64_IMM:
+        case EBPF_OP_ARSH64_IMM:
+            emit_shift_immediate(state, sixty_four, to_shift_opcode(opcode), dst, dst, (uint32_t)inst.imm);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_LSH_REG:
+        case EBPF_OP_RSH_REG:
+        case EBPF_OP_ARSH_REG:
+        case EBPF_OP_LSH64_REG:
+        case EBPF_OP_RSH64_REG:
+        case EBPF_OP_ARSH64_REG:
+            // SLLW, SRLW and SRAW shift the low 32 bits by the low 5 bits of the amount.
+            emit_alu_register(state, sixty_four, to_alu_opcode(opcode), dst, dst, src);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_DIV_REG:
+        case EBPF_OP_MOD_REG:
+        case EBPF_OP_DIV64_REG:
+        case EBPF_OP_MOD64_REG:
+            divmod(state, opcode, dst, dst, src, inst.offset, divisor_may_be_zero);
+            break;
+        case EBPF_OP_NEG:
+        case EBPF_OP_NEG64:
+            emit_alu_register(state, true, ALU_SUB, dst, ZERO, dst);
+            if (!sixty_four) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_MOV_IMM:
+            EMIT_LOAD_IMMEDIATE(vm, state, dst, (int64_t)(uint32_t)inst.imm);
+            break;
+        case EBPF_OP_MOV64_IMM:
+            EMIT_LOAD_IMMEDIATE(vm, state, dst, (int64_t)inst.imm);
+            break;
+        case EBPF_OP_MOV_REG:
+        case EBPF_OP_MOV64_REG:
+            // MOVSX: sign-extend based on offset value (RFC 9669)
+            if (inst.offset == 8 || inst.offset == 16) {
+                emit_shift_immediate(state, true, SHIFT_SLL, dst, src, 64 - inst.offset);
+                emit_shift_immediate(state, true, SHIFT_SRA, dst, dst, 64 - inst.offset);
+                if (!sixty_four) {
+                    emit_zero_extend32(state, dst, dst);
+                }
+            } else if (inst.offset == 32 && sixty_four) {
+                emit_sign_extend32(state, dst, src);
+            } else if (sixty_four) {
+                emit_mov(state, dst, src);
+            } else {
+                emit_zero_extend32(state, dst, src);
+            }
+            break;
+        case EBPF_OP_LE:
+            /* RISC-V is little-endian: only truncate. */
+            if (inst.imm == 16) {
+                emit_shift_immediate(state, true, SHIFT_SLL, dst, dst, 48);
+                emit_shift_immediate(state, true, SHIFT_SRL, dst, dst, 48);
+            } else if (inst.imm == 32) {
+                emit_zero_extend32(state, dst, dst);
+            }
+            break;
+        case EBPF_OP_BE:
+        case EBPF_OP_BSWAP:
+            emit_byte_swap(state, dst, (uint32_t)inst.imm);
+            break;
+
+        case EBPF_OP_JA:
+        case EBPF_OP_JA32:
+            emit_jump(state, ZERO, tgt);
+            break;
+        case EBPF_OP_JEQ_REG:
+        case EBPF_OP_JGT_REG:
+        case EBPF_OP_JGE_REG:
+        case EBPF_OP_JLT_REG:
+        case EBPF_OP_JLE_REG:
+        case EBPF_OP_JNE_REG:
+        case EBPF_OP_JSGT_REG:
+        case EBPF_OP_JSGE_REG:
+        case EBPF_OP_JSLT_REG:
+        case EBPF_OP_JSLE_REG:
+        case EBPF_OP_JEQ32_REG:
+        case EBPF_OP_JGT32_REG:
+        case EBPF_OP_JGE32_REG:
+        case EBPF_OP_JLT32_REG:
+        case EBPF_OP_JLE32_REG:
+        case EBPF_OP_JNE32_REG:
+        case EBPF_OP_JSGT32_REG:
+        case EBPF_OP_JSGE32_REG:
+        case EBPF_OP_JSLT32_REG:
+        case EBPF_OP_JSLE32_REG: {
+            // A 32-bit comparison compares the low halves, which are sign-extended for signed
+            // comparisons and for (in)equality and zero-extended otherwise.
+            if (!sixty_four) {
+                bool sign = is_signed_condition(opcode) || (opcode & EBPF_JMP_OP_MASK) == EBPF_MODE_JEQ ||
+                            (opcode & EBPF_JMP_OP_MASK) == EBPF_MODE_JNE;
+                enum Registers operands[2] = {dst, src};
+                enum Registers extended[2] = {temp_div_register, offset_register};
+                for (int k = 0; k < 2; k++) {
+                    if (operands[k] == ZERO) {
+                        continue;
+                    }
+                    if (sign) {
+                        emit_sign_extend32(state, extended[k], operands[k]);
+                    } else {
+                        emit_zero_extend32(state, extended[k], operands[k]);
+                    }
+                    operands[k] = extended[k];
+                }
+                dst = operands[0];
+                src = operands[1];
+            }
+            bool swap_operands;
+            enum BranchCondition cond = to_branch_condition(opcode, &swap_operands);
+            emit_branch(state, cond ^ cond_invert, swap_operands ? src : dst, swap_operands ? dst : src, tgt);
+            break;
+        }
+        case EBPF_OP_JSET_IMM:
+        case EBPF_OP_JSET32_IMM:
+        case EBPF_OP_JSET_REG:
+        case EBPF_OP_JSET32_REG:
+            if (opcode == EBPF_OP_JSET_IMM || opcode == EBPF_OP_JSET32_IMM) {
+                emit_alu_immediate(state, true, ALUI_ANDI, temp_div_register, dst, inst.imm);
+            } else {
+                emit_alu_register(state, true, ALU_AND, temp_div_register, dst, src);
+            }
+            if (!sixty_four) {
+                emit_shift_immediate(state, true, SHIFT_SLL, temp_div_register, temp_div_register, 32);
+            }
+            emit_branch(state, BR_BNE ^ cond_invert, temp_div_register, ZERO, tgt);
+            break;
+        case EBPF_OP_CALL: {
+            DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit);
+            if (inst.src == 0) {
+                emit_dispatched_external_helper_call(state, vm, inst.imm);
+                if (inst.imm == vm->unwind_stack_extension_index) {
+                    emit_branch(state, BR_BEQ, map_register(0), ZERO, exit_tgt);
+                }
+            } else if (inst.src == 1) {
+                uint32_t call_target = i + inst.imm + 1;
+                emit_local_call(state, call_target);
+            } else {
+                emit_jump(state, ZERO, exit_tgt);
+            }
+            break;
+        }
+        case EBPF_OP_EXIT:
+            emit_adjust_stack(state, 16);
+            emit_return(state);
+            break;
+
+        case EBPF_OP_STXW:
+        case EBPF_OP_STXH:
+        case EBPF_OP_STXB:
+        case EBPF_OP_STXDW:
+            if (!is_imm12(inst.offset)) {
+                EMIT_LOAD_IMMEDIATE(vm, state, offset_register, inst.offset);
+                emit_alu_register(state, true, ALU_ADD, offset_register, dst, offset_register);
+                emit_store(state, to_store_opcode(opcode), src, offset_register, 0);
+            } else {
+                emit_store(state, to_store_opcode(opcode), src, dst, inst.offset);
+            }
+            break;
+        case EBPF_OP_LDXW:
+        case EBPF_OP_LDXH:
+        case EBPF_OP_LDXB:
+        case EBPF_OP_LDXDW:
+        case EBPF_OP_LDXWSX:
+        case EBPF_OP_LDXHSX:
+        case EBPF_OP_LDXBSX:
+            if (!is_imm12(inst.offset)) {
+                EMIT_LOAD_IMMEDIATE(vm, state, offset_register, inst.offset);
+                emit_alu_register(state, true, ALU_ADD, offset_register, src, offset_register);
+                emit_load(state, to_load_opcode(opcode), dst, offset_register, 0);
+            } else {
+                emit_load(state, to_load_opcode(opcode), dst, src, inst.offset);
+            }
+            break;
+
+        case EBPF_OP_ATOMIC_STORE:
+        case EBPF_OP_ATOMIC32_STORE:
+            switch (inst.imm & EBPF_ALU_OP_MASK) {
+            case EBPF_ALU_OP_ADD:
+            case EBPF_ALU_OP_OR:
+            case EBPF_ALU_OP_AND:
+            case EBPF_ALU_OP_XOR:
+            case (EBPF_ATOMIC_OP_XCHG & ~EBPF_ATOMIC_OP_FETCH):
+            case (EBPF_ATOMIC_OP_CMPXCHG & ~EBPF_ATOMIC_OP_FETCH):
+                emit_atomic_operation(
+                    state, vm, opcode == EBPF_OP_ATOMIC_STORE, src, dst, inst.offset, inst.imm);
+                break;
+            default:
+                *errmsg = ubpf_error("Unknown atomic operation at PC %d: imm %02x", i, inst.imm);
+                state->jit_status = UnknownInstruction;
+                break;
+            }
+            break;
+
+        case EBPF_OP_LDDW: {
+            struct ebpf_inst inst2 = ubpf_fetch_instruction(vm, ++i);
+            uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
+            EMIT_LOAD_IMMEDIATE(vm, state, dst, (int64_t)imm);
+            break;
+        }
+
+        case EBPF_OP_MUL_IMM:
+        case EBPF_OP_MUL64_IMM:
+        case EBPF_OP_DIV_IMM:
+        case EBPF_OP_MOD_IMM:
+        case EBPF_OP_DIV64_IMM:
+        case EBPF_OP_MOD64_IMM:
+        case EBPF_OP_STW:
+        case EBPF_OP_STH:
+        case EBPF_OP_STB:
+        case EBPF_OP_STDW:
+            *errmsg = ubpf_error("Unexpected instruction at PC %d: opcode %02x, immediate %08x", i, opcode, inst.imm);
+            state->jit_status = UnexpectedInstruction;
+            break;
+        default:
+            *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, opcode);
+            state->jit_status = UnknownInstruction;
+        }
+
+        if (state->layout_flags[i] & LayoutJumpToTarget) {
+            DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(hot_tgt, target_pc);
+            emit_jump(state, ZERO, hot_tgt);
+        }
+    }
+
+    if (state->jit_status != NoError) {
+        switch (state->jit_status) {
+        case TooManyJumps: {
+            *errmsg = ubpf_error("Too many jump instructions.");
+            break;
+        }
+        case TooManyLoads: {
+            *errmsg = ubpf_error("Too many load instructions.");
+            break;
+        }
+        case TooManyLeas: {
+            *errmsg = ubpf_error("Too many LEA calculations.");
+            break;
+        }
+        case TooManyLocalCalls: {
+            *errmsg = ubpf_error("Too many local calls.");
+            break;
+        }
+        case UnexpectedInstruction: {
+            // errmsg set at time the error was detected because the message requires
+            // information about the unexpected instruction.
+            break;
+        }
+        case UnknownInstruction: {
+            // errmsg set at time the error was detected because the message requires
+            // information about the unknown instruction.
+            break;
+        }
+        case NotEnoughSpace: {
+            *errmsg = ubpf_error("Target buffer too small");
+            break;
+        }
+        case NoError: {
+            assert(false);
+        }
+        }
+        return -1;
+    }
+
+    emit_jit_epilogue(state, used_registers);
+
+    return 0;
+}
+
+/* Patch an AUIPC and the JALR after it to reach offset (relative to the AUIPC). */
+static void
+resolve_pc_relative_pair(struct jit_state* state, uint32_t offset_loc, int32_t offset)
+{
+    uint32_t instrs[2];
+    memcpy(instrs, state->buf + offset_loc, sizeof(instrs));
+    uint32_t hi20 = (uint32_t)(((int64_t)offset + 0x800) >> 12) & 0xfffff;
+    int32_t lo12 = (int32_t)sign_extend((uint32_t)offset, 12);
+    instrs[0] |= hi20 << 12;
+    instrs[1] |= ((uint32_t)lo12 & 0xfff) << 20;
+    memcpy(state->buf + offset_loc, instrs, sizeof(instrs));
+}
+
+/*
+ * Patch the jump at offset_loc. Returns false if the target is out of the range of a
+ * branch or a JAL.
+ */
+static bool
+resolve_jump(struct jit_state* state, uint32_t offset_loc, int32_t offset)
+{
+    assert((offset & 1) == 0);
+    uint32_t instr;
+    memcpy(&instr, state->buf + offset_loc, sizeof(uint32_t));
+    switch (instr & 0x7f) {
+    case OPC_BRANCH:
+        if (offset < -(1 << 12) || offset >= (1 << 12)) {
+            return false;
+        }
+        instr |= encode_branch_offset(offset);
+        break;
+    case OPC_JAL:
+        if (offset < -(1 << 20) || offset >= (1 << 20)) {
+            return false;
+        }
+        instr |= encode_jump_offset(offset);
+        break;
+    case OPC_AUIPC:
+        resolve_pc_relative_pair(state, offset_loc, offset);
+        return true;
+    default:
+        assert(false);
+        return false;
+    }
+    memcpy(state->buf + offset_loc, &instr, sizeof(uint32_t));
+    return true;
+}
+
+/*
+ * Patch the jumps. One that does not reach its target is marked to be emitted in its long
+ * form (see far_jumps in struct jit_state) when the program is translated again, which
+ * *retry asks for.
+ */
+static bool
+resolve_jumps(struct jit_state* state, bool* retry)
+{
+    bool resolved = true;
+    for (int i = 0; i < state->num_jumps; ++i) {
+        struct patchable_relative jump = state->jumps[i];
+
+        int32_t target_loc;
+
+        if (jump.target.is_special) {
+            if (jump.target.target.special == Exit) {
+                target_loc = state->exit_loc;
+            } else if (jump.target.target.special == Enter) {
+                target_loc = state->entry_loc;
+            } else {
+                return false;
+            }
+        } else {
+            // The jit target, if specified, takes precedence.
+            if (jump.target.target.regular.jit_target_pc != 0) {
+                target_loc = jump.target.target.regular.jit_target_pc;
+            } else {
+                target_loc = state->pc_locs[jump.target.target.regular.ebpf_target_pc];
+            }
+        }
+
+        if (!resolve_jump(state, jump.offset_loc, target_loc - (int32_t)jump.offset_loc)) {
+            state->far_jumps[i] = true;
+            *retry = true;
+            resolved = false;
+        }
+    }
+    return resolved;
+}
+
+static bool
+resolve_local_calls(struct jit_state* state)
+{
+    for (int i = 0; i < state->num_local_calls; ++i) {
+        struct patchable_relative local_call = state->local_calls[i];
+
+        // A local call must be eBPF PC-relative and it cannot be special.
+        assert(!local_call.target.is_special);
+        int32_t target_loc = state->pc_locs[local_call.target.target.regular.ebpf_target_pc];
+
+        int32_t rel = target_loc - local_call.offset_loc;
+        rel -= state->bpf_function_prolog_size;
+        resolve_pc_relative_pair(state, local_call.offset_loc, rel);
+    }
+    return true;
+}
+
+struct ubpf_jit_result
+ubpf_translate_riscv64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitMode jit_mode)
+{
+    struct jit_state state;
+    struct ubpf_jit_result compile_result;
+    uint8_t* far_jumps = calloc(UBPF_JIT_MAX_JUMPS, sizeof(far_jumps[0]));
+
+retry:
+    if (initialize_jit_state_result(&state, &compile_result, buffer, *size, jit_mode, &compile_result.errmsg) < 0) {
+        goto out;
+    }
+    if (far_jumps == NULL) {
+        compile_result.errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
+        goto out;
+    }
+    state.far_jumps = far_jumps;
+
+    if (translate(vm, &state, &compile_result.errmsg) < 0) {
+        goto out;
+    }
+
+    // Should a jump not reach its target, translate the program again with it (and every
+    // other one that does not) in its long form. As these only ever get added, this ends.
+    bool retry = false;
+    if (!resolve_jumps(&state, &retry) || !resolve_local_calls(&state)) {
+        if (retry) {
+            release_jit_state_result(&state, &compile_result);
+            goto retry;
+        }
+        compile_result.errmsg = ubpf_error("Could not patch the relative addresses in the JIT'd code.");
+        goto out;
+    }
+
+    compile_result.compile_result = UBPF_JIT_COMPILE_SUCCESS;
+    *size = state.offset;
+
+out:
+    release_jit_state_result(&state, &compile_result);
+    free(far_jumps);
+    return compile_result;
+}
+
+size_t
+ubpf_jit_entry_riscv64(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through)
+{
+    struct jit_state state;
+    memset(&state, 0, sizeof(state));
+    state.buf = buffer;
+    state.size = UBPF_JIT_ENTRY_MAX_SIZE;
+
+    // The prologue keeps T5 in JIT_DATA (see emit_jit_prologue).
+    emit_load_immediate(&state, T5, (int64_t)(uintptr_t)jit_data);
+    if (!fall_through) {
+        emit_load(&state, LD_LD, T6, T5, offsetof(struct ubpf_jit_data, code));
+        emit_itype(&state, OPC_JALR, 0, ZERO, T6, 0);
+    }
+    return state.offset;
+}
@@ -32,6 +32,10 @@
 #include <sys/random.h>
 #endif
 
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
 // Thread-safe initialization for fallback random seeding
 #if defined(_WIN32)
 static INIT_ONCE g_seed_init_once = INIT_ONCE_STATIC_INIT;
@@ -72,14 +76,13 @@ initialize_jit_state_result(
 {
     compile_result->compile_result = UBPF_JIT_COMPILE_FAILURE;
     compile_result->errmsg = NULL;
-    compile_result->external_dispatcher_offset = 0;
     compile_result->jit_mode = jit_mode;
 
     state->offset = 0;
     state->size = size;
     state->buf = buffer;
     state->pc_locs = calloc(UBPF_MAX_INSTS + 1, sizeof(state->pc_locs[0]));
-    state->jumps = calloc(UBPF_MAX_INSTS, sizeof(state->jumps[0]));
+    state->jumps = calloc(UBPF_JIT_MAX_JUMPS, sizeof(state->jumps[0]));
     state->loads = calloc(UBPF_MAX_INSTS, sizeof(state->loads[0]));
     state->leas = calloc(UBPF_MAX_INSTS, sizeof(state->leas[0]));
     state->local_calls = calloc(UBPF_MAX_INSTS, sizeof(state->local_calls[0]));
@@ -90,8 +93,14 @@ initialize_jit_state_result(
     state->jit_status = NoError;
     state->jit_mode = jit_mode;
     state->bpf_function_prolog_size = 0;
+    state->layout = calloc(UBPF_MAX_INSTS, sizeof(state->layout[0]));
+    state->layout_size = 0;
+    state->layout_flags = calloc(UBPF_MAX_INSTS, sizeof(state->layout_flags[0]));
+    state->live_registers = NULL;
+    state->far_jumps = NULL;
 
-    if (!state->pc_locs || !state->jumps || !state->loads || !state->leas) {
+    if (!state->pc_locs || !state->jumps || !state->loads || !state->leas || !state->layout ||
+        !state->layout_flags) {
         *errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
         return -1;
     }
@@ -113,6 +122,229 @@ release_jit_state_result(struct jit_state* state, struct ubpf_jit_result* compil
     state->leas = NULL;
     free(state->local_calls);
     state->local_calls = NULL;
+    free(state->layout);
+    state->layout = NULL;
+    free(state->layout_flags);
+    state->layout_flags = NULL;
+    free(state->live_registers);
+    state->live_registers = NULL;
+}
+
+/*
+ * A branch must have executed at least this many times before its profile is
+ * trusted to say that one of its successors is cold.
+ */
+#define LAYOUT_MIN_BRANCH_SAMPLES 16
+
+static bool
+is_unconditional_jump(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32;
+}
+
+static uint32_t
+jump_target_pc(uint32_t pc, struct ebpf_inst inst)
+{
+    if (inst.opcode == EBPF_OP_JA32) {
+        return (uint32_t)((int64_t)pc + inst.imm + 1);
+    }
+    return (uint32_t)((int64_t)pc + inst.offset + 1);
+}
+
+/*
+ * Find the end of the straight-line block starting at start_pc, i.e., the first
+ * instruction that cannot fall through (an EXIT or a JA). The block cannot be moved
+ * (and false is returned) if anything but its first instruction is the target of a
+ * jump, if it contains the entry of a local function, the branch at branch_pc or
+ * an instruction that is already moved, or if it runs off the end of the program.
+ */
+static bool
+find_cold_block(
+    const struct ubpf_vm* vm,
+    const uint32_t* jump_sources,
+    const uint8_t* layout_flags,
+    uint32_t branch_pc,
+    uint32_t start_pc,
+    uint32_t* end_pc)
+{
+    for (uint32_t pc = start_pc; pc < vm->num_insts; pc++) {
+        if (pc == 0 || pc == branch_pc || vm->int_funcs[pc] || (layout_flags[pc] & LayoutCold)) {
+            return false;
+        }
+        if (pc != start_pc && jump_sources[pc]) {
+            return false;
+        }
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        } else if (inst.opcode == EBPF_OP_EXIT || is_unconditional_jump(inst)) {
+            *end_pc = pc;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Mark the blocks that the branch profile shows are never entered. A block is
+ * cold when it is entered only through one edge of a conditional jump that
+ * executed often enough and never followed that edge.
+ */
+static void
+mark_cold_blocks(const struct ubpf_vm* vm, const uint32_t* jump_sources, uint8_t* layout_flags)
+{
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+            continue;
+        }
+        if (!ubpf_instruction_is_conditional_jump(inst) || (layout_flags[pc] & LayoutCold)) {
+            continue;
+        }
+
+        struct ubpf_branch_profile_entry entry = vm->branch_profile[pc];
+        if ((uint64_t)entry.taken + entry.not_taken < LAYOUT_MIN_BRANCH_SAMPLES) {
+            continue;
+        }
+
+        uint32_t target_pc = jump_target_pc(pc, inst);
+        if (target_pc == pc + 1) {
+            continue;
+        }
+
+        uint32_t start_pc;
+        if (entry.not_taken == 0) {
+            // The fall-through is cold; it must not be reachable any other way.
+            start_pc = pc + 1;
+            if (jump_sources[start_pc] != 0) {
+                continue;
+            }
+        } else if (entry.taken == 0) {
+            // The target is cold; it must be reachable only from this branch.
+            start_pc = target_pc;
+            if (start_pc == 0 || jump_sources[start_pc] != 1) {
+                continue;
+            }
+            struct ebpf_inst prev_inst = ubpf_fetch_instruction(vm, start_pc - 1);
+            if (prev_inst.opcode != EBPF_OP_EXIT && !is_unconditional_jump(prev_inst)) {
+                continue;
+            }
+        } else {
+            continue;
+        }
+
+        uint32_t end_pc;
+        if (!find_cold_block(vm, jump_sources, layout_flags, pc, start_pc, &end_pc)) {
+            continue;
+        }
+        // Moving a cold fall-through only pays off when the branch's target then
+        // becomes its fall-through. Otherwise (e.g., for a loop's back edge) the
+        // hot path would need an extra jump.
+        if (start_pc == pc + 1 && target_pc != end_pc + 1) {
+            continue;
+        }
+        for (uint32_t cold_pc = start_pc; cold_pc <= end_pc; cold_pc++) {
+            layout_flags[cold_pc] |= LayoutCold;
+        }
+        if (start_pc == pc + 1) {
+            layout_flags[pc] |= LayoutInvertBranch;
+        }
+    }
+}
+
+/*
+ * Lay out the hot instructions, in program order, followed by the cold blocks.
+ * Instructions that cannot be reached are left out.
+ */
+static void
+order_jit_layout(const struct ubpf_vm* vm, struct jit_state* state)
+{
+    state->layout_size = 0;
+    for (int cold = 0; cold < 2; cold++) {
+        for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+            if (!!(state->layout_flags[pc] & LayoutCold) == cold && ubpf_instruction_is_reachable(vm, pc)) {
+                state->layout[state->layout_size++] = pc;
+            }
+            if (ubpf_fetch_instruction(vm, pc).opcode == EBPF_OP_LDDW) {
+                pc++;
+            }
+        }
+    }
+}
+
+/*
+ * Make sure that every instruction that falls through is followed by its
+ * successor in the layout and decide which inverted branches still need a
+ * jump to their original target (because it is not emitted next or because
+ * it starts a local function).
+ */
+static bool
+check_jit_layout(const struct ubpf_vm* vm, struct jit_state* state)
+{
+    for (uint32_t n = 0; n < state->layout_size; n++) {
+        uint32_t pc = state->layout[n];
+        uint32_t next_pc = n + 1 < state->layout_size ? state->layout[n + 1] : vm->num_insts;
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+
+        if (state->layout_flags[pc] & LayoutInvertBranch) {
+            uint32_t target_pc = jump_target_pc(pc, inst);
+            if (next_pc != target_pc || vm->int_funcs[target_pc]) {
+                state->layout_flags[pc] |= LayoutJumpToTarget;
+            }
+        } else if (inst.opcode != EBPF_OP_EXIT && !is_unconditional_jump(inst)) {
+            uint32_t successor_pc = pc + (inst.opcode == EBPF_OP_LDDW ? 2 : 1);
+            if (successor_pc < vm->num_insts && next_pc != successor_pc) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void
+compute_jit_layout(const struct ubpf_vm* vm, struct jit_state* state)
+{
+    memset(state->layout_flags, 0, vm->num_insts * sizeof(state->layout_flags[0]));
+
+    uint32_t* jump_sources = calloc(vm->num_insts, sizeof(jump_sources[0]));
+    if (jump_sources) {
+        for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+            struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+            if (inst.opcode == EBPF_OP_LDDW) {
+                pc++;
+            } else if (!ubpf_instruction_is_reachable(vm, pc)) {
+                continue;
+            } else if (is_unconditional_jump(inst) || ubpf_instruction_is_conditional_jump(inst)) {
+                uint32_t target_pc = jump_target_pc(pc, inst);
+                if (target_pc < vm->num_insts) {
+                    jump_sources[target_pc]++;
+                }
+            }
+        }
+    }
+
+    // Without a usable profile (or if there is not enough memory to use it), the
+    // layout is simply program order.
+    if (vm->branch_profile && jump_sources) {
+        mark_cold_blocks(vm, jump_sources, state->layout_flags);
+    }
+
+    order_jit_layout(vm, state);
+
+    if (!check_jit_layout(vm, state)) {
+        // Never expected; but a wrong layout would be a miscompilation, so fall back.
+        memset(state->layout_flags, 0, vm->num_insts * sizeof(state->layout_flags[0]));
+        order_jit_layout(vm, state);
+    }
+
+    // Without the jump sources, any instruction may be a jump target.
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        if (!jump_sources || jump_sources[pc] != 0) {
+            state->layout_flags[pc] |= LayoutJumpTarget;
+        }
+    }
+    free(jump_sources);
 }
 
 void
@@ -139,9 +371,11 @@ note_lea(struct jit_state* state, struct PatchableTarget target)
 void
 modify_patchable_relatives_target(struct patchable_relative* table, size_t table_size, uint32_t patchable_relative_src, struct PatchableTarget target)
 {
-    for (size_t index = 0; index < table_size; index++) {
-        if (table[index].offset_loc == patchable_relative_src) {
-            table[index].target = target;
+    // There is one entry per source and it was most likely emitted recently.
+    for (size_t index = table_size; index > 0; index--) {
+        if (table[index - 1].offset_loc == patchable_relative_src) {
+            table[index - 1].target = target;
+            break;
         }
     }
 }
@@ -202,3 +436,234 @@ ubpf_generate_blinding_constant(void)
 
     return random_value;
 }
+
+uint16_t
+compute_used_registers(const struct ubpf_vm* vm)
+{
+    uint16_t used = (1 << BPF_REG_0) | (1 << BPF_REG_1);
+
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (!ubpf_instruction_is_reachable(vm, pc)) {
+            continue;
+        }
+        // Over-approximate: a field that does not name a register for this
+        // opcode (e.g., the src of a helper call) just marks one more register.
+        used |= (1 << inst.dst) | (1 << inst.src);
+        if (inst.opcode == EBPF_OP_CALL) {
+            if (inst.src == 1) {
+                used |= 1 << BPF_REG_10;
+            } else {
+                used |= (1 << BPF_REG_0) | (1 << BPF_REG_1) | (1 << BPF_REG_2) | (1 << BPF_REG_3) | (1 << BPF_REG_4) |
+                        (1 << BPF_REG_5);
+            }
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+    return used;
+}
+
+#define ALL_REGISTERS ((uint16_t)((1 << _BPF_REG_MAX) - 1))
+#define HELPER_ARGUMENT_REGISTERS \
+    ((uint16_t)((1 << BPF_REG_1) | (1 << BPF_REG_2) | (1 << BPF_REG_3) | (1 << BPF_REG_4) | (1 << BPF_REG_5)))
+
+/*
+ * The eBPF registers that an instruction reads (uses) and those that it always
+ * overwrites (defs). Whatever is not understood reads every register, which only
+ * makes the liveness more conservative.
+ */
+static void
+instruction_registers(struct ebpf_inst inst, bool has_local_calls, uint16_t* uses, uint16_t* defs)
+{
+    uint16_t dst = (uint16_t)(1 << inst.dst);
+    uint16_t src = (uint16_t)(1 << inst.src);
+    *uses = 0;
+    *defs = 0;
+
+    switch (inst.opcode & EBPF_CLS_MASK) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        if ((inst.opcode & EBPF_ALU_OP_MASK) != EBPF_ALU_OP_MOV) {
+            *uses |= dst;
+        }
+        if ((inst.opcode & EBPF_SRC_REG) && (inst.opcode & EBPF_ALU_OP_MASK) != EBPF_ALU_OP_END) {
+            *uses |= src;
+        }
+        *defs = dst;
+        return;
+    case EBPF_CLS_LDX:
+        *uses = src;
+        *defs = dst;
+        return;
+    case EBPF_CLS_ST:
+        *uses = dst;
+        return;
+    case EBPF_CLS_STX:
+        *uses = dst | src;
+        if ((inst.opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+            if (inst.imm == EBPF_ATOMIC_OP_CMPXCHG) {
+                *uses |= 1 << BPF_REG_0;
+                *defs = 1 << BPF_REG_0;
+            } else if (inst.imm & EBPF_ATOMIC_OP_FETCH) {
+                *defs = src;
+            }
+        }
+        return;
+    case EBPF_CLS_LD:
+        if (inst.opcode == EBPF_OP_LDDW) {
+            *defs = dst;
+            return;
+        }
+        break;
+    case EBPF_CLS_JMP:
+    case EBPF_CLS_JMP32:
+        if (inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32) {
+            return;
+        }
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 0) {
+            // Helpers take r1 to r5 and return r0; r1 to r5 are not treated as
+            // clobbered (the interpreter keeps them).
+            *uses = HELPER_ARGUMENT_REGISTERS;
+            *defs = 1 << BPF_REG_0;
+            return;
+        }
+        if (inst.opcode == EBPF_OP_EXIT && !has_local_calls) {
+            *uses = 1 << BPF_REG_0;
+            return;
+        }
+        if (inst.opcode == EBPF_OP_CALL || inst.opcode == EBPF_OP_EXIT) {
+            // A local call and the return from a local function may pass on any register.
+            break;
+        }
+        *uses = dst | ((inst.opcode & EBPF_SRC_REG) ? src : 0);
+        return;
+    }
+    *uses = ALL_REGISTERS;
+}
+
+uint16_t*
+compute_live_registers(const struct ubpf_vm* vm)
+{
+    uint16_t* live_out = calloc(vm->num_insts, sizeof(live_out[0]));
+    uint16_t* live_in = calloc(vm->num_insts + 1, sizeof(live_in[0]));
+    if (live_out == NULL || live_in == NULL) {
+        free(live_out);
+        free(live_in);
+        return NULL;
+    }
+
+    bool has_local_calls = false;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        has_local_calls |= inst.opcode == EBPF_OP_CALL && inst.src == 1;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+
+    // Running off the end of the program (which the validator rejects) reads everything.
+    live_in[vm->num_insts] = ALL_REGISTERS;
+
+    // Iterate backwards to a fixed point; most programs need two or three passes.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t n = vm->num_insts; n > 0; n--) {
+            uint32_t pc = n - 1;
+            struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+            if (pc > 0 && ubpf_fetch_instruction(vm, pc - 1).opcode == EBPF_OP_LDDW) {
+                // The second half of an LDDW is never executed on its own. (A program
+                // may only look like that if its first instruction is half of an LDDW,
+                // and then the pair is still skipped over conservatively.)
+                live_in[pc] = live_in[pc + 1];
+                continue;
+            }
+
+            uint32_t next_pc = pc + (inst.opcode == EBPF_OP_LDDW ? 2 : 1);
+            uint16_t out = 0;
+            if (ubpf_instruction_has_fallthrough(inst) && !is_unconditional_jump(inst)) {
+                out |= live_in[next_pc < vm->num_insts ? next_pc : vm->num_insts];
+            }
+            if (is_unconditional_jump(inst) || ubpf_instruction_is_conditional_jump(inst)) {
+                uint32_t target_pc = jump_target_pc(pc, inst);
+                out |= live_in[target_pc < vm->num_insts ? target_pc : vm->num_insts];
+            }
+
+            uint16_t uses;
+            uint16_t defs;
+            instruction_registers(inst, has_local_calls, &uses, &defs);
+            uint16_t in = uses | (out & ~defs);
+            if (out != live_out[pc] || in != live_in[pc]) {
+                live_out[pc] = out;
+                live_in[pc] = in;
+                changed = true;
+            }
+        }
+    }
+
+    free(live_in);
+    return live_out;
+}
+
+struct jit_worker
+{
+    void (*worker)(void* context);
+    void* context;
+};
+
+#if defined(_WIN32)
+static DWORD WINAPI
+run_jit_worker(LPVOID parameter)
+{
+    struct jit_worker* worker = parameter;
+    worker->worker(worker->context);
+    return 0;
+}
+#else
+static void*
+run_jit_worker(void* parameter)
+{
+    struct jit_worker* worker = parameter;
+    worker->worker(worker->context);
+    return NULL;
+}
+#endif
+
+void
+run_jit_workers(unsigned int threads, void (*worker)(void* context), void* context)
+{
+    struct jit_worker jit_worker = {worker, context};
+#if defined(_WIN32)
+    HANDLE handles[UBPF_MAX_JIT_THREADS];
+#else
+    pthread_t handles[UBPF_MAX_JIT_THREADS];
+#endif
+    unsigned int started = 0;
+
+    for (unsigned int i = 1; i < threads && i < UBPF_MAX_JIT_THREADS; i++) {
+#if defined(_WIN32)
+        handles[started] = CreateThread(NULL, 0, run_jit_worker, &jit_worker, 0, NULL);
+        if (handles[started] == NULL) {
+            break;
+        }
+#else
+        if (pthread_create(&handles[started], NULL, run_jit_worker, &jit_worker) != 0) {
+            break;
+        }
+#endif
+        started++;
+    }
+
+    worker(context);
+
+    for (unsigned int i = 0; i < started; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+#else
+        pthread_join(handles[i], NULL);
+#endif
+    }
+}
@@ -40,6 +40,11 @@ enum JitProgress
     UnknownInstruction
 };
 
+/* The number of jumps a JIT'd program may have: the arm64 JIT may emit several for
+ * one eBPF instruction (e.g., for its bounds check).
+ */
+#define UBPF_JIT_MAX_JUMPS (UBPF_MAX_INSTS * 8)
+
 
 /*
  * During the process of JITing, the targets of program-control
@@ -56,8 +61,10 @@ enum SpecialTarget
     Exit,
     Enter,
     Retpoline,
-    ExternalDispatcher,
-    LoadHelperTable,
+    BoundsCheck,
+    InstructionLimit,
+    CallDepth,
+    ContextSize,
 };
 
 struct RegularTarget
@@ -104,6 +111,27 @@ struct PatchableTarget
     x.target.regular.jit_target_pc = tgt;
 
 
+/*
+ * When the VM holds a branch profile, the JIT emits the eBPF instructions in
+ * an order where blocks that the profile says are never entered come last.
+ * These flags tell the JIT how to emit an instruction whose neighborhood
+ * was rearranged.
+ */
+enum JitLayoutFlags
+{
+    /* The instruction is part of a block moved to the end of the program. */
+    LayoutCold = 0x1,
+    /* The fall-through successor of this conditional jump was moved out of line:
+     * emit the inverted condition and make the fall-through its target ... */
+    LayoutInvertBranch = 0x2,
+    /* ... and follow it with an unconditional jump to the original target because
+     * that target is not emitted next. */
+    LayoutJumpToTarget = 0x4,
+    /* The instruction is (or may be) the target of a jump, so the code emitted for
+     * it cannot be merged into that of the instruction before it. */
+    LayoutJumpTarget = 0x8,
+};
+
 struct patchable_relative
 {
     /* Where in the JIT'd instruction stream should the actual
@@ -129,21 +157,15 @@ struct jit_state
      * of the retpoline (if retpoline support is enabled).
      */
     uint32_t retpoline_loc;
-    /* The offset (from the start of the JIT'd code) to the location
-     * of the address of the external helper dispatcher. The address
-     * at that location during execution may be null if no external
-     * helper dispatcher is registered. See commentary in ubpf_jit_x86_64.c.
+    /* The offsets (from the start of the JIT'd code) to the out-of-line code that
+     * JIT'd code with run-time checks calls when an access fails its inline bounds
+     * check and jumps to when it runs out of fuel, nests too many local calls or is
+     * given less memory than the range verifier assumed.
      */
-    uint32_t dispatcher_loc;
-    /* The offset (from the start of the JIT'd code) to the location
-     * of a consecutive series of XXXX addresses that contain pointers
-     * to external helper functions. The address' position in the sequence
-     * corresponds to the index of the helper function. Addresses may
-     * be null but validation guarantees that (at the time the eBPF program
-     * is loaded), if a helper function is called, there is an appropriately
-     * registered handler. See commentary in ubpf_jit_x86_64.c.
-     */
-    uint32_t helper_table_loc;
+    uint32_t bounds_check_loc;
+    uint32_t instruction_limit_loc;
+    uint32_t call_depth_loc;
+    uint32_t context_size_loc;
     enum JitProgress jit_status;
     enum JitMode jit_mode;
     struct patchable_relative* jumps;
@@ -156,6 +178,27 @@ struct jit_state
     int num_local_calls;
     uint32_t stack_size;
     size_t bpf_function_prolog_size; // Count of bytes emitted at the start of the function.
+    /* The order in which to emit the eBPF instructions (never including the
+     * second half of an LDDW) and the JitLayoutFlags for each instruction.
+     * See compute_jit_layout.
+     */
+    uint32_t* layout;
+    uint32_t layout_size;
+    uint8_t* layout_flags;
+    /* x86-64: for every instruction, the eBPF registers that may be read after it
+     * (see compute_live_registers), or NULL if they are not known.
+     */
+    uint16_t* live_registers;
+    /* x86-64: the native register for every eBPF register. It belongs to the
+     * compile, not the JIT, so that any number of VMs can be compiled at once.
+     */
+    int register_map[_BPF_REG_MAX];
+    /* arm64 and riscv64: the jumps (by their index in jumps) that did not reach their
+     * targets when the program was translated before. They are emitted in a long form:
+     * a short branch on the opposite condition over an unconditional branch. The
+     * translation is repeated until every jump reaches its target.
+     */
+    uint8_t* far_jumps;
 };
 
 int
@@ -170,6 +213,48 @@ initialize_jit_state_result(
 void
 release_jit_state_result(struct jit_state* state, struct ubpf_jit_result* compile_result);
 
+/** @brief Decide the order in which the JIT emits the VM's eBPF instructions.
+ *
+ * Without a branch profile, the order is program order. With one, every
+ * straight-line block that is entered only through a branch edge that the
+ * profile shows was never followed (and that ends in an EXIT or JA) is
+ * moved after all the other instructions. Conditional jumps whose fall-through
+ * block moved are marked to be inverted. Every jump target is marked as such.
+ *
+ * @param[in] vm The VM whose program is about to be JIT'd.
+ * @param[in,out] state The JIT state whose layout and layout_flags to fill.
+ */
+void
+compute_jit_layout(const struct ubpf_vm* vm, struct jit_state* state);
+
+/** @brief Find the eBPF registers that the JIT'd code for a VM's program uses.
+ *
+ * A register is used if any instruction names it, if the prologue or the
+ * epilogue that every JIT emits touches it (r0 and r1), if it carries helper
+ * arguments or results (r0 to r5) or if a local call adjusts it (r10). The
+ * JITs only save and restore the callee-saved registers that these eBPF
+ * registers are mapped to.
+ *
+ * @param[in] vm The VM whose program is about to be JIT'd.
+ * @return A mask with bit n set if eBPF register n is used.
+ */
+uint16_t
+compute_used_registers(const struct ubpf_vm* vm);
+
+/** @brief Find the eBPF registers that are live after each instruction of a VM's program.
+ *
+ * A register is live after an instruction if some path from the instruction may
+ * read it before overwriting it. A local call, the return from a local function
+ * and anything unexpected are treated as reading every register. The JITs use
+ * this to tell when a value only needs to exist for the next instruction.
+ *
+ * @param[in] vm The VM whose program is about to be JIT'd.
+ * @return An array (that the caller frees) with, for every instruction, a mask
+ *  with bit n set if eBPF register n is live after it, or NULL if out of memory.
+ */
+uint16_t*
+compute_live_registers(const struct ubpf_vm* vm);
+
 /** @brief Add an entry to the given patchable relative table.
  *
  * Emitting an entry into the patchable relative table means that resolution of the target
@@ -210,4 +295,18 @@ modify_patchable_relatives_target(
 uint64_t
 ubpf_generate_blinding_constant(void);
 
+/**
+ * @brief Run a function on several threads at once and wait for all of them to return.
+ *
+ * The calling thread is one of them. If a thread cannot be started, the function runs
+ * on fewer threads, so it has to take its work from a queue in the context rather
+ * than expect a share of it.
+ *
+ * @param[in] threads The number of threads to run the function on.
+ * @param[in] worker The function to run.
+ * @param[in] context The context to pass to the function.
+ */
+void
+run_jit_workers(unsigned int threads, void (*worker)(void* context), void* context);
+
 #endif
@@ -23,6 +23,7 @@
 #define _GNU_SOURCE
 
 #include "ebpf.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -89,10 +90,10 @@ enum operand_size
 #define RCX_ALT R10
 
 #if defined(_WIN32)
-static int platform_nonvolatile_registers[] = {RBP, RBX, RDI, RSI, R12, R13, R14, R15}; // Callee-saved registers.
-static int platform_volatile_registers[] = {RAX, RDX, RCX, R8, R9, R10, R11}; // Caller-saved registers (if needed).
-static int platform_parameter_registers[] = {RCX, RDX, R8, R9};
-static int register_map[REGISTER_MAP_SIZE] = {
+static const int platform_nonvolatile_registers[] = {RBP, RBX, RDI, RSI, R12, R13, R14, R15}; // Callee-saved registers.
+static const int platform_volatile_registers[] = {RAX, RDX, RCX, R8, R9, R10, R11}; // Caller-saved registers (if needed).
+static const int platform_parameter_registers[] = {RCX, RDX, R8, R9};
+static const int default_register_map[REGISTER_MAP_SIZE] = {
     // Scratch registers
     RAX,
     R10,
@@ -108,11 +109,11 @@ static int register_map[REGISTER_MAP_SIZE] = {
     R15, // Until further notice, r15 must be mapped to eBPF register r10
 };
 #else
-static int platform_nonvolatile_registers[] = {RBP, RBX, R12, R13, R14, R15}; // Callee-saved registers.
-static int platform_volatile_registers[] = {
+static const int platform_nonvolatile_registers[] = {RBP, RBX, R12, R13, R14, R15}; // Callee-saved registers.
+static const int platform_volatile_registers[] = {
     RAX, RDI, RSI, RDX, RCX, R8, R9, R10, R11}; // Caller-saved registers (if needed).
-static int platform_parameter_registers[] = {RDI, RSI, RDX, RCX, R8, R9};
-static int register_map[REGISTER_MAP_SIZE] = {
+static const int platform_parameter_registers[] = {RDI, RSI, RDX, RCX, R8, R9};
+static const int default_register_map[REGISTER_MAP_SIZE] = {
     // Scratch registers
     RAX,
     RDI,
@@ -131,10 +132,10 @@ static int register_map[REGISTER_MAP_SIZE] = {
 
 /* Return the x86 register for the given eBPF register */
 static int
-map_register(int r)
+map_register(const struct jit_state* state, int r)
 {
     assert(r < _BPF_REG_MAX);
-    return register_map[r % _BPF_REG_MAX];
+    return state->register_map[r % _BPF_REG_MAX];
 }
 
 static inline void
@@ -189,7 +190,7 @@ emit_4byte_offset_placeholder(struct jit_state* state)
 static uint32_t
 emit_jump_address_reloc(struct jit_state* state, struct PatchableTarget target)
 {
-    if (state->num_jumps == UBPF_MAX_INSTS) {
+    if (state->num_jumps == UBPF_JIT_MAX_JUMPS) {
         state->jit_status = TooManyJumps;
         return 0;
     }
@@ -705,41 +706,6 @@ emit_store_imm32_blinded(struct jit_state* state, enum operand_size size, int ds
     } while (0)
 
 
-static uint32_t
-emit_rip_relative_load(struct jit_state* state, int dst, struct PatchableTarget load_tgt)
-{
-    if (state->num_loads == UBPF_MAX_INSTS) {
-        state->jit_status = TooManyLoads;
-        return 0;
-    }
-
-    emit_rex(state, 1, 0, 0, 0);
-    emit1(state, 0x8b);
-    emit_modrm(state, 0, dst, 0x05);
-
-    uint32_t load_target_offset = state->offset;
-    note_load(state, load_tgt);
-    emit_4byte_offset_placeholder(state);
-
-    return load_target_offset;
-}
-
-static void
-emit_rip_relative_lea(struct jit_state* state, int lea_dst_reg, struct PatchableTarget lea_tgt)
-{
-    if (state->num_leas == UBPF_MAX_INSTS) {
-        state->jit_status = TooManyLeas;
-        return;
-    }
-
-    // lea dst, [rip + HELPER TABLE ADDRESS]
-    emit_rex(state, 1, 1, 0, 0);
-    emit1(state, 0x8d);
-    emit_modrm(state, 0, lea_dst_reg, 0x05);
-    note_lea(state, lea_tgt);
-    emit_4byte_offset_placeholder(state);
-}
-
 /* Store register src to [dst + offset] */
 static inline void
 emit_store(struct jit_state* state, enum operand_size size, int src, int dst, int32_t offset)
@@ -755,6 +721,31 @@ emit_store(struct jit_state* state, enum operand_size size, int src, int dst, in
     emit_modrm_and_displacement(state, src, dst, offset);
 }
 
+/* ALU operation (op is the opcode of the r, r/m form) with a memory operand: op reg, [base + offset] */
+static inline void
+emit_alu_load(struct jit_state* state, int is_64bit, int op, int reg, int base, int32_t offset)
+{
+    emit_basic_rex(state, is_64bit, reg, base);
+    emit1(state, op);
+    emit_modrm_and_displacement(state, reg, base, offset);
+}
+
+/* lea dst, [base + index * (1 << scale)] */
+static inline void
+emit_lea_scaled(struct jit_state* state, int dst, int base, int index, int scale)
+{
+    assert(index != RSP && scale >= 0 && scale <= 3);
+    emit_rex(state, 1, !!(dst & 8), !!(index & 8), !!(base & 8));
+    emit1(state, 0x8d);
+    // RBP and R13 can only be a base with a displacement; use a zero disp8.
+    int mod = (base & 7) == RBP ? 0x40 : 0x00;
+    emit_modrm(state, mod, dst, RSP); // A SIB byte follows.
+    emit1(state, (scale << 6) | ((index & 7) << 3) | (base & 7));
+    if (mod) {
+        emit1(state, 0);
+    }
+}
+
 /* Store immediate to [dst + offset] */
 static inline void
 emit_store_imm32(struct jit_state* state, enum operand_size size, int dst, int32_t offset, int32_t imm)
@@ -840,16 +831,16 @@ emit_dispatched_external_helper_call(struct jit_state* state, unsigned int idx)
      *    send control there to invoke an external helper.
      * 2. The user is relying on the default dispatcher to pass control
      *    to the registered external helper.
-     * To determine which action to take, we will first consider the 8
-     * bytes at TARGET_PC_EXTERNAL_DISPATCHER. If those 8 bytes have an
-     * address, that represents the address of the user-registered external
-     * dispatcher and we pass control there. That function signature looks like
+     * To determine which action to take, we will first load the address of the
+     * VM's struct ubpf_jit_data (which the prologue keeps at [rbp]) and consider
+     * its dispatcher field. If that field has an address, that represents the
+     * address of the user-registered external dispatcher and we pass control there. That function signature looks like
      * uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, unsigned int index, void* cookie
      * so we make sure that the arguments are done properly depending on the abi.
      *
      * If there is no external dispatcher registered, the user is expected
      * to have registered a handler with us for the helper with index idx.
-     * There is a table of MAX_ function pointers starting at TARGET_LOAD_HELPER_TABLE.
+     * There is a table of MAX_EXT_FUNCS function pointers in struct ubpf_jit_data.
      * Each of those functions has a signature that looks like
      * uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, void* cookie
      * We load the appropriate function pointer by using idx to index it and then
@@ -870,10 +861,11 @@ emit_dispatched_external_helper_call(struct jit_state* state, unsigned int idx)
     emit_alu64_imm32(state, 0x81, 5, RSP, 3 * sizeof(uint64_t));
 #endif
 
-    DECLARE_PATCHABLE_TARGET(rip_rel_tgt);
-    rip_rel_tgt.is_special = true;
-    rip_rel_tgt.target.special = ExternalDispatcher;
-    emit_rip_relative_load(state, RAX, rip_rel_tgt);
+    // mov r10, [rbp] (see the prologue in translate)
+    emit_load(state, S64, RBP, RCX_ALT, 0);
+
+    // mov rax, [r10 + dispatcher]
+    emit_load(state, S64, RCX_ALT, RAX, offsetof(struct ubpf_jit_data, dispatcher));
 
     // cmp rax, 0
     emit_cmp_imm32(state, RAX, 0);
@@ -886,23 +878,15 @@ emit_dispatched_external_helper_call(struct jit_state* state, unsigned int idx)
     // Default dispatcher:
 
     // Load the address of the helper function from the table.
-    // mov rax, idx
-    emit_alu32(state, 0xc7, 0, RAX);
-    emit4(state, idx);
-    // shl rax, 3 (i.e., multiply the index by 8 because addresses are that size on x86-64)
-    emit_alu64_imm8(state, 0xc1, 4, RAX, 3);
-
-    // lea r10, [rip + HELPER TABLE ADDRESS]
-    DECLARE_PATCHABLE_TARGET(rip_rel_load_helper_tgt);
-    rip_rel_load_helper_tgt.is_special = true;
-    rip_rel_load_helper_tgt.target.special = LoadHelperTable;
-    // emit_rip_relative_lea(state, R10, TARGET_LOAD_HELPER_TABLE);
-    emit_rip_relative_lea(state, R10, rip_rel_load_helper_tgt);
-
-    // add rax, r10
-    emit_alu64(state, 0x01, R10, RAX);
-    // load rax, [rax]
-    emit_load(state, S64, RAX, RAX, 0);
+    // Validation guarantees that idx names a registered helper when there is no
+    // external dispatcher, so it is always in range here.
+    // mov rax, [r10 + helpers + idx * 8]
+    emit_load(
+        state,
+        S64,
+        RCX_ALT,
+        RAX,
+        offsetof(struct ubpf_jit_data, helpers) + (idx % MAX_EXT_FUNCS) * sizeof(extended_external_helper_t));
 
     // There is no index for the registered helper function. They just get
     // 5 arguments and a context, which becomes the 6th argument to the function ...
@@ -967,7 +951,7 @@ emit_dispatched_external_helper_call(struct jit_state* state, unsigned int idx)
 
 #if defined(_WIN32)
     /* Windows x64 ABI spills 5th parameter to stack (MARKER2) */
-    emit_push(state, map_register(5));
+    emit_push(state, map_register(state, 5));
 
     /* Windows x64 ABI requires home register space.
      * Allocate home register space - 4 registers.
@@ -1485,10 +1469,10 @@ emit_local_call(struct ubpf_vm* vm, struct jit_state* state, uint32_t ebpf_targe
     emit1(state, 0x3C); // Mod: 00b Reg: 111b RM: 100b
     emit1(state, 0x24); // Scale: 00b Index: 100b Base: 100b
 
-    emit_push(state, map_register(BPF_REG_6));
-    emit_push(state, map_register(BPF_REG_7));
-    emit_push(state, map_register(BPF_REG_8));
-    emit_push(state, map_register(BPF_REG_9));
+    emit_push(state, map_register(state, BPF_REG_6));
+    emit_push(state, map_register(state, BPF_REG_7));
+    emit_push(state, map_register(state, BPF_REG_8));
+    emit_push(state, map_register(state, BPF_REG_9));
 
 #if defined(_WIN32)
     /* Windows x64 ABI requires home register space */
@@ -1503,10 +1487,10 @@ emit_local_call(struct ubpf_vm* vm, struct jit_state* state, uint32_t ebpf_targe
     /* Deallocate home register space - 4 registers */
     emit_alu64_imm32(state, 0x81, 0, RSP, 4 * sizeof(uint64_t));
 #endif
-    emit_pop(state, map_register(BPF_REG_9));
-    emit_pop(state, map_register(BPF_REG_8));
-    emit_pop(state, map_register(BPF_REG_7));
-    emit_pop(state, map_register(BPF_REG_6));
+    emit_pop(state, map_register(state, BPF_REG_9));
+    emit_pop(state, map_register(state, BPF_REG_8));
+    emit_pop(state, map_register(state, BPF_REG_7));
+    emit_pop(state, map_register(state, BPF_REG_6));
 
     // Because the top of the host stack holds the stack usage of the currently-executing
     // function, we adjust the eBPF base pointer back up by that value!
@@ -1517,25 +1501,6 @@ emit_local_call(struct ubpf_vm* vm, struct jit_state* state, uint32_t ebpf_targe
     emit1(state, 0x24); // Scale: 00b Index: 100b Base: 100b
 }
 
-static uint32_t
-emit_dispatched_external_helper_address(struct jit_state* state, struct ubpf_vm* vm)
-{
-    uint32_t external_helper_address_target = state->offset;
-    emit8(state, (uint64_t)vm->dispatcher);
-    return external_helper_address_target;
-}
-
-static uint32_t
-emit_helper_table(struct jit_state* state, struct ubpf_vm* vm)
-{
-
-    uint32_t helper_table_address_target = state->offset;
-    for (int i = 0; i < MAX_EXT_FUNCS; i++) {
-        emit8(state, (uint64_t)vm->ext_funcs[i]);
-    }
-    return helper_table_address_target;
-}
-
 static uint32_t
 emit_retpoline(struct jit_state* state)
 {
@@ -1577,25 +1542,27 @@ emit_retpoline(struct jit_state* state)
     return retpoline_target;
 }
 
-/* For testing, this changes the mapping between x86 and eBPF registers */
-void
-ubpf_set_register_offset(int x)
+/*
+ * Fill in the mapping between x86 and eBPF registers that this compile uses. A VM's
+ * register offset (see ubpf_set_register_offset) changes it, for testing.
+ */
+static void
+initialize_register_map(struct jit_state* state, int x)
 {
     int i;
     if (x < REGISTER_MAP_SIZE) {
-        int tmp[REGISTER_MAP_SIZE];
-        memcpy(tmp, register_map, sizeof(register_map));
         for (i = 0; i < REGISTER_MAP_SIZE; i++) {
-            register_map[i] = tmp[(i + x) % REGISTER_MAP_SIZE];
+            state->register_map[i] = default_register_map[(i + x) % REGISTER_MAP_SIZE];
         }
     } else {
         /* Shuffle array */
         unsigned int seed = x;
+        memcpy(state->register_map, default_register_map, sizeof(default_register_map));
         for (i = 0; i < REGISTER_MAP_SIZE - 1; i++) {
             int j = i + (rand_r(&seed) % (REGISTER_MAP_SIZE - i));
-            int tmp = register_map[j];
-            register_map[j] = register_map[i];
-            register_map[i] = tmp;
+            int tmp = state->register_map[j];
+            state->register_map[j] = state->register_map[i];
+            state->register_map[i] = tmp;
         }
     }
 }
@@ -1604,20 +1571,26 @@ ubpf_set_register_offset(int x)
  * JIT'd Code Layout & Invariants:
  *
  * 1. Layout of external dispatcher/helpers pointers
- * In order to make it so that the generated code is completely standalone, all the necessary
- * function pointers for external helpers are embedded in the jitted code. The layout looks like:
+ * The function pointers for the external dispatcher and the external helpers are *not* part
+ * of the jitted code. They live in the VM's struct ubpf_jit_data, a separate data page that is
+ * updated (atomically) when helpers or the dispatcher are registered. The code never changes
+ * after it is compiled and holds no address of the VM: the VM's entry stub (see
+ * ubpf_jit_entry_x86_64) passes the address of the struct ubpf_jit_data in RAX, and the
+ * prologue keeps it at [RBP] for the whole run. The layout looks like:
+ *
+ *      VM entry stub: mov rax, <address of struct ubpf_jit_data>
+ *                     jmp [rax] (the code)
+ *
+ *               CODE: push the callee-saved registers
+ *                     push rax (twice if that keeps the stack 16-byte aligned)
+ *                     mov rbp, rsp
+ *                     ...
  *
- *                 state->buffer: CODE
- *                                CODE
- *                                CODE
- *                                ...
- *                                CODE
- *                                External Helper External Dispatcher Function Pointer (8 bytes, maybe NULL)
- *                                External Helper Function Pointer Idx 0 (8 bytes, maybe NULL)
- *                                External Helper Function Pointer Idx 1 (8 bytes, maybe NULL)
- *                                ...
- *                                External Helper Function Pointer Idx MAX_EXT_FUNCS-1 (8 bytes, maybe NULL)
- * state->buffer + state->offset:
+ * struct ubpf_jit_data: Address of the CODE (8 bytes)
+ *                       External Helper External Dispatcher Function Pointer (8 bytes, maybe NULL)
+ *                       External Helper Function Pointer Idx 0 (8 bytes, maybe NULL)
+ *                       ...
+ *                       External Helper Function Pointer Idx MAX_EXT_FUNCS-1 (8 bytes, maybe NULL)
  *
  * 2. Invariants
  *    a. The top of the host stack always contains an 8-byte value which is the size
@@ -1625,7 +1598,7 @@ ubpf_set_register_offset(int x)
  *       is maintained in the code generated for the EXIT, and CALL opcodes and in the
  *       code generated for the first instruction in an eBPF function.
  *
- * The layout and invariants are identical for code JIT compiled for Arm.
+ * The invariants are identical for code JIT compiled for Arm.
  */
 
 /* Helper macros to conditionally use blinded versions */
@@ -1695,93 +1668,197 @@ ubpf_set_register_offset(int x)
         } \
     } while (0)
 
+/*
+ * Select the platform non-volatile registers that the prologue has to save and
+ * the epilogue has to restore: RBP, which holds the frame, and those that are
+ * mapped to an eBPF register the program uses (see compute_used_registers).
+ * They are written to saved_registers in the order in which they are pushed.
+ * Short programs that never touch r6 to r10 save nothing but RBP.
+ */
 static int
-translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
-{
-    int i;
-
-    (void)platform_volatile_registers;
-    /* Save platform non-volatile registers */
-    for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
-        emit_push(state, platform_nonvolatile_registers[i]);
+select_saved_registers(const struct jit_state* state, uint16_t used_registers, int* saved_registers)
+{
+    int count = 0;
+    for (int i = 0; i < _countof(platform_nonvolatile_registers); i++) {
+        int reg = platform_nonvolatile_registers[i];
+        bool used = reg == RBP;
+        for (int r = 0; r < _BPF_REG_MAX && !used; r++) {
+            used = (used_registers & (1 << r)) && map_register(state, r) == reg;
+        }
+        if (used) {
+            saved_registers[count++] = reg;
+        }
     }
+    return count;
+}
 
-    /* Move first platform parameter register into register 1 */
-    if (map_register(1) != platform_parameter_registers[0]) {
-        emit_mov(state, platform_parameter_registers[0], map_register(BPF_REG_1));
+/* The x86 condition code (the second byte of a Jcc) for an eBPF conditional jump. */
+static int
+jcc_condition(uint8_t opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_MODE_JEQ:
+        return 0x84;
+    case EBPF_MODE_JGT:
+        return 0x87;
+    case EBPF_MODE_JGE:
+        return 0x83;
+    case EBPF_MODE_JSET:
+    case EBPF_MODE_JNE:
+        return 0x85;
+    case EBPF_MODE_JSGT:
+        return 0x8f;
+    case EBPF_MODE_JSGE:
+        return 0x8d;
+    case EBPF_MODE_JLT:
+        return 0x82;
+    case EBPF_MODE_JLE:
+        return 0x86;
+    case EBPF_MODE_JSLT:
+        return 0x8c;
+    case EBPF_MODE_JSLE:
+        return 0x8e;
+    default:
+        assert(false);
+        return 0;
     }
+}
 
-    /* Move the first platform parameter register to the (volatile) register
-     * that holds the pointer to the context.
-     */
-    emit_mov(state, platform_parameter_registers[0], VOLATILE_CTXT);
+/* The opcode of the r, r/m form of a folded eBPF ALU operation, or 0 if it has none. */
+static int
+alu_load_opcode(uint8_t opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_ALU_OP_ADD:
+        return 0x03;
+    case EBPF_ALU_OP_SUB:
+        return 0x2b;
+    case EBPF_ALU_OP_OR:
+        return 0x0b;
+    case EBPF_ALU_OP_AND:
+        return 0x23;
+    case EBPF_ALU_OP_XOR:
+        return 0x33;
+    case EBPF_ALU_OP_MOV:
+        return 0x8b;
+    default:
+        return 0;
+    }
+}
 
-    /*
-     * Assuming that the stack is 16-byte aligned right before
-     * the call insn that brought us to this code, when
-     * we start executing the jit'd code, we need to regain a 16-byte
-     * alignment. The UBPF_EBPF_STACK_SIZE is guaranteed to be
-     * divisible by 16. However, if we pushed an even number of
-     * registers on the stack when we are saving state (see above),
-     * then we have to add an additional 8 bytes to get back
-     * to a 16-byte alignment.
-     */
-    if (!(_countof(platform_nonvolatile_registers) % 2)) {
-        emit_alu64_imm32(state, 0x81, 5, RSP, 0x8);
+/*
+ * Instruction selection over pairs of eBPF instructions. The instruction at layout
+ * position n and the one after it are emitted as one x86 instruction (plus a Jcc)
+ * when they match one of these patterns:
+ *
+ *   ldx t, [s + off]; alu d, t     ->  alu d, [s + off]       (ADD, SUB, OR, AND, XOR, MOV)
+ *   ldx t, [s + off]; jcc t, x     ->  cmp/test [s + off], x; jcc
+ *   mov d, s; add d, imm           ->  lea d, [s + imm]
+ *   mov d, s; add d, x             ->  lea d, [s + x]
+ *   lsh t, k; add d, t             ->  lea d, [d + t * (1 << k)]  (k <= 3)
+ *
+ * where the load and the ALU operation or comparison have the same width and t is
+ * dead after the pair (see compute_live_registers), so it never has to be written.
+ * The second instruction must only be reachable from the first one. With constant
+ * blinding, immediates are still never emitted as they are: a folded comparison
+ * with an immediate compares with the blinded value in RCX (which no eBPF register
+ * is mapped to) and the LEA with an immediate is not used. Returns true if the pair
+ * was emitted.
+ */
+static bool
+emit_fused_instructions(struct ubpf_vm* vm, struct jit_state* state, uint32_t n, struct ebpf_inst inst)
+{
+    uint32_t i = state->layout[n];
+    if (n + 1 >= state->layout_size || state->layout[n + 1] != i + 1 || vm->int_funcs[i + 1] ||
+        (state->layout_flags[i + 1] & (LayoutJumpTarget | LayoutInvertBranch | LayoutJumpToTarget))) {
+        return false;
     }
 
-    /*
-     * Let's set RBP to RSP so that we can restore RSP later!
-     */
-    emit_mov(state, RSP, RBP);
+    struct ebpf_inst next = ubpf_fetch_instruction(vm, i + 1);
+    bool next_reads_register = (next.opcode & EBPF_SRC_REG) != 0;
+    int dst = map_register(state, next.dst);
+    int src = map_register(state, inst.src);
+    bool t_dead = state->live_registers && !(state->live_registers[i + 1] & (1 << inst.dst));
+
+    if ((inst.opcode == EBPF_OP_LDXDW || inst.opcode == EBPF_OP_LDXW) && t_dead) {
+        int is_64bit = inst.opcode == EBPF_OP_LDXDW;
+        int next_class = next.opcode & EBPF_CLS_MASK;
+        if (next_class == (is_64bit ? EBPF_CLS_ALU64 : EBPF_CLS_ALU) && next_reads_register &&
+            next.src == inst.dst && next.dst != inst.dst && next.offset == 0 && alu_load_opcode(next.opcode)) {
+            emit_alu_load(state, is_64bit, alu_load_opcode(next.opcode), dst, src, inst.offset);
+            return true;
+        }
 
-    /* Configure eBPF program stack space */
-    if (state->jit_mode == BasicJitMode) {
-        /*
-         * Set BPF R10 (the way to access the frame in eBPF) the beginning
-         * of the eBPF program's stack space.
-         */
-        emit_mov(state, RSP, map_register(BPF_REG_10));
-        /* Allocate eBPF program stack space */
-        emit_alu64_imm32(state, 0x81, 5, RSP, UBPF_EBPF_STACK_SIZE);
-    } else {
-        /* Use given eBPF program stack space */
-        emit_mov(state, platform_parameter_registers[2], map_register(BPF_REG_10));
-        emit_alu64(state, 0x01, platform_parameter_registers[3], map_register(BPF_REG_10));
+        if (next_class == (is_64bit ? EBPF_CLS_JMP : EBPF_CLS_JMP32) && ubpf_instruction_is_conditional_jump(next) &&
+            next.dst == inst.dst && (!next_reads_register || next.src != inst.dst)) {
+            bool test = (next.opcode & EBPF_ALU_OP_MASK) == EBPF_MODE_JSET;
+            if (next_reads_register) {
+                emit_alu_load(state, is_64bit, test ? 0x85 : 0x39, map_register(state, next.src), src, inst.offset);
+            } else if (vm->constant_blinding_enabled) {
+                uint32_t random = (uint32_t)ubpf_generate_blinding_constant();
+                emit_alu32_imm32(state, 0xc7, 0, RCX, (int32_t)((uint32_t)next.imm ^ random));
+                emit_alu32_imm32(state, 0x81, 6, RCX, (int32_t)random);
+                if (is_64bit) {
+                    // Sign extend the immediate, like the comparison with it would.
+                    emit_basic_rex(state, 1, RCX, RCX);
+                    emit1(state, 0x63);
+                    emit_modrm_reg2reg(state, RCX, RCX);
+                }
+                emit_alu_load(state, is_64bit, test ? 0x85 : 0x39, RCX, src, inst.offset);
+            } else {
+                emit_basic_rex(state, is_64bit, 0, src);
+                emit1(state, test ? 0xf7 : 0x81);
+                emit_modrm_and_displacement(state, test ? 0 : 7, src, inst.offset);
+                emit4(state, next.imm);
+            }
+            DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(tgt, i + 1 + next.offset + 1);
+            emit_jcc(state, jcc_condition(next.opcode), tgt);
+            return true;
+        }
+        return false;
     }
 
-#if defined(_WIN32)
-    /* Windows x64 ABI requires home register space */
-    /* Allocate home register space - 4 registers */
-    emit_alu64_imm32(state, 0x81, 5, RSP, 4 * sizeof(uint64_t));
-#endif
-
-    /*
-     * Use a call to set up a place where we can land after eBPF program's
-     * final EXIT call. This makes it appear to the ebpf programs
-     * as if they are called like a function. It is their responsibility
-     * to deal with the non-16-byte aligned stack pointer that goes along
-     * with this pretense.
-     */
-    emit1(state, 0xe8);
-    emit4(state, 5);
-    /*
-     * We jump over this instruction in the first place; return here
-     * after the eBPF program is finished executing.
-     */
+    if (inst.opcode == EBPF_OP_MOV64_REG && inst.offset == 0 && inst.src != inst.dst && next.dst == inst.dst) {
+        if (next.opcode == EBPF_OP_ADD64_IMM && !vm->constant_blinding_enabled) {
+            emit_alu_load(state, 1, 0x8d, dst, src, next.imm);
+            return true;
+        }
+        if (next.opcode == EBPF_OP_ADD64_REG) {
+            // After the move, adding the destination to itself adds the source.
+            int index = next.src == next.dst ? src : map_register(state, next.src);
+            emit_lea_scaled(state, dst, src, index, 0);
+            return true;
+        }
+        return false;
+    }
 
-    DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit)
-    emit_jmp(state, exit_tgt);
+    if (inst.opcode == EBPF_OP_LSH64_IMM && inst.imm >= 1 && inst.imm <= 3 && t_dead &&
+        next.opcode == EBPF_OP_ADD64_REG && next.src == inst.dst && next.dst != inst.dst) {
+        emit_lea_scaled(state, dst, dst, map_register(state, inst.dst), inst.imm);
+        return true;
+    }
+    return false;
+}
 
-    for (i = 0; i < vm->num_insts; i++) {
+/*
+ * Emit the code for the entries [first, last) of the layout. Returns -1 if the
+ * translation failed with *errmsg set; otherwise, state->jit_status tells whether
+ * it succeeded.
+ */
+static int
+translate_instructions(struct ubpf_vm* vm, struct jit_state* state, uint32_t first, uint32_t last, char** errmsg)
+{
+    int i;
+    for (uint32_t n = first; n < last; n++) {
         if (state->jit_status != NoError) {
             break;
         }
 
+        i = state->layout[n];
         struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
 
-        int dst = map_register(inst.dst);
-        int src = map_register(inst.src);
+        int dst = map_register(state, inst.dst);
+        int src = map_register(state, inst.src);
 
         // Use int64_t to avoid signed overflow with large immediates
         int64_t target_pc_64;
@@ -1794,6 +1871,15 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 
         DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(tgt, target_pc);
 
+        // When the fall-through of a conditional jump was moved out of line (see
+        // compute_jit_layout), jump there on the opposite condition instead. All the
+        // x86 condition codes used below are inverted by flipping their low bit.
+        int jcc_invert = 0;
+        if (state->layout_flags[i] & LayoutInvertBranch) {
+            jcc_invert = 1;
+            tgt.target.regular.ebpf_target_pc = i + 1;
+        }
+
         // If
         // a) the previous instruction in the eBPF program could fallthrough
         //    to this instruction and
@@ -1852,6 +1938,13 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         }
         state->pc_locs[i] = state->offset;
 
+        if (emit_fused_instructions(vm, state, n, inst)) {
+            // The second instruction of the pair is not the target of any jump.
+            state->pc_locs[i + 1] = state->offset;
+            n++;
+            continue;
+        }
+
         switch (inst.opcode) {
         case EBPF_OP_ADD_IMM:
             EMIT_ALU32_IMM32(vm, state, 0x81, 0, dst, inst.imm);
@@ -2088,179 +2181,179 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
             break;
         case EBPF_OP_JEQ_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x84, tgt);
+            emit_jcc(state, 0x84 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JEQ_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x84, tgt);
+            emit_jcc(state, 0x84 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JGT_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x87, tgt);
+            emit_jcc(state, 0x87 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JGT_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x87, tgt);
+            emit_jcc(state, 0x87 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JGE_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x83, tgt);
+            emit_jcc(state, 0x83 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JGE_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x83, tgt);
+            emit_jcc(state, 0x83 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JLT_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x82, tgt);
+            emit_jcc(state, 0x82 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JLT_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x82, tgt);
+            emit_jcc(state, 0x82 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JLE_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x86, tgt);
+            emit_jcc(state, 0x86 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JLE_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x86, tgt);
+            emit_jcc(state, 0x86 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSET_IMM:
             EMIT_TEST_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x85, tgt);
+            emit_jcc(state, 0x85 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSET_REG:
             emit_alu64(state, 0x85, src, dst);
-            emit_jcc(state, 0x85, tgt);
+            emit_jcc(state, 0x85 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JNE_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x85, tgt);
+            emit_jcc(state, 0x85 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JNE_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x85, tgt);
+            emit_jcc(state, 0x85 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSGT_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x8f, tgt);
+            emit_jcc(state, 0x8f ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSGT_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8f, tgt);
+            emit_jcc(state, 0x8f ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSGE_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x8d, tgt);
+            emit_jcc(state, 0x8d ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSGE_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8d, tgt);
+            emit_jcc(state, 0x8d ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSLT_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x8c, tgt);
+            emit_jcc(state, 0x8c ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSLT_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8c, tgt);
+            emit_jcc(state, 0x8c ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSLE_IMM:
             EMIT_CMP_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x8e, tgt);
+            emit_jcc(state, 0x8e ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSLE_REG:
             emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8e, tgt);
+            emit_jcc(state, 0x8e ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JEQ32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x84, tgt);
+            emit_jcc(state, 0x84 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JEQ32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x84, tgt);
+            emit_jcc(state, 0x84 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JGT32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x87, tgt);
+            emit_jcc(state, 0x87 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JGT32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x87, tgt);
+            emit_jcc(state, 0x87 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JGE32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x83, tgt);
+            emit_jcc(state, 0x83 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JGE32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x83, tgt);
+            emit_jcc(state, 0x83 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JLT32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x82, tgt);
+            emit_jcc(state, 0x82 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JLT32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x82, tgt);
+            emit_jcc(state, 0x82 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JLE32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x86, tgt);
+            emit_jcc(state, 0x86 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JLE32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x86, tgt);
+            emit_jcc(state, 0x86 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSET32_IMM:
             EMIT_TEST32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x85, tgt);
+            emit_jcc(state, 0x85 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSET32_REG:
             emit_alu32(state, 0x85, src, dst);
-            emit_jcc(state, 0x85, tgt);
+            emit_jcc(state, 0x85 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JNE32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x85, tgt);
+            emit_jcc(state, 0x85 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JNE32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x85, tgt);
+            emit_jcc(state, 0x85 ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSGT32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x8f, tgt);
+            emit_jcc(state, 0x8f ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSGT32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x8f, tgt);
+            emit_jcc(state, 0x8f ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSGE32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x8d, tgt);
+            emit_jcc(state, 0x8d ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSGE32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x8d, tgt);
+            emit_jcc(state, 0x8d ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSLT32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x8c, tgt);
+            emit_jcc(state, 0x8c ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSLT32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x8c, tgt);
+            emit_jcc(state, 0x8c ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSLE32_IMM:
             EMIT_CMP32_IMM32(vm, state, dst, inst.imm);
-            emit_jcc(state, 0x8e, tgt);
+            emit_jcc(state, 0x8e ^ jcc_invert, tgt);
             break;
         case EBPF_OP_JSLE32_REG:
             emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x8e, tgt);
+            emit_jcc(state, 0x8e ^ jcc_invert, tgt);
             break;
         case EBPF_OP_CALL:
             /* We reserve RCX for shifts */
@@ -2268,7 +2361,7 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
                 emit_mov(state, RCX_ALT, RCX);
                 emit_dispatched_external_helper_call(state, inst.imm);
                 if (inst.imm == vm->unwind_stack_extension_index) {
-                    emit_cmp_imm32(state, map_register(BPF_REG_0), 0);
+                    emit_cmp_imm32(state, map_register(state, BPF_REG_0), 0);
                     DECLARE_PATCHABLE_TARGET(exit_tgt);
                     exit_tgt.is_special = true;
                     exit_tgt.target.special = Exit;
@@ -2425,7 +2518,7 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
                 break;
             case (EBPF_ATOMIC_OP_CMPXCHG & ~EBPF_ATOMIC_OP_FETCH):
                 emit_atomic_compare_exchange32(state, src, dst, inst.offset);
-                emit_truncate_u32(state, map_register(0));
+                emit_truncate_u32(state, map_register(state, 0));
                 break;
             default:
                 *errmsg = ubpf_error("Error: unknown atomic opcode %d at PC %d\n", inst.imm, i);
@@ -2442,6 +2535,342 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         if (((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU) && (inst.opcode & EBPF_ALU_OP_MASK) != 0xd0) {
             emit_truncate_u32(state, dst);
         }
+
+        if (state->layout_flags[i] & LayoutJumpToTarget) {
+            DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(hot_tgt, target_pc);
+            emit_jmp(state, hot_tgt);
+        }
+    }
+    return 0;
+}
+
+/*
+ * A local function of the program that was translated on its own, by
+ * translate_functions_worker. Its code starts at offset 0, and so do the locations
+ * in its patchable relatives and in pc_locs.
+ */
+struct function_translation
+{
+    uint32_t first; // The entries [first, last) of the layout belong to the function.
+    uint32_t last;
+    int result; // See translate_instructions.
+    enum JitProgress jit_status;
+    char* errmsg;
+    uint8_t* code;
+    uint32_t code_size;
+    size_t prolog_size;
+    struct patchable_relative* jumps;
+    int num_jumps;
+    struct patchable_relative* local_calls;
+    int num_local_calls;
+};
+
+struct concurrent_translation
+{
+    struct ubpf_vm* vm;
+    const struct jit_state* state;
+    struct function_translation* functions;
+    uint32_t num_functions;
+    volatile int32_t next_function;
+};
+
+static bool
+copy_jit_output(void** copy, const void* data, size_t size)
+{
+    *copy = NULL;
+    if (size == 0) {
+        return true;
+    }
+    *copy = malloc(size);
+    if (*copy == NULL) {
+        return false;
+    }
+    memcpy(*copy, data, size);
+    return true;
+}
+
+/*
+ * Translate functions until there are none left. Each worker has its own buffer and
+ * tables of patchable relatives; everything else that translate_instructions reads is
+ * shared, and the pc_locs of different functions do not overlap.
+ */
+static void
+translate_functions_worker(void* context)
+{
+    struct concurrent_translation* translation = context;
+    struct jit_state state = *translation->state;
+    state.buf = malloc(state.size);
+    state.jumps = calloc(UBPF_JIT_MAX_JUMPS, sizeof(state.jumps[0]));
+    state.loads = NULL;
+    state.leas = NULL;
+    state.local_calls = calloc(UBPF_MAX_INSTS, sizeof(state.local_calls[0]));
+
+    for (;;) {
+        uint32_t index = (uint32_t)UBPF_ATOMIC_ADD_FETCH32(&translation->next_function, 1);
+        if (index >= translation->num_functions) {
+            break;
+        }
+        struct function_translation* function = &translation->functions[index];
+        if (!state.buf || !state.jumps || !state.local_calls) {
+            function->result = -1;
+            function->errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
+            continue;
+        }
+
+        state.offset = 0;
+        state.num_jumps = 0;
+        state.num_local_calls = 0;
+        state.jit_status = NoError;
+        state.bpf_function_prolog_size = 0;
+        function->result =
+            translate_instructions(translation->vm, &state, function->first, function->last, &function->errmsg);
+        function->jit_status = state.jit_status;
+        if (function->result < 0 || state.jit_status != NoError) {
+            continue;
+        }
+
+        function->code_size = state.offset;
+        function->prolog_size = state.bpf_function_prolog_size;
+        function->num_jumps = state.num_jumps;
+        function->num_local_calls = state.num_local_calls;
+        if (!copy_jit_output((void**)&function->code, state.buf, state.offset) ||
+            !copy_jit_output((void**)&function->jumps, state.jumps, state.num_jumps * sizeof(state.jumps[0])) ||
+            !copy_jit_output(
+                (void**)&function->local_calls,
+                state.local_calls,
+                state.num_local_calls * sizeof(state.local_calls[0]))) {
+            function->result = -1;
+            function->errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
+        }
+    }
+
+    free(state.buf);
+    free(state.jumps);
+    free(state.local_calls);
+}
+
+/*
+ * Append a function that was translated on its own to the code in state, moving its
+ * patchable relatives and pc_locs along. Returns -1 if it failed with *errmsg set;
+ * otherwise, state->jit_status tells whether it was appended.
+ */
+static int
+link_function(struct jit_state* state, struct function_translation* function, char** errmsg)
+{
+    if (function->result < 0 || function->jit_status != NoError) {
+        state->jit_status = function->jit_status;
+        *errmsg = function->errmsg;
+        function->errmsg = NULL;
+        return function->result;
+    }
+
+    uint32_t base = state->offset;
+    emit_bytes(state, function->code, function->code_size);
+    if (state->jit_status != NoError) {
+        return 0;
+    }
+    for (uint32_t n = function->first; n < function->last; n++) {
+        state->pc_locs[state->layout[n]] += base;
+    }
+    if (state->bpf_function_prolog_size == 0) {
+        state->bpf_function_prolog_size = function->prolog_size;
+    }
+
+    for (int j = 0; j < function->num_jumps; j++) {
+        if (state->num_jumps == UBPF_JIT_MAX_JUMPS) {
+            state->jit_status = TooManyJumps;
+            return 0;
+        }
+        struct patchable_relative jump = function->jumps[j];
+        jump.offset_loc += base;
+        if (!jump.target.is_special && jump.target.target.regular.jit_target_pc != 0) {
+            jump.target.target.regular.jit_target_pc += base;
+        }
+        state->jumps[state->num_jumps++] = jump;
+    }
+    for (int j = 0; j < function->num_local_calls; j++) {
+        if (state->num_local_calls == UBPF_MAX_INSTS) {
+            state->jit_status = TooManyLocalCalls;
+            return 0;
+        }
+        struct patchable_relative local_call = function->local_calls[j];
+        local_call.offset_loc += base;
+        state->local_calls[state->num_local_calls++] = local_call;
+    }
+    return 0;
+}
+
+/*
+ * Translate the local functions of the program on up to vm->jit_threads threads and
+ * append them to the code in state one after the other, which gives the same code as
+ * translating the program on one thread. Calls between them (and their jumps to the
+ * exit) are patchable relatives that are resolved after
+ * everything is in place.
+ *
+ * Returns 0 if the program is not translated this way: with one thread, with one
+ * function, or when the layout (see compute_jit_layout) moved code out of the
+ * function that it belongs to. Otherwise, returns 1, or -1 if the translation failed
+ * with *errmsg set (state->jit_status tells whether it succeeded).
+ */
+static int
+translate_functions_concurrently(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
+{
+    if (vm->jit_threads < 2) {
+        return 0;
+    }
+
+    uint32_t num_functions = 0;
+    for (uint32_t n = 0; n < state->layout_size; n++) {
+        if (n > 0 && state->layout[n] < state->layout[n - 1]) {
+            return 0;
+        }
+        if (n == 0 || vm->int_funcs[state->layout[n]]) {
+            num_functions++;
+        }
+    }
+    if (num_functions < 2) {
+        return 0;
+    }
+
+    struct function_translation* functions = calloc(num_functions, sizeof(functions[0]));
+    if (functions == NULL) {
+        // Not an error: the caller translates the program on this thread instead.
+        return 0;
+    }
+    uint32_t f = 0;
+    for (uint32_t n = 0; n < state->layout_size; n++) {
+        if (n > 0 && vm->int_funcs[state->layout[n]]) {
+            functions[f++].last = n;
+            functions[f].first = n;
+        }
+    }
+    functions[f].last = state->layout_size;
+
+    struct concurrent_translation translation = {
+        .vm = vm,
+        .state = state,
+        .functions = functions,
+        .num_functions = num_functions,
+        .next_function = 0,
+    };
+    run_jit_workers(
+        vm->jit_threads < num_functions ? vm->jit_threads : num_functions, translate_functions_worker, &translation);
+
+    int result = 1;
+    for (f = 0; f < num_functions; f++) {
+        if (result == 1 && state->jit_status == NoError && link_function(state, &functions[f], errmsg) < 0) {
+            result = -1;
+        }
+        free(functions[f].errmsg);
+        free(functions[f].code);
+        free(functions[f].jumps);
+        free(functions[f].local_calls);
+    }
+    free(functions);
+    return result;
+}
+
+static int
+translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
+{
+    int i;
+    int saved_registers[_countof(platform_nonvolatile_registers)];
+    int num_saved_registers;
+    uint16_t used_registers = compute_used_registers(vm);
+
+    (void)platform_volatile_registers;
+    /* Save the platform non-volatile registers that the program can modify. */
+    num_saved_registers = select_saved_registers(state, used_registers, saved_registers);
+    for (i = 0; i < num_saved_registers; i++) {
+        emit_push(state, saved_registers[i]);
+    }
+
+    /* Move first platform parameter register into register 1 */
+    if (map_register(state, 1) != platform_parameter_registers[0]) {
+        emit_mov(state, platform_parameter_registers[0], map_register(state, BPF_REG_1));
+    }
+
+    /* Move the first platform parameter register to the (volatile) register
+     * that holds the pointer to the context.
+     */
+    emit_mov(state, platform_parameter_registers[0], VOLATILE_CTXT);
+
+    /*
+     * The entry stub (see ubpf_jit_entry_x86_64) passes the address of the VM's
+     * struct ubpf_jit_data in RAX. Keep it at [RBP], where helper calls find it.
+     *
+     * Assuming that the stack is 16-byte aligned right before
+     * the call insn that brought us to this code, when
+     * we start executing the jit'd code, we need to regain a 16-byte
+     * alignment. The UBPF_EBPF_STACK_SIZE is guaranteed to be
+     * divisible by 16. However, if we pushed an even number of
+     * registers on the stack when we are saving state (see above),
+     * then we have to push the address a second time to get back
+     * to a 16-byte alignment.
+     */
+    emit_push(state, RAX);
+    if (!(num_saved_registers % 2)) {
+        emit_push(state, RAX);
+    }
+
+    /*
+     * Let's set RBP to RSP so that we can restore RSP later!
+     */
+    emit_mov(state, RSP, RBP);
+
+    /* Configure eBPF program stack space */
+    if (state->jit_mode == BasicJitMode) {
+        /*
+         * Set BPF R10 (the way to access the frame in eBPF) the beginning
+         * of the eBPF program's stack space.
+         */
+        if (used_registers & (1 << BPF_REG_10)) {
+            emit_mov(state, RSP, map_register(state, BPF_REG_10));
+        }
+        /* Allocate eBPF program stack space (unless the program never uses it) */
+        if (vm->stack_requirement) {
+            emit_alu64_imm32(state, 0x81, 5, RSP, vm->stack_requirement);
+        }
+    } else if (used_registers & (1 << BPF_REG_10)) {
+        /* Use given eBPF program stack space */
+        emit_mov(state, platform_parameter_registers[2], map_register(state, BPF_REG_10));
+        emit_alu64(state, 0x01, platform_parameter_registers[3], map_register(state, BPF_REG_10));
+    }
+
+#if defined(_WIN32)
+    /* Windows x64 ABI requires home register space */
+    /* Allocate home register space - 4 registers */
+    emit_alu64_imm32(state, 0x81, 5, RSP, 4 * sizeof(uint64_t));
+#endif
+
+    /*
+     * Use a call to set up a place where we can land after eBPF program's
+     * final EXIT call. This makes it appear to the ebpf programs
+     * as if they are called like a function. It is their responsibility
+     * to deal with the non-16-byte aligned stack pointer that goes along
+     * with this pretense.
+     */
+    emit1(state, 0xe8);
+    emit4(state, 5);
+    /*
+     * We jump over this instruction in the first place; return here
+     * after the eBPF program is finished executing.
+     */
+
+    DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit)
+    emit_jmp(state, exit_tgt);
+
+    compute_jit_layout(vm, state);
+    state->live_registers = compute_live_registers(vm);
+
+    // The local functions of a program may be translated on several threads (see
+    // ubpf_set_jit_threads); otherwise, the whole program is translated here.
+    int translated = translate_functions_concurrently(vm, state, errmsg);
+    if (translated == 0) {
+        translated = translate_instructions(vm, state, 0, state->layout_size, errmsg);
+    }
+    if (translated < 0) {
+        return -1;
     }
 
     if (state->jit_status != NoError) {
@@ -2487,27 +2916,30 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
     state->exit_loc = state->offset;
 
     /* Move register 0 into rax */
-    if (map_register(BPF_REG_0) != RAX) {
-        emit_mov(state, map_register(BPF_REG_0), RAX);
+    if (map_register(state, BPF_REG_0) != RAX) {
+        emit_mov(state, map_register(state, BPF_REG_0), RAX);
     }
 
     /* Deallocate stack space by restoring RSP from RBP. */
     emit_mov(state, RBP, RSP);
 
-    if (!(_countof(platform_nonvolatile_registers) % 2)) {
-        emit_alu64_imm32(state, 0x81, 0, RSP, 0x8);
-    }
+    /* Drop the address of the struct ubpf_jit_data. */
+    emit_alu64_imm32(state, 0x81, 0, RSP, num_saved_registers % 2 ? 0x8 : 0x10);
 
     /* Restore platform non-volatile registers */
-    for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
-        emit_pop(state, platform_nonvolatile_registers[_countof(platform_nonvolatile_registers) - i - 1]);
+    for (i = 0; i < num_saved_registers; i++) {
+        emit_pop(state, saved_registers[num_saved_registers - i - 1]);
     }
 
     emit1(state, 0xc3); /* ret */
 
     state->retpoline_loc = emit_retpoline(state);
-    state->dispatcher_loc = emit_dispatched_external_helper_address(state, vm);
-    state->helper_table_loc = emit_helper_table(state, vm);
+
+    // The code after the program can still run out of space.
+    if (state->jit_status != NoError) {
+        *errmsg = ubpf_error("Target buffer too small");
+        return -1;
+    }
 
     return 0;
 }
@@ -2586,41 +3018,6 @@ resolve_patchable_relatives(struct jit_state* state)
         memcpy(offset_ptr, &rel, sizeof(uint32_t));
     }
 
-    for (i = 0; i < state->num_loads; i++) {
-        struct patchable_relative load = state->loads[i];
-
-        int target_loc = 0;
-        // It is only possible to load from the external dispatcher's position.
-        if (load.target.is_special && load.target.target.special == ExternalDispatcher) {
-            target_loc = state->dispatcher_loc;
-        } else {
-            target_loc = -1;
-            return false;
-        }
-        /* Assumes load target is calculated relative to the end of instruction */
-        uint32_t rel = target_loc - (load.offset_loc + sizeof(uint32_t));
-
-        uint8_t* offset_ptr = &state->buf[load.offset_loc];
-        memcpy(offset_ptr, &rel, sizeof(uint32_t));
-    }
-
-    for (i = 0; i < state->num_leas; i++) {
-        struct patchable_relative lea = state->leas[i];
-
-        int target_loc;
-        // It is only possible to LEA from the helper table.
-        if (lea.target.is_special && lea.target.target.special == LoadHelperTable) {
-            target_loc = state->helper_table_loc;
-        } else {
-            target_loc = -1;
-            return false;
-        }
-        /* Assumes lea target is calculated relative to the end of instruction */
-        uint32_t rel = target_loc - (lea.offset_loc + sizeof(uint32_t));
-
-        uint8_t* offset_ptr = &state->buf[lea.offset_loc];
-        memcpy(offset_ptr, &rel, sizeof(uint32_t));
-    }
     return true;
 }
 
@@ -2633,6 +3030,7 @@ ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum Ji
     if (initialize_jit_state_result(&state, &compile_result, buffer, *size, jit_mode, &compile_result.errmsg) < 0) {
         goto out;
     }
+    initialize_register_map(&state, vm->register_offset);
 
     if (translate(vm, &state, &compile_result.errmsg) < 0) {
         goto out;
@@ -2644,8 +3042,6 @@ ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum Ji
     }
 
     compile_result.compile_result = UBPF_JIT_COMPILE_SUCCESS;
-    compile_result.external_dispatcher_offset = state.dispatcher_loc;
-    compile_result.external_helper_offset = state.helper_table_loc;
     compile_result.jit_mode = jit_mode;
     *size = state.offset;
 
@@ -2654,37 +3050,43 @@ out:
     return compile_result;
 }
 
-bool
-ubpf_jit_update_dispatcher_x86_64(
-    struct ubpf_vm* vm, external_function_dispatcher_t new_dispatcher, uint8_t* buffer, size_t size, uint32_t offset)
+size_t
+ubpf_jit_entry_x86_64(uint8_t* buffer, const struct ubpf_jit_data* jit_data, bool fall_through)
 {
-    UNUSED_PARAMETER(vm);
-    uint64_t jit_upper_bound = (uint64_t)buffer + size;
-    void* dispatcher_address = (void*)((uint64_t)buffer + offset);
-    if ((uint64_t)dispatcher_address + sizeof(void*) < jit_upper_bound) {
-        memcpy(dispatcher_address, &new_dispatcher, sizeof(void*));
-        return true;
+    struct jit_state state;
+    memset(&state, 0, sizeof(state));
+    state.buf = buffer;
+    state.size = UBPF_JIT_ENTRY_MAX_SIZE;
+
+    // movabs rax, jit_data (see the prologue in translate)
+    emit_basic_rex(&state, 1, 0, RAX);
+    emit1(&state, 0xb8);
+    emit8(&state, (uint64_t)(uintptr_t)jit_data);
+    if (fall_through) {
+        return state.offset;
     }
 
-    return false;
-}
-
-bool
-ubpf_jit_update_helper_x86_64(
-    struct ubpf_vm* vm,
-    extended_external_helper_t new_helper,
-    unsigned int idx,
-    uint8_t* buffer,
-    size_t size,
-    uint32_t offset)
-{
-    UNUSED_PARAMETER(vm);
-    uint64_t jit_upper_bound = (uint64_t)buffer + size;
-
-    void* dispatcher_address = (void*)((uint64_t)buffer + offset + (8 * idx));
-    if ((uint64_t)dispatcher_address + sizeof(void*) < jit_upper_bound) {
-        memcpy(dispatcher_address, &new_helper, sizeof(void*));
-        return true;
-    }
-    return false;
+#ifndef UBPF_DISABLE_RETPOLINES
+    // mov r11, [rax + code]
+    emit_load(&state, S64, RAX, R11, offsetof(struct ubpf_jit_data, code));
+    // A retpoline (see emit_retpoline) to r11:
+    // call set_target
+    emit1(&state, 0xe8);
+    emit4(&state, 4);
+    // capture_ret_spec: pause; jmp capture_ret_spec
+    emit_pause(&state);
+    emit1(&state, 0xeb);
+    emit1(&state, 0xfc);
+    // set_target: mov [rsp], r11; ret
+    emit1(&state, 0x4c);
+    emit1(&state, 0x89);
+    emit1(&state, 0x1c);
+    emit1(&state, 0x24);
+    emit_ret(&state);
+#else
+    // jmp [rax + code]
+    emit1(&state, 0xff);
+    emit_modrm_and_displacement(&state, 4, RAX, offsetof(struct ubpf_jit_data, code));
+#endif
+    return state.offset;
 }
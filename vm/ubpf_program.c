@@ -0,0 +1,642 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Programs: the immutable part of a loaded program, its bytecode and what validation and
+ * the load-time analyses computed about it, which several VMs can share. A VM that runs
+ * a shared program is an instance of it: it points at the program's bytecode, control
+ * flow graph and analysis results and keeps everything that depends on its bindings. Its
+ * helpers are checked against the program's helper calls when it is bound to the
+ * program.
+ *
+ * JIT'd code is shared through its program too. The code reaches the helpers, the
+ * dispatcher and the other bindings of a VM through the struct ubpf_jit_data that the
+ * VM's entry stub passes to it, so the first VM to compile a shared program with a
+ * given set of JIT options (see struct ubpf_jit_options) lists its code in the program
+ * and the VMs that compile the program with the same options run that image. Code
+ * compiled for a branch profile is not shared, because it is laid out for the profile
+ * of one VM.
+ *
+ * An instance (struct ubpf_instance) is lighter still: it holds nothing but a struct
+ * ubpf_jit_data of its own, with its helpers, dispatcher and error hooks, and points at
+ * a program and at code that a VM compiled for it.
+ *
+ * Programs are reference counted: ubpf_get_program(), every VM and instance that runs a
+ * program and every image of JIT'd code that it shares hold a reference, and the last
+ * one to be released frees it. The program's list of JIT'd code holds none, so an image
+ * is unmapped as soon as the last VM or instance that runs it releases it.
+ *
+ * The program cache is a process-wide table of programs, keyed by a hash of their
+ * bytecode and by the options that the load-time analyses depend on, so that VMs that
+ * enable it share the programs they load with ubpf_load(). The table and the reference
+ * counts are protected by a spin lock that is only held to look up, insert and release
+ * programs, never while a program is validated or analyzed.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "ubpf_int.h"
+
+#define PROGRAM_CACHE_BUCKETS 256
+
+// The options that validation and the analyses read from the VM.
+struct program_options
+{
+    enum ubpf_execution_profile execution_profile;
+    bool bounds_check_enabled;
+    bool undefined_behavior_check_enabled;
+    bool readonly_bytecode_enabled;
+    bool context_size_declared;
+    size_t minimum_context_size;
+    uint64_t pointer_secret;
+    struct ubpf_safe_helper_metadata safe_helpers[MAX_EXT_FUNCS];
+};
+
+struct ubpf_program
+{
+    struct ubpf_program* next; // In its bucket of the program cache.
+    bool cached;
+    uint64_t hash;
+    uint32_t references;
+    struct program_options options;
+
+    struct ebpf_inst* insts; // Encoded for its own address and options.pointer_secret.
+    uint16_t num_insts;
+    size_t insts_alloc_size;
+    bool* int_funcs;
+    struct ubpf_cfg* cfg;
+    struct ubpf_stack_usage* local_func_stack_usage; // One entry per instruction.
+    size_t stack_requirement;
+    uint64_t instruction_bound;
+    bool* proven_accesses;
+    uint32_t memory_accesses;
+    uint32_t proven_memory_accesses;
+    bool* shadow_tracked;
+    bool shadow_tracking_needed;
+    uint32_t* helper_calls; // The PCs of the helper calls, in program order.
+    uint32_t num_helper_calls;
+    struct ubpf_jit_code* jit_code; // The JIT'd code that VMs running the program share.
+};
+
+struct ubpf_instance
+{
+    struct ubpf_program* program;
+    struct ubpf_jit_code* jit_code;
+    struct ubpf_jit_data* jit_data; // Preceded by the instance's entry stub.
+};
+
+static struct ubpf_program* program_cache[PROGRAM_CACHE_BUCKETS];
+static struct ubpf_program_cache_stats program_cache_stats;
+static volatile int32_t program_lock;
+
+static void
+lock_programs(void)
+{
+    while (UBPF_ATOMIC_COMPARE_EXCHANGE32(&program_lock, 0, 1) != 0) {
+    }
+}
+
+static void
+unlock_programs(void)
+{
+    UBPF_ATOMIC_COMPARE_EXCHANGE32(&program_lock, 1, 0);
+}
+
+// One step of FNV-1a over the bytecode.
+static uint64_t
+hash_instruction(uint64_t hash, struct ebpf_inst inst)
+{
+    const uint8_t* bytes = (const uint8_t*)&inst;
+    for (size_t i = 0; i < sizeof(inst); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t
+hash_program(const struct ebpf_inst* insts, uint32_t num_insts)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        hash = hash_instruction(hash, insts[pc]);
+    }
+    return hash;
+}
+
+static void
+get_options(const struct ubpf_vm* vm, struct program_options* options)
+{
+    // Zeroed, including padding, so that options compare with memcmp.
+    memset(options, 0, sizeof(*options));
+    options->execution_profile = vm->execution_profile;
+    options->bounds_check_enabled = vm->bounds_check_enabled;
+    options->undefined_behavior_check_enabled = vm->undefined_behavior_check_enabled;
+    options->readonly_bytecode_enabled = vm->readonly_bytecode_enabled;
+    options->context_size_declared = vm->context_size_declared;
+    options->minimum_context_size = vm->minimum_context_size;
+    options->pointer_secret = vm->pointer_secret;
+    if (vm->context_size_declared) {
+        // Only the range verifier reads the metadata of safe helpers.
+        memcpy(options->safe_helpers, vm->safe_helpers, sizeof(options->safe_helpers));
+    }
+}
+
+// The instruction at pc, which is encoded for the program's address and pointer secret.
+static struct ebpf_inst
+fetch_instruction(const struct ubpf_program* program, uint32_t pc)
+{
+    uint64_t encoded;
+    memcpy(&encoded, &program->insts[pc], sizeof(encoded));
+    encoded ^= (uint64_t)program->insts ^ program->options.pointer_secret;
+    struct ebpf_inst inst;
+    memcpy(&inst, &encoded, sizeof(inst));
+    return inst;
+}
+
+static bool
+program_matches(
+    const struct ubpf_program* program,
+    uint64_t hash,
+    const struct program_options* options,
+    const struct ebpf_inst* insts,
+    uint32_t num_insts)
+{
+    if (program->hash != hash || program->num_insts != num_insts ||
+        memcmp(&program->options, options, sizeof(*options)) != 0) {
+        return false;
+    }
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        struct ebpf_inst inst = fetch_instruction(program, pc);
+        if (memcmp(&inst, &insts[pc], sizeof(inst)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct ubpf_program*
+find_program(uint64_t hash, const struct program_options* options, const struct ebpf_inst* insts, uint32_t num_insts)
+{
+    for (struct ubpf_program* program = program_cache[hash % PROGRAM_CACHE_BUCKETS]; program != NULL;
+         program = program->next) {
+        if (program_matches(program, hash, options, insts, num_insts)) {
+            return program;
+        }
+    }
+    return NULL;
+}
+
+static void
+free_program(struct ubpf_program* program)
+{
+    if (program->insts != NULL && program->options.readonly_bytecode_enabled) {
+        munmap(program->insts, program->insts_alloc_size);
+    } else {
+        free(program->insts);
+    }
+    free(program->int_funcs);
+    ubpf_destroy_cfg(program->cfg);
+    free(program->local_func_stack_usage);
+    free(program->proven_accesses);
+    free(program->shadow_tracked);
+    free(program->helper_calls);
+    free(program);
+}
+
+/*
+ * Create a program from what the VM computed when it loaded its bytecode. The program
+ * does not own any of it yet (see take_program).
+ */
+static struct ubpf_program*
+create_program(const struct ubpf_vm* vm)
+{
+    struct ubpf_program* program = calloc(1, sizeof(*program));
+    if (program == NULL) {
+        return NULL;
+    }
+    program->local_func_stack_usage = calloc(vm->num_insts, sizeof(program->local_func_stack_usage[0]));
+    if (program->local_func_stack_usage == NULL) {
+        free_program(program);
+        return NULL;
+    }
+    get_options(vm, &program->options);
+    program->hash = 0xcbf29ce484222325ULL;
+
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        program->hash = hash_instruction(program->hash, inst);
+        program->num_helper_calls += inst.opcode == EBPF_OP_CALL && inst.src == 0;
+    }
+    program->helper_calls = calloc(program->num_helper_calls, sizeof(program->helper_calls[0]));
+    if (program->num_helper_calls != 0 && program->helper_calls == NULL) {
+        free_program(program);
+        return NULL;
+    }
+    memcpy(
+        program->local_func_stack_usage,
+        vm->local_func_stack_usage,
+        vm->num_insts * sizeof(program->local_func_stack_usage[0]));
+    uint32_t helper_call = 0;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 0) {
+            program->helper_calls[helper_call++] = pc;
+        }
+    }
+    return program;
+}
+
+// Move what the VM computed into the program, which the VM then runs.
+static void
+take_program(struct ubpf_vm* vm, struct ubpf_program* program)
+{
+    program->insts = vm->insts;
+    program->num_insts = vm->num_insts;
+    program->insts_alloc_size = vm->insts_alloc_size;
+    program->int_funcs = vm->int_funcs;
+    program->cfg = vm->cfg;
+    program->stack_requirement = vm->stack_requirement;
+    program->instruction_bound = vm->instruction_bound;
+    program->proven_accesses = vm->proven_accesses;
+    program->memory_accesses = vm->memory_accesses;
+    program->proven_memory_accesses = vm->proven_memory_accesses;
+    program->shadow_tracked = vm->shadow_tracked;
+    program->shadow_tracking_needed = vm->shadow_tracking_needed;
+    vm->program = program;
+}
+
+/*
+ * Make the VM run the program, which it holds a reference to, and check that the VM has
+ * the helpers that it calls.
+ */
+static int
+attach_program(struct ubpf_vm* vm, struct ubpf_program* program, char** errmsg)
+{
+    vm->program = program;
+    vm->insts = program->insts;
+    vm->num_insts = program->num_insts;
+    vm->insts_alloc_size = program->insts_alloc_size;
+    vm->int_funcs = program->int_funcs;
+    vm->cfg = program->cfg;
+    memcpy(
+        vm->local_func_stack_usage,
+        program->local_func_stack_usage,
+        program->num_insts * sizeof(program->local_func_stack_usage[0]));
+    vm->stack_requirement = program->stack_requirement;
+    vm->instruction_bound = program->instruction_bound;
+    vm->proven_accesses = program->proven_accesses;
+    vm->memory_accesses = program->memory_accesses;
+    vm->proven_memory_accesses = program->proven_memory_accesses;
+    vm->shadow_tracked = program->shadow_tracked;
+    vm->shadow_tracking_needed = program->shadow_tracking_needed;
+
+    // Validation checked the helper calls against the VM that loaded the program first.
+    for (uint32_t i = 0; i < program->num_helper_calls; i++) {
+        uint32_t pc = program->helper_calls[i];
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (!ubpf_helper_is_registered(vm, inst.imm)) {
+            *errmsg = ubpf_error("call to nonexistent function %u at PC %d", inst.imm, pc);
+            ubpf_unload_code(vm);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+ubpf_load_cached_program(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+{
+    struct program_options options;
+    get_options(vm, &options);
+    uint64_t hash = hash_program(insts, num_insts);
+
+    lock_programs();
+    struct ubpf_program* program = find_program(hash, &options, insts, num_insts);
+    if (program == NULL) {
+        program_cache_stats.misses++;
+        unlock_programs();
+        return 0;
+    }
+    program->references++;
+    program_cache_stats.hits++;
+    unlock_programs();
+
+    return attach_program(vm, program, errmsg) < 0 ? -1 : 1;
+}
+
+void
+ubpf_cache_loaded_program(struct ubpf_vm* vm, const struct ebpf_inst* insts)
+{
+    struct ubpf_program* program = create_program(vm);
+    if (program == NULL) {
+        return;
+    }
+
+    lock_programs();
+    if (find_program(program->hash, &program->options, insts, vm->num_insts) != NULL) {
+        // Another VM loaded the same program at the same time; this one keeps its own copy.
+        unlock_programs();
+        free_program(program);
+        return;
+    }
+    take_program(vm, program);
+    program->references = 1;
+    program->cached = true;
+    struct ubpf_program** bucket = &program_cache[program->hash % PROGRAM_CACHE_BUCKETS];
+    program->next = *bucket;
+    *bucket = program;
+    program_cache_stats.programs++;
+    unlock_programs();
+}
+
+int
+ubpf_share_program(struct ubpf_vm* vm, struct ubpf_program* program, char** errmsg)
+{
+    // The analyses assumed the metadata of the safe helpers that the program was loaded with.
+    if (program->options.context_size_declared &&
+        memcmp(vm->safe_helpers, program->options.safe_helpers, sizeof(vm->safe_helpers)) != 0) {
+        *errmsg = ubpf_error("safe helpers differ from the ones the program was loaded with");
+        return -1;
+    }
+    vm->execution_profile = program->options.execution_profile;
+    vm->bounds_check_enabled = program->options.bounds_check_enabled;
+    vm->undefined_behavior_check_enabled = program->options.undefined_behavior_check_enabled;
+    vm->readonly_bytecode_enabled = program->options.readonly_bytecode_enabled;
+    vm->context_size_declared = program->options.context_size_declared;
+    vm->minimum_context_size = program->options.minimum_context_size;
+    vm->pointer_secret = program->options.pointer_secret;
+
+    lock_programs();
+    program->references++;
+    unlock_programs();
+    return attach_program(vm, program, errmsg);
+}
+
+void
+ubpf_unload_program(struct ubpf_vm* vm)
+{
+    if (vm->program == NULL) {
+        return;
+    }
+    ubpf_release_program(vm->program);
+    vm->program = NULL;
+    vm->insts = NULL;
+    vm->num_insts = 0;
+    vm->insts_alloc_size = 0;
+    vm->int_funcs = NULL;
+    vm->cfg = NULL;
+    vm->proven_accesses = NULL;
+    vm->shadow_tracked = NULL;
+}
+
+struct ubpf_program*
+ubpf_get_program(struct ubpf_vm* vm, char** errmsg)
+{
+    *errmsg = NULL;
+    if (!vm->insts) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+        return NULL;
+    }
+
+    if (vm->program == NULL) {
+        struct ubpf_program* program = create_program(vm);
+        if (program == NULL) {
+            *errmsg = ubpf_error("out of memory");
+            return NULL;
+        }
+        take_program(vm, program);
+        program->references = 1;
+    }
+
+    lock_programs();
+    vm->program->references++;
+    unlock_programs();
+    return vm->program;
+}
+
+void
+ubpf_release_program(struct ubpf_program* program)
+{
+    if (program == NULL) {
+        return;
+    }
+
+    lock_programs();
+    bool last_reference = --program->references == 0;
+    if (last_reference && program->cached) {
+        struct ubpf_program** link = &program_cache[program->hash % PROGRAM_CACHE_BUCKETS];
+        while (*link != program) {
+            link = &(*link)->next;
+        }
+        *link = program->next;
+        program_cache_stats.programs--;
+    }
+    unlock_programs();
+    if (last_reference) {
+        free_program(program);
+    }
+}
+
+void
+ubpf_get_program_cache_stats(struct ubpf_program_cache_stats* stats)
+{
+    lock_programs();
+    *stats = program_cache_stats;
+    unlock_programs();
+}
+
+static void
+get_jit_options(const struct ubpf_vm* vm, enum JitMode jit_mode, struct ubpf_jit_options* options)
+{
+    // Zeroed, including padding, so that options compare with memcmp.
+    memset(options, 0, sizeof(*options));
+    options->jit_mode = jit_mode;
+    options->constant_blinding_enabled = vm->constant_blinding_enabled;
+    options->lse_atomics_enabled = vm->lse_atomics_enabled;
+    options->register_offset = vm->register_offset;
+    options->instruction_limit = vm->instruction_limit;
+    options->unwind_stack_extension_index = vm->unwind_stack_extension_index;
+}
+
+static struct ubpf_jit_code*
+find_jit_code(const struct ubpf_program* program, const struct ubpf_jit_options* options)
+{
+    for (struct ubpf_jit_code* jit_code = program->jit_code; jit_code != NULL; jit_code = jit_code->next) {
+        if (memcmp(&jit_code->options, options, sizeof(*options)) == 0) {
+            return jit_code;
+        }
+    }
+    return NULL;
+}
+
+struct ubpf_jit_code*
+ubpf_find_jit_code(struct ubpf_vm* vm, enum JitMode jit_mode)
+{
+    if (vm->program == NULL || vm->branch_profile != NULL) {
+        return NULL;
+    }
+    struct ubpf_jit_options options;
+    get_jit_options(vm, jit_mode, &options);
+
+    lock_programs();
+    struct ubpf_jit_code* jit_code = find_jit_code(vm->program, &options);
+    if (jit_code != NULL) {
+        jit_code->references++;
+        program_cache_stats.jit_hits++;
+    }
+    unlock_programs();
+    return jit_code;
+}
+
+struct ubpf_jit_code*
+ubpf_create_jit_code(struct ubpf_vm* vm, enum JitMode jit_mode, void* code, size_t size)
+{
+    struct ubpf_jit_code* jit_code = calloc(1, sizeof(*jit_code));
+    if (jit_code == NULL) {
+        return NULL;
+    }
+    get_jit_options(vm, jit_mode, &jit_code->options);
+    jit_code->code = code;
+    jit_code->size = size;
+    jit_code->references = 1;
+    if (vm->program == NULL || vm->branch_profile != NULL) {
+        return jit_code;
+    }
+
+    lock_programs();
+    // Another VM may have compiled the program at the same time; this one keeps its own code.
+    if (find_jit_code(vm->program, &jit_code->options) == NULL) {
+        jit_code->program = vm->program;
+        jit_code->program->references++;
+        jit_code->next = jit_code->program->jit_code;
+        jit_code->program->jit_code = jit_code;
+    }
+    unlock_programs();
+    return jit_code;
+}
+
+void
+ubpf_release_jit_code(struct ubpf_jit_code* jit_code)
+{
+    lock_programs();
+    bool last_reference = --jit_code->references == 0;
+    if (last_reference && jit_code->program != NULL) {
+        struct ubpf_jit_code** link = &jit_code->program->jit_code;
+        while (*link != jit_code) {
+            link = &(*link)->next;
+        }
+        *link = jit_code->next;
+    }
+    unlock_programs();
+    if (last_reference) {
+        munmap(jit_code->code, jit_code->size);
+        ubpf_release_program(jit_code->program);
+        free(jit_code);
+    }
+}
+
+struct ubpf_instance*
+ubpf_create_instance(struct ubpf_vm* vm, char** errmsg)
+{
+    *errmsg = NULL;
+    if (vm->jit_code == NULL) {
+        *errmsg = ubpf_error("the VM has not compiled its program with a native JIT");
+        return NULL;
+    }
+
+    struct ubpf_instance* instance = calloc(1, sizeof(*instance));
+    if (instance == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        return NULL;
+    }
+    instance->jit_data = ubpf_create_jit_data(vm->jit_entry);
+    if (instance->jit_data == NULL) {
+        *errmsg = ubpf_error("failed to map the data of the instance");
+        free(instance);
+        return NULL;
+    }
+    instance->program = ubpf_get_program(vm, errmsg);
+    if (instance->program == NULL) {
+        ubpf_destroy_instance(instance);
+        return NULL;
+    }
+
+    lock_programs();
+    vm->jit_code->references++;
+    unlock_programs();
+    instance->jit_code = vm->jit_code;
+    instance->jit_data->code = instance->jit_code->code;
+    return instance;
+}
+
+void
+ubpf_destroy_instance(struct ubpf_instance* instance)
+{
+    if (instance == NULL) {
+        return;
+    }
+    ubpf_destroy_jit_data(instance->jit_data);
+    if (instance->jit_code != NULL) {
+        ubpf_release_jit_code(instance->jit_code);
+    }
+    ubpf_release_program(instance->program);
+    free(instance);
+}
+
+int
+ubpf_instance_register(struct ubpf_instance* instance, unsigned int idx, external_function_t fn)
+{
+    if (idx >= MAX_EXT_FUNCS) {
+        return -1;
+    }
+    // Like ubpf_register, this takes effect in code that is executing on another thread.
+    UBPF_ATOMIC_STORE64(&instance->jit_data->helpers[idx], (uintptr_t)fn);
+    return 0;
+}
+
+int
+ubpf_instance_register_external_dispatcher(struct ubpf_instance* instance, external_function_dispatcher_t dispatcher)
+{
+    UBPF_ATOMIC_STORE64(&instance->jit_data->dispatcher, (uintptr_t)dispatcher);
+    return 0;
+}
+
+void
+ubpf_instance_set_error_print(
+    struct ubpf_instance* instance, int (*error_printf)(FILE* stream, const char* format, ...))
+{
+    instance->jit_data->error_printf = error_printf ? error_printf : fprintf;
+}
+
+int
+ubpf_instance_register_data_bounds_check(
+    struct ubpf_instance* instance, void* user_context, ubpf_bounds_check bounds_check)
+{
+    if (instance->jit_data->bounds_check_function != NULL) {
+        return -1;
+    }
+    instance->jit_data->bounds_check_function = bounds_check;
+    instance->jit_data->bounds_check_user_data = user_context;
+    return 0;
+}
+
+ubpf_jit_ex_fn
+ubpf_get_instance_function(struct ubpf_instance* instance, char** errmsg)
+{
+    *errmsg = NULL;
+    // Validation checked the helper calls against the VM that loaded the program.
+    if (instance->jit_data->dispatcher == NULL) {
+        for (uint32_t i = 0; i < instance->program->num_helper_calls; i++) {
+            uint32_t pc = instance->program->helper_calls[i];
+            struct ebpf_inst inst = fetch_instruction(instance->program, pc);
+            if ((uint32_t)inst.imm >= MAX_EXT_FUNCS || instance->jit_data->helpers[inst.imm] == NULL) {
+                *errmsg = ubpf_error("call to nonexistent function %u at PC %d", inst.imm, pc);
+                return NULL;
+            }
+        }
+    }
+    return (ubpf_jit_ex_fn)((uint8_t*)instance->jit_data - ubpf_page_size());
+}
@@ -0,0 +1,1098 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Range verifier: an abstract interpreter that proves memory accesses in bounds so that
+ * the interpreter and the JITs can leave out their run-time bounds checks.
+ *
+ * Every register (and every 8-byte slot of the stack just below r10) holds an abstract
+ * value: a scalar in a range of signed 64-bit values or a pointer, with a range of
+ * offsets, into
+ *   - the context, the memory the program is run with, of at least the size declared
+ *     with ubpf_set_minimum_context_size (r1 on entry),
+ *   - the stack (r10 on entry) or
+ *   - a region of region_size bytes that a helper registered with
+ *     ubpf_register_safe_helper returns (the equivalent of a map value), which may be
+ *     NULL until the program compares it with 0.
+ * The values are propagated along the control flow graph of the main function until a
+ * fixpoint; ranges that keep growing at a join point (loops) are widened, and then
+ * narrowed again by recomputing each state from its predecessors, which recovers the
+ * bounds that loop conditions put on induction variables. Conditional jumps narrow the
+ * ranges of what they compare on each edge and edges that cannot be taken are not
+ * followed.
+ *
+ * The analysis never rejects a program: accesses that it cannot prove in bounds (for
+ * example, all of those in local functions) are simply checked at run time. It is
+ * sound as long as the program is run with at least minimum_context_size bytes of
+ * memory and, if it uses the stack, a stack of vm->stack_requirement bytes, which is
+ * why a VM with a declared context size refuses to run a program with less (see
+ * ubpf_check_context_size).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+// The 8-byte stack slots just below r10 whose contents are tracked (spills and fills).
+#define RANGE_STACK_SLOTS 64
+// The number of times a join point is updated before its ranges are widened.
+#define RANGE_WIDEN_AFTER 8
+// The number of times the states are recomputed from their predecessors after widening.
+#define RANGE_NARROW_PASSES 2
+// Sizes and offsets are kept far enough from the limits of int64_t to add them safely.
+#define RANGE_MAX_SIZE ((int64_t)1 << 48)
+
+enum range_type
+{
+    RANGE_SCALAR,
+    RANGE_CONTEXT,
+    RANGE_STACK,
+    RANGE_REGION,
+    RANGE_REGION_OR_NULL,
+};
+
+struct range_value
+{
+    uint8_t type;
+    int64_t min; // The value of a scalar or the offset of a pointer.
+    int64_t max;
+    int64_t size; // The size of a region.
+};
+
+struct range_state
+{
+    struct range_value registers[_BPF_REG_MAX];
+    struct range_value slots[RANGE_STACK_SLOTS];
+    // A pointer to the stack was stored outside of it or given to a helper, so that
+    // helpers may write to the stack.
+    bool stack_escaped;
+};
+
+struct range_analysis
+{
+    struct ubpf_vm* vm;
+    uint32_t end; // The end of the main function.
+    int64_t context_size;
+    bool* is_leader;
+    struct range_state** states; // At the start of each basic block, once reached.
+    // While narrowing, the states that are recomputed from those in states.
+    struct range_state** next;
+    uint32_t* updates;
+    uint32_t* worklist;
+    uint32_t worklist_size;
+    bool* queued;
+    // Whether the walk records which accesses are in bounds instead of propagating states.
+    bool record;
+};
+
+static struct range_value
+scalar(int64_t min, int64_t max)
+{
+    struct range_value value = {RANGE_SCALAR, min, max, 0};
+    return value;
+}
+
+static struct range_value
+unknown(void)
+{
+    return scalar(INT64_MIN, INT64_MAX);
+}
+
+static bool
+is_pointer(struct range_value value)
+{
+    return value.type != RANGE_SCALAR;
+}
+
+static bool
+is_constant(struct range_value value)
+{
+    return value.type == RANGE_SCALAR && value.min == value.max;
+}
+
+static bool
+within(struct range_value value, int64_t min, int64_t max)
+{
+    return value.type == RANGE_SCALAR && value.min >= min && value.max <= max;
+}
+
+static bool
+checked_add(int64_t a, int64_t b, int64_t* result)
+{
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) {
+        return false;
+    }
+    *result = a + b;
+    return true;
+}
+
+static bool
+checked_sub(int64_t a, int64_t b, int64_t* result)
+{
+    if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) {
+        return false;
+    }
+    *result = a - b;
+    return true;
+}
+
+// The values that a load of size bytes may produce.
+static struct range_value
+loaded(int size, bool sign_extend)
+{
+    if (size == 8) {
+        return unknown();
+    }
+    int64_t bound = (int64_t)1 << (size * 8);
+    return sign_extend ? scalar(-bound / 2, bound / 2 - 1) : scalar(0, bound - 1);
+}
+
+// The smallest mask of low bits that covers a non-negative value.
+static int64_t
+low_bits(int64_t value)
+{
+    uint64_t mask = 0;
+    while (mask < (uint64_t)value) {
+        mask = mask << 1 | 1;
+    }
+    return (int64_t)mask;
+}
+
+// Move the offset of a pointer (or a scalar) by the range of delta, negated if subtract.
+static struct range_value
+offset_by(struct range_value value, struct range_value delta, bool subtract)
+{
+    int64_t min, max;
+    bool exact = subtract ? checked_sub(value.min, delta.max, &min) && checked_sub(value.max, delta.min, &max)
+                          : checked_add(value.min, delta.min, &min) && checked_add(value.max, delta.max, &max);
+    if (!exact) {
+        min = INT64_MIN;
+        max = INT64_MAX;
+    }
+    value.min = min;
+    value.max = max;
+    return value;
+}
+
+// A 64-bit ALU operation on scalars. Signed division and modulo (offset 1) are not tracked.
+static struct range_value
+scalar_alu(uint8_t op, int16_t offset, struct range_value a, struct range_value b, int shift_mask)
+{
+    switch (op) {
+    case EBPF_ALU_OP_ADD:
+    case EBPF_ALU_OP_SUB:
+        return offset_by(a, b, op == EBPF_ALU_OP_SUB);
+    case EBPF_ALU_OP_MUL:
+        if (a.min >= 0 && b.min >= 0 && (a.max == 0 || b.max <= INT64_MAX / a.max)) {
+            return scalar(a.min * b.min, a.max * b.max);
+        }
+        return unknown();
+    case EBPF_ALU_OP_DIV:
+        // Division by 0 yields 0.
+        if (offset != 0 || a.min < 0 || b.min < 0) {
+            return unknown();
+        }
+        if (b.min > 0) {
+            return scalar(a.min / b.max, a.max / b.min);
+        }
+        return scalar(0, a.max);
+    case EBPF_ALU_OP_MOD:
+        // Modulo by 0 leaves the dividend as it is.
+        if (offset != 0 || b.min < 0) {
+            return unknown();
+        }
+        if (b.min > 0) {
+            return a.min >= 0 && a.max < b.max ? scalar(0, a.max) : scalar(0, b.max - 1);
+        }
+        return a.min >= 0 ? scalar(0, a.max > b.max ? a.max : b.max) : unknown();
+    case EBPF_ALU_OP_AND:
+        if (is_constant(a) && is_constant(b)) {
+            return scalar(a.min & b.min, a.min & b.min);
+        }
+        if (a.min >= 0 || b.min >= 0) {
+            int64_t max = a.min >= 0 ? a.max : b.max;
+            if (a.min >= 0 && b.min >= 0 && b.max < max) {
+                max = b.max;
+            }
+            return scalar(0, max);
+        }
+        return unknown();
+    case EBPF_ALU_OP_OR:
+    case EBPF_ALU_OP_XOR:
+        if (is_constant(a) && is_constant(b)) {
+            int64_t value = op == EBPF_ALU_OP_OR ? a.min | b.min : a.min ^ b.min;
+            return scalar(value, value);
+        }
+        if (a.min >= 0 && b.min >= 0) {
+            return scalar(0, low_bits(a.max > b.max ? a.max : b.max));
+        }
+        return unknown();
+    case EBPF_ALU_OP_LSH:
+        if (is_constant(b) && a.min >= 0) {
+            int shift = (int)(b.min & shift_mask);
+            if (a.max <= (INT64_MAX >> shift)) {
+                return scalar(a.min << shift, a.max << shift);
+            }
+        }
+        return unknown();
+    case EBPF_ALU_OP_RSH:
+        if (is_constant(b)) {
+            int shift = (int)(b.min & shift_mask);
+            if (a.min >= 0) {
+                return scalar(a.min >> shift, a.max >> shift);
+            }
+            if (shift > 0) {
+                return scalar(0, (int64_t)(UINT64_MAX >> shift));
+            }
+            return a;
+        }
+        return a.min >= 0 ? scalar(0, a.max) : unknown();
+    case EBPF_ALU_OP_ARSH:
+        if (is_constant(b)) {
+            int shift = (int)(b.min & shift_mask);
+            return scalar(a.min >> shift, a.max >> shift);
+        }
+        return a.min >= 0 ? scalar(0, a.max) : unknown();
+    case EBPF_ALU_OP_NEG:
+        if (a.min != INT64_MIN) {
+            return scalar(-a.max, -a.min);
+        }
+        return unknown();
+    default:
+        return unknown();
+    }
+}
+
+// The value of a register (or the immediate) narrowed to its low 32 bits.
+static struct range_value
+low_32_bits(struct range_value value)
+{
+    return within(value, 0, UINT32_MAX) ? value : scalar(0, UINT32_MAX);
+}
+
+static struct range_value
+sign_extended(struct range_value value, int bits)
+{
+    int64_t bound = (int64_t)1 << (bits - 1);
+    return within(value, -bound, bound - 1) ? value : scalar(-bound, bound - 1);
+}
+
+static struct range_value
+alu64(struct ebpf_inst inst, struct range_value a, struct range_value b)
+{
+    uint8_t op = inst.opcode & EBPF_ALU_OP_MASK;
+    switch (op) {
+    case EBPF_ALU_OP_MOV:
+        return inst.offset == 0 ? b : sign_extended(b, inst.offset);
+    case EBPF_ALU_OP_ADD:
+        if (is_pointer(a) && is_pointer(b)) {
+            return unknown();
+        }
+        if (is_pointer(b)) {
+            struct range_value swap = a;
+            a = b;
+            b = swap;
+        }
+        return a.type == RANGE_REGION_OR_NULL ? unknown() : offset_by(a, b, false);
+    case EBPF_ALU_OP_SUB:
+        if (is_pointer(a) && !is_pointer(b) && a.type != RANGE_REGION_OR_NULL) {
+            return offset_by(a, b, true);
+        }
+        if (is_pointer(a) && a.type == b.type && (a.type == RANGE_CONTEXT || a.type == RANGE_STACK)) {
+            // The distance between two pointers into the same object.
+            struct range_value distance = offset_by(a, b, true);
+            distance.type = RANGE_SCALAR;
+            return distance;
+        }
+        return is_pointer(a) || is_pointer(b) ? unknown() : offset_by(a, b, true);
+    default:
+        if (is_pointer(a) || is_pointer(b)) {
+            return unknown();
+        }
+        return scalar_alu(op, inst.offset, a, b, 63);
+    }
+}
+
+// A 32-bit ALU operation: the operands are the low 32 bits of the registers and the
+// result is zero-extended, so anything that may wrap is [0, UINT32_MAX].
+static struct range_value
+alu32(struct ebpf_inst inst, struct range_value a, struct range_value b)
+{
+    uint8_t op = inst.opcode & EBPF_ALU_OP_MASK;
+    a = low_32_bits(a);
+    b = low_32_bits(b);
+    struct range_value result;
+    switch (op) {
+    case EBPF_ALU_OP_MOV:
+        result = inst.offset == 0 ? b : scalar(0, UINT32_MAX);
+        break;
+    case EBPF_ALU_OP_ARSH:
+        // Like a logical shift for values whose sign bit is clear.
+        result = a.max <= INT32_MAX ? scalar_alu(EBPF_ALU_OP_RSH, 0, a, b, 31) : scalar(0, UINT32_MAX);
+        break;
+    default:
+        result = scalar_alu(op, inst.offset, a, b, 31);
+        break;
+    }
+    return low_32_bits(result);
+}
+
+// The tracked stack slot at offset from r10, or -1.
+static int
+slot_index(int64_t offset)
+{
+    if (offset % 8 != 0 || offset < -8 * RANGE_STACK_SLOTS || offset > -8) {
+        return -1;
+    }
+    return (int)((offset + 8 * RANGE_STACK_SLOTS) / 8);
+}
+
+// Forget what the slots that overlap [min, max) at offsets from r10 hold.
+static void
+forget_slots(struct range_state* state, int64_t min, int64_t max)
+{
+    for (int i = 0; i < RANGE_STACK_SLOTS; i++) {
+        int64_t start = -8 * (int64_t)(RANGE_STACK_SLOTS - i);
+        if (start < max && start + 8 > min) {
+            state->slots[i] = unknown();
+        }
+    }
+}
+
+// A store of size bytes at base + offset. value is what an 8-byte store writes, if known.
+static void
+store(struct range_state* state, struct range_value base, int16_t offset, int size, const struct range_value* value)
+{
+    if (value != NULL && value->type == RANGE_STACK && base.type != RANGE_STACK) {
+        state->stack_escaped = true;
+    }
+    switch (base.type) {
+    case RANGE_STACK: {
+        int64_t min, max;
+        if (!checked_add(base.min, offset, &min) || !checked_add(base.max, offset + size, &max)) {
+            forget_slots(state, INT64_MIN, INT64_MAX);
+            return;
+        }
+        int slot = min + size == max && size == 8 ? slot_index(min) : -1;
+        if (slot >= 0 && value != NULL) {
+            state->slots[slot] = *value;
+        } else {
+            forget_slots(state, min, max);
+            if (value != NULL && value->type == RANGE_STACK) {
+                // The pointer is no longer tracked once it is in an untracked slot.
+                state->stack_escaped = true;
+            }
+        }
+        return;
+    }
+    case RANGE_CONTEXT:
+    case RANGE_REGION:
+    case RANGE_REGION_OR_NULL:
+        return;
+    default:
+        // The address may be in the stack.
+        forget_slots(state, INT64_MIN, INT64_MAX);
+        return;
+    }
+}
+
+static struct range_value
+load(const struct range_state* state, struct range_value base, int16_t offset, int size, bool sign_extend)
+{
+    int64_t address;
+    if (base.type == RANGE_STACK && base.min == base.max && size == 8 && checked_add(base.min, offset, &address)) {
+        int slot = slot_index(address);
+        if (slot >= 0) {
+            return state->slots[slot];
+        }
+    }
+    return loaded(size, sign_extend);
+}
+
+static bool
+in_bounds(const struct range_analysis* analysis, struct range_value base, int16_t offset, int size)
+{
+    int64_t lower = 0;
+    int64_t upper;
+    switch (base.type) {
+    case RANGE_CONTEXT:
+        upper = analysis->context_size;
+        break;
+    case RANGE_STACK:
+        lower = -(int64_t)analysis->vm->stack_requirement;
+        upper = 0;
+        break;
+    case RANGE_REGION:
+        upper = base.size;
+        break;
+    default:
+        return false;
+    }
+    int64_t start, end;
+    return checked_add(base.min, offset, &start) && checked_add(base.max, offset + size, &end) && start >= lower &&
+           end <= upper;
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B:
+        return 1;
+    case EBPF_SIZE_H:
+        return 2;
+    case EBPF_SIZE_W:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+static bool
+is_memory_access(struct ebpf_inst inst)
+{
+    uint8_t class = inst.opcode & EBPF_CLS_MASK;
+    return class == EBPF_CLS_LDX || class == EBPF_CLS_ST || class == EBPF_CLS_STX;
+}
+
+static void
+transfer_access(struct range_analysis* analysis, struct range_state* state, uint32_t pc, struct ebpf_inst inst)
+{
+    uint8_t class = inst.opcode & EBPF_CLS_MASK;
+    int size = access_size(inst.opcode);
+    struct range_value base = state->registers[class == EBPF_CLS_LDX ? inst.src : inst.dst];
+
+    if (analysis->record && in_bounds(analysis, base, inst.offset, size)) {
+        analysis->vm->proven_accesses[pc] = true;
+    }
+
+    if (class == EBPF_CLS_LDX) {
+        state->registers[inst.dst] =
+            load(state, base, inst.offset, size, (inst.opcode & 0xe0) == EBPF_MODE_MEMSX);
+    } else if (class == EBPF_CLS_ST) {
+        struct range_value value = scalar(inst.imm, inst.imm);
+        store(state, base, inst.offset, size, &value);
+    } else if ((inst.opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+        state->stack_escaped |= state->registers[inst.src].type == RANGE_STACK;
+        store(state, base, inst.offset, size, NULL);
+        if (inst.imm == EBPF_ATOMIC_OP_CMPXCHG) {
+            state->registers[BPF_REG_0] = loaded(size, false);
+        } else if (inst.imm & EBPF_ATOMIC_OP_FETCH) {
+            state->registers[inst.src] = loaded(size, false);
+        }
+    } else {
+        store(state, base, inst.offset, size, &state->registers[inst.src]);
+    }
+}
+
+static void
+transfer_call(struct range_analysis* analysis, struct range_state* state, struct ebpf_inst inst)
+{
+    bool stack_argument = false;
+    for (int r = BPF_REG_1; r <= BPF_REG_5; r++) {
+        stack_argument |= state->registers[r].type == RANGE_STACK;
+        state->registers[r] = unknown();
+    }
+    state->registers[BPF_REG_0] = unknown();
+
+    if (inst.src == 1) {
+        // A local function is not analyzed: it may write anywhere in the stack.
+        forget_slots(state, INT64_MIN, INT64_MAX);
+        return;
+    }
+    state->stack_escaped |= stack_argument;
+    if (state->stack_escaped) {
+        forget_slots(state, INT64_MIN, INT64_MAX);
+    }
+    if (inst.imm >= 0 && inst.imm < MAX_EXT_FUNCS) {
+        const struct ubpf_safe_helper_metadata* helper = &analysis->vm->safe_helpers[inst.imm];
+        if (helper->in_use && helper->result_kind == UBPF_SAFE_HELPER_RESULT_POINTER) {
+            int64_t size = helper->region_size < RANGE_MAX_SIZE ? (int64_t)helper->region_size : RANGE_MAX_SIZE;
+            struct range_value region = {RANGE_REGION_OR_NULL, 0, 0, size};
+            state->registers[BPF_REG_0] = region;
+        }
+    }
+}
+
+enum range_relation
+{
+    RELATION_NONE,
+    RELATION_EQ,
+    RELATION_NE,
+    RELATION_GT,
+    RELATION_GE,
+    RELATION_LT,
+    RELATION_LE,
+};
+
+// Narrow a and b to the values for which a relation b holds (as signed values).
+// Returns false if there are none.
+static bool
+narrow(enum range_relation relation, struct range_value* a, struct range_value* b)
+{
+    switch (relation) {
+    case RELATION_EQ:
+        a->min = b->min = a->min > b->min ? a->min : b->min;
+        a->max = b->max = a->max < b->max ? a->max : b->max;
+        break;
+    case RELATION_NE:
+        // Only a constant can be excluded from the other side, if it is at one of its ends.
+        if (is_constant(*a) && !is_constant(*b)) {
+            return narrow(relation, b, a);
+        }
+        if (is_constant(*b)) {
+            if (is_constant(*a) && a->min == b->min) {
+                return false;
+            }
+            if (a->min == b->min) {
+                a->min++;
+            } else if (a->max == b->min) {
+                a->max--;
+            }
+        }
+        break;
+    case RELATION_GT:
+    case RELATION_GE: {
+        int64_t strict = relation == RELATION_GT;
+        if ((strict && (b->min == INT64_MAX || a->max == INT64_MIN))) {
+            return false;
+        }
+        if (b->min + strict > a->min) {
+            a->min = b->min + strict;
+        }
+        if (a->max - strict < b->max) {
+            b->max = a->max - strict;
+        }
+        break;
+    }
+    case RELATION_LT:
+        return narrow(RELATION_GT, b, a);
+    case RELATION_LE:
+        return narrow(RELATION_GE, b, a);
+    default:
+        break;
+    }
+    return a->min <= a->max && b->min <= b->max;
+}
+
+// Narrow as for an unsigned comparison. Where a value may be negative (huge, unsigned),
+// only the side that must be below a non-negative value is narrowed.
+static bool
+narrow_unsigned(enum range_relation relation, struct range_value* a, struct range_value* b)
+{
+    if (relation == RELATION_EQ || relation == RELATION_NE || (a->min >= 0 && b->min >= 0)) {
+        return narrow(relation, a, b);
+    }
+    if (relation == RELATION_GT || relation == RELATION_GE) {
+        return narrow_unsigned(relation == RELATION_GT ? RELATION_LT : RELATION_LE, b, a);
+    }
+    // a < b or a <= b (unsigned) with b >= 0: a is in [0, b.max], so not negative (huge).
+    if (b->min >= 0) {
+        if (a->max < 0) {
+            return false;
+        }
+        int64_t max = relation == RELATION_LT ? b->max - 1 : b->max;
+        if (a->min < 0) {
+            a->min = 0;
+        }
+        if (a->max > max) {
+            a->max = max;
+        }
+    }
+    return a->min <= a->max;
+}
+
+static enum range_relation
+negated(enum range_relation relation)
+{
+    switch (relation) {
+    case RELATION_EQ:
+        return RELATION_NE;
+    case RELATION_NE:
+        return RELATION_EQ;
+    case RELATION_GT:
+        return RELATION_LE;
+    case RELATION_GE:
+        return RELATION_LT;
+    case RELATION_LT:
+        return RELATION_GE;
+    case RELATION_LE:
+        return RELATION_GT;
+    default:
+        return RELATION_NONE;
+    }
+}
+
+/*
+ * Narrow the state to the edge of the conditional jump inst that is taken (or not).
+ * Returns false if that edge cannot be taken.
+ */
+static bool
+narrow_branch(struct range_state* state, struct ebpf_inst inst, bool taken)
+{
+    uint8_t op = inst.opcode & EBPF_JMP_OP_MASK;
+    bool is32 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32;
+    bool use_reg = (inst.opcode & EBPF_SRC_REG) != 0;
+    bool is_signed = op == EBPF_MODE_JSGT || op == EBPF_MODE_JSGE || op == EBPF_MODE_JSLT || op == EBPF_MODE_JSLE;
+    struct range_value* a = &state->registers[inst.dst];
+    struct range_value* b_register = use_reg ? &state->registers[inst.src] : NULL;
+    if (use_reg && inst.src == inst.dst) {
+        return true;
+    }
+
+    enum range_relation relation;
+    switch (op) {
+    case EBPF_MODE_JEQ:
+        relation = RELATION_EQ;
+        break;
+    case EBPF_MODE_JNE:
+        relation = RELATION_NE;
+        break;
+    case EBPF_MODE_JGT:
+    case EBPF_MODE_JSGT:
+        relation = RELATION_GT;
+        break;
+    case EBPF_MODE_JGE:
+    case EBPF_MODE_JSGE:
+        relation = RELATION_GE;
+        break;
+    case EBPF_MODE_JLT:
+    case EBPF_MODE_JSLT:
+        relation = RELATION_LT;
+        break;
+    case EBPF_MODE_JLE:
+    case EBPF_MODE_JSLE:
+        relation = RELATION_LE;
+        break;
+    default:
+        return true;
+    }
+    if (!taken) {
+        relation = negated(relation);
+    }
+
+    // A region pointer is not NULL once it is known to differ from 0.
+    if (a->type == RANGE_REGION_OR_NULL && !use_reg && !is32 && inst.imm == 0 &&
+        (relation == RELATION_EQ || relation == RELATION_NE)) {
+        if (relation == RELATION_EQ) {
+            *a = scalar(0, 0);
+        } else {
+            a->type = RANGE_REGION;
+        }
+        return true;
+    }
+
+    struct range_value b = use_reg ? *b_register : scalar(inst.imm, inst.imm);
+    if (is_pointer(*a) || is_pointer(b)) {
+        return true;
+    }
+    if (is32) {
+        // The low 32 bits compare like the registers if both are in the same range
+        // of 32-bit values.
+        bool as_unsigned = !is_signed;
+        if (!use_reg) {
+            b = as_unsigned || (relation == RELATION_EQ || relation == RELATION_NE)
+                    ? scalar((uint32_t)inst.imm, (uint32_t)inst.imm)
+                    : scalar(inst.imm, inst.imm);
+        }
+        if (as_unsigned && !(within(*a, 0, UINT32_MAX) && within(b, 0, UINT32_MAX))) {
+            if (relation != RELATION_EQ && relation != RELATION_NE) {
+                return true;
+            }
+            as_unsigned = false;
+            if (!use_reg) {
+                b = scalar(inst.imm, inst.imm);
+            }
+        }
+        if (!as_unsigned && !(within(*a, INT32_MIN, INT32_MAX) && within(b, INT32_MIN, INT32_MAX))) {
+            return true;
+        }
+    }
+
+    bool feasible = is_signed ? narrow(relation, a, &b) : narrow_unsigned(relation, a, &b);
+    if (b_register != NULL && feasible) {
+        *b_register = b;
+    }
+    return feasible;
+}
+
+static bool
+join_value(struct range_value* old, const struct range_value* value, bool widen)
+{
+    if (old->type != value->type || old->size != value->size) {
+        if (old->type == RANGE_SCALAR && old->min == INT64_MIN && old->max == INT64_MAX) {
+            return false;
+        }
+        *old = unknown();
+        return true;
+    }
+    bool changed = false;
+    if (value->min < old->min) {
+        old->min = widen ? INT64_MIN : value->min;
+        changed = true;
+    }
+    if (value->max > old->max) {
+        old->max = widen ? INT64_MAX : value->max;
+        changed = true;
+    }
+    return changed;
+}
+
+static bool
+join_state(struct range_state* old, const struct range_state* state, bool widen)
+{
+    bool changed = false;
+    for (int r = 0; r < _BPF_REG_MAX; r++) {
+        changed |= join_value(&old->registers[r], &state->registers[r], widen);
+    }
+    for (int i = 0; i < RANGE_STACK_SLOTS; i++) {
+        changed |= join_value(&old->slots[i], &state->slots[i], widen);
+    }
+    if (state->stack_escaped && !old->stack_escaped) {
+        old->stack_escaped = true;
+        changed = true;
+    }
+    return changed;
+}
+
+// Merge the state into that at the start of the basic block at pc.
+static bool
+merge(struct range_analysis* analysis, uint32_t pc, const struct range_state* state)
+{
+    if (analysis->record || pc >= analysis->end) {
+        return true;
+    }
+    if (analysis->next != NULL) {
+        if (analysis->next[pc] == NULL) {
+            analysis->next[pc] = malloc(sizeof(struct range_state));
+            if (analysis->next[pc] == NULL) {
+                return false;
+            }
+            *analysis->next[pc] = *state;
+        } else {
+            join_state(analysis->next[pc], state, false);
+        }
+        return true;
+    }
+    bool changed;
+    if (analysis->states[pc] == NULL) {
+        analysis->states[pc] = malloc(sizeof(struct range_state));
+        if (analysis->states[pc] == NULL) {
+            return false;
+        }
+        *analysis->states[pc] = *state;
+        changed = true;
+    } else {
+        changed = join_state(analysis->states[pc], state, ++analysis->updates[pc] > RANGE_WIDEN_AFTER);
+    }
+    if (changed && !analysis->queued[pc]) {
+        analysis->queued[pc] = true;
+        analysis->worklist[analysis->worklist_size++] = pc;
+    }
+    return true;
+}
+
+// Interpret the basic block at pc from the state at its start. Returns false if out of memory.
+static bool
+walk_block(struct range_analysis* analysis, uint32_t pc)
+{
+    struct ubpf_vm* vm = analysis->vm;
+    struct range_state state = *analysis->states[pc];
+
+    for (;;) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        uint8_t class = inst.opcode & EBPF_CLS_MASK;
+        struct range_value* dst = &state.registers[inst.dst];
+        struct range_value source =
+            (inst.opcode & EBPF_SRC_REG) ? state.registers[inst.src] : scalar(inst.imm, inst.imm);
+
+        switch (class) {
+        case EBPF_CLS_ALU64:
+        case EBPF_CLS_ALU:
+            if ((inst.opcode & EBPF_ALU_OP_MASK) == EBPF_ALU_OP_END) {
+                // A byte swap (or conversion) of imm bits, zero-extended.
+                *dst = inst.imm < 64 ? scalar(0, ((int64_t)1 << inst.imm) - 1) : unknown();
+            } else if (class == EBPF_CLS_ALU64) {
+                *dst = alu64(inst, *dst, source);
+            } else {
+                if (!(inst.opcode & EBPF_SRC_REG)) {
+                    source = scalar((uint32_t)inst.imm, (uint32_t)inst.imm);
+                }
+                *dst = alu32(inst, *dst, source);
+            }
+            break;
+        case EBPF_CLS_LD: {
+            struct ebpf_inst next = ubpf_fetch_instruction(vm, pc + 1);
+            int64_t value = (int64_t)((uint32_t)inst.imm | ((uint64_t)(uint32_t)next.imm << 32));
+            *dst = inst.src == 0 ? scalar(value, value) : unknown();
+            pc++;
+            break;
+        }
+        case EBPF_CLS_LDX:
+        case EBPF_CLS_ST:
+        case EBPF_CLS_STX:
+            transfer_access(analysis, &state, pc, inst);
+            break;
+        default: {
+            uint8_t op = inst.opcode & EBPF_JMP_OP_MASK;
+            if (op == EBPF_MODE_EXIT) {
+                return true;
+            }
+            if (op == EBPF_MODE_CALL) {
+                transfer_call(analysis, &state, inst);
+                break;
+            }
+            if (op == EBPF_MODE_JA) {
+                return merge(analysis, pc + 1 + (class == EBPF_CLS_JMP32 ? inst.imm : inst.offset), &state);
+            }
+            struct range_state taken = state;
+            if (narrow_branch(&taken, inst, true) && !merge(analysis, pc + 1 + inst.offset, &taken)) {
+                return false;
+            }
+            if (!narrow_branch(&state, inst, false)) {
+                return true;
+            }
+            return merge(analysis, pc + 1, &state);
+        }
+        }
+
+        pc++;
+        if (pc >= analysis->end) {
+            return true;
+        }
+        if (analysis->is_leader[pc]) {
+            return merge(analysis, pc, &state);
+        }
+    }
+}
+
+static void
+find_leaders(struct range_analysis* analysis)
+{
+    analysis->is_leader[0] = true;
+    for (uint32_t pc = 0; pc < analysis->end; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(analysis->vm, pc);
+        uint8_t class = inst.opcode & EBPF_CLS_MASK;
+        uint8_t op = inst.opcode & EBPF_JMP_OP_MASK;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+            continue;
+        }
+        if ((class != EBPF_CLS_JMP && class != EBPF_CLS_JMP32) || op == EBPF_MODE_CALL) {
+            continue;
+        }
+        if (op != EBPF_MODE_EXIT) {
+            int32_t target = (int32_t)pc + 1 + (class == EBPF_CLS_JMP32 && op == EBPF_MODE_JA ? inst.imm : inst.offset);
+            if (target >= 0 && (uint32_t)target < analysis->end) {
+                analysis->is_leader[target] = true;
+            }
+        }
+        if (pc + 1 < analysis->end) {
+            analysis->is_leader[pc + 1] = true;
+        }
+    }
+}
+
+static void
+initial_state(struct range_state* state)
+{
+    memset(state, 0, sizeof(*state));
+    for (int r = 0; r < _BPF_REG_MAX; r++) {
+        state->registers[r] = unknown();
+    }
+    for (int i = 0; i < RANGE_STACK_SLOTS; i++) {
+        state->slots[i] = unknown();
+    }
+    struct range_value context = {RANGE_CONTEXT, 0, 0, 0};
+    struct range_value stack = {RANGE_STACK, 0, 0, 0};
+    state->registers[BPF_REG_1] = context;
+    state->registers[BPF_REG_10] = stack;
+}
+
+static void
+free_states(const struct range_analysis* analysis, struct range_state** states)
+{
+    if (states != NULL) {
+        for (uint32_t pc = 0; pc < analysis->end; pc++) {
+            free(states[pc]);
+        }
+    }
+    free(states);
+}
+
+/*
+ * Recompute the state at the start of every block that from reaches from the states at
+ * the end of its predecessors, without widening. Returns NULL if out of memory.
+ */
+static struct range_state**
+recompute_states(struct range_analysis* analysis, struct range_state** from)
+{
+    struct range_state** to = calloc(analysis->end, sizeof(struct range_state*));
+    if (to == NULL) {
+        return NULL;
+    }
+    struct range_state** states = analysis->states;
+    analysis->states = from;
+    analysis->next = to;
+    struct range_state entry;
+    initial_state(&entry);
+    bool succeeded = merge(analysis, 0, &entry);
+    for (uint32_t pc = 0; succeeded && pc < analysis->end; pc++) {
+        if (from[pc] != NULL) {
+            succeeded = walk_block(analysis, pc);
+        }
+    }
+    analysis->states = states;
+    analysis->next = NULL;
+    if (!succeeded) {
+        free_states(analysis, to);
+        return NULL;
+    }
+    return to;
+}
+
+// Whether every state in inner is included in the one for the same block in outer.
+static bool
+includes(const struct range_analysis* analysis, struct range_state** outer, struct range_state** inner)
+{
+    for (uint32_t pc = 0; pc < analysis->end; pc++) {
+        if (inner[pc] == NULL) {
+            continue;
+        }
+        if (outer[pc] == NULL) {
+            return false;
+        }
+        struct range_state joined = *outer[pc];
+        if (join_state(&joined, inner[pc], false)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Narrow the states after widening. The states are only replaced by recomputed ones
+ * once those are known to hold whenever a block is entered, i.e., once recomputing them
+ * again gives states that they include. Returns false if out of memory.
+ */
+static bool
+narrow_states(struct range_analysis* analysis)
+{
+    struct range_state** candidate = recompute_states(analysis, analysis->states);
+    if (candidate == NULL) {
+        return false;
+    }
+    for (int pass = 0; pass < RANGE_NARROW_PASSES; pass++) {
+        struct range_state** next = recompute_states(analysis, candidate);
+        if (next == NULL) {
+            free_states(analysis, candidate);
+            return false;
+        }
+        if (!includes(analysis, candidate, next)) {
+            free_states(analysis, next);
+            break;
+        }
+        free_states(analysis, analysis->states);
+        analysis->states = candidate;
+        candidate = next;
+    }
+    free_states(analysis, candidate);
+    return true;
+}
+
+bool
+ubpf_verify_ranges(struct ubpf_vm* vm, char** errmsg)
+{
+    struct range_analysis analysis = {0};
+    analysis.vm = vm;
+    analysis.end = vm->num_insts;
+    for (uint32_t pc = 1; pc < vm->num_insts; pc++) {
+        if (vm->int_funcs[pc]) {
+            analysis.end = pc;
+            break;
+        }
+    }
+    analysis.context_size =
+        vm->minimum_context_size < (size_t)RANGE_MAX_SIZE ? (int64_t)vm->minimum_context_size : RANGE_MAX_SIZE;
+
+    bool succeeded = false;
+    vm->proven_accesses = calloc(vm->num_insts, sizeof(bool));
+    analysis.is_leader = calloc(analysis.end, sizeof(bool));
+    analysis.states = calloc(analysis.end, sizeof(struct range_state*));
+    analysis.updates = calloc(analysis.end, sizeof(uint32_t));
+    analysis.worklist = calloc(analysis.end, sizeof(uint32_t));
+    analysis.queued = calloc(analysis.end, sizeof(bool));
+    if (!vm->proven_accesses || !analysis.is_leader || !analysis.states || !analysis.updates || !analysis.worklist ||
+        !analysis.queued) {
+        goto out;
+    }
+
+    find_leaders(&analysis);
+    struct range_state entry;
+    initial_state(&entry);
+    if (!merge(&analysis, 0, &entry)) {
+        goto out;
+    }
+    while (analysis.worklist_size > 0) {
+        uint32_t pc = analysis.worklist[--analysis.worklist_size];
+        analysis.queued[pc] = false;
+        if (!walk_block(&analysis, pc)) {
+            goto out;
+        }
+    }
+
+    if (!narrow_states(&analysis)) {
+        goto out;
+    }
+
+    // Every block now starts with a state that holds whenever it is entered.
+    analysis.record = true;
+    for (uint32_t pc = 0; pc < analysis.end; pc++) {
+        if (analysis.states[pc] != NULL) {
+            walk_block(&analysis, pc);
+        }
+    }
+
+    vm->memory_accesses = 0;
+    vm->proven_memory_accesses = 0;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        } else if (is_memory_access(inst)) {
+            vm->memory_accesses++;
+            vm->proven_memory_accesses += vm->proven_accesses[pc];
+        }
+    }
+    succeeded = true;
+
+out:
+    free_states(&analysis, analysis.states);
+    free(analysis.is_leader);
+    free(analysis.updates);
+    free(analysis.worklist);
+    free(analysis.queued);
+    if (!succeeded) {
+        free(vm->proven_accesses);
+        vm->proven_accesses = NULL;
+        *errmsg = ubpf_error("out of memory");
+    }
+    return succeeded;
+}
+
+bool
+ubpf_check_context_size(const struct ubpf_vm* vm, const void* mem, size_t mem_len, size_t stack_len)
+{
+    if (vm->proven_accesses == NULL || !vm->bounds_check_enabled) {
+        return true;
+    }
+    if ((mem != NULL || vm->minimum_context_size == 0) && mem_len >= vm->minimum_context_size &&
+        stack_len >= vm->stack_requirement) {
+        return true;
+    }
+    ubpf_jit_report_stop(vm->jit_data, UBPF_JIT_STOP_CONTEXT_SIZE, vm->minimum_context_size, vm->stack_requirement);
+    return false;
+}
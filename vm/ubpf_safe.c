@@ -221,24 +221,26 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
         break;
     case EBPF_CLS_LDX:
         if (!source_register_valid_before_instruction) {
-            vm->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
+            vm->jit_data->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
             return false;
         }
         destination_register_valid_after_instruction = true;
         break;
     case EBPF_CLS_ST:
         if (inst.dst != BPF_REG_10 && !destination_register_valid_before_instruction) {
-            vm->error_printf(stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
+            vm->jit_data->error_printf(
+                stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
             return false;
         }
         break;
     case EBPF_CLS_STX:
         if (inst.dst != BPF_REG_10 && !source_register_valid_before_instruction) {
-            vm->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
+            vm->jit_data->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
             return false;
         }
         if (inst.dst != BPF_REG_10 && !destination_register_valid_before_instruction) {
-            vm->error_printf(stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
+            vm->jit_data->error_printf(
+                stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
             return false;
         }
         break;
@@ -267,7 +269,7 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
         case 0xd0:
             break;
         default:
-            vm->error_printf(stderr, "Error: %d: Unknown ALU opcode %x.\n", pc, inst.opcode);
+            vm->jit_data->error_printf(stderr, "Error: %d: Unknown ALU opcode %x.\n", pc, inst.opcode);
             return false;
         }
         break;
@@ -293,21 +295,23 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
                 break;
             }
             if (!destination_register_valid_before_instruction) {
-                vm->error_printf(stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
+                vm->jit_data->error_printf(
+                    stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
                 return false;
             }
             if (inst.opcode & EBPF_SRC_REG && !source_register_valid_before_instruction) {
-                vm->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
+                vm->jit_data->error_printf(
+                    stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
                 return false;
             }
             break;
         default:
-            vm->error_printf(stderr, "Error: %d: Unknown JMP opcode %x.\n", pc, inst.opcode);
+            vm->jit_data->error_printf(stderr, "Error: %d: Unknown JMP opcode %x.\n", pc, inst.opcode);
             return false;
         }
         break;
     default:
-        vm->error_printf(stderr, "Error: %d: Unknown opcode %x.\n", pc, inst.opcode);
+        vm->jit_data->error_printf(stderr, "Error: %d: Unknown opcode %x.\n", pc, inst.opcode);
         return false;
     }
 
@@ -326,7 +330,7 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
 
     if (inst.opcode == EBPF_OP_EXIT) {
         if (!(*shadow_registers & REGISTER_TO_SHADOW_MASK(0))) {
-            vm->error_printf(stderr, "Error: %d: Return value register r0 is not initialized.\n", pc);
+            vm->jit_data->error_printf(stderr, "Error: %d: Return value register r0 is not initialized.\n", pc);
             return false;
         }
         *shadow_registers &=
@@ -404,43 +408,47 @@ ubpf_safe_compute_access(
     uint64_t offset_u64;
 
     if (tag->kind != UBPF_SAFE_VALUE_POINTER) {
-        vm->error_printf(stderr, "uBPF safe mode error: %s requires a pointer at PC %u\n", access_type, cur_pc);
+        vm->jit_data->error_printf(
+            stderr, "uBPF safe mode error: %s requires a pointer at PC %u\n", access_type, cur_pc);
         return false;
     }
 
     if ((tag->permissions & required_permissions) != required_permissions) {
-        vm->error_printf(stderr, "uBPF safe mode error: %s is not permitted at PC %u\n", access_type, cur_pc);
+        vm->jit_data->error_printf(stderr, "uBPF safe mode error: %s is not permitted at PC %u\n", access_type, cur_pc);
         return false;
     }
 
     if (offset >= 0) {
         if (current_address > UINT64_MAX - (uint64_t)offset) {
-            vm->error_printf(stderr, "uBPF safe mode error: address overflow in %s at PC %u\n", access_type, cur_pc);
+            vm->jit_data->error_printf(
+                stderr, "uBPF safe mode error: address overflow in %s at PC %u\n", access_type, cur_pc);
             return false;
         }
         *effective_address = current_address + (uint64_t)offset;
     } else {
         offset_u64 = (uint64_t)(-(int64_t)offset);
         if (current_address < offset_u64) {
-            vm->error_printf(stderr, "uBPF safe mode error: address underflow in %s at PC %u\n", access_type, cur_pc);
+            vm->jit_data->error_printf(
+                stderr, "uBPF safe mode error: address underflow in %s at PC %u\n", access_type, cur_pc);
             return false;
         }
         *effective_address = current_address - offset_u64;
     }
 
     if (tag->base > UINT64_MAX - tag->size) {
-        vm->error_printf(stderr, "uBPF safe mode error: invalid region metadata in %s at PC %u\n", access_type, cur_pc);
+        vm->jit_data->error_printf(
+            stderr, "uBPF safe mode error: invalid region metadata in %s at PC %u\n", access_type, cur_pc);
         return false;
     }
 
     region_end = tag->base + tag->size;
     if (*effective_address < tag->base || *effective_address > region_end) {
-        vm->error_printf(stderr, "uBPF safe mode error: %s is out of bounds at PC %u\n", access_type, cur_pc);
+        vm->jit_data->error_printf(stderr, "uBPF safe mode error: %s is out of bounds at PC %u\n", access_type, cur_pc);
         return false;
     }
 
     if (access_size > tag->size || *effective_address > region_end - access_size) {
-        vm->error_printf(stderr, "uBPF safe mode error: %s overruns region at PC %u\n", access_type, cur_pc);
+        vm->jit_data->error_printf(stderr, "uBPF safe mode error: %s overruns region at PC %u\n", access_type, cur_pc);
         return false;
     }
 
@@ -475,7 +483,8 @@ ubpf_safe_apply_pointer_offset(
     struct ubpf_safe_tag* result_tag)
 {
     if (pointer_tag->base > UINT64_MAX - pointer_tag->size) {
-        vm->error_printf(stderr, "uBPF safe mode error: invalid region metadata in pointer arithmetic at PC %u\n", cur_pc);
+        vm->jit_data->error_printf(
+            stderr, "uBPF safe mode error: invalid region metadata in pointer arithmetic at PC %u\n", cur_pc);
         return false;
     }
 
@@ -489,7 +498,8 @@ ubpf_safe_apply_pointer_offset(
     }
 
     if (result < lower_bound || result > upper_bound) {
-        vm->error_printf(stderr, "uBPF safe mode error: pointer arithmetic escaped its region at PC %u\n", cur_pc);
+        vm->jit_data->error_printf(
+            stderr, "uBPF safe mode error: pointer arithmetic escaped its region at PC %u\n", cur_pc);
         return false;
     }
 
@@ -520,7 +530,8 @@ ubpf_safe_apply_alu(
     case EBPF_ALU_OP_MOV:
         if (is_reg) {
             if (inst.offset != 0 && src_before.kind != UBPF_SAFE_VALUE_SCALAR) {
-                vm->error_printf(stderr, "uBPF safe mode error: sign-ext move requires a scalar source at PC %u\n", cur_pc);
+                vm->jit_data->error_printf(
+                    stderr, "uBPF safe mode error: sign-ext move requires a scalar source at PC %u\n", cur_pc);
                 return false;
             }
             *dst_after = inst.offset == 0 ? src_before : ubpf_safe_scalar_tag();
@@ -534,7 +545,7 @@ ubpf_safe_apply_alu(
                 return ubpf_safe_apply_pointer_offset(vm, &dst_before, result, cur_pc, dst_after);
             }
             if (dst_before.kind != UBPF_SAFE_VALUE_SCALAR) {
-                vm->error_printf(stderr, "uBPF safe mode error: invalid add operand at PC %u\n", cur_pc);
+                vm->jit_data->error_printf(stderr, "uBPF safe mode error: invalid add operand at PC %u\n", cur_pc);
                 return false;
             }
             *dst_after = ubpf_safe_scalar_tag();
@@ -550,7 +561,7 @@ ubpf_safe_apply_alu(
             *dst_after = ubpf_safe_scalar_tag();
             return true;
         }
-        vm->error_printf(stderr, "uBPF safe mode error: invalid add operand at PC %u\n", cur_pc);
+        vm->jit_data->error_printf(stderr, "uBPF safe mode error: invalid add operand at PC %u\n", cur_pc);
         return false;
     case EBPF_ALU_OP_SUB:
         if (!is_reg) {
@@ -558,7 +569,7 @@ ubpf_safe_apply_alu(
                 return ubpf_safe_apply_pointer_offset(vm, &dst_before, result, cur_pc, dst_after);
             }
             if (dst_before.kind != UBPF_SAFE_VALUE_SCALAR) {
-                vm->error_printf(stderr, "uBPF safe mode error: invalid sub operand at PC %u\n", cur_pc);
+                vm->jit_data->error_printf(stderr, "uBPF safe mode error: invalid sub operand at PC %u\n", cur_pc);
                 return false;
             }
             *dst_after = ubpf_safe_scalar_tag();
@@ -576,7 +587,7 @@ ubpf_safe_apply_alu(
             *dst_after = ubpf_safe_scalar_tag();
             return true;
         }
-        vm->error_printf(stderr, "uBPF safe mode error: invalid sub operand at PC %u\n", cur_pc);
+        vm->jit_data->error_printf(stderr, "uBPF safe mode error: invalid sub operand at PC %u\n", cur_pc);
         return false;
     case EBPF_ALU_OP_NEG:
     case EBPF_ALU_OP_MUL:
@@ -590,7 +601,8 @@ ubpf_safe_apply_alu(
     case EBPF_ALU_OP_ARSH:
     case EBPF_ALU_OP_END:
         if (dst_before.kind != UBPF_SAFE_VALUE_SCALAR || (is_reg && src_before.kind != UBPF_SAFE_VALUE_SCALAR)) {
-            vm->error_printf(stderr, "uBPF safe mode error: ALU operation requires scalar operands at PC %u\n", cur_pc);
+            vm->jit_data->error_printf(
+                stderr, "uBPF safe mode error: ALU operation requires scalar operands at PC %u\n", cur_pc);
             return false;
         }
         *dst_after = ubpf_safe_scalar_tag();
@@ -608,7 +620,7 @@ ubpf_set_execution_profile_impl(struct ubpf_vm* vm, enum ubpf_execution_profile
         return -1;
     }
 
-    if (vm->insts != NULL || vm->jitted != NULL || vm->execution_started) {
+    if (vm->insts != NULL || vm->jitted != NULL) {
         return -1;
     }
 
@@ -747,11 +759,11 @@ ubpf_exec_ex_safe(
         return -1;
     }
 
-    ((struct ubpf_vm*)vm)->execution_started = true;
-
     struct ubpf_stack_frame stack_frames[UBPF_MAX_CALL_DEPTH] = {0};
 
-    if (vm->undefined_behavior_check_enabled) {
+    const bool* shadow_tracked = vm->debug_function == NULL ? vm->shadow_tracked : NULL;
+    bool track_shadow = false;
+    if (vm->undefined_behavior_check_enabled && (shadow_tracked == NULL || vm->shadow_tracking_needed)) {
         shadow_stack = calloc(shadow_stack_size == 0 ? 1 : shadow_stack_size, 1);
         if (!shadow_stack) {
             return_value = -1;
@@ -799,6 +811,7 @@ ubpf_exec_ex_safe(
 
     shadow_registers |= REGISTER_TO_SHADOW_MASK(1) | REGISTER_TO_SHADOW_MASK(2) | REGISTER_TO_SHADOW_MASK(10);
 
+    bool count_instructions = ubpf_counts_instructions(vm);
     int instruction_limit = vm->instruction_limit;
 
 #define SAFE_LOAD(size, sign_extend)                                                                          \
@@ -810,7 +823,7 @@ ubpf_exec_ex_safe(
             goto cleanup;                                                                                     \
         }                                                                                                     \
         _ptr = (void*)_eff_addr;                                                                              \
-        if (!ubpf_check_shadow_stack(vm, stack_start, stack_length, shadow_stack, _ptr, size)) {            \
+        if (track_shadow && !ubpf_check_shadow_stack(vm, stack_start, stack_length, shadow_stack, _ptr, size)) { \
             shadow_registers &= ~REGISTER_TO_SHADOW_MASK(inst.dst);                                           \
         }                                                                                                     \
         reg[inst.dst] = sign_extend ? ubpf_mem_load_sx(_eff_addr, size) : ubpf_mem_load(_eff_addr, size);   \
@@ -835,7 +848,9 @@ ubpf_exec_ex_safe(
         }                                                                                                     \
         _ptr = (void*)_eff_addr;                                                                              \
         ubpf_mem_store(_eff_addr, value, size);                                                               \
-        ubpf_mark_shadow_stack(vm, stack_start, stack_length, shadow_stack, _ptr, size);                     \
+        if (track_shadow) {                                                                                   \
+            ubpf_mark_shadow_stack(vm, stack_start, stack_length, shadow_stack, _ptr, size);                 \
+        }                                                                                                     \
         if (ubpf_safe_is_stack_pointer(&safe_tags[inst.dst], stack_start, stack_length)) {                   \
             ubpf_safe_invalidate_stack_spill_tags(safe_spill_slots, stack_start, stack_length, _eff_addr, size); \
             if (preserve_tag && size == 8 && ((_eff_addr - (uint64_t)(uintptr_t)stack_start) % sizeof(uint64_t)) == 0) { \
@@ -857,9 +872,9 @@ ubpf_exec_ex_safe(
             return_value = -1;
             goto cleanup;
         }
-        if (vm->instruction_limit && instruction_limit-- <= 0) {
+        if (count_instructions && instruction_limit-- <= 0) {
             return_value = -1;
-            vm->error_printf(stderr, "Error: Instruction limit exceeded.\n");
+            vm->jit_data->error_printf(stderr, "Error: Instruction limit exceeded.\n");
             goto cleanup;
         }
 
@@ -873,8 +888,9 @@ ubpf_exec_ex_safe(
         safe_apply_alu_tag = ((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU) ||
                              ((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64);
 
-        if (!ubpf_validate_shadow_register(vm, cur_pc, &shadow_registers, inst)) {
-            vm->error_printf(stderr, "Error: Invalid register state at pc %d.\n", cur_pc);
+        track_shadow = vm->undefined_behavior_check_enabled && (shadow_tracked == NULL || shadow_tracked[cur_pc]);
+        if (track_shadow && !ubpf_validate_shadow_register(vm, cur_pc, &shadow_registers, inst)) {
+            vm->jit_data->error_printf(stderr, "Error: Invalid register state at pc %d.\n", cur_pc);
             return_value = -1;
             goto cleanup;
         }
@@ -1437,7 +1453,7 @@ ubpf_exec_ex_safe(
                 const struct ubpf_safe_region_internal* region = NULL;
 
                 if (inst.imm < 0 || inst.imm >= MAX_EXT_FUNCS || !vm->safe_helpers[inst.imm].in_use) {
-                    vm->error_printf(
+                    vm->jit_data->error_printf(
                         stderr, "uBPF safe mode error: helper metadata is missing for helper %d at PC %u\n", inst.imm, cur_pc);
                     return_value = -1;
                     goto cleanup;
@@ -1447,7 +1463,7 @@ ubpf_exec_ex_safe(
                 if (helper->result_kind != UBPF_SAFE_HELPER_RESULT_SCALAR) {
                     region = ubpf_safe_find_region_by_id(vm, helper->region_id);
                     if (region == NULL) {
-                        vm->error_printf(
+                        vm->jit_data->error_printf(
                             stderr,
                             "uBPF safe mode error: helper %d references unknown region %u at PC %u\n",
                             inst.imm,
@@ -1458,8 +1474,9 @@ ubpf_exec_ex_safe(
                     }
                 }
 
-                if (vm->dispatcher != NULL) {
-                    reg[0] = vm->dispatcher(reg[1], reg[2], reg[3], reg[4], reg[5], inst.imm, external_dispatcher_cookie);
+                if (vm->jit_data->dispatcher != NULL) {
+                    reg[0] = vm->jit_data->dispatcher(
+                        reg[1], reg[2], reg[3], reg[4], reg[5], inst.imm, external_dispatcher_cookie);
                 } else {
                     reg[0] = vm->ext_funcs[inst.imm](reg[1], reg[2], reg[3], reg[4], reg[5], external_dispatcher_cookie);
                 }
@@ -1482,7 +1499,7 @@ ubpf_exec_ex_safe(
                 case UBPF_SAFE_HELPER_RESULT_HANDLE: {
                     region = ubpf_safe_find_region_by_id(vm, helper->region_id);
                     if (region == NULL) {
-                        vm->error_printf(
+                        vm->jit_data->error_printf(
                             stderr,
                             "uBPF safe mode error: helper %d references unknown region %u at PC %u\n",
                             inst.imm,
@@ -1493,7 +1510,7 @@ ubpf_exec_ex_safe(
                     }
                     if ((helper->result_kind == UBPF_SAFE_HELPER_RESULT_POINTER && region->kind != UBPF_SAFE_REGION_POINTER) ||
                         (helper->result_kind == UBPF_SAFE_HELPER_RESULT_HANDLE && region->kind != UBPF_SAFE_REGION_HANDLE)) {
-                        vm->error_printf(
+                        vm->jit_data->error_printf(
                             stderr,
                             "uBPF safe mode error: helper %d result kind does not match region %u at PC %u\n",
                             inst.imm,
@@ -1503,7 +1520,7 @@ ubpf_exec_ex_safe(
                         goto cleanup;
                     }
                     if (reg[0] < region->base || reg[0] > region->end || helper->region_size > (region->end - reg[0])) {
-                        vm->error_printf(
+                        vm->jit_data->error_printf(
                             stderr, "uBPF safe mode error: helper %d returned an out-of-range pointer at PC %u\n", inst.imm, cur_pc);
                         return_value = -1;
                         goto cleanup;
@@ -1520,7 +1537,7 @@ ubpf_exec_ex_safe(
                 }
             } else if (inst.src == 1) {
                 if (stack_frame_index >= UBPF_MAX_CALL_DEPTH) {
-                    vm->error_printf(
+                    vm->jit_data->error_printf(
                         stderr,
                         "uBPF error: number of nested functions calls (%u) exceeds max (%u) at PC %u\n",
                         (unsigned)(stack_frame_index + 1),
@@ -1589,7 +1606,7 @@ ubpf_exec_ex_safe(
                 atomic_fetch_index = 0;
                 break;
             default:
-                vm->error_printf(stderr, "Error: unknown atomic opcode %d at PC %d\n", inst.imm, cur_pc);
+                vm->jit_data->error_printf(stderr, "Error: unknown atomic opcode %d at PC %d\n", inst.imm, cur_pc);
                 return_value = -1;
                 goto cleanup;
             }
@@ -1639,7 +1656,7 @@ ubpf_exec_ex_safe(
                 atomic_fetch_index = 0;
                 break;
             default:
-                vm->error_printf(stderr, "Error: unknown atomic opcode %d at PC %d\n", inst.imm, cur_pc);
+                vm->jit_data->error_printf(stderr, "Error: unknown atomic opcode %d at PC %d\n", inst.imm, cur_pc);
                 return_value = -1;
                 goto cleanup;
             }
@@ -1649,7 +1666,7 @@ ubpf_exec_ex_safe(
             }
             break;
         default:
-            vm->error_printf(stderr, "Error: unknown opcode %d at PC %d\n", inst.opcode, cur_pc);
+            vm->jit_data->error_printf(stderr, "Error: unknown opcode %d at PC %d\n", inst.opcode, cur_pc);
             return_value = -1;
             goto cleanup;
         }
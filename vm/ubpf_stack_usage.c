@@ -0,0 +1,296 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Stack usage: the size of the frame of each function, computed from the accesses that
+ * it makes relative to r10, and the largest amount of stack that any chain of local
+ * calls can use.
+ *
+ * A function's frame is the memory below its r10 that it accesses: the caller's r10 is
+ * lowered by the size of the caller's frame for the callee. The analysis follows r10 and
+ * the registers that are copied from it and moved by an immediate in straight-line
+ * code. The frame covers every access through them and, for a pointer that is passed
+ * to a helper, the memory from the pointer up to r10. A function whose stack pointers
+ * live across a jump, are stored to memory, are passed to a local function, are
+ * combined with other registers or reach above r10 keeps the default frame size of
+ * UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "ubpf_int.h"
+
+struct stack_pointers
+{
+    bool is_stack[BPF_REG_10 + 1];
+    int64_t offset[BPF_REG_10 + 1]; // The offset from r10, if is_stack.
+};
+
+static void
+clear_stack_pointers(struct stack_pointers* pointers)
+{
+    for (int reg = BPF_REG_0; reg < BPF_REG_10; reg++) {
+        pointers->is_stack[reg] = false;
+    }
+    pointers->is_stack[BPF_REG_10] = true;
+    pointers->offset[BPF_REG_10] = 0;
+}
+
+// Whether a register other than r10 holds a pointer into the stack.
+static bool
+has_stack_pointers(const struct stack_pointers* pointers)
+{
+    for (int reg = BPF_REG_0; reg < BPF_REG_10; reg++) {
+        if (pointers->is_stack[reg]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B:
+        return 1;
+    case EBPF_SIZE_H:
+        return 2;
+    case EBPF_SIZE_W:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+// Grow the frame to cover size bytes at offset from r10, which must be below r10.
+static bool
+cover(int64_t offset, int64_t size, uint32_t* frame_size)
+{
+    if (offset >= 0 || offset + size > 0 || -offset > UINT16_MAX - 15) {
+        return false;
+    }
+    if ((uint32_t)-offset > *frame_size) {
+        *frame_size = (uint32_t)-offset;
+    }
+    return true;
+}
+
+static bool
+cover_access(const struct stack_pointers* pointers, struct ebpf_inst inst, uint8_t base, uint32_t* frame_size)
+{
+    if (base > BPF_REG_10 || !pointers->is_stack[base]) {
+        return true;
+    }
+    return cover(pointers->offset[base] + inst.offset, access_size(inst.opcode), frame_size);
+}
+
+static void
+set_scalar(struct stack_pointers* pointers, uint8_t reg)
+{
+    if (reg < BPF_REG_10) {
+        pointers->is_stack[reg] = false;
+    }
+}
+
+/*
+ * Compute the frame size of the function [start, end), rounded up to 16 bytes, or
+ * return false if it cannot be determined.
+ */
+static bool
+function_stack_usage(const struct ubpf_vm* vm, const bool* is_jump_target, uint32_t start, uint32_t end, uint16_t* usage)
+{
+    struct stack_pointers pointers;
+    clear_stack_pointers(&pointers);
+    uint32_t frame_size = 0;
+
+    for (uint32_t pc = start; pc < end; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (pc != start && is_jump_target[pc] && has_stack_pointers(&pointers)) {
+            return false;
+        }
+        if (inst.dst > BPF_REG_10 || inst.src > BPF_REG_10) {
+            return false;
+        }
+
+        switch (inst.opcode & EBPF_CLS_MASK) {
+        case EBPF_CLS_ALU:
+        case EBPF_CLS_ALU64:
+            if (inst.dst == BPF_REG_10) {
+                return false;
+            }
+            if ((inst.opcode & EBPF_SRC_REG) && pointers.is_stack[inst.src] && inst.opcode != EBPF_OP_BE) {
+                if (inst.opcode != EBPF_OP_MOV64_REG || inst.offset != 0) {
+                    return false;
+                }
+                pointers.is_stack[inst.dst] = true;
+                pointers.offset[inst.dst] = pointers.offset[inst.src];
+            } else if (pointers.is_stack[inst.dst] && inst.opcode == EBPF_OP_ADD64_IMM) {
+                pointers.offset[inst.dst] += inst.imm;
+            } else if (pointers.is_stack[inst.dst] && inst.opcode == EBPF_OP_SUB64_IMM) {
+                pointers.offset[inst.dst] -= inst.imm;
+            } else if (
+                pointers.is_stack[inst.dst] && (inst.opcode & EBPF_ALU_OP_MASK) != EBPF_ALU_OP_MOV) {
+                return false;
+            } else {
+                set_scalar(&pointers, inst.dst);
+            }
+            break;
+        case EBPF_CLS_LD:
+            if (inst.opcode != EBPF_OP_LDDW || inst.dst == BPF_REG_10) {
+                return false;
+            }
+            set_scalar(&pointers, inst.dst);
+            pc++;
+            break;
+        case EBPF_CLS_LDX:
+            if (inst.dst == BPF_REG_10 || !cover_access(&pointers, inst, inst.src, &frame_size)) {
+                return false;
+            }
+            set_scalar(&pointers, inst.dst);
+            break;
+        case EBPF_CLS_ST:
+            if (!cover_access(&pointers, inst, inst.dst, &frame_size)) {
+                return false;
+            }
+            break;
+        case EBPF_CLS_STX:
+            // A stack pointer that is stored (or exchanged) escapes.
+            if (pointers.is_stack[inst.src] || !cover_access(&pointers, inst, inst.dst, &frame_size)) {
+                return false;
+            }
+            if ((inst.opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+                set_scalar(&pointers, inst.src);
+                set_scalar(&pointers, BPF_REG_0);
+            }
+            break;
+        default:
+            if (inst.opcode == EBPF_OP_CALL) {
+                for (int reg = BPF_REG_1; reg <= BPF_REG_5; reg++) {
+                    // A helper may access the memory from a pointer into the frame up to r10.
+                    if (pointers.is_stack[reg] && (inst.src != 0 || !cover(pointers.offset[reg], 0, &frame_size))) {
+                        return false;
+                    }
+                }
+                for (int reg = BPF_REG_0; reg <= BPF_REG_5; reg++) {
+                    pointers.is_stack[reg] = false;
+                }
+            } else if (has_stack_pointers(&pointers)) {
+                // A jump or an exit.
+                return false;
+            } else if (inst.opcode == EBPF_OP_EXIT) {
+                clear_stack_pointers(&pointers);
+            }
+            break;
+        }
+    }
+
+    *usage = (uint16_t)((frame_size + 15) & ~15u);
+    return true;
+}
+
+/*
+ * The most stack that a chain of at most UBPF_MAX_CALL_DEPTH frames starting with the
+ * main function uses, given the frame size of every function.
+ */
+static size_t
+maximum_stack_depth(const struct ubpf_vm* vm, const uint32_t* function_start)
+{
+    uint32_t num_insts = vm->num_insts;
+    // The most stack used from each function on, with one frame less than in depth.
+    uint64_t* shallower = calloc(num_insts, sizeof(uint64_t));
+    uint64_t* depth = calloc(num_insts, sizeof(uint64_t));
+    size_t maximum = 0;
+    if (shallower != NULL && depth != NULL) {
+        for (int frames = 1; frames <= UBPF_MAX_CALL_DEPTH; frames++) {
+            for (uint32_t pc = 0; pc < num_insts; pc++) {
+                if (pc == 0 || vm->int_funcs[pc]) {
+                    depth[pc] = ubpf_stack_usage_for_local_func(vm, (uint16_t)pc);
+                }
+            }
+            for (uint32_t pc = 0; pc < num_insts; pc++) {
+                struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+                if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+                    uint32_t caller = function_start[pc];
+                    uint64_t callee = shallower[pc + 1 + inst.imm];
+                    uint64_t usage = ubpf_stack_usage_for_local_func(vm, (uint16_t)caller);
+                    if (usage + callee > depth[caller]) {
+                        depth[caller] = usage + callee;
+                    }
+                }
+            }
+            uint64_t* swap = shallower;
+            shallower = depth;
+            depth = swap;
+        }
+        maximum = (size_t)shallower[0];
+    }
+    free(shallower);
+    free(depth);
+    return maximum;
+}
+
+size_t
+ubpf_compute_stack_requirement(struct ubpf_vm* vm)
+{
+    uint32_t num_insts = vm->num_insts;
+    bool* is_jump_target = calloc(num_insts, sizeof(bool));
+    uint32_t* function_start = calloc(num_insts, sizeof(uint32_t));
+    if (is_jump_target == NULL || function_start == NULL) {
+        free(is_jump_target);
+        free(function_start);
+        return UBPF_EBPF_STACK_SIZE;
+    }
+
+    uint32_t start = 0;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (vm->int_funcs[pc]) {
+            start = pc;
+        }
+        function_start[pc] = start;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            function_start[++pc] = start;
+        } else if (
+            (inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32 ||
+             ubpf_instruction_is_conditional_jump(inst))) {
+            int64_t target = (int64_t)pc + 1 + (inst.opcode == EBPF_OP_JA32 ? inst.imm : inst.offset);
+            if (target >= 0 && target < num_insts) {
+                is_jump_target[target] = true;
+            }
+        }
+    }
+
+    // Without a stack usage calculator, the frames that can be sized are.
+    bool all_computed = true;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        if (pc != 0 && !vm->int_funcs[pc]) {
+            continue;
+        }
+        uint32_t end = pc + 1;
+        while (end < num_insts && !vm->int_funcs[end]) {
+            end++;
+        }
+        uint16_t usage;
+        if (vm->local_func_stack_usage[pc].stack_usage_calculated == UBPF_STACK_USAGE_DEFAULT &&
+            function_stack_usage(vm, is_jump_target, pc, end, &usage)) {
+            vm->local_func_stack_usage[pc].stack_usage = usage;
+            vm->local_func_stack_usage[pc].stack_usage_calculated = UBPF_STACK_USAGE_COMPUTED;
+        } else {
+            all_computed = false;
+        }
+    }
+
+    // Frames that are not known to hold all of their function's accesses keep the whole stack.
+    size_t requirement = UBPF_EBPF_STACK_SIZE;
+    if (all_computed) {
+        size_t depth = maximum_stack_depth(vm, function_start);
+        if (depth != 0 && depth < requirement) {
+            requirement = depth;
+        }
+    }
+    free(is_jump_target);
+    free(function_start);
+    return requirement;
+}
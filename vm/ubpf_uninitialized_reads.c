@@ -0,0 +1,716 @@
+// Copyright (c) 2026 uBPF contributors
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Uninitialized reads: a dataflow analysis that proves, at load time, that the undefined
+ * behavior checks of the interpreter (see ubpf_toggle_undefined_behavior_check) pass, so
+ * that it only tracks which registers and stack bytes are initialized where that can
+ * change the outcome of a check.
+ *
+ * The analysis follows the run-time shadow state exactly: the set of registers that are
+ * initialized (as updated by ubpf_validate_shadow_register) and the bytes of the stack
+ * that have been written. It computes, at every instruction, the registers that are
+ * initialized on every path (across local calls, too) and the bytes of the current
+ * frame, up to TRACKED_STACK_SIZE bytes below r10, that have been written through r10 or
+ * a copy of it. A load reads initialized memory if it reads such bytes or if its base
+ * cannot point into the stack and the range verifier proved it in bounds: the analysis
+ * tracks which registers may point into the stack, including through pointers that are
+ * stored to memory, given to helpers or passed to local functions.
+ *
+ * An instruction whose check may fail is not proven. The shadow state is tracked at the
+ * instructions from which one of those can be reached, and nowhere else.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+#define TRACKED_STACK_SIZE 512
+#define REGISTER_MASK(reg) (1 << (reg))
+#define ARGUMENT_REGISTERS \
+    (REGISTER_MASK(1) | REGISTER_MASK(2) | REGISTER_MASK(3) | REGISTER_MASK(4) | REGISTER_MASK(5))
+
+enum pointer_kind
+{
+    KIND_NOT_STACK, // Cannot point into the stack.
+    KIND_STACK,     // Points into the current frame, at offset from r10.
+    KIND_MAYBE_STACK,
+};
+
+struct init_state
+{
+    bool reached;
+    bool escaped;   // A pointer into the stack may have been stored to memory.
+    uint16_t valid; // The registers that are initialized.
+    uint8_t kind[BPF_REG_10 + 1];
+    int64_t offset[BPF_REG_10 + 1];
+    uint64_t stack[TRACKED_STACK_SIZE / 64]; // Bit i: the byte at r10 - TRACKED_STACK_SIZE + i is written.
+};
+
+struct init_analysis
+{
+    const struct ubpf_vm* vm;
+    uint32_t num_insts;
+    bool* is_leader;
+    struct init_state* states;      // At the start of each basic block, once reached.
+    uint32_t* function_of;          // The index of the function that contains each instruction.
+    uint32_t* function_start;       // Indexed by function.
+    struct init_state* exit_states; // After the exits of each function, once reached.
+    uint32_t* call_sites;           // The local calls, grouped by the function they call.
+    uint32_t* call_sites_start;     // Indexed by function (and one more).
+    uint32_t num_functions;
+    uint32_t* worklist;
+    uint32_t worklist_size;
+    bool* queued;
+};
+
+static bool
+is_jump(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32 || ubpf_instruction_is_conditional_jump(inst);
+}
+
+static uint32_t
+jump_target(uint32_t pc, struct ebpf_inst inst)
+{
+    return pc + 1 + (inst.opcode == EBPF_OP_JA32 ? inst.imm : inst.offset);
+}
+
+static uint32_t
+instruction_size(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_LDDW ? 2 : 1;
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B:
+        return 1;
+    case EBPF_SIZE_H:
+        return 2;
+    case EBPF_SIZE_W:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+static bool
+is_valid(const struct init_state* state, uint8_t reg)
+{
+    return reg <= BPF_REG_10 && (state->valid & REGISTER_MASK(reg));
+}
+
+static void
+set_valid(struct init_state* state, uint8_t reg, bool valid)
+{
+    if (valid) {
+        state->valid |= REGISTER_MASK(reg);
+    } else {
+        state->valid &= ~REGISTER_MASK(reg);
+    }
+}
+
+// The kind of a register that may have been loaded from memory.
+static uint8_t
+loaded_kind(const struct init_state* state, uint8_t old_kind)
+{
+    return old_kind == KIND_NOT_STACK && !state->escaped ? KIND_NOT_STACK : KIND_MAYBE_STACK;
+}
+
+/*
+ * The range of tracked stack bits that [base + offset, base + offset + size) covers, if
+ * base points into the current frame and the bytes are within TRACKED_STACK_SIZE below r10.
+ */
+static bool
+tracked_bytes(const struct init_state* state, uint8_t base, int16_t offset, int size, uint32_t* first)
+{
+    if (base > BPF_REG_10 || state->kind[base] != KIND_STACK) {
+        return false;
+    }
+    int64_t start = state->offset[base] + offset;
+    if (start < -TRACKED_STACK_SIZE || start + size > 0) {
+        return false;
+    }
+    *first = (uint32_t)(start + TRACKED_STACK_SIZE);
+    return true;
+}
+
+static void
+mark_written(struct init_state* state, uint8_t base, int16_t offset, int size)
+{
+    uint32_t first;
+    if (tracked_bytes(state, base, offset, size, &first)) {
+        for (uint32_t bit = first; bit < first + (uint32_t)size; bit++) {
+            state->stack[bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+}
+
+/*
+ * Whether a load may read stack bytes that have not been written. A pointer that is not
+ * derived from r10 can still reach the stack by running past the memory it points to,
+ * unless the range verifier proved the access in bounds.
+ */
+static bool
+may_read_uninitialized(const struct init_state* state, uint8_t base, int16_t offset, int size, bool proven)
+{
+    if (base <= BPF_REG_10 && state->kind[base] == KIND_NOT_STACK && proven) {
+        return false;
+    }
+    uint32_t first;
+    if (!tracked_bytes(state, base, offset, size, &first)) {
+        return true;
+    }
+    for (uint32_t bit = first; bit < first + (uint32_t)size; bit++) {
+        if (!(state->stack[bit / 64] & (1ull << (bit % 64)))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+is_binary_alu_operation(uint8_t operation)
+{
+    switch (operation) {
+    case EBPF_ALU_OP_ADD:
+    case EBPF_ALU_OP_SUB:
+    case EBPF_ALU_OP_MUL:
+    case EBPF_ALU_OP_DIV:
+    case EBPF_ALU_OP_OR:
+    case EBPF_ALU_OP_AND:
+    case EBPF_ALU_OP_LSH:
+    case EBPF_ALU_OP_RSH:
+    case EBPF_ALU_OP_MOD:
+    case EBPF_ALU_OP_XOR:
+    case EBPF_ALU_OP_ARSH:
+    case EBPF_ALU_OP_MOV:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Whether the check of ubpf_validate_shadow_register may fail for the instruction in the
+ * state before it.
+ */
+static bool
+check_may_fail(const struct init_state* state, struct ebpf_inst inst)
+{
+    switch (inst.opcode & EBPF_CLS_MASK) {
+    case EBPF_CLS_LD:
+        return false;
+    case EBPF_CLS_LDX:
+        return !is_valid(state, inst.src);
+    case EBPF_CLS_ST:
+        return inst.dst != BPF_REG_10 && !is_valid(state, inst.dst);
+    case EBPF_CLS_STX:
+        return inst.dst != BPF_REG_10 && (!is_valid(state, inst.src) || !is_valid(state, inst.dst));
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64: {
+        uint8_t operation = inst.opcode & EBPF_ALU_OP_MASK;
+        return !is_binary_alu_operation(operation) && operation != EBPF_ALU_OP_NEG && operation != EBPF_ALU_OP_END;
+    }
+    default:
+        switch (inst.opcode & EBPF_JMP_OP_MASK) {
+        case EBPF_MODE_CALL:
+        case EBPF_MODE_JA:
+            return false;
+        case EBPF_MODE_EXIT:
+            return !is_valid(state, BPF_REG_0);
+        case EBPF_MODE_JEQ:
+        case EBPF_MODE_JGT:
+        case EBPF_MODE_JGE:
+        case EBPF_MODE_JSET:
+        case EBPF_MODE_JNE:
+        case EBPF_MODE_JSGT:
+        case EBPF_MODE_JSGE:
+        case EBPF_MODE_JLT:
+        case EBPF_MODE_JLE:
+        case EBPF_MODE_JSLT:
+        case EBPF_MODE_JSLE:
+            return inst.offset != 0 &&
+                   (!is_valid(state, inst.dst) || ((inst.opcode & EBPF_SRC_REG) && !is_valid(state, inst.src)));
+        default:
+            return true;
+        }
+    }
+}
+
+/*
+ * Apply the instruction to the state, as the interpreter updates its shadow state. Local
+ * calls and exits are left to propagate.
+ */
+static void
+transfer(const struct ubpf_vm* vm, uint32_t pc, struct init_state* state, struct ebpf_inst inst)
+{
+    if (inst.dst > BPF_REG_10 || inst.src > BPF_REG_10) {
+        return;
+    }
+    switch (inst.opcode & EBPF_CLS_MASK) {
+    case EBPF_CLS_LD:
+        set_valid(state, inst.dst, true);
+        state->kind[inst.dst] = KIND_NOT_STACK;
+        break;
+    case EBPF_CLS_LDX:
+        set_valid(
+            state,
+            inst.dst,
+            !may_read_uninitialized(
+                state, inst.src, inst.offset, access_size(inst.opcode), ubpf_access_is_proven(vm, pc)));
+        state->kind[inst.dst] = loaded_kind(state, KIND_NOT_STACK);
+        break;
+    case EBPF_CLS_ST:
+        mark_written(state, inst.dst, inst.offset, access_size(inst.opcode));
+        break;
+    case EBPF_CLS_STX:
+        // The safe interpreter does not mark the bytes that atomic operations write.
+        if ((inst.opcode & 0xe0) != EBPF_MODE_ATOMIC || vm->execution_profile != UBPF_EXECUTION_PROFILE_SAFE) {
+            mark_written(state, inst.dst, inst.offset, access_size(inst.opcode));
+        }
+        if (state->kind[inst.src] != KIND_NOT_STACK) {
+            state->escaped = true;
+        }
+        if ((inst.opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+            // The fetching operations load into src (or r0).
+            state->kind[inst.src] = loaded_kind(state, state->kind[inst.src]);
+            state->kind[BPF_REG_0] = loaded_kind(state, state->kind[BPF_REG_0]);
+        }
+        break;
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64: {
+        uint8_t operation = inst.opcode & EBPF_ALU_OP_MASK;
+        bool source_is_register = inst.opcode & EBPF_SRC_REG;
+        if (!is_binary_alu_operation(operation)) {
+            if (operation == EBPF_ALU_OP_NEG || operation == EBPF_ALU_OP_END) {
+                state->kind[inst.dst] = state->kind[inst.dst] == KIND_NOT_STACK ? KIND_NOT_STACK : KIND_MAYBE_STACK;
+            }
+            break;
+        }
+        set_valid(state, inst.dst, source_is_register ? is_valid(state, inst.src) : true);
+
+        uint8_t source_kind = source_is_register ? state->kind[inst.src] : KIND_NOT_STACK;
+        if (inst.opcode == EBPF_OP_MOV64_REG && inst.offset == 0) {
+            state->kind[inst.dst] = source_kind;
+            state->offset[inst.dst] = state->offset[inst.src];
+        } else if (operation == EBPF_ALU_OP_MOV) {
+            state->kind[inst.dst] = source_kind == KIND_NOT_STACK ? KIND_NOT_STACK : KIND_MAYBE_STACK;
+        } else if (state->kind[inst.dst] == KIND_STACK && inst.opcode == EBPF_OP_ADD64_IMM) {
+            state->offset[inst.dst] += inst.imm;
+        } else if (state->kind[inst.dst] == KIND_STACK && inst.opcode == EBPF_OP_SUB64_IMM) {
+            state->offset[inst.dst] -= inst.imm;
+        } else if (state->kind[inst.dst] != KIND_NOT_STACK || source_kind != KIND_NOT_STACK) {
+            state->kind[inst.dst] = KIND_MAYBE_STACK;
+        }
+        break;
+    }
+    default:
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 0) {
+            // A helper that is given a pointer into the stack may return or store it.
+            bool passes_stack_pointer = false;
+            for (int reg = BPF_REG_1; reg <= BPF_REG_5; reg++) {
+                passes_stack_pointer |= state->kind[reg] != KIND_NOT_STACK;
+            }
+            state->escaped |= passes_stack_pointer;
+            state->kind[BPF_REG_0] = passes_stack_pointer || state->escaped ? KIND_MAYBE_STACK : KIND_NOT_STACK;
+            state->valid |= REGISTER_MASK(BPF_REG_0);
+            state->valid &= ~ARGUMENT_REGISTERS;
+        } else if (inst.opcode == EBPF_OP_EXIT) {
+            state->valid &= ~ARGUMENT_REGISTERS;
+        }
+        break;
+    }
+}
+
+// The pointers into the caller's frame do not point into the callee's.
+static void
+enter_frame(struct init_state* state)
+{
+    for (int reg = BPF_REG_0; reg < BPF_REG_10; reg++) {
+        if (state->kind[reg] == KIND_STACK) {
+            state->kind[reg] = KIND_MAYBE_STACK;
+        }
+    }
+    memset(state->stack, 0, sizeof(state->stack));
+}
+
+/*
+ * The state after a local call: the callee's exit state, with the caller's r6-r9 (which
+ * are restored, although their initialization is not) and frame.
+ */
+static struct init_state
+return_state(const struct init_state* call, const struct init_state* exit)
+{
+    struct init_state state = *exit;
+    for (int reg = BPF_REG_0; reg <= BPF_REG_5; reg++) {
+        if (state.kind[reg] == KIND_STACK) {
+            state.kind[reg] = KIND_MAYBE_STACK;
+        }
+    }
+    for (int reg = BPF_REG_6; reg <= BPF_REG_9; reg++) {
+        state.kind[reg] = call->kind[reg];
+        state.offset[reg] = call->offset[reg];
+        if (state.escaped && state.kind[reg] == KIND_STACK) {
+            state.kind[reg] = KIND_MAYBE_STACK;
+        }
+    }
+    memcpy(state.stack, call->stack, sizeof(state.stack));
+    return state;
+}
+
+// Join source into target; return whether target changed.
+static bool
+join(struct init_state* target, const struct init_state* source)
+{
+    if (!target->reached) {
+        *target = *source;
+        target->reached = true;
+        return true;
+    }
+    struct init_state old = *target;
+    target->escaped |= source->escaped;
+    target->valid &= source->valid;
+    for (int reg = BPF_REG_0; reg <= BPF_REG_10; reg++) {
+        if (target->kind[reg] != source->kind[reg] ||
+            (target->kind[reg] == KIND_STACK && target->offset[reg] != source->offset[reg])) {
+            target->kind[reg] = KIND_MAYBE_STACK;
+        }
+    }
+    for (size_t i = 0; i < sizeof(target->stack) / sizeof(target->stack[0]); i++) {
+        target->stack[i] &= source->stack[i];
+    }
+    return old.escaped != target->escaped || old.valid != target->valid ||
+           memcmp(old.kind, target->kind, sizeof(old.kind)) != 0 ||
+           memcmp(old.stack, target->stack, sizeof(old.stack)) != 0;
+}
+
+static void
+propagate(struct init_analysis* analysis, uint32_t target, const struct init_state* state)
+{
+    if (target < analysis->num_insts && join(&analysis->states[target], state) && !analysis->queued[target]) {
+        analysis->queued[target] = true;
+        analysis->worklist[analysis->worklist_size++] = target;
+    }
+}
+
+/*
+ * Walk the basic block at leader in its state, recording in may_fail (if any) whether
+ * the check of each instruction may fail, and propagate the state to its successors.
+ */
+static void
+walk_block(struct init_analysis* analysis, uint32_t leader, bool* may_fail)
+{
+    const struct ubpf_vm* vm = analysis->vm;
+    struct init_state state = analysis->states[leader];
+    uint32_t pc = leader;
+    for (;;) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (may_fail != NULL) {
+            may_fail[pc] = check_may_fail(&state, inst);
+        }
+        struct init_state before = state;
+        transfer(vm, pc, &state, inst);
+        uint32_t next = pc + instruction_size(inst);
+
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+            uint32_t callee = analysis->function_of[pc + 1 + inst.imm];
+            struct init_state entry = before;
+            enter_frame(&entry);
+            propagate(analysis, analysis->function_start[callee], &entry);
+            if (analysis->exit_states[callee].reached) {
+                struct init_state after = return_state(&before, &analysis->exit_states[callee]);
+                propagate(analysis, next, &after);
+            }
+            return;
+        }
+        if (inst.opcode == EBPF_OP_EXIT) {
+            uint32_t function = analysis->function_of[pc];
+            if (function != 0 && join(&analysis->exit_states[function], &state)) {
+                for (uint32_t i = analysis->call_sites_start[function]; i < analysis->call_sites_start[function + 1];
+                     i++) {
+                    uint32_t call = analysis->call_sites[i];
+                    uint32_t call_leader = call;
+                    while (!analysis->is_leader[call_leader]) {
+                        call_leader--;
+                    }
+                    if (analysis->states[call_leader].reached && !analysis->queued[call_leader]) {
+                        analysis->queued[call_leader] = true;
+                        analysis->worklist[analysis->worklist_size++] = call_leader;
+                    }
+                }
+            }
+            return;
+        }
+        if (inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32) {
+            propagate(analysis, jump_target(pc, inst), &state);
+            return;
+        }
+        if (is_jump(inst)) {
+            propagate(analysis, jump_target(pc, inst), &state);
+            propagate(analysis, next, &state);
+            return;
+        }
+        if (next >= analysis->num_insts || analysis->is_leader[next]) {
+            propagate(analysis, next, &state);
+            return;
+        }
+        pc = next;
+    }
+}
+
+static bool
+find_functions_and_leaders(struct init_analysis* analysis)
+{
+    const struct ubpf_vm* vm = analysis->vm;
+    uint32_t num_insts = analysis->num_insts;
+    uint32_t num_calls = 0;
+    analysis->num_functions = 0;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (pc == 0 || vm->int_funcs[pc]) {
+            analysis->is_leader[pc] = true;
+            analysis->num_functions++;
+        }
+        analysis->function_of[pc] = analysis->num_functions - 1;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            if (pc + 1 < num_insts) {
+                analysis->function_of[++pc] = analysis->num_functions - 1;
+            }
+        } else if (is_jump(inst)) {
+            if (jump_target(pc, inst) < num_insts) {
+                analysis->is_leader[jump_target(pc, inst)] = true;
+            }
+            if (pc + 1 < num_insts) {
+                analysis->is_leader[pc + 1] = true;
+            }
+        } else if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+            num_calls++;
+            if (pc + 1 < num_insts) {
+                analysis->is_leader[pc + 1] = true;
+            }
+        }
+    }
+
+    analysis->function_start = calloc(analysis->num_functions, sizeof(uint32_t));
+    analysis->exit_states = calloc(analysis->num_functions, sizeof(struct init_state));
+    analysis->call_sites = calloc(num_calls + 1, sizeof(uint32_t));
+    analysis->call_sites_start = calloc(analysis->num_functions + 1, sizeof(uint32_t));
+    if (analysis->function_start == NULL || analysis->exit_states == NULL || analysis->call_sites == NULL ||
+        analysis->call_sites_start == NULL) {
+        return false;
+    }
+
+    // Group the call sites by the function they call.
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (pc == 0 || vm->int_funcs[pc]) {
+            analysis->function_start[analysis->function_of[pc]] = pc;
+        }
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+            analysis->call_sites_start[analysis->function_of[pc + 1 + inst.imm] + 1]++;
+        } else if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+    for (uint32_t function = 0; function < analysis->num_functions; function++) {
+        analysis->call_sites_start[function + 1] += analysis->call_sites_start[function];
+    }
+    uint32_t* next_call_site = calloc(analysis->num_functions, sizeof(uint32_t));
+    if (next_call_site == NULL) {
+        return false;
+    }
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+            uint32_t callee = analysis->function_of[pc + 1 + inst.imm];
+            analysis->call_sites[analysis->call_sites_start[callee] + next_call_site[callee]++] = pc;
+        } else if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+    free(next_call_site);
+    return true;
+}
+
+/*
+ * Mark every instruction from which one whose check may fail can be reached, following
+ * jumps, local calls and the returns from them, backwards.
+ */
+static bool
+mark_tracked(const struct init_analysis* analysis, const bool* may_fail, bool* tracked)
+{
+    const struct ubpf_vm* vm = analysis->vm;
+    uint32_t num_insts = analysis->num_insts;
+    // The edges of the control flow graph, grouped by the instruction they lead to.
+    uint32_t* predecessors_start = calloc(num_insts + 1, sizeof(uint32_t));
+    uint32_t* predecessors = NULL;
+    uint32_t* next_predecessor = NULL;
+    uint32_t* worklist = NULL;
+    bool succeeded = false;
+    if (predecessors_start == NULL) {
+        goto done;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t pc = 0; pc < num_insts; pc++) {
+            struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+            uint32_t successors[3];
+            uint32_t count = 0;
+            uint32_t next = pc + instruction_size(inst);
+            if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+                successors[count++] = analysis->function_start[analysis->function_of[pc + 1 + inst.imm]];
+                successors[count++] = next;
+            } else if (inst.opcode == EBPF_OP_EXIT) {
+                // Every return site of the function.
+                uint32_t function = analysis->function_of[pc];
+                if (function != 0) {
+                    for (uint32_t i = analysis->call_sites_start[function];
+                         i < analysis->call_sites_start[function + 1];
+                         i++) {
+                        uint32_t target = analysis->call_sites[i] + 1;
+                        if (target < num_insts) {
+                            if (pass == 0) {
+                                predecessors_start[target + 1]++;
+                            } else {
+                                predecessors[next_predecessor[target]++] = pc;
+                            }
+                        }
+                    }
+                }
+            } else if (inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32) {
+                successors[count++] = jump_target(pc, inst);
+            } else if (is_jump(inst)) {
+                successors[count++] = jump_target(pc, inst);
+                successors[count++] = next;
+            } else {
+                successors[count++] = next;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                if (successors[i] >= num_insts) {
+                    continue;
+                }
+                if (pass == 0) {
+                    predecessors_start[successors[i] + 1]++;
+                } else {
+                    predecessors[next_predecessor[successors[i]]++] = pc;
+                }
+            }
+            if (inst.opcode == EBPF_OP_LDDW) {
+                pc++;
+            }
+        }
+        if (pass == 0) {
+            for (uint32_t pc = 0; pc < num_insts; pc++) {
+                predecessors_start[pc + 1] += predecessors_start[pc];
+            }
+            predecessors = calloc(predecessors_start[num_insts] + 1, sizeof(uint32_t));
+            next_predecessor = calloc(num_insts, sizeof(uint32_t));
+            if (predecessors == NULL || next_predecessor == NULL) {
+                goto done;
+            }
+            memcpy(next_predecessor, predecessors_start, num_insts * sizeof(uint32_t));
+        }
+    }
+
+    worklist = calloc(num_insts, sizeof(uint32_t));
+    if (worklist == NULL) {
+        goto done;
+    }
+    uint32_t worklist_size = 0;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        if (may_fail[pc]) {
+            tracked[pc] = true;
+            worklist[worklist_size++] = pc;
+        }
+    }
+    while (worklist_size > 0) {
+        uint32_t pc = worklist[--worklist_size];
+        for (uint32_t i = predecessors_start[pc]; i < predecessors_start[pc + 1]; i++) {
+            uint32_t predecessor = predecessors[i];
+            if (!tracked[predecessor]) {
+                tracked[predecessor] = true;
+                worklist[worklist_size++] = predecessor;
+            }
+        }
+    }
+    succeeded = true;
+
+done:
+    free(predecessors_start);
+    free(predecessors);
+    free(next_predecessor);
+    free(worklist);
+    return succeeded;
+}
+
+bool
+ubpf_analyze_uninitialized_reads(struct ubpf_vm* vm, char** errmsg)
+{
+    uint32_t num_insts = vm->num_insts;
+    struct init_analysis analysis = {
+        .vm = vm,
+        .num_insts = num_insts,
+        .is_leader = calloc(num_insts, sizeof(bool)),
+        .states = calloc(num_insts, sizeof(struct init_state)),
+        .function_of = calloc(num_insts, sizeof(uint32_t)),
+        .worklist = calloc(num_insts, sizeof(uint32_t)),
+        .queued = calloc(num_insts, sizeof(bool)),
+    };
+    bool* may_fail = calloc(num_insts, sizeof(bool));
+    bool* tracked = calloc(num_insts, sizeof(bool));
+    bool succeeded = false;
+    if (analysis.is_leader == NULL || analysis.states == NULL || analysis.function_of == NULL ||
+        analysis.worklist == NULL || analysis.queued == NULL || may_fail == NULL || tracked == NULL ||
+        !find_functions_and_leaders(&analysis)) {
+        goto done;
+    }
+
+    // The interpreter starts with r1, r2 and r10 initialized; only r10 points into the stack.
+    struct init_state entry = {0};
+    entry.valid = REGISTER_MASK(BPF_REG_1) | REGISTER_MASK(BPF_REG_2) | REGISTER_MASK(BPF_REG_10);
+    entry.kind[BPF_REG_10] = KIND_STACK;
+    propagate(&analysis, 0, &entry);
+    while (analysis.worklist_size > 0) {
+        uint32_t leader = analysis.worklist[--analysis.worklist_size];
+        analysis.queued[leader] = false;
+        walk_block(&analysis, leader, NULL);
+    }
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        if (analysis.is_leader[pc] && analysis.states[pc].reached) {
+            walk_block(&analysis, pc, may_fail);
+        }
+    }
+
+    if (mark_tracked(&analysis, may_fail, tracked)) {
+        vm->shadow_tracking_needed = false;
+        for (uint32_t pc = 0; pc < num_insts; pc++) {
+            vm->shadow_tracking_needed |= tracked[pc];
+        }
+        vm->shadow_tracked = tracked;
+        tracked = NULL;
+        succeeded = true;
+    }
+
+done:
+    if (!succeeded) {
+        *errmsg = ubpf_error("out of memory");
+    }
+    free(analysis.is_leader);
+    free(analysis.states);
+    free(analysis.function_of);
+    free(analysis.function_start);
+    free(analysis.exit_states);
+    free(analysis.call_sites);
+    free(analysis.call_sites_start);
+    free(analysis.worklist);
+    free(analysis.queued);
+    free(may_fail);
+    free(tracked);
+    return succeeded;
+}
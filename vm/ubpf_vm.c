@@ -38,7 +38,10 @@
 #define DEFAULT_JITTER_BUFFER_SIZE 65536
 
 static bool
-validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+validate(
+    const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, struct ubpf_cfg** cfg, char** errmsg);
+static bool
+program_uses_stack(const struct ebpf_inst* insts, uint32_t num_insts);
 static bool
 bounds_check(
     const struct ubpf_vm* vm,
@@ -67,6 +70,20 @@ ubpf_toggle_constant_blinding(struct ubpf_vm* vm, bool enable)
     return old;
 }
 
+bool
+ubpf_toggle_lse_atomics(struct ubpf_vm* vm, bool enable)
+{
+    bool old = vm->lse_atomics_enabled;
+    vm->lse_atomics_enabled = enable;
+    return old;
+}
+
+void
+ubpf_set_register_offset(struct ubpf_vm* vm, int x)
+{
+    vm->register_offset = x;
+}
+
 bool
 ubpf_toggle_undefined_behavior_check(struct ubpf_vm* vm, bool enable)
 {
@@ -83,6 +100,89 @@ ubpf_toggle_readonly_bytecode(struct ubpf_vm* vm, bool enable)
     return old;
 }
 
+bool
+ubpf_toggle_branch_profiling(struct ubpf_vm* vm, bool enable)
+{
+    bool old = vm->branch_profiling_enabled;
+    vm->branch_profiling_enabled = enable;
+    return old;
+}
+
+bool
+ubpf_toggle_program_cache(struct ubpf_vm* vm, bool enable)
+{
+    bool old = vm->program_cache_enabled;
+    vm->program_cache_enabled = enable;
+    return old;
+}
+
+int
+ubpf_get_branch_profile(const struct ubpf_vm* vm, struct ubpf_branch_profile_entry* profile, uint32_t count)
+{
+    if (!vm->branch_profile || count < vm->num_insts) {
+        return -1;
+    }
+
+    memcpy(profile, vm->branch_profile, vm->num_insts * sizeof(vm->branch_profile[0]));
+    return vm->num_insts;
+}
+
+int
+ubpf_set_branch_profile(
+    struct ubpf_vm* vm, const struct ubpf_branch_profile_entry* profile, uint32_t count, char** errmsg)
+{
+    *errmsg = NULL;
+
+    if (!vm->insts) {
+        *errmsg = ubpf_error("code must be loaded before a branch profile can be set");
+        return -1;
+    }
+
+    if (count != vm->num_insts) {
+        *errmsg = ubpf_error("branch profile has %u entries but the program has %u instructions", count, vm->num_insts);
+        return -1;
+    }
+
+    if (!vm->branch_profile) {
+        vm->branch_profile = calloc(vm->num_insts, sizeof(vm->branch_profile[0]));
+        if (!vm->branch_profile) {
+            *errmsg = ubpf_error("out of memory");
+            return -1;
+        }
+    }
+
+    memcpy(vm->branch_profile, profile, vm->num_insts * sizeof(vm->branch_profile[0]));
+    return 0;
+}
+
+size_t
+ubpf_get_stack_requirement(const struct ubpf_vm* vm)
+{
+    return vm->stack_requirement;
+}
+
+int
+ubpf_set_minimum_context_size(struct ubpf_vm* vm, size_t size)
+{
+    if (vm->insts) {
+        return -1;
+    }
+    vm->context_size_declared = true;
+    vm->minimum_context_size = size;
+    return 0;
+}
+
+int
+ubpf_get_range_report(const struct ubpf_vm* vm, struct ubpf_range_report* report)
+{
+    if (vm->proven_accesses == NULL) {
+        return -1;
+    }
+    report->accesses = vm->memory_accesses;
+    report->proven = vm->proven_memory_accesses;
+    return 0;
+}
+
 int
 ubpf_set_execution_profile(struct ubpf_vm* vm, enum ubpf_execution_profile profile)
 {
@@ -93,24 +193,59 @@ void
 ubpf_set_error_print(struct ubpf_vm* vm, int (*error_printf)(FILE* stream, const char* format, ...))
 {
     if (error_printf)
-        vm->error_printf = error_printf;
+        vm->jit_data->error_printf = error_printf;
     else
-        vm->error_printf = fprintf;
+        vm->jit_data->error_printf = fprintf;
+}
+
+size_t
+ubpf_page_size(void)
+{
+#if defined(_WIN32)
+    // On Windows, assume 4 KiB page size (typical for x86/x64).
+    return 4096;
+#else
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0) {
+        // Fallback to 4 KiB, the most common page size.
+        return 4096;
+    }
+    return (size_t)page_size;
+#endif
 }
 
 struct ubpf_vm*
 ubpf_create(void)
 {
-    struct ubpf_vm* vm = calloc(1, sizeof(*vm));
-    if (vm == NULL) {
+    // The VM gets pages of its own, see struct ubpf_vm. Anonymous mappings are zeroed.
+    struct ubpf_vm* vm = mmap(0, sizeof(*vm), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm == MAP_FAILED) {
         return NULL;
     }
 
-    vm->ext_funcs = calloc(MAX_EXT_FUNCS, sizeof(*vm->ext_funcs));
-    if (vm->ext_funcs == NULL) {
+#if defined(__x86_64__) || defined(_M_X64)
+    vm->jit_translate = ubpf_translate_x86_64;
+    vm->jit_entry = ubpf_jit_entry_x86_64;
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    vm->jit_translate = ubpf_translate_arm64;
+    vm->jit_entry = ubpf_jit_entry_arm64;
+#elif defined(__riscv) && __riscv_xlen == 64
+    vm->jit_translate = ubpf_translate_riscv64;
+    vm->jit_entry = ubpf_jit_entry_riscv64;
+#elif defined(__mips__) && defined(__mips64) && __mips_isa_rev >= 6 && defined(__MIPSEL__)
+    vm->jit_translate = ubpf_translate_mips64;
+    vm->jit_entry = ubpf_jit_entry_mips64;
+#else
+    vm->jit_translate = ubpf_translate_null;
+    vm->jit_entry = ubpf_jit_entry_null;
+#endif
+
+    vm->jit_data = ubpf_create_jit_data(vm->jit_entry);
+    if (vm->jit_data == NULL) {
         ubpf_destroy(vm);
         return NULL;
     }
+    vm->ext_funcs = vm->jit_data->helpers;
 
     vm->ext_func_names = calloc(MAX_EXT_FUNCS, sizeof(*vm->ext_func_names));
     if (vm->ext_func_names == NULL) {
@@ -125,29 +260,19 @@ ubpf_create(void)
     }
 
     vm->bounds_check_enabled = true;
+    vm->instruction_bound = UINT64_MAX;
     vm->undefined_behavior_check_enabled = false;
     vm->readonly_bytecode_enabled = true;  // Enable read-only bytecode by default
     vm->constant_blinding_enabled = false;
     vm->execution_profile = UBPF_EXECUTION_PROFILE_LEGACY;
-    vm->error_printf = fprintf;
+    vm->jit_data->error_printf = fprintf;
 
-#if defined(__x86_64__) || defined(_M_X64)
-    vm->jit_translate = ubpf_translate_x86_64;
-    vm->jit_update_dispatcher = ubpf_jit_update_dispatcher_x86_64;
-    vm->jit_update_helper = ubpf_jit_update_helper_x86_64;
-#elif defined(__aarch64__) || defined(_M_ARM64)
-    vm->jit_translate = ubpf_translate_arm64;
-    vm->jit_update_dispatcher = ubpf_jit_update_dispatcher_arm64;
-    vm->jit_update_helper = ubpf_jit_update_helper_arm64;
-#else
-    vm->jit_translate = ubpf_translate_null;
-    vm->jit_update_dispatcher = ubpf_jit_update_dispatcher_null;
-    vm->jit_update_helper = ubpf_jit_update_helper_null;
-#endif
     vm->unwind_stack_extension_index = -1;
+    vm->lse_atomics_enabled = ubpf_arm64_lse_atomics_supported();
 
     vm->jitted_result.compile_result = UBPF_JIT_COMPILE_FAILURE;
     vm->jitter_buffer_size = DEFAULT_JITTER_BUFFER_SIZE;
+    vm->jit_threads = 1;
     return vm;
 }
 
@@ -156,10 +281,10 @@ ubpf_destroy(struct ubpf_vm* vm)
 {
     ubpf_unload_code(vm);
     free(vm->int_funcs);
-    free(vm->ext_funcs);
+    ubpf_destroy_jit_data(vm->jit_data);
     free(vm->ext_func_names);
     free(vm->local_func_stack_usage);
-    free(vm);
+    munmap(vm, sizeof(*vm));
 }
 
 external_function_t
@@ -175,33 +300,11 @@ ubpf_register(struct ubpf_vm* vm, unsigned int idx, const char* name, external_f
         return -1;
     }
 
-    vm->ext_funcs[idx] = (extended_external_helper_t)fn;
+    // JIT'd code reads the helper table at run time, so this takes effect immediately,
+    // even for a program that is executing on another thread.
+    UBPF_ATOMIC_STORE64(&vm->ext_funcs[idx], (uintptr_t)fn);
     vm->ext_func_names[idx] = name;
-
-    int success = 0;
-
-    if (vm->jitted_result.compile_result == UBPF_JIT_COMPILE_SUCCESS) {
-        if (mprotect(vm->jitted, vm->jitted_size, PROT_READ | PROT_WRITE) < 0) {
-            return -1;
-        }
-
-        // Now, update!
-        if (!vm->jit_update_helper(
-                vm,
-                (extended_external_helper_t)fn,
-                idx,
-                (uint8_t*)vm->jitted,
-                vm->jitted_size,
-                vm->jitted_result.external_helper_offset)) {
-            // Can't immediately stop here because we have unprotected memory!
-            success = -1;
-        }
-
-        if (mprotect(vm->jitted, vm->jitted_size, PROT_READ | PROT_EXEC) < 0) {
-            return -1;
-        }
-    }
-    return success;
+    return 0;
 }
 
 int
@@ -214,28 +317,9 @@ int
 ubpf_register_external_dispatcher(
     struct ubpf_vm* vm, external_function_dispatcher_t dispatcher, external_function_validate_t validater)
 {
-    vm->dispatcher = dispatcher;
     vm->dispatcher_validate = validater;
-
-    int success = 0;
-
-    if (vm->jitted_result.compile_result == UBPF_JIT_COMPILE_SUCCESS) {
-        if (mprotect(vm->jitted, vm->jitted_size, PROT_READ | PROT_WRITE) < 0) {
-            return -1;
-        }
-
-        // Now, update!
-        if (!vm->jit_update_dispatcher(
-                vm, dispatcher, (uint8_t*)vm->jitted, vm->jitted_size, vm->jitted_result.external_dispatcher_offset)) {
-            // Can't immediately stop here because we have unprotected memory!
-            success = -1;
-        }
-
-        if (mprotect(vm->jitted, vm->jitted_size, PROT_READ | PROT_EXEC) < 0) {
-            return -1;
-        }
-    }
-    return success;
+    UBPF_ATOMIC_STORE64(&vm->jit_data->dispatcher, (uintptr_t)dispatcher);
+    return 0;
 }
 
 int
@@ -255,6 +339,15 @@ ubpf_register_safe_region(struct ubpf_vm* vm, const struct ubpf_safe_region* reg
     return ubpf_register_safe_region_impl(vm, region);
 }
 
+bool
+ubpf_helper_is_registered(const struct ubpf_vm* vm, unsigned int idx)
+{
+    if (vm->jit_data->dispatcher != NULL) {
+        return vm->dispatcher_validate(idx, vm);
+    }
+    return idx < MAX_EXT_FUNCS && vm->ext_funcs[idx];
+}
+
 unsigned int
 ubpf_lookup_registered_function(struct ubpf_vm* vm, const char* name)
 {
@@ -268,52 +361,38 @@ ubpf_lookup_registered_function(struct ubpf_vm* vm, const char* name)
     return -1;
 }
 
-int
-ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg)
+static int
+allocate_branch_profile(struct ubpf_vm* vm, char** errmsg)
 {
-    const struct ebpf_inst* source_inst = code;
-    *errmsg = NULL;
-
-    if (UBPF_EBPF_STACK_SIZE % sizeof(uint64_t) != 0) {
-        *errmsg = ubpf_error("UBPF_EBPF_STACK_SIZE must be a multiple of 8");
-        return -1;
-    }
-
-    if (vm->insts) {
-        *errmsg = ubpf_error(
-            "code has already been loaded into this VM. Use ubpf_unload_code() if you need to reuse this VM");
-        return -1;
+    if (vm->branch_profiling_enabled) {
+        vm->branch_profile = calloc(vm->num_insts, sizeof(vm->branch_profile[0]));
+        if (!vm->branch_profile) {
+            *errmsg = ubpf_error("out of memory");
+            ubpf_unload_code(vm);
+            return -1;
+        }
     }
+    return 0;
+}
 
-    if (code_len % 8 != 0) {
-        *errmsg = ubpf_error("code_len must be a multiple of 8");
-        return -1;
-    }
+/*
+ * Validate and store the program, and run the load-time analyses on it.
+ */
+static int
+load_program(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg)
+{
+    const struct ebpf_inst* source_inst = code;
 
-    if (!validate(vm, code, code_len / 8, errmsg)) {
+    struct ubpf_cfg* cfg = NULL;
+    if (!validate(vm, code, code_len / 8, &cfg, errmsg)) {
         return -1;
     }
 
     // Allocate memory for bytecode using mmap if read-only mode is enabled
     if (vm->readonly_bytecode_enabled) {
         // Get page size for alignment
-        size_t page_size;
-#if defined(_WIN32)
-        // On Windows, assume 4 KiB page size (typical for x86/x64).
-        // Using a smaller value than actual page size is still correct.
-        page_size = 4096;
-#else
-        long page_size_long = sysconf(_SC_PAGESIZE);
-        if (page_size_long <= 0) {
-            // Fallback to 4 KiB, the most common page size; using a smaller
-            // value than the actual system page size is still correct, though
-            // it may be slightly less efficient on systems with larger pages.
-            page_size = 4096;
-        } else {
-            page_size = (size_t)page_size_long;
-        }
-#endif
-        
+        size_t page_size = ubpf_page_size();
+
         // Calculate page-aligned allocation size
         vm->insts_alloc_size = (code_len + page_size - 1) & ~(page_size - 1);
         
@@ -323,6 +402,7 @@ ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg
                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
         if (vm->insts == MAP_FAILED) {
             vm->insts = NULL;
+            ubpf_destroy_cfg(cfg);
             *errmsg = ubpf_error("out of memory");
             return -1;
         }
@@ -330,6 +410,7 @@ ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg
         // Use malloc for writable bytecode
         vm->insts = malloc(code_len);
         if (vm->insts == NULL) {
+            ubpf_destroy_cfg(cfg);
             *errmsg = ubpf_error("out of memory");
             return -1;
         }
@@ -350,6 +431,7 @@ ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg
         vm->insts = NULL;
         vm->insts_alloc_size = 0;
         vm->num_insts = 0;
+        ubpf_destroy_cfg(cfg);
         return -1;
     }
 
@@ -378,13 +460,85 @@ ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg
             vm->num_insts = 0;
             free(vm->int_funcs);
             vm->int_funcs = NULL;
+            ubpf_destroy_cfg(cfg);
             return -1;
         }
     }
+    vm->cfg = cfg;
+
+    vm->stack_requirement = program_uses_stack(source_inst, vm->num_insts) ? ubpf_compute_stack_requirement(vm) : 0;
+
+    if (vm->context_size_declared && !ubpf_verify_ranges(vm, errmsg)) {
+        ubpf_unload_code(vm);
+        return -1;
+    }
+    ubpf_compute_instruction_bound(vm);
+
+    if (vm->undefined_behavior_check_enabled && !ubpf_analyze_uninitialized_reads(vm, errmsg)) {
+        ubpf_unload_code(vm);
+        return -1;
+    }
 
     return 0;
 }
 
+int
+ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg)
+{
+    *errmsg = NULL;
+
+    if (UBPF_EBPF_STACK_SIZE % sizeof(uint64_t) != 0) {
+        *errmsg = ubpf_error("UBPF_EBPF_STACK_SIZE must be a multiple of 8");
+        return -1;
+    }
+
+    if (vm->insts) {
+        *errmsg = ubpf_error(
+            "code has already been loaded into this VM. Use ubpf_unload_code() if you need to reuse this VM");
+        return -1;
+    }
+
+    if (code_len % 8 != 0) {
+        *errmsg = ubpf_error("code_len must be a multiple of 8");
+        return -1;
+    }
+
+    // Programs that the cache holds are shared instead of being validated and analyzed again. The result of a
+    // stack usage calculator may depend on the VM, so programs that use one are not shared.
+    bool cacheable = vm->program_cache_enabled && vm->stack_usage_calculator == NULL;
+    int cached = cacheable ? ubpf_load_cached_program(vm, code, code_len / 8, errmsg) : 0;
+    if (cached < 0) {
+        return -1;
+    }
+    if (cached == 0) {
+        if (load_program(vm, code, code_len, errmsg) < 0) {
+            return -1;
+        }
+        if (cacheable) {
+            ubpf_cache_loaded_program(vm, code);
+        }
+    }
+
+    return allocate_branch_profile(vm, errmsg);
+}
+
+int
+ubpf_load_program(struct ubpf_vm* vm, struct ubpf_program* program, char** errmsg)
+{
+    *errmsg = NULL;
+
+    if (vm->insts) {
+        *errmsg = ubpf_error(
+            "code has already been loaded into this VM. Use ubpf_unload_code() if you need to reuse this VM");
+        return -1;
+    }
+
+    if (ubpf_share_program(vm, program, errmsg) < 0) {
+        return -1;
+    }
+    return allocate_branch_profile(vm, errmsg);
+}
+
 void
 ubpf_unload_code(struct ubpf_vm* vm)
 {
@@ -393,11 +547,10 @@ ubpf_unload_code(struct ubpf_vm* vm)
     free(vm->local_func_stack_usage);
     vm->local_func_stack_usage = calloc(UBPF_MAX_INSTS, sizeof(struct ubpf_stack_usage));
 
-    if (vm->jitted) {
-        munmap(vm->jitted, vm->jitted_size);
-        vm->jitted = NULL;
-        vm->jitted_size = 0;
-    }
+    ubpf_release_jitted(vm);
+    ubpf_release_c_module(vm);
+    // A shared program is freed with its last reference.
+    ubpf_unload_program(vm);
     if (vm->insts) {
         if (vm->readonly_bytecode_enabled) {
             munmap(vm->insts, vm->insts_alloc_size);
@@ -410,6 +563,19 @@ ubpf_unload_code(struct ubpf_vm* vm)
     }
     free(vm->int_funcs);
     vm->int_funcs = NULL;
+    ubpf_destroy_cfg(vm->cfg);
+    vm->cfg = NULL;
+    free(vm->branch_profile);
+    vm->branch_profile = NULL;
+    free(vm->proven_accesses);
+    vm->proven_accesses = NULL;
+    vm->memory_accesses = 0;
+    vm->proven_memory_accesses = 0;
+    free(vm->shadow_tracked);
+    vm->shadow_tracked = NULL;
+    vm->shadow_tracking_needed = false;
+    vm->instruction_bound = UINT64_MAX;
+    vm->stack_requirement = 0;
 }
 
 static uint32_t
@@ -636,7 +802,7 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
     // Load indirect instructions initialize the destination register and require the source register to be initialized.
     case EBPF_CLS_LDX:
         if (!source_register_valid_before_instruction) {
-            vm->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
+            vm->jit_data->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
             return false;
         }
         destination_register_valid_after_instruction = true;
@@ -644,7 +810,8 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
     // Store indirect instructions require the destination register to be initialized, but has no source register.
     case EBPF_CLS_ST:
         if (inst.dst != BPF_REG_10 && !destination_register_valid_before_instruction) {
-            vm->error_printf(stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
+            vm->jit_data->error_printf(
+                stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
             return false;
         }
         break;
@@ -652,11 +819,12 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
     // writes to the stack.
     case EBPF_CLS_STX:
         if (inst.dst != BPF_REG_10 && !source_register_valid_before_instruction) {
-            vm->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
+            vm->jit_data->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
             return false;
         }
         if (inst.dst != BPF_REG_10 && !destination_register_valid_before_instruction) {
-            vm->error_printf(stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
+            vm->jit_data->error_printf(
+                stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
             return false;
         }
         break;
@@ -692,7 +860,7 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
             // Doesn't change the initialized state of the either register.
             break;
         default:
-            vm->error_printf(stderr, "Error: %d: Unknown ALU opcode %x.\n", pc, inst.opcode);
+            vm->jit_data->error_printf(stderr, "Error: %d: Unknown ALU opcode %x.\n", pc, inst.opcode);
             return false;
         }
         break;
@@ -721,21 +889,23 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
                 break;
             }
             if (!destination_register_valid_before_instruction) {
-                vm->error_printf(stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
+                vm->jit_data->error_printf(
+                    stderr, "Error: %d: Destination register r%d is not initialized.\n", pc, inst.dst);
                 return false;
             }
             if (inst.opcode & EBPF_SRC_REG && !source_register_valid_before_instruction) {
-                vm->error_printf(stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
+                vm->jit_data->error_printf(
+                    stderr, "Error: %d: Source register r%d is not initialized.\n", pc, inst.src);
                 return false;
             }
             break;
         default:
-            vm->error_printf(stderr, "Error: %d: Unknown JMP opcode %x.\n", pc, inst.opcode);
+            vm->jit_data->error_printf(stderr, "Error: %d: Unknown JMP opcode %x.\n", pc, inst.opcode);
             return false;
         }
     break;
     default:
-        vm->error_printf(stderr, "Error: %d: Unknown opcode %x.\n", pc, inst.opcode);
+        vm->jit_data->error_printf(stderr, "Error: %d: Unknown opcode %x.\n", pc, inst.opcode);
         return false;
     }
 
@@ -762,7 +932,7 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
 
     if (inst.opcode == EBPF_OP_EXIT) {
         if (!(*shadow_registers & REGISTER_TO_SHADOW_MASK(0))) {
-            vm->error_printf(stderr, "Error: %d: Return value register r0 is not initialized.\n", pc);
+            vm->jit_data->error_printf(stderr, "Error: %d: Return value register r0 is not initialized.\n", pc);
             return false;
         }
         // Mark r1-r5 as uninitialized.
@@ -823,14 +993,22 @@ ubpf_exec_ex(
         return -1;
     }
 
-    ((struct ubpf_vm*)vm)->execution_started = true;
+    // The accesses that the range verifier proved in bounds are not checked below.
+    const bool* proven_accesses = vm->proven_accesses;
+    if (!ubpf_check_context_size(vm, mem, mem_len, stack_length)) {
+        return -1;
+    }
 
     struct ubpf_stack_frame stack_frames[UBPF_MAX_CALL_DEPTH] = {
         0,
     };
 
-    if (vm->undefined_behavior_check_enabled) {
-        shadow_stack = calloc(stack_length / 8, 1);
+    // Unless a debug function inspects it, the shadow state is only tracked where the undefined
+    // behavior checks were not proven at load time.
+    const bool* shadow_tracked = vm->debug_function == NULL ? vm->shadow_tracked : NULL;
+    bool track_shadow = false;
+    if (vm->undefined_behavior_check_enabled && (shadow_tracked == NULL || vm->shadow_tracking_needed)) {
+        shadow_stack = calloc(stack_length / 8 == 0 ? 1 : stack_length / 8, 1);
         if (!shadow_stack) {
             return_value = -1;
             goto cleanup;
@@ -854,17 +1032,33 @@ ubpf_exec_ex(
     // Mark r1, r2, r10 as initialized.
     shadow_registers |= REGISTER_TO_SHADOW_MASK(1) | REGISTER_TO_SHADOW_MASK(2) | REGISTER_TO_SHADOW_MASK(10);
 
+    // A program whose instruction bound is within the limit does not count instructions.
+    bool count_instructions = ubpf_counts_instructions(vm);
     int instruction_limit = vm->instruction_limit;
 
+    // When branch profiling is enabled, the pc of the conditional jump executed
+    // by the previous iteration (or -1). Whether it was taken is only known once
+    // the next pc is.
+    struct ubpf_branch_profile_entry* branch_profile = vm->branch_profile;
+    int32_t profiled_branch_pc = -1;
+
     while (1) {
         const uint16_t cur_pc = pc;
+        if (profiled_branch_pc >= 0) {
+            if (pc == profiled_branch_pc + 1) {
+                branch_profile[profiled_branch_pc].not_taken++;
+            } else {
+                branch_profile[profiled_branch_pc].taken++;
+            }
+            profiled_branch_pc = -1;
+        }
         if (pc >= vm->num_insts) {
             return_value = -1;
             goto cleanup;
         }
-        if (vm->instruction_limit && instruction_limit-- <= 0) {
+        if (count_instructions && instruction_limit-- <= 0) {
             return_value = -1;
-            vm->error_printf(stderr, "Error: Instruction limit exceeded.\n");
+            vm->jit_data->error_printf(stderr, "Error: Instruction limit exceeded.\n");
             goto cleanup;
         }
 
@@ -873,8 +1067,12 @@ ubpf_exec_ex(
         }
 
         struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc++);
-        if (!ubpf_validate_shadow_register(vm, cur_pc, &shadow_registers, inst)) {
-            vm->error_printf(stderr, "Error: Invalid register state at pc %d.\n", cur_pc);
+        if (branch_profile && ubpf_instruction_is_conditional_jump(inst)) {
+            profiled_branch_pc = cur_pc;
+        }
+        track_shadow = vm->undefined_behavior_check_enabled && (shadow_tracked == NULL || shadow_tracked[cur_pc]);
+        if (track_shadow && !ubpf_validate_shadow_register(vm, cur_pc, &shadow_registers, inst)) {
+            vm->jit_data->error_printf(stderr, "Error: Invalid register state at pc %d.\n", cur_pc);
             return_value = -1;
             goto cleanup;
         }
@@ -1246,16 +1444,16 @@ ubpf_exec_ex(
     _offset = inst.offset;                                                                                \
     if (_offset >= 0) {                                                                                   \
         if (_base_addr > UINT64_MAX - (uint64_t)_offset) {                                               \
-            vm->error_printf(stderr, "uBPF error: address overflow in %s at PC %u\n",                    \
-                             is_load ? "load" : "store", cur_pc);                                        \
+            vm->jit_data->error_printf(stderr, "uBPF error: address overflow in %s at PC %u\n",          \
+                                       is_load ? "load" : "store", cur_pc);                              \
             return_value = -1;                                                                            \
             goto cleanup;                                                                                 \
         }                                                                                                 \
         _eff_addr = _base_addr + (uint64_t)_offset;                                                      \
     } else {                                                                                              \
         if (_base_addr < (uint64_t)(-_offset)) {                                                         \
-            vm->error_printf(stderr, "uBPF error: address underflow in %s at PC %u\n",                   \
-                             is_load ? "load" : "store", cur_pc);                                        \
+            vm->jit_data->error_printf(stderr, "uBPF error: address underflow in %s at PC %u\n",         \
+                                       is_load ? "load" : "store", cur_pc);                              \
             return_value = -1;                                                                            \
             goto cleanup;                                                                                 \
         }                                                                                                 \
@@ -1271,11 +1469,12 @@ ubpf_exec_ex(
     COMPUTE_EFFECTIVE_ADDR(inst.src, true)                                                                \
     do {                                                                                                  \
         _ptr = (void*)_eff_addr;                                                                          \
-        if (!ubpf_check_shadow_stack(                                                                     \
+        if (track_shadow && !ubpf_check_shadow_stack(                                                     \
                 vm, stack_start, stack_length, shadow_stack, _ptr, size)) {                               \
                 shadow_registers &= ~REGISTER_TO_SHADOW_MASK(inst.dst);                                   \
         }                                                                                                 \
-        if (!bounds_check(                                                                                \
+        if ((proven_accesses == NULL || !proven_accesses[cur_pc]) &&                                      \
+            !bounds_check(                                                                                \
                 vm,                                                                                       \
                 _ptr,                                                                                     \
                 size,                                                                                     \
@@ -1294,7 +1493,8 @@ ubpf_exec_ex(
     COMPUTE_EFFECTIVE_ADDR(inst.dst, false)                                                               \
     do {                                                                                                  \
         _ptr = (void*)_eff_addr;                                                                          \
-        if (!bounds_check(                                                                                \
+        if ((proven_accesses == NULL || !proven_accesses[cur_pc]) &&                                      \
+            !bounds_check(                                                                                \
                 vm,                                                                                       \
                 _ptr,                                                                                     \
                 size,                                                                                     \
@@ -1307,7 +1507,9 @@ ubpf_exec_ex(
             return_value = -1;                                                                            \
             goto cleanup;                                                                                 \
         }                                                                                                 \
-        ubpf_mark_shadow_stack(vm, stack_start, stack_length, shadow_stack, _ptr, size);                 \
+        if (track_shadow) {                                                                               \
+            ubpf_mark_shadow_stack(vm, stack_start, stack_length, shadow_stack, _ptr, size);             \
+        }                                                                                                 \
     } while (0)
 
         case EBPF_OP_LDXW: {
@@ -1638,9 +1840,10 @@ ubpf_exec_ex(
             // program was assembled with the same endianess as the host machine.
             if (inst.src == 0) {
                 // Handle call by address to external function.
-                if (vm->dispatcher != NULL) {
+                if (vm->jit_data->dispatcher != NULL) {
                     reg[0] =
-                        vm->dispatcher(reg[1], reg[2], reg[3], reg[4], reg[5], inst.imm, external_dispatcher_cookie);
+                        vm->jit_data->dispatcher(
+                            reg[1], reg[2], reg[3], reg[4], reg[5], inst.imm, external_dispatcher_cookie);
                 } else {
                     reg[0] =
                         vm->ext_funcs[inst.imm](reg[1], reg[2], reg[3], reg[4], reg[5], external_dispatcher_cookie);
@@ -1652,7 +1855,7 @@ ubpf_exec_ex(
                 }
             } else if (inst.src == 1) {
                 if (stack_frame_index >= UBPF_MAX_CALL_DEPTH) {
-                    vm->error_printf(
+                    vm->jit_data->error_printf(
                         stderr,
                         "uBPF error: number of nested functions calls (%u) exceeds max (%u) at PC %u\n",
                         (unsigned)(stack_frame_index + 1),
@@ -1709,7 +1912,7 @@ ubpf_exec_ex(
                 atomic_fetch_index = 0;
                 break;
             default:
-                vm->error_printf(stderr, "Error: unknown atomic opcode %d at PC %d\n", inst.imm, cur_pc);
+                vm->jit_data->error_printf(stderr, "Error: unknown atomic opcode %d at PC %d\n", inst.imm, cur_pc);
                 return_value = -1;
                 goto cleanup;
             }
@@ -1748,7 +1951,7 @@ ubpf_exec_ex(
                 atomic_fetch_index = 0;
                 break;
             default:
-                vm->error_printf(stderr, "Error: unknown atomic opcode %d at PC %d\n", inst.imm, cur_pc);
+                vm->jit_data->error_printf(stderr, "Error: unknown atomic opcode %d at PC %d\n", inst.imm, cur_pc);
                 return_value = -1;
                 goto cleanup;
             }
@@ -1758,7 +1961,7 @@ ubpf_exec_ex(
         } break;
 
         default:
-            vm->error_printf(stderr, "Error: unknown opcode %d at PC %d\n", inst.opcode, cur_pc);
+            vm->jit_data->error_printf(stderr, "Error: unknown opcode %d at PC %d\n", inst.opcode, cur_pc);
             return_value = -1;
             goto cleanup;
         }
@@ -1774,8 +1977,17 @@ cleanup:
     return return_value;
 }
 
-int
-ubpf_exec(const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value)
+/*
+ * Kept out of line so that callers of ubpf_exec that run a program that never
+ * uses the stack do not pay for the stack array.
+ */
+#if defined(_MSC_VER)
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+static int
+ubpf_exec_with_stack(const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value)
 {
 // Windows Kernel mode limits stack usage to 12K, so we need to allocate it dynamically.
 #if defined(NTDDI_VERSION) && defined(WINNT)
@@ -1794,20 +2006,45 @@ ubpf_exec(const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_ret
     return result;
 }
 
+int
+ubpf_exec(const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value)
+{
+    if (vm->stack_requirement == 0 && vm->insts) {
+        return ubpf_exec_ex(vm, mem, mem_len, bpf_return_value, NULL, 0);
+    }
+    return ubpf_exec_with_stack(vm, mem, mem_len, bpf_return_value);
+}
+
 /**
- * @brief Check if the BPF byte code sequence consists of self-contained sub-programs.
- * This means programs that only enter via a call and leave via the EXIT instruction (no jumps out of one program into another).
+ * @brief Check if a validated program (including its local functions) uses the stack.
+ * Every access to the stack, a spill or fill or passing a pointer into the stack to a
+ * helper, starts from r10. A program that never names r10 therefore needs no stack.
  *
  * @param[in] insts Array of instructions
  * @param[in] num_insts Count of instructions
- * @param[out] errmsg Error message
- * @retval true if the program consists of self-contained sub-programs.
- * @return false if the program contains jumps out of one program into another.
+ * @retval true if some instruction reads or writes r10.
+ * @return false if the program can run without a stack.
  */
-static bool check_for_self_contained_sub_programs(const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+static bool
+program_uses_stack(const struct ebpf_inst* insts, uint32_t num_insts)
+{
+    for (uint32_t i = 0; i < num_insts; i++) {
+        if (insts[i].opcode == EBPF_OP_LDDW) {
+            // The src of an LDDW selects the kind of immediate and its second half is all immediate.
+            if (insts[i].dst == BPF_REG_10) {
+                return true;
+            }
+            i++;
+        } else if (insts[i].dst == BPF_REG_10 || insts[i].src == BPF_REG_10) {
+            return true;
+        }
+    }
+    return false;
+}
 
 static bool
-validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+validate(
+    const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, struct ubpf_cfg** cfg, char** errmsg)
 {
     if (num_insts >= UBPF_MAX_INSTS) {
         *errmsg = ubpf_error("too many instructions (max %u)", UBPF_MAX_INSTS);
@@ -2006,8 +2243,7 @@ validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_i
                     *errmsg = ubpf_error("invalid call immediate at PC %d", i);
                     return false;
                 }
-                if ((vm->dispatcher != NULL && !vm->dispatcher_validate(inst.imm, vm)) ||
-                    (vm->dispatcher == NULL && (inst.imm >= MAX_EXT_FUNCS || !vm->ext_funcs[inst.imm]))) {
+                if (!ubpf_helper_is_registered(vm, inst.imm)) {
                     *errmsg = ubpf_error("call to nonexistent function %u at PC %d", inst.imm, i);
                     return false;
                 }
@@ -2119,8 +2355,10 @@ validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_i
         }
     }
 
-    // If the program is syntactically valid, check if it consists of self-contained sub-programs.
-    return check_for_self_contained_sub_programs(insts, num_insts, errmsg);
+    // If the program is syntactically valid, build its control flow graph, which checks that it consists of
+    // self-contained sub-programs.
+    *cfg = ubpf_create_cfg(insts, num_insts, errmsg);
+    return *cfg != NULL;
 }
 
 static bool
@@ -2140,7 +2378,7 @@ bounds_check(
 
     // Check for negative size
     if (size < 0) {
-        vm->error_printf(
+        vm->jit_data->error_printf(
             stderr, "uBPF error: negative size in %s at PC %u, addr %p, size %d\n", type, cur_pc, addr, size);
         return false;
     }
@@ -2149,7 +2387,7 @@ bounds_check(
     
     // Check for overflow in access_start + size
     if ((uintptr_t)size > UINTPTR_MAX - access_start) {
-        vm->error_printf(
+        vm->jit_data->error_printf(
             stderr, "uBPF error: integer overflow in %s at PC %u, addr %p, size %d\n", type, cur_pc, addr, size);
         return false;
     }
@@ -2210,8 +2448,8 @@ bounds_check(
     // The address may be invalid or it may be a region of memory that the caller
     // is aware of but that is not part of the stack or memory.
     // Call any registered bounds check function to determine if the access is valid.
-    if (vm->bounds_check_function != NULL &&
-        vm->bounds_check_function(vm->bounds_check_user_data, access_start, (uint64_t)size)) {
+    if (vm->jit_data->bounds_check_function != NULL &&
+        vm->jit_data->bounds_check_function(vm->jit_data->bounds_check_user_data, access_start, (uint64_t)size)) {
         return true;
     }
 
@@ -2219,14 +2457,14 @@ bounds_check(
     // and report those as potential root causes.
     if (stack_overflow && access_start >= stack_start) {
         // The access would have been in the stack region if not for the overflow
-        vm->error_printf(
+        vm->jit_data->error_printf(
             stderr, "uBPF error: stack region end overflow at PC %u, stack %p, len %zu\n", 
             cur_pc, stack, stack_len);
         return false;
     }
     if (mem_overflow && mem && access_start >= mem_start) {
         // The access would have been in the mem region if not for the overflow
-        vm->error_printf(
+        vm->jit_data->error_printf(
             stderr, "uBPF error: memory region end overflow at PC %u, mem %p, len %zu\n", 
             cur_pc, mem, mem_len);
         return false;
@@ -2235,9 +2473,9 @@ bounds_check(
     // Memory is neither stack, nor memory, nor valid according to the bounds check function.
 
     // Access is out of bounds.
-    vm->error_printf(
+    vm->jit_data->error_printf(
         stderr,
-        "uBPF error: out of bounds memory %s at PC %u, addr %p, size %d\nmem %p/%zd stack %p/%d\n",
+        "uBPF error: out of bounds memory %s at PC %u, addr %p, size %d\nmem %p/%zd stack %p/%zd\n",
         type,
         cur_pc,
         addr,
@@ -2245,7 +2483,7 @@ bounds_check(
         mem,
         mem_len,
         stack,
-        UBPF_EBPF_STACK_SIZE);
+        stack_len);
     return false;
 }
 
@@ -2350,11 +2588,21 @@ ubpf_register_data_relocation(struct ubpf_vm* vm, void* user_context, ubpf_data_
 int
 ubpf_register_data_bounds_check(struct ubpf_vm* vm, void* user_context, ubpf_bounds_check bounds_check)
 {
-    if (vm->bounds_check_function != NULL) {
+    if (vm->jit_data->bounds_check_function != NULL) {
         return -1;
     }
-    vm->bounds_check_function = bounds_check;
-    vm->bounds_check_user_data = user_context;
+    vm->jit_data->bounds_check_function = bounds_check;
+    vm->jit_data->bounds_check_user_data = user_context;
+    return 0;
+}
+
+int
+ubpf_get_instruction_bound(const struct ubpf_vm* vm, uint64_t* bound)
+{
+    if (!vm->insts || vm->instruction_bound == UINT64_MAX) {
+        return -1;
+    }
+    *bound = vm->instruction_bound;
     return 0;
 }
 
@@ -2397,7 +2645,8 @@ ubpf_stack_usage_for_local_func(const struct ubpf_vm* vm, uint16_t pc)
     assert((vm->local_func_stack_usage[pc].stack_usage_calculated != UBPF_STACK_USAGE_UNKNOWN));
 
     uint16_t stack_usage = UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE;
-    if (vm->local_func_stack_usage[pc].stack_usage_calculated == UBPF_STACK_USAGE_CUSTOM) {
+    if (vm->local_func_stack_usage[pc].stack_usage_calculated == UBPF_STACK_USAGE_CUSTOM ||
+        vm->local_func_stack_usage[pc].stack_usage_calculated == UBPF_STACK_USAGE_COMPUTED) {
         stack_usage = vm->local_func_stack_usage[pc].stack_usage;
     }
     return stack_usage;
@@ -2423,153 +2672,3 @@ ubpf_register_debug_fn(struct ubpf_vm* vm, void* context, ubpf_debug_fn debug_fu
     return 0;
 }
 
-/**
- * @brief Compare function for sorting an array of uint32_t.
- *
- * @param[in] a Pointer to the first element.
- * @param[in] b Pointer to the second element.
- * @return Comparison result.
- */
-static int compare_uint32_t(const void* a, const void* b)
-{
-    uint32_t value_a = *(uint32_t*)a;
-    uint32_t value_b = *(uint32_t*)b;
-    if (value_a < value_b) {
-        return -1;
-    } else if (value_a > value_b) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
-
-/**
- * @brief Given an array of uint32_t, remove duplicates and update the count.
- *
- * @param[in,out] array Array of uint32_t.
- * @param[in,out] count On input, the number of elements in the array. On output, the number of unique elements.
- */
-static void deduplicate_array_of_uint32(uint32_t* array, uint32_t* count)
-{
-    uint32_t write_index = 0;
-
-    qsort(array, *count, sizeof(uint32_t), compare_uint32_t);
-
-    for (uint32_t read_index = 1; read_index < *count; read_index++) {
-        if (array[read_index] != array[write_index]) {
-            array[++write_index] = array[read_index];
-        }
-    }
-    *count = write_index + 1;
-}
-
-static bool check_for_self_contained_sub_programs(const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
-{
-    uint32_t local_call_count = 0;
-    uint32_t sub_program_count = 0;
-    uint32_t * sub_program_start_indices = NULL;
-    bool result = false;
-
-    // Count the number of calls to local functions as a proxy for the number of sub-programs.
-    // Call targets are assumed to define the start of a sub-program and sub-programs are assumed to end at the next call target or at the end of the program.
-    for (uint32_t i = 0; i < num_insts; i++) {
-        if (insts[i].opcode == EBPF_OP_CALL && insts[i].src == 1) {
-            local_call_count++;
-        }
-    }
-
-    // If there are no calls to local functions, then the program is self-contained.
-    if (local_call_count == 0) {
-        result = true;
-        goto exit;
-    }
-
-    sub_program_count = local_call_count + 1;
-
-    // Allocate memory for the sub-program start indices.
-    sub_program_start_indices = calloc(sub_program_count, sizeof(uint32_t));
-    if (sub_program_start_indices == NULL) {
-        *errmsg = ubpf_error("failed to allocate memory for sub-program start indices");
-        goto exit;
-    }
-
-    int sub_program_index = 0;
-    for (uint32_t i = 0; i < num_insts; i++) {
-        if (insts[i].opcode == EBPF_OP_CALL && insts[i].src == 1) {
-            // Compute jump target:
-            uint32_t jump_target = i + 1 + insts[i].imm;
-            sub_program_start_indices[sub_program_index++] = jump_target;
-        }
-    }
-
-    // At this point the sub_program_start_indices array contains the start indices of the sub-programs, but there may be duplicates and the array may not be sorted.
-
-    deduplicate_array_of_uint32(sub_program_start_indices, &sub_program_count);
-
-
-    // Now that we have the sub-program start indices, we can check if the program is self-contained.
-    // For each sub-program, check for jumps that go outside of the sub-program.
-
-    for (uint32_t i = 0; i < sub_program_count; i++) {
-        uint32_t start_index = sub_program_start_indices[i]; ///< First instruction of the sub-program.
-        uint32_t end_index = (i == sub_program_count - 1) ? num_insts : sub_program_start_indices[i + 1]; ///< First instruction after the sub-program.
-
-        for (uint32_t j = start_index; j < end_index; j++) {
-            switch (insts[j].opcode & EBPF_CLS_MASK) {
-            // Only jumps with a target in the range [start_index, end_index) are allowed.
-            case EBPF_CLS_JMP:
-            case EBPF_CLS_JMP32:
-                switch (insts[j].opcode) {
-                case EBPF_OP_CALL:
-                    // Calls to local functions are assumed to be within the same sub-program.
-                    break;
-                case EBPF_OP_EXIT:
-                    // The EXIT instruction is assumed to be the end of the sub-program.
-                    break;
-                default: {
-                    // Compute jump target and bounds:
-                    // Use int64_t to handle negative jumps and avoid signed overflow
-                    int64_t jump_target_64;
-                    if (insts[j].opcode == EBPF_OP_JA32) {
-                        jump_target_64 = (int64_t)j + 1 + (int64_t)insts[j].imm;
-                    } else {
-                        jump_target_64 = (int64_t)j + 1 + (int64_t)insts[j].offset;
-                    }
-                    uint32_t jump_target_lower_bound = start_index;
-                    uint32_t jump_target_upper_bound = end_index - 1;
-
-                    // All other jumps must to be within the same sub-program.
-                    if (jump_target_64 < jump_target_lower_bound || jump_target_64 > jump_target_upper_bound) {
-                        *errmsg = ubpf_error("jump out of bounds at PC %d", j);
-                        goto exit;
-                    }
-                } break;
-                };
-                break;
-            default:
-                break;
-            }
-        }
-        // Last instruction of the sub-program must be EXIT or a jump to the current program.
-        bool ends_with_exit = insts[end_index - 1].opcode == EBPF_OP_EXIT;
-        bool ends_with_jump = false;
-
-        // Only check for a preceding jump if the sub-program has at least two instructions.
-        if (end_index >= start_index + 2) {
-            ends_with_jump = insts[end_index - 2].opcode == EBPF_OP_JA ||
-                             insts[end_index - 2].opcode == EBPF_OP_JA32;
-        }
-
-        if (!(ends_with_exit || ends_with_jump)) {
-            *errmsg = ubpf_error("sub-program does not end with EXIT or unconditional jump at PC %d", end_index - 1);
-            goto exit;
-        }
-    }
-
-    // If we reached here, the program is self-contained.
-    result = true;
-
-exit:
-    free(sub_program_start_indices);
-    return result;
-}